@@ -0,0 +1,153 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include "config.h"
+#include <assert.h>
+#include <stdlib.h>
+
+#include <openssl/crypto.h>
+
+#include "arena.h"
+#include "log.h"
+#include "utils.h"
+
+/*
+ * Every allocation handed out is prefixed with a header recording the
+ * arena it came from, or NULL if it came from the heap, and how much of
+ * the arena it took. This lets arena_release() do the right thing without
+ * the caller needing to track where memory came from, the same trick
+ * typed_memory.c plays with its trailing type byte.
+ */
+typedef union arena_hdr arena_hdr;
+union arena_hdr {
+    struct {
+        arena *owner;
+        /* bytes taken from the arena, header included */
+        size_t size;
+    } info;
+    /* keep payloads aligned for any type */
+    long double ld;
+    long long ll;
+    void *p;
+};
+
+struct arena {
+    size_t size;
+    size_t offset;
+    size_t live;
+    arena_hdr data[];
+};
+
+#define ARENA_ALIGN (sizeof(arena_hdr))
+
+arena *arena_new(size_t size) {
+
+    /* round the chunk to a whole number of headers */
+    size_t blocks = (size + ARENA_ALIGN - 1) / ARENA_ALIGN;
+
+    size_t bytes = 0;
+    safe_mul(bytes, blocks, ARENA_ALIGN);
+    safe_adde(bytes, sizeof(arena));
+
+    arena *a = calloc(1, bytes);
+    if (!a) {
+        LOGE("oom");
+        return NULL;
+    }
+
+    a->size = blocks * ARENA_ALIGN;
+
+    return a;
+}
+
+static void arena_rewind(arena *a) {
+
+    if (a->offset) {
+        OPENSSL_cleanse(a->data, a->offset);
+    }
+
+    a->offset = 0;
+}
+
+void arena_free(arena *a) {
+
+    if (!a) {
+        return;
+    }
+
+    if (a->live) {
+        LOGW("Freeing arena with %zu live allocations", a->live);
+    }
+
+    arena_rewind(a);
+    free(a);
+}
+
+void *arena_calloc(arena *a, size_t nmemb, size_t size) {
+
+    size_t bytes = 0;
+    safe_mul(bytes, nmemb, size);
+
+    /* round up so the next header stays aligned */
+    size_t total = bytes;
+    safe_adde(total, ARENA_ALIGN - 1);
+    total -= total % ARENA_ALIGN;
+    safe_adde(total, sizeof(arena_hdr));
+
+    arena_hdr *hdr = NULL;
+    if (a && a->size - a->offset >= total) {
+        hdr = (arena_hdr *)((unsigned char *)a->data + a->offset);
+        hdr->info.owner = a;
+        hdr->info.size = total;
+        a->offset += total;
+        a->live++;
+    } else {
+        hdr = calloc(1, total);
+        if (!hdr) {
+            return NULL;
+        }
+        hdr->info.owner = NULL;
+    }
+
+    return &hdr[1];
+}
+
+void arena_release(void *ptr) {
+
+    if (!ptr) {
+        return;
+    }
+
+    arena_hdr *hdr = &((arena_hdr *)ptr)[-1];
+    arena *a = hdr->info.owner;
+    if (!a) {
+        free(hdr);
+        return;
+    }
+
+    assert(a->live);
+    a->live--;
+
+    /*
+     * Operations release everything they allocated when they complete,
+     * so once nothing is live the whole arena can be reused.
+     */
+    if (!a->live) {
+        arena_rewind(a);
+        return;
+    }
+
+    /*
+     * The last allocation is given back straight away, so state that is
+     * freed and allocated again within an operation reuses its space
+     * rather than creeping through the arena.
+     */
+    size_t size = hdr->info.size;
+    unsigned char *end = (unsigned char *)hdr + size;
+    if (end == (unsigned char *)a->data + a->offset) {
+        OPENSSL_cleanse(hdr, size);
+        a->offset -= size;
+    }
+}
+
+size_t arena_used(arena *a) {
+    return a->offset;
+}
@@ -0,0 +1,70 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef SRC_LIB_ARENA_H_
+#define SRC_LIB_ARENA_H_
+
+#include <stddef.h>
+
+/*
+ * The default backing size of a session arena. This comfortably holds the
+ * opdata structures of a sign or encrypt operation, anything beyond it
+ * is served from the heap.
+ */
+#define ARENA_DEFAULT_SIZE 4096
+
+typedef struct arena arena;
+
+/**
+ * Creates a new bump allocator backed by a single chunk of memory.
+ * @param size
+ *  The size in bytes of the backing chunk.
+ * @return
+ *  The new arena or NULL on error. Free with arena_free().
+ */
+arena *arena_new(size_t size);
+
+/**
+ * Cleanses and frees an arena. It is safe to pass NULL. Any allocation
+ * still live in the arena is invalid after this call.
+ * @param a
+ *  The arena to free.
+ */
+void arena_free(arena *a);
+
+/**
+ * Allocates zeroed memory from an arena. When the arena is exhausted, or
+ * a is NULL, the memory is allocated from the heap instead. Either way,
+ * the memory must be released with arena_release().
+ * @param a
+ *  The arena to allocate from, may be NULL.
+ * @param nmemb
+ *  The number of members.
+ * @param size
+ *  The size of each member.
+ * @return
+ *  Zeroed memory or NULL on error.
+ */
+void *arena_calloc(arena *a, size_t nmemb, size_t size);
+
+/**
+ * Releases memory returned from arena_calloc(). Heap backed memory is
+ * freed immediately. Arena backed memory is reclaimed right away if it
+ * was the most recent allocation, else when the last allocation in the
+ * arena is released. Reclaimed memory is cleansed so nothing from a
+ * previous operation survives into the next. It is safe to pass NULL.
+ * @param ptr
+ *  The memory to release.
+ */
+void arena_release(void *ptr);
+
+/**
+ * Returns the number of bytes in use within the arena, including the
+ * per allocation headers. Mainly useful for testing.
+ * @param a
+ *  The arena to query.
+ * @return
+ *  The number of bytes used.
+ */
+size_t arena_used(arena *a);
+
+#endif /* SRC_LIB_ARENA_H_ */
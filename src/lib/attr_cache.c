@@ -0,0 +1,124 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include "config.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "attr_cache.h"
+#include "log.h"
+#include "utils.h"
+
+typedef struct attr_cache_entry attr_cache_entry;
+struct attr_cache_entry {
+    unsigned id;
+    CK_ATTRIBUTE_TYPE type;
+    twist value;
+    uint64_t last_used;
+};
+
+/*
+ * The capacity is small, so a flat array scanned linearly beats a hash
+ * table plus list for both memory and speed.
+ */
+struct attr_cache {
+    size_t capacity;
+    uint64_t clock;
+    attr_cache_entry entries[];
+};
+
+attr_cache *attr_cache_new(size_t capacity) {
+
+    assert(capacity);
+
+    size_t bytes = 0;
+    safe_mul(bytes, capacity, sizeof(attr_cache_entry));
+    safe_adde(bytes, sizeof(attr_cache));
+
+    attr_cache *c = calloc(1, bytes);
+    if (!c) {
+        LOGE("oom");
+        return NULL;
+    }
+
+    c->capacity = capacity;
+
+    return c;
+}
+
+static void entry_clear(attr_cache_entry *e) {
+    twist_free(e->value);
+    memset(e, 0, sizeof(*e));
+}
+
+void attr_cache_free(attr_cache *c) {
+
+    if (!c) {
+        return;
+    }
+
+    size_t i;
+    for (i=0; i < c->capacity; i++) {
+        entry_clear(&c->entries[i]);
+    }
+
+    free(c);
+}
+
+twist attr_cache_get(attr_cache *c, unsigned id, CK_ATTRIBUTE_TYPE type) {
+    assert(c);
+
+    size_t i;
+    for (i=0; i < c->capacity; i++) {
+        attr_cache_entry *e = &c->entries[i];
+        if (e->value && e->id == id && e->type == type) {
+            e->last_used = ++c->clock;
+            return e->value;
+        }
+    }
+
+    return NULL;
+}
+
+void attr_cache_put(attr_cache *c, unsigned id, CK_ATTRIBUTE_TYPE type, twist value) {
+    assert(c);
+    assert(value);
+
+    /* prefer a free slot, else the least recently used one */
+    attr_cache_entry *victim = &c->entries[0];
+
+    size_t i;
+    for (i=0; i < c->capacity; i++) {
+        attr_cache_entry *e = &c->entries[i];
+        if (!e->value || (e->id == id && e->type == type)) {
+            victim = e;
+            break;
+        }
+
+        if (e->last_used < victim->last_used) {
+            victim = e;
+        }
+    }
+
+    entry_clear(victim);
+
+    victim->id = id;
+    victim->type = type;
+    victim->value = value;
+    victim->last_used = ++c->clock;
+}
+
+void attr_cache_invalidate(attr_cache *c, unsigned id) {
+
+    if (!c) {
+        return;
+    }
+
+    size_t i;
+    for (i=0; i < c->capacity; i++) {
+        attr_cache_entry *e = &c->entries[i];
+        if (e->value && e->id == id) {
+            entry_clear(e);
+        }
+    }
+}
@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef SRC_LIB_ATTR_CACHE_H_
+#define SRC_LIB_ATTR_CACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "pkcs11.h"
+#include "twist.h"
+
+/*
+ * The number of attribute values kept resident after being fetched
+ * from the store. Large trust stores read a handful of certificates
+ * at a time, so this only needs to cover the working set.
+ */
+#define ATTR_CACHE_DEFAULT_SIZE 32
+
+typedef struct attr_cache attr_cache;
+
+/**
+ * Creates a bounded least recently used cache of attribute values keyed
+ * by object id and attribute type.
+ * @param capacity
+ *  The maximum number of values held.
+ * @return
+ *  The new cache or NULL on error. Free with attr_cache_free().
+ */
+attr_cache *attr_cache_new(size_t capacity);
+
+/**
+ * Frees the cache and all of the values it holds. It is safe to pass NULL.
+ * @param c
+ *  The cache to free.
+ */
+void attr_cache_free(attr_cache *c);
+
+/**
+ * Looks up a value and marks it as most recently used.
+ * @param c
+ *  The cache to search.
+ * @param id
+ *  The object id.
+ * @param type
+ *  The attribute type.
+ * @return
+ *  The cached value, owned by the cache and only valid until the next
+ *  call that modifies it, or NULL if not present.
+ */
+twist attr_cache_get(attr_cache *c, unsigned id, CK_ATTRIBUTE_TYPE type);
+
+/**
+ * Adds a value to the cache, evicting the least recently used entry
+ * when full.
+ * @param c
+ *  The cache to add to.
+ * @param id
+ *  The object id.
+ * @param type
+ *  The attribute type.
+ * @param value
+ *  The value, the cache takes ownership of it.
+ */
+void attr_cache_put(attr_cache *c, unsigned id, CK_ATTRIBUTE_TYPE type, twist value);
+
+/**
+ * Drops every value belonging to an object, for use when the object
+ * is modified or removed.
+ * @param c
+ *  The cache to modify, may be NULL.
+ * @param id
+ *  The object id.
+ */
+void attr_cache_invalidate(attr_cache *c, unsigned id);
+
+#endif /* SRC_LIB_ATTR_CACHE_H_ */
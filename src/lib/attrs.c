@@ -1,6 +1,7 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 #include "config.h"
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include <openssl/crypto.h>
@@ -8,6 +9,7 @@
 #include "attrs.h"
 #include "log.h"
 #include "pkcs11.h"
+#include "twist.h"
 #include "typed_memory.h"
 #include "utils.h"
 
@@ -15,6 +17,16 @@ struct attr_list {
     CK_ULONG max;
     CK_ULONG count;
     CK_ATTRIBUTE_PTR attrs;
+    /*
+     * Values inside [block, block + block_len) aren't allocated on their
+     * own, they are never freed or resized in place, so entries and twist
+     * views of them stay put while the list changes. The list owns the
+     * block when attr_list_compact() packed it, a mapped list only borrows
+     * it, see attr_list_new_mapped().
+     */
+    CK_BYTE_PTR block;
+    size_t block_len;
+    bool owns_block;
 };
 
 #define ADD_ATTR_HANDLER(t, m) { .type = t, .name = #t, .memtype = m }
@@ -28,6 +40,74 @@ struct attr_handler2 {
 
 #define ALLOC_LEN 16
 
+/* values in a block are aligned so CK_ULONG reads stay legal */
+#define PACK_ALIGN(x) (((x) + sizeof(CK_ULONG) - 1) & ~(sizeof(CK_ULONG) - 1))
+
+static bool attr_in_block(attr_list *l, CK_ATTRIBUTE_PTR a) {
+
+    uintptr_t v = (uintptr_t)a->pValue;
+    uintptr_t b = (uintptr_t)l->block;
+
+    return v && v >= b && v - b < l->block_len;
+}
+
+/*
+ * Gives every value in the block an allocation of its own and drops the
+ * block, needed before the entries are handed to another list. The entries
+ * stay where they are, only their pValue changes. A no-op without a block.
+ */
+static bool attr_list_unpack(attr_list *l) {
+
+    if (!l->block) {
+        return true;
+    }
+
+    /* copy every value before touching the list, so oom leaves it intact */
+    CK_VOID_PTR *values = calloc(l->count ? l->count : 1, sizeof(*values));
+    if (!values) {
+        LOGE("oom");
+        return false;
+    }
+
+    CK_ULONG i;
+    for (i=0; i < l->count; i++) {
+        CK_ATTRIBUTE_PTR a = &l->attrs[i];
+        if (attr_in_block(l, a)) {
+            CK_RV rv = type_mem_dup(a->pValue, a->ulValueLen, &values[i]);
+            if (rv != CKR_OK) {
+                LOGE("oom");
+                while (i--) {
+                    if (values[i]) {
+                        OPENSSL_cleanse(values[i], l->attrs[i].ulValueLen);
+                        free(values[i]);
+                    }
+                }
+                free(values);
+                return false;
+            }
+        }
+    }
+
+    for (i=0; i < l->count; i++) {
+        if (values[i]) {
+            l->attrs[i].pValue = values[i];
+        }
+    }
+
+    free(values);
+
+    if (l->owns_block) {
+        OPENSSL_cleanse(l->block, l->block_len);
+        free(l->block);
+    }
+
+    l->block = NULL;
+    l->block_len = 0;
+    l->owns_block = false;
+
+    return true;
+}
+
 static bool _attr_list_add(attr_list *l,
         CK_ATTRIBUTE_TYPE type, CK_ULONG len, CK_BYTE_PTR buf,
         int memtype) {
@@ -198,6 +278,41 @@ attr_list *attr_list_new(void) {
     return calloc(1, sizeof(attr_list));
 }
 
+attr_list *attr_list_new_mapped(CK_ATTRIBUTE_PTR attrs, CK_ULONG count) {
+    assert(attrs || !count);
+
+    attr_list *l = attr_list_new();
+    if (!l) {
+        LOGE("oom");
+        return NULL;
+    }
+
+    l->attrs = attrs;
+    l->count = l->max = count;
+
+    /* the values lie together in the mapping, borrow the span they cover */
+    uintptr_t lo = UINTPTR_MAX;
+    uintptr_t hi = 0;
+
+    CK_ULONG i;
+    for (i=0; i < count; i++) {
+        CK_ATTRIBUTE_PTR a = &attrs[i];
+        if (a->pValue && a->ulValueLen) {
+            uintptr_t v = (uintptr_t)a->pValue;
+            lo = v < lo ? v : lo;
+            /* the type byte after the value is part of it */
+            hi = v + a->ulValueLen + 1 > hi ? v + a->ulValueLen + 1 : hi;
+        }
+    }
+
+    if (hi) {
+        l->block = (CK_BYTE_PTR)lo;
+        l->block_len = hi - lo;
+    }
+
+    return l;
+}
+
 bool attr_list_add_int(attr_list *l, CK_ATTRIBUTE_TYPE type, CK_ULONG value) {
 
     return _attr_list_add(l, type, sizeof(value), (CK_BYTE_PTR)&value, TYPE_BYTE_INT);
@@ -218,6 +333,39 @@ bool attr_list_add_buf(attr_list *l, CK_ATTRIBUTE_TYPE type, CK_BYTE_PTR value,
     return _attr_list_add(l, type, len, value, TYPE_BYTE_HEX_STR);
 }
 
+bool attr_list_add_lazy(attr_list *l, CK_ATTRIBUTE_TYPE type, CK_ULONG len) {
+
+    bool r = _attr_list_add(l, type, 0, NULL, TYPE_BYTE_HEX_STR);
+    if (r) {
+        /* a length without a value marks it as living in the store */
+        l->attrs[l->count - 1].ulValueLen = len;
+    }
+
+    return r;
+}
+
+bool attr_is_lazy(CK_ATTRIBUTE_PTR a) {
+    assert(a);
+    return !a->pValue && a->ulValueLen;
+}
+
+bool attr_is_lazy_candidate(CK_ATTRIBUTE_TYPE type, CK_ULONG len) {
+
+    if (len < ATTR_LAZY_MIN) {
+        return false;
+    }
+
+    switch (type) {
+    case CKA_VALUE:
+    case CKA_SUBJECT:
+    case CKA_ISSUER:
+    case CKA_SERIAL_NUMBER:
+        return true;
+    default:
+        return false;
+    }
+}
+
 CK_ULONG attr_list_get_count(attr_list *l) {
     assert(l);
     return l->count;
@@ -238,6 +386,25 @@ void attr_pfree_cleanse(CK_ATTRIBUTE_PTR attr) {
     }
 }
 
+void attr_list_cleanse_entry(attr_list *l, CK_ATTRIBUTE_PTR attr) {
+    assert(l);
+
+    if (!attr || !attr_in_block(l, attr)) {
+        attr_pfree_cleanse(attr);
+        return;
+    }
+
+    /*
+     * the value is part of the block, scrub it in place, a mapped one
+     * can't be written and is only dropped
+     */
+    if (l->owns_block) {
+        OPENSSL_cleanse(attr->pValue, attr->ulValueLen);
+    }
+    attr->pValue = NULL;
+    attr->ulValueLen = 0;
+}
+
 void attr_list_free(attr_list *attrs) {
 
     if (!attrs) {
@@ -246,14 +413,137 @@ void attr_list_free(attr_list *attrs) {
 
     CK_ULONG i;
     for (i=0; i < attrs->count; i++) {
-        const CK_ATTRIBUTE_PTR a = &attrs->attrs[i];
-        attr_pfree_cleanse(a);
+        CK_ATTRIBUTE_PTR a = &attrs->attrs[i];
+        if (!attr_in_block(attrs, a)) {
+            attr_pfree_cleanse(a);
+        }
+    }
+
+    if (attrs->owns_block) {
+        OPENSSL_cleanse(attrs->block, attrs->block_len);
+        free(attrs->block);
     }
 
     free(attrs->attrs);
     free(attrs);
 }
 
+/* values that are handed out as twists, see attr_list_get_twist() */
+static const CK_ATTRIBUTE_TYPE _twist_views[] = {
+    CKA_TPM2_OBJAUTH_ENC,
+    CKA_TPM2_PUB_BLOB,
+    CKA_TPM2_PRIV_BLOB,
+};
+
+static bool attr_has_twist_view(CK_ATTRIBUTE_TYPE type) {
+
+    size_t i;
+    for (i=0; i < ARRAY_LEN(_twist_views); i++) {
+        if (_twist_views[i] == type) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool attr_list_compact(attr_list *l) {
+    assert(l);
+
+    /* a mapped list already shares its values */
+    if (l->block && !l->owns_block) {
+        return true;
+    }
+
+    /* each value with its trailing type byte, views with a twist header */
+    size_t bytes = 0;
+    bool moved = false;
+
+    CK_ULONG i;
+    for (i=0; i < l->count; i++) {
+        CK_ATTRIBUTE_PTR a = &l->attrs[i];
+        if (a->pValue && a->ulValueLen) {
+            moved |= !attr_in_block(l, a);
+            if (attr_has_twist_view(a->type)) {
+                safe_adde(bytes, TWIST_VIEW_HDR_LEN);
+            }
+            safe_adde(bytes, a->ulValueLen);
+            safe_adde(bytes, 1);
+            bytes = PACK_ALIGN(bytes);
+        }
+    }
+
+    /* nothing changed since the last compact */
+    if (!moved) {
+        return true;
+    }
+
+    CK_BYTE_PTR block = calloc(1, bytes);
+    if (!block) {
+        LOGE("oom");
+        return false;
+    }
+
+    /* only the values move */
+    size_t offset = 0;
+    for (i=0; i < l->count; i++) {
+        CK_ATTRIBUTE_PTR a = &l->attrs[i];
+        if (!a->pValue || !a->ulValueLen) {
+            continue;
+        }
+
+        CK_BYTE_PTR dest = &block[offset];
+        if (attr_has_twist_view(a->type)) {
+            dest = (CK_BYTE_PTR)twist_view_init(dest, a->ulValueLen);
+        }
+
+        type_mem_cpy(dest, a->pValue, a->ulValueLen);
+        offset = PACK_ALIGN((size_t)(dest - block) + a->ulValueLen + 1);
+
+        CK_ULONG len = a->ulValueLen;
+        if (!attr_in_block(l, a)) {
+            attr_pfree_cleanse(a);
+        }
+        a->pValue = dest;
+        a->ulValueLen = len;
+    }
+
+    assert(offset == bytes);
+
+    if (l->owns_block) {
+        OPENSSL_cleanse(l->block, l->block_len);
+        free(l->block);
+    } else if (l->count < l->max) {
+        /* first time round, drop the spare entries, it's fine if it can't */
+        CK_ATTRIBUTE_PTR attrs = realloc(l->attrs, l->count * sizeof(*attrs));
+        if (attrs) {
+            l->attrs = attrs;
+            l->max = l->count;
+        }
+    }
+
+    l->block = block;
+    l->block_len = bytes;
+    l->owns_block = true;
+
+    return true;
+}
+
+twist attr_list_get_twist(attr_list *l, CK_ATTRIBUTE_TYPE type) {
+    assert(l);
+
+    if (!l->owns_block || !attr_has_twist_view(type)) {
+        return NULL;
+    }
+
+    CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(l, type);
+    if (!a || !attr_in_block(l, a)) {
+        return NULL;
+    }
+
+    return (twist)a->pValue;
+}
+
 CK_RV attr_list_raw_invoke_handlers(const CK_ATTRIBUTE_PTR attrs, CK_ULONG count,
         const attr_handler *handlers, size_t len, void *udata) {
 
@@ -343,12 +633,12 @@ CK_RV attr_list_dup(attr_list *old, attr_list **new) {
         CK_ATTRIBUTE_PTR n = &tmp->attrs[i];
 
         n->type = o->type;
+        n->ulValueLen = o->ulValueLen;
         if (o->pValue && o->ulValueLen) {
             rv = type_mem_dup(o->pValue, o->ulValueLen, &n->pValue);
             if (rv != CKR_OK) {
                 goto error;
             }
-            n->ulValueLen = o->ulValueLen;
         }
 
         tmp->count++;
@@ -363,6 +653,80 @@ error:
     return rv;
 }
 
+static bool attr_is_same(CK_ATTRIBUTE_PTR o, CK_ATTRIBUTE_PTR n) {
+
+    if (!o || o->ulValueLen != n->ulValueLen) {
+        return false;
+    }
+
+    /* a value left in the store can only change by being set */
+    if (attr_is_lazy(o) || attr_is_lazy(n)) {
+        return attr_is_lazy(o) && attr_is_lazy(n);
+    }
+
+    return !n->ulValueLen || !memcmp(o->pValue, n->pValue, n->ulValueLen);
+}
+
+CK_RV attr_list_diff(attr_list *old, attr_list *new, attr_list **changed) {
+    assert(old);
+    assert(new);
+    assert(changed);
+
+    attr_list *d = attr_list_new();
+    if (!d) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    CK_ULONG i;
+    for (i=0; i < new->count; i++) {
+        CK_ATTRIBUTE_PTR n = &new->attrs[i];
+        CK_ATTRIBUTE_PTR o = attr_get_attribute_by_type(old, n->type);
+        if (attr_is_same(o, n)) {
+            continue;
+        }
+
+        if (attr_is_lazy(n)) {
+            LOGE("Attribute 0x%lx changed but its value is not resident", n->type);
+            attr_list_free(d);
+            return CKR_GENERAL_ERROR;
+        }
+
+        bool res = n->ulValueLen ?
+                _attr_list_add(d, n->type, n->ulValueLen, n->pValue,
+                        type_from_ptr(n->pValue, n->ulValueLen)) :
+                attr_list_add_buf(d, n->type, NULL, 0);
+        if (!res) {
+            attr_list_free(d);
+            return CKR_GENERAL_ERROR;
+        }
+    }
+
+    *changed = d;
+
+    return CKR_OK;
+}
+
+CK_RV attr_list_merge(attr_list **attrs, attr_list *changes) {
+    assert(attrs);
+    assert(*attrs);
+    assert(changes);
+
+    CK_ULONG i;
+    for (i=0; i < changes->count; i++) {
+        CK_ATTRIBUTE_PTR c = &changes->attrs[i];
+
+        CK_ATTRIBUTE_PTR found = attr_get_attribute_by_type(*attrs, c->type);
+        CK_RV rv = found ? attr_list_update_entry(*attrs, c) :
+            attr_list_append_entry(attrs, c);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+    }
+
+    return CKR_OK;
+}
+
 CK_ATTRIBUTE_PTR attr_get_attribute_by_type_raw(CK_ATTRIBUTE_PTR haystack, CK_ULONG haystack_count,
         CK_ATTRIBUTE_TYPE needle) {
 
@@ -399,6 +763,11 @@ attr_list *attr_list_append_attrs(
         return *new_attrs;
     }
 
+    /* the entries move to old_attrs, so their values must too */
+    if (!attr_list_unpack(*new_attrs)) {
+        return NULL;
+    }
+
     /* todo safe addition */
     CK_ULONG old_len = attr_list_get_count(old_attrs);
     CK_ULONG new_len = attr_list_get_count(*new_attrs);
@@ -1283,7 +1652,27 @@ CK_RV attr_list_update_entry(attr_list *attrs, CK_ATTRIBUTE_PTR untrusted_attr)
     void *pValue = untrusted_attr->pValue;
     CK_ULONG ulValueLen = untrusted_attr->ulValueLen;
 
-    if (ulValueLen != found->ulValueLen) {
+    /*
+     * a value in the block is never resized, it gets storage of its own,
+     * filled before the old value is dropped so oom leaves the entry intact
+     */
+    if (attr_in_block(attrs, found)) {
+        void *new_pValue = type_calloc(1, ulValueLen, handler->memtype);
+        if (!new_pValue) {
+            LOGE("oom");
+            return CKR_HOST_MEMORY;
+        }
+
+        memcpy(new_pValue, pValue, ulValueLen);
+
+        attr_list_cleanse_entry(attrs, found);
+        found->ulValueLen = ulValueLen;
+        found->pValue = new_pValue;
+
+        return CKR_OK;
+    }
+
+    if (ulValueLen != found->ulValueLen || !found->pValue) {
         void *new_pValue = type_zrealloc(found->pValue, ulValueLen, handler->memtype);
         if (!new_pValue) {
             LOGE("oom");
@@ -6,6 +6,7 @@
 #include <stdlib.h>
 
 #include "pkcs11.h"
+#include "twist.h"
 
 /*
  * We will allow these to be accessed, but the values are not stable
@@ -46,6 +47,21 @@ struct attr_handler {
  */
 attr_list *attr_list_new(void);
 
+/**
+ * Creates an attribute list over values it doesn't own, like those of a
+ * mapped snapshot, which must outlive the list and are never written. A
+ * value that is changed gets storage of its own, as for lists compacted
+ * with attr_list_compact(). They have no twist views.
+ * @param attrs
+ *  The attributes, allocated with calloc(), owned by the list on success.
+ *  Each value is followed by its typed memory type byte.
+ * @param count
+ *  The number of attributes.
+ * @return
+ *  attribute list or NULL on error.
+ */
+attr_list *attr_list_new_mapped(CK_ATTRIBUTE_PTR attrs, CK_ULONG count);
+
 /**
  * Duplicates an attribute list.
  * @param old
@@ -57,6 +73,33 @@ attr_list *attr_list_new(void);
  */
 CK_RV attr_list_dup(attr_list *old, attr_list **new);
 
+/**
+ * Collects the attributes of a list that differ from an older version of
+ * it, ie that were added or whose value changed. Values left in the store
+ * in both lists are considered unchanged.
+ * @param old
+ *  The attribute list before the change.
+ * @param new
+ *  The attribute list after the change.
+ * @param changed
+ *  A list with a copy of each changed attribute, may be empty.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV attr_list_diff(attr_list *old, attr_list *new, attr_list **changed);
+
+/**
+ * Applies changes collected with attr_list_diff() to a list, updating the
+ * attributes it has and appending the others.
+ * @param attrs
+ *  The attribute list to update, may be reallocated.
+ * @param changes
+ *  The attributes to apply.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV attr_list_merge(attr_list **attrs, attr_list *changes);
+
 /**
  * Adds a buffer to the attribute list and adds type data.
  * @param l
@@ -72,6 +115,48 @@ CK_RV attr_list_dup(attr_list *old, attr_list **new);
  */
 bool attr_list_add_buf(attr_list *l, CK_ATTRIBUTE_TYPE type, CK_BYTE_PTR value, CK_ULONG len);
 
+/*
+ * Values at least this large, of the types accepted by
+ * attr_is_lazy_candidate(), may be left in the store and only
+ * fetched when read.
+ */
+#define ATTR_LAZY_MIN 256
+
+/**
+ * Adds an attribute whose value is not resident, ie it is left in the
+ * store. The entry has a NULL pValue and a ulValueLen of len.
+ * @param l
+ *  The list to add to.
+ * @param type
+ *  The attribute type to add.
+ * @param len
+ *  The length of the value in the store.
+ * @return
+ *  true on success, false otherwise.
+ */
+bool attr_list_add_lazy(attr_list *l, CK_ATTRIBUTE_TYPE type, CK_ULONG len);
+
+/**
+ * Checks if an attribute was added with attr_list_add_lazy() and its
+ * value must be fetched from the store.
+ * @param a
+ *  The attribute to check.
+ * @return
+ *  true if the value is not resident.
+ */
+bool attr_is_lazy(CK_ATTRIBUTE_PTR a);
+
+/**
+ * Determines whether an attribute value may be left in the store.
+ * @param type
+ *  The attribute type.
+ * @param len
+ *  The length of the value.
+ * @return
+ *  true if the value is large and of a rarely read type.
+ */
+bool attr_is_lazy_candidate(CK_ATTRIBUTE_TYPE type, CK_ULONG len);
+
 /**
  * Adds a CK_BOOL to the attribute list and adds type data.
  * @param l
@@ -157,6 +242,48 @@ void attr_list_free(attr_list *attrs);
  */
 void attr_pfree_cleanse(CK_ATTRIBUTE_PTR attr);
 
+/**
+ * Like attr_pfree_cleanse() but safe to use on lists that have been
+ * compacted with attr_list_compact(), in which case a value in the block
+ * is scrubbed in place and its storage is reclaimed when the list is freed.
+ * @param l
+ *  The list containing attr.
+ * @param attr
+ *  The attr to scrub.
+ */
+void attr_list_cleanse_entry(attr_list *l, CK_ATTRIBUTE_PTR attr);
+
+/**
+ * Moves all of the values of the list into a single allocation. This is
+ * meant for long lived, mostly read lists like those of token objects.
+ * The list remains fully usable. Values in the block are never moved or
+ * resized, a changed value gets storage of its own, so the entries and
+ * views from attr_list_get_twist() stay valid until the list is freed or
+ * compacted again. The first compact trims the entry array, which may move
+ * the entries, after that they stay put. Compacting again only repacks a
+ * list with values outside its block.
+ * @param l
+ *  The list to compact.
+ * @return
+ *  true on success, false on oom in which case the list is unchanged.
+ */
+bool attr_list_compact(attr_list *l);
+
+/**
+ * Gets a twist view of a value attr_list_compact() moved into its block.
+ * Only the TPM blobs, CKA_TPM2_PUB_BLOB and CKA_TPM2_PRIV_BLOB, and
+ * CKA_TPM2_OBJAUTH_ENC have one. See twist_view_init() for what a view
+ * can be used for.
+ * @param l
+ *  The list holding the attribute.
+ * @param type
+ *  The attribute type.
+ * @return
+ *  The view, valid until the list is freed, or NULL if the list isn't
+ *  compacted or the value has no view.
+ */
+twist attr_list_get_twist(attr_list *l, CK_ATTRIBUTE_TYPE type);
+
 /**
  * Given a raw attribute list, perhaps from a client caller,
  * creates an attr_list which contains the caller supplied data,
@@ -294,7 +421,9 @@ CK_OBJECT_CLASS attr_list_get_CKA_CLASS(attr_list *attrs, CK_OBJECT_CLASS defval
  * @param needle
  *  The attribute type to search for.
  * @return
- *  The attribute or NULL if not found.
+ *  The attribute or NULL if not found. It stays valid until an attribute
+ *  is added to the list or the list is freed, updating an entry doesn't
+ *  move it.
  */
 CK_ATTRIBUTE_PTR attr_get_attribute_by_type(attr_list *haystack, CK_ATTRIBUTE_TYPE needle);
 
@@ -4,6 +4,7 @@
 #include "backend.h"
 #include "backend_esysdb.h"
 #include "backend_fapi.h"
+#include "profile.h"
 
 enum backend {
     backend_error,
@@ -46,7 +47,10 @@ CK_RV backend_init(void) {
         return CKR_GENERAL_ERROR;
     }
 
+    profile_span span = profile_begin(profile_phase_fapi_init,
+            PROFILE_TOKEN_INHERIT);
     CK_RV rv = backend_fapi_init();
+    profile_end(&span);
     if (rv) {
         static const char *msg = "FAPI backend was not initialized.";
         if (backend == backend_fapi) {
@@ -58,7 +62,9 @@ CK_RV backend_init(void) {
         fapi_init = true;
     }
 
+    span = profile_begin(profile_phase_esysdb_init, PROFILE_TOKEN_INHERIT);
     rv = backend_esysdb_init();
+    profile_end(&span);
     if (rv) {
         LOGW("ESYSDB backend was not initialized.");
     } else {
@@ -119,6 +125,36 @@ void backend_ctx_reset(token *t) {
     /* fapi doesn't appear to need anything */
 }
 
+CK_RV backend_after_fork(void) {
+    LOGV("Reopening backends after fork");
+
+    if (fapi_init) {
+        CK_RV rv = backend_fapi_after_fork();
+        if (rv != CKR_OK) {
+            return rv;
+        }
+    }
+
+    return esysdb_init ? backend_esysdb_after_fork() : CKR_OK;
+}
+
+bool backend_is_readonly(token *t) {
+
+    /* an uninitialized token is created in the selected backend */
+    bool esysdb = t->config.is_initialized ?
+            t->type == token_type_esysdb : get_backend() == backend_esysdb;
+
+    return esysdb && esysdb_init && backend_esysdb_is_readonly();
+}
+
+CK_RV backend_token_after_fork(token *t) {
+    if (t->type == token_type_esysdb) {
+        return backend_esysdb_token_after_fork(t);
+    } else {
+        return backend_fapi_token_after_fork(t);
+    }
+}
+
 /** Create a new token
  *
  * Create a new sealed object and store it in the data store.
@@ -147,6 +183,10 @@ CK_RV backend_create_token_seal(token *t, const twist hexwrappingkey,
             LOGE("FAPI backend not initialized.");
             return CKR_GENERAL_ERROR;
         }
+        if (backend_esysdb_is_readonly()) {
+            LOGE("Cannot create a token in a read only store");
+            return CKR_TOKEN_WRITE_PROTECTED;
+        }
         LOGV("Creating token under ESYSDB");
         return backend_esysdb_create_token_seal(t, hexwrappingkey, newauth, newsalthex);
     }
@@ -178,7 +218,10 @@ CK_RV backend_get_tokens(token **tok, size_t *len) {
     }
 
     if (esysdb_init) {
+        profile_span span = profile_begin(profile_phase_db_get_tokens,
+                PROFILE_TOKEN_INHERIT);
         rv = backend_esysdb_get_tokens(tmp, len);
+        profile_end(&span);
         if (rv) {
             LOGE("Getting tokens from esysdb backend failed.");
             return rv;
@@ -187,7 +230,10 @@ CK_RV backend_get_tokens(token **tok, size_t *len) {
     }
 
     if (fapi_init) {
+        profile_span span = profile_begin(profile_phase_fapi_add_tokens,
+                PROFILE_TOKEN_INHERIT);
         rv = backend_fapi_add_tokens(tmp, len);
+        profile_end(&span);
         if (rv) {
             static const char *msg = "Getting tokens from fapi backend failed.";
             if (backend == backend_fapi) {
@@ -208,6 +254,13 @@ CK_RV backend_get_tokens(token **tok, size_t *len) {
         return CKR_GENERAL_ERROR;
     }
 
+    /* nothing could initialize the empty token */
+    if (backend == backend_esysdb && esysdb_init && backend_esysdb_is_readonly()) {
+        LOGV("Read only store, not adding an empty token");
+        *tok = tmp;
+        return CKR_OK;
+    }
+
     token *t = &tmp[*len];
 
     for (t->id = 1; t->id < MAX_TOKEN_CNT && *len; t->id += 1) {
@@ -316,7 +369,7 @@ CK_RV backend_update_tobject_attrs(token *tok, tobject *tobj, attr_list *attrs)
 
     switch (tok->type) {
     case token_type_esysdb:
-        return backend_esysdb_update_tobject_attrs(tobj, attrs);
+        return backend_esysdb_update_tobject_attrs(tok, tobj, attrs);
     case token_type_fapi:
         return backend_fapi_update_tobject_attrs(tok, tobj, attrs);
     default:
@@ -338,7 +391,7 @@ CK_RV backend_rm_tobject(token *tok, tobject *tobj) {
 
     switch (tok->type) {
     case token_type_esysdb:
-        return backend_esysdb_rm_tobject(tobj);
+        return backend_esysdb_rm_tobject(tok, tobj);
     case token_type_fapi:
         return backend_fapi_rm_tobject(tok, tobj);
     default:
@@ -347,6 +400,34 @@ CK_RV backend_rm_tobject(token *tok, tobject *tobj) {
     }
 }
 
+/**
+ * Fetches an attribute value that was left in the backend store, see
+ * attr_is_lazy().
+ * @param tok
+ *  The token the object belongs to.
+ * @param tobj
+ *  The tobject whose attribute to fetch.
+ * @param type
+ *  The attribute type to fetch.
+ * @param value
+ *  The value, free with twist_free().
+ * @return
+ *  CKR_OK on success, anything else is an error.
+ */
+CK_RV backend_get_tobject_attr(token *tok, tobject *tobj, CK_ATTRIBUTE_TYPE type, twist *value) {
+
+    switch (tok->type) {
+    case token_type_esysdb:
+        return backend_esysdb_get_tobject_attr(tok, tobj, type, value);
+    case token_type_fapi:
+        LOGE("Not supported on FAPI");
+        return CKR_FUNCTION_NOT_SUPPORTED;
+    default:
+        assert(1);
+        return CKR_GENERAL_ERROR;
+    }
+}
+
 /** Unseal a token's wrapping key.
  *
  * Unseal a token's wrapping key as part of the Login process.
@@ -14,6 +14,29 @@ CK_RV backend_destroy(void);
 CK_RV backend_ctx_new(token *t);
 void backend_ctx_free(token *t);
 void backend_ctx_reset(token *t);
+
+/**
+ * Replaces the backends' connections inherited over fork(), called in the
+ * child before backend_token_after_fork().
+ */
+CK_RV backend_after_fork(void);
+
+/**
+ * Tells if a token's backend can't be written, see db_is_readonly().
+ * Calls that would change the token fail with CKR_TOKEN_WRITE_PROTECTED.
+ * @param t
+ *  The token, for an uninitialized one the backend it would be created in.
+ * @return
+ *  true if the token is read only.
+ */
+bool backend_is_readonly(token *t);
+
+/**
+ * Gives a token inherited over fork() its own TPM connection and reloads
+ * its primary object.
+ */
+CK_RV backend_token_after_fork(token *t);
+
 CK_RV backend_create_token_seal(token *t, const twist hexwrappingkey,
                         const twist newauth, const twist newsalthex);
 
@@ -30,6 +53,8 @@ CK_RV backend_update_tobject_attrs(token *tok, tobject *tobj, attr_list *attrs);
 
 CK_RV backend_rm_tobject(token *tok, tobject *tobj);
 
+CK_RV backend_get_tobject_attr(token *tok, tobject *tobj, CK_ATTRIBUTE_TYPE type, twist *value);
+
 CK_RV backend_token_unseal_wrapping_key(token *tok, bool user, twist tpin);
 
 CK_RV backend_token_changeauth(token *tok, bool user, twist toldpin, twist tnewpin);
@@ -1,6 +1,7 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 
 #include "config.h"
+#include "attr_cache.h"
 #include "backend_esysdb.h"
 #include "db.h"
 #include "ssl_util.h"
@@ -24,6 +25,36 @@ CK_RV backend_esysdb_ctx_new(token *t) {
     return tpm_ctx_new(t->config.tcti, &t->tctx);
 }
 
+CK_RV backend_esysdb_after_fork(void) {
+    return db_after_fork();
+}
+
+bool backend_esysdb_is_readonly(void) {
+    return db_is_readonly();
+}
+
+CK_RV backend_esysdb_token_after_fork(token *t) {
+
+    CK_RV rv = tpm_ctx_reopen(t->tctx, t->config.tcti);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    /* a persistent primary only needs its ESYS_TR, a transient one is recreated */
+    pobject *pobj = &t->pobject;
+    if (pobj->config.is_transient && pobj->config.template_name) {
+        return tpm_create_transient_primary_from_template(t->tctx,
+                pobj->config.template_name, pobj->objauth, &pobj->handle);
+    }
+
+    if (!pobj->config.is_transient && pobj->config.blob) {
+        bool res = tpm_deserialize_handle(t->tctx, pobj->config.blob, &pobj->handle);
+        return res ? CKR_OK : CKR_GENERAL_ERROR;
+    }
+
+    return CKR_OK;
+}
+
 static void sealobject_free(sealobject *sealobj) {
     twist_free(sealobj->soauthsalt);
     twist_free(sealobj->sopriv);
@@ -37,6 +68,8 @@ static void sealobject_free(sealobject *sealobj) {
 void backend_esysdb_ctx_reset(token *t) {
 
     sealobject_free(&t->esysdb.sealobject);
+    attr_cache_free(t->esysdb.attr_cache);
+    t->esysdb.attr_cache = NULL;
     /*
      * the rest of the state can live so we don't need to free/realloc it
      * Beware of who holds the mutex!
@@ -45,6 +78,8 @@ void backend_esysdb_ctx_reset(token *t) {
 
 void backend_esysdb_ctx_free(token *t) {
     sealobject_free(&t->esysdb.sealobject);
+    attr_cache_free(t->esysdb.attr_cache);
+    t->esysdb.attr_cache = NULL;
 }
 
 static CK_RV get_or_create_primary(token *t) {
@@ -258,16 +293,60 @@ CK_RV backend_esysdb_update_token_config (token *tok) {
     return db_update_token_config(tok);
 }
 
-CK_RV backend_esysdb_update_tobject_attrs(tobject *tobj, attr_list *attrs) {
+CK_RV backend_esysdb_update_tobject_attrs(token *tok, tobject *tobj, attr_list *attrs) {
+
+    attr_cache_invalidate(tok->esysdb.attr_cache, tobj->id);
 
-    return db_update_tobject_attrs(tobj->id, attrs);
+    /* only what changed is written, the store keeps the rest */
+    attr_list *changed = NULL;
+    CK_RV rv = attr_list_diff(tobj->attrs, attrs, &changed);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    rv = db_patch_tobject_attrs(tobj->id, changed);
+    attr_list_free(changed);
+
+    return rv;
 }
 
-CK_RV backend_esysdb_rm_tobject(tobject *tobj) {
+CK_RV backend_esysdb_rm_tobject(token *tok, tobject *tobj) {
+
+    /* ids can be reused by the DB, so don't let the values outlive the object */
+    attr_cache_invalidate(tok->esysdb.attr_cache, tobj->id);
 
     return db_delete_object(tobj);
 }
 
+CK_RV backend_esysdb_get_tobject_attr(token *tok, tobject *tobj,
+        CK_ATTRIBUTE_TYPE type, twist *value) {
+
+    if (!tok->esysdb.attr_cache) {
+        tok->esysdb.attr_cache = attr_cache_new(ATTR_CACHE_DEFAULT_SIZE);
+        if (!tok->esysdb.attr_cache) {
+            return CKR_HOST_MEMORY;
+        }
+    }
+
+    twist cached = attr_cache_get(tok->esysdb.attr_cache, tobj->id, type);
+    if (!cached) {
+        CK_RV rv = db_get_tobject_attr(tobj->id, type, &cached);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+
+        attr_cache_put(tok->esysdb.attr_cache, tobj->id, type, cached);
+    }
+
+    *value = twist_dup(cached);
+    if (!*value) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    return CKR_OK;
+}
+
 /** Unseal a token's wrapping key.
  *
  * see backend_token_unseal_wrapping_key()
@@ -12,6 +12,9 @@ CK_RV backend_esysdb_destroy(void);
 CK_RV backend_esysdb_ctx_new(token *t);
 void backend_esysdb_ctx_free(token *t);
 void backend_esysdb_ctx_reset(token *t);
+CK_RV backend_esysdb_after_fork(void);
+CK_RV backend_esysdb_token_after_fork(token *t);
+bool backend_esysdb_is_readonly(void);
 
 CK_RV backend_esysdb_create_token_seal(token *t, const twist hexwrappingkey,
                        const twist newauth, const twist newsalthex);
@@ -25,9 +28,12 @@ CK_RV backend_esysdb_add_object(token *t, tobject *tobj);
 
 CK_RV backend_esysdb_update_token_config (token *tok);
 
-CK_RV backend_esysdb_update_tobject_attrs(tobject *tobj, attr_list *attrs);
+CK_RV backend_esysdb_update_tobject_attrs(token *tok, tobject *tobj, attr_list *attrs);
 
-CK_RV backend_esysdb_rm_tobject(tobject *tobj);
+CK_RV backend_esysdb_rm_tobject(token *tok, tobject *tobj);
+
+CK_RV backend_esysdb_get_tobject_attr(token *tok, tobject *tobj,
+        CK_ATTRIBUTE_TYPE type, twist *value);
 
 CK_RV backend_esysdb_token_unseal_wrapping_key(token *tok, bool user, twist tpin);
 
@@ -10,7 +10,9 @@
 
 #include "backend_fapi.h"
 #include "emitter.h"
+#include "fapi_index.h"
 #include "parser.h"
+#include "profile.h"
 #include "ssl_util.h"
 #include "utils.h"
 
@@ -39,27 +41,146 @@ static void fail_fapi_msg(TSS2_RC rc) {
             "for more details", Tss2_RC_Decode(rc), version);
 }
 
-static CK_RV get_key(FAPI_CONTEXT *fapictx, tpm_ctx *tctx, const char *path, uint32_t *esysHandle, uint32_t *pid) {
+/*
+ * The reads enumerating the tokens go through the FAPI index, see
+ * fapi_index.h. Every value is returned as a twist, from the index when the
+ * keystore entry is unchanged and from FAPI otherwise.
+ */
+static TSS2_RC index_list(fapi_index *idx, const char *search, twist *pathlist) {
+
+    *pathlist = fapi_index_get(idx, "list", search);
+    if (*pathlist) {
+        return TSS2_RC_SUCCESS;
+    }
+
+    char *list = NULL;
+    TSS2_RC rc = Fapi_List(fctx, search, &list);
+    if (rc) {
+        return rc;
+    }
+
+    *pathlist = twist_new(list);
+    Fapi_Free(list);
+    if (!*pathlist) {
+        LOGE("oom");
+        return TSS2_FAPI_RC_MEMORY;
+    }
+
+    fapi_index_put(idx, "list", search, *pathlist, twist_len(*pathlist));
+
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC index_get_appdata(fapi_index *idx, FAPI_CONTEXT *fapictx,
+        const char *path, twist *appdata) {
+
+    *appdata = fapi_index_get(idx, "appdata", path);
+    if (*appdata) {
+        return TSS2_RC_SUCCESS;
+    }
+
+    uint8_t *data = NULL;
+    size_t len = 0;
+    TSS2_RC rc = Fapi_GetAppData(fapictx, path, &data, &len);
+    if (rc) {
+        return rc;
+    }
+
+    *appdata = twistbin_new(data ? data : (uint8_t *)"", len);
+    Fapi_Free(data);
+    if (!*appdata) {
+        LOGE("oom");
+        return TSS2_FAPI_RC_MEMORY;
+    }
+
+    fapi_index_put(idx, "appdata", path, *appdata, twist_len(*appdata));
+
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC index_get_description(fapi_index *idx, FAPI_CONTEXT *fapictx,
+        const char *path, twist *description) {
+
+    *description = fapi_index_get(idx, "description", path);
+    if (*description) {
+        return TSS2_RC_SUCCESS;
+    }
+
+    char *desc = NULL;
+    TSS2_RC rc = Fapi_GetDescription(fapictx, path, &desc);
+    if (rc) {
+        return rc;
+    }
+
+    *description = twist_new(desc ? desc : "");
+    Fapi_Free(desc);
+    if (!*description) {
+        LOGE("oom");
+        return TSS2_FAPI_RC_MEMORY;
+    }
+
+    fapi_index_put(idx, "description", path, *description,
+            twist_len(*description));
+
+    return TSS2_RC_SUCCESS;
+}
+
+/* the blob is stored after its type */
+static TSS2_RC index_get_esysblob(fapi_index *idx, FAPI_CONTEXT *fapictx,
+        const char *path, uint8_t *type, twist *blob) {
+
+    twist cached = fapi_index_get(idx, "esysblob", path);
+    if (cached && twist_len(cached) > 1) {
+        *type = (uint8_t)cached[0];
+        *blob = twistbin_new(&cached[1], twist_len(cached) - 1);
+        twist_free(cached);
+        return *blob ? TSS2_RC_SUCCESS : TSS2_FAPI_RC_MEMORY;
+    }
+    twist_free(cached);
+
+    uint8_t *data;
+    size_t length;
+    TSS2_RC rc = Fapi_GetEsysBlob(fapictx, path, type, &data, &length);
+    if (rc) {
+        return rc;
+    }
+
+    *blob = twistbin_new(data, length);
+    Fapi_Free(data);
+    if (!*blob) {
+        LOGE("oom");
+        return TSS2_FAPI_RC_MEMORY;
+    }
+
+    binarybuffer parts[] = {
+        { .data = type,  .size = sizeof(*type)     },
+        { .data = *blob, .size = twist_len(*blob) },
+    };
+    twist entry = twistbin_aappend(NULL, parts, ARRAY_LEN(parts));
+    if (entry) {
+        fapi_index_put(idx, "esysblob", path, entry, twist_len(entry));
+        twist_free(entry);
+    }
+
+    return TSS2_RC_SUCCESS;
+}
+
+static CK_RV get_key(fapi_index *idx, FAPI_CONTEXT *fapictx, tpm_ctx *tctx,
+        const char *path, uint32_t *esysHandle, uint32_t *pid) {
 
     bool ret;
     TSS2_RC rc;
     uint8_t type;
-    uint8_t *data;
     size_t length;
     twist name = NULL;
 
-    rc = Fapi_GetEsysBlob(fapictx, path, &type, &data, &length);
+    twist twistdata = NULL;
+    rc = index_get_esysblob(idx, fapictx, path, &type, &twistdata);
     if (rc != TSS2_RC_SUCCESS) {
         LOGE("Cannot get Esys blob for key %s", path);
         return CKR_GENERAL_ERROR;
     }
 
-    twist twistdata = twistbin_new(data, length);
-    Fapi_Free(data);
-    if (!twistdata) {
-        return CKR_HOST_MEMORY;
-    }
-
     switch(type) {
     case FAPI_ESYSBLOB_CONTEXTLOAD:
         ret = tpm_contextload_handle(tctx, twistdata, esysHandle);
@@ -137,41 +258,591 @@ CK_RV backend_fapi_ctx_new(token *t) {
         return CKR_GENERAL_ERROR;
     }
 
-    t->type = token_type_fapi;
-    t->fapi.ctx = fctx;
-    return tpm_ctx_new_fromtcti(tcti, &t->tctx);
-}
+    t->type = token_type_fapi;
+    t->fapi.ctx = fctx;
+    return tpm_ctx_new_fromtcti(tcti, &t->tctx);
+}
+
+void backend_fapi_ctx_free(token *t) {
+    UNUSED(t);
+}
+
+
+#define PREFIX "/HS/SRK/tpm2-pkcs11-token-"
+
+static char *tss_path_from_id(unsigned id, const char *type) {
+    /* Allocate for PREFIX + type + "-" + id + '\0' */
+    size_t size = 0;
+    safe_add(size, strlen(PREFIX), strlen(type));
+    safe_adde(size, strlen(PREFIX));
+    safe_adde(size, 1 + 8 + 1);
+
+    char *path = malloc(size);
+    if (!path) {
+        return NULL;
+    }
+
+    sprintf(&path[0], PREFIX "%s-%08x", type, id);
+
+    return path;
+}
+
+static char *path_get_parent(const char *path) {
+    char *end = rindex(path, '/');
+    if (!end) {
+        return NULL;
+    }
+    return strndup(path, end - path);
+}
+
+CK_RV backend_fapi_after_fork(void) {
+
+    if (!fctx) {
+        return CKR_OK;
+    }
+
+    /* the parent's context shares its TPM connection, leave it be */
+    fctx = NULL;
+
+    return backend_fapi_init();
+}
+
+CK_RV backend_fapi_token_after_fork(token *t) {
+
+    TSS2_TCTI_CONTEXT *tcti;
+    TSS2_RC rc = Fapi_GetTcti(fctx, &tcti);
+    if (rc) {
+        LOGE("Getting FAPI's tcti context");
+        return CKR_GENERAL_ERROR;
+    }
+
+    t->fapi.ctx = fctx;
+
+    CK_RV rv = tpm_ctx_reopen_fromtcti(t->tctx, tcti);
+    if (rv != CKR_OK || !t->config.is_initialized) {
+        return rv;
+    }
+
+    char *path = tss_path_from_id(t->id, "so");
+    if (!path) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    char *parentpath = path_get_parent(path);
+    free(path);
+    if (!parentpath) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    rv = get_key(NULL, t->fapi.ctx, t->tctx, parentpath, &t->pobject.handle, &t->pid);
+    free(parentpath);
+
+    return rv;
+}
+
+/* Skips over a profile node, like /P_RSA2048SHA256, at the start of path */
+static const char *path_skip_profile(const char *path) {
+    if (strncmp(path, "/P_", strlen("/P_"))) {
+        return path;
+    }
+    return index(path + 1, '/');
+}
+
+/* The path of another seal of token id, next to the seal at path */
+static char *path_sibling(const char *path, const char *type, unsigned id) {
+
+    char *parent = path_get_parent(path);
+    if (!parent) {
+        return NULL;
+    }
+
+    /* Allocate for parent + "/tpm2-pkcs11-token-" + type + "-" + id + '\0' */
+    const char *name = rindex(PREFIX, '/');
+    size_t size = 0;
+    safe_add(size, strlen(parent), strlen(name));
+    safe_adde(size, strlen(type));
+    safe_adde(size, 1 + 8 + 1);
+
+    char *sibling = malloc(size);
+    if (sibling) {
+        sprintf(sibling, "%s%s%s-%08x", parent, name, type, id);
+    }
+
+    free(parent);
+    return sibling;
+}
+
+/* True if path is one of the entries of a Fapi_List() result */
+static bool pathlist_has(const char *pathlist, const char *path) {
+
+    if (!pathlist) {
+        return false;
+    }
+
+    size_t len = strlen(path);
+    const char *p = pathlist;
+    while ((p = strstr(p, path))) {
+        bool starts = p == pathlist || p[-1] == ':';
+        bool ends = p[len] == '\0' || p[len] == ':';
+        if (starts && ends) {
+            return true;
+        }
+        p += len;
+    }
+
+    return false;
+}
+
+/*
+ * The objects of a token are kept in chunk seals holding up to
+ * FAPI_CHUNK_OBJECTS objects each, the chunk of an object follows from its
+ * id. So adding, changing or removing an object reads and writes one small
+ * keystore entry, instead of the SO seal's appdata holding every object of
+ * the token.
+ *
+ * The appdata of a chunk is a list of records, each the object id as 8 hex
+ * digits, a ':' and the YAML attributes, terminated by '\0'. Tokens created
+ * by older versions keep these records after the salt in the SO seal's
+ * appdata, they are moved to chunks when the token is loaded.
+ */
+#define FAPI_CHUNK_OBJECTS 64
+
+static char *tss_path_from_chunk(unsigned tokid, unsigned chunk) {
+    /* Allocate for PREFIX + "obj-" + tokid + "-" + chunk + '\0' */
+    size_t size = 0;
+    safe_add(size, strlen(PREFIX), 4 + 8 + 1 + 8 + 1);
+
+    char *path = malloc(size);
+    if (!path) {
+        return NULL;
+    }
+
+    sprintf(&path[0], PREFIX "obj-%08x-%08x", tokid, chunk);
+
+    return path;
+}
+
+/* Finds the record of object id in data, the record spans [*start, *end) */
+static bool record_find(const uint8_t *data, size_t len, unsigned id,
+        size_t *start, size_t *end) {
+
+    size_t offset = 0;
+    while (offset < len) {
+        size_t reclen = strnlen((const char *)&data[offset], len - offset);
+
+        unsigned cur;
+        if (reclen < 9 || sscanf((const char *)&data[offset], "%08x:", &cur) != 1) {
+            LOGE("bad tobject.");
+            return false;
+        }
+
+        size_t next = offset + reclen;
+        if (next < len) {
+            next++;
+        }
+
+        if (cur == id) {
+            *start = offset;
+            *end = next;
+            return true;
+        }
+
+        offset = next;
+    }
+
+    return false;
+}
+
+/* An absent chunk is returned as empty appdata with exists set to false */
+static CK_RV chunk_get(token *t, const char *path, uint8_t **data,
+        size_t *len, bool *exists) {
+
+    TSS2_RC rc = Fapi_GetAppData(t->fapi.ctx, path, data, len);
+    if (rc == TSS2_FAPI_RC_KEY_NOT_FOUND || rc == TSS2_FAPI_RC_PATH_NOT_FOUND) {
+        *data = NULL;
+        *len = 0;
+        *exists = false;
+        return CKR_OK;
+    }
+    if (rc) {
+        LOGE("Getting FAPI chunk appdata failed.");
+        return CKR_GENERAL_ERROR;
+    }
+
+    *exists = true;
+    return CKR_OK;
+}
+
+/* Writes the chunk's appdata, creating it if needed and deleting it once empty */
+static CK_RV chunk_set(token *t, const char *path, bool exists,
+        uint8_t *data, size_t len) {
+
+    TSS2_RC rc;
+
+    if (!len) {
+        if (exists) {
+            rc = Fapi_Delete(t->fapi.ctx, path);
+            if (rc) {
+                LOGE("Deleting FAPI chunk failed.");
+                return CKR_GENERAL_ERROR;
+            }
+        }
+        return CKR_OK;
+    }
+
+    if (!exists) {
+        /* the seal only carries the appdata, its secret is never used */
+        uint8_t secret = 0;
+        rc = Fapi_CreateSeal(t->fapi.ctx, path,
+                             NULL /*type*/, sizeof(secret),
+                             NULL /*policy*/, NULL /*auth*/, &secret);
+        if (rc) {
+            LOGE("Creation of a FAPI chunk failed.");
+            return CKR_GENERAL_ERROR;
+        }
+    }
+
+    rc = Fapi_SetAppData(t->fapi.ctx, path, data, len);
+    if (rc) {
+        LOGE("Setting FAPI chunk appdata failed.");
+        if (!exists) {
+            Fapi_Delete(t->fapi.ctx, path);
+        }
+        return CKR_GENERAL_ERROR;
+    }
+
+    return CKR_OK;
+}
+
+/*
+ * Stores the record of object id in its chunk, replacing the current one.
+ * Without must_exist a missing record is appended.
+ */
+static CK_RV chunk_put(token *t, unsigned id, const char *attrs, bool must_exist) {
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    char *path = tss_path_from_chunk(t->id, id / FAPI_CHUNK_OBJECTS);
+    if (!path) {
+        LOGE("No path constructed.");
+        return CKR_HOST_MEMORY;
+    }
+
+    uint8_t *data = NULL;
+    size_t len = 0;
+    bool exists;
+    rv = chunk_get(t, path, &data, &len, &exists);
+    if (rv != CKR_OK) {
+        goto out;
+    }
+    rv = CKR_GENERAL_ERROR;
+
+    size_t start = len;
+    size_t end = len;
+    if (!record_find(data, len, id, &start, &end) && must_exist) {
+        LOGE("tobj not found in chunk.");
+        goto out;
+    }
+
+    size_t reclen = 0;
+    safe_add(reclen, strlen(attrs), 9 + 1); /* id, ':' and terminating '\0' */
+
+    size_t newlen = len - (end - start);
+    safe_adde(newlen, reclen);
+    uint8_t *newdata = malloc(newlen);
+    if (!newdata) {
+        LOGE("oom");
+        rv = CKR_HOST_MEMORY;
+        goto out;
+    }
+
+    memcpy(&newdata[0], &data[0], start);
+    sprintf((char *)&newdata[start], "%08x:%s", id, attrs);
+    memcpy(&newdata[start + reclen], &data[end], len - end);
+
+    rv = chunk_set(t, path, exists, newdata, newlen);
+    free(newdata);
+
+out:
+    Fapi_Free(data);
+    free(path);
+    return rv;
+}
+
+static CK_RV chunk_remove(token *t, unsigned id) {
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    char *path = tss_path_from_chunk(t->id, id / FAPI_CHUNK_OBJECTS);
+    if (!path) {
+        LOGE("No path constructed.");
+        return CKR_HOST_MEMORY;
+    }
+
+    uint8_t *data = NULL;
+    size_t len = 0;
+    bool exists;
+    rv = chunk_get(t, path, &data, &len, &exists);
+    if (rv != CKR_OK) {
+        goto out;
+    }
+    rv = CKR_GENERAL_ERROR;
+
+    size_t start, end;
+    if (!record_find(data, len, id, &start, &end)) {
+        LOGE("tobj not found in chunk.");
+        goto out;
+    }
+
+    memmove(&data[start], &data[end], len - end);
+    len -= end - start;
+
+    rv = chunk_set(t, path, exists, data, len);
+
+out:
+    Fapi_Free(data);
+    free(path);
+    return rv;
+}
+
+static bool token_has_tobject_id(token *t, unsigned id) {
+
+    list *cur = NULL;
+    list_for_each(t->tobjects.head ? &t->tobjects.head->l : NULL, cur) {
+        tobject *tobj = list_entry(cur, tobject, l);
+        if (tobj->id == id) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Adds the objects of the records in data, starting at offset. With
+ * skip_known set, objects the token already has are skipped, which happens
+ * when moving them from the SO seal to chunks was interrupted.
+ */
+static CK_RV records_load(token *t, const uint8_t *data, size_t len, size_t offset,
+        bool skip_known, size_t *count) {
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+    const uint8_t *yaml = &data[offset];
+
+    while ((size_t)(yaml - data) < len) {
+        LOGV("Current tobj at offset %zi / %zi is: %s",
+             yaml - data, len, yaml);
+
+        size_t left = len - (size_t)(yaml - data);
+        if (left < 10 || strnlen((char*)yaml, left) < 10) {
+            LOGE("Incomplete tobj in appdata");
+            return CKR_GENERAL_ERROR;
+        }
+
+        unsigned id;
+        if (sscanf((char*)yaml, "%08x:", &id) != 1) {
+            LOGE("Could not scan tobj id");
+            return CKR_GENERAL_ERROR;
+        }
+
+        if (!skip_known || !token_has_tobject_id(t, id)) {
+
+            tobject *tobj = tobject_new();
+            if (!tobj) {
+                LOGE("oom");
+                return CKR_HOST_MEMORY;
+            }
+
+            tobj->id = id;
+
+            maxobjectid = (maxobjectid > tobj->id)? maxobjectid : tobj->id;
+
+            profile_span span = profile_begin(profile_phase_yaml_parse, t->id);
+            bool res = parse_attributes_from_string(&yaml[9],
+                    strlen((char*)&yaml[9]), &tobj->attrs);
+            profile_end(&span);
+            if (!res) {
+                LOGE("Could not parse FAPI attrs, got: \"%s\"", yaml);
+                free(tobj);
+                return CKR_GENERAL_ERROR;
+            }
+
+            rv = object_init_from_attrs(tobj);
+            if (rv != CKR_OK) {
+                LOGE("Object initialization failed");
+                free(tobj);
+                return rv;
+            }
+
+            rv = token_add_tobject_last(t, tobj);
+            if (rv != CKR_OK) {
+                LOGE("Failed to initialize tobject from FAPI");
+                free(tobj);
+                return rv;
+            }
+
+            if (count) {
+                *count += 1;
+            }
+        }
+
+        size_t next = 0;
+        safe_add(next, strlen((char *)yaml), 1);
+        yaml += next;
+        LOGV("\nCurrent next is: %zi / %zi", yaml - data, len);
+    }
+
+    return CKR_OK;
+}
+
+/*
+ * Moves the records following the salt in the SO seal's appdata to chunks.
+ * The SO seal is only truncated once every record is in its chunk, so an
+ * interrupted move is completed on the next load.
+ */
+static CK_RV records_migrate(token *t, const char *sopath,
+        const uint8_t *appdata, size_t appdata_len) {
+
+    size_t offset = strlen((char *)appdata) + 1;
+
+    LOGV("Moving the objects of FAPI token %08x to chunks", t->id);
+
+    while (offset < appdata_len) {
+        const char *rec = (const char *)&appdata[offset];
+
+        unsigned id;
+        if (sscanf(rec, "%08x:", &id) != 1) {
+            LOGE("bad tobject.");
+            return CKR_GENERAL_ERROR;
+        }
+
+        CK_RV rv = chunk_put(t, id, &rec[9], false);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+
+        safe_adde(offset, strlen(rec));
+        safe_adde(offset, 1);
+    }
+
+    /* keep the salt and its terminating '\0' */
+    TSS2_RC rc = Fapi_SetAppData(t->fapi.ctx, sopath, appdata,
+            strlen((char *)appdata) + 1);
+    if (rc) {
+        LOGE("Setting FAPI seal appdata failed.");
+        return CKR_GENERAL_ERROR;
+    }
+
+    return CKR_OK;
+}
+
+typedef struct fapi_chunk fapi_chunk;
+struct fapi_chunk {
+    unsigned tokid;
+    unsigned chunk;
+    const char *path;
+};
+
+static int fapi_chunk_cmp(const void *a, const void *b) {
+
+    const fapi_chunk *x = (const fapi_chunk *)a;
+    const fapi_chunk *y = (const fapi_chunk *)b;
+
+    if (x->tokid != y->tokid) {
+        return x->tokid < y->tokid ? -1 : 1;
+    }
+
+    return x->chunk < y->chunk ? -1 : x->chunk > y->chunk;
+}
+
+/*
+ * Collects the chunks in a Fapi_List() result, ordered by token and chunk.
+ * The entries point into *copy, which the caller frees.
+ */
+static CK_RV chunks_from_pathlist(const char *pathlist, char **copy,
+        fapi_chunk **chunks, size_t *nchunks) {
+
+    *copy = NULL;
+    *chunks = NULL;
+    *nchunks = 0;
+
+    if (!pathlist) {
+        return CKR_OK;
+    }
+
+    size_t max = 1;
+    const char *p;
+    for (p = pathlist; *p; p++) {
+        if (*p == ':') {
+            safe_adde(max, 1);
+        }
+    }
 
-void backend_fapi_ctx_free(token *t) {
-    UNUSED(t);
-}
+    *copy = strdup(pathlist);
+    *chunks = calloc(max, sizeof(**chunks));
+    if (!*copy || !*chunks) {
+        LOGE("oom");
+        free(*copy);
+        free(*chunks);
+        *copy = NULL;
+        *chunks = NULL;
+        return CKR_HOST_MEMORY;
+    }
 
+    char *strtokr_save = NULL;
+    char *path;
+    for (path = strtok_r(*copy, ":", &strtokr_save);
+            path != NULL; path = strtok_r(NULL, ":", &strtokr_save)) {
 
-#define PREFIX "/HS/SRK/tpm2-pkcs11-token-"
+        const char *subpath = path_skip_profile(path);
+        if (!subpath) {
+            continue;
+        }
 
-static char *tss_path_from_id(unsigned id, const char *type) {
-    /* Allocate for PREFIX + type + "-" + id + '\0' */
-    size_t size = 0;
-    safe_add(size, strlen(PREFIX), strlen(type));
-    safe_adde(size, strlen(PREFIX));
-    safe_adde(size, 1 + 8 + 1);
+        fapi_chunk *c = &(*chunks)[*nchunks];
+        if (sscanf(subpath, PREFIX "obj-%08x-%08x", &c->tokid, &c->chunk) != 2) {
+            continue;
+        }
 
-    char *path = malloc(size);
-    if (!path) {
-        return NULL;
+        c->path = path;
+        *nchunks += 1;
     }
 
-    sprintf(&path[0], PREFIX "%s-%08x", type, id);
+    qsort(*chunks, *nchunks, sizeof(**chunks), fapi_chunk_cmp);
 
-    return path;
+    return CKR_OK;
 }
 
-static char *path_get_parent(const char *path) {
-    char *end = rindex(path, '/');
-    if (!end) {
-        return NULL;
+static CK_RV chunks_load(fapi_index *idx, token *t, const fapi_chunk *chunks,
+        size_t nchunks, bool skip_known) {
+
+    size_t i;
+    for (i=0; i < nchunks; i++) {
+        if (chunks[i].tokid != t->id) {
+            continue;
+        }
+
+        twist data = NULL;
+
+        profile_span span = profile_begin(profile_phase_fapi_get_appdata, t->id);
+        TSS2_RC rc = index_get_appdata(idx, t->fapi.ctx, chunks[i].path, &data);
+        profile_end(&span);
+        if (rc) {
+            LOGE("Getting FAPI chunk appdata failed.");
+            return CKR_GENERAL_ERROR;
+        }
+
+        CK_RV rv = records_load(t, (const uint8_t *)data, twist_len(data), 0,
+                skip_known, NULL);
+        twist_free(data);
+        if (rv != CKR_OK) {
+            return rv;
+        }
     }
-    return strndup(path, end - path);
+
+    return CKR_OK;
 }
 
 /** Create a new token in fapi backend.
@@ -253,7 +924,7 @@ CK_RV backend_fapi_create_token_seal(token *t, const twist hexwrappingkey,
         return CKR_HOST_MEMORY;
     }
 
-    CK_RV rv = get_key(t->fapi.ctx, t->tctx, parentpath, &t->pobject.handle, &t->pid);
+    CK_RV rv = get_key(NULL, t->fapi.ctx, t->tctx, parentpath, &t->pobject.handle, &t->pid);
     free(parentpath);
     if (rv != CKR_OK) {
         LOGE("Error getting parent key");
@@ -270,29 +941,52 @@ CK_RV backend_fapi_create_token_seal(token *t, const twist hexwrappingkey,
 CK_RV backend_fapi_add_tokens(token *tok, size_t *len) {
     CK_RV rv = CKR_GENERAL_ERROR;
     TSS2_RC rc;
-    char *pathlist;
-
-    rc = Fapi_List(fctx, "/HS/SRK", &pathlist);
+    twist pathlist = NULL;
+    char *walk = NULL;
+    char *chunkpaths = NULL;
+    fapi_chunk *chunks = NULL;
+    size_t nchunks = 0;
+
+    profile_span span = profile_begin(profile_phase_fapi_index,
+            PROFILE_TOKEN_INHERIT);
+    fapi_index *idx = fapi_index_open();
+    profile_end(&span);
+
+    span = profile_begin(profile_phase_fapi_list, PROFILE_TOKEN_INHERIT);
+    rc = index_list(idx, "/HS/SRK", &pathlist);
+    profile_end(&span);
     if (rc == TSS2_FAPI_RC_IO_ERROR) {
         /* If no token seals were found, we're done here. */
         LOGV("No FAPI token seals found.");
     } else if (rc != TSS2_RC_SUCCESS) {
         fail_fapi_msg(rc);
-        return CKR_GENERAL_ERROR;
+        goto error;
+    }
+
+    rv = chunks_from_pathlist(pathlist, &chunkpaths, &chunks, &nchunks);
+    if (rv != CKR_OK) {
+        goto error;
+    }
+    rv = CKR_GENERAL_ERROR;
+
+    if (pathlist) {
+        walk = strdup(pathlist);
+        if (!walk) {
+            LOGE("oom");
+            rv = CKR_HOST_MEMORY;
+            goto error;
+        }
     }
 
     char *strtokr_save = NULL;
-    for (char *path = strtok_r(pathlist, ":", &strtokr_save);
+    for (char *path = walk ? strtok_r(walk, ":", &strtokr_save) : NULL;
             path != NULL; path = strtok_r(NULL, ":", &strtokr_save)) {
 
         /* Skip over potential profile nodes that don't interest us. */
-        char *subpath = path;
-        if (!strncmp(path, "/P_", strlen("/P_"))) {
-            subpath = index(path + 1, '/');
-            if (!subpath) {
-                LOGE("Malformed path received");
-                goto error;
-            }
+        const char *subpath = path_skip_profile(path);
+        if (!subpath) {
+            LOGE("Malformed path received");
+            goto error;
         }
 
         unsigned id;
@@ -309,7 +1003,9 @@ CK_RV backend_fapi_add_tokens(token *tok, size_t *len) {
         t->type = token_type_fapi;
         t->id = id;
 
+        span = profile_begin(profile_phase_token_min_init, t->id);
         rv = token_min_init(t);
+        profile_end(&span);
         if (rv) {
             LOGE("token min init failed");
             goto error;
@@ -324,113 +1020,93 @@ CK_RV backend_fapi_add_tokens(token *tok, size_t *len) {
             goto error;
         }
 
-        rv = get_key(t->fapi.ctx, t->tctx, parentpath, &t->pobject.handle, &t->pid);
+        span = profile_begin(profile_phase_fapi_get_key, t->id);
+        rv = get_key(idx, t->fapi.ctx, t->tctx, parentpath, &t->pobject.handle, &t->pid);
+        profile_end(&span);
         free(parentpath);
         if (rv != CKR_OK) {
-            return rv;
+            goto error;
         }
 
-        char *label;
-        rc = Fapi_GetDescription(t->fapi.ctx, path, &label);
+        twist label = NULL;
+        rc = index_get_description(idx, t->fapi.ctx, path, &label);
         if (rc) {
             LOGE("Getting FAPI seal description failed.");
             goto error;
         }
-        memcpy(&t->label[0], label, strlen(label));
-        Fapi_Free(label);
+        size_t label_len = twist_len(label);
+        if (label_len > sizeof(t->label)) {
+            label_len = sizeof(t->label);
+        }
+        memcpy(&t->label[0], label, label_len);
+        twist_free(label);
 
         LOGV("Parsing objects for token %i:%s", t->id, &t->label[0]);
 
-        uint8_t *appdata;
-        size_t appdata_len;
+        twist appdata = NULL;
 
-        rc = Fapi_GetAppData(t->fapi.ctx, path, &appdata, &appdata_len);
+        span = profile_begin(profile_phase_fapi_get_appdata, t->id);
+        rc = index_get_appdata(idx, t->fapi.ctx, path, &appdata);
+        profile_end(&span);
         if (rc) {
             LOGE("Getting FAPI seal appdata failed.");
             goto error;
         }
 
-        t->fapi.soauthsalt = twistbin_new(appdata, strlen((char *)appdata));
+        t->fapi.soauthsalt = twistbin_new(appdata, strlen(appdata));
         if (!t->fapi.soauthsalt) {
             LOGE("OOM");
-            Fapi_Free(appdata);
+            twist_free(appdata);
             goto error;
         }
 
+        /* objects still kept in the SO seal by an older version */
+        size_t appdata_len = twist_len(appdata);
         size_t offset = 0;
-        safe_add(offset, strlen((char *)appdata), 1);
-        uint8_t *yaml = &appdata[offset];
-
-        while ((size_t)(yaml - appdata) < appdata_len) {
-            LOGV("Current tobj at offset %zi / %zi is: %s",
-                 yaml - appdata, appdata_len, yaml);
-
-            if (((size_t)(yaml - appdata) > appdata_len - 9) ||
-                    (strlen((char*)yaml) < 10)) {
-                LOGE("Incomplete tobj in appdata");
-                Fapi_Free(appdata);
-                goto error;
-            }
-
-            tobject *tobj = tobject_new();
-            if (!tobj) {
-                LOGE("oom");
-                Fapi_Free(appdata);
-                goto error;
-            }
-
-            if (sscanf((char*)yaml, "%08x:", &tobj->id) != 1) {
-                LOGE("Could not scan tobj id");
-                free(tobj);
-                Fapi_Free(appdata);
-                goto error;
-            }
-
-            maxobjectid = (maxobjectid > tobj->id)? maxobjectid : tobj->id;
-
-            if (!parse_attributes_from_string(&yaml[9], strlen((char*)&yaml[9]),
-                                              &tobj->attrs)) {
-                LOGE("Could not parse FAPI attrs, got: \"%s\"", yaml);
-                free(tobj);
-                Fapi_Free(appdata);
-                goto error;
-            }
+        safe_add(offset, strlen(appdata), 1);
+        size_t legacy = 0;
+        rv = records_load(t, (const uint8_t *)appdata, appdata_len, offset,
+                false, &legacy);
+        if (rv != CKR_OK) {
+            twist_free(appdata);
+            goto error;
+        }
 
-            rv = object_init_from_attrs(tobj);
-            if (rv != CKR_OK) {
-                LOGE("Object initialization failed");
-                free(tobj);
-                Fapi_Free(appdata);
-                goto error;
-            }
+        rv = chunks_load(idx, t, chunks, nchunks, legacy > 0);
+        if (rv != CKR_OK) {
+            twist_free(appdata);
+            goto error;
+        }
 
-            rv = token_add_tobject_last(t, tobj);
+        if (legacy) {
+            rv = records_migrate(t, path, (const uint8_t *)appdata, appdata_len);
             if (rv != CKR_OK) {
-                LOGE("Failed to initialize tobject from FAPI");
-                free(tobj);
-                Fapi_Free(appdata);
+                twist_free(appdata);
                 goto error;
             }
-
-            size_t offset = 0;
-            safe_add(offset, strlen((char *)yaml), 1);
-            yaml += offset;
-            LOGV("\nCurrent next is: %zi / %zi", yaml - appdata, appdata_len);
         }
-        Fapi_Free(appdata);
+        twist_free(appdata);
+        rv = CKR_GENERAL_ERROR;
 
         t->config.is_initialized = true;
 
         /* Initialize the User PIN area. */
         /*********************************/
-        path = tss_path_from_id(t->id, "usr");
-        if (!path) {
+        char *usrpath = path_sibling(path, "usr", t->id);
+        if (!usrpath) {
             LOGE("No path constructed.");
             goto error;
         }
 
-        rc = Fapi_GetAppData(t->fapi.ctx, path, &appdata, NULL);
-        free(path);
+        /* the listing is authoritative, so a missing seal costs no lookup */
+        if (!pathlist_has(pathlist, usrpath)) {
+            LOGV("No user pin found for token %08x.", t->id);
+            free(usrpath);
+            continue;
+        }
+
+        rc = index_get_appdata(idx, t->fapi.ctx, usrpath, &appdata);
+        free(usrpath);
         if (rc == TSS2_FAPI_RC_KEY_NOT_FOUND) {
             LOGV("No user pin found for token %08x.", t->id);
             continue;
@@ -440,8 +1116,8 @@ CK_RV backend_fapi_add_tokens(token *tok, size_t *len) {
             goto error;
         }
 
-        t->fapi.userauthsalt = twistbin_new(appdata, strlen((char *)appdata));
-        Fapi_Free(appdata);
+        t->fapi.userauthsalt = twistbin_new(appdata, strlen(appdata));
+        twist_free(appdata);
         if (!t->fapi.userauthsalt) {
             LOGE("OOM");
             goto error;
@@ -451,7 +1127,11 @@ CK_RV backend_fapi_add_tokens(token *tok, size_t *len) {
     rv = CKR_OK;
 
 out:
-    Fapi_Free(pathlist);
+    free(chunks);
+    free(chunkpaths);
+    free(walk);
+    twist_free(pathlist);
+    fapi_index_close(idx);
     return rv;
 
 error:
@@ -530,72 +1210,26 @@ CK_RV backend_fapi_init_user(token *t, const twist sealdata,
  *
  * See backend_add_object()
  *
- * The object is added to the AppData of the token object
- * in the FAPI keystore. The different objects are separated
- * by a \0 delimiter. The first element of the AppData is the
- * salthex, so the first object starts after the first \0.
+ * The object is added to the chunk its id belongs to, see
+ * FAPI_CHUNK_OBJECTS.
  */
 CK_RV backend_fapi_add_object(token *t, tobject *tobj) {
-    TSS2_RC rc;
 
     LOGV("Adding object to fapi token %i", t->id);
 
-    char *path = tss_path_from_id(t->id, "so");
-    if (!path) {
-        LOGE("No path constructed.");
-        return CKR_GENERAL_ERROR;
-    }
-
     safe_adde(maxobjectid, 1);
     tobj->id = maxobjectid;
 
     char *attrs = emit_attributes_to_string(tobj->attrs);
     if (!attrs) {
         LOGE("OOM");
-        free(path);
         return CKR_GENERAL_ERROR;
     }
 
-    uint8_t *appdata;
-    size_t appdata_len;
-    rc = Fapi_GetAppData(t->fapi.ctx, path, &appdata, &appdata_len);
-    if (rc) {
-        LOGE("Getting FAPI seal appdata failed.");
-        goto error;
-    }
-
-    size_t newappdata_len = appdata_len;
-    safe_adde(newappdata_len, 9); /* id as 8byte hex and ':' */
-    safe_adde(newappdata_len, strlen(attrs));
-    safe_adde(newappdata_len, 1); /* terminating '\0' */
-    uint8_t *newappdata = malloc(newappdata_len);
-    if (!newappdata) {
-        LOGE("OOM");
-        Fapi_Free(appdata);
-        goto error;
-    }
-
-    memcpy(&newappdata[0], &appdata[0], appdata_len);
-    sprintf((char*)&newappdata[appdata_len], "%08x:", tobj->id);
-    memcpy(&newappdata[appdata_len + 9], attrs, strlen(attrs));
-    newappdata[newappdata_len - 1] = '\0';
-    Fapi_Free(appdata);
-
-    rc = Fapi_SetAppData(t->fapi.ctx, path, newappdata, newappdata_len);
-    free(newappdata);
-    if (rc) {
-        LOGE("Getting FAPI seal appdata failed.");
-        goto error;
-    }
-
-    free(path);
+    CK_RV rv = chunk_put(t, tobj->id, attrs, false);
     free(attrs);
-    return CKR_OK;
 
-error:
-    free(path);
-    free(attrs);
-    return CKR_GENERAL_ERROR;
+    return rv;
 }
 
 /** Given a token and tobject, will persist the new attributes in fapi backend.
@@ -603,88 +1237,17 @@ error:
  * see backend_update_tobject_attrs().
  */
 CK_RV backend_fapi_update_tobject_attrs(token *t, tobject *tobj, attr_list *attrlist) {
-    TSS2_RC rc;
-
-    char *path = tss_path_from_id(t->id, "so");
-    if (!path) {
-        LOGE("No path constructed.");
-        return CKR_GENERAL_ERROR;
-    }
-
-    uint8_t *appdata;
-    size_t appdata_len;
-    rc = Fapi_GetAppData(t->fapi.ctx, path, &appdata, &appdata_len);
-    if (rc) {
-        LOGE("Getting FAPI seal appdata failed.");
-        goto error;
-    }
-
-    /* Skip over soauthvalue (the first element of appData) */
-    size_t tobj_start = strlen((char*)appdata) + 1;
-
-    /* Find the offset of the tobj to delete */
-    while (1) {
-        if (tobj_start + 9 >= appdata_len) {
-            LOGE("tobj not found in appdata.");
-            goto error;
-        }
-
-        unsigned id;
-        if (sscanf((char*)&appdata[tobj_start], "%08x:", &id) != 1) {
-            LOGE("bad tobject.");
-            goto error;
-        }
-
-        if (id == tobj->id) {
-            LOGV("Object found at offset %zi.", tobj_start);
-            break;
-        }
-
-        safe_adde(tobj_start, strlen((char*)&appdata[tobj_start]));
-        safe_adde(tobj_start, 1);
-    }
-
-    size_t tobj_len = strlen((char*)&appdata[tobj_start]);
 
     char *attrs = emit_attributes_to_string(attrlist);
     if (!attrs) {
         LOGE("OOM");
-        free(path);
         return CKR_GENERAL_ERROR;
     }
 
-    size_t newappdata_len = appdata_len - tobj_len;
-    safe_adde(newappdata_len, 9); /* id as 8byte hex and ':' */
-    safe_adde(newappdata_len, strlen(attrs));
-    uint8_t *newappdata = malloc(newappdata_len);
-    if (!newappdata) {
-        LOGE("OOM");
-        Fapi_Free(appdata);
-        goto error;
-    }
-
-    memcpy(&newappdata[0], &appdata[0], tobj_start);
-    sprintf((char*)&newappdata[tobj_start], "%08x:%s", tobj->id, attrs);
-    memcpy(&newappdata[tobj_start + 9 + strlen(attrs) + 1],
-           &appdata[tobj_start + tobj_len + 1],
-           appdata_len - tobj_start - tobj_len - 1);
-    newappdata[newappdata_len - 1] = '\0';
-
-    Fapi_Free(appdata);
-
-    rc = Fapi_SetAppData(t->fapi.ctx, path, newappdata, newappdata_len);
-    free(newappdata);
-    if (rc) {
-        LOGE("Getting FAPI seal appdata failed.");
-        goto error;
-    }
-
-    free(path);
-    return CKR_OK;
+    CK_RV rv = chunk_put(t, tobj->id, attrs, true);
+    free(attrs);
 
-error:
-    free(path);
-    return CKR_GENERAL_ERROR;
+    return rv;
 }
 
 /** Removes a tobject from the fapi backend.
@@ -692,65 +1255,8 @@ error:
  * See backend_rm_tobject().
  */
 CK_RV backend_fapi_rm_tobject(token *t, tobject *tobj) {
-    TSS2_RC rc;
-
-    char *path = tss_path_from_id(t->id, "so");
-    if (!path) {
-        LOGE("No path constructed.");
-        return CKR_GENERAL_ERROR;
-    }
-
-    uint8_t *appdata;
-    size_t appdata_len;
-    rc = Fapi_GetAppData(t->fapi.ctx, path, &appdata, &appdata_len);
-    if (rc) {
-        LOGE("Getting FAPI seal appdata failed.");
-        goto error;
-    }
-
-    /* Skip over soauthvalue (the first element of appData) */
-    size_t tobj_start = strlen((char*)appdata) + 1;
-
-    /* Find the offset of the tobj to delete */
-    while (1) {
-        if (tobj_start + 9 >= appdata_len) {
-            LOGE("tobj not found in appdata.");
-            goto error;
-        }
-
-        unsigned id;
-        if (sscanf((char*)&appdata[tobj_start], "%08x:", &id) != 1) {
-            LOGE("bad tobject.");
-            goto error;
-        }
-
-        if (id == tobj->id) {
-            LOGV("Object found at offset %zi.", tobj_start);
-            break;
-        }
-
-        safe_adde(tobj_start, strlen((char*)&appdata[tobj_start]));
-        safe_adde(tobj_start, 1);
-    }
-
-    size_t tobj_len = strlen((char*)&appdata[tobj_start]);
-    memmove(&appdata[tobj_start - 1], &appdata[tobj_start + tobj_len],
-            appdata_len - tobj_start - tobj_len);
-    appdata_len -= tobj_len + 1;
-
-    rc = Fapi_SetAppData(t->fapi.ctx, path, appdata, appdata_len);
-    Fapi_Free(appdata);
-    if (rc) {
-        LOGE("Getting FAPI seal appdata failed.");
-        goto error;
-    }
-
-    free(path);
-    return CKR_OK;
 
-error:
-    free(path);
-    return CKR_GENERAL_ERROR;
+    return chunk_remove(t, tobj->id);
 }
 
 struct authtable {
@@ -998,6 +1504,18 @@ void backend_fapi_ctx_free(token *t) {
 	LOGV("FAPI NOT ENABLED");
 }
 
+CK_RV backend_fapi_after_fork(void) {
+
+	return CKR_OK;
+}
+
+CK_RV backend_fapi_token_after_fork(token *t) {
+
+	UNUSED(t);
+	LOGE("FAPI NOT ENABLED");
+	return CKR_GENERAL_ERROR;
+}
+
 CK_RV backend_fapi_create_token_seal(token *t, const twist hexwrappingkey,
                        const twist newauth, const twist newsalthex) {
 	UNUSED(t);
@@ -15,6 +15,8 @@ CK_RV backend_fapi_destroy(void);
 
 CK_RV backend_fapi_ctx_new(token *t);
 void backend_fapi_ctx_free(token *t);
+CK_RV backend_fapi_after_fork(void);
+CK_RV backend_fapi_token_after_fork(token *t);
 
 CK_RV backend_fapi_create_token_seal(token *t, const twist hexwrappingkey,
                        const twist newauth, const twist newsalthex);
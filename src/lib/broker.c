@@ -0,0 +1,1440 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#define _GNU_SOURCE
+#include "config.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "broker.h"
+#include "log.h"
+
+/*
+ * Wire format.
+ */
+
+static bool msg_reserve(broker_msg *m, size_t more) {
+
+    if (m->bad) {
+        return false;
+    }
+
+    if (more > BROKER_MAX_FRAME - m->len) {
+        m->bad = true;
+        return false;
+    }
+
+    if (m->len + more <= m->cap) {
+        return true;
+    }
+
+    size_t cap = m->cap ? m->cap : 256;
+    while (cap < m->len + more) {
+        cap *= 2;
+    }
+
+    uint8_t *data = realloc(m->data, cap);
+    if (!data) {
+        m->bad = true;
+        return false;
+    }
+
+    m->data = data;
+    m->cap = cap;
+    return true;
+}
+
+static void msg_put(broker_msg *m, const void *data, size_t len) {
+
+    if (!msg_reserve(m, len)) {
+        return;
+    }
+
+    if (len) {
+        memcpy(&m->data[m->len], data, len);
+    }
+    m->len += len;
+}
+
+static const uint8_t *msg_get(broker_msg *m, size_t len) {
+
+    if (m->bad || len > m->len - m->off) {
+        m->bad = true;
+        return NULL;
+    }
+
+    const uint8_t *p = &m->data[m->off];
+    m->off += len;
+    return p;
+}
+
+static void put_u8(broker_msg *m, uint8_t v) {
+    msg_put(m, &v, sizeof(v));
+}
+
+static uint8_t get_u8(broker_msg *m) {
+
+    const uint8_t *p = msg_get(m, 1);
+    return p ? *p : 0;
+}
+
+void broker_msg_reset(broker_msg *m) {
+    m->len = 0;
+    m->off = 0;
+    m->bad = false;
+}
+
+void broker_msg_free(broker_msg *m) {
+    free(m->data);
+    memset(m, 0, sizeof(*m));
+}
+
+void broker_put_ulong(broker_msg *m, CK_ULONG v) {
+
+    uint64_t v64 = v;
+    msg_put(m, &v64, sizeof(v64));
+}
+
+CK_ULONG broker_get_ulong(broker_msg *m) {
+
+    uint64_t v64 = 0;
+    const uint8_t *p = msg_get(m, sizeof(v64));
+    if (p) {
+        memcpy(&v64, p, sizeof(v64));
+    }
+
+    return (CK_ULONG)v64;
+}
+
+void broker_put_bytes(broker_msg *m, const void *data, CK_ULONG len) {
+
+    put_u8(m, data != NULL);
+    if (data) {
+        broker_put_ulong(m, len);
+        msg_put(m, data, len);
+    }
+}
+
+uint8_t *broker_get_bytes(broker_msg *m, CK_ULONG *len) {
+
+    *len = 0;
+    if (!get_u8(m)) {
+        return NULL;
+    }
+
+    CK_ULONG l = broker_get_ulong(m);
+    const uint8_t *p = msg_get(m, l);
+    if (!p) {
+        return NULL;
+    }
+
+    *len = l;
+    return (uint8_t *)p;
+}
+
+void broker_put_out(broker_msg *m, const void *data, CK_ULONG len) {
+
+    put_u8(m, data != NULL);
+    broker_put_ulong(m, len);
+}
+
+bool broker_get_out(broker_msg *m, CK_ULONG *len) {
+
+    bool has = get_u8(m);
+    *len = broker_get_ulong(m);
+    return has;
+}
+
+/* templates of templates hold pointers, they cannot cross the socket */
+static bool attr_nested(CK_ATTRIBUTE_TYPE type) {
+    return type == CKA_WRAP_TEMPLATE
+        || type == CKA_UNWRAP_TEMPLATE
+        || type == CKA_DERIVE_TEMPLATE;
+}
+
+bool broker_put_attrs(broker_msg *m, CK_ATTRIBUTE_PTR templ, CK_ULONG count) {
+
+    if (count && !templ) {
+        return false;
+    }
+
+    broker_put_ulong(m, count);
+
+    CK_ULONG i;
+    for (i=0; i < count; i++) {
+        if (attr_nested(templ[i].type)) {
+            return false;
+        }
+        broker_put_ulong(m, templ[i].type);
+        broker_put_bytes(m, templ[i].pValue, templ[i].ulValueLen);
+    }
+
+    return true;
+}
+
+CK_RV broker_get_attrs(broker_msg *m, CK_ATTRIBUTE_PTR *templ, CK_ULONG *count) {
+
+    *templ = NULL;
+    *count = broker_get_ulong(m);
+    /* every attribute takes at least 9 bytes */
+    if (m->bad || *count > (m->len - m->off) / 9) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    if (!*count) {
+        return CKR_OK;
+    }
+
+    CK_ATTRIBUTE_PTR t = calloc(*count, sizeof(*t));
+    if (!t) {
+        return CKR_HOST_MEMORY;
+    }
+
+    CK_ULONG i;
+    for (i=0; i < *count; i++) {
+        t[i].type = broker_get_ulong(m);
+        t[i].pValue = broker_get_bytes(m, &t[i].ulValueLen);
+    }
+
+    if (m->bad) {
+        free(t);
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    *templ = t;
+    return CKR_OK;
+}
+
+/* how a mechanism parameter travels */
+enum {
+    mech_param_raw,
+    mech_param_oaep,
+    mech_param_ecdh,
+};
+
+bool broker_put_mech(broker_msg *m, CK_MECHANISM_PTR mech) {
+
+    if (!mech) {
+        return false;
+    }
+
+    broker_put_ulong(m, mech->mechanism);
+
+    if (mech->mechanism == CKM_RSA_PKCS_OAEP
+            && mech->pParameter
+            && mech->ulParameterLen == sizeof(CK_RSA_PKCS_OAEP_PARAMS)) {
+        CK_RSA_PKCS_OAEP_PARAMS *p = mech->pParameter;
+        put_u8(m, mech_param_oaep);
+        broker_put_ulong(m, p->hash_alg);
+        broker_put_ulong(m, p->mgf);
+        broker_put_ulong(m, p->source);
+        broker_put_bytes(m, p->source_data, p->source_data_len);
+    } else if ((mech->mechanism == CKM_ECDH1_DERIVE
+                || mech->mechanism == CKM_ECDH1_COFACTOR_DERIVE)
+            && mech->pParameter
+            && mech->ulParameterLen == sizeof(CK_ECDH1_DERIVE_PARAMS)) {
+        CK_ECDH1_DERIVE_PARAMS *p = mech->pParameter;
+        put_u8(m, mech_param_ecdh);
+        broker_put_ulong(m, p->kdf);
+        broker_put_bytes(m, p->shared_data, p->shared_data_len);
+        broker_put_bytes(m, p->public_data, p->public_data_len);
+    } else {
+        put_u8(m, mech_param_raw);
+        broker_put_bytes(m, mech->pParameter, mech->ulParameterLen);
+    }
+
+    return true;
+}
+
+CK_RV broker_get_mech(broker_msg *m, broker_mech *mech) {
+
+    memset(mech, 0, sizeof(*mech));
+    mech->mech.mechanism = broker_get_ulong(m);
+
+    switch (get_u8(m)) {
+    case mech_param_oaep: {
+        CK_RSA_PKCS_OAEP_PARAMS *p = &mech->params.oaep;
+        p->hash_alg = broker_get_ulong(m);
+        p->mgf = broker_get_ulong(m);
+        p->source = broker_get_ulong(m);
+        p->source_data = broker_get_bytes(m, &p->source_data_len);
+        mech->mech.pParameter = p;
+        mech->mech.ulParameterLen = sizeof(*p);
+    } break;
+    case mech_param_ecdh: {
+        CK_ECDH1_DERIVE_PARAMS *p = &mech->params.ecdh;
+        p->kdf = broker_get_ulong(m);
+        p->shared_data = broker_get_bytes(m, &p->shared_data_len);
+        p->public_data = broker_get_bytes(m, &p->public_data_len);
+        mech->mech.pParameter = p;
+        mech->mech.ulParameterLen = sizeof(*p);
+    } break;
+    case mech_param_raw:
+        mech->mech.pParameter = broker_get_bytes(m, &mech->mech.ulParameterLen);
+        break;
+    default:
+        m->bad = true;
+    }
+
+    return m->bad ? CKR_ARGUMENTS_BAD : CKR_OK;
+}
+
+static bool write_all(int fd, const void *buf, size_t len) {
+
+    const uint8_t *p = buf;
+    while (len) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static bool read_all(int fd, void *buf, size_t len) {
+
+    uint8_t *p = buf;
+    while (len) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+CK_RV broker_send(int fd, broker_msg *m) {
+
+    if (m->bad) {
+        LOGE("Broker message over %u bytes", BROKER_MAX_FRAME);
+        return CKR_DEVICE_MEMORY;
+    }
+
+    uint32_t len = m->len;
+    if (!write_all(fd, &len, sizeof(len))
+            || !write_all(fd, m->data, m->len)) {
+        LOGV("Broker send failed: %s", strerror(errno));
+        return CKR_DEVICE_ERROR;
+    }
+
+    return CKR_OK;
+}
+
+CK_RV broker_recv(int fd, broker_msg *m) {
+
+    broker_msg_reset(m);
+
+    uint32_t len = 0;
+    if (!read_all(fd, &len, sizeof(len))) {
+        return CKR_DEVICE_ERROR;
+    }
+
+    if (len > BROKER_MAX_FRAME) {
+        LOGE("Broker frame of %u bytes is over the limit", len);
+        return CKR_DEVICE_MEMORY;
+    }
+
+    if (!msg_reserve(m, len)) {
+        return CKR_HOST_MEMORY;
+    }
+
+    if (!read_all(fd, m->data, len)) {
+        return CKR_DEVICE_ERROR;
+    }
+
+    m->len = len;
+    return CKR_OK;
+}
+
+bool broker_socket_path(char *buf, size_t len) {
+
+    const char *env = getenv(BROKER_ENV_VAR);
+    int n;
+    if (env && env[0] && strcmp(env, "1")) {
+        n = snprintf(buf, len, "%s", env);
+    } else {
+        /* the runtime dir is private to the user, /tmp relies on the peer checks */
+        const char *dir = getenv("XDG_RUNTIME_DIR");
+        n = dir && dir[0] ?
+                snprintf(buf, len, "%s/tpm2-pkcs11-broker.sock", dir) :
+                snprintf(buf, len, "/tmp/tpm2-pkcs11-broker-%u.sock",
+                        (unsigned)geteuid());
+    }
+
+    return n > 0 && (size_t)n < len;
+}
+
+bool broker_peer_trusted(int fd) {
+
+    uid_t uid;
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+        LOGE("Could not get the broker peer credentials: %s", strerror(errno));
+        return false;
+    }
+    uid = cred.uid;
+#else
+    gid_t gid;
+    if (getpeereid(fd, &uid, &gid)) {
+        LOGE("Could not get the broker peer credentials: %s", strerror(errno));
+        return false;
+    }
+#endif
+
+    if (uid != geteuid()) {
+        LOGE("Broker peer runs as uid %u, expected %u", (unsigned)uid,
+                (unsigned)geteuid());
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * The serving side.
+ *
+ * The library in the daemon is one PKCS11 application, so each client
+ * application is tracked here: the sessions it opened, which it alone may
+ * use and which are closed when it finalizes or goes away, and the slots
+ * it logged in on, so one client logging out leaves the others logged in.
+ */
+
+typedef struct broker_app broker_app;
+struct broker_app {
+    uint64_t id;
+    unsigned refs;
+    CK_SESSION_HANDLE *sessions;
+    size_t nsessions;
+    size_t sessions_cap;
+    CK_SLOT_ID *logins;
+    size_t nlogins;
+    size_t logins_cap;
+    broker_app *next;
+};
+
+struct broker_server {
+    CK_FUNCTION_LIST_PTR p11;
+    pthread_mutex_t lock;
+    broker_app *apps;
+};
+
+broker_server *broker_server_new(CK_FUNCTION_LIST_PTR p11) {
+
+    broker_server *s = calloc(1, sizeof(*s));
+    if (!s) {
+        return NULL;
+    }
+
+    s->p11 = p11;
+    pthread_mutex_init(&s->lock, NULL);
+
+    return s;
+}
+
+void broker_server_free(broker_server *s) {
+
+    if (!s) {
+        return;
+    }
+
+    while (s->apps) {
+        broker_app *next = s->apps->next;
+        free(s->apps->sessions);
+        free(s->apps->logins);
+        free(s->apps);
+        s->apps = next;
+    }
+
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+static bool ulong_list_add(CK_ULONG **list, size_t *n, size_t *cap, CK_ULONG v) {
+
+    if (*n == *cap) {
+        size_t newcap = *cap ? *cap * 2 : 8;
+        CK_ULONG *l = realloc(*list, newcap * sizeof(*l));
+        if (!l) {
+            return false;
+        }
+        *list = l;
+        *cap = newcap;
+    }
+
+    (*list)[(*n)++] = v;
+    return true;
+}
+
+static bool ulong_list_remove(CK_ULONG *list, size_t *n, CK_ULONG v) {
+
+    size_t i;
+    for (i=0; i < *n; i++) {
+        if (list[i] == v) {
+            list[i] = list[--(*n)];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool ulong_list_has(const CK_ULONG *list, size_t n, CK_ULONG v) {
+
+    size_t i;
+    for (i=0; i < n; i++) {
+        if (list[i] == v) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static broker_app *app_get(broker_server *s, uint64_t id) {
+
+    pthread_mutex_lock(&s->lock);
+
+    broker_app *app = s->apps;
+    while (app && app->id != id) {
+        app = app->next;
+    }
+
+    if (!app) {
+        app = calloc(1, sizeof(*app));
+        if (app) {
+            app->id = id;
+            app->next = s->apps;
+            s->apps = app;
+        }
+    }
+
+    if (app) {
+        app->refs++;
+    }
+
+    pthread_mutex_unlock(&s->lock);
+
+    return app;
+}
+
+static bool app_owns(broker_server *s, broker_app *app, CK_SESSION_HANDLE session) {
+
+    pthread_mutex_lock(&s->lock);
+    bool owns = ulong_list_has(app->sessions, app->nsessions, session);
+    pthread_mutex_unlock(&s->lock);
+
+    return owns;
+}
+
+/*
+ * Closes every session of an application, the library logs a token out
+ * when its last session closes.
+ */
+static void app_close_sessions(broker_server *s, broker_app *app, CK_SLOT_ID *slot) {
+
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+        size_t i;
+        for (i=0; i < app->nsessions; i++) {
+            CK_SESSION_INFO info;
+            if (slot && (s->p11->C_GetSessionInfo(app->sessions[i], &info) != CKR_OK
+                    || info.slotID != *slot)) {
+                continue;
+            }
+            session = app->sessions[i];
+            app->sessions[i] = app->sessions[--app->nsessions];
+            break;
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        if (session == CK_INVALID_HANDLE) {
+            break;
+        }
+
+        CK_RV rv = s->p11->C_CloseSession(session);
+        if (rv != CKR_OK) {
+            LOGV("Closing session 0x%lx of a broker client: 0x%lx", session, rv);
+        }
+    }
+
+    if (!slot) {
+        pthread_mutex_lock(&s->lock);
+        app->nlogins = 0;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+static void app_put(broker_server *s, broker_app *app) {
+
+    pthread_mutex_lock(&s->lock);
+    bool last = --app->refs == 0;
+    pthread_mutex_unlock(&s->lock);
+
+    if (!last) {
+        return;
+    }
+
+    app_close_sessions(s, app, NULL);
+
+    pthread_mutex_lock(&s->lock);
+    /* a new connection of the same application may have found it meanwhile */
+    if (app->refs) {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+
+    broker_app **p = &s->apps;
+    while (*p != app) {
+        p = &(*p)->next;
+    }
+    *p = app->next;
+    pthread_mutex_unlock(&s->lock);
+
+    free(app->sessions);
+    free(app->logins);
+    free(app);
+}
+
+static CK_RV session_slot(broker_server *s, CK_SESSION_HANDLE session, CK_SLOT_ID *slot) {
+
+    CK_SESSION_INFO info;
+    CK_RV rv = s->p11->C_GetSessionInfo(session, &info);
+    if (rv == CKR_OK) {
+        *slot = info.slotID;
+    }
+
+    return rv;
+}
+
+/*
+ * The per call handlers. Each reads its arguments from req and writes the
+ * CK_RV and outputs to rep.
+ */
+typedef struct serve_ctx serve_ctx;
+struct serve_ctx {
+    broker_server *s;
+    broker_app *app;
+    broker_msg *req;
+    broker_msg *rep;
+};
+
+/* reads a session argument the client application must own */
+static CK_RV get_session(serve_ctx *c, CK_SESSION_HANDLE *session) {
+
+    *session = broker_get_ulong(c->req);
+    if (c->req->bad) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    return app_owns(c->s, c->app, *session) ? CKR_OK : CKR_SESSION_HANDLE_INVALID;
+}
+
+/* an output buffer of the size the client has, NULL if it has none */
+static CK_RV get_out_buffer(serve_ctx *c, uint8_t **buf, CK_ULONG *len) {
+
+    *buf = NULL;
+    bool has = broker_get_out(c->req, len);
+    if (c->req->bad) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    if (!has) {
+        return CKR_OK;
+    }
+
+    /* what does not fit a reply cannot be returned anyway */
+    if (*len > BROKER_MAX_FRAME / 2) {
+        *len = BROKER_MAX_FRAME / 2;
+    }
+
+    *buf = malloc(*len ? *len : 1);
+    return *buf ? CKR_OK : CKR_HOST_MEMORY;
+}
+
+static void put_out_buffer(serve_ctx *c, CK_RV rv, uint8_t *buf, CK_ULONG len) {
+
+    broker_put_ulong(c->rep, rv);
+    broker_put_ulong(c->rep, len);
+    broker_put_bytes(c->rep, rv == CKR_OK ? buf : NULL, len);
+}
+
+
+/* a list of CK_ULONG, the client sends whether it has one and its count */
+static CK_RV get_out_list(serve_ctx *c, CK_ULONG **list, CK_ULONG *count) {
+
+    *list = NULL;
+    bool has = broker_get_out(c->req, count);
+    if (c->req->bad) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    if (!has) {
+        return CKR_OK;
+    }
+
+    if (*count > BROKER_MAX_FRAME / 2 / sizeof(uint64_t)) {
+        *count = BROKER_MAX_FRAME / 2 / sizeof(uint64_t);
+    }
+
+    *list = calloc(*count ? *count : 1, sizeof(**list));
+    return *list ? CKR_OK : CKR_HOST_MEMORY;
+}
+
+static void put_out_list(serve_ctx *c, CK_RV rv, CK_ULONG *list, CK_ULONG count) {
+
+    broker_put_ulong(c->rep, rv);
+    broker_put_ulong(c->rep, count);
+
+    bool has = list && rv == CKR_OK;
+    broker_put_ulong(c->rep, has);
+    CK_ULONG i;
+    for (i=0; has && i < count; i++) {
+        broker_put_ulong(c->rep, list[i]);
+    }
+}
+
+static void serve_finalize(serve_ctx *c) {
+
+    app_close_sessions(c->s, c->app, NULL);
+    broker_put_ulong(c->rep, CKR_OK);
+}
+
+static void serve_get_info(serve_ctx *c) {
+
+    CK_INFO info = { 0 };
+    CK_RV rv = c->s->p11->C_GetInfo(&info);
+    broker_put_ulong(c->rep, rv);
+    broker_put_bytes(c->rep, &info, sizeof(info));
+}
+
+static void serve_get_slot_list(serve_ctx *c) {
+
+    CK_BBOOL present = broker_get_ulong(c->req);
+    CK_ULONG *list = NULL;
+    CK_ULONG count = 0;
+    CK_RV rv = get_out_list(c, &list, &count);
+    if (rv == CKR_OK) {
+        rv = c->s->p11->C_GetSlotList(present, list, &count);
+    }
+
+    put_out_list(c, rv, list, count);
+    free(list);
+}
+
+static void serve_get_slot_info(serve_ctx *c) {
+
+    CK_SLOT_ID slot = broker_get_ulong(c->req);
+    CK_SLOT_INFO info = { 0 };
+    CK_RV rv = c->s->p11->C_GetSlotInfo(slot, &info);
+    broker_put_ulong(c->rep, rv);
+    broker_put_bytes(c->rep, &info, sizeof(info));
+}
+
+static void serve_get_token_info(serve_ctx *c) {
+
+    CK_SLOT_ID slot = broker_get_ulong(c->req);
+    CK_TOKEN_INFO info = { 0 };
+    CK_RV rv = c->s->p11->C_GetTokenInfo(slot, &info);
+    broker_put_ulong(c->rep, rv);
+    broker_put_bytes(c->rep, &info, sizeof(info));
+}
+
+static void serve_wait_for_slot_event(serve_ctx *c) {
+
+    CK_FLAGS flags = broker_get_ulong(c->req);
+    CK_SLOT_ID slot = 0;
+    CK_RV rv = c->s->p11->C_WaitForSlotEvent(flags, &slot, NULL);
+    broker_put_ulong(c->rep, rv);
+    broker_put_ulong(c->rep, slot);
+}
+
+static void serve_get_mechanism_list(serve_ctx *c) {
+
+    CK_SLOT_ID slot = broker_get_ulong(c->req);
+    CK_ULONG *list = NULL;
+    CK_ULONG count = 0;
+    CK_RV rv = get_out_list(c, &list, &count);
+    if (rv == CKR_OK) {
+        rv = c->s->p11->C_GetMechanismList(slot, list, &count);
+    }
+
+    put_out_list(c, rv, list, count);
+    free(list);
+}
+
+static void serve_get_mechanism_info(serve_ctx *c) {
+
+    CK_SLOT_ID slot = broker_get_ulong(c->req);
+    CK_MECHANISM_TYPE type = broker_get_ulong(c->req);
+    CK_MECHANISM_INFO info = { 0 };
+    CK_RV rv = c->s->p11->C_GetMechanismInfo(slot, type, &info);
+    broker_put_ulong(c->rep, rv);
+    broker_put_bytes(c->rep, &info, sizeof(info));
+}
+
+static void serve_init_token(serve_ctx *c) {
+
+    CK_SLOT_ID slot = broker_get_ulong(c->req);
+    CK_ULONG pin_len = 0;
+    CK_ULONG label_len = 0;
+    uint8_t *pin = broker_get_bytes(c->req, &pin_len);
+    uint8_t *label = broker_get_bytes(c->req, &label_len);
+
+    CK_RV rv = CKR_ARGUMENTS_BAD;
+    if (!c->req->bad && (!label || label_len == 32)) {
+        rv = c->s->p11->C_InitToken(slot, pin, pin_len, label);
+    }
+
+    broker_put_ulong(c->rep, rv);
+}
+
+static void serve_init_pin(serve_ctx *c) {
+
+    CK_SESSION_HANDLE session;
+    CK_RV rv = get_session(c, &session);
+    CK_ULONG pin_len = 0;
+    uint8_t *pin = broker_get_bytes(c->req, &pin_len);
+    if (rv == CKR_OK) {
+        rv = c->s->p11->C_InitPIN(session, pin, pin_len);
+    }
+
+    broker_put_ulong(c->rep, rv);
+}
+
+static void serve_set_pin(serve_ctx *c) {
+
+    CK_SESSION_HANDLE session;
+    CK_RV rv = get_session(c, &session);
+    CK_ULONG old_len = 0;
+    CK_ULONG new_len = 0;
+    uint8_t *old_pin = broker_get_bytes(c->req, &old_len);
+    uint8_t *new_pin = broker_get_bytes(c->req, &new_len);
+    if (rv == CKR_OK) {
+        rv = c->s->p11->C_SetPIN(session, old_pin, old_len, new_pin, new_len);
+    }
+
+    broker_put_ulong(c->rep, rv);
+}
+
+static void serve_open_session(serve_ctx *c) {
+
+    CK_SLOT_ID slot = broker_get_ulong(c->req);
+    CK_FLAGS flags = broker_get_ulong(c->req);
+    CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+
+    /* notify callbacks live in the client, they are never called */
+    CK_RV rv = c->s->p11->C_OpenSession(slot, flags, NULL, NULL, &session);
+    if (rv == CKR_OK) {
+        pthread_mutex_lock(&c->s->lock);
+        bool added = ulong_list_add(&c->app->sessions, &c->app->nsessions,
+                &c->app->sessions_cap, session);
+        pthread_mutex_unlock(&c->s->lock);
+        if (!added) {
+            c->s->p11->C_CloseSession(session);
+            rv = CKR_HOST_MEMORY;
+        }
+    }
+
+    broker_put_ulong(c->rep, rv);
+    broker_put_ulong(c->rep, session);
+}
+
+static void serve_close_session(serve_ctx *c) {
+
+    CK_SESSION_HANDLE session;
+    CK_RV rv = get_session(c, &session);
+    if (rv == CKR_OK) {
+        pthread_mutex_lock(&c->s->lock);
+        ulong_list_remove(c->app->sessions, &c->app->nsessions, session);
+        pthread_mutex_unlock(&c->s->lock);
+        rv = c->s->p11->C_CloseSession(session);
+    }
+
+    broker_put_ulong(c->rep, rv);
+}
+
+/* only the sessions of this client, the others are none of its business */
+static void serve_close_all_sessions(serve_ctx *c) {
+
+    CK_SLOT_ID slot = broker_get_ulong(c->req);
+    CK_SLOT_INFO info;
+    CK_RV rv = c->s->p11->C_GetSlotInfo(slot, &info);
+    if (rv == CKR_OK) {
+        app_close_sessions(c->s, c->app, &slot);
+    }
+
+    broker_put_ulong(c->rep, rv);
+}
+
+static void serve_get_session_info(serve_ctx *c) {
+
+    CK_SESSION_HANDLE session;
+    CK_SESSION_INFO info = { 0 };
+    CK_RV rv = get_session(c, &session);
+    if (rv == CKR_OK) {
+        rv = c->s->p11->C_GetSessionInfo(session, &info);
+    }
+
+    broker_put_ulong(c->rep, rv);
+    broker_put_bytes(c->rep, &info, sizeof(info));
+}
+
+static void serve_login(serve_ctx *c) {
+
+    CK_SESSION_HANDLE session;
+    CK_RV rv = get_session(c, &session);
+    CK_USER_TYPE user = broker_get_ulong(c->req);
+    CK_ULONG pin_len = 0;
+    uint8_t *pin = broker_get_bytes(c->req, &pin_len);
+    if (rv == CKR_OK) {
+        rv = c->s->p11->C_Login(session, user, pin, pin_len);
+    }
+
+    CK_SLOT_ID slot;
+    if (rv == CKR_OK && session_slot(c->s, session, &slot) == CKR_OK) {
+        pthread_mutex_lock(&c->s->lock);
+        if (!ulong_list_has(c->app->logins, c->app->nlogins, slot)) {
+            ulong_list_add(&c->app->logins, &c->app->nlogins,
+                    &c->app->logins_cap, slot);
+        }
+        pthread_mutex_unlock(&c->s->lock);
+    }
+
+    broker_put_ulong(c->rep, rv);
+}
+
+/* logs the token out only when no other client is logged in on it */
+static void serve_logout(serve_ctx *c) {
+
+    CK_SESSION_HANDLE session;
+    CK_SLOT_ID slot;
+    CK_RV rv = get_session(c, &session);
+    if (rv == CKR_OK) {
+        rv = session_slot(c->s, session, &slot);
+    }
+
+    if (rv == CKR_OK) {
+        pthread_mutex_lock(&c->s->lock);
+        ulong_list_remove(c->app->logins, &c->app->nlogins, slot);
+        bool others = false;
+        broker_app *a;
+        for (a=c->s->apps; a && !others; a=a->next) {
+            others = ulong_list_has(a->logins, a->nlogins, slot);
+        }
+        pthread_mutex_unlock(&c->s->lock);
+
+        if (!others) {
+            rv = c->s->p11->C_Logout(session);
+        }
+    }
+
+    broker_put_ulong(c->rep, rv);
+}
+
+static void serve_create_object(serve_ctx *c) {
+
+    CK_SESSION_HANDLE session;
+    CK_ATTRIBUTE_PTR templ = NULL;
+    CK_ULONG count = 0;
+    CK_OBJECT_HANDLE object = CK_INVALID_HANDLE;
+    CK_RV rv = get_session(c, &session);
+    if (rv == CKR_OK) {
+        rv = broker_get_attrs(c->req, &templ, &count);
+    }
+    if (rv == CKR_OK) {
+        rv = c->s->p11->C_CreateObject(session, templ, count, &object);
+    }
+
+    broker_put_ulong(c->rep, rv);
+    broker_put_ulong(c->rep, object);
+    free(templ);
+}
+
+static void serve_destroy_object(serve_ctx *c) {
+
+    CK_SESSION_HANDLE session;
+    CK_RV rv = get_session(c, &session);
+    CK_OBJECT_HANDLE object = broker_get_ulong(c->req);
+    if (rv == CKR_OK) {
+        rv = c->s->p11->C_DestroyObject(session, object);
+    }
+
+    broker_put_ulong(c->rep, rv);
+}
+
+static void serve_get_attribute_value(serve_ctx *c) {
+
+    CK_SESSION_HANDLE session;
+    CK_ATTRIBUTE_PTR templ = NULL;
+    CK_RV rv = get_session(c, &session);
+    CK_OBJECT_HANDLE object = broker_get_ulong(c->req);
+    CK_ULONG count = broker_get_ulong(c->req);
+    CK_ULONG i;
+
+    /* every attribute takes at least 17 bytes */
+    if (rv == CKR_OK && (c->req->bad || count > (c->req->len - c->req->off) / 17)) {
+        rv = CKR_ARGUMENTS_BAD;
+    }
+
+    if (rv == CKR_OK && count) {
+        templ = calloc(count, sizeof(*templ));
+        rv = templ ? CKR_OK : CKR_HOST_MEMORY;
+    }
+
+    size_t total = 0;
+    for (i=0; rv == CKR_OK && i < count; i++) {
+        CK_ULONG len;
+        templ[i].type = broker_get_ulong(c->req);
+        bool has = broker_get_out(c->req, &len);
+        templ[i].ulValueLen = len;
+        if (c->req->bad) {
+            rv = CKR_ARGUMENTS_BAD;
+        } else if (has && !attr_nested(templ[i].type)) {
+            total += len;
+            if (total > BROKER_MAX_FRAME / 2) {
+                rv = CKR_ARGUMENTS_BAD;
+                break;
+            }
+            templ[i].pValue = malloc(len ? len : 1);
+            rv = templ[i].pValue ? CKR_OK : CKR_HOST_MEMORY;
+        }
+    }
+
+    if (rv == CKR_OK) {
+        rv = c->s->p11->C_GetAttributeValue(session, object, templ, count);
+    }
+
+    bool results = rv == CKR_OK
+            || rv == CKR_ATTRIBUTE_SENSITIVE
+            || rv == CKR_ATTRIBUTE_TYPE_INVALID
+            || rv == CKR_BUFFER_TOO_SMALL;
+
+    if (results) {
+        for (i=0; i < count; i++) {
+            if (attr_nested(templ[i].type)) {
+                templ[i].ulValueLen = CK_UNAVAILABLE_INFORMATION;
+                if (rv == CKR_OK) {
+                    rv = CKR_ATTRIBUTE_TYPE_INVALID;
+                }
+            }
+        }
+    }
+
+    broker_put_ulong(c->rep, rv);
+    broker_put_ulong(c->rep, results ? count : 0);
+    for (i=0; results && i < count; i++) {
+        CK_ULONG len = templ[i].ulValueLen;
+        broker_put_ulong(c->rep, len);
+        broker_put_bytes(c->rep, len != CK_UNAVAILABLE_INFORMATION ?
+                templ[i].pValue : NULL, len);
+    }
+
+    for (i=0; templ && i < count; i++) {
+        free(templ[i].pValue);
+    }
+    free(templ);
+}
+
+static void serve_set_attribute_value(serve_ctx *c) {
+
+    CK_SESSION_HANDLE session;
+    CK_ATTRIBUTE_PTR templ = NULL;
+    CK_ULONG count = 0;
+    CK_RV rv = get_session(c, &session);
+    CK_OBJECT_HANDLE object = broker_get_ulong(c->req);
+    if (rv == CKR_OK) {
+        rv = broker_get_attrs(c->req, &templ, &count);
+    }
+    if (rv == CKR_OK) {
+        rv = c->s->p11->C_SetAttributeValue(session, object, templ, count);
+    }
+
+    broker_put_ulong(c->rep, rv);
+    free(templ);
+}
+
+static void serve_find_objects_init(serve_ctx *c) {
+
+    CK_SESSION_HANDLE session;
+    CK_ATTRIBUTE_PTR templ = NULL;
+    CK_ULONG count = 0;
+    CK_RV rv = get_session(c, &session);
+    if (rv == CKR_OK) {
+        rv = broker_get_attrs(c->req, &templ, &count);
+    }
+    if (rv == CKR_OK) {
+        rv = c->s->p11->C_FindObjectsInit(session, templ, count);
+    }
+
+    broker_put_ulong(c->rep, rv);
+    free(templ);
+}
+
+static void serve_find_objects(serve_ctx *c) {
+
+    CK_SESSION_HANDLE session;
+    CK_ULONG *list = NULL;
+    CK_ULONG max = 0;
+    CK_RV rv = get_session(c, &session);
+    if (rv == CKR_OK) {
+        rv = get_out_list(c, &list, &max);
+    }
+
+    CK_ULONG count = 0;
+    if (rv == CKR_OK) {
+        rv = c->s->p11->C_FindObjects(session, list, max, &count);
+    }
+
+    put_out_list(c, rv, list, count);
+    free(list);
+}
+
+/* C_FindObjectsFinal */
+typedef CK_RV (*session_fn)(CK_SESSION_HANDLE);
+
+static void serve_session(serve_ctx *c, session_fn fn) {
+
+    CK_SESSION_HANDLE session;
+    CK_RV rv = get_session(c, &session);
+    if (rv == CKR_OK) {
+        rv = fn(session);
+    }
+
+    broker_put_ulong(c->rep, rv);
+}
+
+/* C_EncryptInit, C_DecryptInit, C_SignInit, C_VerifyInit and C_VerifyRecoverInit */
+typedef CK_RV (*op_init_fn)(CK_SESSION_HANDLE, CK_MECHANISM_PTR, CK_OBJECT_HANDLE);
+
+static void serve_op_init(serve_ctx *c, op_init_fn fn) {
+
+    CK_SESSION_HANDLE session;
+    broker_mech mech;
+    CK_RV rv = get_session(c, &session);
+    CK_RV rv2 = broker_get_mech(c->req, &mech);
+    CK_OBJECT_HANDLE key = broker_get_ulong(c->req);
+    if (rv == CKR_OK) {
+        rv = c->req->bad ? CKR_ARGUMENTS_BAD : rv2;
+    }
+    if (rv == CKR_OK) {
+        rv = fn(session, &mech.mech, key);
+    }
+
+    broker_put_ulong(c->rep, rv);
+}
+
+static void serve_digest_init(serve_ctx *c) {
+
+    CK_SESSION_HANDLE session;
+    broker_mech mech;
+    CK_RV rv = get_session(c, &session);
+    CK_RV rv2 = broker_get_mech(c->req, &mech);
+    if (rv == CKR_OK) {
+        rv = rv2;
+    }
+    if (rv == CKR_OK) {
+        rv = c->s->p11->C_DigestInit(session, &mech.mech);
+    }
+
+    broker_put_ulong(c->rep, rv);
+}
+
+/* C_Encrypt, C_Decrypt, their updates, C_Digest, C_Sign and C_VerifyRecover */
+typedef CK_RV (*in_out_fn)(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+
+static void serve_in_out(serve_ctx *c, in_out_fn fn) {
+
+    CK_SESSION_HANDLE session;
+    uint8_t *out = NULL;
+    CK_ULONG out_len = 0;
+    CK_ULONG in_len = 0;
+    CK_RV rv = get_session(c, &session);
+    uint8_t *in = broker_get_bytes(c->req, &in_len);
+    if (rv == CKR_OK) {
+        rv = get_out_buffer(c, &out, &out_len);
+    }
+    if (rv == CKR_OK) {
+        rv = fn(session, in, in_len, out, &out_len);
+    }
+
+    put_out_buffer(c, rv, out, out_len);
+    free(out);
+}
+
+/* C_EncryptFinal, C_DecryptFinal, C_DigestFinal and C_SignFinal */
+typedef CK_RV (*out_fn)(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG_PTR);
+
+static void serve_out(serve_ctx *c, out_fn fn) {
+
+    CK_SESSION_HANDLE session;
+    uint8_t *out = NULL;
+    CK_ULONG out_len = 0;
+    CK_RV rv = get_session(c, &session);
+    if (rv == CKR_OK) {
+        rv = get_out_buffer(c, &out, &out_len);
+    }
+    if (rv == CKR_OK) {
+        rv = fn(session, out, &out_len);
+    }
+
+    put_out_buffer(c, rv, out, out_len);
+    free(out);
+}
+
+/* C_DigestUpdate, C_SignUpdate, C_VerifyUpdate, C_VerifyFinal and C_SeedRandom */
+typedef CK_RV (*in_fn)(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG);
+
+static void serve_in(serve_ctx *c, in_fn fn) {
+
+    CK_SESSION_HANDLE session;
+    CK_ULONG in_len = 0;
+    CK_RV rv = get_session(c, &session);
+    uint8_t *in = broker_get_bytes(c->req, &in_len);
+    if (rv == CKR_OK) {
+        rv = c->req->bad ? CKR_ARGUMENTS_BAD : fn(session, in, in_len);
+    }
+
+    broker_put_ulong(c->rep, rv);
+}
+
+static void serve_verify(serve_ctx *c) {
+
+    CK_SESSION_HANDLE session;
+    CK_ULONG data_len = 0;
+    CK_ULONG sig_len = 0;
+    CK_RV rv = get_session(c, &session);
+    uint8_t *data = broker_get_bytes(c->req, &data_len);
+    uint8_t *sig = broker_get_bytes(c->req, &sig_len);
+    if (rv == CKR_OK) {
+        rv = c->req->bad ? CKR_ARGUMENTS_BAD :
+                c->s->p11->C_Verify(session, data, data_len, sig, sig_len);
+    }
+
+    broker_put_ulong(c->rep, rv);
+}
+
+static void serve_generate_key_pair(serve_ctx *c) {
+
+    CK_SESSION_HANDLE session;
+    broker_mech mech;
+    CK_ATTRIBUTE_PTR pub = NULL;
+    CK_ATTRIBUTE_PTR priv = NULL;
+    CK_ULONG pub_count = 0;
+    CK_ULONG priv_count = 0;
+    CK_OBJECT_HANDLE pub_key = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE priv_key = CK_INVALID_HANDLE;
+
+    CK_RV rv = get_session(c, &session);
+    if (rv == CKR_OK) {
+        rv = broker_get_mech(c->req, &mech);
+    }
+    if (rv == CKR_OK) {
+        rv = broker_get_attrs(c->req, &pub, &pub_count);
+    }
+    if (rv == CKR_OK) {
+        rv = broker_get_attrs(c->req, &priv, &priv_count);
+    }
+    if (rv == CKR_OK) {
+        rv = c->s->p11->C_GenerateKeyPair(session, &mech.mech, pub, pub_count,
+                priv, priv_count, &pub_key, &priv_key);
+    }
+
+    broker_put_ulong(c->rep, rv);
+    broker_put_ulong(c->rep, pub_key);
+    broker_put_ulong(c->rep, priv_key);
+    free(pub);
+    free(priv);
+}
+
+static void serve_derive_key(serve_ctx *c) {
+
+    CK_SESSION_HANDLE session;
+    broker_mech mech;
+    CK_ATTRIBUTE_PTR templ = NULL;
+    CK_ULONG count = 0;
+    CK_OBJECT_HANDLE base = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE key = CK_INVALID_HANDLE;
+
+    CK_RV rv = get_session(c, &session);
+    if (rv == CKR_OK) {
+        rv = broker_get_mech(c->req, &mech);
+    }
+    if (rv == CKR_OK) {
+        base = broker_get_ulong(c->req);
+        rv = broker_get_attrs(c->req, &templ, &count);
+    }
+    if (rv == CKR_OK) {
+        rv = c->s->p11->C_DeriveKey(session, &mech.mech, base, templ, count, &key);
+    }
+
+    broker_put_ulong(c->rep, rv);
+    broker_put_ulong(c->rep, key);
+    free(templ);
+}
+
+static void serve_generate_random(serve_ctx *c) {
+
+    CK_SESSION_HANDLE session;
+    uint8_t *out = NULL;
+    CK_ULONG out_len = 0;
+    CK_RV rv = get_session(c, &session);
+    if (rv == CKR_OK) {
+        rv = get_out_buffer(c, &out, &out_len);
+    }
+    if (rv == CKR_OK) {
+        rv = out ? c->s->p11->C_GenerateRandom(session, out, out_len) : CKR_ARGUMENTS_BAD;
+    }
+
+    put_out_buffer(c, rv, out, out_len);
+    free(out);
+}
+
+static void serve_call(serve_ctx *c, broker_call call) {
+
+    CK_FUNCTION_LIST_PTR p11 = c->s->p11;
+
+    switch (call) {
+    case broker_call_finalize:            serve_finalize(c); break;
+    case broker_call_get_info:            serve_get_info(c); break;
+    case broker_call_get_slot_list:       serve_get_slot_list(c); break;
+    case broker_call_get_slot_info:       serve_get_slot_info(c); break;
+    case broker_call_get_token_info:      serve_get_token_info(c); break;
+    case broker_call_wait_for_slot_event: serve_wait_for_slot_event(c); break;
+    case broker_call_get_mechanism_list:  serve_get_mechanism_list(c); break;
+    case broker_call_get_mechanism_info:  serve_get_mechanism_info(c); break;
+    case broker_call_init_token:          serve_init_token(c); break;
+    case broker_call_init_pin:            serve_init_pin(c); break;
+    case broker_call_set_pin:             serve_set_pin(c); break;
+    case broker_call_open_session:        serve_open_session(c); break;
+    case broker_call_close_session:       serve_close_session(c); break;
+    case broker_call_close_all_sessions:  serve_close_all_sessions(c); break;
+    case broker_call_get_session_info:    serve_get_session_info(c); break;
+    case broker_call_login:               serve_login(c); break;
+    case broker_call_logout:              serve_logout(c); break;
+    case broker_call_create_object:       serve_create_object(c); break;
+    case broker_call_destroy_object:      serve_destroy_object(c); break;
+    case broker_call_get_attribute_value: serve_get_attribute_value(c); break;
+    case broker_call_set_attribute_value: serve_set_attribute_value(c); break;
+    case broker_call_find_objects_init:   serve_find_objects_init(c); break;
+    case broker_call_find_objects:        serve_find_objects(c); break;
+    case broker_call_find_objects_final:  serve_session(c, p11->C_FindObjectsFinal); break;
+    case broker_call_encrypt_init:        serve_op_init(c, p11->C_EncryptInit); break;
+    case broker_call_encrypt:             serve_in_out(c, p11->C_Encrypt); break;
+    case broker_call_encrypt_update:      serve_in_out(c, p11->C_EncryptUpdate); break;
+    case broker_call_encrypt_final:       serve_out(c, p11->C_EncryptFinal); break;
+    case broker_call_decrypt_init:        serve_op_init(c, p11->C_DecryptInit); break;
+    case broker_call_decrypt:             serve_in_out(c, p11->C_Decrypt); break;
+    case broker_call_decrypt_update:      serve_in_out(c, p11->C_DecryptUpdate); break;
+    case broker_call_decrypt_final:       serve_out(c, p11->C_DecryptFinal); break;
+    case broker_call_digest_init:         serve_digest_init(c); break;
+    case broker_call_digest:              serve_in_out(c, p11->C_Digest); break;
+    case broker_call_digest_update:       serve_in(c, p11->C_DigestUpdate); break;
+    case broker_call_digest_final:        serve_out(c, p11->C_DigestFinal); break;
+    case broker_call_sign_init:           serve_op_init(c, p11->C_SignInit); break;
+    case broker_call_sign:                serve_in_out(c, p11->C_Sign); break;
+    case broker_call_sign_update:         serve_in(c, p11->C_SignUpdate); break;
+    case broker_call_sign_final:          serve_out(c, p11->C_SignFinal); break;
+    case broker_call_verify_init:         serve_op_init(c, p11->C_VerifyInit); break;
+    case broker_call_verify:              serve_verify(c); break;
+    case broker_call_verify_update:       serve_in(c, p11->C_VerifyUpdate); break;
+    case broker_call_verify_final:        serve_in(c, p11->C_VerifyFinal); break;
+    case broker_call_verify_recover_init: serve_op_init(c, p11->C_VerifyRecoverInit); break;
+    case broker_call_verify_recover:      serve_in_out(c, p11->C_VerifyRecover); break;
+    case broker_call_generate_key_pair:   serve_generate_key_pair(c); break;
+    case broker_call_derive_key:          serve_derive_key(c); break;
+    case broker_call_seed_random:         serve_in(c, p11->C_SeedRandom); break;
+    case broker_call_generate_random:     serve_generate_random(c); break;
+    default:
+        broker_put_ulong(c->rep, CKR_FUNCTION_NOT_SUPPORTED);
+    }
+}
+
+/*
+ * The hello carries the protocol version, the client's sizeof(CK_ULONG),
+ * as structures travel as they are, and the id of the client application.
+ */
+static broker_app *serve_hello(broker_server *s, broker_msg *req, broker_msg *rep) {
+
+    CK_ULONG version = broker_get_ulong(req);
+    CK_ULONG ulong_size = broker_get_ulong(req);
+    CK_ULONG id_hi = broker_get_ulong(req);
+    CK_ULONG id_lo = broker_get_ulong(req);
+
+    broker_app *app = NULL;
+    CK_RV rv = CKR_OK;
+    if (req->bad || version != BROKER_PROTOCOL_VERSION || ulong_size != sizeof(CK_ULONG)) {
+        LOGE("Broker client speaks protocol %lu with %lu byte CK_ULONG, expected %u with %zu",
+                version, ulong_size, BROKER_PROTOCOL_VERSION, sizeof(CK_ULONG));
+        rv = CKR_FUNCTION_FAILED;
+    } else {
+        app = app_get(s, ((uint64_t)(id_hi & 0xFFFFFFFF) << 32) | (id_lo & 0xFFFFFFFF));
+        rv = app ? CKR_OK : CKR_HOST_MEMORY;
+    }
+
+    broker_put_ulong(rep, rv);
+    return app;
+}
+
+void broker_server_serve(broker_server *s, int fd) {
+
+    broker_msg req = { 0 };
+    broker_msg rep = { 0 };
+    broker_app *app = NULL;
+
+    if (!broker_peer_trusted(fd)) {
+        goto out;
+    }
+
+    while (broker_recv(fd, &req) == CKR_OK) {
+
+        broker_msg_reset(&rep);
+
+        CK_ULONG call = broker_get_ulong(&req);
+        broker_put_ulong(&rep, call);
+
+        if (!app) {
+            if (call != broker_call_hello) {
+                LOGE("Broker client skipped the hello");
+                break;
+            }
+            app = serve_hello(s, &req, &rep);
+        } else {
+            serve_ctx c = { .s = s, .app = app, .req = &req, .rep = &rep };
+            serve_call(&c, (broker_call)call);
+        }
+
+        if (broker_send(fd, &rep) != CKR_OK || !app) {
+            break;
+        }
+    }
+
+out:
+    if (app) {
+        app_put(s, app);
+    }
+
+    close(fd);
+    broker_msg_free(&req);
+    broker_msg_free(&rep);
+}
@@ -0,0 +1,282 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef SRC_LIB_BROKER_H_
+#define SRC_LIB_BROKER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pkcs11.h"
+
+/*
+ * The broker: one long running process, tpm2-pkcs11-broker, owns the store,
+ * the TPM connections and the loaded objects, and modules in client mode
+ * forward their PKCS11 calls to it over a Unix socket. Short lived clients
+ * skip C_Initialize's store parse and primary loads, and objects loaded for
+ * one client stay loaded for the next.
+ *
+ * TPM2_PKCS11_BROKER turns client mode on, either naming the socket or set
+ * to "1" for the default socket. When nothing listens on the socket the
+ * client starts the daemon, TPM2_PKCS11_BROKER_DAEMON overrides its path
+ * and set to "" disables starting it.
+ *
+ * The daemon only serves processes of its own user, and the clients of one
+ * daemon share login state like the threads of one application do.
+ */
+#define BROKER_ENV_VAR        "TPM2_PKCS11_BROKER"
+#define BROKER_DAEMON_ENV_VAR "TPM2_PKCS11_BROKER_DAEMON"
+
+#define BROKER_PROTOCOL_VERSION 1
+
+/* The largest frame either side accepts, bounds every allocation */
+#define BROKER_MAX_FRAME (16u << 20)
+
+/*
+ * Every message starts with the call, requests then carry the arguments
+ * and replies the CK_RV followed by the outputs.
+ */
+#define BROKER_CALLS \
+    X(hello) \
+    X(finalize) \
+    X(get_info) \
+    X(get_slot_list) \
+    X(get_slot_info) \
+    X(get_token_info) \
+    X(wait_for_slot_event) \
+    X(get_mechanism_list) \
+    X(get_mechanism_info) \
+    X(init_token) \
+    X(init_pin) \
+    X(set_pin) \
+    X(open_session) \
+    X(close_session) \
+    X(close_all_sessions) \
+    X(get_session_info) \
+    X(login) \
+    X(logout) \
+    X(create_object) \
+    X(destroy_object) \
+    X(get_attribute_value) \
+    X(set_attribute_value) \
+    X(find_objects_init) \
+    X(find_objects) \
+    X(find_objects_final) \
+    X(encrypt_init) \
+    X(encrypt) \
+    X(encrypt_update) \
+    X(encrypt_final) \
+    X(decrypt_init) \
+    X(decrypt) \
+    X(decrypt_update) \
+    X(decrypt_final) \
+    X(digest_init) \
+    X(digest) \
+    X(digest_update) \
+    X(digest_final) \
+    X(sign_init) \
+    X(sign) \
+    X(sign_update) \
+    X(sign_final) \
+    X(verify_init) \
+    X(verify) \
+    X(verify_update) \
+    X(verify_final) \
+    X(verify_recover_init) \
+    X(verify_recover) \
+    X(generate_key_pair) \
+    X(derive_key) \
+    X(seed_random) \
+    X(generate_random)
+
+typedef enum broker_call broker_call;
+enum broker_call {
+#define X(name) broker_call_##name,
+    BROKER_CALLS
+#undef X
+    broker_call_max
+};
+
+/**
+ * A message being built or parsed. Values are host order, the peers run
+ * on one host and the hello checks they agree on sizeof(CK_ULONG).
+ * Reading past the end sets bad rather than failing every get.
+ */
+typedef struct broker_msg broker_msg;
+struct broker_msg {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+    size_t off;
+    bool bad;
+};
+
+/**
+ * A mechanism read from a message. Parameters that hold pointers are
+ * rebuilt in params with the pointers into the message.
+ */
+typedef struct broker_mech broker_mech;
+struct broker_mech {
+    CK_MECHANISM mech;
+    union {
+        CK_RSA_PKCS_OAEP_PARAMS oaep;
+        CK_ECDH1_DERIVE_PARAMS ecdh;
+    } params;
+};
+
+/**
+ * Empties a message for reuse, keeping its allocation.
+ */
+void broker_msg_reset(broker_msg *m);
+
+/**
+ * Frees a message's allocation.
+ */
+void broker_msg_free(broker_msg *m);
+
+void broker_put_ulong(broker_msg *m, CK_ULONG v);
+
+/**
+ * Adds a buffer, NULL is kept apart from an empty buffer.
+ */
+void broker_put_bytes(broker_msg *m, const void *data, CK_ULONG len);
+
+/**
+ * Adds an output buffer, only whether the caller has one and its size
+ * travel.
+ */
+void broker_put_out(broker_msg *m, const void *data, CK_ULONG len);
+
+/**
+ * Adds a template.
+ * @return
+ *  false when an attribute holds pointers, CKA_WRAP_TEMPLATE and the like.
+ */
+bool broker_put_attrs(broker_msg *m, CK_ATTRIBUTE_PTR templ, CK_ULONG count);
+
+/**
+ * Adds a mechanism.
+ * @return
+ *  false for a NULL mechanism.
+ */
+bool broker_put_mech(broker_msg *m, CK_MECHANISM_PTR mech);
+
+CK_ULONG broker_get_ulong(broker_msg *m);
+
+/**
+ * Gets a buffer added with broker_put_bytes().
+ * @param len
+ *  The length of the buffer.
+ * @return
+ *  A pointer into the message, NULL for a NULL buffer.
+ */
+uint8_t *broker_get_bytes(broker_msg *m, CK_ULONG *len);
+
+/**
+ * Gets an output buffer added with broker_put_out().
+ * @param len
+ *  The size of the caller's buffer.
+ * @return
+ *  true if the caller has a buffer.
+ */
+bool broker_get_out(broker_msg *m, CK_ULONG *len);
+
+/**
+ * Gets a template added with broker_put_attrs().
+ * @param templ
+ *  An allocated array, the values point into the message. Free it with
+ *  free().
+ * @param count
+ *  The number of attributes.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV broker_get_attrs(broker_msg *m, CK_ATTRIBUTE_PTR *templ, CK_ULONG *count);
+
+/**
+ * Gets a mechanism added with broker_put_mech(), it points into both the
+ * message and mech.
+ */
+CK_RV broker_get_mech(broker_msg *m, broker_mech *mech);
+
+/**
+ * Writes a message as one frame.
+ * @return
+ *  CKR_OK on success, CKR_DEVICE_ERROR when the socket failed.
+ */
+CK_RV broker_send(int fd, broker_msg *m);
+
+/**
+ * Reads one frame into a reset message.
+ * @return
+ *  CKR_OK on success, CKR_DEVICE_ERROR when the socket failed or closed,
+ *  CKR_DEVICE_MEMORY for a frame over BROKER_MAX_FRAME.
+ */
+CK_RV broker_recv(int fd, broker_msg *m);
+
+/**
+ * Resolves the socket path from BROKER_ENV_VAR.
+ * @param buf
+ *  Where to write the path.
+ * @param len
+ *  The size of buf.
+ * @return
+ *  false if the path does not fit.
+ */
+bool broker_socket_path(char *buf, size_t len);
+
+/**
+ * Checks that the peer of a Unix socket runs as the same user.
+ */
+bool broker_peer_trusted(int fd);
+
+/*
+ * The serving side, used by the daemon. Connections are served on their
+ * own threads and share the registry of client applications.
+ */
+typedef struct broker_server broker_server;
+
+/**
+ * Creates the shared state of the serving side.
+ * @param p11
+ *  The in process function list calls are forwarded to, with the library
+ *  already initialized.
+ * @return
+ *  The server or NULL on no memory.
+ */
+broker_server *broker_server_new(CK_FUNCTION_LIST_PTR p11);
+
+/**
+ * Frees a server, every connection must be done.
+ */
+void broker_server_free(broker_server *s);
+
+/**
+ * Serves one connection until the client hangs up, then closes every
+ * session the client application left open once it has no connections
+ * left. Safe to call from many threads.
+ * @param fd
+ *  The connected socket, closed on return.
+ */
+void broker_server_serve(broker_server *s, int fd);
+
+/*
+ * The client side, the module's function list in client mode.
+ */
+
+/**
+ * Whether BROKER_ENV_VAR asks for client mode.
+ */
+bool broker_client_enabled(void);
+
+/**
+ * Gets the client mode function list.
+ */
+CK_RV broker_client_get_func_list(CK_FUNCTION_LIST **function_list);
+
+/**
+ * Gets the client mode interface, the 2.40 function list as "PKCS 11".
+ */
+CK_INTERFACE *broker_client_get_interface(void);
+
+#endif /* SRC_LIB_BROKER_H_ */
@@ -0,0 +1,1180 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#define _GNU_SOURCE
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "broker.h"
+#include "log.h"
+
+#ifndef BROKER_DAEMON_PATH
+  #define BROKER_DAEMON_PATH "tpm2-pkcs11-broker"
+#endif
+
+/* connections kept per process, callers beyond it wait for one */
+#define CLIENT_MAX_CONNECTIONS 8
+
+/* how long to wait for a daemon started on demand, in 10ms steps */
+#define CLIENT_CONNECT_TRIES 500
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool is_init;
+    /* bumped by C_Finalize, connections of an older generation are closed */
+    unsigned generation;
+    uint64_t app_id;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int idle[CLIENT_MAX_CONNECTIONS];
+    size_t nidle;
+    size_t nconn;
+} _client = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+bool broker_client_enabled(void) {
+
+    const char *env = getenv(BROKER_ENV_VAR);
+    return env && env[0] && strcmp(env, "0");
+}
+
+/*
+ * Starts the daemon detached from this process, it outlives the client and
+ * must not become its zombie. A daemon already serving the socket makes
+ * the new one exit.
+ */
+static bool spawn_daemon(const char *path) {
+
+    const char *daemon = getenv(BROKER_DAEMON_ENV_VAR);
+    if (!daemon) {
+        daemon = BROKER_DAEMON_PATH;
+    }
+
+    if (!daemon[0]) {
+        return false;
+    }
+
+    char arg[sizeof(_client.path) + 16];
+    snprintf(arg, sizeof(arg), "--socket=%s", path);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        LOGE("Could not start the broker: %s", strerror(errno));
+        return false;
+    }
+
+    if (pid == 0) {
+        if (setsid() < 0 || fork() != 0) {
+            _exit(0);
+        }
+
+        int null = open("/dev/null", O_RDWR);
+        if (null >= 0) {
+            dup2(null, STDIN_FILENO);
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+            if (null > STDERR_FILENO) {
+                close(null);
+            }
+        }
+
+        /* so the daemon does not turn into a client of itself */
+        unsetenv(BROKER_ENV_VAR);
+
+        char * const argv[] = { (char *)daemon, arg, NULL };
+        execvp(daemon, argv);
+        _exit(127);
+    }
+
+    waitpid(pid, NULL, 0);
+    return true;
+}
+
+static int try_connect(const char *path) {
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        int e = errno;
+        close(fd);
+        errno = e;
+        return -1;
+    }
+
+    return fd;
+}
+
+static CK_RV hello(int fd, uint64_t app_id) {
+
+    broker_msg m = { 0 };
+    broker_put_ulong(&m, broker_call_hello);
+    broker_put_ulong(&m, BROKER_PROTOCOL_VERSION);
+    broker_put_ulong(&m, sizeof(CK_ULONG));
+    broker_put_ulong(&m, (CK_ULONG)(app_id >> 32));
+    broker_put_ulong(&m, (CK_ULONG)(app_id & 0xFFFFFFFF));
+
+    CK_RV rv = broker_send(fd, &m);
+    if (rv == CKR_OK) {
+        rv = broker_recv(fd, &m);
+    }
+
+    if (rv == CKR_OK) {
+        CK_ULONG call = broker_get_ulong(&m);
+        CK_RV reply = broker_get_ulong(&m);
+        rv = m.bad || call != broker_call_hello ? CKR_DEVICE_ERROR : reply;
+    }
+
+    broker_msg_free(&m);
+    return rv;
+}
+
+static int open_connection(const char *path, uint64_t app_id) {
+
+    bool spawned = false;
+    unsigned tries = 0;
+    for (;;) {
+        int fd = try_connect(path);
+        if (fd >= 0) {
+            if (!broker_peer_trusted(fd)) {
+                close(fd);
+                return -1;
+            }
+
+            CK_RV rv = hello(fd, app_id);
+            if (rv == CKR_OK) {
+                return fd;
+            }
+
+            close(fd);
+            /* a daemon shutting down drops the hello, the next one takes it */
+            if (rv != CKR_DEVICE_ERROR || tries++ >= CLIENT_CONNECT_TRIES) {
+                LOGE("Broker at \"%s\" refused the hello: 0x%lx", path, rv);
+                return -1;
+            }
+        } else if (errno == ENOENT || errno == ECONNREFUSED) {
+            if (!spawned && !spawn_daemon(path)) {
+                LOGE("No broker listens on \"%s\"", path);
+                return -1;
+            }
+            spawned = true;
+
+            if (tries++ >= CLIENT_CONNECT_TRIES) {
+                LOGE("No broker listens on \"%s\"", path);
+                return -1;
+            }
+        } else {
+            LOGE("Could not connect to the broker at \"%s\": %s", path,
+                    strerror(errno));
+            return -1;
+        }
+
+        struct timespec wait = { .tv_nsec = 10 * 1000 * 1000 };
+        nanosleep(&wait, NULL);
+    }
+}
+
+static CK_RV connection_get(int *fd, unsigned *generation) {
+
+    pthread_mutex_lock(&_client.lock);
+    while (_client.is_init && !_client.nidle && _client.nconn >= CLIENT_MAX_CONNECTIONS) {
+        pthread_cond_wait(&_client.cond, &_client.lock);
+    }
+
+    if (!_client.is_init) {
+        pthread_mutex_unlock(&_client.lock);
+        return CKR_CRYPTOKI_NOT_INITIALIZED;
+    }
+
+    *generation = _client.generation;
+    if (_client.nidle) {
+        *fd = _client.idle[--_client.nidle];
+        pthread_mutex_unlock(&_client.lock);
+        return CKR_OK;
+    }
+
+    _client.nconn++;
+    uint64_t app_id = _client.app_id;
+    char path[sizeof(_client.path)];
+    memcpy(path, _client.path, sizeof(path));
+    pthread_mutex_unlock(&_client.lock);
+
+    *fd = open_connection(path, app_id);
+    if (*fd >= 0) {
+        return CKR_OK;
+    }
+
+    pthread_mutex_lock(&_client.lock);
+    if (*generation == _client.generation) {
+        _client.nconn--;
+    }
+    pthread_cond_signal(&_client.cond);
+    pthread_mutex_unlock(&_client.lock);
+
+    return CKR_DEVICE_ERROR;
+}
+
+static void connection_put(int fd, unsigned generation, bool healthy) {
+
+    pthread_mutex_lock(&_client.lock);
+    if (generation != _client.generation) {
+        /* finalized meanwhile, the count was reset then */
+        close(fd);
+    } else if (healthy && _client.is_init) {
+        _client.idle[_client.nidle++] = fd;
+    } else {
+        close(fd);
+        _client.nconn--;
+    }
+    pthread_cond_signal(&_client.cond);
+    pthread_mutex_unlock(&_client.lock);
+}
+
+/*
+ * Sends a request and reads the reply up to its CK_RV, the caller reads
+ * the outputs from rep.
+ */
+static CK_RV client_call(broker_msg *req, broker_msg *rep) {
+
+    if (req->bad) {
+        return CKR_HOST_MEMORY;
+    }
+
+    int fd;
+    unsigned generation;
+    CK_RV rv = connection_get(&fd, &generation);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    rv = broker_send(fd, req);
+    if (rv == CKR_OK) {
+        rv = broker_recv(fd, rep);
+    }
+
+    connection_put(fd, generation, rv == CKR_OK);
+
+    if (rv != CKR_OK) {
+        LOGE("Lost the connection to the broker: 0x%lx", rv);
+        return CKR_DEVICE_ERROR;
+    }
+
+    req->off = 0;
+    CK_ULONG call = broker_get_ulong(req);
+    if (broker_get_ulong(rep) != call) {
+        return CKR_DEVICE_ERROR;
+    }
+
+    CK_RV reply = broker_get_ulong(rep);
+    return rep->bad ? CKR_DEVICE_ERROR : reply;
+}
+
+/* a request and its reply, freed with call_done() */
+typedef struct call call;
+struct call {
+    broker_msg req;
+    broker_msg rep;
+};
+
+static void call_begin(call *c, broker_call name) {
+
+    memset(c, 0, sizeof(*c));
+    broker_put_ulong(&c->req, name);
+}
+
+/* whether the broker answered, so the reply holds the outputs */
+static bool call_replied(call *c) {
+    return c->rep.off != 0;
+}
+
+static CK_RV call_done(call *c, CK_RV rv) {
+
+    if (rv == CKR_OK && c->rep.bad) {
+        rv = CKR_DEVICE_ERROR;
+    }
+
+    broker_msg_free(&c->req);
+    broker_msg_free(&c->rep);
+    return rv;
+}
+
+/* copies a fixed size structure from a reply */
+static void get_struct(broker_msg *m, void *out, size_t size) {
+
+    CK_ULONG len = 0;
+    uint8_t *data = broker_get_bytes(m, &len);
+    if (!data || len != size) {
+        m->bad = true;
+        return;
+    }
+
+    memcpy(out, data, size);
+}
+
+/* reads the reply to an output buffer into the caller's buffer */
+static CK_RV get_out_buffer(broker_msg *m, CK_RV rv, CK_BYTE_PTR out, CK_ULONG_PTR out_len) {
+
+    CK_ULONG len = broker_get_ulong(m);
+    CK_ULONG data_len = 0;
+    uint8_t *data = broker_get_bytes(m, &data_len);
+    if (m->bad) {
+        return CKR_DEVICE_ERROR;
+    }
+
+    if (rv != CKR_OK && rv != CKR_BUFFER_TOO_SMALL) {
+        return rv;
+    }
+
+    if (data && out) {
+        if (data_len > *out_len) {
+            return CKR_DEVICE_ERROR;
+        }
+        memcpy(out, data, data_len);
+    }
+
+    *out_len = len;
+    return rv;
+}
+
+static CK_RV get_out_list(broker_msg *m, CK_RV rv, CK_ULONG_PTR list, CK_ULONG_PTR count) {
+
+    CK_ULONG len = broker_get_ulong(m);
+    bool has = broker_get_ulong(m);
+    if (m->bad) {
+        return CKR_DEVICE_ERROR;
+    }
+
+    if (rv != CKR_OK && rv != CKR_BUFFER_TOO_SMALL) {
+        return rv;
+    }
+
+    if (has && list) {
+        if (len > *count) {
+            return CKR_DEVICE_ERROR;
+        }
+
+        CK_ULONG i;
+        for (i=0; i < len; i++) {
+            list[i] = broker_get_ulong(m);
+        }
+    }
+
+    *count = len;
+    return m->bad ? CKR_DEVICE_ERROR : rv;
+}
+
+static CK_RV put_attrs(broker_msg *m, CK_ATTRIBUTE_PTR templ, CK_ULONG count) {
+
+    if (count && !templ) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    if (!broker_put_attrs(m, templ, count)) {
+        LOGE("Templates within templates are not forwarded to the broker");
+        return CKR_ATTRIBUTE_TYPE_INVALID;
+    }
+
+    return CKR_OK;
+}
+
+/*
+ * A child must not talk over the parent's connections, it opens its own.
+ * It keeps the application id and so shares the parent's sessions, as it
+ * would in process.
+ */
+static void on_fork_prepare(void) {
+    pthread_mutex_lock(&_client.lock);
+}
+
+static void on_fork_parent(void) {
+    pthread_mutex_unlock(&_client.lock);
+}
+
+static void on_fork_child(void) {
+
+    /* locked in prepare, reset rather than unlocked under a new thread id */
+    pthread_mutex_init(&_client.lock, NULL);
+    pthread_cond_init(&_client.cond, NULL);
+
+    while (_client.nidle) {
+        close(_client.idle[--_client.nidle]);
+    }
+    _client.nconn = 0;
+    _client.generation++;
+}
+
+static pthread_once_t _fork_once = PTHREAD_ONCE_INIT;
+
+static void register_fork_handlers(void) {
+
+    int rc = pthread_atfork(on_fork_prepare, on_fork_parent,
+            on_fork_child);
+    if (rc) {
+        LOGW("Cannot register fork handlers: %s", strerror(rc));
+    }
+}
+
+static CK_RV client_initialize(void *init_args) {
+
+    if (init_args) {
+        CK_C_INITIALIZE_ARGS *args = (CK_C_INITIALIZE_ARGS *)init_args;
+        if (args->pReserved) {
+            return CKR_ARGUMENTS_BAD;
+        }
+
+        /* all or nothing, the client uses its own locks either way */
+        bool any = args->CreateMutex || args->DestroyMutex
+                || args->LockMutex || args->UnlockMutex;
+        bool all = args->CreateMutex && args->DestroyMutex
+                && args->LockMutex && args->UnlockMutex;
+        if (any && !all) {
+            return CKR_ARGUMENTS_BAD;
+        }
+    }
+
+    pthread_once(&_fork_once, register_fork_handlers);
+
+    pthread_mutex_lock(&_client.lock);
+    if (_client.is_init) {
+        pthread_mutex_unlock(&_client.lock);
+        return CKR_CRYPTOKI_ALREADY_INITIALIZED;
+    }
+
+    if (!broker_socket_path(_client.path, sizeof(_client.path))) {
+        pthread_mutex_unlock(&_client.lock);
+        LOGE("The broker socket path is too long");
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    /* unique per process and per C_Initialize, the broker keys sessions by it */
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    _client.app_id = ((uint64_t)getpid() << 32)
+            ^ ((uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec);
+    _client.is_init = true;
+    pthread_mutex_unlock(&_client.lock);
+
+    /* connect now, so a missing broker fails here rather than later */
+    int fd;
+    unsigned generation;
+    CK_RV rv = connection_get(&fd, &generation);
+    if (rv != CKR_OK) {
+        pthread_mutex_lock(&_client.lock);
+        _client.is_init = false;
+        pthread_mutex_unlock(&_client.lock);
+        return CKR_FUNCTION_FAILED;
+    }
+
+    connection_put(fd, generation, true);
+
+    return CKR_OK;
+}
+
+static CK_RV client_finalize(void *reserved) {
+
+    if (reserved) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    call c;
+    call_begin(&c, broker_call_finalize);
+    CK_RV rv = call_done(&c, client_call(&c.req, &c.rep));
+    if (rv == CKR_CRYPTOKI_NOT_INITIALIZED) {
+        return rv;
+    }
+
+    pthread_mutex_lock(&_client.lock);
+    while (_client.nidle) {
+        close(_client.idle[--_client.nidle]);
+    }
+    _client.nconn = 0;
+    _client.generation++;
+    _client.is_init = false;
+    pthread_cond_broadcast(&_client.cond);
+    pthread_mutex_unlock(&_client.lock);
+
+    /* the broker closes the sessions when the connections go anyway */
+    return CKR_OK;
+}
+
+static CK_RV client_get_info(CK_INFO_PTR info) {
+
+    if (!info) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    call c;
+    call_begin(&c, broker_call_get_info);
+    CK_RV rv = client_call(&c.req, &c.rep);
+    if (rv == CKR_OK) {
+        get_struct(&c.rep, info, sizeof(*info));
+    }
+
+    return call_done(&c, rv);
+}
+
+static CK_RV client_get_slot_list(CK_BBOOL present, CK_SLOT_ID_PTR list, CK_ULONG_PTR count) {
+
+    if (!count) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    call c;
+    call_begin(&c, broker_call_get_slot_list);
+    broker_put_ulong(&c.req, present);
+    broker_put_out(&c.req, list, *count);
+    CK_RV rv = client_call(&c.req, &c.rep);
+    if (call_replied(&c)) {
+        rv = get_out_list(&c.rep, rv, list, count);
+    }
+
+    return call_done(&c, rv);
+}
+
+static CK_RV client_get_slot_info(CK_SLOT_ID slot, CK_SLOT_INFO_PTR info) {
+
+    if (!info) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    call c;
+    call_begin(&c, broker_call_get_slot_info);
+    broker_put_ulong(&c.req, slot);
+    CK_RV rv = client_call(&c.req, &c.rep);
+    if (rv == CKR_OK) {
+        get_struct(&c.rep, info, sizeof(*info));
+    }
+
+    return call_done(&c, rv);
+}
+
+static CK_RV client_get_token_info(CK_SLOT_ID slot, CK_TOKEN_INFO_PTR info) {
+
+    if (!info) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    call c;
+    call_begin(&c, broker_call_get_token_info);
+    broker_put_ulong(&c.req, slot);
+    CK_RV rv = client_call(&c.req, &c.rep);
+    if (rv == CKR_OK) {
+        get_struct(&c.rep, info, sizeof(*info));
+    }
+
+    return call_done(&c, rv);
+}
+
+static CK_RV client_wait_for_slot_event(CK_FLAGS flags, CK_SLOT_ID_PTR slot, CK_VOID_PTR reserved) {
+
+    if (!slot || reserved) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    call c;
+    call_begin(&c, broker_call_wait_for_slot_event);
+    broker_put_ulong(&c.req, flags);
+    CK_RV rv = client_call(&c.req, &c.rep);
+    if (rv == CKR_OK) {
+        *slot = broker_get_ulong(&c.rep);
+    }
+
+    return call_done(&c, rv);
+}
+
+static CK_RV client_get_mechanism_list(CK_SLOT_ID slot, CK_MECHANISM_TYPE_PTR list, CK_ULONG_PTR count) {
+
+    if (!count) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    call c;
+    call_begin(&c, broker_call_get_mechanism_list);
+    broker_put_ulong(&c.req, slot);
+    broker_put_out(&c.req, list, *count);
+    CK_RV rv = client_call(&c.req, &c.rep);
+    if (call_replied(&c)) {
+        rv = get_out_list(&c.rep, rv, list, count);
+    }
+
+    return call_done(&c, rv);
+}
+
+static CK_RV client_get_mechanism_info(CK_SLOT_ID slot, CK_MECHANISM_TYPE type, CK_MECHANISM_INFO_PTR info) {
+
+    if (!info) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    call c;
+    call_begin(&c, broker_call_get_mechanism_info);
+    broker_put_ulong(&c.req, slot);
+    broker_put_ulong(&c.req, type);
+    CK_RV rv = client_call(&c.req, &c.rep);
+    if (rv == CKR_OK) {
+        get_struct(&c.rep, info, sizeof(*info));
+    }
+
+    return call_done(&c, rv);
+}
+
+static CK_RV client_init_token(CK_SLOT_ID slot, CK_UTF8CHAR_PTR pin, CK_ULONG pin_len, CK_UTF8CHAR_PTR label) {
+
+    call c;
+    call_begin(&c, broker_call_init_token);
+    broker_put_ulong(&c.req, slot);
+    broker_put_bytes(&c.req, pin, pin_len);
+    broker_put_bytes(&c.req, label, label ? 32 : 0);
+
+    return call_done(&c, client_call(&c.req, &c.rep));
+}
+
+static CK_RV client_init_pin(CK_SESSION_HANDLE session, CK_UTF8CHAR_PTR pin, CK_ULONG pin_len) {
+
+    call c;
+    call_begin(&c, broker_call_init_pin);
+    broker_put_ulong(&c.req, session);
+    broker_put_bytes(&c.req, pin, pin_len);
+
+    return call_done(&c, client_call(&c.req, &c.rep));
+}
+
+static CK_RV client_set_pin(CK_SESSION_HANDLE session, CK_UTF8CHAR_PTR old_pin, CK_ULONG old_len,
+        CK_UTF8CHAR_PTR new_pin, CK_ULONG new_len) {
+
+    call c;
+    call_begin(&c, broker_call_set_pin);
+    broker_put_ulong(&c.req, session);
+    broker_put_bytes(&c.req, old_pin, old_len);
+    broker_put_bytes(&c.req, new_pin, new_len);
+
+    return call_done(&c, client_call(&c.req, &c.rep));
+}
+
+static CK_RV client_open_session(CK_SLOT_ID slot, CK_FLAGS flags, CK_VOID_PTR application,
+        CK_NOTIFY notify, CK_SESSION_HANDLE_PTR session) {
+
+    if (!session) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    call c;
+    call_begin(&c, broker_call_open_session);
+    broker_put_ulong(&c.req, slot);
+    broker_put_ulong(&c.req, flags);
+    CK_RV rv = client_call(&c.req, &c.rep);
+    if (rv == CKR_OK) {
+        *session = broker_get_ulong(&c.rep);
+    }
+
+    return call_done(&c, rv);
+}
+
+static CK_RV client_close_session(CK_SESSION_HANDLE session) {
+
+    call c;
+    call_begin(&c, broker_call_close_session);
+    broker_put_ulong(&c.req, session);
+
+    return call_done(&c, client_call(&c.req, &c.rep));
+}
+
+static CK_RV client_close_all_sessions(CK_SLOT_ID slot) {
+
+    call c;
+    call_begin(&c, broker_call_close_all_sessions);
+    broker_put_ulong(&c.req, slot);
+
+    return call_done(&c, client_call(&c.req, &c.rep));
+}
+
+static CK_RV client_get_session_info(CK_SESSION_HANDLE session, CK_SESSION_INFO_PTR info) {
+
+    if (!info) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    call c;
+    call_begin(&c, broker_call_get_session_info);
+    broker_put_ulong(&c.req, session);
+    CK_RV rv = client_call(&c.req, &c.rep);
+    if (rv == CKR_OK) {
+        get_struct(&c.rep, info, sizeof(*info));
+    }
+
+    return call_done(&c, rv);
+}
+
+static CK_RV client_login(CK_SESSION_HANDLE session, CK_USER_TYPE user, CK_UTF8CHAR_PTR pin, CK_ULONG pin_len) {
+
+    call c;
+    call_begin(&c, broker_call_login);
+    broker_put_ulong(&c.req, session);
+    broker_put_ulong(&c.req, user);
+    broker_put_bytes(&c.req, pin, pin_len);
+
+    return call_done(&c, client_call(&c.req, &c.rep));
+}
+
+static CK_RV client_logout(CK_SESSION_HANDLE session) {
+
+    call c;
+    call_begin(&c, broker_call_logout);
+    broker_put_ulong(&c.req, session);
+
+    return call_done(&c, client_call(&c.req, &c.rep));
+}
+
+static CK_RV client_create_object(CK_SESSION_HANDLE session, CK_ATTRIBUTE_PTR templ, CK_ULONG count,
+        CK_OBJECT_HANDLE_PTR object) {
+
+    if (!object) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    call c;
+    call_begin(&c, broker_call_create_object);
+    broker_put_ulong(&c.req, session);
+    CK_RV rv = put_attrs(&c.req, templ, count);
+    if (rv == CKR_OK) {
+        rv = client_call(&c.req, &c.rep);
+    }
+    if (rv == CKR_OK) {
+        *object = broker_get_ulong(&c.rep);
+    }
+
+    return call_done(&c, rv);
+}
+
+static CK_RV client_destroy_object(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object) {
+
+    call c;
+    call_begin(&c, broker_call_destroy_object);
+    broker_put_ulong(&c.req, session);
+    broker_put_ulong(&c.req, object);
+
+    return call_done(&c, client_call(&c.req, &c.rep));
+}
+
+static CK_RV client_get_attribute_value(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
+        CK_ATTRIBUTE_PTR templ, CK_ULONG count) {
+
+    if (count && !templ) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    call c;
+    call_begin(&c, broker_call_get_attribute_value);
+    broker_put_ulong(&c.req, session);
+    broker_put_ulong(&c.req, object);
+    broker_put_ulong(&c.req, count);
+    CK_ULONG i;
+    for (i=0; i < count; i++) {
+        broker_put_ulong(&c.req, templ[i].type);
+        broker_put_out(&c.req, templ[i].pValue, templ[i].ulValueLen);
+    }
+
+    CK_RV rv = client_call(&c.req, &c.rep);
+    if (!call_replied(&c)) {
+        return call_done(&c, rv);
+    }
+
+    CK_ULONG n = broker_get_ulong(&c.rep);
+    if (n && n != count) {
+        return call_done(&c, CKR_DEVICE_ERROR);
+    }
+
+    /* per attribute the length, or CK_UNAVAILABLE_INFORMATION, and the value */
+    for (i=0; i < n; i++) {
+        CK_ULONG len = broker_get_ulong(&c.rep);
+        CK_ULONG data_len = 0;
+        uint8_t *data = broker_get_bytes(&c.rep, &data_len);
+        if (c.rep.bad) {
+            return call_done(&c, CKR_DEVICE_ERROR);
+        }
+
+        if (data && templ[i].pValue && data_len <= templ[i].ulValueLen) {
+            memcpy(templ[i].pValue, data, data_len);
+        }
+        templ[i].ulValueLen = len;
+    }
+
+    return call_done(&c, rv);
+}
+
+static CK_RV client_set_attribute_value(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
+        CK_ATTRIBUTE_PTR templ, CK_ULONG count) {
+
+    call c;
+    call_begin(&c, broker_call_set_attribute_value);
+    broker_put_ulong(&c.req, session);
+    broker_put_ulong(&c.req, object);
+    CK_RV rv = put_attrs(&c.req, templ, count);
+    if (rv == CKR_OK) {
+        rv = client_call(&c.req, &c.rep);
+    }
+
+    return call_done(&c, rv);
+}
+
+static CK_RV client_find_objects_init(CK_SESSION_HANDLE session, CK_ATTRIBUTE_PTR templ, CK_ULONG count) {
+
+    call c;
+    call_begin(&c, broker_call_find_objects_init);
+    broker_put_ulong(&c.req, session);
+    CK_RV rv = put_attrs(&c.req, templ, count);
+    if (rv == CKR_OK) {
+        rv = client_call(&c.req, &c.rep);
+    }
+
+    return call_done(&c, rv);
+}
+
+static CK_RV client_find_objects(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE_PTR objects,
+        CK_ULONG max, CK_ULONG_PTR count) {
+
+    if (!objects || !count) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    call c;
+    call_begin(&c, broker_call_find_objects);
+    broker_put_ulong(&c.req, session);
+    broker_put_out(&c.req, objects, max);
+    CK_RV rv = client_call(&c.req, &c.rep);
+    if (rv == CKR_OK) {
+        *count = max;
+        rv = get_out_list(&c.rep, rv, objects, count);
+    }
+
+    return call_done(&c, rv);
+}
+
+static CK_RV client_session(broker_call name, CK_SESSION_HANDLE session) {
+
+    call c;
+    call_begin(&c, name);
+    broker_put_ulong(&c.req, session);
+
+    return call_done(&c, client_call(&c.req, &c.rep));
+}
+
+static CK_RV client_find_objects_final(CK_SESSION_HANDLE session) {
+    return client_session(broker_call_find_objects_final, session);
+}
+
+static CK_RV client_op_init(broker_call name, CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech,
+        CK_OBJECT_HANDLE key) {
+
+    call c;
+    call_begin(&c, name);
+    broker_put_ulong(&c.req, session);
+    if (!broker_put_mech(&c.req, mech)) {
+        return call_done(&c, CKR_ARGUMENTS_BAD);
+    }
+    broker_put_ulong(&c.req, key);
+
+    return call_done(&c, client_call(&c.req, &c.rep));
+}
+
+static CK_RV client_in_out(broker_call name, CK_SESSION_HANDLE session, CK_BYTE_PTR in, CK_ULONG in_len,
+        CK_BYTE_PTR out, CK_ULONG_PTR out_len) {
+
+    if (!out_len) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    call c;
+    call_begin(&c, name);
+    broker_put_ulong(&c.req, session);
+    broker_put_bytes(&c.req, in, in_len);
+    broker_put_out(&c.req, out, *out_len);
+    CK_RV rv = client_call(&c.req, &c.rep);
+    if (call_replied(&c)) {
+        rv = get_out_buffer(&c.rep, rv, out, out_len);
+    }
+
+    return call_done(&c, rv);
+}
+
+static CK_RV client_out(broker_call name, CK_SESSION_HANDLE session, CK_BYTE_PTR out, CK_ULONG_PTR out_len) {
+
+    if (!out_len) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    call c;
+    call_begin(&c, name);
+    broker_put_ulong(&c.req, session);
+    broker_put_out(&c.req, out, *out_len);
+    CK_RV rv = client_call(&c.req, &c.rep);
+    if (call_replied(&c)) {
+        rv = get_out_buffer(&c.rep, rv, out, out_len);
+    }
+
+    return call_done(&c, rv);
+}
+
+static CK_RV client_in(broker_call name, CK_SESSION_HANDLE session, CK_BYTE_PTR in, CK_ULONG in_len) {
+
+    call c;
+    call_begin(&c, name);
+    broker_put_ulong(&c.req, session);
+    broker_put_bytes(&c.req, in, in_len);
+
+    return call_done(&c, client_call(&c.req, &c.rep));
+}
+
+#define CLIENT_OP_INIT(fn, name) \
+    static CK_RV fn(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech, CK_OBJECT_HANDLE key) { \
+        return client_op_init(broker_call_##name, session, mech, key); \
+    }
+
+#define CLIENT_IN_OUT(fn, name) \
+    static CK_RV fn(CK_SESSION_HANDLE session, CK_BYTE_PTR in, CK_ULONG in_len, \
+            CK_BYTE_PTR out, CK_ULONG_PTR out_len) { \
+        return client_in_out(broker_call_##name, session, in, in_len, out, out_len); \
+    }
+
+#define CLIENT_OUT(fn, name) \
+    static CK_RV fn(CK_SESSION_HANDLE session, CK_BYTE_PTR out, CK_ULONG_PTR out_len) { \
+        return client_out(broker_call_##name, session, out, out_len); \
+    }
+
+#define CLIENT_IN(fn, name) \
+    static CK_RV fn(CK_SESSION_HANDLE session, CK_BYTE_PTR in, CK_ULONG in_len) { \
+        return client_in(broker_call_##name, session, in, in_len); \
+    }
+
+CLIENT_OP_INIT(client_encrypt_init, encrypt_init)
+CLIENT_IN_OUT(client_encrypt, encrypt)
+CLIENT_IN_OUT(client_encrypt_update, encrypt_update)
+CLIENT_OUT(client_encrypt_final, encrypt_final)
+CLIENT_OP_INIT(client_decrypt_init, decrypt_init)
+CLIENT_IN_OUT(client_decrypt, decrypt)
+CLIENT_IN_OUT(client_decrypt_update, decrypt_update)
+CLIENT_OUT(client_decrypt_final, decrypt_final)
+CLIENT_IN_OUT(client_digest, digest)
+CLIENT_IN(client_digest_update, digest_update)
+CLIENT_OUT(client_digest_final, digest_final)
+CLIENT_OP_INIT(client_sign_init, sign_init)
+CLIENT_IN_OUT(client_sign, sign)
+CLIENT_IN(client_sign_update, sign_update)
+CLIENT_OUT(client_sign_final, sign_final)
+CLIENT_OP_INIT(client_verify_init, verify_init)
+CLIENT_IN(client_verify_update, verify_update)
+CLIENT_IN(client_verify_final, verify_final)
+CLIENT_OP_INIT(client_verify_recover_init, verify_recover_init)
+CLIENT_IN_OUT(client_verify_recover, verify_recover)
+
+static CK_RV client_seed_random(CK_SESSION_HANDLE session, CK_BYTE_PTR seed, CK_ULONG seed_len) {
+    return client_in(broker_call_seed_random, session, seed, seed_len);
+}
+
+static CK_RV client_digest_init(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech) {
+
+    call c;
+    call_begin(&c, broker_call_digest_init);
+    broker_put_ulong(&c.req, session);
+    if (!broker_put_mech(&c.req, mech)) {
+        return call_done(&c, CKR_ARGUMENTS_BAD);
+    }
+
+    return call_done(&c, client_call(&c.req, &c.rep));
+}
+
+static CK_RV client_verify(CK_SESSION_HANDLE session, CK_BYTE_PTR data, CK_ULONG data_len,
+        CK_BYTE_PTR sig, CK_ULONG sig_len) {
+
+    call c;
+    call_begin(&c, broker_call_verify);
+    broker_put_ulong(&c.req, session);
+    broker_put_bytes(&c.req, data, data_len);
+    broker_put_bytes(&c.req, sig, sig_len);
+
+    return call_done(&c, client_call(&c.req, &c.rep));
+}
+
+static CK_RV client_generate_key_pair(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech,
+        CK_ATTRIBUTE_PTR pub, CK_ULONG pub_count, CK_ATTRIBUTE_PTR priv, CK_ULONG priv_count,
+        CK_OBJECT_HANDLE_PTR pub_key, CK_OBJECT_HANDLE_PTR priv_key) {
+
+    if (!pub_key || !priv_key) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    call c;
+    call_begin(&c, broker_call_generate_key_pair);
+    broker_put_ulong(&c.req, session);
+    CK_RV rv = broker_put_mech(&c.req, mech) ? CKR_OK : CKR_ARGUMENTS_BAD;
+    if (rv == CKR_OK) {
+        rv = put_attrs(&c.req, pub, pub_count);
+    }
+    if (rv == CKR_OK) {
+        rv = put_attrs(&c.req, priv, priv_count);
+    }
+    if (rv == CKR_OK) {
+        rv = client_call(&c.req, &c.rep);
+    }
+    if (rv == CKR_OK) {
+        *pub_key = broker_get_ulong(&c.rep);
+        *priv_key = broker_get_ulong(&c.rep);
+    }
+
+    return call_done(&c, rv);
+}
+
+static CK_RV client_derive_key(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech, CK_OBJECT_HANDLE base,
+        CK_ATTRIBUTE_PTR templ, CK_ULONG count, CK_OBJECT_HANDLE_PTR key) {
+
+    if (!key) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    call c;
+    call_begin(&c, broker_call_derive_key);
+    broker_put_ulong(&c.req, session);
+    CK_RV rv = broker_put_mech(&c.req, mech) ? CKR_OK : CKR_ARGUMENTS_BAD;
+    broker_put_ulong(&c.req, base);
+    if (rv == CKR_OK) {
+        rv = put_attrs(&c.req, templ, count);
+    }
+    if (rv == CKR_OK) {
+        rv = client_call(&c.req, &c.rep);
+    }
+    if (rv == CKR_OK) {
+        *key = broker_get_ulong(&c.rep);
+    }
+
+    return call_done(&c, rv);
+}
+
+static CK_RV client_generate_random(CK_SESSION_HANDLE session, CK_BYTE_PTR out, CK_ULONG out_len) {
+
+    if (!out) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_ULONG len = out_len;
+    return client_out(broker_call_generate_random, session, out, &len);
+}
+
+static CK_RV client_get_function_list(CK_FUNCTION_LIST **function_list);
+
+/*
+ * What the library does not support goes to the library's own entry
+ * points, they fail without touching any state.
+ */
+static CK_FUNCTION_LIST _client_func_list = {
+    .version = { .major = CRYPTOKI_VERSION_MAJOR, .minor = CRYPTOKI_VERSION_MINOR },
+    .C_Initialize = client_initialize,
+    .C_Finalize = client_finalize,
+    .C_GetInfo = client_get_info,
+    .C_GetFunctionList = client_get_function_list,
+    .C_GetSlotList = client_get_slot_list,
+    .C_GetSlotInfo = client_get_slot_info,
+    .C_GetTokenInfo = client_get_token_info,
+    .C_GetMechanismList = client_get_mechanism_list,
+    .C_GetMechanismInfo = client_get_mechanism_info,
+    .C_InitToken = client_init_token,
+    .C_InitPIN = client_init_pin,
+    .C_SetPIN = client_set_pin,
+    .C_OpenSession = client_open_session,
+    .C_CloseSession = client_close_session,
+    .C_CloseAllSessions = client_close_all_sessions,
+    .C_GetSessionInfo = client_get_session_info,
+    .C_GetOperationState = C_GetOperationState,
+    .C_SetOperationState = C_SetOperationState,
+    .C_Login = client_login,
+    .C_Logout = client_logout,
+    .C_CreateObject = client_create_object,
+    .C_CopyObject = C_CopyObject,
+    .C_DestroyObject = client_destroy_object,
+    .C_GetObjectSize = C_GetObjectSize,
+    .C_GetAttributeValue = client_get_attribute_value,
+    .C_SetAttributeValue = client_set_attribute_value,
+    .C_FindObjectsInit = client_find_objects_init,
+    .C_FindObjects = client_find_objects,
+    .C_FindObjectsFinal = client_find_objects_final,
+    .C_EncryptInit = client_encrypt_init,
+    .C_Encrypt = client_encrypt,
+    .C_EncryptUpdate = client_encrypt_update,
+    .C_EncryptFinal = client_encrypt_final,
+    .C_DecryptInit = client_decrypt_init,
+    .C_Decrypt = client_decrypt,
+    .C_DecryptUpdate = client_decrypt_update,
+    .C_DecryptFinal = client_decrypt_final,
+    .C_DigestInit = client_digest_init,
+    .C_Digest = client_digest,
+    .C_DigestUpdate = client_digest_update,
+    .C_DigestKey = C_DigestKey,
+    .C_DigestFinal = client_digest_final,
+    .C_SignInit = client_sign_init,
+    .C_Sign = client_sign,
+    .C_SignUpdate = client_sign_update,
+    .C_SignFinal = client_sign_final,
+    .C_SignRecoverInit = C_SignRecoverInit,
+    .C_SignRecover = C_SignRecover,
+    .C_VerifyInit = client_verify_init,
+    .C_Verify = client_verify,
+    .C_VerifyUpdate = client_verify_update,
+    .C_VerifyFinal = client_verify_final,
+    .C_VerifyRecoverInit = client_verify_recover_init,
+    .C_VerifyRecover = client_verify_recover,
+    .C_DigestEncryptUpdate = C_DigestEncryptUpdate,
+    .C_DecryptDigestUpdate = C_DecryptDigestUpdate,
+    .C_SignEncryptUpdate = C_SignEncryptUpdate,
+    .C_DecryptVerifyUpdate = C_DecryptVerifyUpdate,
+    .C_GenerateKey = C_GenerateKey,
+    .C_GenerateKeyPair = client_generate_key_pair,
+    .C_WrapKey = C_WrapKey,
+    .C_UnwrapKey = C_UnwrapKey,
+    .C_DeriveKey = client_derive_key,
+    .C_SeedRandom = client_seed_random,
+    .C_GenerateRandom = client_generate_random,
+    .C_GetFunctionStatus = C_GetFunctionStatus,
+    .C_CancelFunction = C_CancelFunction,
+    .C_WaitForSlotEvent = client_wait_for_slot_event,
+};
+
+static CK_RV client_get_function_list(CK_FUNCTION_LIST **function_list) {
+    return broker_client_get_func_list(function_list);
+}
+
+CK_RV broker_client_get_func_list(CK_FUNCTION_LIST **function_list) {
+
+    if (!function_list) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    *function_list = &_client_func_list;
+
+    return CKR_OK;
+}
+
+static CK_INTERFACE _client_interface = {
+    .pInterfaceName = (char *)"PKCS 11",
+    .pFunctionList = &_client_func_list,
+};
+
+CK_INTERFACE *broker_client_get_interface(void) {
+    return &_client_interface;
+}
@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 
 #include <fcntl.h>
 #include <libgen.h>
@@ -27,9 +28,12 @@
 #include "mutex.h"
 #include "object.h"
 #include "parser.h"
+#include "profile.h"
 #include "session_table.h"
+#include "snapshot.h"
 #include "token.h"
 #include "tpm.h"
+#include "trace.h"
 #include "twist.h"
 #include "utils.h"
 #include "typed_memory.h"
@@ -40,7 +44,7 @@
 #define TPM2_PKCS11_STORE_DIR "/etc/tpm2_pkcs11"
 #endif
 
-#define DB_VERSION 8
+#define DB_VERSION 9
 
 #define goto_oom(x, l) if (!x) { LOGE("oom"); goto l; }
 #define goto_error(x, l) if (x) { goto l; }
@@ -49,6 +53,7 @@
 #define TRANSACTION_START \
     do { \
         bool _transaction_active = false; \
+        db_writer_lock(); \
         if (start() != SQLITE_OK) { \
             goto error; \
         } \
@@ -67,12 +72,47 @@
                 rollback(); \
             } \
         } \
+        db_writer_unlock(); \
     } while (0);
 
 #define CKR_VENDOR_SKIP (CKR_VENDOR_DEFINED | 0x01)
 
+/* the most read only connections kept for lookups */
+#define DB_READERS_MAX 64
+
+/* patches an object collects before they are folded into its row */
+#define DB_PATCHES_MAX 16
+
+typedef struct db_reader db_reader;
+struct db_reader {
+    /* opened on first use */
+    sqlite3 *db;
+    bool busy;
+};
+
 static struct {
+    /* the one connection that writes, see db_writer_lock() */
     sqlite3 *db;
+    void *writer_mutex;
+    /*
+     * Read only connections for lookups, so they don't queue behind the
+     * writer. Empty for in memory stores, which are private to db.
+     */
+    void *readers_mutex;
+    db_reader readers[DB_READERS_MAX];
+    unsigned reader_cnt;
+    /* in milliseconds, applied to every connection */
+    unsigned busy_timeout;
+    /*
+     * Large attribute values may be left in the store. This is only
+     * enabled once the store is set up, the upgrade handlers rewrite
+     * the objects they load and so need every value resident.
+     */
+    bool lazy_attrs;
+    /* opened with TPM2_PKCS11_STORE_READONLY, see db_is_readonly() */
+    bool readonly;
+    /* objects of the tokens it holds are loaded from it, see snapshot.h */
+    snapshot *snapshot;
 } global;
 
 static inline void _sqlite3_finalize_warn(sqlite3 *db, sqlite3_stmt *stmt) {
@@ -89,6 +129,28 @@ static inline void sqlite3_finalize_warn(sqlite3_stmt *stmt) {
     }
 }
 
+/*
+ * Every statement step is a trace point, and rows read count towards
+ * the startup profile. The wrapper is named after sqlite3_step so call
+ * sites stay untouched.
+ */
+static inline int db_step(sqlite3_stmt *stmt) {
+
+    TRACE(db_stmt_begin, sqlite3_sql(stmt), 0);
+
+    int rc = sqlite3_step(stmt);
+
+    TRACE(db_stmt_end, NULL, rc);
+
+    if (rc == SQLITE_ROW) {
+        profile_db_row();
+    }
+
+    return rc;
+}
+
+#define sqlite3_step(stmt) db_step(stmt)
+
 static int _get_blob(sqlite3_stmt *stmt, int i, bool can_be_null, twist *blob) {
 
 	/* This cannot return < 0 */
@@ -155,8 +217,12 @@ DEBUG_VISIBILITY tobject *__real_db_tobject_new(sqlite3_stmt *stmt) {
                 goto error;
             }
 
-            bool res = parse_attributes_from_string(attrs, bytes,
-                    &tobj->attrs);
+            profile_span span = profile_begin(profile_phase_yaml_parse,
+                    PROFILE_TOKEN_INHERIT);
+            bool res = global.lazy_attrs ?
+                    parse_attributes_from_string_lazy(attrs, bytes, &tobj->attrs) :
+                    parse_attributes_from_string(attrs, bytes, &tobj->attrs);
+            profile_end(&span);
             if (!res) {
                 LOGE("Could not parse DB attrs, got: \"%s\"", attrs);
                 goto error;
@@ -186,6 +252,99 @@ WEAK DEBUG_VISIBILITY tobject *db_tobject_new(sqlite3_stmt *stmt) {
     return __real_db_tobject_new(stmt);
 }
 
+static tobject *find_loaded_tobject(token *tok, unsigned id) {
+
+    list *cur = tok->tobjects.head ? &tok->tobjects.head->l : NULL;
+    while (cur) {
+        tobject *t = list_entry(cur, tobject, l);
+        if (t->id == id) {
+            return t;
+        }
+        cur = cur->next;
+    }
+
+    return NULL;
+}
+
+/*
+ * Applies the updates an object collected since its row was last written,
+ * see db_patch_tobject_attrs().
+ */
+static int apply_tobject_patches(token *tok) {
+
+    const char *sql =
+            "SELECT p.tobjid, p.attrs FROM tobject_patches p"
+            " JOIN tobjects t ON t.id=p.tobjid"
+            " WHERE t.tokid=? ORDER BY p.tobjid, p.id";
+
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot prepare tobject patch query: %s\n", sqlite3_errmsg(global.db));
+        return rc;
+    }
+
+    rc = sqlite3_bind_int(stmt, 1, tok->id);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot bind tobject patch tokid: %s\n", sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    tobject *tobj = NULL;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+
+        unsigned id = sqlite3_column_int(stmt, 0);
+        if (!tobj || tobj->id != id) {
+            if (tobj && object_init_from_attrs(tobj) != CKR_OK) {
+                LOGE("Object initialization failed");
+                rc = SQLITE_ERROR;
+                goto error;
+            }
+
+            tobj = find_loaded_tobject(tok, id);
+            if (!tobj) {
+                LOGE("Patch for unknown tobject id: %u", id);
+                rc = SQLITE_ERROR;
+                goto error;
+            }
+        }
+
+        int bytes = sqlite3_column_bytes(stmt, 1);
+        const unsigned char *yaml = sqlite3_column_text(stmt, 1);
+
+        attr_list *patch = NULL;
+        if (!yaml || !bytes ||
+                !parse_attributes_from_string(yaml, bytes, &patch)) {
+            LOGE("Could not parse tobject patch, got: \"%s\"", yaml);
+            rc = SQLITE_ERROR;
+            goto error;
+        }
+
+        CK_RV rv = attr_list_merge(&tobj->attrs, patch);
+        attr_list_free(patch);
+        if (rv != CKR_OK) {
+            rc = SQLITE_ERROR;
+            goto error;
+        }
+    }
+
+    if (rc != SQLITE_DONE) {
+        LOGE("Cannot step tobject patch query: %s\n", sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    /* checks the result and compacts it again */
+    rc = SQLITE_OK;
+    if (tobj && object_init_from_attrs(tobj) != CKR_OK) {
+        LOGE("Object initialization failed");
+        rc = SQLITE_ERROR;
+    }
+
+error:
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
 DEBUG_VISIBILITY int __real_init_tobjects(token *tok) {
 
     const char *sql =
@@ -219,7 +378,7 @@ DEBUG_VISIBILITY int __real_init_tobjects(token *tok) {
         }
     }
 
-    rc = SQLITE_OK;
+    rc = apply_tobject_patches(tok);
 
 error:
     sqlite3_finalize(stmt);
@@ -230,6 +389,25 @@ WEAK DEBUG_VISIBILITY int init_tobjects(token *tok) {
     return __real_init_tobjects(tok);
 }
 
+static int load_tobjects(token *tok) {
+
+    if (global.snapshot) {
+        profile_span span = profile_begin(profile_phase_snapshot_load,
+                PROFILE_TOKEN_INHERIT);
+        CK_RV rv = snapshot_load_tobjects(global.snapshot, tok);
+        profile_end(&span);
+        if (rv == CKR_OK) {
+            return SQLITE_OK;
+        }
+
+        if (rv != CKR_TOKEN_NOT_PRESENT) {
+            return SQLITE_ERROR;
+        }
+    }
+
+    return init_tobjects(tok);
+}
+
 static void pobject_v3_free(pobject_v3 *old_pobj) {
 
     twist_free(old_pobj->handle);
@@ -311,8 +489,40 @@ DEBUG_VISIBILITY CK_RV convert_pobject_v3_to_v4(pobject_v3 *old_pobj, pobject_v4
     return CKR_OK;
 }
 
+/*
+ * Writes through db are serialized here, a transaction on it is the whole
+ * process's. Other processes are kept out by sqlite's locks, waited on for
+ * up to the busy timeout.
+ */
+static void db_writer_lock(void) {
+    /* NULL before db_init() and without locking */
+    if (global.writer_mutex) {
+        mutex_lock_fatal(global.writer_mutex);
+    }
+}
+
+static void db_writer_unlock(void) {
+    if (global.writer_mutex) {
+        mutex_unlock_fatal(global.writer_mutex);
+    }
+}
+
+/*
+ * Takes a pooled read only connection, or db with the writer lock held if
+ * there is no pool or every connection is in use. Give it back with
+ * db_reader_release().
+ */
+static sqlite3 *db_reader_acquire(void);
+
+static void db_reader_release(sqlite3 *db);
+
 static int start2(sqlite3 *db) {
-    int rc = sqlite3_exec(db, "BEGIN TRANSACTION", NULL, NULL, NULL);
+    /*
+     * Take the write lock up front. A deferred transaction that reads
+     * first can't wait for another writer in WAL mode, it fails with
+     * SQLITE_BUSY as soon as it tries to write.
+     */
+    int rc = sqlite3_exec(db, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL);
     if (rc != SQLITE_OK) {
         LOGE("%s", sqlite3_errmsg(db));
     }
@@ -615,13 +825,17 @@ CK_RV db_get_tokens(token *tok, size_t *len) {
             }
         } /* done with sql key value search */
 
+        profile_span span = profile_begin(profile_phase_token_min_init, t->id);
         CK_RV rv = token_min_init(t);
+        profile_end(&span);
         if (rv != CKR_OK) {
             goto error;
         }
 
         /* tokens in the DB store already have an associated primary object */
+        span = profile_begin(profile_phase_init_pobject, t->id);
         rc = init_pobject(t->pid, &t->pobject, t->tctx);
+        profile_end(&span);
         if (rc != SQLITE_OK) {
             goto error;
         }
@@ -633,12 +847,16 @@ CK_RV db_get_tokens(token *tok, size_t *len) {
             continue;
         }
 
+        span = profile_begin(profile_phase_init_sealobjects, t->id);
         rc = init_sealobjects(t->id, &t->esysdb.sealobject);
+        profile_end(&span);
         if (rc != SQLITE_OK) {
             goto error;
         }
 
-        rc = init_tobjects(t);
+        span = profile_begin(profile_phase_init_tobjects, t->id);
+        rc = load_tobjects(t);
+        profile_end(&span);
         if (rc != SQLITE_OK) {
             goto error;
         }
@@ -959,7 +1177,7 @@ error:
     return rv;
 }
 
-CK_RV _db_update_tobject_attrs(sqlite3 *db, unsigned id, attr_list *attrs) {
+static CK_RV _db_update_tobject_attrs(sqlite3 *db, unsigned id, attr_list *attrs) {
     assert(attrs);
 
     CK_RV rv = CKR_GENERAL_ERROR;
@@ -1002,168 +1220,428 @@ error:
     return rv;
 }
 
-CK_RV db_update_tobject_attrs(unsigned id, attr_list *attrs) {
-    assert(attrs);
-
-    return _db_update_tobject_attrs(global.db, id,  attrs);
-}
-
-CK_RV db_add_token(token *tok) {
-    assert(tok);
+/*
+ * The row of an object followed by its patches in the order they were
+ * written, see db_patch_tobject_attrs().
+ */
+#define TOBJECT_ATTRS_SQL \
+    "SELECT 0 AS seq, attrs FROM tobjects WHERE id=?1" \
+    " UNION ALL " \
+    "SELECT id AS seq, attrs FROM tobject_patches WHERE tobjid=?1"
 
-    /* This function is only called from token_initialize, hence... */
-    assert(tok->config.is_initialized);
+/* reads the current attributes of an object with every value resident */
+static CK_RV db_read_tobject_attrs(sqlite3 *db, unsigned id, attr_list **attrs) {
 
     CK_RV rv = CKR_GENERAL_ERROR;
 
+    attr_list *merged = NULL;
     sqlite3_stmt *stmt = NULL;
 
-    char *config = emit_config_to_string(tok);
-    if (!config) {
-        LOGE("Could not get token config");
-        return CKR_GENERAL_ERROR;
+    const char *sql = TOBJECT_ATTRS_SQL " ORDER BY seq;";
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        LOGE("%s", sqlite3_errmsg(db));
+        goto error;
     }
 
-    /* strip trailing spaces */
-    char label_buf[sizeof(tok->label) + 1] = { 0 };
-    memcpy(label_buf, tok->label, sizeof(tok->label));
-
-    size_t i;
-    for (i=sizeof(tok->label); i > 0; i--) {
-        char *p = &label_buf[i-1];
-        if (*p != ' ') {
-            break;
-        }
-        *p = '\0';
-    }
+    rc = sqlite3_bind_int(stmt, 1, id);
+    gotobinderror(rc, "id");
 
-    const char *sql =
-          "INSERT INTO tokens ("
-            "pid, "       // index: 1 type: INT
-            "label,"      // index: 2 type: TEXT
-            "config"      // index: 3 type: TEXT (JSON)
-          ") VALUES ("
-            "?,?,?"
-          ");";
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
 
-    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
-    if (rc != SQLITE_OK) {
-        LOGE("%s", sqlite3_errmsg(global.db));
-        free(config);
-        return CKR_GENERAL_ERROR;
-    }
+        bool is_row = sqlite3_column_int64(stmt, 0) == 0;
+        if (!is_row && !merged) {
+            LOGE("tobject %u has patches but no row", id);
+            goto error;
+        }
 
-    TRANSACTION_START;
+        int bytes = sqlite3_column_bytes(stmt, 1);
+        const unsigned char *yaml = sqlite3_column_text(stmt, 1);
+        if (!yaml || !bytes) {
+            LOGE("tobject does not have attributes");
+            goto error;
+        }
 
-    rc = sqlite3_bind_int(stmt, 1, tok->pid);
-    gotobinderror(rc, "pid");
+        attr_list *a = NULL;
+        bool res = parse_attributes_from_string(yaml, bytes, &a);
+        if (!res) {
+            LOGE("Could not parse DB attrs, got: \"%s\"", yaml);
+            goto error;
+        }
 
-    rc = sqlite3_bind_text(stmt, 2, label_buf, -1, SQLITE_STATIC);
-    gotobinderror(rc, "config");
+        if (is_row) {
+            merged = a;
+            continue;
+        }
 
-    rc = sqlite3_bind_text(stmt, 3, config, -1, SQLITE_STATIC);
-    gotobinderror(rc, "label");
+        CK_RV tmp_rv = attr_list_merge(&merged, a);
+        attr_list_free(a);
+        if (tmp_rv != CKR_OK) {
+            goto error;
+        }
+    }
 
-    rc = sqlite3_step(stmt);
     if (rc != SQLITE_DONE) {
-        LOGE("step error: %s", sqlite3_errmsg(global.db));
+        LOGE("step error: %s", sqlite3_errmsg(db));
         goto error;
     }
 
-    sqlite3_int64 id = sqlite3_last_insert_rowid(global.db);
-    if (id == 0) {
-        LOGE("Could not get id: %s", sqlite3_errmsg(global.db));
+    if (!merged) {
+        LOGE("Could not find tobject id: %u", id);
         goto error;
     }
 
-    if (id > UINT_MAX) {
-        LOGE("id is larger than unsigned int, got: %lld", id);
-        goto error;
+    *attrs = merged;
+    merged = NULL;
+
+    rv = CKR_OK;
+
+error:
+    attr_list_free(merged);
+    if (stmt) {
+        _sqlite3_finalize_warn(db, stmt);
     }
+    return rv;
+}
 
-    tok->id = id;
+static CK_RV db_add_tobject_patch(sqlite3 *db, unsigned id, const char *attrs,
+        unsigned *count) {
 
-    rc = sqlite3_finalize(stmt);
-    gotobinderror(rc, "finalize");
-    stmt = NULL;
+    CK_RV rv = CKR_GENERAL_ERROR;
 
-    /* add the sealobjects WITHIN the transaction */
-    sql = "INSERT INTO sealobjects"
-            "(tokid, soauthsalt, sopriv, sopub)"
-            "VALUES(?,?,?,?)";
+    sqlite3_stmt *stmt = NULL;
 
-    rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    const char *sql =
+          "INSERT INTO tobject_patches ("
+            "tobjid, "    // index: 1 type: INT
+            "attrs"       // index: 2 type: TEXT (JSON)
+          ") VALUES ("
+            "?,?"
+          ");";
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) {
-        LOGE("%s", sqlite3_errmsg(global.db));
+        LOGE("%s", sqlite3_errmsg(db));
         goto error;
     }
 
-    rc = sqlite3_bind_int(stmt, 1, tok->id);
-    gotobinderror(rc, "tokid");
-
-    rc = sqlite3_bind_text(stmt, 2, tok->esysdb.sealobject.soauthsalt, -1, SQLITE_STATIC);
-    gotobinderror(rc, "soauthsalt");
-
-    rc = sqlite3_bind_blob(stmt, 3, tok->esysdb.sealobject.sopriv,
-            twist_len(tok->esysdb.sealobject.sopriv), SQLITE_STATIC);
-    gotobinderror(rc, "sopriv");
+    rc = sqlite3_bind_int(stmt, 1, id);
+    gotobinderror(rc, "tobjid");
 
-    rc = sqlite3_bind_blob(stmt, 4, tok->esysdb.sealobject.sopub,
-            twist_len(tok->esysdb.sealobject.sopub), SQLITE_STATIC);
-    gotobinderror(rc, "sopub");
+    rc = sqlite3_bind_text(stmt, 2, attrs, -1, SQLITE_STATIC);
+    gotobinderror(rc, "attrs");
 
     rc = sqlite3_step(stmt);
     if (rc != SQLITE_DONE) {
-        LOGE("step error: %s", sqlite3_errmsg(global.db));
+        LOGE("step error: %s", sqlite3_errmsg(db));
         goto error;
     }
 
-    rv = CKR_OK;
-
-    TRANSACTION_END(rv);
-
-    sqlite3_finalize_warn(stmt);
-
-    free(config);
-
-    return rv;
-}
-
-CK_RV db_get_first_pid(unsigned *id) {
-    assert(id);
-
-    CK_RV rv = CKR_GENERAL_ERROR;
-
-    const char *sql =
-            "SELECT id FROM pobjects ORDER BY id ASC LIMIT 1";
+    _sqlite3_finalize_warn(db, stmt);
 
-    sqlite3_stmt *stmt;
-    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    sql = "SELECT COUNT(*) FROM tobject_patches WHERE tobjid=?;";
+    rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
     if (rc != SQLITE_OK) {
-        LOGE("Cannot prepare first pid query: %s\n", sqlite3_errmsg(global.db));
-        return rv;
+        stmt = NULL;
+        LOGE("%s", sqlite3_errmsg(db));
+        goto error;
     }
 
+    rc = sqlite3_bind_int(stmt, 1, id);
+    gotobinderror(rc, "tobjid");
+
     rc = sqlite3_step(stmt);
-    if (rc == SQLITE_ROW) {
-        *id = sqlite3_column_int(stmt, 0);
-    } else if (rc == SQLITE_DONE) {
-        *id = 0;
-    } else {
-        LOGE("Cannot step query: %s\n", sqlite3_errmsg(global.db));
+    if (rc != SQLITE_ROW) {
+        LOGE("step error: %s", sqlite3_errmsg(db));
         goto error;
     }
 
+    *count = sqlite3_column_int(stmt, 0);
+
     rv = CKR_OK;
 
 error:
-    sqlite3_finalize(stmt);
+    if (stmt) {
+        _sqlite3_finalize_warn(db, stmt);
+    }
     return rv;
 }
 
+CK_RV db_patch_tobject_attrs(unsigned id, attr_list *changed) {
+    assert(changed);
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    attr_list *attrs = NULL;
+    unsigned count = 0;
+
+    if (!attr_list_get_count(changed)) {
+        return CKR_OK;
+    }
+
+    char *attr_str = emit_attributes_to_string(changed);
+    if (!attr_str) {
+        LOGE("Could not emit tobject attributes");
+        return CKR_GENERAL_ERROR;
+    }
+
+    TRANSACTION_START;
+
+    rv = db_add_tobject_patch(global.db, id, attr_str, &count);
+
+    /*
+     * Fold the patches into the row so loading and lookups stay cheap,
+     * writing the row drops them, see the tobject_patches_fold trigger.
+     */
+    if (rv == CKR_OK && count >= DB_PATCHES_MAX) {
+        rv = db_read_tobject_attrs(global.db, id, &attrs);
+        if (rv == CKR_OK) {
+            rv = _db_update_tobject_attrs(global.db, id, attrs);
+        }
+    }
+
+    TRANSACTION_END(rv);
+
+    attr_list_free(attrs);
+    free(attr_str);
+
+    return rv;
+}
+
+CK_RV db_get_tobject_attr(unsigned id, CK_ATTRIBUTE_TYPE type, twist *value) {
+    assert(value);
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    attr_list *attrs = NULL;
+    sqlite3_stmt *stmt = NULL;
+
+    sqlite3 *db = db_reader_acquire();
+
+    /* the newest patch that has the attribute holds its value */
+    const char *sql = TOBJECT_ATTRS_SQL " ORDER BY seq DESC;";
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        LOGE("%s", sqlite3_errmsg(db));
+        goto error;
+    }
+
+    rc = sqlite3_bind_int(stmt, 1, id);
+    gotobinderror(rc, "id");
+
+    CK_ATTRIBUTE_PTR a = NULL;
+    while (!a && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+
+        int bytes = sqlite3_column_bytes(stmt, 1);
+        const unsigned char *yaml = sqlite3_column_text(stmt, 1);
+        if (!yaml || !bytes) {
+            LOGE("tobject does not have attributes");
+            goto error;
+        }
+
+        attr_list_free(attrs);
+        attrs = NULL;
+
+        bool res = parse_attributes_from_string(yaml, bytes, &attrs);
+        if (!res) {
+            LOGE("Could not parse DB attrs, got: \"%s\"", yaml);
+            goto error;
+        }
+
+        a = attr_get_attribute_by_type(attrs, type);
+    }
+
+    if (!a && rc != SQLITE_DONE) {
+        LOGE("step error: %s", sqlite3_errmsg(db));
+        goto error;
+    }
+
+    if (!a || !a->pValue || !a->ulValueLen) {
+        LOGE("tobject %u has no value for attribute 0x%lx", id, type);
+        goto error;
+    }
+
+    *value = twistbin_new(a->pValue, a->ulValueLen);
+    if (!*value) {
+        LOGE("oom");
+        rv = CKR_HOST_MEMORY;
+        goto error;
+    }
+
+    rv = CKR_OK;
+
+error:
+    attr_list_free(attrs);
+    if (stmt) {
+        _sqlite3_finalize_warn(db, stmt);
+    }
+    db_reader_release(db);
+    return rv;
+}
+
+CK_RV db_add_token(token *tok) {
+    assert(tok);
+
+    /* This function is only called from token_initialize, hence... */
+    assert(tok->config.is_initialized);
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    sqlite3_stmt *stmt = NULL;
+
+    char *config = emit_config_to_string(tok);
+    if (!config) {
+        LOGE("Could not get token config");
+        return CKR_GENERAL_ERROR;
+    }
+
+    /* strip trailing spaces */
+    char label_buf[sizeof(tok->label) + 1] = { 0 };
+    memcpy(label_buf, tok->label, sizeof(tok->label));
+
+    size_t i;
+    for (i=sizeof(tok->label); i > 0; i--) {
+        char *p = &label_buf[i-1];
+        if (*p != ' ') {
+            break;
+        }
+        *p = '\0';
+    }
+
+    const char *sql =
+          "INSERT INTO tokens ("
+            "pid, "       // index: 1 type: INT
+            "label,"      // index: 2 type: TEXT
+            "config"      // index: 3 type: TEXT (JSON)
+          ") VALUES ("
+            "?,?,?"
+          ");";
+
+    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        LOGE("%s", sqlite3_errmsg(global.db));
+        free(config);
+        return CKR_GENERAL_ERROR;
+    }
+
+    TRANSACTION_START;
+
+    rc = sqlite3_bind_int(stmt, 1, tok->pid);
+    gotobinderror(rc, "pid");
+
+    rc = sqlite3_bind_text(stmt, 2, label_buf, -1, SQLITE_STATIC);
+    gotobinderror(rc, "config");
+
+    rc = sqlite3_bind_text(stmt, 3, config, -1, SQLITE_STATIC);
+    gotobinderror(rc, "label");
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        LOGE("step error: %s", sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    sqlite3_int64 id = sqlite3_last_insert_rowid(global.db);
+    if (id == 0) {
+        LOGE("Could not get id: %s", sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    if (id > UINT_MAX) {
+        LOGE("id is larger than unsigned int, got: %lld", id);
+        goto error;
+    }
+
+    tok->id = id;
+
+    rc = sqlite3_finalize(stmt);
+    gotobinderror(rc, "finalize");
+    stmt = NULL;
+
+    /* add the sealobjects WITHIN the transaction */
+    sql = "INSERT INTO sealobjects"
+            "(tokid, soauthsalt, sopriv, sopub)"
+            "VALUES(?,?,?,?)";
+
+    rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        LOGE("%s", sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    rc = sqlite3_bind_int(stmt, 1, tok->id);
+    gotobinderror(rc, "tokid");
+
+    rc = sqlite3_bind_text(stmt, 2, tok->esysdb.sealobject.soauthsalt, -1, SQLITE_STATIC);
+    gotobinderror(rc, "soauthsalt");
+
+    rc = sqlite3_bind_blob(stmt, 3, tok->esysdb.sealobject.sopriv,
+            twist_len(tok->esysdb.sealobject.sopriv), SQLITE_STATIC);
+    gotobinderror(rc, "sopriv");
+
+    rc = sqlite3_bind_blob(stmt, 4, tok->esysdb.sealobject.sopub,
+            twist_len(tok->esysdb.sealobject.sopub), SQLITE_STATIC);
+    gotobinderror(rc, "sopub");
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        LOGE("step error: %s", sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    rv = CKR_OK;
+
+    TRANSACTION_END(rv);
+
+    sqlite3_finalize_warn(stmt);
+
+    free(config);
+
+    return rv;
+}
+
+CK_RV db_get_first_pid(unsigned *id) {
+    assert(id);
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    const char *sql =
+            "SELECT id FROM pobjects ORDER BY id ASC LIMIT 1";
+
+    sqlite3_stmt *stmt;
+    int rc = sqlite3_prepare_v2(global.db, sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot prepare first pid query: %s\n", sqlite3_errmsg(global.db));
+        return rv;
+    }
+
+    rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+        *id = sqlite3_column_int(stmt, 0);
+    } else if (rc == SQLITE_DONE) {
+        *id = 0;
+    } else {
+        LOGE("Cannot step query: %s\n", sqlite3_errmsg(global.db));
+        goto error;
+    }
+
+    rv = CKR_OK;
+
+error:
+    sqlite3_finalize(stmt);
+    return rv;
+}
 
-#define DB_NAME "tpm2_pkcs11.sqlite3"
-#define PKCS11_STORE_ENV_VAR "TPM2_PKCS11_STORE"
+
+#define DB_NAME "tpm2_pkcs11.sqlite3"
+#define PKCS11_STORE_ENV_VAR "TPM2_PKCS11_STORE"
+#define PKCS11_STORE_READONLY_ENV_VAR "TPM2_PKCS11_STORE_READONLY"
+#define PKCS11_STORE_JOURNAL_MODE_ENV_VAR "TPM2_PKCS11_STORE_JOURNAL_MODE"
+#define PKCS11_STORE_BUSY_TIMEOUT_ENV_VAR "TPM2_PKCS11_STORE_BUSY_TIMEOUT"
+#define PKCS11_STORE_READERS_ENV_VAR "TPM2_PKCS11_STORE_READERS"
+
+#define DB_JOURNAL_MODE_DEFAULT "wal"
+#define DB_BUSY_TIMEOUT_DEFAULT 5000
+#define DB_READERS_DEFAULT      4
 
 static CK_RV handle_env_var(char *path, size_t len, bool *skip) {
 
@@ -2194,6 +2672,38 @@ error:
     return rv;
 }
 
+static CK_RV dbup_handler_from_8_to_9(sqlite3 *updb) {
+
+    /*
+     * Between version 8 and 9 of the DB the following changes need to be made:
+     *
+     * Table tobject_patches:
+     *
+     * New, holds the attributes C_SetAttributeValue changed until they are
+     * folded into the tobjects row, see db_patch_tobject_attrs().
+     */
+    const char *sql[] = {
+        "CREATE TABLE tobject_patches("
+            "id INTEGER PRIMARY KEY,"
+            "tobjid INTEGER NOT NULL,"
+            "attrs TEXT NOT NULL,"
+            "FOREIGN KEY (tobjid) REFERENCES tobjects(id) ON DELETE CASCADE"
+        ");",
+        "CREATE INDEX tobject_patches_tobjid ON tobject_patches(tobjid);",
+        "CREATE TRIGGER tobject_patches_fold\n"
+        "AFTER UPDATE OF attrs ON tobjects\n"
+        "BEGIN\n"
+        "    DELETE FROM tobject_patches WHERE tobjid=NEW.id;\n"
+        "END;\n",
+        "CREATE TRIGGER tobject_patches_drop\n"
+        "AFTER DELETE ON tobjects\n"
+        "BEGIN\n"
+        "    DELETE FROM tobject_patches WHERE tobjid=OLD.id;\n"
+        "END;\n",
+    };
+
+    return run_sql_list(updb, sql, ARRAY_LEN(sql));
+}
 
 static CK_RV db_backup(sqlite3 *db, const char *dbpath, sqlite3 **updb, char **copypath) {
 
@@ -2270,7 +2780,8 @@ static CK_RV db_update(sqlite3 **xdb, const char *dbpath, unsigned old_version,
             dbup_handler_from_4_to_5,
             dbup_handler_from_5_to_6,
             dbup_handler_from_6_to_7,
-            dbup_handler_from_7_to_8
+            dbup_handler_from_7_to_8,
+            dbup_handler_from_8_to_9
     };
 
     /*
@@ -2505,6 +3016,23 @@ CK_RV db_init_new(sqlite3 *db) {
             "attrs TEXT NOT NULL,"
             "FOREIGN KEY (tokid) REFERENCES tokens(id) ON DELETE CASCADE"
         ");",
+        "CREATE TABLE tobject_patches("
+            "id INTEGER PRIMARY KEY,"
+            "tobjid INTEGER NOT NULL,"
+            "attrs TEXT NOT NULL,"
+            "FOREIGN KEY (tobjid) REFERENCES tobjects(id) ON DELETE CASCADE"
+        ");",
+        "CREATE INDEX tobject_patches_tobjid ON tobject_patches(tobjid);",
+        "CREATE TRIGGER tobject_patches_fold\n"
+        "AFTER UPDATE OF attrs ON tobjects\n"
+        "BEGIN\n"
+        "    DELETE FROM tobject_patches WHERE tobjid=NEW.id;\n"
+        "END;\n",
+        "CREATE TRIGGER tobject_patches_drop\n"
+        "AFTER DELETE ON tobjects\n"
+        "BEGIN\n"
+        "    DELETE FROM tobject_patches WHERE tobjid=OLD.id;\n"
+        "END;\n",
         "CREATE TABLE schema("
             "id INTEGER PRIMARY KEY,"
             "schema_version INTEGER NOT NULL"
@@ -2617,12 +3145,381 @@ out:
     return rv;
 }
 
-DEBUG_VISIBILITY WEAK
-CK_RV db_new(sqlite3 **db) {
+static bool db_readonly_requested(void) {
 
-    char dbpath[PATH_MAX];
-    CK_RV rv = db_get_existing(dbpath, sizeof(dbpath));
+    const char *env = getenv(PKCS11_STORE_READONLY_ENV_VAR);
+    return env && env[0] && strcmp(env, "0");
+}
+
+/*
+ * An immutable store is opened by URI, so the characters URIs give a
+ * meaning to are escaped in the path.
+ */
+static CK_RV db_readonly_uri(const char *dbpath, char *uri, size_t len) {
+
+    static const char prefix[] = "file:";
+    static const char suffix[] = "?mode=ro&immutable=1";
+
+    size_t off = 0;
+    if (len < sizeof(prefix)) {
+        goto overlength;
+    }
+    memcpy(uri, prefix, sizeof(prefix) - 1);
+    off += sizeof(prefix) - 1;
+
+    const char *p;
+    for (p=dbpath; *p; p++) {
+        if (*p == '%' || *p == '?' || *p == '#') {
+            if (off + 3 >= len) {
+                goto overlength;
+            }
+            snprintf(&uri[off], 4, "%%%02X", (unsigned char)*p);
+            off += 3;
+            continue;
+        }
+
+        if (off + 1 >= len) {
+            goto overlength;
+        }
+        uri[off++] = *p;
+    }
+
+    if (off + sizeof(suffix) > len) {
+        goto overlength;
+    }
+    memcpy(&uri[off], suffix, sizeof(suffix));
+
+    return CKR_OK;
+
+overlength:
+    LOGE("Read only DB URI for \"%s\" is longer than %zu", dbpath, len);
+    return CKR_GENERAL_ERROR;
+}
+
+static CK_RV db_open(const char *dbpath, sqlite3 **db) {
+
+    int rc;
+    if (global.readonly) {
+        char uri[PATH_MAX + 64];
+        CK_RV rv = db_readonly_uri(dbpath, uri, sizeof(uri));
+        if (rv != CKR_OK) {
+            return rv;
+        }
+
+        rc = sqlite3_open_v2(uri, db, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI,
+                NULL);
+    } else {
+        rc = sqlite3_open(dbpath, db);
+    }
+
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot open database: %s\n", sqlite3_errmsg(*db));
+        sqlite3_close(*db);
+        *db = NULL;
+        return CKR_GENERAL_ERROR;
+    }
+
+    sqlite3_busy_timeout(*db, global.busy_timeout);
+
+    return CKR_OK;
+}
+
+/*
+ * Opens a connection that only reads and is only ever used by one thread
+ * at a time, so it goes without sqlite's connection mutex.
+ */
+static CK_RV db_open_reader(const char *dbpath, sqlite3 **db) {
+
+    /* already opened read only, and immutable */
+    if (global.readonly) {
+        return db_open(dbpath, db);
+    }
+
+    int rc = sqlite3_open_v2(dbpath, db,
+            SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot open database: %s\n", sqlite3_errmsg(*db));
+        sqlite3_close(*db);
+        *db = NULL;
+        return CKR_GENERAL_ERROR;
+    }
+
+    sqlite3_busy_timeout(*db, global.busy_timeout);
+
+    return CKR_OK;
+}
+
+static sqlite3 *db_reader_acquire(void) {
+
+    db_reader *r = NULL;
+
+    if (global.reader_cnt) {
+        mutex_lock_fatal(global.readers_mutex);
+
+        unsigned i;
+        for (i=0; i < global.reader_cnt; i++) {
+            if (!global.readers[i].busy) {
+                r = &global.readers[i];
+                r->busy = true;
+                break;
+            }
+        }
+
+        mutex_unlock_fatal(global.readers_mutex);
+    }
+
+    /* opening is slow, and the entry is ours while busy */
+    if (r && !r->db) {
+        const char *path = sqlite3_db_filename(global.db, "main");
+        CK_RV rv = db_open_reader(path, &r->db);
+        if (rv != CKR_OK) {
+            LOGW("Cannot open a read only connection, reading through the "
+                    "writer");
+            mutex_lock_fatal(global.readers_mutex);
+            r->busy = false;
+            mutex_unlock_fatal(global.readers_mutex);
+            r = NULL;
+        }
+    }
+
+    if (r) {
+        return r->db;
+    }
+
+    db_writer_lock();
+    return global.db;
+}
+
+static void db_reader_release(sqlite3 *db) {
+
+    if (db == global.db) {
+        db_writer_unlock();
+        return;
+    }
+
+    mutex_lock_fatal(global.readers_mutex);
+
+    unsigned i;
+    for (i=0; i < global.reader_cnt; i++) {
+        if (global.readers[i].db == db) {
+            global.readers[i].busy = false;
+            break;
+        }
+    }
+
+    mutex_unlock_fatal(global.readers_mutex);
+}
+
+static void db_readers_close(void) {
+
+    unsigned i;
+    for (i=0; i < global.reader_cnt; i++) {
+        sqlite3 *db = global.readers[i].db;
+        if (db && sqlite3_close(db) != SQLITE_OK) {
+            LOGW("Cannot close database: %s\n", sqlite3_errmsg(db));
+        }
+    }
+
+    memset(global.readers, 0, sizeof(global.readers));
+}
+
+static unsigned db_env_uint(const char *name, unsigned dflt, unsigned max) {
+
+    const char *env = getenv(name);
+    if (!env || !env[0]) {
+        return dflt;
+    }
+
+    char *end = NULL;
+    errno = 0;
+    unsigned long value = strtoul(env, &end, 0);
+    if (errno || *end || value > max) {
+        LOGW("Ignoring %s=\"%s\", expected a number up to %u, using %u",
+                name, env, max, dflt);
+        return dflt;
+    }
+
+    return value;
+}
+
+/*
+ * WAL lets readers, in this and other processes, go on while a writer
+ * commits, where the rollback journal locks them out. The mode is kept in
+ * the store, so this is only a change the first time.
+ */
+static void db_set_journal_mode(sqlite3 *db) {
+
+    /* the modes that keep a store safe over a crash */
+    static const char *modes[] = { "wal", "delete", "truncate", "persist" };
+
+    const char *mode = getenv(PKCS11_STORE_JOURNAL_MODE_ENV_VAR);
+    if (!mode || !mode[0]) {
+        mode = DB_JOURNAL_MODE_DEFAULT;
+    }
+
+    size_t i;
+    for (i=0; i < ARRAY_LEN(modes); i++) {
+        if (!strcasecmp(mode, modes[i])) {
+            break;
+        }
+    }
+
+    if (i == ARRAY_LEN(modes)) {
+        LOGW("Ignoring "PKCS11_STORE_JOURNAL_MODE_ENV_VAR"=\"%s\", expected "
+                "wal, delete, truncate or persist", mode);
+        mode = DB_JOURNAL_MODE_DEFAULT;
+    }
+
+    char sql[64];
+    snprintf(sql, sizeof(sql), "PRAGMA journal_mode=%s", mode);
+
+    sqlite3_stmt *stmt = NULL;
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        LOGW("Cannot prepare journal mode query: %s", sqlite3_errmsg(db));
+        return;
+    }
+
+    /* the store stays in its mode if it can't change, it just works slower */
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_ROW) {
+        LOGW("Cannot set journal mode %s: %s", mode, sqlite3_errmsg(db));
+    } else {
+        const char *got = (const char *)sqlite3_column_text(stmt, 0);
+        if (!got || strcasecmp(got, mode)) {
+            LOGW("Store stays in journal mode %s, %s is not available",
+                    got ? got : "unknown", mode);
+        } else {
+            LOGV("Store journal mode: %s", got);
+        }
+    }
+
+    _sqlite3_finalize_warn(db, stmt);
+}
+
+/*
+ * In WAL mode commits only reach the store file when they are checkpointed,
+ * so its stamp tells nothing about a snapshot while the log holds any.
+ */
+static bool db_wal_pending(sqlite3 *db, const char *dbpath) {
+
+    /* an immutable store is never checkpointed, any log means changes */
+    if (global.readonly) {
+        char walpath[PATH_MAX];
+        unsigned l = snprintf(walpath, sizeof(walpath), "%s-wal", dbpath);
+        struct stat sb;
+        return l >= sizeof(walpath)
+                || (!stat(walpath, &sb) && sb.st_size > 0);
+    }
+
+    /* both stay -1 outside of WAL mode */
+    int log = -1;
+    int ckpt = -1;
+    int rc = sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_PASSIVE,
+            &log, &ckpt);
+    if (rc != SQLITE_OK) {
+        LOGV("Cannot checkpoint the store: %s", sqlite3_errmsg(db));
+        return true;
+    }
+
+    return log != ckpt;
+}
+
+static CK_RV db_setup_readonly(sqlite3 *db, const char *dbpath) {
+
+    /*
+     * An immutable open ignores the WAL, commits still in it would be
+     * missed and the pages read could be from different commits.
+     */
+    if (db_wal_pending(db, dbpath)) {
+        LOGE("Read only store \"%s\" has commits in its WAL, it is being "
+                "written or wasn't closed cleanly, close its writers or "
+                "open it once without "PKCS11_STORE_READONLY_ENV_VAR, dbpath);
+        return CKR_GENERAL_ERROR;
+    }
+
+    /*
+     * Nothing may change the store, so there is no lock to take and no
+     * upgrade to run, it has to be at the library's version already.
+     */
+    unsigned version = DB_EMPTY;
+    CK_RV rv = db_get_version(db, &version);
+    if (rv != CKR_OK) {
+        LOGE("Could not get DB version");
+        return rv;
+    }
+
+    if (version == DB_EMPTY) {
+        LOGE("Read only store is empty, create it with tpm2_ptool first");
+        return CKR_GENERAL_ERROR;
+    }
+
+    if (version < DB_VERSION) {
+        LOGE("Read only store needs an upgrade from version %u to %u, "
+                "open it once without "PKCS11_STORE_READONLY_ENV_VAR,
+                version, DB_VERSION);
+        return CKR_GENERAL_ERROR;
+    }
+
+    if (version > DB_VERSION) {
+        LOGE("DB Version exceeds library version: %u > %u",
+                version, DB_VERSION);
+    }
+
+    return CKR_OK;
+}
+
+static void db_snapshot_open(sqlite3 *db, const char *dbpath) {
+
+    const char *env = getenv(SNAPSHOT_ENV_VAR);
+    if (env && !env[0]) {
+        return;
+    }
+
+    char path[PATH_MAX];
+    unsigned l;
+    if (env) {
+        l = snprintf(path, sizeof(path), "%s", env);
+    } else {
+        /* next to the store */
+        const char *slash = strrchr(dbpath, '/');
+        int dirlen = slash ? (int)(slash - dbpath + 1) : 0;
+        l = snprintf(path, sizeof(path), "%.*s%s", dirlen, dbpath,
+                SNAPSHOT_NAME);
+    }
+
+    if (l >= sizeof(path)) {
+        LOGW("Snapshot path is longer than PATH_MAX, not using it");
+        return;
+    }
+
+    if (db_wal_pending(db, dbpath)) {
+        LOGW("Not using snapshot \"%s\", the store changed since it was "
+                "compiled, compile it again with \"tpm2_ptool snapshot\"",
+                path);
+        return;
+    }
+
+    profile_span span = profile_begin(profile_phase_snapshot_open,
+            PROFILE_TOKEN_INHERIT);
+    CK_RV rv = snapshot_open(path, dbpath, DB_VERSION, &global.snapshot);
+    profile_end(&span);
     if (rv == CKR_TOKEN_NOT_PRESENT) {
+        LOGV("No snapshot at \"%s\"", path);
+    } else if (rv != CKR_OK) {
+        LOGW("Not using snapshot \"%s\", compile it again with "
+                "\"tpm2_ptool snapshot\"", path);
+    }
+}
+
+DEBUG_VISIBILITY WEAK
+CK_RV db_new(sqlite3 **db) {
+
+    global.readonly = db_readonly_requested();
+
+    char dbpath[PATH_MAX];
+    CK_RV rv = db_get_existing(dbpath, sizeof(dbpath));
+    if (rv == CKR_TOKEN_NOT_PRESENT && !global.readonly) {
         rv = db_create(dbpath, sizeof(dbpath));
     }
 
@@ -2632,15 +3529,39 @@ CK_RV db_new(sqlite3 **db) {
         return rv;
     }
 
-    LOGV("Using sqlite3 DB: \"%s\"", dbpath);
-
-    int rc = sqlite3_open(dbpath, db);
-    if (rc != SQLITE_OK) {
-        LOGE("Cannot open database: %s\n", sqlite3_errmsg(*db));
+    if (global.readonly && (!strncmp(dbpath, "file::memory", 12)
+            || !strcmp(dbpath, ":memory:"))) {
+        LOGE("An in memory store cannot be opened read only");
         return CKR_GENERAL_ERROR;
     }
 
-    return db_setup(db, dbpath);
+    LOGV("Using sqlite3 DB: \"%s\"%s", dbpath,
+            global.readonly ? " read only" : "");
+
+    rv = db_open(dbpath, db);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    profile_span span = profile_begin(profile_phase_db_setup,
+            PROFILE_TOKEN_INHERIT);
+    rv = global.readonly ? db_setup_readonly(*db, dbpath) : db_setup(db, dbpath);
+    profile_end(&span);
+
+    /* in memory stores were just created, there is nothing to snapshot */
+    const char *pname = sqlite3_db_filename(*db, NULL);
+    if (rv == CKR_OK && pname && pname[0]) {
+        if (!global.readonly) {
+            db_set_journal_mode(*db);
+        }
+        db_snapshot_open(*db, dbpath);
+    }
+
+    return rv;
+}
+
+bool db_is_readonly(void) {
+    return global.readonly;
 }
 
 static CK_RV db_free(sqlite3 **db) {
@@ -2656,11 +3577,306 @@ static CK_RV db_free(sqlite3 **db) {
     return CKR_OK;
 }
 
+/*
+ * Token ids share the top byte of session handles, rows with larger ids
+ * can't be slots and aren't tracked.
+ */
+#define DB_WATCH_IDS 256
+
+struct db_watch {
+    sqlite3 *db;
+    char *path;
+    int data_version;
+    /* a hash of each token row by id, 0 when there is no row */
+    uint64_t fingerprints[DB_WATCH_IDS];
+};
+
+static CK_RV db_watch_data_version(db_watch *watch, int *version) {
+
+    sqlite3_stmt *stmt = NULL;
+    int rc = sqlite3_prepare_v2(watch->db, "PRAGMA data_version", -1,
+            &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot prepare data version query: %s\n",
+                sqlite3_errmsg(watch->db));
+        return CKR_GENERAL_ERROR;
+    }
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_ROW) {
+        LOGE("Cannot step query: %s\n", sqlite3_errmsg(watch->db));
+        goto out;
+    }
+
+    *version = sqlite3_column_int(stmt, 0);
+
+    rv = CKR_OK;
+
+out:
+    _sqlite3_finalize_warn(watch->db, stmt);
+    return rv;
+}
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+
+    const unsigned char *p = data;
+    size_t i;
+    for (i=0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+static CK_RV db_watch_fingerprints(db_watch *watch,
+        uint64_t fingerprints[DB_WATCH_IDS]) {
+
+    memset(fingerprints, 0, DB_WATCH_IDS * sizeof(*fingerprints));
+
+    sqlite3_stmt *stmt = NULL;
+    int rc = sqlite3_prepare_v2(watch->db,
+            "SELECT id, pid, label, config FROM tokens", -1, &stmt, NULL);
+    if (rc != SQLITE_OK) {
+        LOGE("Cannot prepare tokens query: %s\n", sqlite3_errmsg(watch->db));
+        return CKR_GENERAL_ERROR;
+    }
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+
+        sqlite3_int64 id = sqlite3_column_int64(stmt, 0);
+        if (id <= 0 || id >= DB_WATCH_IDS) {
+            continue;
+        }
+
+        uint64_t h = 0xcbf29ce484222325ULL;
+
+        int i;
+        for (i=1; i < 4; i++) {
+            const unsigned char *text = sqlite3_column_text(stmt, i);
+            int len = sqlite3_column_bytes(stmt, i);
+            /* keep NULL and empty apart */
+            h = fnv1a(h, text ? "v" : "n", 1);
+            h = fnv1a(h, text, text ? len : 0);
+            h = fnv1a(h, "", 1);
+        }
+
+        fingerprints[id] = h ? h : 1;
+    }
+
+    if (rc != SQLITE_DONE) {
+        LOGE("Cannot step query: %s\n", sqlite3_errmsg(watch->db));
+        goto out;
+    }
+
+    rv = CKR_OK;
+
+out:
+    _sqlite3_finalize_warn(watch->db, stmt);
+    return rv;
+}
+
+CK_RV db_watch_new(db_watch **watch) {
+
+    /* an immutable store never changes, and has nothing to watch */
+    if (global.readonly) {
+        return CKR_TOKEN_NOT_PRESENT;
+    }
+
+    const char *path = global.db ? sqlite3_db_filename(global.db, "main") : NULL;
+    if (!path || !path[0]) {
+        return CKR_TOKEN_NOT_PRESENT;
+    }
+
+    db_watch *w = calloc(1, sizeof(*w));
+    if (!w) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    w->path = strdup(path);
+    if (!w->path) {
+        LOGE("oom");
+        rv = CKR_HOST_MEMORY;
+        goto error;
+    }
+
+    /*
+     * Not a pooled connection, PRAGMA data_version only compares between
+     * calls on the same one. A writer holding the store delays a look for
+     * up to the busy timeout.
+     */
+    rv = db_open_reader(w->path, &w->db);
+    if (rv != CKR_OK) {
+        goto error;
+    }
+
+    rv = db_watch_data_version(w, &w->data_version);
+    if (rv != CKR_OK) {
+        goto error;
+    }
+
+    rv = db_watch_fingerprints(w, w->fingerprints);
+    if (rv != CKR_OK) {
+        goto error;
+    }
+
+    *watch = w;
+
+    return CKR_OK;
+
+error:
+    db_watch_free(w);
+    return rv;
+}
+
+const char *db_watch_path(db_watch *watch) {
+    return watch->path;
+}
+
+CK_RV db_watch_changes(db_watch *watch, db_watch_cb cb, void *userdata) {
+
+    int version;
+    CK_RV rv = db_watch_data_version(watch, &version);
+    if (rv != CKR_OK || version == watch->data_version) {
+        return rv;
+    }
+
+    uint64_t fingerprints[DB_WATCH_IDS];
+    rv = db_watch_fingerprints(watch, fingerprints);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    watch->data_version = version;
+
+    unsigned id;
+    for (id=1; id < DB_WATCH_IDS; id++) {
+        if (fingerprints[id] != watch->fingerprints[id]) {
+            watch->fingerprints[id] = fingerprints[id];
+            cb(id, userdata);
+        }
+    }
+
+    return CKR_OK;
+}
+
+void db_watch_free(db_watch *watch) {
+
+    if (!watch) {
+        return;
+    }
+
+    if (watch->db) {
+        int rc = sqlite3_close(watch->db);
+        if (rc != SQLITE_OK) {
+            LOGW("Cannot close database: %s\n", sqlite3_errmsg(watch->db));
+        }
+    }
+
+    free(watch->path);
+    free(watch);
+}
+
+static CK_RV db_mutexes_new(void) {
+
+    CK_RV rv = mutex_create(&global.writer_mutex);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    rv = mutex_create(&global.readers_mutex);
+    if (rv != CKR_OK) {
+        mutex_destroy(global.writer_mutex);
+        global.writer_mutex = NULL;
+    }
+
+    return rv;
+}
+
 CK_RV db_init(void) {
 
-    return db_new(&global.db);
+    global.busy_timeout = db_env_uint(PKCS11_STORE_BUSY_TIMEOUT_ENV_VAR,
+            DB_BUSY_TIMEOUT_DEFAULT, INT_MAX);
+
+    CK_RV rv = db_mutexes_new();
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    profile_span span = profile_begin(profile_phase_db_new,
+            PROFILE_TOKEN_INHERIT);
+    rv = db_new(&global.db);
+    profile_end(&span);
+    if (rv != CKR_OK) {
+        /* the backend isn't destroyed when it fails, don't keep a half open store */
+        db_destroy();
+        return rv;
+    }
+
+    global.lazy_attrs = true;
+
+    /* every connection to an in memory store is a store of its own */
+    const char *pname = global.db ? sqlite3_db_filename(global.db, "main") : NULL;
+    if (pname && pname[0]) {
+        global.reader_cnt = db_env_uint(PKCS11_STORE_READERS_ENV_VAR,
+                DB_READERS_DEFAULT, DB_READERS_MAX);
+    }
+
+    return rv;
 }
 
 CK_RV db_destroy(void) {
-    return db_free(&global.db);
+    global.lazy_attrs = false;
+    db_readers_close();
+    global.reader_cnt = 0;
+    CK_RV rv = db_free(&global.db);
+    mutex_destroy(global.readers_mutex);
+    mutex_destroy(global.writer_mutex);
+    global.readers_mutex = global.writer_mutex = NULL;
+    global.readonly = false;
+    /* after the tokens, whose objects point into it */
+    snapshot_close(global.snapshot);
+    global.snapshot = NULL;
+    return rv;
+}
+
+CK_RV db_after_fork(void) {
+
+    const char *path = global.db ? sqlite3_db_filename(global.db, "main") : NULL;
+    if (!path || !path[0]) {
+        /* nothing to reopen, an in memory store is the child's own copy */
+        return db_mutexes_new();
+    }
+
+    /*
+     * sqlite connections must not be used across fork(), and closing one
+     * is a use, it may roll back or checkpoint for the parent. The
+     * inherited one leaks, and the store is already set up so the new one
+     * skips db_setup().
+     */
+    sqlite3 *db = NULL;
+    CK_RV rv = db_open(path, &db);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    LOGV("Reopened sqlite3 DB: \"%s\"", path);
+
+    global.db = db;
+
+    /*
+     * The pooled connections leak the same way, and are opened again on
+     * use. The inherited locks may have been held by threads the child
+     * doesn't have, so they are left behind too.
+     */
+    memset(global.readers, 0, sizeof(global.readers));
+
+    return db_mutexes_new();
 }
@@ -37,6 +37,23 @@ struct pobject_v4 {
 CK_RV db_init(void);
 CK_RV db_destroy(void);
 
+/**
+ * Opens a connection of the child's own after fork() in place of the
+ * inherited one, which is left open.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV db_after_fork(void);
+
+/**
+ * Tells if the store was opened read only, as asked for with
+ * TPM2_PKCS11_STORE_READONLY. A read only store is opened immutable,
+ * without taking the lock file or upgrading it, and can't be written.
+ * @return
+ *  true if the open store is read only.
+ */
+bool db_is_readonly(void);
+
 CK_RV db_get_tokens(token *t, size_t *len);
 
 CK_RV db_update_for_pinchange(
@@ -70,7 +87,75 @@ CK_RV db_add_token(token *tok);
 
 CK_RV db_update_token_config(token *tok);
 
-CK_RV db_update_tobject_attrs(unsigned id, attr_list *attrs);
+/**
+ * Persists the attributes of a tobject that changed, without rewriting the
+ * others. They are kept as a patch to the tobject row, which the patches
+ * are folded into once enough of them collect.
+ * @param id
+ *  The tobject id.
+ * @param changed
+ *  The changed attributes, see attr_list_diff(). Nothing is written for
+ *  an empty list.
+ * @return
+ *  CKR_OK on success, anything else is an error.
+ */
+CK_RV db_patch_tobject_attrs(unsigned id, attr_list *changed);
+
+/**
+ * Reads a single attribute value of a tobject from the DB.
+ * @param id
+ *  The tobject id.
+ * @param type
+ *  The attribute type to read.
+ * @param value
+ *  The value, free with twist_free().
+ * @return
+ *  CKR_OK on success, anything else is an error.
+ */
+CK_RV db_get_tobject_attr(unsigned id, CK_ATTRIBUTE_TYPE type, twist *value);
+
+/*
+ * A private, read only connection to the store used to notice token
+ * changes made by other connections, including other processes.
+ */
+typedef struct db_watch db_watch;
+
+/**
+ * Called for every token whose row was added, changed or removed.
+ */
+typedef void (*db_watch_cb)(unsigned tokid, void *userdata);
+
+/**
+ * Opens a watch on the store in use and records the current token rows.
+ * @param watch
+ *  The new watch, free with db_watch_free().
+ * @return
+ *  CKR_OK on success, CKR_TOKEN_NOT_PRESENT if no store is open.
+ */
+CK_RV db_watch_new(db_watch **watch);
+
+/**
+ * @return
+ *  The path of the watched store file.
+ */
+const char *db_watch_path(db_watch *watch);
+
+/**
+ * Compares the token rows with the last look, calling cb for each token
+ * that differs. The tokens are only read when the store's data version
+ * moved, so calling this on spurious file activity is cheap.
+ * @param watch
+ *  The watch.
+ * @param cb
+ *  The callback.
+ * @param userdata
+ *  Passed to cb.
+ * @return
+ *  CKR_OK on success, anything else is an error.
+ */
+CK_RV db_watch_changes(db_watch *watch, db_watch_cb cb, void *userdata);
+
+void db_watch_free(db_watch *watch);
 
 /* Debug testing */
 #ifdef TESTING
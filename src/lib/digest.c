@@ -1,5 +1,6 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 
+#include <assert.h>
 #include <stdint.h>
 
 #include <openssl/evp.h>
@@ -17,8 +18,8 @@ static inline const char *get_openssl_err(void) {
     return ERR_error_string(ERR_get_error(), NULL);
 }
 
-digest_op_data *digest_op_data_new(void) {
-    return calloc(1, sizeof(digest_op_data));
+digest_op_data *digest_op_data_new(arena *a) {
+    return arena_calloc(a, 1, sizeof(digest_op_data));
 }
 
 void digest_op_data_free(digest_op_data **opdata) {
@@ -31,14 +32,20 @@ void digest_op_data_free(digest_op_data **opdata) {
     if ((*opdata)->mdctx) {
         EVP_MD_CTX_destroy((*opdata)->mdctx);
     }
-    free(*opdata);
+    arena_release(*opdata);
     *opdata = NULL;
 }
 
 static CK_RV digest_sw_init(mdetail *mdtl, digest_op_data *opdata) {
 
+    mdetail_entry *d = NULL;
+    CK_RV rv = mech_resolve(mdtl, &opdata->mechanism, &d);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
     const EVP_MD *md = NULL;
-    CK_RV rv = mech_get_digester(mdtl, &opdata->mechanism, &md);
+    rv = mech_get_digester(mdtl, d, &opdata->mechanism, &md);
     if (rv != CKR_OK) {
         return rv;
     }
@@ -56,6 +63,7 @@ static CK_RV digest_sw_init(mdetail *mdtl, digest_op_data *opdata) {
         return CKR_GENERAL_ERROR;
     }
 
+    opdata->md = md;
     opdata->mdctx = mdctx;
 
     return CKR_OK;
@@ -74,8 +82,6 @@ static CK_RV digest_sw_update(digest_op_data *opdata, const void *d, size_t cnt)
 
 static CK_RV digest_sw_final(digest_op_data *opdata, CK_BYTE_PTR md, CK_ULONG_PTR s) {
 
-    CK_RV rv = CKR_GENERAL_ERROR;
-
     /*
      * Warn on truncation, this is likely not an issue unless digest message lengths overflow
      * int.
@@ -84,19 +90,14 @@ static CK_RV digest_sw_final(digest_op_data *opdata, CK_BYTE_PTR md, CK_ULONG_PT
         LOGW("OSSL takes an int pointer, anything past %u is lost, got %lu", UINT_MAX, *s);
     }
 
+    /* the context is kept for digest_restart_op() and freed with the opdata */
     int rc = EVP_DigestFinal_ex(opdata->mdctx, md, (unsigned int *)s);
     if (!rc) {
         LOGE("%s", get_openssl_err());
-        goto out;
+        return CKR_GENERAL_ERROR;
     }
 
-    rv = CKR_OK;
-
-out:
-    EVP_MD_CTX_destroy(opdata->mdctx);
-    opdata->mdctx = NULL;
-
-    return rv;
+    return CKR_OK;
 }
 
 static CK_RV digest_get_min_size(session_ctx *ctx,
@@ -127,7 +128,7 @@ CK_RV digest_init_op(session_ctx *ctx, digest_op_data *supplied_opdata, CK_MECHA
 
     digest_op_data *opdata = NULL;
     if (!supplied_opdata) {
-        opdata = digest_op_data_new();
+        opdata = digest_op_data_new(session_ctx_get_arena(ctx));
         if (!opdata) {
             return CKR_HOST_MEMORY;
         }
@@ -214,6 +215,20 @@ error:
     return rv;
 }
 
+CK_RV digest_restart_op(digest_op_data *opdata) {
+
+    assert(opdata);
+    assert(opdata->mdctx);
+
+    int rc = EVP_DigestInit_ex(opdata->mdctx, opdata->md, NULL);
+    if (!rc) {
+        LOGE("%s", get_openssl_err());
+        return CKR_GENERAL_ERROR;
+    }
+
+    return CKR_OK;
+}
+
 CK_RV digest_oneshot(session_ctx *ctx, CK_BYTE_PTR data, CK_ULONG data_len, CK_BYTE_PTR digest, CK_ULONG_PTR digest_len) {
 
     CK_ULONG min_len = 0;
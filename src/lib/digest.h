@@ -8,6 +8,7 @@
 
 #include <openssl/evp.h>
 
+#include "arena.h"
 #include "object.h"
 #include "pkcs11.h"
 #include "session_ctx.h"
@@ -16,10 +17,11 @@ typedef struct digest_op_data digest_op_data;
 struct digest_op_data {
     tobject *tobj;
     CK_MECHANISM mechanism;
+    const EVP_MD *md;
     EVP_MD_CTX *mdctx;
 };
 
-digest_op_data *digest_op_data_new(void);
+digest_op_data *digest_op_data_new(arena *a);
 void digest_op_data_free(digest_op_data **opdata);
 
 CK_RV digest_init_op(session_ctx *ctx, digest_op_data *supplied_opdata, CK_MECHANISM_PTR mechanism);
@@ -37,6 +39,16 @@ static inline CK_RV digest_final(session_ctx *ctx, unsigned char *digest, unsign
     return digest_final_op(ctx, NULL, digest, digest_len);
 }
 
+/**
+ * Starts a digest set up with digest_init_op() over, in place, so the
+ * next message doesn't pay for setting up the hash again.
+ * @param opdata
+ *  The digest state.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV digest_restart_op(digest_op_data *opdata);
+
 CK_RV digest_oneshot(session_ctx *ctx, unsigned char *data, unsigned long data_len, unsigned char *digest, unsigned long *digest_len);
 
 #endif /* SRC_LIB_DIGEST_H_ */
@@ -91,6 +91,12 @@ WEAK char *emit_attributes_to_string(attr_list *attrs) {
             goto doc_delete;
         }
 
+        /* values left in the store must be fetched before the object is rewritten */
+        if (attr_is_lazy(a)) {
+            LOGE("Attribute 0x%lx is not resident", a->type);
+            goto doc_delete;
+        }
+
         /* what type of value is it */
         CK_BYTE type = type_from_ptr(a->pValue, a->ulValueLen);
         assert(type);
@@ -40,9 +40,9 @@ static void sw_encrypt_data_free(sw_encrypt_data **enc_data) {
     *enc_data = NULL;
 }
 
-encrypt_op_data *encrypt_op_data_new(void) {
+encrypt_op_data *encrypt_op_data_new(arena *a) {
 
-    return (encrypt_op_data *)calloc(1, sizeof(encrypt_op_data));
+    return (encrypt_op_data *)arena_calloc(a, 1, sizeof(encrypt_op_data));
 }
 
 void encrypt_op_data_free(encrypt_op_data **opdata) {
@@ -51,12 +51,12 @@ void encrypt_op_data_free(encrypt_op_data **opdata) {
         (*opdata)->use_sw ?
                 sw_encrypt_data_free(&(*opdata)->cryptopdata.sw_enc_data) :
                 tpm_opdata_free(&(*opdata)->cryptopdata.tpm_opdata);
-        free(*opdata);
+        arena_release(*opdata);
         *opdata = NULL;
     }
 }
 
-CK_RV sw_encrypt_data_init(mdetail *mdtl, CK_MECHANISM *mechanism, tobject *tobj, sw_encrypt_data **enc_data) {
+CK_RV sw_encrypt_data_init(mdetail *mdtl, mdetail_entry *d, CK_MECHANISM *mechanism, tobject *tobj, sw_encrypt_data **enc_data) {
 
     EVP_PKEY *pkey = NULL;
     CK_RV rv = ssl_util_attrs_to_evp(tobj->attrs, &pkey);
@@ -65,7 +65,7 @@ CK_RV sw_encrypt_data_init(mdetail *mdtl, CK_MECHANISM *mechanism, tobject *tobj
     }
 
     int padding = 0;
-    rv = mech_get_padding(mdtl, mechanism, &padding);
+    rv = mech_get_padding(d, &padding);
     if (rv != CKR_OK) {
         return rv;
     }
@@ -73,7 +73,7 @@ CK_RV sw_encrypt_data_init(mdetail *mdtl, CK_MECHANISM *mechanism, tobject *tobj
     const EVP_MD *md = NULL;
     bool is_hashing_needed = false;
     rv = mech_is_hashing_needed(
-            mdtl,
+            d,
             mechanism,
             &is_hashing_needed);
     if (rv != CKR_OK) {
@@ -81,7 +81,7 @@ CK_RV sw_encrypt_data_init(mdetail *mdtl, CK_MECHANISM *mechanism, tobject *tobj
     }
 
     if (is_hashing_needed) {
-        rv = mech_get_digester(mdtl, mechanism, &md);
+        rv = mech_get_digester(mdtl, d, mechanism, &md);
         if (rv != CKR_OK) {
             return rv;
         }
@@ -93,20 +93,20 @@ CK_RV sw_encrypt_data_init(mdetail *mdtl, CK_MECHANISM *mechanism, tobject *tobj
         return rv;
     }
 
-    sw_encrypt_data *d = sw_encrypt_data_new();
-    if (!d) {
+    sw_encrypt_data *sw = sw_encrypt_data_new();
+    if (!sw) {
         LOGE("oom");
         twist_free(label);
         EVP_PKEY_free(pkey);
         return CKR_HOST_MEMORY;
     }
 
-    d->key = pkey;
-    d->padding = padding;
-    d->label = label;
-    d->md = md;
+    sw->key = pkey;
+    sw->padding = padding;
+    sw->label = label;
+    sw->md = md;
 
-    *enc_data = d;
+    *enc_data = sw;
 
     return CKR_OK;
 }
@@ -162,6 +162,13 @@ static CK_RV common_init_op (session_ctx *ctx, encrypt_op_data *supplied_opdata,
         return rv;
     }
 
+    mdetail_entry *d = NULL;
+    rv = mech_resolve(tok->mdtl, mechanism, &d);
+    if (rv != CKR_OK) {
+        tobject_user_decrement(tobj);
+        return rv;
+    }
+
     CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(tobj->attrs, CKA_CLASS);
     if (!a) {
         LOGE("Expected tobject to have attribute CKA_CLASS");
@@ -177,7 +184,7 @@ static CK_RV common_init_op (session_ctx *ctx, encrypt_op_data *supplied_opdata,
 
     encrypt_op_data *opdata;
     if (!supplied_opdata) {
-        opdata = encrypt_op_data_new();
+        opdata = encrypt_op_data_new(session_ctx_get_arena(ctx));
         if (!opdata) {
             tobject_user_decrement(tobj);
             return CKR_HOST_MEMORY;
@@ -191,9 +198,9 @@ static CK_RV common_init_op (session_ctx *ctx, encrypt_op_data *supplied_opdata,
      */
     if (obj_class == CKO_PUBLIC_KEY) {
         opdata->use_sw = true;
-        rv = sw_encrypt_data_init(tok->mdtl, mechanism, tobj, &opdata->cryptopdata.sw_enc_data);
+        rv = sw_encrypt_data_init(tok->mdtl, d, mechanism, tobj, &opdata->cryptopdata.sw_enc_data);
     } else {
-        rv = mech_get_tpm_opdata(tok->mdtl,
+        rv = mech_get_tpm_opdata(tok->mdtl, d, session_ctx_get_arena(ctx),
                 tok->tctx, mechanism, tobj,
                 &opdata->cryptopdata.tpm_opdata);
     }
@@ -426,3 +433,251 @@ CK_RV encrypt_oneshot_op (session_ctx *ctx, encrypt_op_data *supplied_opdata, CK
     *encrypted_data_len = update_len + tmp_len;
     return !is_buffer_too_small ? rv : CKR_BUFFER_TOO_SMALL;
 }
+
+CK_RV message_encrypt_init(session_ctx *ctx, CK_MECHANISM *mechanism, CK_OBJECT_HANDLE key) {
+
+    return common_init_op(ctx, NULL, operation_message_encrypt, mechanism, key);
+}
+
+CK_RV message_decrypt_init(session_ctx *ctx, CK_MECHANISM *mechanism, CK_OBJECT_HANDLE key) {
+
+    return common_init_op(ctx, NULL, operation_message_decrypt, mechanism, key);
+}
+
+static CK_RV message_get(session_ctx *ctx, operation op, encrypt_op_data **opdata) {
+
+    CK_RV rv = session_ctx_opdata_get(ctx, op, opdata);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    return session_ctx_tobject_authenticated(ctx);
+}
+
+/* sets up the operation's state for a new message */
+static CK_RV message_start(session_ctx *ctx, operation op,
+        CK_VOID_PTR param, CK_ULONG param_len,
+        CK_BYTE_PTR aad, CK_ULONG aad_len,
+        encrypt_op_data **out) {
+
+    encrypt_op_data *opdata = NULL;
+    CK_RV rv = message_get(ctx, op, &opdata);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    if (opdata->in_message) {
+        return CKR_OPERATION_ACTIVE;
+    }
+
+    if (aad || aad_len) {
+        LOGE("Associated data needs an AEAD mechanism");
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    if (opdata->use_sw) {
+        if (param || param_len) {
+            return CKR_MECHANISM_PARAM_INVALID;
+        }
+    } else {
+        rv = tpm_opdata_message_begin(opdata->cryptopdata.tpm_opdata,
+                param, param_len);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+    }
+
+    *out = opdata;
+
+    return CKR_OK;
+}
+
+static CK_RV message_oneshot_op(session_ctx *ctx, encrypt_op_data *opdata, operation op,
+        CK_BYTE_PTR in, CK_ULONG in_len, CK_BYTE_PTR out, CK_ULONG_PTR out_len) {
+
+    CK_RV rv = (op == operation_message_encrypt) ?
+            encrypt_oneshot_op(ctx, opdata, in, in_len, out, out_len) :
+            decrypt_oneshot_op(ctx, opdata, in, in_len, out, out_len);
+    if (rv == CKR_OK && out) {
+        /* the message is done, a context specific login covers only one */
+        tobject *tobj = session_ctx_opdata_get_tobject(ctx);
+        assert(tobj);
+        tobj->is_authenticated = false;
+    }
+
+    return rv;
+}
+
+static CK_RV message_op(session_ctx *ctx, operation op,
+        CK_VOID_PTR param, CK_ULONG param_len,
+        CK_BYTE_PTR aad, CK_ULONG aad_len,
+        CK_BYTE_PTR in, CK_ULONG in_len,
+        CK_BYTE_PTR out, CK_ULONG_PTR out_len) {
+
+    check_pointer(out_len);
+
+    /*
+     * Every call starts the message over from the parameter, so a size
+     * query leaves nothing behind for the call that follows it.
+     */
+    encrypt_op_data *opdata = NULL;
+    CK_RV rv = message_start(ctx, op, param, param_len, aad, aad_len, &opdata);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    return message_oneshot_op(ctx, opdata, op, in, in_len, out, out_len);
+}
+
+static CK_RV message_begin(session_ctx *ctx, operation op,
+        CK_VOID_PTR param, CK_ULONG param_len,
+        CK_BYTE_PTR aad, CK_ULONG aad_len) {
+
+    encrypt_op_data *opdata = NULL;
+    CK_RV rv = message_start(ctx, op, param, param_len, aad, aad_len, &opdata);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    opdata->in_message = true;
+
+    return CKR_OK;
+}
+
+static CK_RV message_next(session_ctx *ctx, operation op,
+        CK_BYTE_PTR in, CK_ULONG in_len,
+        CK_BYTE_PTR out, CK_ULONG_PTR out_len,
+        CK_FLAGS flags) {
+
+    check_pointer(out_len);
+
+    encrypt_op_data *opdata = NULL;
+    CK_RV rv = message_get(ctx, op, &opdata);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    if (!opdata->in_message) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+
+    if (!(flags & CKF_END_OF_MESSAGE)) {
+        return (op == operation_message_encrypt) ?
+                encrypt_update_op(ctx, opdata, in, in_len, out, out_len) :
+                decrypt_update_op(ctx, opdata, in, in_len, out, out_len);
+    }
+
+    if (opdata->use_sw) {
+        rv = message_oneshot_op(ctx, opdata, op, in, in_len, out, out_len);
+        if (rv == CKR_OK && out) {
+            opdata->in_message = false;
+        }
+        return rv;
+    }
+
+    /*
+     * The last part runs on a copy of the message state, so a size query
+     * or a short buffer leaves the message as it was for the retry.
+     */
+    encrypt_op_data scratch = *opdata;
+    rv = tpm_opdata_dup(opdata->cryptopdata.tpm_opdata,
+            &scratch.cryptopdata.tpm_opdata);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    rv = message_oneshot_op(ctx, &scratch, op, in, in_len, out, out_len);
+    if (rv == CKR_OK && out) {
+        tpm_op_data *done = opdata->cryptopdata.tpm_opdata;
+        opdata->cryptopdata.tpm_opdata = scratch.cryptopdata.tpm_opdata;
+        scratch.cryptopdata.tpm_opdata = done;
+        opdata->in_message = false;
+    }
+
+    tpm_opdata_free(&scratch.cryptopdata.tpm_opdata);
+
+    return rv;
+}
+
+static CK_RV message_final(session_ctx *ctx, operation op) {
+
+    encrypt_op_data *opdata = NULL;
+    CK_RV rv = session_ctx_opdata_get(ctx, op, &opdata);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    tobject *tobj = session_ctx_opdata_get_tobject(ctx);
+    assert(tobj);
+
+    tobj->is_authenticated = false;
+    session_ctx_opdata_clear(ctx);
+
+    return tobject_user_decrement(tobj);
+}
+
+CK_RV encrypt_message(session_ctx *ctx, CK_VOID_PTR param, CK_ULONG param_len,
+        CK_BYTE_PTR aad, CK_ULONG aad_len,
+        CK_BYTE_PTR data, CK_ULONG data_len,
+        CK_BYTE_PTR encrypted_data, CK_ULONG_PTR encrypted_data_len) {
+
+    return message_op(ctx, operation_message_encrypt, param, param_len, aad, aad_len,
+            data, data_len, encrypted_data, encrypted_data_len);
+}
+
+CK_RV encrypt_message_begin(session_ctx *ctx, CK_VOID_PTR param, CK_ULONG param_len,
+        CK_BYTE_PTR aad, CK_ULONG aad_len) {
+
+    return message_begin(ctx, operation_message_encrypt, param, param_len, aad, aad_len);
+}
+
+CK_RV encrypt_message_next(session_ctx *ctx, CK_VOID_PTR param, CK_ULONG param_len,
+        CK_BYTE_PTR part, CK_ULONG part_len,
+        CK_BYTE_PTR encrypted_part, CK_ULONG_PTR encrypted_part_len,
+        CK_FLAGS flags) {
+
+    /* the parameter was taken by C_EncryptMessageBegin */
+    UNUSED(param);
+    UNUSED(param_len);
+
+    return message_next(ctx, operation_message_encrypt, part, part_len,
+            encrypted_part, encrypted_part_len, flags);
+}
+
+CK_RV message_encrypt_final(session_ctx *ctx) {
+
+    return message_final(ctx, operation_message_encrypt);
+}
+
+CK_RV decrypt_message(session_ctx *ctx, CK_VOID_PTR param, CK_ULONG param_len,
+        CK_BYTE_PTR aad, CK_ULONG aad_len,
+        CK_BYTE_PTR encrypted_data, CK_ULONG encrypted_data_len,
+        CK_BYTE_PTR data, CK_ULONG_PTR data_len) {
+
+    return message_op(ctx, operation_message_decrypt, param, param_len, aad, aad_len,
+            encrypted_data, encrypted_data_len, data, data_len);
+}
+
+CK_RV decrypt_message_begin(session_ctx *ctx, CK_VOID_PTR param, CK_ULONG param_len,
+        CK_BYTE_PTR aad, CK_ULONG aad_len) {
+
+    return message_begin(ctx, operation_message_decrypt, param, param_len, aad, aad_len);
+}
+
+CK_RV decrypt_message_next(session_ctx *ctx, CK_VOID_PTR param, CK_ULONG param_len,
+        CK_BYTE_PTR encrypted_part, CK_ULONG encrypted_part_len,
+        CK_BYTE_PTR part, CK_ULONG_PTR part_len,
+        CK_FLAGS flags) {
+
+    /* the parameter was taken by C_DecryptMessageBegin */
+    UNUSED(param);
+    UNUSED(param_len);
+
+    return message_next(ctx, operation_message_decrypt, encrypted_part, encrypted_part_len,
+            part, part_len, flags);
+}
+
+CK_RV message_decrypt_final(session_ctx *ctx) {
+
+    return message_final(ctx, operation_message_decrypt);
+}
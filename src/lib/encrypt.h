@@ -5,6 +5,7 @@
 
 #include <stdlib.h>
 
+#include "arena.h"
 #include "mech.h"
 #include "pkcs11.h"
 #include "tpm.h"
@@ -23,6 +24,8 @@ union crypto_op_data{
 
 struct encrypt_op_data {
     bool use_sw;
+    /* a C_EncryptMessageBegin or C_DecryptMessageBegin message is open */
+    bool in_message;
     crypto_op_data cryptopdata;
 };
 
@@ -33,10 +36,10 @@ struct sw_encrypt_data {
     EVP_PKEY *key;
 };
 
-encrypt_op_data *encrypt_op_data_new(void);
+encrypt_op_data *encrypt_op_data_new(arena *a);
 void encrypt_op_data_free(encrypt_op_data **opdata);
 
-CK_RV sw_encrypt_data_init(mdetail *mdtl,
+CK_RV sw_encrypt_data_init(mdetail *mdtl, mdetail_entry *d,
         CK_MECHANISM *mechanism, tobject *tobj, sw_encrypt_data **enc_data);
 
 CK_RV encrypt_init_op (session_ctx *ctx, encrypt_op_data *supplied_opdata, CK_MECHANISM *mechanism, CK_OBJECT_HANDLE key);
@@ -81,4 +84,44 @@ static inline CK_RV encrypt_oneshot (session_ctx *ctx, unsigned char *data, unsi
     return encrypt_oneshot_op (ctx, NULL, data, data_len, encrypted_data, encrypted_data_len);
 }
 
+/*
+ * The PKCS#11 3.0 message based operations. The key and its TPM state are
+ * bound once by the init call, each message then brings its own IV or
+ * counter block as the per message parameter. None of the mechanisms are
+ * AEAD, so associated data is refused.
+ */
+CK_RV message_encrypt_init(session_ctx *ctx, CK_MECHANISM *mechanism, CK_OBJECT_HANDLE key);
+
+CK_RV encrypt_message(session_ctx *ctx, void *param, unsigned long param_len,
+        unsigned char *aad, unsigned long aad_len,
+        unsigned char *data, unsigned long data_len,
+        unsigned char *encrypted_data, unsigned long *encrypted_data_len);
+
+CK_RV encrypt_message_begin(session_ctx *ctx, void *param, unsigned long param_len,
+        unsigned char *aad, unsigned long aad_len);
+
+CK_RV encrypt_message_next(session_ctx *ctx, void *param, unsigned long param_len,
+        unsigned char *part, unsigned long part_len,
+        unsigned char *encrypted_part, unsigned long *encrypted_part_len,
+        CK_FLAGS flags);
+
+CK_RV message_encrypt_final(session_ctx *ctx);
+
+CK_RV message_decrypt_init(session_ctx *ctx, CK_MECHANISM *mechanism, CK_OBJECT_HANDLE key);
+
+CK_RV decrypt_message(session_ctx *ctx, void *param, unsigned long param_len,
+        unsigned char *aad, unsigned long aad_len,
+        unsigned char *encrypted_data, unsigned long encrypted_data_len,
+        unsigned char *data, unsigned long *data_len);
+
+CK_RV decrypt_message_begin(session_ctx *ctx, void *param, unsigned long param_len,
+        unsigned char *aad, unsigned long aad_len);
+
+CK_RV decrypt_message_next(session_ctx *ctx, void *param, unsigned long param_len,
+        unsigned char *encrypted_part, unsigned long encrypted_part_len,
+        unsigned char *part, unsigned long *part_len,
+        CK_FLAGS flags);
+
+CK_RV message_decrypt_final(session_ctx *ctx);
+
 #endif /* SRC_LIB_ENCRYPT_H_ */
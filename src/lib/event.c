@@ -0,0 +1,473 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include "db.h"
+#include "event.h"
+#include "log.h"
+#include "slot.h"
+
+/*
+ * Slot ids live in the top byte of session handles, so this covers them
+ * all and the queue can never overflow.
+ */
+#define EVENT_SLOTS 256
+
+/*
+ * Without inotify the store's data version is checked on this period
+ * instead.
+ */
+#define EVENT_POLL_MS 1000
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool is_init;
+    bool can_create_threads;
+    unsigned waiters;
+    /* slots with a pending event, oldest first */
+    CK_SLOT_ID queue[EVENT_SLOTS];
+    size_t head;
+    size_t len;
+    bool pending[EVENT_SLOTS];
+    /* the store watcher */
+    bool watch_tried;
+    bool watch_running;
+    pthread_t watcher;
+    db_watch *watch;
+    int notify_fd;
+    const char *notify_name;
+    int wake[2];
+} global = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .notify_fd = -1,
+    .wake = { -1, -1 },
+};
+
+static void event_lock(void) {
+    int rc = pthread_mutex_lock(&global.lock);
+    if (rc) {
+        LOGE("Failed to lock event mutex: %s", strerror(rc));
+        abort();
+    }
+}
+
+static void event_unlock(void) {
+    int rc = pthread_mutex_unlock(&global.lock);
+    if (rc) {
+        LOGE("Failed to unlock event mutex: %s", strerror(rc));
+        abort();
+    }
+}
+
+/* with the lock held */
+static void queue_push(CK_SLOT_ID slot_id) {
+
+    if (global.pending[slot_id]) {
+        return;
+    }
+
+    global.pending[slot_id] = true;
+    global.queue[(global.head + global.len) % EVENT_SLOTS] = slot_id;
+    global.len++;
+
+    pthread_cond_signal(&global.cond);
+}
+
+/* with the lock held */
+static CK_SLOT_ID queue_pop(void) {
+
+    CK_SLOT_ID slot_id = global.queue[global.head];
+    global.head = (global.head + 1) % EVENT_SLOTS;
+    global.len--;
+    global.pending[slot_id] = false;
+
+    return slot_id;
+}
+
+void event_post(CK_SLOT_ID slot_id) {
+
+    if (slot_id >= EVENT_SLOTS) {
+        return;
+    }
+
+    event_lock();
+    if (global.is_init) {
+        LOGV("Slot event on slot %lu", slot_id);
+        queue_push(slot_id);
+    }
+    event_unlock();
+}
+
+static void on_store_change(unsigned tokid, void *userdata) {
+    (void) userdata;
+
+    /* rows for tokens this process doesn't have as a slot are no event */
+    if (slot_get_token(tokid)) {
+        event_post(tokid);
+    }
+}
+
+/* with the lock held, for checks made on the waiting thread */
+static void on_store_change_locked(unsigned tokid, void *userdata) {
+    (void) userdata;
+
+    if (slot_get_token(tokid) && tokid < EVENT_SLOTS) {
+        LOGV("Slot event on slot %u", tokid);
+        queue_push(tokid);
+    }
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/*
+ * Watches the store's directory rather than the file, as the WAL and
+ * rollback journal come and go and an upgrade replaces the store.
+ */
+static int watch_open(const char *path, const char **name) {
+
+    const char *slash = strrchr(path, '/');
+    *name = slash ? slash + 1 : path;
+
+    char dir[PATH_MAX];
+    if (!slash) {
+        snprintf(dir, sizeof(dir), ".");
+    } else if (slash == path) {
+        snprintf(dir, sizeof(dir), "/");
+    } else {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+    }
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        LOGW("inotify_init1: %s", strerror(errno));
+        return -1;
+    }
+
+    int wd = inotify_add_watch(fd, dir,
+            IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO | IN_DELETE);
+    if (wd < 0) {
+        LOGW("Cannot watch \"%s\": %s", dir, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* true if any queued notification is about the store, the journal or WAL */
+static bool watch_drain(int fd, const char *name) {
+
+    size_t name_len = strlen(name);
+    bool matched = false;
+
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        char *p = buf;
+        while (p < buf + n) {
+            const struct inotify_event *e = (const struct inotify_event *)p;
+            if (e->len && !strncmp(e->name, name, name_len)) {
+                const char *suffix = e->name + name_len;
+                if (!suffix[0] || !strcmp(suffix, "-wal")
+                        || !strcmp(suffix, "-journal")) {
+                    matched = true;
+                }
+            }
+            p += sizeof(*e) + e->len;
+        }
+    }
+
+    return matched;
+}
+#else
+static int watch_open(const char *path, const char **name) {
+    (void) path;
+    *name = NULL;
+    return -1;
+}
+
+static bool watch_drain(int fd, const char *name) {
+    (void) fd;
+    (void) name;
+    return false;
+}
+#endif
+
+static void *watch_main(void *arg) {
+    (void) arg;
+
+    int fd = global.notify_fd;
+
+    struct pollfd fds[2] = {
+        { .fd = global.wake[0], .events = POLLIN },
+        { .fd = fd, .events = POLLIN },
+    };
+
+    /* catches changes made before the inotify watch was in place */
+    CK_RV rv = db_watch_changes(global.watch, on_store_change, NULL);
+    if (rv != CKR_OK) {
+        LOGW("Could not check the store for changes: 0x%lx", rv);
+    }
+
+    while (true) {
+        int rc = poll(fds, fd >= 0 ? 2 : 1, fd >= 0 ? -1 : EVENT_POLL_MS);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("poll: %s", strerror(errno));
+            break;
+        }
+
+        if (fds[0].revents) {
+            break;
+        }
+
+        if (fd >= 0 && !watch_drain(fd, global.notify_name)) {
+            continue;
+        }
+
+        rv = db_watch_changes(global.watch, on_store_change, NULL);
+        if (rv != CKR_OK) {
+            LOGW("Could not check the store for changes: 0x%lx", rv);
+        }
+    }
+
+    return NULL;
+}
+
+static void watch_free(void) {
+
+    if (global.wake[0] >= 0) {
+        close(global.wake[0]);
+        close(global.wake[1]);
+        global.wake[0] = global.wake[1] = -1;
+    }
+
+    if (global.notify_fd >= 0) {
+        close(global.notify_fd);
+        global.notify_fd = -1;
+    }
+
+    global.notify_name = NULL;
+
+    db_watch_free(global.watch);
+    global.watch = NULL;
+}
+
+/* with the lock held, failures leave only the directly posted events */
+static void watch_start(void) {
+
+    if (global.watch_tried) {
+        return;
+    }
+
+    global.watch_tried = true;
+
+    CK_RV rv = db_watch_new(&global.watch);
+    if (rv != CKR_OK) {
+        LOGV("No store to watch for slot events");
+        return;
+    }
+
+    global.notify_fd = watch_open(db_watch_path(global.watch),
+            &global.notify_name);
+    if (global.notify_fd < 0) {
+        LOGV("Polling the store for slot events every %d ms", EVENT_POLL_MS);
+    }
+
+    if (pipe(global.wake)) {
+        LOGW("pipe: %s", strerror(errno));
+        goto error;
+    }
+
+    /* keep the application's signals off the watcher */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int rc = pthread_create(&global.watcher, NULL, watch_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc) {
+        LOGW("Cannot start store watcher: %s", strerror(rc));
+        goto error;
+    }
+
+    global.watch_running = true;
+
+    return;
+
+error:
+    watch_free();
+}
+
+/*
+ * With the lock held. Without a watcher thread the store is checked on the
+ * calling thread, done when the application doesn't let us create threads.
+ */
+static void watch_check(void) {
+
+    if (!global.watch_tried) {
+        global.watch_tried = true;
+
+        CK_RV rv = db_watch_new(&global.watch);
+        if (rv != CKR_OK) {
+            LOGV("No store to watch for slot events");
+            return;
+        }
+    }
+
+    if (!global.watch) {
+        return;
+    }
+
+    CK_RV rv = db_watch_changes(global.watch, on_store_change_locked, NULL);
+    if (rv != CKR_OK) {
+        LOGW("Could not check the store for changes: 0x%lx", rv);
+    }
+}
+
+static void watch_stop(void) {
+
+    if (global.watch_running) {
+        ssize_t n;
+        do {
+            n = write(global.wake[1], "", 1);
+        } while (n < 0 && errno == EINTR);
+
+        pthread_join(global.watcher, NULL);
+        global.watch_running = false;
+    }
+
+    watch_free();
+}
+
+void event_init(bool can_create_threads) {
+
+    event_lock();
+
+    global.can_create_threads = can_create_threads;
+    global.head = global.len = 0;
+    memset(global.pending, 0, sizeof(global.pending));
+    global.watch_tried = false;
+    global.is_init = true;
+
+    event_unlock();
+}
+
+void event_destroy(void) {
+
+    event_lock();
+
+    global.is_init = false;
+    pthread_cond_broadcast(&global.cond);
+
+    /* waiters must be gone before the slots they could return go away */
+    while (global.waiters) {
+        pthread_cond_wait(&global.cond, &global.lock);
+    }
+
+    event_unlock();
+
+    /*
+     * The watcher posts events, so it's joined without the lock held.
+     * No waiter is left to start another one.
+     */
+    watch_stop();
+}
+
+void event_after_fork(void) {
+
+    /* the lock may be held, and the waiters and watcher are threads of the parent */
+    pthread_mutex_init(&global.lock, NULL);
+    pthread_cond_init(&global.cond, NULL);
+    global.waiters = 0;
+
+    if (global.watch_running) {
+        /* the descriptors are the child's copies, the watch's connection is the parent's */
+        close(global.wake[0]);
+        close(global.wake[1]);
+        global.wake[0] = global.wake[1] = -1;
+
+        if (global.notify_fd >= 0) {
+            close(global.notify_fd);
+            global.notify_fd = -1;
+        }
+
+        global.notify_name = NULL;
+        global.watch_running = false;
+    }
+
+    /* a watch, with or without a watcher, uses the parent's connection */
+    global.watch = NULL;
+
+    /* the next waiter starts a watcher of the child's own */
+    global.watch_tried = false;
+}
+
+CK_RV event_wait(CK_FLAGS flags, CK_SLOT_ID *slot, void *reserved) {
+
+    if (reserved || !slot) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    CK_RV rv = CKR_OK;
+
+    event_lock();
+
+    if (!global.is_init) {
+        rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+        goto out;
+    }
+
+    if (global.can_create_threads) {
+        watch_start();
+    } else {
+        watch_check();
+
+        /* nothing could post the event a blocking wait is for */
+        if (!global.len && !(flags & CKF_DONT_BLOCK)) {
+            LOGV("Blocking slot event waits need a thread the application doesn't allow");
+            rv = CKR_FUNCTION_NOT_SUPPORTED;
+            goto out;
+        }
+    }
+
+    while (!global.len) {
+
+        if (flags & CKF_DONT_BLOCK) {
+            rv = CKR_NO_EVENT;
+            goto out;
+        }
+
+        global.waiters++;
+        pthread_cond_wait(&global.cond, &global.lock);
+        global.waiters--;
+
+        if (!global.is_init) {
+            /* let C_Finalize know the last waiter left */
+            pthread_cond_broadcast(&global.cond);
+            rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+            goto out;
+        }
+    }
+
+    *slot = queue_pop();
+
+out:
+    event_unlock();
+    return rv;
+}
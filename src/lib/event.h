@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef SRC_LIB_EVENT_H_
+#define SRC_LIB_EVENT_H_
+
+#include <stdbool.h>
+
+#include "pkcs11.h"
+
+/*
+ * Slot events for C_WaitForSlotEvent.
+ *
+ * Changes made through this library, a token being initialized or a new
+ * uninitialized token being added, are posted directly. Changes made to
+ * the store by other processes are found by a watcher thread, started by
+ * the first C_WaitForSlotEvent call so applications that never wait pay
+ * nothing for it. Applications that initialize with
+ * CKF_LIBRARY_CANT_CREATE_OS_THREADS get no watcher, the store is checked
+ * on each CKF_DONT_BLOCK call instead and blocking waits are refused.
+ *
+ * Each slot has at most one pending event, posting to a slot that already
+ * has one is a no-op. Waiting returns and clears the oldest.
+ */
+
+/**
+ * Sets up the event state, called from C_Initialize.
+ * @param can_create_threads
+ *  False if the application passed CKF_LIBRARY_CANT_CREATE_OS_THREADS.
+ */
+void event_init(bool can_create_threads);
+
+/**
+ * Wakes every blocked waiter with CKR_CRYPTOKI_NOT_INITIALIZED, stops the
+ * watcher and drops pending events. Called from C_Finalize before the
+ * slots are torn down.
+ */
+void event_destroy(void);
+
+/**
+ * Resets the event state inherited over fork(), which has no watcher
+ * thread and no waiters. Pending events are kept.
+ */
+void event_after_fork(void);
+
+/**
+ * Records an event on a slot.
+ * @param slot_id
+ *  The slot that changed.
+ */
+void event_post(CK_SLOT_ID slot_id);
+
+/**
+ * Implements C_WaitForSlotEvent.
+ * @param flags
+ *  CKF_DONT_BLOCK to return CKR_NO_EVENT instead of waiting.
+ * @param slot
+ *  The slot with the event.
+ * @param reserved
+ *  Must be NULL.
+ * @return
+ *  CKR_OK on an event, CKR_NO_EVENT when none is pending and
+ *  CKF_DONT_BLOCK is set, CKR_CRYPTOKI_NOT_INITIALIZED when C_Finalize
+ *  ran while waiting and CKR_FUNCTION_NOT_SUPPORTED for a blocking wait
+ *  when the library may not create threads.
+ */
+CK_RV event_wait(CK_FLAGS flags, CK_SLOT_ID *slot, void *reserved);
+
+#endif /* SRC_LIB_EVENT_H_ */
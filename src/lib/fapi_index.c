@@ -0,0 +1,697 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include "config.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <yaml.h>
+
+#include "fapi_index.h"
+#include "log.h"
+#include "utils.h"
+
+#define FAPI_CONFIG_ENV_VAR "TSS2_FAPICONF"
+#define FAPI_CONFIG_DEFAULT "/etc/tpm2-tss/fapi-config.json"
+#define FAPI_OBJECT_FILE    "object.json"
+
+#define INDEX_DIR     ".tpm2_pkcs11"
+#define INDEX_NAME    "fapi-index"
+#define INDEX_MAGIC   "tpm2fapi"
+#define INDEX_VERSION 1
+
+/* keystores in the order FAPI searches them for an entry */
+#define KEYSTORES 2
+
+typedef struct index_entry index_entry;
+struct index_entry {
+    char *key;
+    /* the keystore state the data was read at */
+    twist stamp;
+    /* NULL while pending a fapi_index_put() */
+    twist data;
+    bool used;
+};
+
+struct fapi_index {
+    char *file;
+    char *dirs[KEYSTORES];
+    index_entry *entries;
+    size_t len;
+    size_t cap;
+    /* entries [0, sorted) are ordered by key */
+    size_t sorted;
+    bool dirty;
+};
+
+typedef struct stamp stamp;
+struct stamp {
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_s;
+    uint64_t mtime_ns;
+    uint64_t ctime_s;
+    uint64_t ctime_ns;
+};
+
+typedef struct buffer buffer;
+struct buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+static bool buffer_add(buffer *b, const void *data, size_t len) {
+
+    if (b->cap - b->len < len) {
+        size_t cap = b->cap ? b->cap : 256;
+        while (cap - b->len < len) {
+            safe_mule(cap, 2);
+        }
+        char *d = realloc(b->data, cap);
+        if (!d) {
+            LOGE("oom");
+            return false;
+        }
+        b->data = d;
+        b->cap = cap;
+    }
+
+    memcpy(&b->data[b->len], data, len);
+    b->len += len;
+
+    return true;
+}
+
+/* a missing file stamps as all zeroes */
+static bool buffer_add_stamp(buffer *b, const char *path) {
+
+    stamp s = { 0 };
+
+    struct stat st;
+    if (!stat(path, &st)) {
+        s.ino = st.st_ino;
+        s.size = st.st_size;
+        s.mtime_s = st.st_mtim.tv_sec;
+        s.mtime_ns = st.st_mtim.tv_nsec;
+        s.ctime_s = st.st_ctim.tv_sec;
+        s.ctime_ns = st.st_ctim.tv_nsec;
+    }
+
+    return buffer_add(b, &s, sizeof(s));
+}
+
+static char *path_join(const char *a, const char *b, const char *c) {
+
+    c = c ? c : "";
+
+    size_t size = 0;
+    safe_add(size, strlen(a), strlen(b));
+    safe_adde(size, strlen(c));
+    safe_adde(size, 1);
+
+    char *p = malloc(size);
+    if (!p) {
+        LOGE("oom");
+        return NULL;
+    }
+
+    snprintf(p, size, "%s%s%s", a, b, c);
+
+    return p;
+}
+
+static char *expand_home(const char *dir) {
+
+    if (dir[0] != '~') {
+        return strdup(dir);
+    }
+
+    const char *home = getenv("HOME");
+    if (!home) {
+        return NULL;
+    }
+
+    return path_join(home, &dir[1], NULL);
+}
+
+static char *read_file(const char *path, size_t *len) {
+
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return NULL;
+    }
+
+    buffer b = { 0 };
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        if (!buffer_add(&b, chunk, n)) {
+            free(b.data);
+            fclose(f);
+            return NULL;
+        }
+    }
+
+    bool failed = ferror(f);
+    fclose(f);
+    if (failed || !buffer_add(&b, "", 1)) {
+        free(b.data);
+        return NULL;
+    }
+
+    *len = b.len - 1;
+    return b.data;
+}
+
+/*
+ * Reads user_dir and system_dir from the top level of the FAPI config.
+ * JSON is YAML, so the attribute parser's library reads it too.
+ */
+static bool config_dirs(fapi_index *idx) {
+
+    const char *path = getenv(FAPI_CONFIG_ENV_VAR);
+    if (!path) {
+        path = FAPI_CONFIG_DEFAULT;
+    }
+
+    size_t len;
+    char *config = read_file(path, &len);
+    if (!config) {
+        LOGV("Cannot read FAPI config \"%s\"", path);
+        return false;
+    }
+
+    yaml_parser_t parser;
+    if (!yaml_parser_initialize(&parser)) {
+        free(config);
+        return false;
+    }
+
+    yaml_parser_set_input_string(&parser, (const unsigned char *)config, len);
+
+    unsigned depth = 0;
+    char *key = NULL;
+    bool done = false;
+    bool ok = true;
+    while (!done) {
+        yaml_event_t event;
+        if (!yaml_parser_parse(&parser, &event)) {
+            LOGV("Cannot parse FAPI config \"%s\"", path);
+            ok = false;
+            break;
+        }
+
+        switch (event.type) {
+        case YAML_MAPPING_START_EVENT:
+        case YAML_SEQUENCE_START_EVENT:
+            depth++;
+            break;
+        case YAML_MAPPING_END_EVENT:
+        case YAML_SEQUENCE_END_EVENT:
+            depth--;
+            if (depth == 1) {
+                /* a nested value ended, the next scalar is a key */
+                free(key);
+                key = NULL;
+            }
+            break;
+        case YAML_SCALAR_EVENT:
+            if (depth != 1) {
+                break;
+            }
+            if (!key) {
+                key = strdup((const char *)event.data.scalar.value);
+                if (!key) {
+                    LOGE("oom");
+                    ok = false;
+                    done = true;
+                }
+                break;
+            }
+
+            int i = !strcmp(key, "user_dir") ? 0 :
+                    !strcmp(key, "system_dir") ? 1 : -1;
+            if (i >= 0 && !idx->dirs[i]) {
+                idx->dirs[i] = expand_home((const char *)event.data.scalar.value);
+            }
+            free(key);
+            key = NULL;
+            break;
+        case YAML_STREAM_END_EVENT:
+            done = true;
+            break;
+        default:
+            break;
+        }
+
+        yaml_event_delete(&event);
+    }
+
+    free(key);
+    yaml_parser_delete(&parser);
+    free(config);
+
+    return ok && (idx->dirs[0] || idx->dirs[1]);
+}
+
+static char *index_file(void) {
+
+    const char *env = getenv(FAPI_INDEX_ENV_VAR);
+    if (env) {
+        return env[0] ? strdup(env) : NULL;
+    }
+
+    const char *home = getenv("HOME");
+    if (!home) {
+        return NULL;
+    }
+
+    return path_join(home, "/" INDEX_DIR "/", INDEX_NAME);
+}
+
+static int entry_cmp(const void *a, const void *b) {
+
+    const index_entry *x = (const index_entry *)a;
+    const index_entry *y = (const index_entry *)b;
+
+    return strcmp(x->key, y->key);
+}
+
+static index_entry *entry_find(fapi_index *idx, const char *key) {
+
+    if (idx->sorted) {
+        index_entry needle = { .key = (char *)key };
+        index_entry *e = bsearch(&needle, idx->entries, idx->sorted,
+                sizeof(*idx->entries), entry_cmp);
+        if (e) {
+            return e;
+        }
+    }
+
+    /* added since the load */
+    size_t i;
+    for (i=idx->sorted; i < idx->len; i++) {
+        if (!strcmp(idx->entries[i].key, key)) {
+            return &idx->entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+static index_entry *entry_add(fapi_index *idx, char *key) {
+
+    if (idx->len == idx->cap) {
+        size_t cap = idx->cap ? idx->cap : 16;
+        safe_mule(cap, 2);
+        index_entry *e = realloc(idx->entries, cap * sizeof(*e));
+        if (!e) {
+            LOGE("oom");
+            return NULL;
+        }
+        idx->entries = e;
+        idx->cap = cap;
+    }
+
+    index_entry *e = &idx->entries[idx->len++];
+    memset(e, 0, sizeof(*e));
+    e->key = key;
+
+    return e;
+}
+
+static bool read_field(const char **p, const char *end, const char **field,
+        uint32_t *len) {
+
+    if ((size_t)(end - *p) < sizeof(*len)) {
+        return false;
+    }
+
+    memcpy(len, *p, sizeof(*len));
+    *p += sizeof(*len);
+
+    if ((size_t)(end - *p) < *len) {
+        return false;
+    }
+
+    *field = *p;
+    *p += *len;
+
+    return true;
+}
+
+/* any damage drops everything, the index is rebuilt on close */
+static void index_load(fapi_index *idx) {
+
+    size_t len;
+    char *data = read_file(idx->file, &len);
+    if (!data) {
+        LOGV("No FAPI index at \"%s\"", idx->file);
+        return;
+    }
+
+    const char *p = data;
+    const char *end = data + len;
+
+    uint32_t version;
+    if (len < sizeof(INDEX_MAGIC) - 1 + sizeof(version)
+            || memcmp(p, INDEX_MAGIC, sizeof(INDEX_MAGIC) - 1)) {
+        goto damaged;
+    }
+    p += sizeof(INDEX_MAGIC) - 1;
+
+    memcpy(&version, p, sizeof(version));
+    p += sizeof(version);
+    if (version != INDEX_VERSION) {
+        goto damaged;
+    }
+
+    while (p < end) {
+        const char *key, *st, *value;
+        uint32_t keylen, stlen, valuelen;
+        if (!read_field(&p, end, &key, &keylen)
+                || !read_field(&p, end, &st, &stlen)
+                || !read_field(&p, end, &value, &valuelen)
+                || !keylen || memchr(key, '\0', keylen)) {
+            goto damaged;
+        }
+
+        char *k = strndup(key, keylen);
+        if (!k) {
+            LOGE("oom");
+            goto damaged;
+        }
+
+        index_entry *e = entry_add(idx, k);
+        if (!e) {
+            free(k);
+            goto damaged;
+        }
+
+        e->stamp = twistbin_new(st, stlen);
+        e->data = twistbin_new(value, valuelen);
+        if (!e->stamp || !e->data) {
+            LOGE("oom");
+            goto damaged;
+        }
+    }
+
+    qsort(idx->entries, idx->len, sizeof(*idx->entries), entry_cmp);
+    idx->sorted = idx->len;
+
+    free(data);
+    return;
+
+damaged:
+    LOGW("Ignoring damaged FAPI index \"%s\"", idx->file);
+    free(data);
+
+    size_t i;
+    for (i=0; i < idx->len; i++) {
+        free(idx->entries[i].key);
+        twist_free(idx->entries[i].stamp);
+        twist_free(idx->entries[i].data);
+    }
+    idx->len = idx->sorted = 0;
+    idx->dirty = true;
+}
+
+static bool write_field(FILE *f, const void *data, size_t len) {
+
+    uint32_t l = len;
+    return fwrite(&l, sizeof(l), 1, f) == 1
+            && (!len || fwrite(data, len, 1, f) == 1);
+}
+
+static void index_store(fapi_index *idx) {
+
+    char *tmp = path_join(idx->file, ".tmp", NULL);
+    if (!tmp) {
+        return;
+    }
+
+    /* the default directory is shared with the store, which creates it */
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        LOGV("Cannot write FAPI index \"%s\": %s", tmp, strerror(errno));
+        free(tmp);
+        return;
+    }
+
+    FILE *f = fdopen(fd, "wb");
+    if (!f) {
+        close(fd);
+        goto error;
+    }
+
+    uint32_t version = INDEX_VERSION;
+    bool ok = fwrite(INDEX_MAGIC, sizeof(INDEX_MAGIC) - 1, 1, f) == 1
+            && fwrite(&version, sizeof(version), 1, f) == 1;
+
+    size_t i;
+    for (i=0; ok && i < idx->len; i++) {
+        index_entry *e = &idx->entries[i];
+        if (!e->used || !e->data) {
+            continue;
+        }
+
+        ok = write_field(f, e->key, strlen(e->key))
+                && write_field(f, e->stamp, twist_len(e->stamp))
+                && write_field(f, e->data, twist_len(e->data));
+    }
+
+    if (fclose(f) || !ok) {
+        goto error;
+    }
+
+    if (rename(tmp, idx->file)) {
+        LOGW("Could not rename \"%s\" --> \"%s\", error: %s",
+                tmp, idx->file, strerror(errno));
+        goto error;
+    }
+
+    free(tmp);
+    return;
+
+error:
+    LOGW("Writing FAPI index \"%s\" failed", idx->file);
+    unlink(tmp);
+    free(tmp);
+}
+
+fapi_index *fapi_index_open(void) {
+
+    fapi_index *idx = calloc(1, sizeof(*idx));
+    if (!idx) {
+        LOGE("oom");
+        return NULL;
+    }
+
+    idx->file = index_file();
+    if (!idx->file) {
+        goto disabled;
+    }
+
+    if (!config_dirs(idx)) {
+        goto disabled;
+    }
+
+    index_load(idx);
+
+    return idx;
+
+disabled:
+    LOGV("FAPI index disabled");
+    fapi_index_close(idx);
+    return NULL;
+}
+
+void fapi_index_close(fapi_index *idx) {
+
+    if (!idx) {
+        return;
+    }
+
+    bool stale = false;
+    size_t i;
+    for (i=0; i < idx->len; i++) {
+        stale |= !idx->entries[i].used;
+    }
+
+    if (idx->file && (idx->dirty || stale)) {
+        index_store(idx);
+    }
+
+    for (i=0; i < idx->len; i++) {
+        free(idx->entries[i].key);
+        twist_free(idx->entries[i].stamp);
+        twist_free(idx->entries[i].data);
+    }
+
+    free(idx->entries);
+    for (i=0; i < KEYSTORES; i++) {
+        free(idx->dirs[i]);
+    }
+    free(idx->file);
+    free(idx);
+}
+
+/*
+ * Entries are found and listed through the profile directories, so their
+ * mtimes together with HS and SRK below them, and the keystore's own,
+ * change whenever what Fapi_List() of /HS/SRK returns could.
+ */
+static bool stamp_listing(fapi_index *idx, buffer *b) {
+
+    size_t i;
+    for (i=0; i < KEYSTORES; i++) {
+        const char *dir = idx->dirs[i];
+        if (!dir) {
+            continue;
+        }
+
+        if (!buffer_add_stamp(b, dir)) {
+            return false;
+        }
+
+        struct dirent **names = NULL;
+        int n = scandir(dir, &names, NULL, alphasort);
+        if (n < 0) {
+            continue;
+        }
+
+        bool ok = true;
+        int j;
+        for (j=0; j < n; j++) {
+            const char *name = names[j]->d_name;
+            if (ok && !strncmp(name, "P_", 2)) {
+                char *p = path_join(dir, "/", name);
+                char *hs = p ? path_join(p, "/HS", NULL) : NULL;
+                char *srk = hs ? path_join(hs, "/SRK", NULL) : NULL;
+                ok = srk
+                        && buffer_add(b, name, strlen(name) + 1)
+                        && buffer_add_stamp(b, p)
+                        && buffer_add_stamp(b, hs)
+                        && buffer_add_stamp(b, srk);
+                free(p);
+                free(hs);
+                free(srk);
+            }
+            free(names[j]);
+        }
+        free(names);
+
+        if (!ok) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* the keystore holding the entry, and its file */
+static bool stamp_entry(fapi_index *idx, const char *path, buffer *b) {
+
+    size_t i;
+    for (i=0; i < KEYSTORES; i++) {
+        const char *dir = idx->dirs[i];
+        if (!dir) {
+            continue;
+        }
+
+        char *file = path_join(dir, path, "/" FAPI_OBJECT_FILE);
+        if (!file) {
+            return false;
+        }
+
+        struct stat st;
+        bool found = !stat(file, &st);
+        if (found) {
+            uint8_t keystore = i;
+            bool ok = buffer_add(b, &keystore, sizeof(keystore))
+                    && buffer_add_stamp(b, file);
+            free(file);
+            return ok;
+        }
+        free(file);
+    }
+
+    return false;
+}
+
+static char *entry_key(const char *kind, const char *path) {
+    return path_join(kind, "\n", path);
+}
+
+twist fapi_index_get(fapi_index *idx, const char *kind, const char *path) {
+
+    if (!idx) {
+        return NULL;
+    }
+
+    char *key = entry_key(kind, path);
+    if (!key) {
+        return NULL;
+    }
+
+    buffer b = { 0 };
+    bool stamped = !strcmp(kind, "list") ?
+            stamp_listing(idx, &b) : stamp_entry(idx, path, &b);
+
+    index_entry *e = entry_find(idx, key);
+    if (e) {
+        free(key);
+    } else {
+        e = entry_add(idx, key);
+        if (!e) {
+            free(key);
+            free(b.data);
+            return NULL;
+        }
+    }
+
+    e->used = true;
+
+    if (stamped && e->data && e->stamp && twist_len(e->stamp) == b.len
+            && !memcmp(e->stamp, b.data, b.len)) {
+        free(b.data);
+        return twistbin_new(e->data, twist_len(e->data));
+    }
+
+    /* stale, hold the fresh stamp for the put */
+    twist_free(e->data);
+    twist_free(e->stamp);
+    e->data = NULL;
+    e->stamp = stamped ? twistbin_new(b.data, b.len) : NULL;
+    free(b.data);
+    idx->dirty = true;
+
+    return NULL;
+}
+
+void fapi_index_put(fapi_index *idx, const char *kind, const char *path,
+        const void *data, size_t len) {
+
+    if (!idx) {
+        return;
+    }
+
+    char *key = entry_key(kind, path);
+    if (!key) {
+        return;
+    }
+
+    index_entry *e = entry_find(idx, key);
+    free(key);
+    if (!e || !e->stamp || e->data) {
+        return;
+    }
+
+    e->data = twistbin_new(data, len);
+}
@@ -0,0 +1,81 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef SRC_LIB_FAPI_INDEX_H_
+#define SRC_LIB_FAPI_INDEX_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "twist.h"
+
+/*
+ * TPM2_PKCS11_FAPI_INDEX names the index file, an empty value disables it.
+ * It defaults to $HOME/.tpm2_pkcs11/fapi-index.
+ */
+#define FAPI_INDEX_ENV_VAR "TPM2_PKCS11_FAPI_INDEX"
+
+/*
+ * An on disk cache of what enumerating the FAPI tokens reads from the
+ * keystore, so an unchanged keystore is loaded without Fapi_List() and
+ * without reading and parsing the JSON file of every entry.
+ *
+ * Each value is stored under a kind, like "appdata", and a FAPI path. It is
+ * valid while the inode, size, mtime and ctime of the entry's object.json
+ * in the keystore are the same as when it was read. Listings are checked
+ * against the profile, HS and SRK directories of the keystores instead.
+ *
+ * The keystore directories are read from the FAPI config, TSS2_FAPICONF or
+ * /etc/tpm2-tss/fapi-config.json. Without them the index is disabled and
+ * every value comes from FAPI.
+ */
+typedef struct fapi_index fapi_index;
+
+/**
+ * Loads the index. A missing or damaged index file loads as empty.
+ * @return
+ *  The index or NULL if disabled. Free with fapi_index_close().
+ */
+fapi_index *fapi_index_open(void);
+
+/**
+ * Writes the index back if it changed and frees it. Entries that were not
+ * looked up since fapi_index_open() are dropped, as they belong to keystore
+ * entries that are gone. It is safe to pass NULL.
+ * @param idx
+ *  The index to close.
+ */
+void fapi_index_close(fapi_index *idx);
+
+/**
+ * Looks up a value. On a miss, the current state of the keystore entry is
+ * remembered for fapi_index_put(), so it must be called before the value
+ * is read from FAPI.
+ * @param idx
+ *  The index, may be NULL.
+ * @param kind
+ *  What is stored about the entry.
+ * @param path
+ *  The FAPI path, including the profile. For a listing the search path.
+ * @return
+ *  A copy of the value, or NULL if not present or stale.
+ */
+twist fapi_index_get(fapi_index *idx, const char *kind, const char *path);
+
+/**
+ * Stores a value read after a missed fapi_index_get() for the same kind
+ * and path. Does nothing when the entry's state could not be taken.
+ * @param idx
+ *  The index, may be NULL.
+ * @param kind
+ *  What is stored about the entry.
+ * @param path
+ *  The FAPI path.
+ * @param data
+ *  The value.
+ * @param len
+ *  The length of data.
+ */
+void fapi_index_put(fapi_index *idx, const char *kind, const char *path,
+        const void *data, size_t len);
+
+#endif /* SRC_LIB_FAPI_INDEX_H_ */
@@ -0,0 +1,124 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include "config.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "backend.h"
+#include "event.h"
+#include "fork.h"
+#include "general.h"
+#include "log.h"
+#include "slot.h"
+
+static struct {
+    pthread_once_t once;
+    /* serializes the reopen, and held across fork() */
+    pthread_mutex_t lock;
+    /* set in a child until its first call reopens */
+    bool pending;
+    /* what prepare took, for the parent and child handlers */
+    bool prepared;
+    bool locked;
+} global = {
+    .once = PTHREAD_ONCE_INIT,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void on_prepare(void) {
+
+    if (!general_is_init()) {
+        return;
+    }
+
+    pthread_mutex_lock(&global.lock);
+    global.prepared = true;
+
+    /*
+     * A child that didn't reopen yet has nobody using its tokens, and
+     * their inherited locks are held for good.
+     */
+    if (!global.pending) {
+        slot_fork_lock();
+        global.locked = true;
+    }
+}
+
+static void on_parent(void) {
+
+    if (global.locked) {
+        global.locked = false;
+        slot_fork_unlock();
+    }
+
+    if (global.prepared) {
+        global.prepared = false;
+        pthread_mutex_unlock(&global.lock);
+    }
+}
+
+static void on_child(void) {
+
+    /* only async-signal-safe work in here, the reopen waits for a call */
+    pthread_mutex_init(&global.lock, NULL);
+
+    if (global.prepared) {
+        global.prepared = false;
+        global.locked = false;
+        __atomic_store_n(&global.pending, true, __ATOMIC_RELEASE);
+    }
+}
+
+static void register_handlers(void) {
+
+    int rc = pthread_atfork(on_prepare, on_parent, on_child);
+    if (rc) {
+        LOGW("Cannot register fork handlers: %s", strerror(rc));
+    }
+}
+
+void fork_init(void) {
+
+    pthread_once(&global.once, register_handlers);
+
+    /* a child that calls C_Initialize again has nothing left to reopen */
+    __atomic_store_n(&global.pending, false, __ATOMIC_RELEASE);
+}
+
+static CK_RV reopen(void) {
+
+    LOGV("Reopening connections after fork");
+
+    event_after_fork();
+
+    CK_RV rv = backend_after_fork();
+    if (rv != CKR_OK) {
+        LOGE("Could not reopen the backends after fork: 0x%lx", rv);
+    }
+
+    /* tokens are still reopened, without a backend they fail on their own */
+    CK_RV rv2 = slot_after_fork();
+    if (rv == CKR_OK) {
+        rv = rv2;
+    }
+
+    return rv;
+}
+
+CK_RV fork_check(void) {
+
+    if (!__atomic_load_n(&global.pending, __ATOMIC_ACQUIRE)) {
+        return CKR_OK;
+    }
+
+    CK_RV rv = CKR_OK;
+
+    pthread_mutex_lock(&global.lock);
+    if (global.pending) {
+        rv = reopen();
+        __atomic_store_n(&global.pending, false, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&global.lock);
+
+    return rv;
+}
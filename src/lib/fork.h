@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef SRC_LIB_FORK_H_
+#define SRC_LIB_FORK_H_
+
+#include "pkcs11.h"
+
+/*
+ * Support for processes that fork() after C_Initialize, like pre-forking
+ * servers, without a C_Finalize and C_Initialize in every child.
+ *
+ * The child inherits the TPM connections, their HMAC sessions and the
+ * store's sqlite connection, none of which it may share with the parent.
+ * Rather than parsing the store again, the child keeps the tokens and
+ * objects it inherited and on its first PKCS11 call opens connections of
+ * its own, reloads the primary objects and restarts the HMAC sessions of
+ * logged in tokens. Other objects reload when next used. The inherited
+ * connections are never closed, that would act on the parent's behalf.
+ *
+ * Every token lock is held across fork(), so a fork waits for calls in
+ * progress on other threads. Operations active at the fork must be
+ * started again in the child.
+ */
+
+/**
+ * Registers the fork handlers, once per process. Called from C_Initialize.
+ */
+void fork_init(void);
+
+/**
+ * Reopens the library's connections if this process is a child that has
+ * not done so yet, a single load otherwise. Called by every entry point
+ * that needs the library initialized.
+ * @return
+ *  CKR_OK on success, the failure of the reopen otherwise. A reopen is
+ *  only tried once, tokens it failed for fail their TPM calls.
+ */
+CK_RV fork_check(void);
+
+#endif /* SRC_LIB_FORK_H_ */
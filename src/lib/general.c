@@ -4,15 +4,22 @@
 #include <limits.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "checks.h"
 #include "config.h"
 #include "backend.h"
+#include "broker.h"
+#include "event.h"
+#include "fork.h"
 #include "general.h"
 #include "log.h"
 #include "mutex.h"
 #include "pkcs11.h"
+#include "profile.h"
 #include "session.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
 
 #ifndef VERSION
@@ -52,89 +59,272 @@ CK_RV general_get_info(CK_INFO *info) {
     return CKR_OK;
 }
 
+static CK_FUNCTION_LIST _func_list = {
+    .version = CRYPTOKI_VERSION,
+    .C_Initialize = C_Initialize,
+    .C_Finalize = C_Finalize,
+    .C_GetInfo = C_GetInfo,
+    .C_GetFunctionList = C_GetFunctionList,
+    .C_GetSlotList = C_GetSlotList,
+    .C_GetSlotInfo = C_GetSlotInfo,
+    .C_GetTokenInfo = C_GetTokenInfo,
+    .C_GetMechanismList = C_GetMechanismList,
+    .C_GetMechanismInfo = C_GetMechanismInfo,
+    .C_InitToken = C_InitToken,
+    .C_InitPIN = C_InitPIN,
+    .C_SetPIN = C_SetPIN,
+    .C_OpenSession = C_OpenSession,
+    .C_CloseSession = C_CloseSession,
+    .C_CloseAllSessions = C_CloseAllSessions,
+    .C_GetSessionInfo = C_GetSessionInfo,
+    .C_GetOperationState = C_GetOperationState,
+    .C_SetOperationState = C_SetOperationState,
+    .C_Login = C_Login,
+    .C_Logout = C_Logout,
+    .C_CreateObject = C_CreateObject,
+    .C_CopyObject = C_CopyObject,
+    .C_DestroyObject = C_DestroyObject,
+    .C_GetObjectSize = C_GetObjectSize,
+    .C_GetAttributeValue = C_GetAttributeValue,
+    .C_SetAttributeValue = C_SetAttributeValue,
+    .C_FindObjectsInit = C_FindObjectsInit,
+    .C_FindObjects = C_FindObjects,
+    .C_FindObjectsFinal = C_FindObjectsFinal,
+    .C_EncryptInit = C_EncryptInit,
+    .C_Encrypt = C_Encrypt,
+    .C_EncryptUpdate = C_EncryptUpdate,
+    .C_EncryptFinal = C_EncryptFinal,
+    .C_DecryptInit = C_DecryptInit,
+    .C_Decrypt = C_Decrypt,
+    .C_DecryptUpdate = C_DecryptUpdate,
+    .C_DecryptFinal = C_DecryptFinal,
+    .C_DigestInit = C_DigestInit,
+    .C_Digest = C_Digest,
+    .C_DigestUpdate = C_DigestUpdate,
+    .C_DigestKey = C_DigestKey,
+    .C_DigestFinal = C_DigestFinal,
+    .C_SignInit = C_SignInit,
+    .C_Sign = C_Sign,
+    .C_SignUpdate = C_SignUpdate,
+    .C_SignFinal = C_SignFinal,
+    .C_SignRecoverInit = C_SignRecoverInit,
+    .C_SignRecover = C_SignRecover,
+    .C_VerifyInit = C_VerifyInit,
+    .C_Verify = C_Verify,
+    .C_VerifyUpdate = C_VerifyUpdate,
+    .C_VerifyFinal = C_VerifyFinal,
+    .C_VerifyRecoverInit = C_VerifyRecoverInit,
+    .C_VerifyRecover = C_VerifyRecover,
+    .C_DigestEncryptUpdate = C_DigestEncryptUpdate,
+    .C_DecryptDigestUpdate = C_DecryptDigestUpdate,
+    .C_SignEncryptUpdate = C_SignEncryptUpdate,
+    .C_DecryptVerifyUpdate = C_DecryptVerifyUpdate,
+    .C_GenerateKey = C_GenerateKey,
+    .C_GenerateKeyPair = C_GenerateKeyPair,
+    .C_WrapKey = C_WrapKey,
+    .C_UnwrapKey = C_UnwrapKey,
+    .C_DeriveKey = C_DeriveKey,
+    .C_SeedRandom = C_SeedRandom,
+    .C_GenerateRandom = C_GenerateRandom,
+    .C_GetFunctionStatus = C_GetFunctionStatus,
+    .C_CancelFunction = C_CancelFunction,
+    .C_WaitForSlotEvent = C_WaitForSlotEvent,
+};
+
+static CK_FUNCTION_LIST_3_0 _func_list_3_0 = {
+    .version = { .major = 3, .minor = 0 },
+    .C_Initialize = C_Initialize,
+    .C_Finalize = C_Finalize,
+    .C_GetInfo = C_GetInfo,
+    .C_GetFunctionList = C_GetFunctionList,
+    .C_GetSlotList = C_GetSlotList,
+    .C_GetSlotInfo = C_GetSlotInfo,
+    .C_GetTokenInfo = C_GetTokenInfo,
+    .C_GetMechanismList = C_GetMechanismList,
+    .C_GetMechanismInfo = C_GetMechanismInfo,
+    .C_InitToken = C_InitToken,
+    .C_InitPIN = C_InitPIN,
+    .C_SetPIN = C_SetPIN,
+    .C_OpenSession = C_OpenSession,
+    .C_CloseSession = C_CloseSession,
+    .C_CloseAllSessions = C_CloseAllSessions,
+    .C_GetSessionInfo = C_GetSessionInfo,
+    .C_GetOperationState = C_GetOperationState,
+    .C_SetOperationState = C_SetOperationState,
+    .C_Login = C_Login,
+    .C_Logout = C_Logout,
+    .C_CreateObject = C_CreateObject,
+    .C_CopyObject = C_CopyObject,
+    .C_DestroyObject = C_DestroyObject,
+    .C_GetObjectSize = C_GetObjectSize,
+    .C_GetAttributeValue = C_GetAttributeValue,
+    .C_SetAttributeValue = C_SetAttributeValue,
+    .C_FindObjectsInit = C_FindObjectsInit,
+    .C_FindObjects = C_FindObjects,
+    .C_FindObjectsFinal = C_FindObjectsFinal,
+    .C_EncryptInit = C_EncryptInit,
+    .C_Encrypt = C_Encrypt,
+    .C_EncryptUpdate = C_EncryptUpdate,
+    .C_EncryptFinal = C_EncryptFinal,
+    .C_DecryptInit = C_DecryptInit,
+    .C_Decrypt = C_Decrypt,
+    .C_DecryptUpdate = C_DecryptUpdate,
+    .C_DecryptFinal = C_DecryptFinal,
+    .C_DigestInit = C_DigestInit,
+    .C_Digest = C_Digest,
+    .C_DigestUpdate = C_DigestUpdate,
+    .C_DigestKey = C_DigestKey,
+    .C_DigestFinal = C_DigestFinal,
+    .C_SignInit = C_SignInit,
+    .C_Sign = C_Sign,
+    .C_SignUpdate = C_SignUpdate,
+    .C_SignFinal = C_SignFinal,
+    .C_SignRecoverInit = C_SignRecoverInit,
+    .C_SignRecover = C_SignRecover,
+    .C_VerifyInit = C_VerifyInit,
+    .C_Verify = C_Verify,
+    .C_VerifyUpdate = C_VerifyUpdate,
+    .C_VerifyFinal = C_VerifyFinal,
+    .C_VerifyRecoverInit = C_VerifyRecoverInit,
+    .C_VerifyRecover = C_VerifyRecover,
+    .C_DigestEncryptUpdate = C_DigestEncryptUpdate,
+    .C_DecryptDigestUpdate = C_DecryptDigestUpdate,
+    .C_SignEncryptUpdate = C_SignEncryptUpdate,
+    .C_DecryptVerifyUpdate = C_DecryptVerifyUpdate,
+    .C_GenerateKey = C_GenerateKey,
+    .C_GenerateKeyPair = C_GenerateKeyPair,
+    .C_WrapKey = C_WrapKey,
+    .C_UnwrapKey = C_UnwrapKey,
+    .C_DeriveKey = C_DeriveKey,
+    .C_SeedRandom = C_SeedRandom,
+    .C_GenerateRandom = C_GenerateRandom,
+    .C_GetFunctionStatus = C_GetFunctionStatus,
+    .C_CancelFunction = C_CancelFunction,
+    .C_WaitForSlotEvent = C_WaitForSlotEvent,
+    .C_GetInterfaceList = C_GetInterfaceList,
+    .C_GetInterface = C_GetInterface,
+    .C_LoginUser = C_LoginUser,
+    .C_SessionCancel = C_SessionCancel,
+    .C_MessageEncryptInit = C_MessageEncryptInit,
+    .C_EncryptMessage = C_EncryptMessage,
+    .C_EncryptMessageBegin = C_EncryptMessageBegin,
+    .C_EncryptMessageNext = C_EncryptMessageNext,
+    .C_MessageEncryptFinal = C_MessageEncryptFinal,
+    .C_MessageDecryptInit = C_MessageDecryptInit,
+    .C_DecryptMessage = C_DecryptMessage,
+    .C_DecryptMessageBegin = C_DecryptMessageBegin,
+    .C_DecryptMessageNext = C_DecryptMessageNext,
+    .C_MessageDecryptFinal = C_MessageDecryptFinal,
+    .C_MessageSignInit = C_MessageSignInit,
+    .C_SignMessage = C_SignMessage,
+    .C_SignMessageBegin = C_SignMessageBegin,
+    .C_SignMessageNext = C_SignMessageNext,
+    .C_MessageSignFinal = C_MessageSignFinal,
+    .C_MessageVerifyInit = C_MessageVerifyInit,
+    .C_VerifyMessage = C_VerifyMessage,
+    .C_VerifyMessageBegin = C_VerifyMessageBegin,
+    .C_VerifyMessageNext = C_VerifyMessageNext,
+    .C_MessageVerifyFinal = C_MessageVerifyFinal,
+};
+
+static const char INTERFACE_NAME[] = "PKCS 11";
+
+/* the newest first, so a C_GetInterface without a version gets it */
+static CK_INTERFACE _interfaces[] = {
+    { .pInterfaceName = (char *)INTERFACE_NAME, .pFunctionList = &_func_list_3_0 },
+    { .pInterfaceName = (char *)INTERFACE_NAME, .pFunctionList = &_func_list },
+};
+
+/*
+ * In broker client mode the function lists and interfaces hand out the
+ * client, which forwards to the broker. Applications linking the C_*
+ * symbols directly stay in process.
+ */
+static CK_INTERFACE *get_interfaces(size_t *count) {
+
+    if (broker_client_enabled()) {
+        *count = 1;
+        return broker_client_get_interface();
+    }
+
+    *count = ARRAY_LEN(_interfaces);
+    return _interfaces;
+}
+
 CK_RV general_get_func_list(CK_FUNCTION_LIST **function_list) {
 
     if (function_list == NULL_PTR) {
         return CKR_ARGUMENTS_BAD;
     }
 
-    static CK_FUNCTION_LIST list = {
-         .version = CRYPTOKI_VERSION,
-        .C_Initialize = C_Initialize,
-        .C_Finalize = C_Finalize,
-        .C_GetInfo = C_GetInfo,
-        .C_GetFunctionList = C_GetFunctionList,
-        .C_GetSlotList = C_GetSlotList,
-        .C_GetSlotInfo = C_GetSlotInfo,
-        .C_GetTokenInfo = C_GetTokenInfo,
-        .C_GetMechanismList = C_GetMechanismList,
-        .C_GetMechanismInfo = C_GetMechanismInfo,
-        .C_InitToken = C_InitToken,
-        .C_InitPIN = C_InitPIN,
-        .C_SetPIN = C_SetPIN,
-        .C_OpenSession = C_OpenSession,
-        .C_CloseSession = C_CloseSession,
-        .C_CloseAllSessions = C_CloseAllSessions,
-        .C_GetSessionInfo = C_GetSessionInfo,
-        .C_GetOperationState = C_GetOperationState,
-        .C_SetOperationState = C_SetOperationState,
-        .C_Login = C_Login,
-        .C_Logout = C_Logout,
-        .C_CreateObject = C_CreateObject,
-        .C_CopyObject = C_CopyObject,
-        .C_DestroyObject = C_DestroyObject,
-        .C_GetObjectSize = C_GetObjectSize,
-        .C_GetAttributeValue = C_GetAttributeValue,
-        .C_SetAttributeValue = C_SetAttributeValue,
-        .C_FindObjectsInit = C_FindObjectsInit,
-        .C_FindObjects = C_FindObjects,
-        .C_FindObjectsFinal = C_FindObjectsFinal,
-        .C_EncryptInit = C_EncryptInit,
-        .C_Encrypt = C_Encrypt,
-        .C_EncryptUpdate = C_EncryptUpdate,
-        .C_EncryptFinal = C_EncryptFinal,
-        .C_DecryptInit = C_DecryptInit,
-        .C_Decrypt = C_Decrypt,
-        .C_DecryptUpdate = C_DecryptUpdate,
-        .C_DecryptFinal = C_DecryptFinal,
-        .C_DigestInit = C_DigestInit,
-        .C_Digest = C_Digest,
-        .C_DigestUpdate = C_DigestUpdate,
-        .C_DigestKey = C_DigestKey,
-        .C_DigestFinal = C_DigestFinal,
-        .C_SignInit = C_SignInit,
-        .C_Sign = C_Sign,
-        .C_SignUpdate = C_SignUpdate,
-        .C_SignFinal = C_SignFinal,
-        .C_SignRecoverInit = C_SignRecoverInit,
-        .C_SignRecover = C_SignRecover,
-        .C_VerifyInit = C_VerifyInit,
-        .C_Verify = C_Verify,
-        .C_VerifyUpdate = C_VerifyUpdate,
-        .C_VerifyFinal = C_VerifyFinal,
-        .C_VerifyRecoverInit = C_VerifyRecoverInit,
-        .C_VerifyRecover = C_VerifyRecover,
-        .C_DigestEncryptUpdate = C_DigestEncryptUpdate,
-        .C_DecryptDigestUpdate = C_DecryptDigestUpdate,
-        .C_SignEncryptUpdate = C_SignEncryptUpdate,
-        .C_DecryptVerifyUpdate = C_DecryptVerifyUpdate,
-        .C_GenerateKey = C_GenerateKey,
-        .C_GenerateKeyPair = C_GenerateKeyPair,
-        .C_WrapKey = C_WrapKey,
-        .C_UnwrapKey = C_UnwrapKey,
-        .C_DeriveKey = C_DeriveKey,
-        .C_SeedRandom = C_SeedRandom,
-        .C_GenerateRandom = C_GenerateRandom,
-        .C_GetFunctionStatus = C_GetFunctionStatus,
-        .C_CancelFunction = C_CancelFunction,
-        .C_WaitForSlotEvent = C_WaitForSlotEvent,
-    };
+    if (broker_client_enabled()) {
+        return broker_client_get_func_list(function_list);
+    }
+
+    *function_list = &_func_list;
+
+    return CKR_OK;
+}
+
+CK_RV general_get_interface_list(CK_INTERFACE *interfaces, CK_ULONG_PTR count) {
+
+    check_pointer(count);
+
+    size_t len;
+    CK_INTERFACE *list = get_interfaces(&len);
+
+    if (!interfaces) {
+        *count = len;
+        return CKR_OK;
+    }
+
+    if (*count < len) {
+        *count = len;
+        return CKR_BUFFER_TOO_SMALL;
+    }
 
-    *function_list = &list;
+    memcpy(interfaces, list, len * sizeof(*list));
+    *count = len;
 
     return CKR_OK;
 }
 
+CK_RV general_get_interface(CK_UTF8CHAR_PTR name, CK_VERSION_PTR version,
+        CK_INTERFACE_PTR_PTR interface_ptr, CK_FLAGS flags) {
+
+    check_pointer(interface_ptr);
+
+    size_t len;
+    CK_INTERFACE *list = get_interfaces(&len);
+
+    size_t i;
+    for (i=0; i < len; i++) {
+        CK_INTERFACE *cur = &list[i];
+
+        if (name && strcmp((const char *)name, cur->pInterfaceName)) {
+            continue;
+        }
+
+        /* every function list starts with its version */
+        const CK_VERSION *cur_version = (const CK_VERSION *)cur->pFunctionList;
+        if (version && (version->major != cur_version->major
+                || version->minor != cur_version->minor)) {
+            continue;
+        }
+
+        if ((cur->flags & flags) != flags) {
+            continue;
+        }
+
+        *interface_ptr = cur;
+        return CKR_OK;
+    }
+
+    LOGV("No interface \"%s\" matches", name ? (const char *)name : "");
+
+    return CKR_ARGUMENTS_BAD;
+}
+
 static bool _g_is_init;
 bool general_is_init(void) {
     return _g_is_init;
@@ -143,6 +333,7 @@ bool general_is_init(void) {
 CK_RV general_init(void *init_args) {
 
     CK_RV rv = CKR_GENERAL_ERROR;
+    bool can_create_threads = true;
 
     if (init_args) {
         CK_C_INITIALIZE_ARGS *args = (CK_C_INITIALIZE_ARGS *)init_args;
@@ -150,6 +341,8 @@ CK_RV general_init(void *init_args) {
             return CKR_ARGUMENTS_BAD;
         }
 
+        can_create_threads = !(args->flags & CKF_LIBRARY_CANT_CREATE_OS_THREADS);
+
         /*
          * If their is CKF_OS_LOCKING_OK flag:
          * 1. No function pointers, Use native OS support (default in mutex.h).
@@ -199,21 +392,36 @@ CK_RV general_init(void *init_args) {
      *
      * THESE MUST GO AFTER MUTEX INIT above!!
      */
+    stats_init();
+    trace_init();
+    profile_init();
+    fork_init();
+
+    profile_span span = profile_begin(profile_phase_backend_init,
+            PROFILE_TOKEN_INHERIT);
     rv = backend_init();
+    profile_end(&span);
     if (rv != CKR_OK) {
         goto err;
     }
 
+    span = profile_begin(profile_phase_slot_init, PROFILE_TOKEN_INHERIT);
     rv = slot_init();
+    profile_end(&span);
     if (rv != CKR_OK) {
         (void)backend_destroy();
         goto err;
     }
 
+    event_init(can_create_threads);
+
     _g_is_init = true;
 
+    profile_finalize(CKR_OK);
+
     return CKR_OK;
 err:
+    profile_finalize(rv);
     return rv;
 }
 
@@ -225,8 +433,12 @@ CK_RV general_finalize(void *reserved) {
 
     _g_is_init = false;
 
+    event_destroy();
     slot_destroy();
     backend_destroy();
 
+    stats_finalize();
+    trace_finalize();
+
     return CKR_OK;
 }
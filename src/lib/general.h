@@ -9,6 +9,9 @@
 
 CK_RV general_init(void *init_args);
 CK_RV general_get_func_list(CK_FUNCTION_LIST **function_list);
+CK_RV general_get_interface_list(CK_INTERFACE *interfaces, CK_ULONG_PTR count);
+CK_RV general_get_interface(CK_UTF8CHAR_PTR name, CK_VERSION_PTR version,
+        CK_INTERFACE_PTR_PTR interface_ptr, CK_FLAGS flags);
 CK_RV general_get_info(CK_INFO *info);
 bool general_is_init(void);
 
@@ -214,6 +214,11 @@ CK_RV key_gen (
     token *tok = session_ctx_get_token(ctx);
     assert(tok);
 
+    if (backend_is_readonly(tok)) {
+        LOGE("Cannot generate keys in a read only store");
+        return CKR_TOKEN_WRITE_PROTECTED;
+    }
+
     /*
      * Attribute arrays specified by the user don't have the type
      * information, but are safe for basic sanity checks (for now).
@@ -331,7 +336,7 @@ CK_RV key_gen (
 
             /* Secure erase the CKA_TPM2_OBJAUTH field in the privkey template */
             memset(attr_ptr->pValue, 0, attr_ptr->ulValueLen);
-            attr_pfree_cleanse(attr_ptr);
+            attr_list_cleanse_entry(new_private_tobj->attrs, attr_ptr);
 
             /* [To-do] delete the CKA_TPM2_OBJAUTH from the privkey template to save storage space */
         }
@@ -28,9 +28,20 @@ static const char *log_strings[] = {
     "UNKNOWN",
 };
 
-#define _LOGV(filename, lineno, fmt, ...) _log(log_level_verbose, filename, lineno, fmt, ##__VA_ARGS__)
-#define _LOGW(filename, lineno, fmt, ...) _log(log_level_warn,    filename, lineno, fmt, ##__VA_ARGS__)
-#define _LOGE(filename, lineno, fmt, ...) _log(log_level_error,   filename, lineno, fmt, ##__VA_ARGS__)
+/*
+ * The level is checked before calling _log() so filtered messages never
+ * evaluate their arguments.
+ */
+#define _LOG(level, filename, lineno, fmt, ...) \
+    do { \
+        if (level <= log_get_level()) { \
+            _log(level, filename, lineno, fmt, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define _LOGV(filename, lineno, fmt, ...) _LOG(log_level_verbose, filename, lineno, fmt, ##__VA_ARGS__)
+#define _LOGW(filename, lineno, fmt, ...) _LOG(log_level_warn,    filename, lineno, fmt, ##__VA_ARGS__)
+#define _LOGE(filename, lineno, fmt, ...) _LOG(log_level_error,   filename, lineno, fmt, ##__VA_ARGS__)
 
 #define LOGV(fmt, ...) _LOGV(__FILE__, __LINE__, fmt, ##__VA_ARGS__)
 #define LOGW(fmt, ...) _LOGW(__FILE__, __LINE__, fmt, ##__VA_ARGS__)
@@ -69,15 +80,28 @@ static inline void log_set_level(const char *level_str) {
     }
 }
 
-static inline void _log(log_level level, const char *file, unsigned lineno,
-        const char *fmt,...) {
+static const char *_g_log_level_env;
+
+static inline log_level log_get_level(void) {
+
+    /*
+     * override config with env var if set, setenv() hands back a new
+     * string for a new value so only reparse when the pointer moves.
+     */
+    const char *env = getenv("TPM2_PKCS11_LOG_LEVEL");
+    if (env != _g_log_level_env) {
+        _g_log_level_env = env;
+        log_set_level(env);
+    }
 
-    /* override config with env var if set */
-    log_set_level(getenv("TPM2_PKCS11_LOG_LEVEL"));
+    return _g_current_log_level;
+}
 
+static inline void _log(log_level level, const char *file, unsigned lineno,
+        const char *fmt,...) {
 
     /* Skip printing messages outside of the log level */
-    if (level > _g_current_log_level) {
+    if (level > log_get_level()) {
         return;
     }
 
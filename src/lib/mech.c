@@ -39,7 +39,6 @@ enum mechanism_flags {
     mf_derive        = 1 << 14,
 };
 
-typedef struct mdetail_entry mdetail_entry;
 typedef struct nid_detail nid_detail;
 typedef struct rsa_detail rsa_detail;
 
@@ -71,7 +70,7 @@ typedef CK_RV (*fn_get_halg)(CK_MECHANISM_PTR mech, CK_MECHANISM_TYPE *halg);
 
 typedef CK_RV (*fn_get_digester)(mdetail *m, CK_MECHANISM_PTR mech, const EVP_MD **md);
 
-typedef CK_RV (*fn_get_tpm_opdata)(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **encdata);
+typedef CK_RV (*fn_get_tpm_opdata)(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **encdata);
 
 struct mdetail_entry {
     CK_MECHANISM_TYPE type;
@@ -92,6 +91,14 @@ struct mdetail {
     size_t mdetail_len;
     mdetail_entry *mech_entries;
 
+    /*
+     * Pointers into mech_entries sorted by mechanism type, built once in
+     * mdetail_new() so lookups on the per-operation paths are a bsearch
+     * rather than a linear walk of the table. mech_entries itself keeps
+     * template order, as that is the order reported by C_GetMechanismList.
+     */
+    mdetail_entry **mech_index;
+
     size_t rsa_detail_len;
     rsa_detail *rsa_entries;
 
@@ -216,17 +223,28 @@ const nid_detail _g_ecc_curve_nids_templ [] = {
     { .nid = NID_secp521r1,       },
 };
 
-static mdetail_entry *mlookup(mdetail *details, CK_MECHANISM_TYPE t) {
+static int mech_index_cmp(const void *a, const void *b) {
 
-    CK_ULONG i;
-    for (i=0; i < details->mdetail_len; i++) {
-        mdetail_entry *m = &details->mech_entries[i];
-        if (m->type == t) {
-            return m;
-        }
+    const mdetail_entry *x = *(const mdetail_entry * const *)a;
+    const mdetail_entry *y = *(const mdetail_entry * const *)b;
+
+    if (x->type < y->type) {
+        return -1;
     }
 
-    return NULL;
+    return x->type > y->type ? 1 : 0;
+}
+
+static mdetail_entry *mlookup(mdetail *details, CK_MECHANISM_TYPE t) {
+
+    mdetail_entry key = { .type = t };
+    const mdetail_entry *keyp = &key;
+
+    mdetail_entry **found = bsearch(&keyp, details->mech_index,
+            details->mdetail_len, sizeof(details->mech_index[0]),
+            mech_index_cmp);
+
+    return found ? *found : NULL;
 }
 
 static CK_RV mech_init(tpm_ctx *tctx, mdetail *m) {
@@ -249,15 +267,9 @@ static CK_RV mech_init(tpm_ctx *tctx, mdetail *m) {
      */
     CK_ULONG i;
     for (i=0; i < tpm_mechs_len; i++) {
-        CK_MECHANISM_TYPE t = tpm_mechs[i];
-        mdetail_entry *d = NULL;
-        CK_ULONG j;
-        for (j=0; j < m->mdetail_len; j++) {
-            d = &m->mech_entries[j];
-            if (d->type == t) {
-                d->flags |= mf_tpm_supported;
-                break;
-            }
+        mdetail_entry *d = mlookup(m, tpm_mechs[i]);
+        if (d) {
+            d->flags |= mf_tpm_supported;
         }
     }
 
@@ -311,6 +323,7 @@ void mdetail_free(mdetail **mdtl) {
 
     mdetail *m = *mdtl;
 
+    free(m->mech_index);
     free(m->mech_entries);
     free(m->nid_entries);
     free(m->rsa_entries);
@@ -367,12 +380,22 @@ CK_RV mdetail_new(tpm_ctx *ctx, mdetail **mout, pss_config_state pss_sig_state)
         return CKR_HOST_MEMORY;
     }
 
+    mdetail_entry **idx = calloc(ARRAY_LEN(_g_mechs_templ), sizeof(*idx));
+    if (!idx) {
+        LOGE("oom");
+        free(d);
+        free(n);
+        free(r);
+        return CKR_HOST_MEMORY;
+    }
+
     mdetail *m = calloc(1, sizeof(mdetail));
     if (!m) {
         LOGE("oom");
         free(d);
         free(n);
         free(r);
+        free(idx);
         return CKR_HOST_MEMORY;
     }
 
@@ -380,6 +403,13 @@ CK_RV mdetail_new(tpm_ctx *ctx, mdetail **mout, pss_config_state pss_sig_state)
     m->mdetail_len = ARRAY_LEN(_g_mechs_templ);
     m->mech_entries = d;
 
+    size_t i;
+    for (i=0; i < m->mdetail_len; i++) {
+        idx[i] = &d[i];
+    }
+    qsort(idx, m->mdetail_len, sizeof(idx[0]), mech_index_cmp);
+    m->mech_index = idx;
+
     memcpy(n, _g_ecc_curve_nids_templ, sizeof(_g_ecc_curve_nids_templ));
     m->nid_detail_len = ARRAY_LEN(_g_ecc_curve_nids_templ);
     m->nid_entries = n;
@@ -398,6 +428,7 @@ CK_RV mdetail_new(tpm_ctx *ctx, mdetail **mout, pss_config_state pss_sig_state)
     if (rv != CKR_OK) {
         LOGE("mech_init failed: 0x%lx", rv);
         free(m);
+        free(idx);
         free(d);
         free(n);
         free(r);
@@ -580,8 +611,14 @@ CK_RV rsa_pss_validator(mdetail *m, CK_MECHANISM_PTR mech, attr_list *attrs) {
     }
 
     /* Is it synthetic or native TPM supported ?*/
+    mdetail_entry *test_d = NULL;
+    CK_RV rv = mech_resolve(m, &test_type, &test_d);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
     bool is_synthetic = true;
-    CK_RV rv = mech_is_synthetic(m, &test_type, &is_synthetic);
+    rv = mech_is_synthetic(test_d, &is_synthetic);
     if (rv != CKR_OK) {
         return rv;
     }
@@ -935,8 +972,14 @@ CK_RV rsa_pss_synthesizer(mdetail *mdtl,
         CK_BYTE_PTR inbuf, CK_ULONG inlen,
         CK_BYTE_PTR outbuf, CK_ULONG_PTR outlen) {
 
+    mdetail_entry *d = NULL;
+    CK_RV rv = mech_resolve(mdtl, mech, &d);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
     const EVP_MD *md = NULL;
-    CK_RV rv = mech_get_digester(mdtl, mech, &md);
+    rv = mech_get_digester(mdtl, d, mech, &md);
     if (rv != CKR_OK) {
         LOGE("Could not get digester for mech: 0x%lx", mech->mechanism);
         return rv;
@@ -1193,9 +1236,11 @@ out:
     return rv;
 }
 
-CK_RV mech_validate(mdetail *m, CK_MECHANISM_PTR mech, attr_list *attrs) {
+CK_RV mech_resolve(mdetail *m, CK_MECHANISM_PTR mech, mdetail_entry **entry) {
 
+    check_pointer(m);
     check_pointer(mech);
+    check_pointer(entry);
 
     mdetail_entry *d = mlookup(m, mech->mechanism);
     if (!d) {
@@ -1203,6 +1248,16 @@ CK_RV mech_validate(mdetail *m, CK_MECHANISM_PTR mech, attr_list *attrs) {
         return CKR_MECHANISM_INVALID;
     }
 
+    *entry = d;
+
+    return CKR_OK;
+}
+
+CK_RV mech_validate(mdetail *m, mdetail_entry *d, CK_MECHANISM_PTR mech, attr_list *attrs) {
+
+    check_pointer(d);
+    check_pointer(mech);
+
     /* if their is no validator, don't do anything but a look up */
     if (!d->validator) {
         return CKR_OK;
@@ -1239,19 +1294,14 @@ CK_RV mech_validate(mdetail *m, CK_MECHANISM_PTR mech, attr_list *attrs) {
 }
 
 CK_RV mech_synthesize(
-        mdetail *mdtl,
+        mdetail *mdtl, mdetail_entry *d,
         CK_MECHANISM_PTR mech, attr_list *attrs,
         CK_BYTE_PTR inbuf, CK_ULONG inlen,
         CK_BYTE_PTR outbuf, CK_ULONG_PTR outlen) {
 
+    check_pointer(d);
     check_pointer(mech);
 
-    mdetail_entry *d = mlookup(mdtl, mech->mechanism);
-    if (!d) {
-        LOGE("Mechanism not supported, got: 0x%lx", mech->mechanism);
-        return CKR_MECHANISM_INVALID;
-    }
-
     /* if it's supported by the tpm we don't need to call
      * the synthesizer, just memcpy in to out.
      */
@@ -1276,19 +1326,14 @@ CK_RV mech_synthesize(
 }
 
 CK_RV mech_unsynthesize(
-        mdetail *mdtl,
+        mdetail *mdtl, mdetail_entry *d,
         CK_MECHANISM_PTR mech, attr_list *attrs,
         CK_BYTE_PTR inbuf, CK_ULONG inlen,
         CK_BYTE_PTR outbuf, CK_ULONG_PTR outlen) {
 
+    check_pointer(d);
     check_pointer(mech);
 
-    mdetail_entry *d = mlookup(mdtl, mech->mechanism);
-    if (!d) {
-        LOGE("Mechanism not supported, got: 0x%lx", mech->mechanism);
-        return CKR_MECHANISM_INVALID;
-    }
-
     /* if it's supported by the tpm we don't need to call
      * the synthesizer, just memcpy in to out.
      */
@@ -1312,19 +1357,11 @@ CK_RV mech_unsynthesize(
     return d->unsynthesizer(mdtl, mech, attrs, inbuf, inlen, outbuf, outlen);
 }
 
-CK_RV mech_is_synthetic(mdetail *m, CK_MECHANISM_PTR mech,
-        bool *is_synthetic) {
+CK_RV mech_is_synthetic(mdetail_entry *d, bool *is_synthetic) {
 
-    check_pointer(m);
-    check_pointer(mech);
+    check_pointer(d);
     check_pointer(is_synthetic);
 
-    mdetail_entry *d = mlookup(m, mech->mechanism);
-    if (!d) {
-        LOGE("Mechanism not supported, got: 0x%lx", mech->mechanism);
-        return CKR_MECHANISM_INVALID;
-    }
-
     *is_synthetic = (!(d->flags & mf_tpm_supported))
             || (d->flags & mf_is_synthetic)
             || (d->flags & mf_force_synthetic);
@@ -1332,20 +1369,14 @@ CK_RV mech_is_synthetic(mdetail *m, CK_MECHANISM_PTR mech,
     return CKR_OK;
 }
 
-CK_RV mech_is_hashing_needed(mdetail *m,
+CK_RV mech_is_hashing_needed(mdetail_entry *d,
         CK_MECHANISM_PTR mech,
         bool *is_hashing_needed) {
 
-    check_pointer(m);
+    check_pointer(d);
     check_pointer(mech);
     check_pointer(is_hashing_needed);
 
-    mdetail_entry *d = mlookup(m, mech->mechanism);
-    if (!d) {
-        LOGE("Mechanism not supported, got: 0x%lx", mech->mechanism);
-        return CKR_MECHANISM_INVALID;
-    }
-
     if (!d->get_halg) {
         *is_hashing_needed = false;
         return CKR_OK;
@@ -1362,56 +1393,35 @@ CK_RV mech_is_hashing_needed(mdetail *m,
     return CKR_OK;
 }
 
-CK_RV mech_is_HMAC(mdetail *m, CK_MECHANISM_PTR mech, bool *is_hmac) {
+CK_RV mech_is_HMAC(mdetail_entry *d, bool *is_hmac) {
 
-    check_pointer(m);
-    check_pointer(mech);
+    check_pointer(d);
     check_pointer(is_hmac);
 
-    mdetail_entry *d = mlookup(m, mech->mechanism);
-    if (!d) {
-        LOGE("Mechanism not supported, got: 0x%lx", mech->mechanism);
-        return CKR_MECHANISM_INVALID;
-    }
-
     *is_hmac = !!(d->flags & mf_hmac);
 
     return CKR_OK;
 }
 
-CK_RV mech_is_hashing_knowledge_needed(mdetail *m,
-    CK_MECHANISM_PTR mech,
+CK_RV mech_is_hashing_knowledge_needed(mdetail_entry *d,
     bool *is_hashing_knowledge_needed) {
 
-    check_pointer(m);
-    check_pointer(mech);
+    check_pointer(d);
     check_pointer(is_hashing_knowledge_needed);
 
-    mdetail_entry *d = mlookup(m, mech->mechanism);
-    if (!d) {
-        LOGE("Mechanism not supported, got: 0x%lx", mech->mechanism);
-        return CKR_MECHANISM_INVALID;
-    }
-
     *is_hashing_knowledge_needed = d->get_digester;
 
     return CKR_OK;
 }
 
-CK_RV mech_get_digest_alg(mdetail *m,
+CK_RV mech_get_digest_alg(mdetail_entry *d,
         CK_MECHANISM_PTR mech,
         CK_MECHANISM_TYPE *mech_type) {
 
-    check_pointer(m);
+    check_pointer(d);
     check_pointer(mech);
     check_pointer(mech_type);
 
-    mdetail_entry *d = mlookup(m, mech->mechanism);
-    if (!d) {
-        LOGE("Mechanism not supported, got: 0x%lx", mech->mechanism);
-        return CKR_MECHANISM_INVALID;
-    }
-
     if (!d->get_halg) {
         LOGE("Mechanism 0x%lx has no get_halg()", mech->mechanism);
         return CKR_MECHANISM_INVALID;
@@ -1421,19 +1431,14 @@ CK_RV mech_get_digest_alg(mdetail *m,
 }
 
 CK_RV mech_get_digester(
-        mdetail *mdtl,
+        mdetail *mdtl, mdetail_entry *d,
         CK_MECHANISM_PTR mech,
         const EVP_MD **md) {
 
+    check_pointer(d);
     check_pointer(mech);
     check_pointer(md);
 
-    mdetail_entry *d = mlookup(mdtl, mech->mechanism);
-    if (!d) {
-        LOGV("Mechanism not supported, got: 0x%lx", mech->mechanism);
-        return CKR_MECHANISM_INVALID;
-    }
-
     if (!d->get_digester) {
         LOGE("Mechanism 0x%lx has no get_digester()", mech->mechanism);
         return CKR_MECHANISM_INVALID;
@@ -1442,39 +1447,35 @@ CK_RV mech_get_digester(
     return d->get_digester(mdtl, mech, md);
 }
 
-CK_RV mech_get_tpm_opdata(mdetail *mdtl,
-        tpm_ctx *tctx,
+CK_RV mech_get_tpm_opdata(mdetail *mdtl, mdetail_entry *d,
+        arena *a, tpm_ctx *tctx,
         CK_MECHANISM_PTR mech,
         tobject *tobj, tpm_op_data **opdata) {
 
     check_pointer(mdtl);
+    check_pointer(d);
     check_pointer(tctx);
     check_pointer(opdata);
 
-    mdetail_entry *d = mlookup(mdtl, mech->mechanism);
-    if (!d) {
-        LOGE("Mechanism not supported, got: 0x%lx", mech->mechanism);
+    if (!d->get_tpm_opdata) {
         return CKR_MECHANISM_INVALID;
     }
 
-    if (!d->get_tpm_opdata) {
-        return CKR_MECHANISM_INVALID;
+    CK_RV rv = d->get_tpm_opdata(mdtl, a, tctx, mech, tobj, opdata);
+    if (rv != CKR_OK) {
+        return rv;
     }
 
-    return d->get_tpm_opdata(mdtl, tctx, mech, tobj, opdata);
+    tpm_opdata_set_mech_entry(*opdata, d);
+
+    return CKR_OK;
 }
 
-CK_RV mech_get_padding(mdetail *m, CK_MECHANISM_PTR mech, int *padding) {
+CK_RV mech_get_padding(mdetail_entry *d, int *padding) {
 
-    check_pointer(mech);
+    check_pointer(d);
     check_pointer(padding);
 
-    mdetail_entry *d = mlookup(m, mech->mechanism);
-    if (!d) {
-        LOGE("Mechanism not supported, got: 0x%lx", mech->mechanism);
-        return CKR_MECHANISM_INVALID;
-    }
-
     *padding = d->padding;
 
     return CKR_OK;
@@ -1585,15 +1586,9 @@ CK_RV mech_get_info(mdetail *m, tpm_ctx *tctx,
     return CKR_MECHANISM_INVALID;
 }
 
-CK_RV mech_is_ecc(mdetail *m, CK_MECHANISM_TYPE mech_type, bool *is_ecc) {
+CK_RV mech_is_ecc(mdetail_entry *d, bool *is_ecc) {
 
-    *is_ecc = false;
-
-    mdetail_entry *d = mlookup(m, mech_type);
-    if (!d) {
-        LOGE("Mechanism not supported, got: 0x%lx", mech_type);
-        return CKR_MECHANISM_INVALID;
-    }
+    check_pointer(d);
 
     *is_ecc = !!(d->flags & mf_ecc);
 
@@ -18,58 +18,89 @@ CK_RV mdetail_new(tpm_ctx *ctx, mdetail **mout, pss_config_state pss_sig_state);
 
 void mdetail_free(mdetail **mdtl);
 
-CK_RV mech_validate(mdetail *mdtl, CK_MECHANISM_PTR mech, attr_list *attrs);
-
-CK_RV mech_synthesize(mdetail *mdtl,
+/**
+ * Resolves a mechanism to its entry in the mechanism table. Operations
+ * resolve their mechanism once and hand the entry to the helpers below,
+ * rather than have each helper look it up again.
+ * @param mdtl
+ *  The mechanism details of the token.
+ * @param mech
+ *  The mechanism to resolve.
+ * @param entry
+ *  The entry, valid as long as mdtl.
+ * @return
+ *  CKR_OK on success, CKR_MECHANISM_INVALID if it isn't supported.
+ */
+CK_RV mech_resolve(mdetail *mdtl, CK_MECHANISM_PTR mech, mdetail_entry **entry);
+
+CK_RV mech_validate(mdetail *mdtl, mdetail_entry *d, CK_MECHANISM_PTR mech, attr_list *attrs);
+
+CK_RV mech_synthesize(mdetail *mdtl, mdetail_entry *d,
         CK_MECHANISM_PTR mech, attr_list *attrs,
         CK_BYTE_PTR inbuf, CK_ULONG inlen,
         CK_BYTE_PTR outbuf, CK_ULONG_PTR outlen);
 
 CK_RV mech_unsynthesize(
-        mdetail *mdtl,
+        mdetail *mdtl, mdetail_entry *d,
         CK_MECHANISM_PTR mech, attr_list *attrs,
         CK_BYTE_PTR inbuf, CK_ULONG inlen,
         CK_BYTE_PTR outbuf, CK_ULONG_PTR outlen);
 
-CK_RV mech_is_synthetic(mdetail *mdtl,
-        CK_MECHANISM_PTR mech,
+CK_RV mech_is_synthetic(mdetail_entry *d,
         bool *is_synthetic);
 
 CK_RV mech_get_supported(mdetail *mdtl,
         CK_MECHANISM_TYPE_PTR mechlist, CK_ULONG_PTR count);
 
 CK_RV mech_is_hashing_needed(
-        mdetail *mdtl,
+        mdetail_entry *d,
         CK_MECHANISM_PTR mech,
         bool *is_hashing_needed);
 
-CK_RV mech_is_hashing_knowledge_needed(mdetail *m,
-    CK_MECHANISM_PTR mech,
+CK_RV mech_is_hashing_knowledge_needed(mdetail_entry *d,
     bool *is_hashing_knowledge_needed);
 
-CK_RV mech_get_digest_alg(mdetail *mdtl,
+CK_RV mech_get_digest_alg(mdetail_entry *d,
         CK_MECHANISM_PTR mech,
         CK_MECHANISM_TYPE *mech_type);
 
-CK_RV mech_get_digester(mdetail *mdtl,
+CK_RV mech_get_digester(mdetail *mdtl, mdetail_entry *d,
         CK_MECHANISM_PTR mech,
         const EVP_MD **md);
 
-CK_RV mech_get_tpm_opdata(mdetail *mdtl, tpm_ctx *tctx,
+/**
+ * Sets up the TPM side of an operation.
+ * @param mdtl
+ *  The mechanism details of the token.
+ * @param d
+ *  The resolved mechanism, see mech_resolve().
+ * @param a
+ *  The arena of the session, may be NULL to use the heap.
+ * @param tctx
+ *  The TPM context.
+ * @param mech
+ *  The mechanism.
+ * @param tobj
+ *  The key.
+ * @param opdata
+ *  The operation data, free with tpm_opdata_free().
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV mech_get_tpm_opdata(mdetail *mdtl, mdetail_entry *d, arena *a, tpm_ctx *tctx,
         CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
 
 CK_RV mech_get_info(mdetail *mdtl, tpm_ctx *tctx,
         CK_MECHANISM_TYPE mech_type, CK_MECHANISM_INFO_PTR info);
 
-CK_RV mech_get_padding(mdetail *mdtl,
-        CK_MECHANISM_PTR mech, int *padding);
+CK_RV mech_get_padding(mdetail_entry *d, int *padding);
 
 CK_RV mech_get_label(CK_MECHANISM_PTR mech, twist *label);
 
 void mdetail_set_pss_status(mdetail *m, bool pss_sigs_good);
 
-CK_RV mech_is_HMAC(mdetail *m, CK_MECHANISM_PTR mech, bool *is_hmac);
+CK_RV mech_is_HMAC(mdetail_entry *d, bool *is_hmac);
 
-CK_RV mech_is_ecc(mdetail *m, CK_MECHANISM_TYPE mech_type, bool *is_ecc);
+CK_RV mech_is_ecc(mdetail_entry *d, bool *is_ecc);
 
 #endif /* SRC_LIB_MECH_H_ */
@@ -8,6 +8,8 @@
 #include "log.h"
 #include "mutex.h"
 #include "pkcs11.h"
+#include "stats.h"
+#include "trace.h"
 
 /*
  * Default handlers for mutex operations
@@ -159,7 +161,15 @@ CK_RV mutex_lock(void *mutex) {
         return CKR_OK;
     }
 
-    return _g_lock(mutex);
+    TRACE(lock_acquire_begin, NULL, (uintptr_t)mutex);
+    uint64_t start = stats_now();
+
+    CK_RV rv = _g_lock(mutex);
+
+    stats_lock_wait(start);
+    TRACE(lock_acquire_end, NULL, rv);
+
+    return rv;
 }
 
 CK_RV mutex_unlock(void *mutex) {
@@ -32,21 +32,88 @@ struct object_find_data {
     tobject_match_list *cur;
 };
 
+static void tobject_clear_blobs(tobject *tobj) {
+
+    if (tobj->blobs_owned) {
+        /* cleanse the ENCRYPTED objauth so it goes away */
+        if (tobj->objauth) {
+            OPENSSL_cleanse((void *)tobj->objauth, twist_len(tobj->objauth));
+            twist_free(tobj->objauth);
+        }
+
+        twist_free(tobj->priv);
+        twist_free(tobj->pub);
+    }
+
+    tobj->objauth = NULL;
+    tobj->priv = NULL;
+    tobj->pub = NULL;
+    tobj->blobs_owned = false;
+}
+
+/*
+ * Points pub, priv and objauth at the attributes. They are views into the
+ * block of compacted attributes, and copies where there are no views, as
+ * with objects being created or mapped from a snapshot.
+ */
+static CK_RV tobject_bind_blobs(tobject *tobj) {
+
+    tobject_clear_blobs(tobj);
+
+    static const CK_ATTRIBUTE_TYPE types[] = {
+        CKA_TPM2_PUB_BLOB,
+        CKA_TPM2_PRIV_BLOB,
+        CKA_TPM2_OBJAUTH_ENC,
+    };
+
+    twist *blobs[] = {
+        &tobj->pub,
+        &tobj->priv,
+        &tobj->objauth,
+    };
+
+    bool views = true;
+
+    size_t i;
+    for (i=0; i < ARRAY_LEN(types); i++) {
+        CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(tobj->attrs, types[i]);
+        if (a && a->pValue && a->ulValueLen) {
+            *blobs[i] = attr_list_get_twist(tobj->attrs, types[i]);
+            views &= !!*blobs[i];
+        }
+    }
+
+    if (views) {
+        return CKR_OK;
+    }
+
+    tobject_clear_blobs(tobj);
+    tobj->blobs_owned = true;
+
+    for (i=0; i < ARRAY_LEN(types); i++) {
+        CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(tobj->attrs, types[i]);
+        if (a && a->pValue && a->ulValueLen) {
+            *blobs[i] = twistbin_new(a->pValue, a->ulValueLen);
+            if (!*blobs[i]) {
+                LOGE("oom");
+                tobject_clear_blobs(tobj);
+                return CKR_HOST_MEMORY;
+            }
+        }
+    }
+
+    return CKR_OK;
+}
+
 void tobject_free(tobject *tobj) {
 
     if (!tobj) {
         return;
     }
 
-    /* cleanse the ENCRYPTED objauth so it goes away */
-    if (tobj->objauth) {
-        OPENSSL_cleanse((void *)tobj->objauth, twist_len(tobj->objauth));
-        twist_free(tobj->objauth);
-        tobj->objauth = NULL;
-    }
+    tobject_clear_unwrapped_value(tobj);
 
-    twist_free(tobj->priv);
-    twist_free(tobj->pub);
+    tobject_clear_blobs(tobj);
 
     /* cleanse the PLAINTEXT objauth so it goes away */
     if (tobj->unsealed_auth) {
@@ -207,7 +274,25 @@ CK_RV tobject_get_min_buf_size(tobject *tobj, CK_MECHANISM_PTR mech, size_t *max
     return CKR_GENERAL_ERROR;
 }
 
-static bool attr_filter(attr_list *attrs, CK_ATTRIBUTE_PTR templ, CK_ULONG count) {
+static bool attr_lazy_match(token *tok, tobject *tobj, CK_ATTRIBUTE_PTR search) {
+
+    twist value = NULL;
+    CK_RV rv = backend_get_tobject_attr(tok, tobj, search->type, &value);
+    if (rv != CKR_OK) {
+        LOGW("Could not fetch attribute 0x%lx of tobject %u, treating as no match",
+                search->type, tobj->id);
+        return false;
+    }
+
+    bool match = twist_len(value) == search->ulValueLen &&
+            !memcmp(value, search->pValue, search->ulValueLen);
+    twist_free(value);
+    return match;
+}
+
+static bool attr_filter(token *tok, tobject *tobj, CK_ATTRIBUTE_PTR templ, CK_ULONG count) {
+
+    attr_list *attrs = tobject_get_attrs(tobj);
 
 
     CK_ULONG i;
@@ -234,7 +319,9 @@ static bool attr_filter(attr_list *attrs, CK_ATTRIBUTE_PTR templ, CK_ULONG count
                 continue;
             }
 
-            bool match = !memcmp(compare->pValue, search->pValue, search->ulValueLen);
+            bool match = attr_is_lazy(compare) ?
+                    attr_lazy_match(tok, tobj, search) :
+                    !memcmp(compare->pValue, search->pValue, search->ulValueLen);
             if (match) {
                 is_attr_match = true;
                 break;
@@ -262,10 +349,9 @@ static bool attr_filter(attr_list *attrs, CK_ATTRIBUTE_PTR templ, CK_ULONG count
     return true;
 }
 
-tobject *object_attr_filter(tobject *tobj, CK_ATTRIBUTE_PTR templ, CK_ULONG count) {
+tobject *object_attr_filter(token *tok, tobject *tobj, CK_ATTRIBUTE_PTR templ, CK_ULONG count) {
 
-    attr_list *attrs = tobject_get_attrs(tobj);
-    bool res = attr_filter(attrs, templ, count);
+    bool res = attr_filter(tok, tobj, templ, count);
     return res ? tobj : NULL;
 }
 
@@ -348,7 +434,7 @@ CK_RV object_find_init(session_ctx *ctx, CK_ATTRIBUTE_PTR templ, CK_ULONG count)
         tobject *tobj = list_entry(cur, tobject, l);
         cur = cur->next;
 
-        tobject *match = object_attr_filter(tobj, templ, count);
+        tobject *match = object_attr_filter(tok, tobj, templ, count);
         if (!match) {
             continue;
         }
@@ -453,68 +539,107 @@ CK_RV object_find_final(session_ctx *ctx) {
     return CKR_OK;
 }
 
+void tobject_clear_unwrapped_value(tobject *tobj) {
+
+    if (tobj->unwrapped_value) {
+        OPENSSL_cleanse((void *)tobj->unwrapped_value, twist_len(tobj->unwrapped_value));
+        twist_free(tobj->unwrapped_value);
+        tobj->unwrapped_value = NULL;
+    }
+}
+
+static void tobject_set_unwrapped_value(tobject *tobj, twist plaintext) {
+
+    tobject_clear_unwrapped_value(tobj);
+    tobj->unwrapped_value = plaintext;
+}
+
 /**
- * given an attribute list with CKA_TPM2_ENC_BLOB, will unwrap it with the token wrapping
- * key and store it in CKA_VALUE.
+ * Gets the plaintext CKA_VALUE of a private object. The first call after
+ * login unwraps CKA_TPM2_ENC_BLOB with the token wrapping key, later
+ * calls are served from the tobject until logout.
  * @param tok
  *  The token
- * @param attrs
- *  The attribute list to modify.
+ * @param tobj
+ *  The object.
+ * @param value
+ *  The plaintext value, owned by the tobject. NULL if the object has no
+ *  encrypted blob.
  * @return
  *  CKR_OK on success.
  */
-static CK_RV unwrap_protected_cka_value(token *tok, attr_list *attrs) {
-    /* Caller wants CKA_VALUE in their template and it's not found, we need to fetch it, do we have
-     * the wrapped value in the DB? */
+static CK_RV tobject_get_unwrapped_value(token *tok, tobject *tobj, twist *value) {
     assert(tok->wrappingkey);
 
-    CK_ATTRIBUTE_PTR ciphertext_attr = attr_get_attribute_by_type(attrs, CKA_TPM2_ENC_BLOB);
-    if (ciphertext_attr) {
+    if (tobj->unwrapped_value) {
+        *value = tobj->unwrapped_value;
+        return CKR_OK;
+    }
 
-        twist plaintext = NULL;
-        size_t len = 0;
-        if (ciphertext_attr->ulValueLen) {
-            twist ciphertext = twistbin_new(ciphertext_attr->pValue, ciphertext_attr->ulValueLen);
-            if (!ciphertext) {
-                LOGE("oom");
-                return CKR_HOST_MEMORY;
-            }
+    *value = NULL;
 
-            CK_RV rv = utils_ctx_unwrap_objauth(tok->wrappingkey, ciphertext, &plaintext);
-            twist_free(ciphertext);
-            if (rv != CKR_OK) {
-                LOGE("Could not unwrap CKA_VALUE");
-                return rv;
-            }
+    CK_ATTRIBUTE_PTR ciphertext_attr = attr_get_attribute_by_type(tobj->attrs, CKA_TPM2_ENC_BLOB);
+    if (!ciphertext_attr) {
+        // TODO: Fetch from TPM to support more object types?
+        LOGW("Needed CKA_VALUE but didn't find encrypted blob");
+        return CKR_OK;
+    }
 
-            len = twist_len(plaintext);
+    twist plaintext = NULL;
+    if (ciphertext_attr->ulValueLen) {
+        twist ciphertext = twistbin_new(ciphertext_attr->pValue, ciphertext_attr->ulValueLen);
+        if (!ciphertext) {
+            LOGE("oom");
+            return CKR_HOST_MEMORY;
         }
 
-        CK_ATTRIBUTE temp = {
-            .type = CKA_VALUE,
-            .pValue = (void *)plaintext,
-            .ulValueLen = len
-        };
-
-        /*
-         * Add the unwrapped value back to CKA_VALUE
-         *  - Append if not in the list
-         *  - Update if it's in the list
-         */
-        CK_ATTRIBUTE_PTR found = attr_get_attribute_by_type(attrs, CKA_TPM2_ENC_BLOB);
-        CK_RV rv = found ?
-                attr_list_update_entry(attrs, &temp) : attr_list_append_entry(&attrs, &temp);
-        twist_free(plaintext);
+        CK_RV rv = utils_ctx_unwrap_objauth(tok->wrappingkey, ciphertext, &plaintext);
+        twist_free(ciphertext);
         if (rv != CKR_OK) {
+            LOGE("Could not unwrap CKA_VALUE");
             return rv;
         }
-
     } else {
-        // TODO: Fetch from TPM to support more object types?
-        // TODO: set CKA_VALUE to 0?
-        LOGW("Needed CKA_VALUE but didn't find encrypted blob");
+        plaintext = twist_new("");
+        if (!plaintext) {
+            LOGE("oom");
+            return CKR_HOST_MEMORY;
+        }
     }
 
+    tobject_set_unwrapped_value(tobj, plaintext);
+    *value = plaintext;
+
+    return CKR_OK;
+}
+
+/**
+ * Moves the plaintext CKA_VALUE out of an attribute list so it is never
+ * written to the store, leaving an empty CKA_VALUE behind.
+ * @param attrs
+ *  The attribute list to modify.
+ * @param plaintext
+ *  The plaintext value, empty if CKA_VALUE is empty or missing.
+ * @return
+ *  CKR_OK on success.
+ */
+static CK_RV take_private_cka_value(attr_list *attrs, twist *plaintext) {
+
+    CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(attrs, CKA_VALUE);
+
+    twist t = a && a->ulValueLen ?
+            twistbin_new(a->pValue, a->ulValueLen) : twist_new("");
+    if (!t) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    if (a) {
+        attr_list_cleanse_entry(attrs, a);
+    }
+
+    *plaintext = t;
+
     return CKR_OK;
 }
 
@@ -613,10 +738,24 @@ CK_RV object_get_attributes(session_ctx *ctx, CK_OBJECT_HANDLE object, CK_ATTRIB
         CK_ATTRIBUTE_PTR t = &templ[i];
 
         CK_ATTRIBUTE_PTR found = attr_get_attribute_by_type(tobj->attrs, t->type);
-        if (cka_private && t->type == CKA_VALUE && is_user_logged_in &&
-                (!found || !found->ulValueLen)) {
-            rv = unwrap_protected_cka_value(tok, tobj->attrs);
-            /* continue on processing */
+
+        /* private values are never kept in the attributes, see take_private_cka_value() */
+        CK_ATTRIBUTE unwrapped = { 0 };
+        if (cka_private && t->type == CKA_VALUE && is_user_logged_in) {
+            twist value = NULL;
+            CK_RV tmp_rv = tobject_get_unwrapped_value(tok, tobj, &value);
+            if (tmp_rv != CKR_OK) {
+                t->ulValueLen = CK_UNAVAILABLE_INFORMATION;
+                rv = tmp_rv;
+                continue;
+            }
+
+            if (value) {
+                unwrapped.type = CKA_VALUE;
+                unwrapped.pValue = (void *)value;
+                unwrapped.ulValueLen = twist_len(value);
+                found = &unwrapped;
+            }
         }
 
         if (found) {
@@ -626,6 +765,40 @@ CK_RV object_get_attributes(session_ctx *ctx, CK_OBJECT_HANDLE object, CK_ATTRIB
                 continue;
             }
 
+            if (attr_is_lazy(found)) {
+                twist value = NULL;
+                CK_RV tmp_rv = backend_get_tobject_attr(tok, tobj, t->type, &value);
+                if (tmp_rv != CKR_OK) {
+                    t->ulValueLen = CK_UNAVAILABLE_INFORMATION;
+                    rv = tmp_rv;
+                    continue;
+                }
+
+                /*
+                 * The store is the authority on the value, another process may
+                 * have changed it since the object was loaded, so size it by
+                 * what came back and keep the length we report in step.
+                 */
+                size_t len = twist_len(value);
+                if (len != found->ulValueLen) {
+                    LOGW("Attribute 0x%lx of tobject %u is %zu bytes in the store, expected %lu",
+                            t->type, tobj->id, len, found->ulValueLen);
+                    found->ulValueLen = len;
+                }
+
+                if (len > t->ulValueLen) {
+                    twist_free(value);
+                    t->ulValueLen = CK_UNAVAILABLE_INFORMATION;
+                    rv = CKR_BUFFER_TOO_SMALL;
+                    continue;
+                }
+
+                t->ulValueLen = len;
+                memcpy(t->pValue, value, len);
+                twist_free(value);
+                continue;
+            }
+
             /* The found attribute should fit inside the one to copy to */
             if (found->ulValueLen > t->ulValueLen) {
                 t->ulValueLen = CK_UNAVAILABLE_INFORMATION;
@@ -657,6 +830,11 @@ CK_RV object_set_attributes(session_ctx *ctx, CK_OBJECT_HANDLE object, CK_ATTRIB
     token *tok = session_ctx_get_token(ctx);
     assert(tok);
 
+    if (backend_is_readonly(tok)) {
+        LOGE("Cannot change objects in a read only store");
+        return CKR_TOKEN_WRITE_PROTECTED;
+    }
+
     tobject *tobj = NULL;
     CK_RV rv = token_find_tobject(tok, object, &tobj);
     if (rv != CKR_OK) {
@@ -700,32 +878,43 @@ CK_RV object_set_attributes(session_ctx *ctx, CK_OBJECT_HANDLE object, CK_ATTRIB
 
         CK_ATTRIBUTE_PTR t = &templ[i];
 
-        /* CKA_VALUE fields are encrypted for CKO_DATA objects */
-        if (t->type == CKA_VALUE && clazz == CKO_DATA && cka_private) {
+        CK_ATTRIBUTE_PTR found = attr_get_attribute_by_type(tmp, t->type);
+        rv = found ? attr_list_update_entry(tmp, t) :
+            attr_list_append_entry(&tmp, t);
+        if (rv != CKR_OK) {
+            goto error;
+        }
+    }
+
+    /* We don't want to emit CKA_VALUE for CKA_PRIVATE objects to the backend store */
+    twist plaintext = NULL;
+    bool is_value_set = cka_private &&
+            attr_get_attribute_by_type_raw(templ, count, CKA_VALUE);
+    if (is_value_set) {
+
+        /* CKA_VALUE fields are encrypted for CKO_DATA objects, skip it if nothing changed */
+        twist current = tobj->unwrapped_value;
+        CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(tmp, CKA_VALUE);
+        bool is_unchanged = current && a &&
+                twist_len(current) == a->ulValueLen &&
+                (!a->ulValueLen || !memcmp(current, a->pValue, a->ulValueLen));
+        if (clazz == CKO_DATA && !is_unchanged) {
             rv = wrap_protected_cka_value(tok, tmp);
             if (rv != CKR_OK) {
                 goto error;
             }
         }
 
-        CK_ATTRIBUTE_PTR found = attr_get_attribute_by_type(tmp, t->type);
-        rv = found ? attr_list_update_entry(tmp, t) :
-            attr_list_append_entry(&tmp, t);
+        rv = take_private_cka_value(tmp, &plaintext);
         if (rv != CKR_OK) {
             goto error;
         }
     }
 
-    /* We don't want to emit CKA_VALUE for CKA_PRIVATE objects to the backend store */
-    bool is_backed_up = false;
-    CK_ATTRIBUTE backup = { 0 };
-    CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(tmp, CKA_VALUE);
-    if (cka_private && a && a->ulValueLen) {
-        backup.pValue = a->pValue;
-        backup.ulValueLen = a->ulValueLen;
-        a->pValue = NULL;
-        a->ulValueLen = 0;
-        is_backed_up = true;
+    /* the object is long lived, keep it packed, see object_init_from_attrs() */
+    if (!attr_list_compact(tmp)) {
+        rv = CKR_HOST_MEMORY;
+        goto error;
     }
 
     /* in memory is updated, so update the persistent store */
@@ -734,19 +923,20 @@ CK_RV object_set_attributes(session_ctx *ctx, CK_OBJECT_HANDLE object, CK_ATTRIB
         goto error;
     }
 
-    if (is_backed_up) {
-        a->pValue = backup.pValue;
-        a->ulValueLen = backup.ulValueLen;
+    if (is_value_set) {
+        tobject_set_unwrapped_value(tobj, plaintext);
+        plaintext = NULL;
     }
 
     /*
      * everything completed successfully, swap the
      * attribute pointers.
      */
-    attr_list_free(tobj->attrs);
+    attr_list *old = tobj->attrs;
     tobj->attrs = tmp;
 
-    rv = CKR_OK;
+    rv = tobject_bind_blobs(tobj);
+    attr_list_free(old);
 
 out:
     tobject_user_decrement(tobj);
@@ -754,6 +944,10 @@ out:
     return rv;
 
 error:
+    if (plaintext) {
+        OPENSSL_cleanse((void *)plaintext, twist_len(plaintext));
+        twist_free(plaintext);
+    }
     attr_list_free(tmp);
     goto out;
 }
@@ -777,19 +971,6 @@ CK_RV tobject_set_blob_data(tobject *tobj, twist pub, twist priv) {
     assert(pub);
     assert(tobj);
 
-    tobj->priv = twist_dup(priv);
-    if (priv && !tobj->priv) {
-        LOGE("oom");
-        return CKR_HOST_MEMORY;
-    }
-
-    tobj->pub = twist_dup(pub);
-    if (!tobj->pub) {
-        twist_free(tobj->priv);
-        LOGE("oom");
-        return CKR_HOST_MEMORY;
-    }
-
     if (priv) {
         bool r = attr_list_add_buf(tobj->attrs, CKA_TPM2_PRIV_BLOB,
                 (CK_BYTE_PTR)priv, twist_len(priv));
@@ -800,8 +981,11 @@ CK_RV tobject_set_blob_data(tobject *tobj, twist pub, twist priv) {
 
     bool r = attr_list_add_buf(tobj->attrs, CKA_TPM2_PUB_BLOB,
             (CK_BYTE_PTR)pub, pub ? twist_len(pub) : 0);
+    if (!r) {
+        return CKR_GENERAL_ERROR;
+    }
 
-    return r ? CKR_OK : CKR_GENERAL_ERROR;
+    return tobject_bind_blobs(tobj);
 }
 
 CK_RV tobject_set_auth(tobject *tobj, twist authbin, twist wrappedauthhex) {
@@ -815,16 +999,15 @@ CK_RV tobject_set_auth(tobject *tobj, twist authbin, twist wrappedauthhex) {
         return CKR_HOST_MEMORY;
     }
 
-    tobj->objauth = twist_dup(wrappedauthhex);
-    if (!tobj->objauth) {
-        LOGE("oom");
+    bool r = attr_list_add_buf(tobj->attrs, CKA_TPM2_OBJAUTH_ENC,
+            (CK_BYTE_PTR)wrappedauthhex, twist_len(wrappedauthhex));
+    if (!r) {
         twist_free(tobj->unsealed_auth);
-        return CKR_HOST_MEMORY;
+        tobj->unsealed_auth = NULL;
+        return CKR_GENERAL_ERROR;
     }
 
-    bool r = attr_list_add_buf(tobj->attrs, CKA_TPM2_OBJAUTH_ENC,
-            (CK_BYTE_PTR)wrappedauthhex, twist_len(wrappedauthhex));
-    return r ? CKR_OK : CKR_GENERAL_ERROR;
+    return tobject_bind_blobs(tobj);
 }
 
 void tobject_set_esys_tr(tobject *tobj, uint32_t esys_tr) {
@@ -885,6 +1068,11 @@ CK_RV object_destroy(session_ctx *ctx, CK_OBJECT_HANDLE object) {
     token *tok = session_ctx_get_token(ctx);
     assert(tok);
 
+    if (backend_is_readonly(tok)) {
+        LOGE("Cannot destroy objects in a read only store");
+        return CKR_TOKEN_WRITE_PROTECTED;
+    }
+
     tobject *tobj = NULL;
     CK_RV rv = token_find_tobject(tok, object, &tobj);
     if (rv != CKR_OK) {
@@ -1139,6 +1327,14 @@ CK_RV object_create(session_ctx *ctx, CK_ATTRIBUTE *templ, CK_ULONG count, CK_OB
         return CKR_SESSION_READ_ONLY;
     }
 
+    token *tok = session_ctx_get_token(ctx);
+    assert(tok);
+
+    if (backend_is_readonly(tok)) {
+        LOGE("Cannot create objects in a read only store");
+        return CKR_TOKEN_WRITE_PROTECTED;
+    }
+
     /*
      * If CKA_LOCAL is specified, it can never be CK_TRUE
      * TODO: At somepoint these attr_get_attribute_by_type_raw() calls
@@ -1189,8 +1385,6 @@ CK_RV object_create(session_ctx *ctx, CK_ATTRIBUTE *templ, CK_ULONG count, CK_OB
         }
     }
 
-    token *tok = session_ctx_get_token(ctx);
-    assert(tok);
     attr_list *new_attrs = NULL;
 
     if (key_type == CKK_RSA && clazz == CKO_PUBLIC_KEY) {
@@ -1226,18 +1420,17 @@ CK_RV object_create(session_ctx *ctx, CK_ATTRIBUTE *templ, CK_ULONG count, CK_OB
     new_tobj->attrs = new_attrs;
     new_attrs = NULL;
 
-    bool is_backed_up = false;
-    CK_ATTRIBUTE backup = { 0 };
-
-    /* if it's a private object we can't expose the CKA_VALUE attribute */
+    /*
+     * if it's a private object we can't expose the CKA_VALUE attribute,
+     * the plaintext is kept with the object until logout.
+     */
     CK_BBOOL cka_private = attr_list_get_CKA_PRIVATE(new_tobj->attrs, CK_FALSE);
     a = attr_get_attribute_by_type(new_tobj->attrs, CKA_VALUE);
-    if (cka_private && a && a->ulValueLen) {
-        backup.ulValueLen = a->ulValueLen;
-        backup.pValue = a->pValue;
-        a->ulValueLen = 0;
-        a->pValue = NULL;
-        is_backed_up = true;
+    if (cka_private && a) {
+        rv = take_private_cka_value(new_tobj->attrs, &new_tobj->unwrapped_value);
+        if (rv != CKR_OK) {
+            goto out;
+        }
     }
 
     /* add the object to the db */
@@ -1246,11 +1439,6 @@ CK_RV object_create(session_ctx *ctx, CK_ATTRIBUTE *templ, CK_ULONG count, CK_OB
         goto out;
     }
 
-    if (is_backed_up) {
-        a->ulValueLen = backup.ulValueLen;
-        a->pValue = backup.pValue;
-    }
-
     /* add the object to the token */
     rv = token_add_tobject(tok, new_tobj);
     if (rv != CKR_OK) {
@@ -1271,38 +1459,14 @@ out:
 }
 
 CK_RV object_init_from_attrs(tobject *tobj) {
-    CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(tobj->attrs, CKA_TPM2_OBJAUTH_ENC);
-    if (a && a->pValue && a->ulValueLen) {
-        tobj->objauth = twistbin_new(a->pValue, a->ulValueLen);
-        if (!tobj->objauth) {
-            LOGE("oom");
-            goto error;
-        }
-    }
-
-    a = attr_get_attribute_by_type(tobj->attrs, CKA_TPM2_PUB_BLOB);
-    if (a && a->pValue && a->ulValueLen) {
-
-        tobj->pub = twistbin_new(a->pValue, a->ulValueLen);
-        if (!tobj->pub) {
-            LOGE("oom");
-            goto error;
-        }
-    }
 
-    a = attr_get_attribute_by_type(tobj->attrs, CKA_TPM2_PRIV_BLOB);
+    CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(tobj->attrs, CKA_TPM2_PRIV_BLOB);
     if (a && a->pValue && a->ulValueLen) {
-
-        if (!tobj->pub) {
+        a = attr_get_attribute_by_type(tobj->attrs, CKA_TPM2_PUB_BLOB);
+        if (!a || !a->pValue || !a->ulValueLen) {
             LOGE("objects with CKA_TPM2_PUB_BLOB should have CKA_TPM2_PRIV_BLOB");
             goto error;
         }
-
-        tobj->priv = twistbin_new(a->pValue, a->ulValueLen);
-        if (!tobj->priv) {
-            LOGE("oom");
-            goto error;
-        }
     }
 
     a = attr_get_attribute_by_type(tobj->attrs, CKA_TPM2_PERSISTENT_HANDLE);
@@ -1315,7 +1479,16 @@ CK_RV object_init_from_attrs(tobject *tobj) {
         tobj->tpm_persistent_handle = (uint32_t)handle;
     }
 
-    return CKR_OK;
+    /*
+     * Objects loaded from the store are mostly read from here on, so
+     * pack their values into a single allocation to keep large stores
+     * compact. The TPM blobs and wrapped auth are views into it.
+     */
+    if (!attr_list_compact(tobj->attrs)) {
+        return CKR_HOST_MEMORY;
+    }
+
+    return tobject_bind_blobs(tobj);
 
 error:
     return CKR_GENERAL_ERROR;
@@ -25,12 +25,14 @@ struct tobject {
     CK_OBJECT_HANDLE obj_handle; /** application visible handle */
 
     /*
-     * these all exist in the attribute array, but we'll keep some
-     * twist copies of them handy for convenience.
+     * these all exist in the attribute array, kept as twists for the TPM
+     * calls. They are views into the compacted attributes, see
+     * attr_list_get_twist(), or copies when blobs_owned is set.
      */
     twist pub;           /** public tpm data */
     twist priv;          /** private tpm data */
     twist objauth;       /** wrapped object auth value */
+    bool blobs_owned;    /** pub, priv and objauth are copies to free */
 
     attr_list *attrs;    /** object attributes */
 
@@ -38,6 +40,8 @@ struct tobject {
 
     twist unsealed_auth; /** unwrapped auth value */
 
+    twist unwrapped_value; /** plaintext CKA_VALUE of a private object, login scoped */
+
     uint32_t tpm_esys_tr;           /** loaded tpm handle */
     uint32_t tpm_persistent_handle; /** persistent TPM handle **/
 
@@ -47,7 +51,7 @@ struct tobject {
 tobject *tobject_new(void);
 
 /**
- * Sets the internal private and public TPM data blob fields via deep copy.
+ * Sets the private and public TPM data blob attributes via deep copy.
  * Thus the caller is still responsible to free the priv and pub parameters.
  * @param tobj
  *  The tobject to set.
@@ -79,6 +83,14 @@ void tobject_set_persistent_handle(tobject *tobj, uint32_t handle);
 void tobject_set_id(tobject *tobj, unsigned id);
 void tobject_free(tobject *tobj);
 
+/**
+ * Cleanses and drops the plaintext CKA_VALUE held for a private object.
+ * Must be called for every object on logout.
+ * @param tobj
+ *  The tobject to clear.
+ */
+void tobject_clear_unwrapped_value(tobject *tobj);
+
 CK_RV object_find_init(session_ctx *ctx, CK_ATTRIBUTE_PTR templ, unsigned long count);
 
 CK_RV object_find(session_ctx *ctx, CK_OBJECT_HANDLE *object, unsigned long max_object_count, unsigned long *object_count);
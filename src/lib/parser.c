@@ -22,6 +22,7 @@ struct handler_state {
     CK_ATTRIBUTE_TYPE key;
     size_t seqbytes;
     void *seqbuf;
+    bool lazy;
 };
 
 typedef bool (*handler)(yaml_event_t *e, handler_state *state, attr_list *l);
@@ -34,6 +35,9 @@ struct handler_stack {
 
     handler_state state[MAX_DEPTH];
     handler_state *s;
+
+    /* leave large values in the store, see attr_is_lazy_candidate() */
+    bool lazy;
 };
 
 bool push_handler(handler_stack *state, handler h) {
@@ -45,6 +49,7 @@ bool push_handler(handler_stack *state, handler h) {
     state->cur = h;
     state->h[state->depth] = h;
     state->s = &state->state[state->depth];
+    state->s->lazy = state->lazy;
     state->depth++;
 
     return true;
@@ -185,6 +190,16 @@ bool on_map_scalar_event(yaml_event_t *e, handler_state *state, attr_list *l) {
         } else if (is_yaml_bool(e->data.scalar.tag)) {
             pfn = yaml_convert_bbool;
         } else if (is_yaml_str(e->data.scalar.tag)) {
+            /* the value is hex, so it is twice the size of the binary */
+            size_t hexlen = strlen((const char *)e->data.scalar.value);
+            if (state->lazy && !(hexlen & 1)
+                    && attr_is_lazy_candidate(state->key, hexlen / 2)) {
+                if (!attr_list_add_lazy(l, state->key, hexlen / 2)) {
+                    return false;
+                }
+                state->is_value = !state->is_value;
+                return true;
+            }
             pfn = yaml_convert_hex_str;
         } else {
             LOGE("unknown data type: %s", e->data.scalar.tag);
@@ -294,7 +309,7 @@ bool handle_attr_event(yaml_event_t *event,
 
 #define ALLOC_SIZE 16
 
-bool parse_attributes(yaml_parser_t *parser, attr_list **attrs) {
+static bool parse_attributes(yaml_parser_t *parser, bool lazy, attr_list **attrs) {
 
     bool res = false;
 
@@ -305,7 +320,7 @@ bool parse_attributes(yaml_parser_t *parser, attr_list **attrs) {
     }
 
     yaml_event_t event;
-    handler_stack state = { 0 };
+    handler_stack state = { .lazy = lazy };
     /* while events */
     do {
 
@@ -348,8 +363,8 @@ error:
     return res;
 }
 
-bool parse_attributes_from_string(const unsigned char *yaml, size_t size,
-        attr_list **attrs) {
+static bool _parse_attributes_from_string(const unsigned char *yaml, size_t size,
+        bool lazy, attr_list **attrs) {
 
     yaml_parser_t parser;
 
@@ -360,7 +375,7 @@ bool parse_attributes_from_string(const unsigned char *yaml, size_t size,
 
     yaml_parser_set_input_string(&parser, yaml, size);
 
-    bool ret = parse_attributes(&parser, attrs);
+    bool ret = parse_attributes(&parser, lazy, attrs);
     yaml_parser_delete(&parser);
     if (!ret) {
         attr_list_free(*attrs);
@@ -370,6 +385,18 @@ bool parse_attributes_from_string(const unsigned char *yaml, size_t size,
     return ret;
 }
 
+bool parse_attributes_from_string(const unsigned char *yaml, size_t size,
+        attr_list **attrs) {
+
+    return _parse_attributes_from_string(yaml, size, false, attrs);
+}
+
+bool parse_attributes_from_string_lazy(const unsigned char *yaml, size_t size,
+        attr_list **attrs) {
+
+    return _parse_attributes_from_string(yaml, size, true, attrs);
+}
+
 typedef struct config_state config_state;
 struct config_state {
     bool map_start;
@@ -12,6 +12,14 @@
 WEAK bool parse_attributes_from_string(const unsigned char *yaml, size_t size,
         attr_list **attrs);
 
+/**
+ * Like parse_attributes_from_string(), but large values that are rarely
+ * read are not decoded, they are added with attr_list_add_lazy() and
+ * must be fetched from the store when needed.
+ */
+bool parse_attributes_from_string_lazy(const unsigned char *yaml, size_t size,
+        attr_list **attrs);
+
 bool parse_token_config_from_string(const unsigned char *yaml, size_t size,
         token_config *config);
 
@@ -0,0 +1,268 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include "config.h"
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "profile.h"
+
+/*
+ * Every run of a phase for a token at a nesting depth is added into one
+ * record, records keep the order phases first started in so the report
+ * reads as a call tree.
+ */
+typedef struct profile_record profile_record;
+struct profile_record {
+    profile_phase phase;
+    unsigned token;
+    unsigned depth;
+    unsigned runs;
+    uint64_t ns;
+    uint64_t tpm_cmds;
+    uint64_t tpm_ns;
+    uint64_t rows;
+};
+
+bool _g_profile_enabled;
+
+static char *_g_report_path;
+static uint64_t _g_start_ns;
+static profile_record *_g_records;
+static size_t _g_records_len;
+static size_t _g_records_cap;
+
+/*
+ * C_Initialize runs on one thread, but keep the counters per thread so
+ * a TPM command on another thread is never counted against a phase.
+ */
+static __thread uint64_t _tl_tpm_start;
+static __thread uint64_t _tl_tpm_cmds;
+static __thread uint64_t _tl_tpm_ns;
+static __thread uint64_t _tl_rows;
+static __thread unsigned _tl_token;
+static __thread unsigned _tl_depth;
+
+static const char *_g_phase_names[] = {
+#define X(name) #name,
+    PROFILE_PHASES(X)
+#undef X
+};
+
+static uint64_t clock_ns(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void reset(void) {
+
+    free(_g_records);
+    _g_records = NULL;
+    _g_records_len = _g_records_cap = 0;
+
+    _tl_tpm_start = _tl_tpm_cmds = _tl_tpm_ns = _tl_rows = 0;
+    _tl_token = _tl_depth = 0;
+}
+
+void profile_init(void) {
+
+    if (profile_enabled()) {
+        return;
+    }
+
+    const char *path = getenv(PROFILE_ENV_VAR);
+    if (!path || !path[0]) {
+        return;
+    }
+
+    _g_report_path = strdup(path);
+    if (!_g_report_path) {
+        LOGE("oom");
+        return;
+    }
+
+    reset();
+    _g_start_ns = clock_ns();
+    _g_profile_enabled = true;
+}
+
+static void report_to_destination(unsigned long rv) {
+
+    bool is_stderr = !strcmp(_g_report_path, "stderr");
+    FILE *f = is_stderr ? stderr : fopen(_g_report_path, "a");
+    if (!f) {
+        LOGW("Could not open startup profile \"%s\"", _g_report_path);
+        return;
+    }
+
+    fprintf(f, "C_Initialize startup profile (rv=0x%lx)\n", rv);
+    profile_report(f);
+
+    if (!is_stderr) {
+        fclose(f);
+    }
+}
+
+void profile_finalize(unsigned long rv) {
+
+    if (!profile_enabled()) {
+        return;
+    }
+
+    report_to_destination(rv);
+
+    _g_profile_enabled = false;
+
+    reset();
+    free(_g_report_path);
+    _g_report_path = NULL;
+}
+
+static profile_record *find_record(profile_phase phase, unsigned token,
+        unsigned depth) {
+
+    size_t i;
+    for (i=0; i < _g_records_len; i++) {
+        profile_record *r = &_g_records[i];
+        if (r->phase == phase && r->token == token && r->depth == depth) {
+            return r;
+        }
+    }
+
+    if (_g_records_len == _g_records_cap) {
+        size_t cap = _g_records_cap ? _g_records_cap * 2 : 32;
+        profile_record *records = realloc(_g_records, cap * sizeof(*records));
+        if (!records) {
+            LOGE("oom");
+            return NULL;
+        }
+        _g_records = records;
+        _g_records_cap = cap;
+    }
+
+    profile_record *r = &_g_records[_g_records_len++];
+    memset(r, 0, sizeof(*r));
+    r->phase = phase;
+    r->token = token;
+    r->depth = depth;
+
+    return r;
+}
+
+profile_span profile_begin(profile_phase phase, unsigned token) {
+
+    profile_span span = { 0 };
+
+    if (!profile_enabled()) {
+        return span;
+    }
+
+    span.parent_token = _tl_token;
+    span.token = token != PROFILE_TOKEN_INHERIT ? token : _tl_token;
+
+    /* the record is made now so parents are listed before their children */
+    profile_record *r = find_record(phase, span.token, _tl_depth);
+    if (!r) {
+        return span;
+    }
+
+    span.active = true;
+    span.record = r - _g_records;
+    span.tpm_cmds = _tl_tpm_cmds;
+    span.tpm_ns = _tl_tpm_ns;
+    span.rows = _tl_rows;
+
+    _tl_token = span.token;
+    _tl_depth++;
+
+    /* last, so the bookkeeping above isn't timed */
+    span.start_ns = clock_ns();
+
+    return span;
+}
+
+void profile_end(profile_span *span) {
+
+    if (!span->active) {
+        return;
+    }
+
+    span->active = false;
+
+    uint64_t ns = clock_ns() - span->start_ns;
+
+    _tl_depth--;
+    _tl_token = span->parent_token;
+
+    /* profiling stopped while the phase ran */
+    if (!profile_enabled()) {
+        return;
+    }
+
+    profile_record *r = &_g_records[span->record];
+    r->runs++;
+    r->ns += ns;
+    r->tpm_cmds += _tl_tpm_cmds - span->tpm_cmds;
+    r->tpm_ns += _tl_tpm_ns - span->tpm_ns;
+    r->rows += _tl_rows - span->rows;
+}
+
+void _profile_tpm_begin(void) {
+    _tl_tpm_start = clock_ns();
+}
+
+void _profile_tpm_end(void) {
+
+    if (!_tl_tpm_start) {
+        return;
+    }
+
+    _tl_tpm_cmds++;
+    _tl_tpm_ns += clock_ns() - _tl_tpm_start;
+    _tl_tpm_start = 0;
+}
+
+void _profile_db_row(void) {
+    _tl_rows++;
+}
+
+static void print_ms(FILE *f, uint64_t ns) {
+    fprintf(f, " %10"PRIu64".%03"PRIu64, ns / 1000000, ns / 1000 % 1000);
+}
+
+void profile_report(FILE *f) {
+
+    fprintf(f, "%-32s %6s %5s %14s %9s %14s %9s\n",
+            "phase", "token", "runs", "ms", "tpm cmds", "tpm ms", "rows");
+
+    size_t i;
+    for (i=0; i < _g_records_len; i++) {
+        const profile_record *r = &_g_records[i];
+
+        int indent = 2 * r->depth;
+        fprintf(f, "%*s%-*s", indent, "", 32 - indent,
+                _g_phase_names[r->phase]);
+
+        if (r->token) {
+            fprintf(f, " %6u", r->token);
+        } else {
+            fprintf(f, " %6s", "-");
+        }
+
+        fprintf(f, " %5u", r->runs);
+        print_ms(f, r->ns);
+        fprintf(f, " %9"PRIu64, r->tpm_cmds);
+        print_ms(f, r->tpm_ns);
+        fprintf(f, " %9"PRIu64"\n", r->rows);
+    }
+
+    fprintf(f, "%-32s %6s %5s", "total", "-", "-");
+    print_ms(f, clock_ns() - _g_start_ns);
+    fprintf(f, " %9"PRIu64, _tl_tpm_cmds);
+    print_ms(f, _tl_tpm_ns);
+    fprintf(f, " %9"PRIu64"\n", _tl_rows);
+}
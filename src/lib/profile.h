@@ -0,0 +1,146 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef SRC_LIB_PROFILE_H_
+#define SRC_LIB_PROFILE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * TPM2_PKCS11_PROFILE_INIT enables the startup profiler and names where
+ * the C_Initialize breakdown is written, either a file path or "stderr".
+ */
+#define PROFILE_ENV_VAR "TPM2_PKCS11_PROFILE_INIT"
+
+/*
+ * The phases of C_Initialize. A phase may run inside another, and per
+ * token phases run many times, the report adds up every run of a phase
+ * for a token.
+ */
+#define PROFILE_PHASES(X) \
+    X(backend_init) \
+    X(slot_init) \
+    X(fapi_init) \
+    X(esysdb_init) \
+    X(db_new) \
+    X(db_setup) \
+    X(db_get_tokens) \
+    X(token_min_init) \
+    X(backend_ctx_new) \
+    X(mdetail_new) \
+    X(init_pobject) \
+    X(init_sealobjects) \
+    X(init_tobjects) \
+    X(snapshot_open) \
+    X(snapshot_load) \
+    X(yaml_parse) \
+    X(fapi_add_tokens) \
+    X(fapi_index) \
+    X(fapi_list) \
+    X(fapi_get_key) \
+    X(fapi_get_appdata)
+
+typedef enum profile_phase profile_phase;
+enum profile_phase {
+#define X(name) profile_phase_##name,
+    PROFILE_PHASES(X)
+#undef X
+    profile_phase_max
+};
+
+/*
+ * Passed as the token id of a phase that belongs to the token of the
+ * phase it runs in, or to no token at the top level.
+ */
+#define PROFILE_TOKEN_INHERIT 0
+
+typedef struct profile_span profile_span;
+struct profile_span {
+    bool active;
+    unsigned token;
+    unsigned parent_token;
+    size_t record;
+    uint64_t start_ns;
+    uint64_t tpm_cmds;
+    uint64_t tpm_ns;
+    uint64_t rows;
+};
+
+extern bool _g_profile_enabled;
+
+static inline bool profile_enabled(void) {
+    return _g_profile_enabled;
+}
+
+/**
+ * Starts profiling C_Initialize if PROFILE_ENV_VAR is set.
+ */
+void profile_init(void);
+
+/**
+ * Writes the breakdown if profiling and stops.
+ * @param rv
+ *  The result of C_Initialize, included in the report.
+ */
+void profile_finalize(unsigned long rv);
+
+/**
+ * Starts timing a phase.
+ * @param phase
+ *  The phase.
+ * @param token
+ *  The token id the phase works on, or PROFILE_TOKEN_INHERIT.
+ * @return
+ *  The span to hand to profile_end(), inactive when not profiling.
+ */
+profile_span profile_begin(profile_phase phase, unsigned token);
+
+/**
+ * Stops timing a phase and adds it to the breakdown.
+ * @param span
+ *  The span returned by profile_begin().
+ */
+void profile_end(profile_span *span);
+
+void _profile_tpm_begin(void);
+void _profile_tpm_end(void);
+void _profile_db_row(void);
+
+/**
+ * Marks the start of a TPM command.
+ */
+static inline void profile_tpm_begin(void) {
+    if (profile_enabled()) {
+        _profile_tpm_begin();
+    }
+}
+
+/**
+ * Counts the TPM command started with profile_tpm_begin() towards the
+ * running phases.
+ */
+static inline void profile_tpm_end(void) {
+    if (profile_enabled()) {
+        _profile_tpm_end();
+    }
+}
+
+/**
+ * Counts a database row read towards the running phases.
+ */
+static inline void profile_db_row(void) {
+    if (profile_enabled()) {
+        _profile_db_row();
+    }
+}
+
+/**
+ * Writes the breakdown gathered so far.
+ * @param f
+ *  The stream to write to.
+ */
+void profile_report(FILE *f);
+
+#endif /* SRC_LIB_PROFILE_H_ */
@@ -1,5 +1,6 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 
+#include "config.h"
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,6 +14,7 @@
 #include "session_table.h"
 #include "token.h"
 #include "tpm.h"
+#include "trace.h"
 #include "utils.h"
 
 static CK_RV check_max_sessions(session_table *s_table) {
@@ -115,7 +117,7 @@ CK_RV session_closeall(CK_SLOT_ID slot_id) {
     return session_table_free_ctx_all(t);
 }
 
-CK_RV session_lookup(CK_SESSION_HANDLE session, token **tok, session_ctx **ctx) {
+static CK_RV lookup(CK_SESSION_HANDLE session, token **tok, session_ctx **ctx) {
 
     token *tmp = NULL;
     unsigned tokid = get_tokid_from_session_handle_and_cleanse(&session);
@@ -132,3 +134,14 @@ CK_RV session_lookup(CK_SESSION_HANDLE session, token **tok, session_ctx **ctx)
 
     return CKR_OK;
 }
+
+CK_RV session_lookup(CK_SESSION_HANDLE session, token **tok, session_ctx **ctx) {
+
+    TRACE(session_lookup_begin, NULL, session);
+
+    CK_RV rv = lookup(session, tok, ctx);
+
+    TRACE(session_lookup_end, NULL, rv);
+
+    return rv;
+}
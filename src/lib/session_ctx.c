@@ -8,6 +8,7 @@
 
 #include <openssl/crypto.h>
 
+#include "arena.h"
 #include "attrs.h"
 #include "log.h"
 #include "mutex.h"
@@ -29,6 +30,8 @@ struct session_ctx {
     generic_opdata opdata;
 
     opdata_free_fn free;
+
+    arena *arena;
 };
 
 void session_ctx_free(session_ctx *ctx) {
@@ -39,6 +42,8 @@ void session_ctx_free(session_ctx *ctx) {
 
     session_ctx_opdata_clear(ctx);
 
+    arena_free(ctx->arena);
+
     free(ctx);
 }
 
@@ -78,6 +83,12 @@ CK_RV session_ctx_new(session_ctx **ctx, token *tok, CK_FLAGS flags) {
         return CKR_HOST_MEMORY;
     }
 
+    s->arena = arena_new(ARENA_DEFAULT_SIZE);
+    if (!s->arena) {
+        free(s);
+        return CKR_HOST_MEMORY;
+    }
+
     session_set_initial_state(s, tok->login_state, flags);
 
     s->flags = flags;
@@ -100,6 +111,10 @@ token *session_ctx_get_token(session_ctx *ctx) {
     return ctx->tok;
 }
 
+arena *session_ctx_get_arena(session_ctx *ctx) {
+    return ctx->arena;
+}
+
 void session_ctx_login_event(session_ctx *ctx, CK_USER_TYPE usertype) {
 
     /*
@@ -175,6 +190,55 @@ void session_ctx_opdata_clear(session_ctx *ctx) {
     session_ctx_opdata_set(ctx, operation_none, NULL, NULL, NULL);
 }
 
+static CK_FLAGS opdata_cancel_flag(operation op) {
+
+    switch (op) {
+    case operation_find:
+        return CKF_FIND_OBJECTS;
+    case operation_sign:
+        return CKF_SIGN;
+    case operation_verify:
+        return CKF_VERIFY;
+    case operation_verify_recover:
+        return CKF_VERIFY_RECOVER;
+    case operation_encrypt:
+        return CKF_ENCRYPT;
+    case operation_decrypt:
+        return CKF_DECRYPT;
+    case operation_digest:
+        return CKF_DIGEST;
+    case operation_message_sign:
+        return CKF_MESSAGE_SIGN;
+    case operation_message_verify:
+        return CKF_MESSAGE_VERIFY;
+    case operation_message_encrypt:
+        return CKF_MESSAGE_ENCRYPT;
+    case operation_message_decrypt:
+        return CKF_MESSAGE_DECRYPT;
+    default:
+        return 0;
+    }
+}
+
+CK_RV session_ctx_cancel(session_ctx *ctx, CK_FLAGS flags) {
+
+    if (!(flags & opdata_cancel_flag(ctx->opdata.op))) {
+        return CKR_OK;
+    }
+
+    /* key operations hold a user on their object, like their final call drops */
+    tobject *tobj = ctx->opdata.tobj;
+
+    session_ctx_opdata_clear(ctx);
+
+    if (!tobj) {
+        return CKR_OK;
+    }
+
+    tobj->is_authenticated = false;
+    return tobject_user_decrement(tobj);
+}
+
 static bool is_user(CK_USER_TYPE user) {
     return user == CKU_USER || user == CKU_CONTEXT_SPECIFIC;
 }
@@ -272,6 +336,17 @@ CK_RV session_ctx_login(session_ctx *ctx, CK_USER_TYPE user, CK_BYTE_PTR pin, CK
     return CKR_OK;
 }
 
+CK_RV session_ctx_login_user(session_ctx *ctx, CK_USER_TYPE user, CK_BYTE_PTR pin, CK_ULONG pinlen,
+        CK_BYTE_PTR username, CK_ULONG usernamelen) {
+
+    if (username && usernamelen) {
+        LOGE("Tokens have no named users");
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    return session_ctx_login(ctx, user, pin, pinlen);
+}
+
 CK_RV session_ctx_logout(session_ctx *ctx) {
 
     token *tok = session_ctx_get_token(ctx);
@@ -301,7 +376,7 @@ CK_RV session_ctx_logout(session_ctx *ctx) {
     /*
      * For each object:
      *   - Evict the TPM Handles
-     *   - Cleanse CKA_VALUE fields for private values.
+     *   - Cleanse the unwrapped CKA_VALUE of private objects.
      */
     if (tok->tobjects.head) {
 
@@ -310,12 +385,9 @@ CK_RV session_ctx_logout(session_ctx *ctx) {
             tobject *tobj = list_entry(cur, tobject, l);
             cur = cur->next;
 
-            /* if it's CKA_PRIVATE == CK_TRUE and it has a CKA_VALUE field, clear it */
+            tobject_clear_unwrapped_value(tobj);
+
             CK_BBOOL cka_private = attr_list_get_CKA_PRIVATE(tobj->attrs, CK_FALSE);
-            CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(tobj->attrs, CKA_VALUE);
-            if (cka_private && a && a->pValue && a->ulValueLen) {
-                attr_pfree_cleanse(a);
-            }
 
             /*
              * Do not perform tpm_flushcontext when:
@@ -3,6 +3,7 @@
 #ifndef SRC_PKCS11_SESSION_CTX_H_
 #define SRC_PKCS11_SESSION_CTX_H_
 
+#include "arena.h"
 #include "mutex.h"
 #include "object.h"
 #include "pkcs11.h"
@@ -22,6 +23,10 @@ enum operation {
     operation_encrypt,
     operation_decrypt,
     operation_digest,
+    operation_message_sign,
+    operation_message_verify,
+    operation_message_encrypt,
+    operation_message_decrypt,
     operation_count
 };
 
@@ -80,6 +85,17 @@ CK_FLAGS session_ctx_flags_get(session_ctx *ctx);
 
 token *session_ctx_get_token(session_ctx *ctx);
 
+/**
+ * Returns the operation arena of the session. Operation data allocated
+ * from it with arena_calloc() is recycled, and cleansed, once the
+ * operation releases it, avoiding heap traffic in steady state loops.
+ * @param ctx
+ *  The session context.
+ * @return
+ *  The session's arena.
+ */
+arena *session_ctx_get_arena(session_ctx *ctx);
+
 /**
  * Given a user, performs a login event, causing a transition to it's correct end state based
  * on current session state and user triggering the event.
@@ -150,6 +166,19 @@ tobject *session_ctx_opdata_get_tobject(session_ctx *ctx);
  */
 void session_ctx_opdata_clear(session_ctx *ctx);
 
+/**
+ * Implements C_SessionCancel, ending the active operation, if any, when
+ * flags names it.
+ * @param ctx
+ *  The session context.
+ * @param flags
+ *  CKF_FIND_OBJECTS and the mechanism flags, CKF_SIGN, CKF_MESSAGE_SIGN
+ *  and so on, of the operations to cancel.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV session_ctx_cancel(session_ctx *ctx, CK_FLAGS flags);
+
 /**
  * Sets the operation specific state data
  * @param tok
@@ -189,6 +218,27 @@ CK_RV _session_ctx_opdata_get(session_ctx *ctx, operation op, void **data);
  */
 CK_RV session_ctx_login(session_ctx *ctx, CK_USER_TYPE user, CK_BYTE_PTR pin, CK_ULONG pinlen);
 
+/**
+ * Implements C_LoginUser. Tokens have no named users, so this is
+ * session_ctx_login() when no username is given.
+ * @param ctx
+ *  The session context.
+ * @param user
+ *  The user
+ * @param pin
+ *  The pin
+ * @param pinlen
+ *  The length of the pin in bytes.
+ * @param username
+ *  The username, must be empty.
+ * @param usernamelen
+ *  The length of the username in bytes.
+ * @return
+ *  CKR_OK on success, anything else is a failure.
+ */
+CK_RV session_ctx_login_user(session_ctx *ctx, CK_USER_TYPE user, CK_BYTE_PTR pin, CK_ULONG pinlen,
+        CK_BYTE_PTR username, CK_ULONG usernamelen);
+
 /**
  * Generates a logout event to be propagated throughout the token.
  * A logout event is propagated by:
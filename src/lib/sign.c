@@ -26,21 +26,24 @@
 typedef struct sign_opdata sign_opdata;
 struct sign_opdata {
     CK_MECHANISM mech;
+    mdetail_entry *mech_entry;
     bool do_hash;
     twist buffer;
     digest_op_data *digest_opdata;
     encrypt_op_data *crypto_opdata;
+    /* a C_SignMessageBegin or C_VerifyMessageBegin message is open */
+    bool in_message;
 
     int padding;
     EVP_PKEY *pkey;
     const EVP_MD *md;
 };
 
-static sign_opdata *sign_opdata_new(mdetail *mdtl, CK_MECHANISM_PTR mechanism, tobject *tobj) {
+static sign_opdata *sign_opdata_new(arena *a, mdetail *mdtl, mdetail_entry *d,
+        CK_MECHANISM_PTR mechanism, tobject *tobj) {
 
     int padding = 0;
-    CK_RV rv = mech_get_padding(mdtl,
-            mechanism, &padding);
+    CK_RV rv = mech_get_padding(d, &padding);
     if (rv != CKR_OK) {
         return NULL;
     }
@@ -48,7 +51,7 @@ static sign_opdata *sign_opdata_new(mdetail *mdtl, CK_MECHANISM_PTR mechanism, t
     const EVP_MD *md = NULL;
 
     bool is_hashing_needed = false;
-    rv = mech_is_hashing_needed(mdtl, mechanism,
+    rv = mech_is_hashing_needed(d, mechanism,
             &is_hashing_needed);
     if (rv != CKR_OK) {
         return NULL;
@@ -59,7 +62,7 @@ static sign_opdata *sign_opdata_new(mdetail *mdtl, CK_MECHANISM_PTR mechanism, t
      * the hashing algorithm for verify operations with OSSL
      */
     bool is_hash_knowledge_needed = false;
-    rv = mech_is_hashing_knowledge_needed(mdtl, mechanism,
+    rv = mech_is_hashing_knowledge_needed(d,
             &is_hash_knowledge_needed);
     if (rv != CKR_OK) {
         return NULL;
@@ -67,7 +70,7 @@ static sign_opdata *sign_opdata_new(mdetail *mdtl, CK_MECHANISM_PTR mechanism, t
 
 
     if (is_hashing_needed || is_hash_knowledge_needed) {
-        rv = mech_get_digester(mdtl, mechanism, &md);
+        rv = mech_get_digester(mdtl, d, mechanism, &md);
         if (rv != CKR_OK) {
             return NULL;
         }
@@ -79,12 +82,14 @@ static sign_opdata *sign_opdata_new(mdetail *mdtl, CK_MECHANISM_PTR mechanism, t
         return NULL;
     }
 
-    sign_opdata *opdata = calloc(1, sizeof(sign_opdata));
+    sign_opdata *opdata = arena_calloc(a, 1, sizeof(sign_opdata));
     if (!opdata) {
         LOGE("oom");
+        EVP_PKEY_free(pkey);
         return NULL;
     }
 
+    opdata->mech_entry = d;
     opdata->padding = padding;
     opdata->pkey = pkey;
     opdata->md = md;
@@ -106,7 +111,7 @@ static void sign_opdata_free(sign_opdata **opdata) {
         encrypt_op_data_free(&(*opdata)->crypto_opdata);
     }
 
-    free(*opdata);
+    arena_release(*opdata);
 
     *opdata = NULL;
 }
@@ -140,6 +145,12 @@ static CK_RV update_pss_sig_state(token *tok, tobject *tobj) {
         }
 
         mdetail_set_pss_status(tok->mdtl, pss_sigs_good);
+
+        /* a read only store finds out again on every load */
+        if (backend_is_readonly(tok)) {
+            return CKR_OK;
+        }
+
         rv = backend_update_token_config(tok);
         if (rv != CKR_OK) {
             LOGW("Could not update token config backend, moving on");
@@ -166,20 +177,29 @@ static CK_RV common_init(operation op, session_ctx *ctx, CK_MECHANISM_PTR mechan
     token *tok = session_ctx_get_token(ctx);
     assert(tok);
 
+    arena *a = session_ctx_get_arena(ctx);
+
     tobject *tobj = NULL;
     rv = token_load_object(tok, key, &tobj);
     if (rv != CKR_OK) {
         return rv;
     }
 
-    rv = mech_validate(tok->mdtl, mechanism, tobj->attrs);
+    /* resolved once here, the helpers below and each final take the entry */
+    mdetail_entry *d = NULL;
+    rv = mech_resolve(tok->mdtl, mechanism, &d);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    rv = mech_validate(tok->mdtl, d, mechanism, tobj->attrs);
     if (rv != CKR_OK) {
         return rv;
     }
 
     digest_op_data *digest_opdata = NULL;
     bool is_hashing_needed = false;
-    rv = mech_is_hashing_needed(tok->mdtl,
+    rv = mech_is_hashing_needed(d,
             mechanism, &is_hashing_needed);
     if (rv != CKR_OK) {
         return rv;
@@ -187,7 +207,7 @@ static CK_RV common_init(operation op, session_ctx *ctx, CK_MECHANISM_PTR mechan
 
     if (is_hashing_needed) {
 
-        digest_opdata = digest_op_data_new();
+        digest_opdata = digest_op_data_new(a);
         if (!digest_opdata) {
             return CKR_HOST_MEMORY;
         }
@@ -205,28 +225,30 @@ static CK_RV common_init(operation op, session_ctx *ctx, CK_MECHANISM_PTR mechan
      * verify since the key is only resident in the TPM.
      */
     bool is_hmac = false;
-    rv = mech_is_HMAC(tok->mdtl, mechanism, &is_hmac);
+    rv = mech_is_HMAC(d, &is_hmac);
     if (rv != CKR_OK) {
         LOGE("Could not determine if algorithm is HMAC or not");
         return rv;
     }
 
+    bool is_sign = (op == operation_sign || op == operation_message_sign);
+
     tpm_op_data *tpm_opdata = NULL;
-    if (op == operation_sign || is_hmac) {
+    if (is_sign || is_hmac) {
 
         rv = update_pss_sig_state(tok, tobj);
         if (rv != CKR_OK) {
             return rv;
         }
 
-        rv = mech_get_tpm_opdata(tok->mdtl,
+        rv = mech_get_tpm_opdata(tok->mdtl, d, a,
                 tok->tctx, mechanism, tobj, &tpm_opdata);
         if (rv != CKR_OK) {
             return rv;
         }
     }
 
-    sign_opdata *opdata = sign_opdata_new(tok->mdtl,
+    sign_opdata *opdata = sign_opdata_new(a, tok->mdtl, d,
             mechanism, tobj);
     if (!opdata) {
         tpm_opdata_free(&tpm_opdata);
@@ -237,16 +259,16 @@ static CK_RV common_init(operation op, session_ctx *ctx, CK_MECHANISM_PTR mechan
     memcpy(&opdata->mech, mechanism, sizeof(opdata->mech));
     opdata->digest_opdata = digest_opdata;
 
-    opdata->crypto_opdata = encrypt_op_data_new();
+    opdata->crypto_opdata = encrypt_op_data_new(a);
     if (!opdata->crypto_opdata) {
         sign_opdata_free(&opdata);
         return CKR_HOST_MEMORY;
     }
 
     /* Use SW Verify if it's an asymmetric key with pkey set */
-    if (op != operation_sign && opdata->pkey) {
+    if (!is_sign && opdata->pkey) {
         opdata->crypto_opdata->use_sw = true;
-        rv = sw_encrypt_data_init(tok->mdtl,
+        rv = sw_encrypt_data_init(tok->mdtl, d,
                 mechanism, tobj, &opdata->crypto_opdata->cryptopdata.sw_enc_data);
         if (rv != CKR_OK) {
             sign_opdata_free(&opdata);
@@ -297,6 +319,25 @@ static CK_RV common_update(operation op, session_ctx *ctx, CK_BYTE_PTR part, CK_
     return CKR_OK;
 }
 
+/*
+ * Starts the hash, or the buffered data, over so the operation can take
+ * another message with the same key.
+ */
+static CK_RV sign_opdata_restart(sign_opdata *opdata, bool drop_buffer) {
+
+    if (opdata->do_hash) {
+        /* reuses the digest state in place, nothing is allocated per message */
+        assert(opdata->digest_opdata);
+        return digest_restart_op(opdata->digest_opdata);
+
+    } else if (drop_buffer) {
+        twist_free(opdata->buffer);
+        opdata->buffer = NULL;
+    }
+
+    return CKR_OK;
+}
+
 CK_RV sign_init(session_ctx *ctx, CK_MECHANISM *mechanism, CK_OBJECT_HANDLE key) {
 
     return common_init(operation_sign, ctx, mechanism, key);
@@ -307,7 +348,7 @@ CK_RV sign_update(session_ctx *ctx, CK_BYTE_PTR part, CK_ULONG part_len) {
     return common_update(operation_sign, ctx, part, part_len);
 }
 
-CK_RV sign_final_ex(session_ctx *ctx, CK_BYTE_PTR signature, CK_ULONG_PTR signature_len, bool is_oneshot) {
+static CK_RV sign_final_op(session_ctx *ctx, operation op, CK_BYTE_PTR signature, CK_ULONG_PTR signature_len, bool is_oneshot) {
 
     check_pointer(signature_len);
 
@@ -316,7 +357,7 @@ CK_RV sign_final_ex(session_ctx *ctx, CK_BYTE_PTR signature, CK_ULONG_PTR signat
     CK_RV rv = CKR_GENERAL_ERROR;
 
     sign_opdata *opdata = NULL;
-    rv = session_ctx_opdata_get(ctx, operation_sign, &opdata);
+    rv = session_ctx_opdata_get(ctx, op, &opdata);
     if (rv != CKR_OK) {
         return rv;
     }
@@ -334,6 +375,9 @@ CK_RV sign_final_ex(session_ctx *ctx, CK_BYTE_PTR signature, CK_ULONG_PTR signat
     assert(tobj);
 
     twist digest_buf = NULL;
+    CK_BYTE hash_buf[EVP_MAX_MD_SIZE];
+    CK_BYTE_PTR digest_data = NULL;
+    CK_ULONG digest_buf_len = 0;
 
     size_t expected_sig_len = 0;
     rv = tobject_get_min_buf_size(tobj, &opdata->mech, &expected_sig_len);
@@ -355,7 +399,7 @@ CK_RV sign_final_ex(session_ctx *ctx, CK_BYTE_PTR signature, CK_ULONG_PTR signat
     if (opdata->do_hash) {
 
         CK_MECHANISM_TYPE mech_halg;
-        rv = mech_get_digest_alg(tok->mdtl,
+        rv = mech_get_digest_alg(opdata->mech_entry,
                 &opdata->mech,
                 &mech_halg);
         if (rv != CKR_OK) {
@@ -363,34 +407,33 @@ CK_RV sign_final_ex(session_ctx *ctx, CK_BYTE_PTR signature, CK_ULONG_PTR signat
         }
 
         CK_ULONG hash_len = utils_get_halg_size(mech_halg);
-        if (!hash_len) {
-            LOGE("Hash algorithm cannot have 0 size");
+        if (!hash_len || hash_len > sizeof(hash_buf)) {
+            LOGE("Hash algorithm has invalid size: %lu", hash_len);
             return CKR_GENERAL_ERROR;
         }
 
-        digest_buf = twist_calloc(hash_len);
-        if (!digest_buf) {
-            LOGE("oom");
-            rv = CKR_HOST_MEMORY;
-            goto session_out;
-        }
-
-        rv = digest_final_op(ctx, opdata->digest_opdata, (CK_BYTE_PTR)digest_buf, &hash_len);
+        /* the digest is small and fixed size, keep it off the heap */
+        rv = digest_final_op(ctx, opdata->digest_opdata, hash_buf, &hash_len);
         if (rv != CKR_OK) {
             goto session_out;
         }
+
+        digest_data = hash_buf;
+        digest_buf_len = hash_len;
     } else {
         digest_buf = opdata->buffer;
         /* we take ownership of this buffer */
         opdata->buffer = NULL;
+
+        digest_data = (CK_BYTE_PTR)digest_buf;
+        digest_buf_len = twist_len(digest_buf);
     }
 
     CK_BYTE syn_buf[4096];
     CK_ULONG syn_buf_len = sizeof(syn_buf);
-    CK_ULONG digest_buf_len = twist_len(digest_buf);
 
     bool is_ecc = false;
-    rv = mech_is_ecc(tok->mdtl, opdata->mech.mechanism, &is_ecc);
+    rv = mech_is_ecc(opdata->mech_entry, &is_ecc);
     if (rv != CKR_OK) {
         LOGE("COuld not determine if mechanism is ECC: %lu", rv);
         return rv;
@@ -402,16 +445,16 @@ CK_RV sign_final_ex(session_ctx *ctx, CK_BYTE_PTR signature, CK_ULONG_PTR signat
     }
 
     rv = mech_synthesize(
-            tok->mdtl,
+            tok->mdtl, opdata->mech_entry,
             &opdata->mech, tobj->attrs,
-            (CK_BYTE_PTR)digest_buf, digest_buf_len,
+            digest_data, digest_buf_len,
             syn_buf, &syn_buf_len);
     if (rv != CKR_OK) {
         goto session_out;
     }
 
     bool is_synthetic = false;
-    rv = mech_is_synthetic(tok->mdtl, &opdata->mech,
+    rv = mech_is_synthetic(opdata->mech_entry,
             &is_synthetic);
     if (rv != CKR_OK) {
         goto session_out;
@@ -420,7 +463,8 @@ CK_RV sign_final_ex(session_ctx *ctx, CK_BYTE_PTR signature, CK_ULONG_PTR signat
     if (is_synthetic) {
 
         /* sign padded pkcs 1.5 structure */
-        encrypt_op_data *encrypt_opdata = encrypt_op_data_new();
+        encrypt_op_data *encrypt_opdata = encrypt_op_data_new(
+                session_ctx_get_arena(ctx));
         if (!encrypt_opdata) {
             rv = CKR_HOST_MEMORY;
             goto session_out;
@@ -474,42 +518,32 @@ out:
      * Reset the hashing state IF we're actually doing the hash internally
      */
     reset_ctx = (rv == CKR_BUFFER_TOO_SMALL || !signature);
-    if (reset_ctx) {
-        if (opdata->do_hash) {
-            /* reset the hashing state */
-            digest_op_data *new_digest_state = digest_op_data_new();
-            if (!new_digest_state) {
-                rv = CKR_HOST_MEMORY;
-                reset_ctx = false;
-                goto session_out;
-            }
-
-            assert(opdata->digest_opdata);
-
-            CK_RV tmp = digest_init_op(ctx, new_digest_state,
-                    &opdata->digest_opdata->mechanism);
-            if (tmp != CKR_OK) {
-                digest_op_data_free(&new_digest_state);
-                reset_ctx = false;
-                goto session_out;
-            }
-
-            digest_op_data_free(&opdata->digest_opdata);
-            opdata->digest_opdata = new_digest_state;
-
-        } else if (is_oneshot) {
-            twist_free(opdata->buffer);
-            opdata->buffer = NULL;
-        }
-    } else {
+    if (!reset_ctx) {
         /* not resetting the state, and all is well */
         rv = CKR_OK;
+    } else if (op != operation_message_sign) {
+        /* reset the hashing state */
+        CK_RV tmp = sign_opdata_restart(opdata, is_oneshot);
+        if (tmp != CKR_OK) {
+            rv = tmp;
+            reset_ctx = false;
+        }
     }
 
 session_out:
     twist_free(digest_buf);
     assert(tobj);
-    if (!reset_ctx) {
+    if (op == operation_message_sign) {
+        /* the key stays bound, only this message is done */
+        if (!reset_ctx) {
+            tobj->is_authenticated = false;
+        }
+
+        CK_RV tmp_rv = sign_opdata_restart(opdata, true);
+        if (tmp_rv != CKR_OK && rv == CKR_OK) {
+            rv = tmp_rv;
+        }
+    } else if (!reset_ctx) {
         tobj->is_authenticated = false;
         CK_RV tmp_rv = tobject_user_decrement(tobj);
         if (tmp_rv != CKR_OK && rv == CKR_OK) {
@@ -523,6 +557,11 @@ session_out:
     return rv;
 }
 
+CK_RV sign_final_ex(session_ctx *ctx, CK_BYTE_PTR signature, CK_ULONG_PTR signature_len, bool is_oneshot) {
+
+    return sign_final_op(ctx, operation_sign, signature, signature_len, is_oneshot);
+}
+
 CK_RV sign(session_ctx *ctx, CK_BYTE_PTR data, CK_ULONG data_len, CK_BYTE_PTR signature, CK_ULONG *signature_len) {
 
     CK_RV rv = sign_update(ctx, data, data_len);
@@ -542,7 +581,7 @@ CK_RV verify_update (session_ctx *ctx, CK_BYTE_PTR part, CK_ULONG part_len) {
     return common_update(operation_verify, ctx, part, part_len);
 }
 
-CK_RV verify_final (session_ctx *ctx, CK_BYTE_PTR signature, CK_ULONG signature_len) {
+static CK_RV verify_final_op(session_ctx *ctx, operation op, CK_BYTE_PTR signature, CK_ULONG signature_len) {
 
     check_pointer(signature);
     check_pointer(signature_len);
@@ -550,7 +589,7 @@ CK_RV verify_final (session_ctx *ctx, CK_BYTE_PTR signature, CK_ULONG signature_
     CK_RV rv = CKR_GENERAL_ERROR;
 
     sign_opdata *opdata = NULL;
-    rv = session_ctx_opdata_get(ctx, operation_verify, &opdata);
+    rv = session_ctx_opdata_get(ctx, op, &opdata);
     if (rv != CKR_OK) {
         return rv;
     }
@@ -592,6 +631,16 @@ CK_RV verify_final (session_ctx *ctx, CK_BYTE_PTR signature, CK_ULONG signature_
 out:
     assert(tobj);
     tobj->is_authenticated = false;
+
+    if (op == operation_message_verify) {
+        /* the key stays bound, only this message is done */
+        CK_RV tmp_rv = sign_opdata_restart(opdata, true);
+        if (tmp_rv != CKR_OK && rv == CKR_OK) {
+            rv = tmp_rv;
+        }
+        return rv;
+    }
+
     CK_RV tmp_rv = tobject_user_decrement(tobj);
     if (tmp_rv != CKR_OK && rv == CKR_OK) {
         rv = tmp_rv;
@@ -604,6 +653,11 @@ out:
     return rv;
 }
 
+CK_RV verify_final (session_ctx *ctx, CK_BYTE_PTR signature, CK_ULONG signature_len) {
+
+    return verify_final_op(ctx, operation_verify, signature, signature_len);
+}
+
 CK_RV verify(session_ctx *ctx, CK_BYTE_PTR data, CK_ULONG data_len, CK_BYTE_PTR signature, CK_ULONG signature_len) {
 
     CK_RV rv = verify_update(ctx, data, data_len);
@@ -656,3 +710,249 @@ CK_RV verify_recover (session_ctx *ctx, CK_BYTE_PTR signature, CK_ULONG signatur
 
     return rv;
 }
+
+/*
+ * Looks up a message based operation. None of the signing mechanisms take
+ * per message parameters.
+ */
+static CK_RV message_get(session_ctx *ctx, operation op,
+        CK_VOID_PTR param, CK_ULONG param_len, sign_opdata **opdata) {
+
+    CK_RV rv = session_ctx_opdata_get(ctx, op, opdata);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    if (param || param_len) {
+        LOGE("Mechanism 0x%lx takes no per message parameters",
+                (*opdata)->mech.mechanism);
+        return CKR_MECHANISM_PARAM_INVALID;
+    }
+
+    return CKR_OK;
+}
+
+/*
+ * Answers size queries before any data goes into the message, so the
+ * application can repeat the call with the same data.
+ */
+static CK_RV message_sig_len(session_ctx *ctx, sign_opdata *opdata,
+        CK_BYTE_PTR signature, CK_ULONG_PTR signature_len, bool *is_query) {
+
+    tobject *tobj = session_ctx_opdata_get_tobject(ctx);
+    assert(tobj);
+
+    size_t expected_sig_len = 0;
+    CK_RV rv = tobject_get_min_buf_size(tobj, &opdata->mech, &expected_sig_len);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    *is_query = !signature;
+    if (!signature) {
+        *signature_len = expected_sig_len;
+        return CKR_OK;
+    }
+
+    if (*signature_len < expected_sig_len) {
+        *signature_len = expected_sig_len;
+        return CKR_BUFFER_TOO_SMALL;
+    }
+
+    return CKR_OK;
+}
+
+static CK_RV message_final(session_ctx *ctx, operation op) {
+
+    sign_opdata *opdata = NULL;
+    CK_RV rv = session_ctx_opdata_get(ctx, op, &opdata);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    tobject *tobj = session_ctx_opdata_get_tobject(ctx);
+    assert(tobj);
+
+    tobj->is_authenticated = false;
+    rv = tobject_user_decrement(tobj);
+
+    encrypt_op_data_free(&opdata->crypto_opdata);
+
+    session_ctx_opdata_clear(ctx);
+
+    return rv;
+}
+
+CK_RV message_sign_init(session_ctx *ctx, CK_MECHANISM *mechanism, CK_OBJECT_HANDLE key) {
+
+    return common_init(operation_message_sign, ctx, mechanism, key);
+}
+
+CK_RV sign_message(session_ctx *ctx, CK_VOID_PTR param, CK_ULONG param_len,
+        CK_BYTE_PTR data, CK_ULONG data_len,
+        CK_BYTE_PTR signature, CK_ULONG_PTR signature_len) {
+
+    check_pointer(signature_len);
+
+    sign_opdata *opdata = NULL;
+    CK_RV rv = message_get(ctx, operation_message_sign, param, param_len, &opdata);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    if (opdata->in_message) {
+        return CKR_OPERATION_ACTIVE;
+    }
+
+    bool is_query = false;
+    rv = message_sig_len(ctx, opdata, signature, signature_len, &is_query);
+    if (rv != CKR_OK || is_query) {
+        return rv;
+    }
+
+    rv = common_update(operation_message_sign, ctx, data, data_len);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    return sign_final_op(ctx, operation_message_sign, signature, signature_len, true);
+}
+
+CK_RV sign_message_begin(session_ctx *ctx, CK_VOID_PTR param, CK_ULONG param_len) {
+
+    sign_opdata *opdata = NULL;
+    CK_RV rv = message_get(ctx, operation_message_sign, param, param_len, &opdata);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    if (opdata->in_message) {
+        return CKR_OPERATION_ACTIVE;
+    }
+
+    opdata->in_message = true;
+
+    return CKR_OK;
+}
+
+CK_RV sign_message_next(session_ctx *ctx, CK_VOID_PTR param, CK_ULONG param_len,
+        CK_BYTE_PTR data, CK_ULONG data_len,
+        CK_BYTE_PTR signature, CK_ULONG_PTR signature_len) {
+
+    sign_opdata *opdata = NULL;
+    CK_RV rv = message_get(ctx, operation_message_sign, param, param_len, &opdata);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    if (!opdata->in_message) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+
+    /* no signature length means more parts are coming */
+    if (!signature_len) {
+        return common_update(operation_message_sign, ctx, data, data_len);
+    }
+
+    bool is_query = false;
+    rv = message_sig_len(ctx, opdata, signature, signature_len, &is_query);
+    if (rv != CKR_OK || is_query) {
+        return rv;
+    }
+
+    if (data_len) {
+        rv = common_update(operation_message_sign, ctx, data, data_len);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+    }
+
+    opdata->in_message = false;
+
+    return sign_final_op(ctx, operation_message_sign, signature, signature_len, false);
+}
+
+CK_RV message_sign_final(session_ctx *ctx) {
+
+    return message_final(ctx, operation_message_sign);
+}
+
+CK_RV message_verify_init(session_ctx *ctx, CK_MECHANISM *mechanism, CK_OBJECT_HANDLE key) {
+
+    return common_init(operation_message_verify, ctx, mechanism, key);
+}
+
+CK_RV verify_message(session_ctx *ctx, CK_VOID_PTR param, CK_ULONG param_len,
+        CK_BYTE_PTR data, CK_ULONG data_len,
+        CK_BYTE_PTR signature, CK_ULONG signature_len) {
+
+    sign_opdata *opdata = NULL;
+    CK_RV rv = message_get(ctx, operation_message_verify, param, param_len, &opdata);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    if (opdata->in_message) {
+        return CKR_OPERATION_ACTIVE;
+    }
+
+    rv = common_update(operation_message_verify, ctx, data, data_len);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    return verify_final_op(ctx, operation_message_verify, signature, signature_len);
+}
+
+CK_RV verify_message_begin(session_ctx *ctx, CK_VOID_PTR param, CK_ULONG param_len) {
+
+    sign_opdata *opdata = NULL;
+    CK_RV rv = message_get(ctx, operation_message_verify, param, param_len, &opdata);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    if (opdata->in_message) {
+        return CKR_OPERATION_ACTIVE;
+    }
+
+    opdata->in_message = true;
+
+    return CKR_OK;
+}
+
+CK_RV verify_message_next(session_ctx *ctx, CK_VOID_PTR param, CK_ULONG param_len,
+        CK_BYTE_PTR data, CK_ULONG data_len,
+        CK_BYTE_PTR signature, CK_ULONG signature_len) {
+
+    sign_opdata *opdata = NULL;
+    CK_RV rv = message_get(ctx, operation_message_verify, param, param_len, &opdata);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    if (!opdata->in_message) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+
+    /* no signature means more parts are coming */
+    if (!signature) {
+        return common_update(operation_message_verify, ctx, data, data_len);
+    }
+
+    if (data_len) {
+        rv = common_update(operation_message_verify, ctx, data, data_len);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+    }
+
+    opdata->in_message = false;
+
+    return verify_final_op(ctx, operation_message_verify, signature, signature_len);
+}
+
+CK_RV message_verify_final(session_ctx *ctx) {
+
+    return message_final(ctx, operation_message_verify);
+}
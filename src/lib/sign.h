@@ -31,4 +31,38 @@ CK_RV verify_recover_init (session_ctx *ctx, CK_MECHANISM *mechanism, CK_OBJECT_
 CK_RV verify_recover (session_ctx *ctx, CK_BYTE_PTR signature, CK_ULONG signature_len,
         CK_BYTE_PTR data, CK_ULONG_PTR data_len);
 
+/*
+ * The PKCS#11 3.0 message based operations. The key is bound once by the
+ * init call and stays loaded, with its TPM state, until the final call.
+ * Each message starts a fresh hash and, for CKA_ALWAYS_AUTHENTICATE keys,
+ * needs its own context specific login.
+ */
+CK_RV message_sign_init(session_ctx *ctx, CK_MECHANISM *mechanism, CK_OBJECT_HANDLE key);
+
+CK_RV sign_message(session_ctx *ctx, CK_VOID_PTR param, CK_ULONG param_len,
+        CK_BYTE_PTR data, CK_ULONG data_len,
+        CK_BYTE_PTR signature, CK_ULONG_PTR signature_len);
+
+CK_RV sign_message_begin(session_ctx *ctx, CK_VOID_PTR param, CK_ULONG param_len);
+
+CK_RV sign_message_next(session_ctx *ctx, CK_VOID_PTR param, CK_ULONG param_len,
+        CK_BYTE_PTR data, CK_ULONG data_len,
+        CK_BYTE_PTR signature, CK_ULONG_PTR signature_len);
+
+CK_RV message_sign_final(session_ctx *ctx);
+
+CK_RV message_verify_init(session_ctx *ctx, CK_MECHANISM *mechanism, CK_OBJECT_HANDLE key);
+
+CK_RV verify_message(session_ctx *ctx, CK_VOID_PTR param, CK_ULONG param_len,
+        CK_BYTE_PTR data, CK_ULONG data_len,
+        CK_BYTE_PTR signature, CK_ULONG signature_len);
+
+CK_RV verify_message_begin(session_ctx *ctx, CK_VOID_PTR param, CK_ULONG param_len);
+
+CK_RV verify_message_next(session_ctx *ctx, CK_VOID_PTR param, CK_ULONG param_len,
+        CK_BYTE_PTR data, CK_ULONG data_len,
+        CK_BYTE_PTR signature, CK_ULONG signature_len);
+
+CK_RV message_verify_final(session_ctx *ctx);
+
 #endif
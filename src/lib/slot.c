@@ -1,22 +1,95 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "checks.h"
 #include "backend.h"
+#include "event.h"
 #include "mech.h"
 #include "pkcs11.h"
 #include "slot.h"
 #include "token.h"
 #include "utils.h"
 
+/*
+ * Token ids are carried in the high byte of session handles, so a table
+ * of this size indexes every id a session can name.
+ */
+#define SLOT_TABLE_SIZE 256
+
+/*
+ * An immutable view of the slots. Readers load the current table without
+ * locking, writers build a new one under the mutex and publish it. Old
+ * tables may still be in use by readers, so they are kept until
+ * slot_destroy().
+ */
+typedef struct slot_table slot_table;
+struct slot_table {
+    size_t token_cnt;
+    token *list[MAX_TOKEN_CNT];
+    token *by_id[SLOT_TABLE_SIZE];
+    slot_table *retired;
+};
+
 static struct {
     size_t token_cnt;
     token *token;
+    slot_table *table;
     void *mutex;
 } global;
 
+static slot_table *slot_table_get(void) {
+    return __atomic_load_n(&global.table, __ATOMIC_ACQUIRE);
+}
+
+static void slot_table_add(slot_table *table, token *t) {
+
+    table->list[table->token_cnt++] = t;
+
+    /* on duplicate ids the first token wins, as with a scan */
+    if (t->id < SLOT_TABLE_SIZE && !table->by_id[t->id]) {
+        table->by_id[t->id] = t;
+    }
+}
+
+/*
+ * Publishes a table holding every token in global.token, retiring the
+ * current one. Called with the mutex held, or before any readers exist.
+ */
+static CK_RV slot_table_publish(void) {
+
+    slot_table *table = calloc(1, sizeof(*table));
+    if (!table) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    size_t i;
+    for (i=0; i < global.token_cnt; i++) {
+        slot_table_add(table, &global.token[i]);
+    }
+
+    table->retired = global.table;
+
+    __atomic_store_n(&global.table, table, __ATOMIC_RELEASE);
+
+    return CKR_OK;
+}
+
+static void slot_table_free_all(void) {
+
+    slot_table *table = global.table;
+    global.table = NULL;
+
+    while (table) {
+        slot_table *next = table->retired;
+        free(table);
+        table = next;
+    }
+}
+
 CK_RV slot_init(void) {
 
     CK_RV rv = mutex_create(&global.mutex);
@@ -24,7 +97,12 @@ CK_RV slot_init(void) {
         return rv;
     }
 
-    return backend_get_tokens(&global.token, &global.token_cnt);
+    rv = backend_get_tokens(&global.token, &global.token_cnt);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    return slot_table_publish();
 }
 
 static void slot_lock(void) {
@@ -35,8 +113,65 @@ static void slot_unlock(void) {
     mutex_unlock_fatal(global.mutex);
 }
 
+/* the tokens slot_fork_lock() took, the parent unlocks exactly these */
+static slot_table *_fork_locked;
+
+void slot_fork_lock(void) {
+
+    /* tokens first, token_init() takes the slot lock with its token held */
+    slot_table *table = slot_table_get();
+    if (table) {
+        size_t i;
+        for (i=0; i < table->token_cnt; i++) {
+            token_lock(table->list[i]);
+        }
+    }
+
+    _fork_locked = table;
+
+    slot_lock();
+}
+
+void slot_fork_unlock(void) {
+
+    slot_unlock();
+
+    slot_table *table = _fork_locked;
+    _fork_locked = NULL;
+    if (table) {
+        size_t i;
+        for (i=0; i < table->token_cnt; i++) {
+            token_unlock(table->list[i]);
+        }
+    }
+}
+
+CK_RV slot_after_fork(void) {
+
+    /* the inherited mutexes are held, the fork happened under them */
+    _fork_locked = NULL;
+
+    CK_RV rv = mutex_create(&global.mutex);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    /* a token that fails keeps failing its TPM calls, the rest still work */
+    size_t i;
+    for (i=0; i < global.token_cnt; i++) {
+        CK_RV tmp = token_after_fork(&global.token[i]);
+        if (rv == CKR_OK) {
+            rv = tmp;
+        }
+    }
+
+    return rv;
+}
+
 void slot_destroy(void) {
 
+    slot_table_free_all();
+
     token_free_list(&global.token, &global.token_cnt);
 
     CK_RV rv = mutex_destroy(global.mutex);
@@ -48,18 +183,24 @@ void slot_destroy(void) {
 
 token *slot_get_token(CK_SLOT_ID slot_id) {
 
-    slot_lock();
+    slot_table *table = slot_table_get();
+    if (!table) {
+        return NULL;
+    }
+
+    if (slot_id < SLOT_TABLE_SIZE) {
+        return table->by_id[slot_id];
+    }
 
+    /* ids too big for a session handle are rare, scan for them */
     size_t i;
-    for (i=0; i < global.token_cnt; i++) {
-        token *t = &global.token[i];
+    for (i=0; i < table->token_cnt; i++) {
+        token *t = table->list[i];
         if (slot_id == t->id) {
-            slot_unlock();
             return t;
         }
     }
 
-    slot_unlock();
     return NULL;
 }
 
@@ -73,29 +214,27 @@ CK_RV slot_get_list (CK_BYTE token_present, CK_SLOT_ID *slot_list, CK_ULONG_PTR
 
     check_pointer(count);
 
-    slot_lock();
+    slot_table *table = slot_table_get();
+    if (!table) {
+        return CKR_GENERAL_ERROR;
+    }
 
     if (!slot_list) {
-        slot_unlock();
-        *count = global.token_cnt;
+        *count = table->token_cnt;
         return CKR_OK;
     }
 
-    if (*count < global.token_cnt) {
-        *count = global.token_cnt;
-        slot_unlock();
+    if (*count < table->token_cnt) {
+        *count = table->token_cnt;
         return CKR_BUFFER_TOO_SMALL;
     }
 
     size_t i;
-    for (i=0; i < global.token_cnt; i++) {
-        token *t = &global.token[i];
-        slot_list[i] = t->id;
+    for (i=0; i < table->token_cnt; i++) {
+        slot_list[i] = table->list[i]->id;
     }
 
-    *count = global.token_cnt;
-
-    slot_unlock();
+    *count = table->token_cnt;
 
     return CKR_OK;
 }
@@ -185,14 +324,29 @@ CK_RV slot_add_uninit_token(void) {
            }
         }
 
-        token *t = &global.token[global.token_cnt++];
-        t->id = global.token_cnt;
+        /*
+         * The slot is invisible to readers until the new table is
+         * published, so it can be set up in place.
+         */
+        token *t = &global.token[global.token_cnt];
+        t->id = global.token_cnt + 1;
         rv = token_min_init(t);
         if (rv != CKR_OK) {
            goto out;
         }
 
         assert(t->id);
+
+        global.token_cnt++;
+        rv = slot_table_publish();
+        if (rv != CKR_OK) {
+            global.token_cnt--;
+            token_free(t);
+            memset(t, 0, sizeof(*t));
+            goto out;
+        }
+
+        event_post(t->id);
     } else {
         LOGW("Reached max tokens in store");
     }
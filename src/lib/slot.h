@@ -14,6 +14,25 @@ typedef struct token token;
 CK_RV slot_init(void);
 void slot_destroy(void);
 
+/**
+ * Takes every token lock and the slot lock ahead of fork(), so the child
+ * inherits the slots in a consistent state.
+ */
+void slot_fork_lock(void);
+
+/**
+ * Releases the locks taken by slot_fork_lock(), in the parent.
+ */
+void slot_fork_unlock(void);
+
+/**
+ * Makes the inherited slots usable in the child, replacing the held locks
+ * and reopening every token with token_after_fork().
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV slot_after_fork(void);
+
 token *slot_get_token(CK_SLOT_ID slot_id);
 
 CK_RV slot_get_list (unsigned char token_present, CK_SLOT_ID *slot_list, unsigned long *count);
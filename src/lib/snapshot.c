@@ -0,0 +1,462 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#include "log.h"
+#include "object.h"
+#include "snapshot.h"
+#include "typed_memory.h"
+
+#define SNAPSHOT_MAGIC   "TPM2SNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_ENDIAN  0x01020304
+
+/* the sqlite file header keeps a big endian change counter here */
+#define SQLITE_CHANGE_COUNTER_OFF 24
+
+typedef struct snap_header snap_header;
+struct snap_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t endian;
+    uint32_t ulong_size;
+    uint32_t db_version;
+    uint32_t token_count;
+    uint32_t object_count;
+    uint32_t reserved;
+    uint64_t tokens_off;
+    uint64_t objects_off;
+    uint64_t file_size;
+    /* the stamp of the store the snapshot was compiled from */
+    uint64_t store_size;
+    uint64_t store_mtime_s;
+    uint64_t store_mtime_ns;
+    uint32_t store_change_counter;
+    uint32_t reserved2;
+    /* over the file, without this field */
+    uint8_t sha256[SHA256_DIGEST_LENGTH];
+};
+
+typedef struct snap_token snap_token;
+struct snap_token {
+    uint32_t id;
+    uint32_t object_count;
+    uint32_t first_object;
+    uint32_t reserved;
+};
+
+typedef struct snap_object snap_object;
+struct snap_object {
+    uint32_t id;
+    uint32_t tokid;
+    uint32_t attr_count;
+    uint32_t reserved;
+    uint64_t attrs_off;
+};
+
+typedef struct snap_attr snap_attr;
+struct snap_attr {
+    uint64_t type;
+    uint64_t len;
+    /* 0 for an empty value */
+    uint64_t value_off;
+};
+
+struct snapshot {
+    const uint8_t *base;
+    size_t size;
+    const snap_header *hdr;
+    const snap_token *tokens;
+    const snap_object *objects;
+};
+
+static bool in_bounds(const snapshot *snap, uint64_t off, uint64_t len) {
+    return off <= snap->size && len <= snap->size - off && !(off & 7);
+}
+
+static bool table_in_bounds(const snapshot *snap, uint64_t off,
+        uint64_t count, size_t size) {
+    return count <= snap->size / size && in_bounds(snap, off, count * size);
+}
+
+static CK_RV check_stamp(const snap_header *hdr, const char *storepath) {
+
+    int fd = open(storepath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGW("Could not open store \"%s\": %s", storepath, strerror(errno));
+        return CKR_GENERAL_ERROR;
+    }
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    struct stat sb;
+    if (fstat(fd, &sb)) {
+        LOGW("Could not stat store \"%s\": %s", storepath, strerror(errno));
+        goto out;
+    }
+
+    uint8_t counter[4];
+    ssize_t n = pread(fd, counter, sizeof(counter), SQLITE_CHANGE_COUNTER_OFF);
+    if (n != sizeof(counter)) {
+        LOGW("Could not read the store's change counter");
+        goto out;
+    }
+
+    uint32_t change_counter = (uint32_t)counter[0] << 24 |
+            (uint32_t)counter[1] << 16 | (uint32_t)counter[2] << 8 | counter[3];
+
+    if (hdr->store_size != (uint64_t)sb.st_size
+            || hdr->store_mtime_s != (uint64_t)sb.st_mtim.tv_sec
+            || hdr->store_mtime_ns != (uint64_t)sb.st_mtim.tv_nsec
+            || hdr->store_change_counter != change_counter) {
+        LOGW("Snapshot is stale, the store changed since it was compiled");
+        goto out;
+    }
+
+    rv = CKR_OK;
+
+out:
+    close(fd);
+    return rv;
+}
+
+static CK_RV check_digest(const snapshot *snap) {
+
+    uint8_t md[SHA256_DIGEST_LENGTH];
+    size_t off = offsetof(snap_header, sha256);
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (!ctx) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    unsigned int len = sizeof(md);
+    if (EVP_DigestInit(ctx, EVP_sha256()) != 1
+            || EVP_DigestUpdate(ctx, snap->base, off) != 1
+            || EVP_DigestUpdate(ctx, snap->base + sizeof(snap_header),
+                    snap->size - sizeof(snap_header)) != 1
+            || EVP_DigestFinal(ctx, md, &len) != 1) {
+        LOGE("Could not hash the snapshot");
+        goto out;
+    }
+
+    if (memcmp(md, snap->hdr->sha256, sizeof(md))) {
+        LOGW("Snapshot checksum mismatch");
+        goto out;
+    }
+
+    rv = CKR_OK;
+
+out:
+    EVP_MD_CTX_free(ctx);
+    return rv;
+}
+
+static bool check_attr(const snapshot *snap, const snap_attr *a) {
+
+    if (!a->value_off) {
+        return !a->len;
+    }
+
+    if (!a->len || a->len >= snap->size
+            || !in_bounds(snap, a->value_off, a->len + 1)) {
+        return false;
+    }
+
+    CK_BYTE type = snap->base[a->value_off + a->len];
+    switch (type) {
+    case TYPE_BYTE_INT:
+        return a->len == sizeof(CK_ULONG);
+    case TYPE_BYTE_BOOL:
+        return a->len == sizeof(CK_BBOOL);
+    case TYPE_BYTE_INT_SEQ:
+        return !(a->len % sizeof(CK_ULONG));
+    case TYPE_BYTE_HEX_STR:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* every offset is checked once here, so loading trusts them */
+static CK_RV check_tables(const snapshot *snap) {
+
+    const snap_header *hdr = snap->hdr;
+
+    if (!table_in_bounds(snap, hdr->tokens_off, hdr->token_count,
+                sizeof(snap_token))
+            || !table_in_bounds(snap, hdr->objects_off, hdr->object_count,
+                sizeof(snap_object))) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    uint32_t i;
+    for (i=0; i < hdr->token_count; i++) {
+        const snap_token *t = &snap->tokens[i];
+
+        if ((i && t->id <= snap->tokens[i - 1].id)
+                || t->first_object > hdr->object_count
+                || t->object_count > hdr->object_count - t->first_object) {
+            return CKR_GENERAL_ERROR;
+        }
+
+        uint32_t j;
+        for (j=0; j < t->object_count; j++) {
+            const snap_object *o = &snap->objects[t->first_object + j];
+            if (o->tokid != t->id || !o->id
+                    || (j && o->id <= o[-1].id)
+                    || !table_in_bounds(snap, o->attrs_off, o->attr_count,
+                            sizeof(snap_attr))) {
+                return CKR_GENERAL_ERROR;
+            }
+
+            const snap_attr *attrs = (const snap_attr *)&snap->base[o->attrs_off];
+
+            uint32_t k;
+            for (k=0; k < o->attr_count; k++) {
+                if (!check_attr(snap, &attrs[k])) {
+                    return CKR_GENERAL_ERROR;
+                }
+            }
+        }
+    }
+
+    return CKR_OK;
+}
+
+static CK_RV snapshot_check(snapshot *snap, const char *storepath,
+        unsigned db_version) {
+
+    if (snap->size < sizeof(snap_header)) {
+        LOGW("Snapshot is truncated");
+        return CKR_GENERAL_ERROR;
+    }
+
+    const snap_header *hdr = snap->hdr = (const snap_header *)snap->base;
+
+    if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic))
+            || hdr->header_size != sizeof(snap_header)) {
+        LOGW("Not a snapshot file");
+        return CKR_GENERAL_ERROR;
+    }
+
+    if (hdr->version != SNAPSHOT_VERSION || hdr->endian != SNAPSHOT_ENDIAN
+            || hdr->ulong_size != sizeof(CK_ULONG)) {
+        LOGW("Snapshot version %u was not compiled for this library, "
+                "compile it again", hdr->version);
+        return CKR_GENERAL_ERROR;
+    }
+
+    if (hdr->db_version != db_version) {
+        LOGW("Snapshot is of store version %u, the store is at %u",
+                hdr->db_version, db_version);
+        return CKR_GENERAL_ERROR;
+    }
+
+    if (hdr->file_size != snap->size) {
+        LOGW("Snapshot is truncated");
+        return CKR_GENERAL_ERROR;
+    }
+
+    CK_RV rv = check_stamp(hdr, storepath);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    rv = check_digest(snap);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    snap->tokens = (const snap_token *)&snap->base[hdr->tokens_off];
+    snap->objects = (const snap_object *)&snap->base[hdr->objects_off];
+
+    rv = check_tables(snap);
+    if (rv != CKR_OK) {
+        LOGW("Snapshot tables are damaged");
+    }
+
+    return rv;
+}
+
+CK_RV snapshot_open(const char *path, const char *storepath,
+        unsigned db_version, snapshot **snap) {
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return CKR_TOKEN_NOT_PRESENT;
+        }
+        LOGW("Could not open snapshot \"%s\": %s", path, strerror(errno));
+        return CKR_GENERAL_ERROR;
+    }
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+
+    snapshot *s = calloc(1, sizeof(*s));
+    if (!s) {
+        LOGE("oom");
+        rv = CKR_HOST_MEMORY;
+        goto error;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb)) {
+        LOGW("Could not stat snapshot \"%s\": %s", path, strerror(errno));
+        goto error;
+    }
+
+    if (sb.st_size < (off_t)sizeof(snap_header)) {
+        LOGW("Snapshot \"%s\" is truncated", path);
+        goto error;
+    }
+
+    s->size = sb.st_size;
+    void *base = mmap(NULL, s->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        LOGW("Could not map snapshot \"%s\": %s", path, strerror(errno));
+        goto error;
+    }
+    s->base = base;
+
+    rv = snapshot_check(s, storepath, db_version);
+    if (rv != CKR_OK) {
+        goto error;
+    }
+
+    LOGV("Using snapshot \"%s\" of %u tokens and %u objects", path,
+            s->hdr->token_count, s->hdr->object_count);
+
+    close(fd);
+    *snap = s;
+
+    return CKR_OK;
+
+error:
+    close(fd);
+    snapshot_close(s);
+    return rv;
+}
+
+static const snap_token *find_token(snapshot *snap, unsigned id) {
+
+    size_t lo = 0;
+    size_t hi = snap->hdr->token_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const snap_token *t = &snap->tokens[mid];
+        if (t->id == id) {
+            return t;
+        }
+        if (t->id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return NULL;
+}
+
+static tobject *snapshot_tobject_new(snapshot *snap, const snap_object *o) {
+
+    tobject *tobj = tobject_new();
+    if (!tobj) {
+        LOGE("oom");
+        return NULL;
+    }
+
+    tobj->id = o->id;
+
+    CK_ATTRIBUTE_PTR attrs = calloc(o->attr_count ? o->attr_count : 1,
+            sizeof(*attrs));
+    if (!attrs) {
+        LOGE("oom");
+        goto error;
+    }
+
+    const snap_attr *sattrs = (const snap_attr *)&snap->base[o->attrs_off];
+
+    uint32_t i;
+    for (i=0; i < o->attr_count; i++) {
+        attrs[i].type = sattrs[i].type;
+        attrs[i].ulValueLen = sattrs[i].len;
+        attrs[i].pValue = sattrs[i].value_off ?
+                (void *)&snap->base[sattrs[i].value_off] : NULL;
+    }
+
+    tobj->attrs = attr_list_new_mapped(attrs, o->attr_count);
+    if (!tobj->attrs) {
+        free(attrs);
+        goto error;
+    }
+
+    CK_RV rv = object_init_from_attrs(tobj);
+    if (rv != CKR_OK) {
+        LOGE("Object initialization failed");
+        goto error;
+    }
+
+    return tobj;
+
+error:
+    tobject_free(tobj);
+    return NULL;
+}
+
+CK_RV snapshot_load_tobjects(snapshot *snap, token *tok) {
+
+    const snap_token *t = find_token(snap, tok->id);
+    if (!t) {
+        return CKR_TOKEN_NOT_PRESENT;
+    }
+
+    uint32_t i;
+    for (i=0; i < t->object_count; i++) {
+
+        tobject *tobj = snapshot_tobject_new(snap,
+                &snap->objects[t->first_object + i]);
+        if (!tobj) {
+            return CKR_GENERAL_ERROR;
+        }
+
+        CK_RV rv = token_add_tobject_last(tok, tobj);
+        if (rv != CKR_OK) {
+            tobject_free(tobj);
+            return rv;
+        }
+    }
+
+    LOGV("Loaded %u objects of token %u from the snapshot",
+            t->object_count, tok->id);
+
+    return CKR_OK;
+}
+
+void snapshot_close(snapshot *snap) {
+
+    if (!snap) {
+        return;
+    }
+
+    if (snap->base) {
+        munmap((void *)snap->base, snap->size);
+    }
+
+    free(snap);
+}
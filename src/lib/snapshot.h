@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef SRC_LIB_SNAPSHOT_H_
+#define SRC_LIB_SNAPSHOT_H_
+
+#include "pkcs11.h"
+#include "token.h"
+
+/*
+ * TPM2_PKCS11_SNAPSHOT names the snapshot file, an empty value disables
+ * it. It defaults to tpm2_pkcs11.snapshot next to the store.
+ */
+#define SNAPSHOT_ENV_VAR "TPM2_PKCS11_SNAPSHOT"
+#define SNAPSHOT_NAME    "tpm2_pkcs11.snapshot"
+
+/*
+ * A precompiled, read only copy of the objects of a store's tokens, made
+ * with "tpm2_ptool snapshot". It is mapped and the attribute values of the
+ * objects point into the mapping, so loading a token is no sqlite read and
+ * no YAML decode per object, and processes share the pages. An object is
+ * copied to the heap when it is modified, see attr_list_new_mapped().
+ *
+ * Each snapshot records the size, modification time and sqlite change
+ * counter of the store it was compiled from, and is only used while the
+ * store is unchanged. Tokens it doesn't hold are read from the store.
+ *
+ * The file is little endian, with every table and value 8 byte aligned:
+ *
+ *   header   magic "TPM2SNAP", version, the store stamp, the tables and
+ *            a SHA256 of the file without the digest
+ *   tokens   { id, object count, first object } sorted by id
+ *   objects  { id, token id, attribute count, attributes } sorted by
+ *            token id and id
+ *   attrs    { type, length, value } per object, in store order
+ *   values   each followed by its typed memory type byte
+ */
+typedef struct snapshot snapshot;
+
+/**
+ * Maps and checks a snapshot.
+ * @param path
+ *  The snapshot file.
+ * @param storepath
+ *  The store file the snapshot must match.
+ * @param db_version
+ *  The schema version the store is at.
+ * @param snap
+ *  The snapshot, free with snapshot_close().
+ * @return
+ *  CKR_OK on success, CKR_TOKEN_NOT_PRESENT if there is no snapshot file,
+ *  CKR_GENERAL_ERROR if it is damaged or doesn't match the store.
+ */
+CK_RV snapshot_open(const char *path, const char *storepath,
+        unsigned db_version, snapshot **snap);
+
+/**
+ * Adds the objects of a token from the snapshot.
+ * @param snap
+ *  The snapshot, which must stay open while the objects exist.
+ * @param tok
+ *  The token to add to, by its id.
+ * @return
+ *  CKR_OK on success, CKR_TOKEN_NOT_PRESENT if the snapshot doesn't hold
+ *  the token, anything else is an error.
+ */
+CK_RV snapshot_load_tobjects(snapshot *snap, token *tok);
+
+/**
+ * Unmaps a snapshot. It is safe to pass NULL.
+ * @param snap
+ *  The snapshot to close.
+ */
+void snapshot_close(snapshot *snap);
+
+#endif /* SRC_LIB_SNAPSHOT_H_ */
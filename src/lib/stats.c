@@ -0,0 +1,366 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include "config.h"
+#include <inttypes.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "stats.h"
+#include "utils.h"
+
+struct stats_shard {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t sum_ns[STATS_TIME_MAX];
+    uint64_t buckets[STATS_TIME_MAX][STATS_BUCKETS];
+};
+
+static bool _g_enabled;
+static char *_g_report_path;
+static stats_site *_g_sites;
+static unsigned _g_next_shard;
+static volatile sig_atomic_t _g_report_pending;
+
+/*
+ * Per thread state, the shard a thread records into and the wait times
+ * accumulated during the entry point it is currently in.
+ */
+static __thread unsigned _tl_shard = UINT32_MAX;
+static __thread uint64_t _tl_tpm_start;
+static __thread uint64_t _tl_tpm_ns;
+static __thread uint64_t _tl_lock_ns;
+
+#define ATOMIC_ADD(p, v) __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#define ATOMIC_GET(p)    __atomic_load_n(p, __ATOMIC_RELAXED)
+
+bool stats_enabled(void) {
+    return __atomic_load_n(&_g_enabled, __ATOMIC_ACQUIRE);
+}
+
+static uint64_t clock_ns(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t stats_now(void) {
+
+    if (!stats_enabled()) {
+        return 0;
+    }
+
+    /* never hand out 0, it means disabled to the callers */
+    uint64_t now = clock_ns();
+    return now ? now : 1;
+}
+
+static void on_report_signal(int sig) {
+    UNUSED(sig);
+    _g_report_pending = 1;
+}
+
+void stats_init(void) {
+
+    if (stats_enabled()) {
+        return;
+    }
+
+    const char *path = getenv(STATS_ENV_VAR);
+    if (!path || !path[0]) {
+        return;
+    }
+
+    _g_report_path = strdup(path);
+    if (!_g_report_path) {
+        LOGE("oom");
+        return;
+    }
+
+    const char *sig = getenv(STATS_SIGNAL_ENV_VAR);
+    if (sig) {
+        int signo = atoi(sig);
+        struct sigaction sa = { 0 };
+        sa.sa_handler = on_report_signal;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (signo <= 0 || sigaction(signo, &sa, NULL)) {
+            LOGW("Could not install statistics handler for signal \"%s\"", sig);
+        }
+    }
+
+    __atomic_store_n(&_g_enabled, true, __ATOMIC_RELEASE);
+}
+
+static unsigned get_shard(void) {
+
+    if (_tl_shard == UINT32_MAX) {
+        _tl_shard = ATOMIC_ADD(&_g_next_shard, 1) % STATS_SHARDS;
+    }
+
+    return _tl_shard;
+}
+
+static stats_shard *get_shards(stats_site *site) {
+
+    stats_shard *shards = __atomic_load_n(&site->shards, __ATOMIC_ACQUIRE);
+    if (shards) {
+        return shards;
+    }
+
+    stats_shard *fresh = calloc(STATS_SHARDS, sizeof(*fresh));
+    if (!fresh) {
+        LOGE("oom");
+        return NULL;
+    }
+
+    if (!__atomic_compare_exchange_n(&site->shards, &shards, fresh, false,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        /* another thread won, use theirs */
+        free(fresh);
+        return shards;
+    }
+
+    /* first use of the site, publish it for the report */
+    stats_site *head = __atomic_load_n(&_g_sites, __ATOMIC_ACQUIRE);
+    do {
+        site->next = head;
+    } while (!__atomic_compare_exchange_n(&_g_sites, &head, site, true,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    return fresh;
+}
+
+static unsigned ns_to_bucket(uint64_t ns) {
+
+    uint64_t us = ns / 1000;
+    if (!us) {
+        return 0;
+    }
+
+    unsigned b = 63 - __builtin_clzll(us);
+    return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+static void record(stats_site *site, CK_RV rv, const uint64_t ns[STATS_TIME_MAX]) {
+
+    stats_shard *shards = get_shards(site);
+    if (!shards) {
+        return;
+    }
+
+    stats_shard *s = &shards[get_shard()];
+
+    ATOMIC_ADD(&s->calls, 1);
+    if (rv) {
+        ATOMIC_ADD(&s->errors, 1);
+    }
+
+    unsigned i;
+    for (i=0; i < STATS_TIME_MAX; i++) {
+        if (!ns[i]) {
+            continue;
+        }
+        ATOMIC_ADD(&s->sum_ns[i], ns[i]);
+        ATOMIC_ADD(&s->buckets[i][ns_to_bucket(ns[i])], 1);
+    }
+}
+
+static void report_to_destination(void) {
+
+    if (!_g_report_path) {
+        return;
+    }
+
+    bool is_stderr = !strcmp(_g_report_path, "stderr");
+    FILE *f = is_stderr ? stderr : fopen(_g_report_path, "a");
+    if (!f) {
+        LOGW("Could not open statistics report \"%s\"", _g_report_path);
+        return;
+    }
+
+    stats_report(f);
+
+    if (!is_stderr) {
+        fclose(f);
+    }
+}
+
+uint64_t stats_call_begin(void) {
+
+    uint64_t start = stats_now();
+    if (start) {
+        _tl_tpm_ns = _tl_lock_ns = 0;
+    }
+
+    return start;
+}
+
+void stats_call_end(stats_site *site, uint64_t start, CK_RV rv) {
+
+    /* collection was off when the call started, or finalize raced us */
+    if (!start || !stats_enabled()) {
+        return;
+    }
+
+    uint64_t elapsed = clock_ns() - start;
+    uint64_t waited = _tl_tpm_ns + _tl_lock_ns;
+
+    uint64_t ns[STATS_TIME_MAX] = {
+        [STATS_TIME_HOST] = elapsed > waited ? elapsed - waited : 0,
+        [STATS_TIME_TPM]  = _tl_tpm_ns,
+        [STATS_TIME_LOCK] = _tl_lock_ns,
+    };
+
+    record(site, rv, ns);
+
+    if (_g_report_pending) {
+        _g_report_pending = 0;
+        report_to_destination();
+    }
+}
+
+void stats_tpm_begin(void) {
+    _tl_tpm_start = stats_now();
+}
+
+uint32_t stats_tpm_end(stats_site *site, uint32_t rc) {
+
+    if (!_tl_tpm_start || !stats_enabled()) {
+        return rc;
+    }
+
+    uint64_t ns[STATS_TIME_MAX] = {
+        [STATS_TIME_TPM] = clock_ns() - _tl_tpm_start,
+    };
+
+    _tl_tpm_start = 0;
+    _tl_tpm_ns += ns[STATS_TIME_TPM];
+
+    record(site, rc, ns);
+
+    return rc;
+}
+
+void stats_lock_wait(uint64_t start) {
+
+    if (!start) {
+        return;
+    }
+
+    _tl_lock_ns += clock_ns() - start;
+}
+
+void stats_site_snapshot(stats_site *site, stats_snapshot *snap) {
+
+    memset(snap, 0, sizeof(*snap));
+
+    stats_shard *shards = __atomic_load_n(&site->shards, __ATOMIC_ACQUIRE);
+    if (!shards) {
+        return;
+    }
+
+    unsigned i;
+    for (i=0; i < STATS_SHARDS; i++) {
+        stats_shard *s = &shards[i];
+        snap->calls += ATOMIC_GET(&s->calls);
+        snap->errors += ATOMIC_GET(&s->errors);
+
+        unsigned t;
+        for (t=0; t < STATS_TIME_MAX; t++) {
+            snap->sum_ns[t] += ATOMIC_GET(&s->sum_ns[t]);
+
+            unsigned b;
+            for (b=0; b < STATS_BUCKETS; b++) {
+                snap->buckets[t][b] += ATOMIC_GET(&s->buckets[t][b]);
+            }
+        }
+    }
+}
+
+/*
+ * Returns the upper bound in microseconds of the bucket holding the
+ * given percentile.
+ */
+static uint64_t percentile_us(const uint64_t buckets[STATS_BUCKETS], uint64_t total, unsigned pct) {
+
+    uint64_t want = (total * pct + 99) / 100;
+    uint64_t seen = 0;
+
+    unsigned b;
+    for (b=0; b < STATS_BUCKETS - 1; b++) {
+        seen += buckets[b];
+        if (seen >= want) {
+            break;
+        }
+    }
+
+    return 2ULL << b;
+}
+
+void stats_report(FILE *f) {
+
+    static const char *names[STATS_TIME_MAX] = {
+        [STATS_TIME_HOST] = "host",
+        [STATS_TIME_TPM]  = "tpm",
+        [STATS_TIME_LOCK] = "lock",
+    };
+
+    fprintf(f, "# tpm2-pkcs11 statistics\n");
+
+    stats_site *site = __atomic_load_n(&_g_sites, __ATOMIC_ACQUIRE);
+    for (; site; site = site->next) {
+
+        stats_snapshot snap;
+        stats_site_snapshot(site, &snap);
+
+        fprintf(f, "%s: calls=%"PRIu64" errors=%"PRIu64"\n",
+                site->name, snap.calls, snap.errors);
+
+        unsigned t;
+        for (t=0; t < STATS_TIME_MAX; t++) {
+
+            uint64_t samples = 0;
+            unsigned b;
+            for (b=0; b < STATS_BUCKETS; b++) {
+                samples += snap.buckets[t][b];
+            }
+
+            if (!samples) {
+                continue;
+            }
+
+            fprintf(f, "  %s: total_us=%"PRIu64" p50<%"PRIu64"us p99<%"PRIu64"us buckets:",
+                    names[t], snap.sum_ns[t] / 1000,
+                    percentile_us(snap.buckets[t], samples, 50),
+                    percentile_us(snap.buckets[t], samples, 99));
+
+            for (b=0; b < STATS_BUCKETS; b++) {
+                if (snap.buckets[t][b]) {
+                    fprintf(f, " %u:%"PRIu64, b, snap.buckets[t][b]);
+                }
+            }
+
+            fprintf(f, "\n");
+        }
+    }
+
+    fflush(f);
+}
+
+void stats_finalize(void) {
+
+    if (!stats_enabled()) {
+        return;
+    }
+
+    report_to_destination();
+
+    __atomic_store_n(&_g_enabled, false, __ATOMIC_RELEASE);
+
+    free(_g_report_path);
+    _g_report_path = NULL;
+}
@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef SRC_LIB_STATS_H_
+#define SRC_LIB_STATS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "pkcs11.h"
+
+/*
+ * Environment variables controlling the statistics subsystem.
+ *
+ * TPM2_PKCS11_STATS enables collection and names where the report goes
+ * at C_Finalize, either a file path or "stderr".
+ *
+ * TPM2_PKCS11_STATS_SIGNAL optionally names a signal number, upon which
+ * the report is written by the next thread leaving an entry point.
+ */
+#define STATS_ENV_VAR        "TPM2_PKCS11_STATS"
+#define STATS_SIGNAL_ENV_VAR "TPM2_PKCS11_STATS_SIGNAL"
+
+/*
+ * Counters are spread over this many shards, threads pick one when they
+ * first record something so concurrent callers rarely share a cache line.
+ */
+#define STATS_SHARDS 8
+
+/*
+ * Histogram bucket i counts samples in [2^i, 2^(i+1)) microseconds,
+ * bucket 0 also holds everything under a microsecond.
+ */
+#define STATS_BUCKETS 32
+
+typedef enum stats_time stats_time;
+enum stats_time {
+    STATS_TIME_HOST = 0, /** time spent in the library itself */
+    STATS_TIME_TPM,      /** time waiting on TPM commands */
+    STATS_TIME_LOCK,     /** time waiting on locks */
+    STATS_TIME_MAX
+};
+
+typedef struct stats_shard stats_shard;
+
+typedef struct stats_site stats_site;
+struct stats_site {
+    const char *name;
+    stats_shard *shards;
+    stats_site *next;
+};
+
+/**
+ * Initializer for a static stats_site.
+ */
+#define STATS_SITE_INIT(n) { .name = n, .shards = NULL, .next = NULL }
+
+typedef struct stats_snapshot stats_snapshot;
+struct stats_snapshot {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t sum_ns[STATS_TIME_MAX];
+    uint64_t buckets[STATS_TIME_MAX][STATS_BUCKETS];
+};
+
+/**
+ * Enables collection if STATS_ENV_VAR is set. Safe to call more
+ * than once.
+ */
+void stats_init(void);
+
+/**
+ * Writes the report if collection is enabled and disables collection.
+ * Counters persist, so a later stats_init() keeps accumulating.
+ */
+void stats_finalize(void);
+
+/**
+ * @return
+ *  true if statistics are being collected.
+ */
+bool stats_enabled(void);
+
+/**
+ * Marks the start of an entry point on the calling thread.
+ * @return
+ *  The start time, 0 when collection is disabled.
+ */
+uint64_t stats_call_begin(void);
+
+/**
+ * Records a completed entry point. The TPM and lock wait time gathered
+ * on this thread since stats_call_begin() is subtracted from the
+ * elapsed time to yield the host time.
+ * @param site
+ *  The site to record against.
+ * @param start
+ *  The value returned from stats_call_begin().
+ * @param rv
+ *  The result of the call, anything but CKR_OK counts as an error.
+ */
+void stats_call_end(stats_site *site, uint64_t start, CK_RV rv);
+
+/**
+ * Marks the start of a TPM command on the calling thread.
+ */
+void stats_tpm_begin(void);
+
+/**
+ * Records a completed TPM command against site and adds its duration to
+ * the TPM wait time of the enclosing entry point.
+ * @param site
+ *  The site to record against.
+ * @param rc
+ *  The TSS2_RC of the command, non-zero counts as an error.
+ * @return
+ *  rc, so calls can be wrapped inline.
+ */
+uint32_t stats_tpm_end(stats_site *site, uint32_t rc);
+
+/**
+ * Adds the time since start to the lock wait time of the enclosing
+ * entry point.
+ * @param start
+ *  The value of stats_now() before the lock was requested.
+ */
+void stats_lock_wait(uint64_t start);
+
+/**
+ * @return
+ *  The monotonic clock in nanoseconds, or 0 if collection is disabled.
+ */
+uint64_t stats_now(void);
+
+/**
+ * Aggregates the shards of a site.
+ * @param site
+ *  The site to aggregate.
+ * @param snap
+ *  The aggregated counters.
+ */
+void stats_site_snapshot(stats_site *site, stats_snapshot *snap);
+
+/**
+ * Writes a report of every site that has recorded something.
+ * @param f
+ *  The stream to write to.
+ */
+void stats_report(FILE *f);
+
+#endif /* SRC_LIB_STATS_H_ */
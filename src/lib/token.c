@@ -10,14 +10,17 @@
 #include "attrs.h"
 #include "backend.h"
 #include "checks.h"
+#include "event.h"
 #include "list.h"
 #include "mech.h"
 #include "object.h"
 #include "pkcs11.h"
+#include "profile.h"
 #include "session.h"
 #include "session_table.h"
 #include "slot.h"
 #include "token.h"
+#include "trace.h"
 #include "utils.h"
 
 static const CK_UTF8CHAR TPM2_TOKEN_SERIAL_NUMBER[] = "0000000000000000";
@@ -56,7 +59,10 @@ WEAK CK_RV token_min_init(token *t) {
     /*
      * Initialize the per-token tpm context
      */
+    profile_span span = profile_begin(profile_phase_backend_ctx_new,
+            PROFILE_TOKEN_INHERIT);
     rv = backend_ctx_new(t);
+    profile_end(&span);
     if (rv != CKR_OK) {
         LOGE("Could not initialize tpm ctx: 0x%lx", rv);
         return rv;
@@ -65,7 +71,9 @@ WEAK CK_RV token_min_init(token *t) {
     /*
      * Initialize the per-token mechanism details table
      */
+    span = profile_begin(profile_phase_mdetail_new, PROFILE_TOKEN_INHERIT);
     rv = mdetail_new(t->tctx, &t->mdtl, t->config.pss_sigs_good);
+    profile_end(&span);
     if (rv != CKR_OK) {
         LOGE("Could not initialize tpm mdetails: 0x%lx", rv);
         return rv;
@@ -91,6 +99,48 @@ void token_reset(token *t) {
      */
 }
 
+CK_RV token_after_fork(token *t) {
+
+    bool had_session = tpm_session_active(t->tctx);
+
+    /* on failure the token is left without a TPM connection, never the parent's */
+    CK_RV rv = backend_token_after_fork(t);
+    if (rv != CKR_OK) {
+        LOGE("Could not reopen token %u after fork: 0x%lx", t->id, rv);
+    }
+
+    /* the inherited mutex is held, the fork happened under it */
+    void *mutex = NULL;
+    CK_RV rv2 = mutex_create(&mutex);
+    if (rv2 != CKR_OK) {
+        LOGE("Could not initialize mutex: 0x%lx", rv2);
+        return rv2;
+    }
+    t->mutex = mutex;
+
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    /* loaded objects belong to the old context, load_object() reloads them */
+    list *cur = t->tobjects.head ? &t->tobjects.head->l : NULL;
+    while (cur) {
+        tobject *tobj = list_entry(cur, tobject, l);
+        tobj->tpm_esys_tr = 0;
+        cur = cur->next;
+    }
+
+    /* a logged in token keeps its HMAC session */
+    if (had_session) {
+        rv = tpm_session_start(t->tctx, t->pobject.objauth, t->pobject.handle);
+        if (rv != CKR_OK) {
+            LOGE("Could not restart the session of token %u: 0x%lx", t->id, rv);
+        }
+    }
+
+    return rv;
+}
+
 void token_free_list(token **tok_ptr, size_t *ptr_len) {
 
     size_t len = *ptr_len;
@@ -321,6 +371,10 @@ CK_RV token_get_info (token *t, CK_TOKEN_INFO *info) {
         info->flags |= CKF_USER_PIN_INITIALIZED;
     }
 
+    if (backend_is_readonly(t)) {
+        info->flags |= CKF_WRITE_PROTECTED;
+    }
+
     // Identification
     str_padded_copy(info->label, t->label);
     str_padded_copy(info->serialNumber, TPM2_TOKEN_SERIAL_NUMBER);
@@ -375,6 +429,11 @@ CK_RV token_init(token *t, CK_BYTE_PTR pin, CK_ULONG pin_len, CK_BYTE_PTR label)
         return CKR_ARGUMENTS_BAD;
     }
 
+    if (backend_is_readonly(t)) {
+        LOGE("Cannot initialize a token in a read only store");
+        return CKR_TOKEN_WRITE_PROTECTED;
+    }
+
     twist sopin = twistbin_new(pin, pin_len);
     if (!sopin) {
         LOGE("oom");
@@ -403,6 +462,8 @@ CK_RV token_init(token *t, CK_BYTE_PTR pin, CK_ULONG pin_len, CK_BYTE_PTR label)
     /* Ownership of newsalthex is transferred in the previous call */
     newsalthex = NULL;
 
+    event_post(t->id);
+
     rv = slot_add_uninit_token();
     if (rv != CKR_OK) {
         LOGW("Could not add uninitialized token");
@@ -456,6 +517,11 @@ CK_RV token_setpin(token *tok, CK_UTF8CHAR_PTR oldpin, CK_ULONG oldlen, CK_UTF8C
 
     bool is_so = token_is_so_logged_in(tok);
 
+    if (backend_is_readonly(tok)) {
+        LOGE("Cannot change a PIN in a read only store");
+        return CKR_TOKEN_WRITE_PROTECTED;
+    }
+
     toldpin = twistbin_new(oldpin, oldlen);
     if (!toldpin) {
         rv = CKR_HOST_MEMORY;
@@ -514,6 +580,11 @@ CK_RV token_initpin(token *tok, CK_UTF8CHAR_PTR newpin, CK_ULONG newlen) {
 
     twist sealdata = NULL;
 
+    if (backend_is_readonly(tok)) {
+        LOGE("Cannot initialize a user PIN in a read only store");
+        return CKR_TOKEN_WRITE_PROTECTED;
+    }
+
     tnewpin = twistbin_new(newpin, newlen);
     if (!tnewpin) {
         LOGE("oom");
@@ -576,7 +647,7 @@ out:
     return rv;
 }
 
-CK_RV token_load_object(token *tok, CK_OBJECT_HANDLE key, tobject **loaded_tobj) {
+static CK_RV load_object(token *tok, CK_OBJECT_HANDLE key, tobject **loaded_tobj) {
     CK_RV rv;
     tpm_ctx *tpm = tok->tctx;
 
@@ -677,3 +748,14 @@ CK_RV token_load_object(token *tok, CK_OBJECT_HANDLE key, tobject **loaded_tobj)
     *loaded_tobj = tobj;
     return CKR_OK;
 }
+
+CK_RV token_load_object(token *tok, CK_OBJECT_HANDLE key, tobject **loaded_tobj) {
+
+    TRACE(object_load_begin, NULL, key);
+
+    CK_RV rv = load_object(tok, key, loaded_tobj);
+
+    TRACE(object_load_end, NULL, rv);
+
+    return rv;
+}
@@ -71,6 +71,7 @@ enum token_type {
 };
 
 typedef struct mdetail mdetail;
+typedef struct attr_cache attr_cache;
 
 typedef struct token token;
 struct token {
@@ -88,6 +89,7 @@ struct token {
     union { /* anon union for backend data */
         struct {
             sealobject sealobject;
+            attr_cache *attr_cache; /* recently read values left in the store */
         } esysdb; /* esysdb */
         struct {
             void *ctx;
@@ -222,6 +224,18 @@ CK_RV token_load_object(token *tok, CK_OBJECT_HANDLE key, tobject **loaded_tobj)
 CK_RV token_min_init(token *t);
 void token_reset(token *t);
 
+/**
+ * Makes a token inherited over fork() usable in the child: a new mutex, its
+ * own TPM connection and HMAC session, and the loaded objects marked
+ * unloaded so they reload on first use. The parsed token and object state
+ * is kept. Operations started before the fork must be started again.
+ * @param t
+ *  The token, no thread of the child may be using it.
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV token_after_fork(token *t);
+
 CK_RV token_init(token *t, CK_BYTE_PTR pin, CK_ULONG pin_len, CK_BYTE_PTR label);
 
 void pobject_config_free(pobject_config *c);
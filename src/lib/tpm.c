@@ -32,13 +32,96 @@
 #include "log.h"
 #include "mutex.h"
 #include "pkcs11.h"
+#include "profile.h"
 #include "ssl_util.h"
+#include "stats.h"
 #include "tpm.h"
+#include "trace.h"
 
 #ifndef ESAPI_MANAGE_FLAGS
 #define ESAPI_MANAGE_FLAGS 0
 #endif
 
+/*
+ * Every ESAPI call that talks to the TPM is routed through ESYS_TIMED so
+ * the statistics, tracing and startup profiling subsystems can attribute
+ * TPM wait time. The wrappers are function like macros named after the
+ * ESAPI call, so call sites stay untouched and a name is not expanded
+ * again inside its own wrapper.
+ */
+static inline void esys_begin(stats_site *site) {
+    TRACE(esys_begin, site->name, 0);
+    stats_tpm_begin();
+    profile_tpm_begin();
+}
+
+static inline TSS2_RC esys_end(stats_site *site, TSS2_RC rc) {
+    profile_tpm_end();
+    stats_tpm_end(site, rc);
+    TRACE(esys_end, site->name, rc);
+    return rc;
+}
+
+#define ESYS_TIMED(fn, ...) \
+    (esys_begin(&_stats_##fn), esys_end(&_stats_##fn, fn(__VA_ARGS__)))
+
+#define ESYS_STATS_SITE(fn) \
+    static stats_site _stats_##fn = STATS_SITE_INIT(#fn)
+
+ESYS_STATS_SITE(Esys_ContextLoad);
+ESYS_STATS_SITE(Esys_Create);
+ESYS_STATS_SITE(Esys_CreateLoaded);
+ESYS_STATS_SITE(Esys_CreatePrimary);
+ESYS_STATS_SITE(Esys_ECDH_ZGen);
+ESYS_STATS_SITE(Esys_EncryptDecrypt);
+ESYS_STATS_SITE(Esys_EncryptDecrypt2);
+ESYS_STATS_SITE(Esys_EvictControl);
+ESYS_STATS_SITE(Esys_FlushContext);
+ESYS_STATS_SITE(Esys_GetCapability);
+ESYS_STATS_SITE(Esys_GetRandom);
+ESYS_STATS_SITE(Esys_HMAC);
+ESYS_STATS_SITE(Esys_HMAC_Start);
+ESYS_STATS_SITE(Esys_Load);
+ESYS_STATS_SITE(Esys_LoadExternal);
+ESYS_STATS_SITE(Esys_ObjectChangeAuth);
+ESYS_STATS_SITE(Esys_RSA_Decrypt);
+ESYS_STATS_SITE(Esys_ReadPublic);
+ESYS_STATS_SITE(Esys_SequenceComplete);
+ESYS_STATS_SITE(Esys_SequenceUpdate);
+ESYS_STATS_SITE(Esys_Sign);
+ESYS_STATS_SITE(Esys_StartAuthSession);
+ESYS_STATS_SITE(Esys_StirRandom);
+ESYS_STATS_SITE(Esys_TR_FromTPMPublic);
+ESYS_STATS_SITE(Esys_TestParms);
+ESYS_STATS_SITE(Esys_Unseal);
+
+#define Esys_ContextLoad(...) ESYS_TIMED(Esys_ContextLoad, __VA_ARGS__)
+#define Esys_Create(...) ESYS_TIMED(Esys_Create, __VA_ARGS__)
+#define Esys_CreateLoaded(...) ESYS_TIMED(Esys_CreateLoaded, __VA_ARGS__)
+#define Esys_CreatePrimary(...) ESYS_TIMED(Esys_CreatePrimary, __VA_ARGS__)
+#define Esys_ECDH_ZGen(...) ESYS_TIMED(Esys_ECDH_ZGen, __VA_ARGS__)
+#define Esys_EncryptDecrypt(...) ESYS_TIMED(Esys_EncryptDecrypt, __VA_ARGS__)
+#define Esys_EncryptDecrypt2(...) ESYS_TIMED(Esys_EncryptDecrypt2, __VA_ARGS__)
+#define Esys_EvictControl(...) ESYS_TIMED(Esys_EvictControl, __VA_ARGS__)
+#define Esys_FlushContext(...) ESYS_TIMED(Esys_FlushContext, __VA_ARGS__)
+#define Esys_GetCapability(...) ESYS_TIMED(Esys_GetCapability, __VA_ARGS__)
+#define Esys_GetRandom(...) ESYS_TIMED(Esys_GetRandom, __VA_ARGS__)
+#define Esys_HMAC(...) ESYS_TIMED(Esys_HMAC, __VA_ARGS__)
+#define Esys_HMAC_Start(...) ESYS_TIMED(Esys_HMAC_Start, __VA_ARGS__)
+#define Esys_Load(...) ESYS_TIMED(Esys_Load, __VA_ARGS__)
+#define Esys_LoadExternal(...) ESYS_TIMED(Esys_LoadExternal, __VA_ARGS__)
+#define Esys_ObjectChangeAuth(...) ESYS_TIMED(Esys_ObjectChangeAuth, __VA_ARGS__)
+#define Esys_RSA_Decrypt(...) ESYS_TIMED(Esys_RSA_Decrypt, __VA_ARGS__)
+#define Esys_ReadPublic(...) ESYS_TIMED(Esys_ReadPublic, __VA_ARGS__)
+#define Esys_SequenceComplete(...) ESYS_TIMED(Esys_SequenceComplete, __VA_ARGS__)
+#define Esys_SequenceUpdate(...) ESYS_TIMED(Esys_SequenceUpdate, __VA_ARGS__)
+#define Esys_Sign(...) ESYS_TIMED(Esys_Sign, __VA_ARGS__)
+#define Esys_StartAuthSession(...) ESYS_TIMED(Esys_StartAuthSession, __VA_ARGS__)
+#define Esys_StirRandom(...) ESYS_TIMED(Esys_StirRandom, __VA_ARGS__)
+#define Esys_TR_FromTPMPublic(...) ESYS_TIMED(Esys_TR_FromTPMPublic, __VA_ARGS__)
+#define Esys_TestParms(...) ESYS_TIMED(Esys_TestParms, __VA_ARGS__)
+#define Esys_Unseal(...) ESYS_TIMED(Esys_Unseal, __VA_ARGS__)
+
 #define DEFAULT_SEAL_TEMPLATE { \
         .size = 0, \
         .publicArea = { \
@@ -189,6 +272,7 @@ struct tpm_op_data {
     CK_KEY_TYPE op_type;
 
     mdetail *mdtl;
+    mdetail_entry *mech_entry;
     CK_MECHANISM mech;
 
     union {
@@ -217,8 +301,8 @@ struct tpm_op_data {
     };
 };
 
-static inline tpm_op_data *tpm_opdata_new(mdetail *mdtl, CK_MECHANISM_PTR mech) {
-    tpm_op_data *opdata = (tpm_op_data *)calloc(1, sizeof(tpm_op_data));
+static inline tpm_op_data *tpm_opdata_new(arena *a, mdetail *mdtl, CK_MECHANISM_PTR mech) {
+    tpm_op_data *opdata = (tpm_op_data *)arena_calloc(a, 1, sizeof(tpm_op_data));
     if (opdata) {
         opdata->mdtl = mdtl;
         opdata->mech = *mech;
@@ -468,6 +552,53 @@ CK_RV tpm_ctx_new(const char *config, tpm_ctx **tctx) {
     return tpm_ctx_new_fromtcti(tcti, tctx);
 }
 
+CK_RV tpm_ctx_reopen_fromtcti(tpm_ctx *ctx, void *tcti) {
+
+    /*
+     * The old contexts talk over a connection the parent still uses, so
+     * finalizing them here could end the parent's sessions. They leak,
+     * and on failure ctx is left without any rather than with them.
+     */
+    ctx->esys_ctx = NULL;
+    ctx->tcti_ctx = NULL;
+    ctx->hmac_session = 0;
+
+    ESYS_CONTEXT *esys = esys_ctx_init(tcti);
+    if (!esys) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    ctx->esys_ctx = esys;
+    ctx->tcti_ctx = tcti;
+
+    return CKR_OK;
+}
+
+CK_RV tpm_ctx_reopen(tpm_ctx *ctx, const char *config) {
+
+    TSS2_TCTI_CONTEXT *tcti = NULL;
+
+    if (!config) {
+        config = getenv(TPM2_PKCS11_TCTI);
+    }
+
+    LOGV("reopening tcti=%s", config ? config : "(null)");
+    TSS2_RC rc = Tss2_TctiLdr_Initialize(config, &tcti);
+    if (rc != TSS2_RC_SUCCESS) {
+        ctx->esys_ctx = NULL;
+        ctx->tcti_ctx = NULL;
+        ctx->hmac_session = 0;
+        return CKR_GENERAL_ERROR;
+    }
+
+    CK_RV rv = tpm_ctx_reopen_fromtcti(ctx, tcti);
+    if (rv != CKR_OK) {
+        Tss2_TctiLdr_Finalize(&tcti);
+    }
+
+    return rv;
+}
+
 static CK_RV tpm_get_properties(tpm_ctx *ctx, TPMS_CAPABILITY_DATA **d) {
 
     if (ctx->tpms_fixed_property_cache) {
@@ -1587,7 +1718,7 @@ static void set_common_opdata(tpm_op_data *opdata, tpm_ctx *tctx, tobject *tobj,
     opdata->op_type = key_type;
 }
 
-CK_RV tpm_rsa_oaep_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
+CK_RV tpm_rsa_oaep_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
     assert(outdata);
     assert(mech);
     UNUSED(m);
@@ -1624,7 +1755,7 @@ CK_RV tpm_rsa_oaep_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech,
     }
     */
 
-    tpm_op_data *opdata = tpm_opdata_new(m, mech);
+    tpm_op_data *opdata = tpm_opdata_new(a, m, mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1658,13 +1789,13 @@ CK_RV tpm_rsa_oaep_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech,
     return CKR_OK;
 }
 
-CK_RV tpm_rsa_pkcs_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
+CK_RV tpm_rsa_pkcs_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
     UNUSED(m);
     UNUSED(mech);
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new(m, mech);
+    tpm_op_data *opdata = tpm_opdata_new(a, m, mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1679,7 +1810,7 @@ CK_RV tpm_rsa_pkcs_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech,
     return CKR_OK;
 }
 
-CK_RV tpm_rsa_pss_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
+CK_RV tpm_rsa_pss_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
     UNUSED(m);
 
     check_pointer(mech);
@@ -1688,7 +1819,7 @@ CK_RV tpm_rsa_pss_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, t
     CK_RSA_PKCS_PSS_PARAMS_PTR params;
     SAFE_CAST(mech, params);
 
-    tpm_op_data *opdata = tpm_opdata_new(m, mech);
+    tpm_op_data *opdata = tpm_opdata_new(a, m, mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1720,14 +1851,14 @@ CK_RV tpm_rsa_pss_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, t
     return CKR_OK;
 }
 
-CK_RV tpm_rsa_pss_sha1_get_opdata(mdetail *mdtl,
+CK_RV tpm_rsa_pss_sha1_get_opdata(mdetail *mdtl, arena *a,
         tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
     UNUSED(mdtl);
     UNUSED(mech);
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new(mdtl, mech);
+    tpm_op_data *opdata = tpm_opdata_new(a, mdtl, mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1742,14 +1873,14 @@ CK_RV tpm_rsa_pss_sha1_get_opdata(mdetail *mdtl,
     return CKR_OK;
 }
 
-CK_RV tpm_rsa_pss_sha256_get_opdata(mdetail *mdtl,
+CK_RV tpm_rsa_pss_sha256_get_opdata(mdetail *mdtl, arena *a,
         tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
     UNUSED(mdtl);
     UNUSED(mech);
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new(mdtl, mech);
+    tpm_op_data *opdata = tpm_opdata_new(a, mdtl, mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1764,14 +1895,14 @@ CK_RV tpm_rsa_pss_sha256_get_opdata(mdetail *mdtl,
     return CKR_OK;
 }
 
-CK_RV tpm_rsa_pss_sha384_get_opdata(mdetail *mdtl,
+CK_RV tpm_rsa_pss_sha384_get_opdata(mdetail *mdtl, arena *a,
         tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
     UNUSED(mdtl);
     UNUSED(mech);
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new(mdtl, mech);
+    tpm_op_data *opdata = tpm_opdata_new(a, mdtl, mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1786,14 +1917,14 @@ CK_RV tpm_rsa_pss_sha384_get_opdata(mdetail *mdtl,
     return CKR_OK;
 }
 
-CK_RV tpm_rsa_pss_sha512_get_opdata(mdetail *mdtl,
+CK_RV tpm_rsa_pss_sha512_get_opdata(mdetail *mdtl, arena *a,
         tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
     UNUSED(mdtl);
     UNUSED(mech);
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new(mdtl, mech);
+    tpm_op_data *opdata = tpm_opdata_new(a, mdtl, mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1808,14 +1939,14 @@ CK_RV tpm_rsa_pss_sha512_get_opdata(mdetail *mdtl,
     return CKR_OK;
 }
 
-CK_RV tpm_rsa_pkcs_sha1_get_opdata(mdetail *mdtl,
+CK_RV tpm_rsa_pkcs_sha1_get_opdata(mdetail *mdtl, arena *a,
         tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
     UNUSED(mdtl);
     UNUSED(mech);
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new(mdtl, mech);
+    tpm_op_data *opdata = tpm_opdata_new(a, mdtl, mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1830,14 +1961,14 @@ CK_RV tpm_rsa_pkcs_sha1_get_opdata(mdetail *mdtl,
     return CKR_OK;
 }
 
-CK_RV tpm_rsa_pkcs_sha256_get_opdata(mdetail *mdtl,
+CK_RV tpm_rsa_pkcs_sha256_get_opdata(mdetail *mdtl, arena *a,
         tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
     UNUSED(mdtl);
     UNUSED(mech);
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new(mdtl, mech);
+    tpm_op_data *opdata = tpm_opdata_new(a, mdtl, mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1852,14 +1983,14 @@ CK_RV tpm_rsa_pkcs_sha256_get_opdata(mdetail *mdtl,
     return CKR_OK;
 }
 
-CK_RV tpm_rsa_pkcs_sha384_get_opdata(mdetail *mdtl,
+CK_RV tpm_rsa_pkcs_sha384_get_opdata(mdetail *mdtl, arena *a,
         tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
     UNUSED(mdtl);
     UNUSED(mech);
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new(mdtl, mech);
+    tpm_op_data *opdata = tpm_opdata_new(a, mdtl, mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1874,14 +2005,14 @@ CK_RV tpm_rsa_pkcs_sha384_get_opdata(mdetail *mdtl,
     return CKR_OK;
 }
 
-CK_RV tpm_rsa_pkcs_sha512_get_opdata(mdetail *mdtl,
+CK_RV tpm_rsa_pkcs_sha512_get_opdata(mdetail *mdtl, arena *a,
         tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
     UNUSED(mdtl);
     UNUSED(mech);
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new(mdtl, mech);
+    tpm_op_data *opdata = tpm_opdata_new(a, mdtl, mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1896,14 +2027,14 @@ CK_RV tpm_rsa_pkcs_sha512_get_opdata(mdetail *mdtl,
     return CKR_OK;
 }
 
-CK_RV tpm_ec_ecdsa_get_opdata(mdetail *mdtl,
+CK_RV tpm_ec_ecdsa_get_opdata(mdetail *mdtl, arena *a,
         tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
     UNUSED(mdtl);
     UNUSED(mech);
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new(mdtl, mech);
+    tpm_op_data *opdata = tpm_opdata_new(a, mdtl, mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1923,7 +2054,7 @@ CK_RV tpm_ec_ecdsa_get_opdata(mdetail *mdtl,
     return CKR_OK;
 }
 
-static CK_RV tpm_ec_ecdsa_get_opdata_common(mdetail *mdtl,
+static CK_RV tpm_ec_ecdsa_get_opdata_common(mdetail *mdtl, arena *a,
         tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj,
         TPMI_ALG_HASH halg, tpm_op_data **outdata) {
 
@@ -1932,7 +2063,7 @@ static CK_RV tpm_ec_ecdsa_get_opdata_common(mdetail *mdtl,
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new(mdtl, mech);
+    tpm_op_data *opdata = tpm_opdata_new(a, mdtl, mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -1948,10 +2079,10 @@ static CK_RV tpm_ec_ecdsa_get_opdata_common(mdetail *mdtl,
 }
 
 #define TPM_EC_ECDSA_GET_OPDATA(name, halg) \
-CK_RV tpm_ec_ecdsa_##name##_get_opdata(mdetail *mdtl, \
+CK_RV tpm_ec_ecdsa_##name##_get_opdata(mdetail *mdtl, arena *a, \
     tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, \
     tpm_op_data **outdata) { \
-    return tpm_ec_ecdsa_get_opdata_common(mdtl, tctx, mech, tobj, \
+    return tpm_ec_ecdsa_get_opdata_common(mdtl, a, tctx, mech, tobj, \
             halg, outdata); \
 }
 
@@ -1976,13 +2107,13 @@ static CK_RV aes_common_opdata(tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *to
     return CKR_OK;
 }
 
-CK_RV tpm_aes_cbc_get_opdata(mdetail *mdtl,
+CK_RV tpm_aes_cbc_get_opdata(mdetail *mdtl, arena *a,
         tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
     UNUSED(mdtl);
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new(mdtl, mech);
+    tpm_op_data *opdata = tpm_opdata_new(a, mdtl, mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -2000,13 +2131,13 @@ CK_RV tpm_aes_cbc_get_opdata(mdetail *mdtl,
     return CKR_OK;
 }
 
-CK_RV tpm_aes_cfb_get_opdata(mdetail *mdtl,
+CK_RV tpm_aes_cfb_get_opdata(mdetail *mdtl, arena *a,
         tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
     UNUSED(mdtl);
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new(mdtl, mech);
+    tpm_op_data *opdata = tpm_opdata_new(a, mdtl, mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -2024,13 +2155,13 @@ CK_RV tpm_aes_cfb_get_opdata(mdetail *mdtl,
     return CKR_OK;
 }
 
-CK_RV tpm_aes_ecb_get_opdata(mdetail *mdtl,
+CK_RV tpm_aes_ecb_get_opdata(mdetail *mdtl, arena *a,
         tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
     UNUSED(mdtl);
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new(mdtl, mech);
+    tpm_op_data *opdata = tpm_opdata_new(a, mdtl, mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -2048,7 +2179,7 @@ CK_RV tpm_aes_ecb_get_opdata(mdetail *mdtl,
     return CKR_OK;
 }
 
-CK_RV tpm_aes_ctr_get_opdata(mdetail *mdtl,
+CK_RV tpm_aes_ctr_get_opdata(mdetail *mdtl, arena *a,
         tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
     UNUSED(mdtl);
     assert(outdata);
@@ -2068,7 +2199,7 @@ CK_RV tpm_aes_ctr_get_opdata(mdetail *mdtl,
         return CKR_MECHANISM_PARAM_INVALID;
     }
 
-    tpm_op_data *opdata = tpm_opdata_new(mdtl, mech);
+    tpm_op_data *opdata = tpm_opdata_new(a, mdtl, mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -2098,14 +2229,14 @@ CK_RV tpm_aes_ctr_get_opdata(mdetail *mdtl,
     return CKR_OK;
 }
 
-CK_RV tpm_hmac_sha1_get_opdata(mdetail *mdtl,
+CK_RV tpm_hmac_sha1_get_opdata(mdetail *mdtl, arena *a,
         tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
     UNUSED(mdtl);
     UNUSED(mech);
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new(mdtl, mech);
+    tpm_op_data *opdata = tpm_opdata_new(a, mdtl, mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -2120,14 +2251,14 @@ CK_RV tpm_hmac_sha1_get_opdata(mdetail *mdtl,
     return CKR_OK;
 }
 
-CK_RV tpm_hmac_sha256_get_opdata(mdetail *mdtl,
+CK_RV tpm_hmac_sha256_get_opdata(mdetail *mdtl, arena *a,
         tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
     UNUSED(mdtl);
     UNUSED(mech);
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new(mdtl, mech);
+    tpm_op_data *opdata = tpm_opdata_new(a, mdtl, mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -2142,14 +2273,14 @@ CK_RV tpm_hmac_sha256_get_opdata(mdetail *mdtl,
     return CKR_OK;
 }
 
-CK_RV tpm_hmac_sha384_get_opdata(mdetail *mdtl,
+CK_RV tpm_hmac_sha384_get_opdata(mdetail *mdtl, arena *a,
         tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
     UNUSED(mdtl);
     UNUSED(mech);
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new(mdtl, mech);
+    tpm_op_data *opdata = tpm_opdata_new(a, mdtl, mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -2164,14 +2295,14 @@ CK_RV tpm_hmac_sha384_get_opdata(mdetail *mdtl,
     return CKR_OK;
 }
 
-CK_RV tpm_hmac_sha512_get_opdata(mdetail *mdtl,
+CK_RV tpm_hmac_sha512_get_opdata(mdetail *mdtl, arena *a,
         tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata) {
     UNUSED(mdtl);
     UNUSED(mech);
     assert(outdata);
     assert(mech);
 
-    tpm_op_data *opdata = tpm_opdata_new(mdtl, mech);
+    tpm_op_data *opdata = tpm_opdata_new(a, mdtl, mech);
     if (!opdata) {
         return CKR_HOST_MEMORY;
     }
@@ -2192,6 +2323,11 @@ void tpm_opdata_reset(tpm_op_data *opdata) {
     }
 }
 
+void tpm_opdata_set_mech_entry(tpm_op_data *opdata, mdetail_entry *d) {
+    assert(opdata);
+    opdata->mech_entry = d;
+}
+
 void tpm_opdata_free(tpm_op_data **opdata) {
 
     if (opdata) {
@@ -2201,11 +2337,87 @@ void tpm_opdata_free(tpm_op_data **opdata) {
             (*opdata)->sym.ctr.counter = NULL;
         }
 
-        free(*opdata);
+        arena_release(*opdata);
         *opdata = NULL;
     }
 }
 
+CK_RV tpm_opdata_dup(tpm_op_data *opdata, tpm_op_data **copy) {
+
+    assert(opdata);
+
+    /* the copy is short lived, keep it out of the operation's arena */
+    tpm_op_data *c = (tpm_op_data *)arena_calloc(NULL, 1, sizeof(*c));
+    if (!c) {
+        LOGE("oom");
+        return CKR_HOST_MEMORY;
+    }
+
+    *c = *opdata;
+
+    if (opdata->mech.mechanism == CKM_AES_CTR) {
+        c->sym.ctr.counter = BN_dup(opdata->sym.ctr.counter);
+        if (!c->sym.ctr.counter) {
+            LOGE("oom");
+            arena_release(c);
+            return CKR_HOST_MEMORY;
+        }
+    }
+
+    *copy = c;
+
+    return CKR_OK;
+}
+
+CK_RV tpm_opdata_message_begin(tpm_op_data *opdata, CK_VOID_PTR param, CK_ULONG param_len) {
+
+    assert(opdata);
+
+    /* only the chained AES modes carry state from one message to the next */
+    if (opdata->op_type != CKK_AES || opdata->sym.mode == TPM2_ALG_ECB) {
+        if (opdata->op_type == CKK_AES) {
+            tpm_opdata_reset(opdata);
+        }
+        return (param || param_len) ? CKR_MECHANISM_PARAM_INVALID : CKR_OK;
+    }
+
+    if (!param) {
+        LOGE("Mechanism 0x%lx needs a per message IV", opdata->mech.mechanism);
+        return CKR_MECHANISM_PARAM_INVALID;
+    }
+
+    if (opdata->sym.mode == TPM2_ALG_CTR) {
+        if (param_len != sizeof(CK_AES_CTR_PARAMS)) {
+            return CKR_MECHANISM_PARAM_INVALID;
+        }
+
+        CK_AES_CTR_PARAMS *params = (CK_AES_CTR_PARAMS *)param;
+        if (params->ulCounterBits != (8 * sizeof(params->cb))) {
+            LOGE("TPM Requires ulCounterBits to be %zu, got %lu", sizeof(params->cb),
+                    params->ulCounterBits);
+            return CKR_MECHANISM_PARAM_INVALID;
+        }
+
+        /* each message gets its own counter block, so wrap detection starts over */
+        BN_zero(opdata->sym.ctr.counter);
+
+        opdata->sym.iv.size = sizeof(params->cb);
+        memcpy(opdata->sym.iv.buffer, params->cb, sizeof(params->cb));
+    } else {
+        /* same rules as the IV given to the init call */
+        if (param_len > sizeof(opdata->sym.iv.buffer) || param_len % 8) {
+            return CKR_MECHANISM_PARAM_INVALID;
+        }
+
+        opdata->sym.iv.size = param_len;
+        memcpy(opdata->sym.iv.buffer, param, param_len);
+    }
+
+    tpm_opdata_reset(opdata);
+
+    return CKR_OK;
+}
+
 CK_RV tpm_rsa_decrypt(tpm_op_data *tpm_enc_data,
         CK_BYTE_PTR ctext, CK_ULONG ctextlen,
         CK_BYTE_PTR ptext, CK_ULONG_PTR ptextlen) {
@@ -2641,7 +2853,7 @@ static CK_RV common_final_encrypt_decrypt(int encdec, crypto_op_data *opdata,
              */
             CK_BYTE out[sizeof(opdata->tpm_opdata->sym.prev.data)];
             CK_ULONG outlen = sizeof(out);
-            rv = mech_synthesize(tpm_enc_data->mdtl,
+            rv = mech_synthesize(tpm_enc_data->mdtl, tpm_enc_data->mech_entry,
                     &tpm_enc_data->mech, tpm_enc_data->tobj->attrs,
                     opdata->tpm_opdata->sym.prev.data,
                     opdata->tpm_opdata->sym.prev.len,
@@ -2686,7 +2898,7 @@ static CK_RV common_final_encrypt_decrypt(int encdec, crypto_op_data *opdata,
             CK_BYTE out[sizeof(padded)];
             CK_ULONG outlen = sizeof(out);
 
-            rv = mech_unsynthesize(tpm_enc_data->mdtl,
+            rv = mech_unsynthesize(tpm_enc_data->mdtl, tpm_enc_data->mech_entry,
                     &tpm_enc_data->mech, tpm_enc_data->tobj->attrs,
                     padded,
                     padded_len,
@@ -2751,7 +2963,7 @@ CK_RV tpm_decrypt(crypto_op_data *opdata,
         }
 
         return mech_unsynthesize(
-                tpm_enc_data->mdtl,
+                tpm_enc_data->mdtl, tpm_enc_data->mech_entry,
                 &tpm_enc_data->mech, tpm_enc_data->tobj->attrs,
                 buf, buf_len,
                 ptext, ptextlen);
@@ -8,6 +8,7 @@
 
 #include <tss2/tss2_esys.h>
 
+#include "arena.h"
 #include "attrs.h"
 #include "debug.h"
 #include "object.h"
@@ -24,6 +25,7 @@ typedef struct tpm_op_data tpm_op_data;
 /* forward references */
 typedef union crypto_op_data crypto_op_data;
 typedef struct mdetail mdetail;
+typedef struct mdetail_entry mdetail_entry;
 typedef struct pobject pobject;
 
 
@@ -50,6 +52,26 @@ CK_RV tpm_ctx_new(const char *tcti, tpm_ctx **tctx);
 
 CK_RV tpm_ctx_new_fromtcti(void *tcti, tpm_ctx **tctx);
 
+/**
+ * Gives a context inherited over fork() its own TCTI and ESAPI contexts,
+ * keeping the cached TPM properties. The inherited contexts are left
+ * alone and the HMAC session is forgotten, as are the ESYS_TRs of
+ * everything loaded through the context. On failure the context has no
+ * connection and every TPM call through it fails.
+ * @param ctx
+ *  The tpm_ctx to reopen.
+ * @param tcti
+ *  An optional (can be null) tcti config string.
+ * @return
+ *  CKR_OK on success, anything else is a failure.
+ */
+CK_RV tpm_ctx_reopen(tpm_ctx *ctx, const char *tcti);
+
+/**
+ * Like tpm_ctx_reopen() with an already opened TCTI context.
+ */
+CK_RV tpm_ctx_reopen_fromtcti(tpm_ctx *ctx, void *tcti);
+
 /**
  * Retrieves Spec Version, FW Version, Manufacturer and Model from TPM
  * and populates the provided CK_TOKEN_INFO structure.
@@ -104,39 +126,75 @@ bool tpm_contextload_handle(tpm_ctx *ctx, twist handle_blob, uint32_t *handle);
 CK_RV tpm_sign(tpm_op_data *opdata, CK_BYTE_PTR data, CK_ULONG datalen, CK_BYTE_PTR sig, CK_ULONG_PTR siglen);
 CK_RV tpm_verify(tpm_op_data *opdata, CK_BYTE_PTR data, CK_ULONG datalen, CK_BYTE_PTR sig, CK_ULONG siglen);
 
-CK_RV tpm_rsa_pkcs_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
-CK_RV tpm_rsa_oaep_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
-CK_RV tpm_rsa_pss_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata);
-CK_RV tpm_rsa_pss_sha1_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
-CK_RV tpm_rsa_pss_sha256_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
-CK_RV tpm_rsa_pss_sha384_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
-CK_RV tpm_rsa_pss_sha512_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
-
-CK_RV tpm_rsa_pkcs_sha1_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
-CK_RV tpm_rsa_pkcs_sha256_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
-CK_RV tpm_rsa_pkcs_sha384_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
-CK_RV tpm_rsa_pkcs_sha512_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
-
-CK_RV tpm_ec_ecdsa_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
-CK_RV tpm_ec_ecdsa_sha1_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
-CK_RV tpm_ec_ecdsa_sha256_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
-CK_RV tpm_ec_ecdsa_sha384_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
-CK_RV tpm_ec_ecdsa_sha512_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
+CK_RV tpm_rsa_pkcs_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
+CK_RV tpm_rsa_oaep_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
+CK_RV tpm_rsa_pss_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata);
+CK_RV tpm_rsa_pss_sha1_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
+CK_RV tpm_rsa_pss_sha256_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
+CK_RV tpm_rsa_pss_sha384_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
+CK_RV tpm_rsa_pss_sha512_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
+
+CK_RV tpm_rsa_pkcs_sha1_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
+CK_RV tpm_rsa_pkcs_sha256_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
+CK_RV tpm_rsa_pkcs_sha384_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
+CK_RV tpm_rsa_pkcs_sha512_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
+
+CK_RV tpm_ec_ecdsa_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
+CK_RV tpm_ec_ecdsa_sha1_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
+CK_RV tpm_ec_ecdsa_sha256_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
+CK_RV tpm_ec_ecdsa_sha384_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
+CK_RV tpm_ec_ecdsa_sha512_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
 CK_RV tpm_ec_ecdh1_derive(tpm_ctx *tctx, tobject *tobj, unsigned char *pubkey, size_t pubkey_len, unsigned char **psec, size_t *pseclen);
 
-CK_RV tpm_aes_cbc_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
-CK_RV tpm_aes_cfb_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
-CK_RV tpm_aes_ecb_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
-CK_RV tpm_aes_ctr_get_opdata(mdetail *m, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata);
+CK_RV tpm_aes_cbc_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
+CK_RV tpm_aes_cfb_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
+CK_RV tpm_aes_ecb_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **opdata);
+CK_RV tpm_aes_ctr_get_opdata(mdetail *m, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata);
 
-CK_RV tpm_hmac_sha1_get_opdata(mdetail *mdtl, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata);
-CK_RV tpm_hmac_sha256_get_opdata(mdetail *mdtl, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata);
-CK_RV tpm_hmac_sha384_get_opdata(mdetail *mdtl, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata);
-CK_RV tpm_hmac_sha512_get_opdata(mdetail *mdtl, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata);
+CK_RV tpm_hmac_sha1_get_opdata(mdetail *mdtl, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata);
+CK_RV tpm_hmac_sha256_get_opdata(mdetail *mdtl, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata);
+CK_RV tpm_hmac_sha384_get_opdata(mdetail *mdtl, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata);
+CK_RV tpm_hmac_sha512_get_opdata(mdetail *mdtl, arena *a, tpm_ctx *tctx, CK_MECHANISM_PTR mech, tobject *tobj, tpm_op_data **outdata);
 
 void tpm_opdata_reset(tpm_op_data *opdata);
+
+/**
+ * Records the mechanism entry the operation was set up from, for the
+ * padding applied and removed by the final calls.
+ * @param opdata
+ *  The operation.
+ * @param d
+ *  The entry, see mech_resolve().
+ */
+void tpm_opdata_set_mech_entry(tpm_op_data *opdata, mdetail_entry *d);
 void tpm_opdata_free(tpm_op_data **opdata);
 
+/**
+ * Copies an operation's state, so work on the copy can be thrown away.
+ * @param opdata
+ *  The state to copy.
+ * @param copy
+ *  The copy, free with tpm_opdata_free().
+ * @return
+ *  CKR_OK on success.
+ */
+CK_RV tpm_opdata_dup(tpm_op_data *opdata, tpm_op_data **copy);
+
+/**
+ * Starts a new message on a PKCS#11 3.0 message based encrypt or decrypt
+ * operation, dropping any buffered partial block.
+ * @param opdata
+ *  The operation bound by the message init call.
+ * @param param
+ *  The per message parameter: the IV for AES CBC and CFB, a
+ *  CK_AES_CTR_PARAMS for AES CTR, and NULL for everything else.
+ * @param param_len
+ *  The size of param.
+ * @return
+ *  CKR_OK on success, CKR_MECHANISM_PARAM_INVALID on a bad parameter.
+ */
+CK_RV tpm_opdata_message_begin(tpm_op_data *opdata, CK_VOID_PTR param, CK_ULONG param_len);
+
 CK_RV tpm_encrypt(crypto_op_data *opdata, CK_BYTE_PTR ptext, CK_ULONG ptextlen, CK_BYTE_PTR ctext, CK_ULONG_PTR ctextlen);
 
 CK_RV tpm_final_encrypt(crypto_op_data *opdata, CK_BYTE_PTR last_part, CK_ULONG_PTR last_part_len);
@@ -0,0 +1,255 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include "config.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "trace.h"
+
+#define TRACE_LABEL_MAX 40
+
+typedef struct trace_event trace_event;
+struct trace_event {
+    uint64_t ts_ns;
+    uint64_t arg;
+    trace_probe probe;
+    char label[TRACE_LABEL_MAX];
+};
+
+typedef struct trace_ring trace_ring;
+struct trace_ring {
+    unsigned tid;
+    uint64_t count;
+    bool in_use;
+    trace_ring *next;
+    trace_event events[TRACE_RING_SIZE];
+};
+
+static const struct {
+    const char *name;
+    char phase;
+} _probes[trace_probe_max] = {
+#define X(n, p) [trace_probe_##n] = { .name = #n, .phase = p },
+    TRACE_PROBES(X)
+#undef X
+};
+
+bool _g_trace_ring_enabled;
+
+static char *_g_dump_path;
+static trace_ring *_g_rings;
+static unsigned _g_next_tid;
+
+/*
+ * Rings are owned by their thread but stay on the global list for the
+ * life of the process, so a thread that outlives C_Finalize never writes
+ * to freed memory and a later C_Initialize reuses them. When a thread
+ * exits its ring is handed back, its events are still dumped until a new
+ * thread takes it over, so threads coming and going don't grow the list.
+ */
+static __thread trace_ring *_tl_ring;
+
+static pthread_once_t _g_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t _g_ring_key;
+static bool _g_key_ok;
+
+static void ring_release(void *arg) {
+
+    trace_ring *r = (trace_ring *)arg;
+    __atomic_store_n(&r->in_use, false, __ATOMIC_RELEASE);
+}
+
+static void key_create(void) {
+
+    int rc = pthread_key_create(&_g_ring_key, ring_release);
+    if (rc) {
+        LOGW("Could not create the trace ring key, rings of exited threads"
+                " are not reused: %s", strerror(rc));
+        return;
+    }
+
+    _g_key_ok = true;
+}
+
+/* threads may outlive a dlclose(), don't leave them a destructor to call */
+static COMPILER_ATTR(destructor) void key_delete(void) {
+
+    if (_g_key_ok) {
+        pthread_key_delete(_g_ring_key);
+    }
+}
+
+void trace_init(void) {
+
+    if (trace_ring_enabled()) {
+        return;
+    }
+
+    const char *path = getenv(TRACE_ENV_VAR);
+    if (!path || !path[0]) {
+        return;
+    }
+
+    _g_dump_path = strdup(path);
+    if (!_g_dump_path) {
+        LOGE("oom");
+        return;
+    }
+
+    __atomic_store_n(&_g_trace_ring_enabled, true, __ATOMIC_RELEASE);
+}
+
+/* takes over the ring of a thread that exited, if there is one */
+static trace_ring *reuse_ring(void) {
+
+    trace_ring *r = __atomic_load_n(&_g_rings, __ATOMIC_ACQUIRE);
+    for (; r; r = r->next) {
+        bool expected = false;
+        if (__atomic_compare_exchange_n(&r->in_use, &expected, true, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&r->count, 0, __ATOMIC_RELEASE);
+            r->tid = __atomic_add_fetch(&_g_next_tid, 1, __ATOMIC_RELAXED);
+            return r;
+        }
+    }
+
+    return NULL;
+}
+
+static trace_ring *get_ring(void) {
+
+    if (_tl_ring) {
+        return _tl_ring;
+    }
+
+    pthread_once(&_g_key_once, key_create);
+
+    trace_ring *r = reuse_ring();
+    if (!r) {
+        r = calloc(1, sizeof(*r));
+        if (!r) {
+            LOGE("oom");
+            return NULL;
+        }
+
+        r->tid = __atomic_add_fetch(&_g_next_tid, 1, __ATOMIC_RELAXED);
+        r->in_use = true;
+
+        trace_ring *head = __atomic_load_n(&_g_rings, __ATOMIC_ACQUIRE);
+        do {
+            r->next = head;
+        } while (!__atomic_compare_exchange_n(&_g_rings, &head, r, true,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    }
+
+    /* without the key the ring is simply never handed back */
+    if (_g_key_ok) {
+        int rc = pthread_setspecific(_g_ring_key, r);
+        if (rc) {
+            LOGW("Could not register the trace ring for release: %s",
+                    strerror(rc));
+        }
+    }
+
+    _tl_ring = r;
+
+    return r;
+}
+
+void trace_ring_record(trace_probe probe, const char *label, uint64_t arg) {
+
+    trace_ring *r = get_ring();
+    if (!r) {
+        return;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    trace_event *e = &r->events[r->count % TRACE_RING_SIZE];
+    e->ts_ns = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    e->arg = arg;
+    e->probe = probe;
+    if (label) {
+        strncpy(e->label, label, sizeof(e->label) - 1);
+        e->label[sizeof(e->label) - 1] = '\0';
+    } else {
+        e->label[0] = '\0';
+    }
+
+    __atomic_store_n(&r->count, r->count + 1, __ATOMIC_RELEASE);
+}
+
+static void dump_string(FILE *f, const char *s) {
+
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(f, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+void trace_ring_dump(FILE *f) {
+
+    bool first = true;
+    pid_t pid = getpid();
+
+    fprintf(f, "{\"traceEvents\":[");
+
+    trace_ring *r = __atomic_load_n(&_g_rings, __ATOMIC_ACQUIRE);
+    for (; r; r = r->next) {
+
+        uint64_t count = __atomic_load_n(&r->count, __ATOMIC_ACQUIRE);
+        uint64_t i = count > TRACE_RING_SIZE ? count - TRACE_RING_SIZE : 0;
+
+        for (; i < count; i++) {
+            trace_event *e = &r->events[i % TRACE_RING_SIZE];
+
+            fprintf(f, "%s\n{\"name\":", first ? "" : ",");
+            dump_string(f, e->label[0] ? e->label : _probes[e->probe].name);
+            fprintf(f, ",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%"PRIu64".%03u,"
+                    "\"pid\":%d,\"tid\":%u,\"args\":{\"arg\":%"PRIu64"}}",
+                    _probes[e->probe].name, _probes[e->probe].phase,
+                    e->ts_ns / 1000, (unsigned)(e->ts_ns % 1000),
+                    (int)pid, r->tid, e->arg);
+            first = false;
+        }
+    }
+
+    fprintf(f, "\n]}\n");
+    fflush(f);
+}
+
+void trace_finalize(void) {
+
+    if (!trace_ring_enabled()) {
+        return;
+    }
+
+    __atomic_store_n(&_g_trace_ring_enabled, false, __ATOMIC_RELEASE);
+
+    bool is_stderr = !strcmp(_g_dump_path, "stderr");
+    FILE *f = is_stderr ? stderr : fopen(_g_dump_path, "w");
+    if (f) {
+        trace_ring_dump(f);
+        if (!is_stderr) {
+            fclose(f);
+        }
+    } else {
+        LOGW("Could not open trace dump \"%s\"", _g_dump_path);
+    }
+
+    free(_g_dump_path);
+    _g_dump_path = NULL;
+}
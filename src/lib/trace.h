@@ -0,0 +1,117 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef SRC_LIB_TRACE_H_
+#define SRC_LIB_TRACE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#if defined(ENABLE_TRACING) && defined(HAVE_SYS_SDT_H)
+#include <sys/sdt.h>
+#endif
+
+/*
+ * TPM2_PKCS11_TRACE enables the in memory ring buffer and names where it
+ * is written at C_Finalize, either a file path or "stderr". The USDT
+ * probes need no configuration, they cost a nop until a tracer attaches.
+ */
+#define TRACE_ENV_VAR "TPM2_PKCS11_TRACE"
+
+/*
+ * The number of events each thread keeps, older events are overwritten.
+ */
+#define TRACE_RING_SIZE 1024
+
+/*
+ * The probes, with the trace event phase used when dumping the ring:
+ * B begins a span, E ends the most recent one and i is an instant.
+ * Every probe carries a label, which may be NULL, and an integer.
+ */
+#define TRACE_PROBES(X) \
+    X(session_lookup_begin, 'B') \
+    X(session_lookup_end,   'E') \
+    X(lock_acquire_begin,   'B') \
+    X(lock_acquire_end,     'E') \
+    X(object_load_begin,    'B') \
+    X(object_load_end,      'E') \
+    X(esys_begin,           'B') \
+    X(esys_end,             'E') \
+    X(db_stmt_begin,        'B') \
+    X(db_stmt_end,          'E')
+
+typedef enum trace_probe trace_probe;
+enum trace_probe {
+#define X(name, phase) trace_probe_##name,
+    TRACE_PROBES(X)
+#undef X
+    trace_probe_max
+};
+
+extern bool _g_trace_ring_enabled;
+
+/**
+ * Enables the ring buffer if TRACE_ENV_VAR is set. Safe to call more
+ * than once.
+ */
+void trace_init(void);
+
+/**
+ * Writes the ring buffers if enabled and stops recording.
+ */
+void trace_finalize(void);
+
+/**
+ * Records an event in the calling thread's ring buffer.
+ * @param probe
+ *  The probe that fired.
+ * @param label
+ *  The label, copied and truncated. May be NULL.
+ * @param arg
+ *  The probe argument.
+ */
+void trace_ring_record(trace_probe probe, const char *label, uint64_t arg);
+
+/**
+ * Writes every thread's ring buffer as a JSON trace event document, as
+ * understood by chrome://tracing and Perfetto. Threads should be quiet
+ * while this runs.
+ * @param f
+ *  The stream to write to.
+ */
+void trace_ring_dump(FILE *f);
+
+static inline bool trace_ring_enabled(void) {
+    return __atomic_load_n(&_g_trace_ring_enabled, __ATOMIC_RELAXED);
+}
+
+#if defined(ENABLE_TRACING) && defined(HAVE_SYS_SDT_H)
+#define _TRACE_USDT(probe, label, arg) \
+    DTRACE_PROBE2(tpm2_pkcs11, probe, label, arg)
+#else
+#define _TRACE_USDT(probe, label, arg)
+#endif
+
+/**
+ * Fires a trace point. When built with --disable-tracing this expands
+ * to nothing and the arguments are never evaluated.
+ * @param probe
+ *  The probe name from TRACE_PROBES, also the USDT probe name.
+ * @param label
+ *  A const char * label, or NULL.
+ * @param arg
+ *  An integer argument.
+ */
+#ifdef ENABLE_TRACING
+#define TRACE(probe, label, arg) \
+    do { \
+        _TRACE_USDT(probe, label, arg); \
+        if (trace_ring_enabled()) { \
+            trace_ring_record(trace_probe_##probe, label, (uint64_t)(arg)); \
+        } \
+    } while (0)
+#else
+#define TRACE(probe, label, arg) do { } while (0)
+#endif
+
+#endif /* SRC_LIB_TRACE_H_ */
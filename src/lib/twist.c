@@ -178,6 +178,14 @@ void twist_free(twist tstring) {
 	free(from_twist_to_hdr(tstring));
 }
 
+twist twist_view_init(void *mem, size_t len) {
+
+	twist_hdr *hdr = (twist_hdr *)mem;
+	hdr->end = &hdr->data[len];
+
+	return from_hdr_to_twist(hdr);
+}
+
 extern char *twist_end(twist tstring) {
 
 	if (!tstring) {
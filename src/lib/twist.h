@@ -115,6 +115,27 @@ extern twist twist_dup(twist tstring);
  */
 extern void twist_free(twist tstring);
 
+/**
+ * The number of bytes a twist view needs in front of its data, see
+ * twist_view_init().
+ */
+#define TWIST_VIEW_HDR_LEN sizeof(char *)
+
+/**
+ * Lays out a read only twist in memory the caller owns, so long lived data
+ * needs no allocation of its own. A view is not NULL terminated, and
+ * must never be passed to twist_free() or a routine that grows it.
+ * twist_dup() gives an ordinary twist of it.
+ * @param mem
+ *  TWIST_VIEW_HDR_LEN bytes followed by the len bytes of data. It must
+ *  outlive the view and be aligned for a pointer.
+ * @param len
+ *  The length of the data.
+ * @return
+ *  The view, pointing at the data.
+ */
+extern twist twist_view_init(void *mem, size_t len);
+
 /**
  * Concatenates a new string onto old string
  * @param old_str
@@ -10,6 +10,8 @@
 #include "derive.h"
 #include "digest.h"
 #include "encrypt.h"
+#include "event.h"
+#include "fork.h"
 #include "key.h"
 #include "log.h"
 #include "general.h"
@@ -18,6 +20,7 @@
 #include "session.h"
 #include "sign.h"
 #include "slot.h"
+#include "stats.h"
 #include "token.h"
 
 // TODO REMOVE ME
@@ -25,15 +28,21 @@
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 
 /**
- * Logs an "enter" function stub via LOGV
+ * Logs an "enter" function stub via LOGV and starts the statistics
+ * for the entry point.
  */
-#define _TRACE_CALL    LOGV("enter \"%s\"", __func__)
+#define _TRACE_CALL \
+    static stats_site _stats_site = STATS_SITE_INIT(__func__); \
+    uint64_t _stats_start = stats_call_begin(); \
+    LOGV("enter \"%s\"", __func__)
 
 /**
  * Logs an "return" function stub with return value. It expects rv to be declared
  * as a CK_RV and contain the actual return value
  */
-#define _TRACE_RET(rv) LOGV("return \"%s\" value: %lu", __func__, rv);
+#define _TRACE_RET(rv) \
+    stats_call_end(&_stats_site, _stats_start, rv); \
+    LOGV("return \"%s\" value: %lu", __func__, rv);
 
 /**
  * Calls a user supplied function with arguments logging the function entry and
@@ -89,16 +98,21 @@
 
 /**
  * Checks that the library is initialized, if not goes to a user specified
- * label. Requires rv to be defined as a CK_RV type.
+ * label. In a forked child the first call also reopens the connections,
+ * see fork.h. Requires rv to be defined as a CK_RV type.
  * @param label
  *  The label to go to on failure.
  * @return
- *  Sets rv to CKR_CRYPTOKI_NOT_INITIALIZED.
+ *  Sets rv to CKR_CRYPTOKI_NOT_INITIALIZED, or the failure of the reopen.
  */
 #define _CHECK_INIT(label) \
     if (!general_is_init()) { \
         rv = CKR_CRYPTOKI_NOT_INITIALIZED; \
         goto label; \
+    } \
+    rv = fork_check(); \
+    if (rv != CKR_OK) { \
+        goto label; \
     }
 
 /**
@@ -407,7 +421,7 @@ CK_RV C_GetTokenInfo (CK_SLOT_ID slotID, CK_TOKEN_INFO *info) {
 }
 
 CK_RV C_WaitForSlotEvent (CK_FLAGS flags, CK_SLOT_ID *slot, void *pReserved) {
-    TOKEN_UNSUPPORTED;
+    TOKEN_CALL_INIT(event_wait, flags, slot, pReserved);
 }
 
 CK_RV C_GetMechanismList (CK_SLOT_ID slotID, CK_MECHANISM_TYPE *mechanism_list, CK_ULONG_PTR count) {
@@ -650,5 +664,101 @@ CK_RV C_CancelFunction (CK_SESSION_HANDLE session) {
     TOKEN_UNSUPPORTED;
 }
 
+CK_RV C_GetInterfaceList (CK_INTERFACE_PTR interfaces_list, CK_ULONG_PTR count) {
+    TOKEN_CALL(general_get_interface_list, interfaces_list, count);
+}
+
+CK_RV C_GetInterface (CK_UTF8CHAR_PTR interface_name, CK_VERSION_PTR version, CK_INTERFACE_PTR_PTR interface_ptr, CK_FLAGS flags) {
+    TOKEN_CALL(general_get_interface, interface_name, version, interface_ptr, flags);
+}
+
+CK_RV C_LoginUser (CK_SESSION_HANDLE session, CK_USER_TYPE user_type, CK_BYTE_PTR pin, CK_ULONG pin_len, CK_UTF8CHAR_PTR username, CK_ULONG username_len) {
+    TOKEN_WITH_LOCK_BY_SESSION_PUB_RO(session_ctx_login_user, session, user_type, pin, pin_len, username, username_len);
+}
+
+CK_RV C_SessionCancel (CK_SESSION_HANDLE session, CK_FLAGS flags) {
+    TOKEN_WITH_LOCK_BY_SESSION_PUB_RO(session_ctx_cancel, session, flags);
+}
+
+CK_RV C_MessageEncryptInit (CK_SESSION_HANDLE session, CK_MECHANISM *mechanism, CK_OBJECT_HANDLE key) {
+    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(message_encrypt_init, session, mechanism, key);
+}
+
+CK_RV C_EncryptMessage (CK_SESSION_HANDLE session, CK_VOID_PTR parameter, CK_ULONG parameter_len, CK_BYTE_PTR associated_data, CK_ULONG associated_data_len, CK_BYTE_PTR plaintext, CK_ULONG plaintext_len, CK_BYTE_PTR ciphertext, CK_ULONG_PTR ciphertext_len) {
+    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(encrypt_message, session, parameter, parameter_len, associated_data, associated_data_len, plaintext, plaintext_len, ciphertext, ciphertext_len);
+}
+
+CK_RV C_EncryptMessageBegin (CK_SESSION_HANDLE session, CK_VOID_PTR parameter, CK_ULONG parameter_len, CK_BYTE_PTR associated_data, CK_ULONG associated_data_len) {
+    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(encrypt_message_begin, session, parameter, parameter_len, associated_data, associated_data_len);
+}
+
+CK_RV C_EncryptMessageNext (CK_SESSION_HANDLE session, CK_VOID_PTR parameter, CK_ULONG parameter_len, CK_BYTE_PTR plaintext_part, CK_ULONG plaintext_part_len, CK_BYTE_PTR ciphertext_part, CK_ULONG_PTR ciphertext_part_len, CK_FLAGS flags) {
+    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(encrypt_message_next, session, parameter, parameter_len, plaintext_part, plaintext_part_len, ciphertext_part, ciphertext_part_len, flags);
+}
+
+CK_RV C_MessageEncryptFinal (CK_SESSION_HANDLE session) {
+    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(message_encrypt_final, session);
+}
+
+CK_RV C_MessageDecryptInit (CK_SESSION_HANDLE session, CK_MECHANISM *mechanism, CK_OBJECT_HANDLE key) {
+    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(message_decrypt_init, session, mechanism, key);
+}
+
+CK_RV C_DecryptMessage (CK_SESSION_HANDLE session, CK_VOID_PTR parameter, CK_ULONG parameter_len, CK_BYTE_PTR associated_data, CK_ULONG associated_data_len, CK_BYTE_PTR ciphertext, CK_ULONG ciphertext_len, CK_BYTE_PTR plaintext, CK_ULONG_PTR plaintext_len) {
+    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(decrypt_message, session, parameter, parameter_len, associated_data, associated_data_len, ciphertext, ciphertext_len, plaintext, plaintext_len);
+}
+
+CK_RV C_DecryptMessageBegin (CK_SESSION_HANDLE session, CK_VOID_PTR parameter, CK_ULONG parameter_len, CK_BYTE_PTR associated_data, CK_ULONG associated_data_len) {
+    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(decrypt_message_begin, session, parameter, parameter_len, associated_data, associated_data_len);
+}
+
+CK_RV C_DecryptMessageNext (CK_SESSION_HANDLE session, CK_VOID_PTR parameter, CK_ULONG parameter_len, CK_BYTE_PTR ciphertext_part, CK_ULONG ciphertext_part_len, CK_BYTE_PTR plaintext_part, CK_ULONG_PTR plaintext_part_len, CK_FLAGS flags) {
+    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(decrypt_message_next, session, parameter, parameter_len, ciphertext_part, ciphertext_part_len, plaintext_part, plaintext_part_len, flags);
+}
+
+CK_RV C_MessageDecryptFinal (CK_SESSION_HANDLE session) {
+    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(message_decrypt_final, session);
+}
+
+CK_RV C_MessageSignInit (CK_SESSION_HANDLE session, CK_MECHANISM *mechanism, CK_OBJECT_HANDLE key) {
+    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(message_sign_init, session, mechanism, key);
+}
+
+CK_RV C_SignMessage (CK_SESSION_HANDLE session, CK_VOID_PTR parameter, CK_ULONG parameter_len, CK_BYTE_PTR data, CK_ULONG data_len, CK_BYTE_PTR signature, CK_ULONG_PTR signature_len) {
+    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(sign_message, session, parameter, parameter_len, data, data_len, signature, signature_len);
+}
+
+CK_RV C_SignMessageBegin (CK_SESSION_HANDLE session, CK_VOID_PTR parameter, CK_ULONG parameter_len) {
+    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(sign_message_begin, session, parameter, parameter_len);
+}
+
+CK_RV C_SignMessageNext (CK_SESSION_HANDLE session, CK_VOID_PTR parameter, CK_ULONG parameter_len, CK_BYTE_PTR data, CK_ULONG data_len, CK_BYTE_PTR signature, CK_ULONG_PTR signature_len) {
+    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(sign_message_next, session, parameter, parameter_len, data, data_len, signature, signature_len);
+}
+
+CK_RV C_MessageSignFinal (CK_SESSION_HANDLE session) {
+    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(message_sign_final, session);
+}
+
+CK_RV C_MessageVerifyInit (CK_SESSION_HANDLE session, CK_MECHANISM *mechanism, CK_OBJECT_HANDLE key) {
+    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(message_verify_init, session, mechanism, key);
+}
+
+CK_RV C_VerifyMessage (CK_SESSION_HANDLE session, CK_VOID_PTR parameter, CK_ULONG parameter_len, CK_BYTE_PTR data, CK_ULONG data_len, CK_BYTE_PTR signature, CK_ULONG signature_len) {
+    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(verify_message, session, parameter, parameter_len, data, data_len, signature, signature_len);
+}
+
+CK_RV C_VerifyMessageBegin (CK_SESSION_HANDLE session, CK_VOID_PTR parameter, CK_ULONG parameter_len) {
+    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(verify_message_begin, session, parameter, parameter_len);
+}
+
+CK_RV C_VerifyMessageNext (CK_SESSION_HANDLE session, CK_VOID_PTR parameter, CK_ULONG parameter_len, CK_BYTE_PTR data, CK_ULONG data_len, CK_BYTE_PTR signature, CK_ULONG signature_len) {
+    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(verify_message_next, session, parameter, parameter_len, data, data_len, signature, signature_len);
+}
+
+CK_RV C_MessageVerifyFinal (CK_SESSION_HANDLE session) {
+    TOKEN_WITH_LOCK_BY_SESSION_USER_RO(message_verify_final, session);
+}
+
 // TODO REMOVE ME
 #pragma GCC diagnostic pop
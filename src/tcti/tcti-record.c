@@ -0,0 +1,304 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tss2/tss2_tctildr.h>
+
+#include "tcti-recording.h"
+
+#define TCTI_RECORD_MAGIC 0x5265636f72647321ULL
+#define TCTI_RECORD_VERSION 2
+
+typedef struct tcti_record tcti_record;
+struct tcti_record {
+    TSS2_TCTI_CONTEXT_COMMON_V2 common;
+    TSS2_TCTI_CONTEXT *child;
+    bool owns_child;
+    FILE *f;
+    struct timespec start;
+    bool pending;
+    recording_entry e;
+};
+
+static uint64_t elapsed_ns(const struct timespec *start) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000ULL
+            + now.tv_nsec - start->tv_nsec;
+}
+
+static tcti_record *to_record(TSS2_TCTI_CONTEXT *ctx) {
+
+    if (!ctx) {
+        return NULL;
+    }
+
+    tcti_record *t = (tcti_record *)ctx;
+    return TSS2_TCTI_MAGIC(ctx) == TCTI_RECORD_MAGIC ? t : NULL;
+}
+
+static TSS2_RC tcti_record_transmit(TSS2_TCTI_CONTEXT *ctx, size_t size,
+        const uint8_t *command) {
+
+    tcti_record *t = to_record(ctx);
+    if (!t) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+
+    if (!command || size < 10) {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+
+    uint8_t *cmd = realloc(t->e.cmd, size);
+    if (!cmd) {
+        return TSS2_TCTI_RC_MEMORY;
+    }
+    memcpy(cmd, command, size);
+    t->e.cmd = cmd;
+    t->e.cmd_len = size;
+    t->e.sent_ns = elapsed_ns(&t->start);
+
+    TSS2_RC rc = Tss2_Tcti_Transmit(t->child, size, command);
+    t->pending = rc == TSS2_RC_SUCCESS;
+
+    return rc;
+}
+
+static TSS2_RC tcti_record_receive(TSS2_TCTI_CONTEXT *ctx, size_t *size,
+        uint8_t *response, int32_t timeout) {
+
+    tcti_record *t = to_record(ctx);
+    if (!t) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+
+    TSS2_RC rc = Tss2_Tcti_Receive(t->child, size, response, timeout);
+    /* size queries and timeouts leave the command outstanding */
+    if (rc != TSS2_RC_SUCCESS || !response || !t->pending) {
+        return rc;
+    }
+
+    t->pending = false;
+    t->e.received_ns = elapsed_ns(&t->start);
+    t->e.rsp = response;
+    t->e.rsp_len = *size;
+
+    if (!recording_write(t->f, &t->e)) {
+        /* never fail the caller's command over the recording */
+        fprintf(stderr, "tcti-record: write failed: %s\n", strerror(errno));
+    }
+
+    t->e.rsp = NULL;
+
+    return rc;
+}
+
+static void tcti_record_finalize(TSS2_TCTI_CONTEXT *ctx) {
+
+    tcti_record *t = to_record(ctx);
+    if (!t) {
+        return;
+    }
+
+    if (t->owns_child) {
+        Tss2_TctiLdr_Finalize(&t->child);
+    }
+
+    fclose(t->f);
+    free(t->e.cmd);
+
+    TSS2_TCTI_MAGIC(ctx) = 0;
+}
+
+static TSS2_RC tcti_record_cancel(TSS2_TCTI_CONTEXT *ctx) {
+
+    tcti_record *t = to_record(ctx);
+    if (!t) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+
+    t->pending = false;
+    return Tss2_Tcti_Cancel(t->child);
+}
+
+static TSS2_RC tcti_record_get_poll_handles(TSS2_TCTI_CONTEXT *ctx,
+        TSS2_TCTI_POLL_HANDLE *handles, size_t *num_handles) {
+
+    tcti_record *t = to_record(ctx);
+    if (!t) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+
+    return Tss2_Tcti_GetPollHandles(t->child, handles, num_handles);
+}
+
+static TSS2_RC tcti_record_set_locality(TSS2_TCTI_CONTEXT *ctx,
+        uint8_t locality) {
+
+    tcti_record *t = to_record(ctx);
+    if (!t) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+
+    return Tss2_Tcti_SetLocality(t->child, locality);
+}
+
+static TSS2_RC tcti_record_make_sticky(TSS2_TCTI_CONTEXT *ctx,
+        TPM2_HANDLE *handle, uint8_t sticky) {
+
+    tcti_record *t = to_record(ctx);
+    if (!t) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+
+    return Tss2_Tcti_MakeSticky(t->child, handle, sticky);
+}
+
+/* expands %p to the process id so every process gets its own file */
+static char *expand_path(const char *path) {
+
+    const char *p = strstr(path, "%p");
+    if (!p) {
+        return strdup(path);
+    }
+
+    /* a long is at most 20 digits */
+    size_t len = strlen(path) + 20;
+    char *out = malloc(len);
+    if (!out) {
+        return NULL;
+    }
+
+    snprintf(out, len, "%.*s%ld%s", (int)(p - path), path,
+            (long)getpid(), p + 2);
+
+    return out;
+}
+
+static FILE *open_recording(const char *opts) {
+
+    char *file = recording_opt(opts, "file");
+    if (!file) {
+        fprintf(stderr, "tcti-record: file=<path> is required\n");
+        return NULL;
+    }
+
+    char *path = expand_path(file);
+    free(file);
+    if (!path) {
+        return NULL;
+    }
+
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "tcti-record: could not open \"%s\": %s\n",
+                path, strerror(errno));
+        free(path);
+        return NULL;
+    }
+    free(path);
+
+    time_t now = time(NULL);
+    char date[64] = "";
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    fprintf(f, RECORDING_MAGIC "\n# started %s by pid %ld\n", date, (long)getpid());
+    fflush(f);
+
+    return f;
+}
+
+TSS2_RC tcti_record_init_child(TSS2_TCTI_CONTEXT *ctx, size_t *size,
+        const char *opts, TSS2_TCTI_CONTEXT *child) {
+
+    if (!size) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+
+    if (!ctx) {
+        *size = sizeof(tcti_record);
+        return TSS2_RC_SUCCESS;
+    }
+
+    if (*size < sizeof(tcti_record)) {
+        return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+    }
+
+    if (!child) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+
+    tcti_record *t = (tcti_record *)ctx;
+    memset(t, 0, sizeof(*t));
+
+    t->f = open_recording(opts);
+    if (!t->f) {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+
+    t->child = child;
+    clock_gettime(CLOCK_MONOTONIC, &t->start);
+
+    TSS2_TCTI_MAGIC(ctx) = TCTI_RECORD_MAGIC;
+    TSS2_TCTI_VERSION(ctx) = TCTI_RECORD_VERSION;
+    TSS2_TCTI_TRANSMIT(ctx) = tcti_record_transmit;
+    TSS2_TCTI_RECEIVE(ctx) = tcti_record_receive;
+    TSS2_TCTI_FINALIZE(ctx) = tcti_record_finalize;
+    TSS2_TCTI_CANCEL(ctx) = tcti_record_cancel;
+    TSS2_TCTI_GET_POLL_HANDLES(ctx) = tcti_record_get_poll_handles;
+    TSS2_TCTI_SET_LOCALITY(ctx) = tcti_record_set_locality;
+    TSS2_TCTI_MAKE_STICKY(ctx) = tcti_record_make_sticky;
+
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC Tss2_Tcti_Record_Init(TSS2_TCTI_CONTEXT *ctx, size_t *size,
+        const char *conf) {
+
+    if (!ctx) {
+        return tcti_record_init_child(ctx, size, conf, NULL);
+    }
+
+    const char *child_conf = conf ? strchr(conf, ';') : NULL;
+    if (child_conf) {
+        child_conf++;
+    }
+
+    TSS2_TCTI_CONTEXT *child = NULL;
+    TSS2_RC rc = Tss2_TctiLdr_Initialize(
+            child_conf && *child_conf ? child_conf : NULL, &child);
+    if (rc != TSS2_RC_SUCCESS) {
+        fprintf(stderr, "tcti-record: could not load child TCTI \"%s\"\n",
+                child_conf ? child_conf : "(default)");
+        return rc;
+    }
+
+    rc = tcti_record_init_child(ctx, size, conf, child);
+    if (rc != TSS2_RC_SUCCESS) {
+        Tss2_TctiLdr_Finalize(&child);
+        return rc;
+    }
+
+    ((tcti_record *)ctx)->owns_child = true;
+
+    return TSS2_RC_SUCCESS;
+}
+
+static const TSS2_TCTI_INFO _info = {
+    .version = TCTI_RECORD_VERSION,
+    .name = "tcti-record",
+    .description = "Forwards to a child TCTI and records every command and "
+                   "response with timestamps.",
+    .config_help = "file=PATH[;CHILD-TCTI], %p in PATH is the process id",
+    .init = Tss2_Tcti_Record_Init,
+};
+
+const TSS2_TCTI_INFO *Tss2_Tcti_Info(void) {
+    return &_info;
+}
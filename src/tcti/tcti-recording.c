@@ -0,0 +1,218 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tcti-recording.h"
+
+static void write_hex(FILE *f, const uint8_t *buf, size_t len) {
+
+    size_t i;
+    for (i=0; i < len; i++) {
+        fprintf(f, "%02x", buf[i]);
+    }
+}
+
+bool recording_write(FILE *f, const recording_entry *e) {
+
+    fprintf(f, "%"PRIu64" %"PRIu64" ", e->sent_ns, e->received_ns);
+    write_hex(f, e->cmd, e->cmd_len);
+    fputc(' ', f);
+    write_hex(f, e->rsp, e->rsp_len);
+    fputc('\n', f);
+
+    return !fflush(f) && !ferror(f);
+}
+
+static int hex_nibble(char c) {
+
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static bool parse_hex(const char *hex, uint8_t **buf, size_t *len) {
+
+    size_t hex_len = strlen(hex);
+    if (!hex_len || hex_len & 1) {
+        return false;
+    }
+
+    uint8_t *b = malloc(hex_len / 2);
+    if (!b) {
+        return false;
+    }
+
+    size_t i;
+    for (i=0; i < hex_len / 2; i++) {
+        int hi = hex_nibble(hex[2 * i]);
+        int lo = hex_nibble(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            free(b);
+            return false;
+        }
+        b[i] = hi << 4 | lo;
+    }
+
+    *buf = b;
+    *len = hex_len / 2;
+    return true;
+}
+
+static bool parse_line(char *line, recording_entry *e) {
+
+    char *saveptr = NULL;
+    char *sent = strtok_r(line, " \n", &saveptr);
+    char *received = strtok_r(NULL, " \n", &saveptr);
+    char *cmd = strtok_r(NULL, " \n", &saveptr);
+    char *rsp = strtok_r(NULL, " \n", &saveptr);
+    if (!rsp || strtok_r(NULL, " \n", &saveptr)) {
+        return false;
+    }
+
+    errno = 0;
+    char *end1 = NULL, *end2 = NULL;
+    e->sent_ns = strtoull(sent, &end1, 10);
+    e->received_ns = strtoull(received, &end2, 10);
+    if (errno || *end1 || *end2 || e->received_ns < e->sent_ns) {
+        return false;
+    }
+
+    if (!parse_hex(cmd, &e->cmd, &e->cmd_len)) {
+        return false;
+    }
+
+    if (e->cmd_len < 10 || !parse_hex(rsp, &e->rsp, &e->rsp_len)) {
+        free(e->cmd);
+        e->cmd = NULL;
+        return false;
+    }
+
+    e->cc = recording_cc(e->cmd);
+
+    return true;
+}
+
+TSS2_RC recording_load(const char *path, recording *r) {
+
+    memset(r, 0, sizeof(*r));
+
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "tcti-replay: could not open \"%s\": %s\n",
+                path, strerror(errno));
+        return TSS2_TCTI_RC_IO_ERROR;
+    }
+
+    TSS2_RC rc = TSS2_TCTI_RC_BAD_VALUE;
+    char *line = NULL;
+    size_t line_size = 0;
+    size_t capacity = 0;
+    unsigned lineno = 0;
+
+    ssize_t n;
+    while ((n = getline(&line, &line_size, f)) >= 0) {
+        lineno++;
+
+        if (lineno == 1) {
+            if (strncmp(line, RECORDING_MAGIC, strlen(RECORDING_MAGIC))) {
+                fprintf(stderr, "tcti-replay: \"%s\" is not a recording\n", path);
+                goto out;
+            }
+            continue;
+        }
+
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+
+        if (r->len == capacity) {
+            size_t new_capacity = capacity ? capacity * 2 : 64;
+            recording_entry *e = realloc(r->entries,
+                    new_capacity * sizeof(*e));
+            if (!e) {
+                rc = TSS2_TCTI_RC_MEMORY;
+                goto out;
+            }
+            r->entries = e;
+            capacity = new_capacity;
+        }
+
+        recording_entry *e = &r->entries[r->len];
+        memset(e, 0, sizeof(*e));
+        if (!parse_line(line, e)) {
+            fprintf(stderr, "tcti-replay: \"%s\" line %u is malformed\n",
+                    path, lineno);
+            goto out;
+        }
+        r->len++;
+    }
+
+    if (lineno == 0) {
+        fprintf(stderr, "tcti-replay: \"%s\" is empty\n", path);
+        goto out;
+    }
+
+    rc = TSS2_RC_SUCCESS;
+
+out:
+    free(line);
+    fclose(f);
+
+    if (rc != TSS2_RC_SUCCESS) {
+        recording_free(r);
+    }
+
+    return rc;
+}
+
+void recording_free(recording *r) {
+
+    size_t i;
+    for (i=0; i < r->len; i++) {
+        free(r->entries[i].cmd);
+        free(r->entries[i].rsp);
+    }
+
+    free(r->entries);
+    memset(r, 0, sizeof(*r));
+}
+
+char *recording_opt(const char *opts, const char *key) {
+
+    if (!opts) {
+        return NULL;
+    }
+
+    size_t key_len = strlen(key);
+    const char *end = strchr(opts, ';');
+    if (!end) {
+        end = opts + strlen(opts);
+    }
+
+    const char *p = opts;
+    while (p < end) {
+        const char *next = memchr(p, ',', end - p);
+        if (!next) {
+            next = end;
+        }
+
+        if ((size_t)(next - p) > key_len && !strncmp(p, key, key_len)
+                && p[key_len] == '=') {
+            const char *val = p + key_len + 1;
+            return strndup(val, next - val);
+        }
+
+        p = next + 1;
+    }
+
+    return NULL;
+}
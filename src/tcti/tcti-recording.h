@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef SRC_TCTI_RECORDING_H_
+#define SRC_TCTI_RECORDING_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <tss2/tss2_tcti.h>
+
+/*
+ * A recording of TPM traffic is a text file so it can be attached to a
+ * bug report and diffed. It starts with the RECORDING_MAGIC line and holds
+ * one exchange per line:
+ *
+ *   <sent ns> <received ns> <command hex> <response hex>
+ *
+ * The times are CLOCK_MONOTONIC nanoseconds since the recording TCTI was
+ * initialized. Other lines starting with '#' are comments.
+ *
+ * The record TCTI writes one, once installed with --enable-tcti-record the
+ * TCTI loader finds it by name:
+ *
+ *   TPM2_PKCS11_TCTI="record:file=/tmp/tpm-%p.rec;device:/dev/tpmrm0"
+ *
+ * where %p is replaced by the process id. The replay TCTI serves one back:
+ *
+ *   TPM2_PKCS11_TCTI="/path/libtss2-tcti-replay.so:file=/tmp/tpm-1234.rec,scale=0.5"
+ *
+ * Replay options are comma separated:
+ *   file=<path>   the recording, required.
+ *   scale=<float> multiplies the recorded TPM time of each command, 0 answers
+ *                 at once. Default 1.
+ *
+ * By default the recorded responses are served in order and every command
+ * code must match the recording. Commands under HMAC or encrypted sessions
+ * carry fresh nonces, so ESAPI will reject the recorded responses to them.
+ * To replay such a workload give a child TCTI after a ';', it executes the
+ * commands and the replay TCTI only reproduces the recorded timings, the
+ * n-th command of a code takes as long as the n-th recorded one did.
+ */
+#define RECORDING_MAGIC "# tpm2-pkcs11 tcti recording 1"
+
+typedef struct recording_entry recording_entry;
+struct recording_entry {
+    uint32_t cc;
+    uint64_t sent_ns;
+    uint64_t received_ns;
+    uint8_t *cmd;
+    size_t cmd_len;
+    uint8_t *rsp;
+    size_t rsp_len;
+};
+
+typedef struct recording recording;
+struct recording {
+    recording_entry *entries;
+    size_t len;
+};
+
+/**
+ * The command code from a command buffer.
+ * @param command
+ *  The command, at least 10 bytes.
+ * @return
+ *  The command code.
+ */
+static inline uint32_t recording_cc(const uint8_t *command) {
+    return (uint32_t)command[6] << 24 | (uint32_t)command[7] << 16
+            | (uint32_t)command[8] << 8 | command[9];
+}
+
+/**
+ * Writes one exchange and flushes it, so a crash loses nothing.
+ * @param f
+ *  The recording file.
+ * @param e
+ *  The exchange, cc is ignored.
+ * @return
+ *  true on success.
+ */
+bool recording_write(FILE *f, const recording_entry *e);
+
+/**
+ * Loads a recording.
+ * @param path
+ *  The file to load.
+ * @param r
+ *  The recording to fill in, free with recording_free().
+ * @return
+ *  TSS2_RC_SUCCESS, TSS2_TCTI_RC_IO_ERROR if the file can't be read or
+ *  TSS2_TCTI_RC_BAD_VALUE if it is malformed.
+ */
+TSS2_RC recording_load(const char *path, recording *r);
+
+/**
+ * Frees the entries of a recording.
+ * @param r
+ *  The recording.
+ */
+void recording_free(recording *r);
+
+/**
+ * Returns the value of a key=value option from a comma separated list
+ * ending at the end of the string or the first ';'.
+ * @param opts
+ *  The options, may be NULL.
+ * @param key
+ *  The key to find.
+ * @return
+ *  A copy of the value to free, or NULL if the key is absent or on oom.
+ */
+char *recording_opt(const char *opts, const char *key);
+
+/**
+ * Initializes a record TCTI around an already initialized child, which is
+ * not finalized with it.
+ * @param ctx
+ *  The context to initialize, or NULL to query the size.
+ * @param size
+ *  The context size.
+ * @param opts
+ *  The options, file=<path> is required.
+ * @param child
+ *  The TCTI to forward to.
+ * @return
+ *  TSS2_RC_SUCCESS on success.
+ */
+TSS2_RC tcti_record_init_child(TSS2_TCTI_CONTEXT *ctx, size_t *size,
+        const char *opts, TSS2_TCTI_CONTEXT *child);
+
+/**
+ * Initializes a replay TCTI, optionally around an already initialized
+ * child, which is not finalized with it.
+ * @param ctx
+ *  The context to initialize, or NULL to query the size.
+ * @param size
+ *  The context size.
+ * @param opts
+ *  The options, file=<path> is required.
+ * @param child
+ *  The TCTI to time the replay on, or NULL to serve recorded responses.
+ * @return
+ *  TSS2_RC_SUCCESS on success.
+ */
+TSS2_RC tcti_replay_init_child(TSS2_TCTI_CONTEXT *ctx, size_t *size,
+        const char *opts, TSS2_TCTI_CONTEXT *child);
+
+#endif /* SRC_TCTI_RECORDING_H_ */
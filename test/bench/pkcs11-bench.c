@@ -0,0 +1,964 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * A throughput and latency benchmark for the PKCS11 interface. The module
+ * is loaded with dlopen() and driven through C_GetFunctionList() only, so
+ * any build of the library, or any other module, can be measured.
+ *
+ * Every result is printed as a single line of JSON, suitable for storing
+ * and comparing across runs.
+ */
+#include "config.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pkcs11.h"
+
+#define MAX_THREADS 64
+#define MAX_LIST 16
+
+#define DEFAULT_TOKEN    "label"
+#define DEFAULT_PIN      "myuserpin"
+#define DEFAULT_THREADS  "1,2,4"
+#define DEFAULT_SIZES    "0,100,1000"
+#define DEFAULT_DURATION 2
+
+#define FIND_LABEL "pkcs11-bench-find"
+#define CREATE_LABEL "pkcs11-bench-create"
+
+#define ARRAY_LEN(x) (sizeof(x)/sizeof(x[0]))
+
+typedef struct bench_keys bench_keys;
+struct bench_keys {
+    CK_OBJECT_HANDLE rsa_priv;
+    CK_OBJECT_HANDLE rsa_pub;
+    CK_OBJECT_HANDLE ec_priv;
+    CK_OBJECT_HANDLE aes;
+    CK_OBJECT_HANDLE hmac;
+};
+
+typedef struct bench_ctx bench_ctx;
+struct bench_ctx {
+    CK_FUNCTION_LIST_PTR p11;
+    CK_SLOT_ID slot;
+    bench_keys keys;
+    CK_ULONG size;
+};
+
+typedef struct bench_thread bench_thread;
+struct bench_thread {
+    pthread_t thread;
+    bench_ctx *ctx;
+    const struct bench_op *op;
+    CK_SESSION_HANDLE session;
+    uint64_t deadline;
+    uint64_t *samples;
+    size_t nsamples;
+    size_t cap;
+    uint64_t errors;
+    CK_RV last_error;
+};
+
+typedef CK_RV (*bench_fn)(bench_thread *t);
+
+typedef struct bench_op bench_op;
+struct bench_op {
+    const char *name;
+    const char *variant;
+    bench_fn fn;
+    /* needs a key handle, skipped if the token has no such key */
+    size_t key_offset;
+    /* payload sizes to run with, 0 terminated, none means a single run */
+    CK_ULONG sizes[4];
+    /* run untimed after each fn, to end the operation fn started */
+    bench_fn done;
+};
+
+static struct {
+    const char *module;
+    const char *token;
+    const char *pin;
+    const char *ops;
+    unsigned threads[MAX_LIST];
+    size_t nthreads;
+    unsigned long store_sizes[MAX_LIST];
+    size_t nstore_sizes;
+    unsigned duration;
+    FILE *out;
+} opts;
+
+static pthread_barrier_t _barrier;
+
+static uint64_t now_ns(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static CK_BYTE _data[16384];
+
+static CK_RV op_open_session(bench_thread *t) {
+
+    CK_SESSION_HANDLE s;
+    CK_RV rv = t->ctx->p11->C_OpenSession(t->ctx->slot,
+            CKF_SERIAL_SESSION | CKF_RW_SESSION, NULL, NULL, &s);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    return t->ctx->p11->C_CloseSession(s);
+}
+
+static CK_RV op_find_objects(bench_thread *t) {
+
+    CK_FUNCTION_LIST_PTR p11 = t->ctx->p11;
+
+    CK_ATTRIBUTE tmpl[] = {
+        { CKA_LABEL, FIND_LABEL, sizeof(FIND_LABEL) - 1 },
+    };
+
+    CK_RV rv = p11->C_FindObjectsInit(t->session, tmpl, ARRAY_LEN(tmpl));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_OBJECT_HANDLE handles[64];
+    CK_ULONG count;
+    do {
+        rv = p11->C_FindObjects(t->session, handles, ARRAY_LEN(handles), &count);
+    } while (rv == CKR_OK && count == ARRAY_LEN(handles));
+
+    CK_RV rv2 = p11->C_FindObjectsFinal(t->session);
+
+    return rv != CKR_OK ? rv : rv2;
+}
+
+/*
+ * Adds one token object to a store of the current size and removes it again,
+ * so the cost of persisting an object can be followed as the store grows.
+ */
+static CK_RV op_create_object(bench_thread *t) {
+
+    CK_FUNCTION_LIST_PTR p11 = t->ctx->p11;
+
+    CK_OBJECT_CLASS clazz = CKO_DATA;
+    CK_BBOOL ck_true = CK_TRUE;
+    CK_BBOOL ck_false = CK_FALSE;
+
+    CK_ATTRIBUTE tmpl[] = {
+        { CKA_CLASS,   &clazz,       sizeof(clazz)            },
+        { CKA_TOKEN,   &ck_true,     sizeof(ck_true)          },
+        { CKA_PRIVATE, &ck_false,    sizeof(ck_false)         },
+        { CKA_LABEL,   CREATE_LABEL, sizeof(CREATE_LABEL) - 1 },
+        { CKA_VALUE,   _data,        64                       },
+    };
+
+    CK_OBJECT_HANDLE h;
+    CK_RV rv = p11->C_CreateObject(t->session, tmpl, ARRAY_LEN(tmpl), &h);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    return p11->C_DestroyObject(t->session, h);
+}
+
+static CK_RV op_get_attribute_value(bench_thread *t) {
+
+    CK_BYTE modulus[512];
+    CK_BYTE id[64];
+    CK_BYTE label[64];
+
+    CK_ATTRIBUTE tmpl[] = {
+        { CKA_MODULUS, modulus, sizeof(modulus) },
+        { CKA_ID,      id,      sizeof(id)      },
+        { CKA_LABEL,   label,   sizeof(label)   },
+    };
+
+    return t->ctx->p11->C_GetAttributeValue(t->session,
+            t->ctx->keys.rsa_pub, tmpl, ARRAY_LEN(tmpl));
+}
+
+static CK_RV sign_done(bench_thread *t) {
+
+    CK_BYTE sig[512];
+    CK_ULONG siglen = sizeof(sig);
+
+    return t->ctx->p11->C_Sign(t->session, _data, 32, sig, &siglen);
+}
+
+static CK_RV sign(bench_thread *t, CK_MECHANISM_PTR mech, CK_OBJECT_HANDLE key) {
+
+    CK_FUNCTION_LIST_PTR p11 = t->ctx->p11;
+
+    CK_RV rv = p11->C_SignInit(t->session, mech, key);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    /* C_SignInit alone is timed, the signature is made by the done step */
+    if (t->op->done) {
+        return CKR_OK;
+    }
+
+    return sign_done(t);
+}
+
+static CK_RV op_sign_rsa_pkcs(bench_thread *t) {
+
+    CK_MECHANISM mech = { CKM_SHA256_RSA_PKCS, NULL, 0 };
+
+    return sign(t, &mech, t->ctx->keys.rsa_priv);
+}
+
+static CK_RV op_sign_rsa_pss(bench_thread *t) {
+
+    CK_RSA_PKCS_PSS_PARAMS params = {
+        .hashAlg = CKM_SHA256,
+        .mgf = CKG_MGF1_SHA256,
+        .sLen = 32,
+    };
+
+    CK_MECHANISM mech = { CKM_SHA256_RSA_PKCS_PSS, &params, sizeof(params) };
+
+    return sign(t, &mech, t->ctx->keys.rsa_priv);
+}
+
+static CK_RV op_sign_ecdsa(bench_thread *t) {
+
+    CK_MECHANISM mech = { CKM_ECDSA_SHA256, NULL, 0 };
+
+    return sign(t, &mech, t->ctx->keys.ec_priv);
+}
+
+static CK_RV op_sign_hmac(bench_thread *t) {
+
+    CK_MECHANISM mech = { CKM_SHA256_HMAC, NULL, 0 };
+
+    return sign(t, &mech, t->ctx->keys.hmac);
+}
+
+static CK_RV encrypt(bench_thread *t, CK_MECHANISM_PTR mech) {
+
+    CK_FUNCTION_LIST_PTR p11 = t->ctx->p11;
+
+    CK_RV rv = p11->C_EncryptInit(t->session, mech, t->ctx->keys.aes);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    static __thread CK_BYTE ciphertext[sizeof(_data) + 16];
+    CK_ULONG len = sizeof(ciphertext);
+
+    return p11->C_Encrypt(t->session, _data, t->ctx->size, ciphertext, &len);
+}
+
+static CK_RV op_encrypt_aes_cbc(bench_thread *t) {
+
+    CK_BYTE iv[16] = { 0 };
+    CK_MECHANISM mech = { CKM_AES_CBC, iv, sizeof(iv) };
+
+    return encrypt(t, &mech);
+}
+
+static CK_RV op_encrypt_aes_ctr(bench_thread *t) {
+
+    CK_AES_CTR_PARAMS params = {
+        .ulCounterBits = 128,
+        .cb = { 0 },
+    };
+    CK_MECHANISM mech = { CKM_AES_CTR, &params, sizeof(params) };
+
+    return encrypt(t, &mech);
+}
+
+static CK_RV op_generate_random(bench_thread *t) {
+
+    CK_BYTE buf[32];
+
+    return t->ctx->p11->C_GenerateRandom(t->session, buf, sizeof(buf));
+}
+
+static CK_RV op_generate_key_pair(bench_thread *t) {
+
+    CK_FUNCTION_LIST_PTR p11 = t->ctx->p11;
+
+    /* DER OID for prime256v1 */
+    CK_BYTE ec_params[] = {
+        0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07
+    };
+    CK_BBOOL ck_false = CK_FALSE;
+    CK_BBOOL ck_true = CK_TRUE;
+
+    CK_ATTRIBUTE pub[] = {
+        { CKA_EC_PARAMS, ec_params, sizeof(ec_params) },
+        { CKA_TOKEN,     &ck_false, sizeof(ck_false)  },
+        { CKA_VERIFY,    &ck_true,  sizeof(ck_true)   },
+    };
+
+    CK_ATTRIBUTE priv[] = {
+        { CKA_TOKEN,     &ck_false, sizeof(ck_false)  },
+        { CKA_SIGN,      &ck_true,  sizeof(ck_true)   },
+        { CKA_PRIVATE,   &ck_true,  sizeof(ck_true)   },
+    };
+
+    CK_MECHANISM mech = { CKM_EC_KEY_PAIR_GEN, NULL, 0 };
+
+    CK_OBJECT_HANDLE hpub, hpriv;
+    CK_RV rv = p11->C_GenerateKeyPair(t->session, &mech,
+            pub, ARRAY_LEN(pub), priv, ARRAY_LEN(priv), &hpub, &hpriv);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    p11->C_DestroyObject(t->session, hpub);
+    p11->C_DestroyObject(t->session, hpriv);
+
+    return CKR_OK;
+}
+
+#define NO_KEY ((size_t)-1)
+#define KEY(k) offsetof(bench_keys, k)
+
+static const bench_op _ops[] = {
+    { "C_OpenSession",       "",         op_open_session,        NO_KEY,        { 0 }, NULL },
+    { "C_FindObjects",       "",         op_find_objects,        NO_KEY,        { 0 }, NULL },
+    { "C_CreateObject",      "DATA",     op_create_object,       NO_KEY,        { 0 }, NULL },
+    { "C_GetAttributeValue", "RSA",      op_get_attribute_value, KEY(rsa_pub),  { 0 }, NULL },
+    { "C_Sign",              "RSA_PKCS", op_sign_rsa_pkcs,       KEY(rsa_priv), { 0 }, NULL },
+    { "C_Sign",              "RSA_PSS",  op_sign_rsa_pss,        KEY(rsa_priv), { 0 }, NULL },
+    { "C_Sign",              "ECDSA",    op_sign_ecdsa,          KEY(ec_priv),  { 0 }, NULL },
+    { "C_Sign",              "HMAC",     op_sign_hmac,           KEY(hmac),     { 0 }, NULL },
+    { "C_SignInit",          "RSA_PKCS", op_sign_rsa_pkcs,       KEY(rsa_priv), { 0 }, sign_done },
+    { "C_SignInit",          "RSA_PSS",  op_sign_rsa_pss,        KEY(rsa_priv), { 0 }, sign_done },
+    { "C_SignInit",          "ECDSA",    op_sign_ecdsa,          KEY(ec_priv),  { 0 }, sign_done },
+    { "C_SignInit",          "HMAC",     op_sign_hmac,           KEY(hmac),     { 0 }, sign_done },
+    { "C_Encrypt",           "AES_CBC",  op_encrypt_aes_cbc,     KEY(aes),      { 16, 1024, 16384 }, NULL },
+    { "C_Encrypt",           "AES_CTR",  op_encrypt_aes_ctr,     KEY(aes),      { 16, 1024, 16384 }, NULL },
+    { "C_GenerateRandom",    "",         op_generate_random,     NO_KEY,        { 0 }, NULL },
+    { "C_GenerateKeyPair",   "EC_P256",  op_generate_key_pair,   NO_KEY,        { 0 }, NULL },
+};
+
+static bool op_selected(const char *name) {
+
+    if (!opts.ops) {
+        return true;
+    }
+
+    size_t len = strlen(name);
+    const char *p = opts.ops;
+    while (p && *p) {
+        if (!strncmp(p, name, len) && (p[len] == ',' || p[len] == '\0')) {
+            return true;
+        }
+        p = strchr(p, ',');
+        p = p ? p + 1 : NULL;
+    }
+
+    return false;
+}
+
+static bool record(bench_thread *t, uint64_t ns) {
+
+    if (t->nsamples == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 4096;
+        uint64_t *s = realloc(t->samples, cap * sizeof(*s));
+        if (!s) {
+            fprintf(stderr, "oom\n");
+            return false;
+        }
+        t->samples = s;
+        t->cap = cap;
+    }
+
+    t->samples[t->nsamples++] = ns;
+
+    return true;
+}
+
+static void *thread_main(void *arg) {
+
+    bench_thread *t = (bench_thread *)arg;
+
+    pthread_barrier_wait(&_barrier);
+
+    while (now_ns() < t->deadline) {
+        uint64_t start = now_ns();
+        CK_RV rv = t->op->fn(t);
+        uint64_t end = now_ns();
+
+        if (rv == CKR_OK && t->op->done) {
+            rv = t->op->done(t);
+        }
+
+        if (rv != CKR_OK) {
+            t->errors++;
+            t->last_error = rv;
+            continue;
+        }
+
+        if (!record(t, end - start)) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double pct_us(const uint64_t *s, size_t n, double pct) {
+
+    if (!n) {
+        return 0;
+    }
+
+    size_t i = (size_t)(pct / 100.0 * (n - 1) + 0.5);
+
+    return s[i] / 1000.0;
+}
+
+static void report(const char *name, const char *variant, unsigned threads,
+        CK_ULONG size, CK_ULONG store_size, double seconds,
+        uint64_t *samples, size_t n, uint64_t errors, CK_RV last_error) {
+
+    qsort(samples, n, sizeof(*samples), cmp_u64);
+
+    fprintf(opts.out, "{\"op\":\"%s\",\"variant\":\"%s\",\"threads\":%u,"
+            "\"size\":%lu,\"store_size\":%lu,\"ops\":%zu,\"errors\":%"PRIu64","
+            "\"last_error\":%lu,\"seconds\":%.3f,\"ops_per_sec\":%.1f,"
+            "\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+            name, variant, threads, size, store_size, n, errors, last_error,
+            seconds, seconds > 0 ? n / seconds : 0,
+            pct_us(samples, n, 50), pct_us(samples, n, 90),
+            pct_us(samples, n, 99), n ? samples[n - 1] / 1000.0 : 0);
+    fflush(opts.out);
+}
+
+static int run_op(bench_ctx *ctx, const bench_op *op, unsigned nthreads,
+        CK_ULONG store_size) {
+
+    bench_thread threads[MAX_THREADS] = { 0 };
+    int ret = 1;
+
+    unsigned i;
+    for (i=0; i < nthreads; i++) {
+        bench_thread *t = &threads[i];
+        t->ctx = ctx;
+        t->op = op;
+        CK_RV rv = ctx->p11->C_OpenSession(ctx->slot,
+                CKF_SERIAL_SESSION | CKF_RW_SESSION, NULL, NULL, &t->session);
+        if (rv != CKR_OK) {
+            fprintf(stderr, "C_OpenSession: 0x%lx\n", rv);
+            goto out;
+        }
+    }
+
+    pthread_barrier_init(&_barrier, NULL, nthreads);
+
+    uint64_t start = now_ns();
+    uint64_t deadline = start + opts.duration * 1000000000ULL;
+
+    unsigned started;
+    for (started=0; started < nthreads; started++) {
+        threads[started].deadline = deadline;
+        int rc = pthread_create(&threads[started].thread, NULL, thread_main,
+                &threads[started]);
+        if (rc) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(rc));
+            /* the barrier can't be met, so this is fatal */
+            exit(1);
+        }
+    }
+
+    for (i=0; i < nthreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+
+    double seconds = (now_ns() - start) / 1e9;
+
+    pthread_barrier_destroy(&_barrier);
+
+    /* merge the per thread samples */
+    size_t total = 0;
+    uint64_t errors = 0;
+    CK_RV last_error = CKR_OK;
+    for (i=0; i < nthreads; i++) {
+        total += threads[i].nsamples;
+        errors += threads[i].errors;
+        if (threads[i].errors) {
+            last_error = threads[i].last_error;
+        }
+    }
+
+    uint64_t *merged = calloc(total ? total : 1, sizeof(*merged));
+    if (!merged) {
+        fprintf(stderr, "oom\n");
+        goto out;
+    }
+
+    size_t off = 0;
+    for (i=0; i < nthreads; i++) {
+        memcpy(&merged[off], threads[i].samples,
+                threads[i].nsamples * sizeof(*merged));
+        off += threads[i].nsamples;
+    }
+
+    report(op->name, op->variant, nthreads, ctx->size, store_size, seconds,
+            merged, total, errors, last_error);
+
+    free(merged);
+
+    ret = 0;
+
+out:
+    for (i=0; i < nthreads; i++) {
+        if (threads[i].session) {
+            ctx->p11->C_CloseSession(threads[i].session);
+        }
+        free(threads[i].samples);
+    }
+
+    return ret;
+}
+
+static CK_RV init_library(CK_FUNCTION_LIST_PTR p11) {
+
+    CK_C_INITIALIZE_ARGS args = {
+        .flags = CKF_OS_LOCKING_OK,
+    };
+
+    return p11->C_Initialize(&args);
+}
+
+static void bench_initialize(CK_FUNCTION_LIST_PTR p11) {
+
+    uint64_t *samples = calloc(4096, sizeof(*samples));
+    if (!samples) {
+        fprintf(stderr, "oom\n");
+        return;
+    }
+
+    size_t n = 0;
+    uint64_t errors = 0;
+    CK_RV last_error = CKR_OK;
+
+    uint64_t start = now_ns();
+    uint64_t deadline = start + opts.duration * 1000000000ULL;
+    while (n < 4096 && now_ns() < deadline) {
+        uint64_t s = now_ns();
+        CK_RV rv = init_library(p11);
+        uint64_t e = now_ns();
+        if (rv != CKR_OK) {
+            errors++;
+            last_error = rv;
+            continue;
+        }
+        samples[n++] = e - s;
+        p11->C_Finalize(NULL);
+    }
+
+    report("C_Initialize", "", 1, 0, 0, (now_ns() - start) / 1e9,
+            samples, n, errors, last_error);
+
+    free(samples);
+}
+
+static CK_RV find_slot(CK_FUNCTION_LIST_PTR p11, CK_SLOT_ID *slot) {
+
+    CK_SLOT_ID slots[32];
+    CK_ULONG count = ARRAY_LEN(slots);
+
+    CK_RV rv = p11->C_GetSlotList(CK_TRUE, slots, &count);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    size_t len = strlen(opts.token);
+
+    CK_ULONG i;
+    for (i=0; i < count; i++) {
+        CK_TOKEN_INFO info;
+        rv = p11->C_GetTokenInfo(slots[i], &info);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+
+        /* labels are blank padded */
+        if (len <= sizeof(info.label)
+                && !memcmp(info.label, opts.token, len)
+                && (len == sizeof(info.label) || info.label[len] == ' ')) {
+            *slot = slots[i];
+            return CKR_OK;
+        }
+    }
+
+    fprintf(stderr, "Token \"%s\" not found\n", opts.token);
+    return CKR_TOKEN_NOT_PRESENT;
+}
+
+static CK_OBJECT_HANDLE find_key(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE s,
+        CK_OBJECT_CLASS clazz, CK_KEY_TYPE key_type, bool key_type_match) {
+
+    CK_ATTRIBUTE tmpl[] = {
+        { CKA_CLASS, &clazz, sizeof(clazz) },
+    };
+
+    CK_OBJECT_HANDLE found = CK_INVALID_HANDLE;
+
+    CK_RV rv = p11->C_FindObjectsInit(s, tmpl, ARRAY_LEN(tmpl));
+    if (rv != CKR_OK) {
+        return CK_INVALID_HANDLE;
+    }
+
+    CK_OBJECT_HANDLE handles[64];
+    CK_ULONG count = 0;
+    rv = p11->C_FindObjects(s, handles, ARRAY_LEN(handles), &count);
+    p11->C_FindObjectsFinal(s);
+    if (rv != CKR_OK) {
+        return CK_INVALID_HANDLE;
+    }
+
+    CK_ULONG i;
+    for (i=0; i < count && found == CK_INVALID_HANDLE; i++) {
+
+        CK_KEY_TYPE type = 0;
+        CK_BBOOL always_auth = CK_FALSE;
+        CK_ATTRIBUTE attrs[] = {
+            { CKA_KEY_TYPE,              &type,        sizeof(type)        },
+            { CKA_ALWAYS_AUTHENTICATE,   &always_auth, sizeof(always_auth) },
+        };
+
+        rv = p11->C_GetAttributeValue(s, handles[i], attrs, ARRAY_LEN(attrs));
+        if (rv != CKR_OK && rv != CKR_ATTRIBUTE_TYPE_INVALID) {
+            continue;
+        }
+
+        /* context specific logins would dominate the measurement */
+        if (attrs[1].ulValueLen == sizeof(always_auth) && always_auth) {
+            continue;
+        }
+
+        if ((type == key_type) == key_type_match) {
+            found = handles[i];
+        }
+    }
+
+    return found;
+}
+
+static CK_RV find_keys(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE s, bench_keys *keys) {
+
+    keys->rsa_priv = find_key(p11, s, CKO_PRIVATE_KEY, CKK_RSA, true);
+    keys->rsa_pub  = find_key(p11, s, CKO_PUBLIC_KEY,  CKK_RSA, true);
+    keys->ec_priv  = find_key(p11, s, CKO_PRIVATE_KEY, CKK_EC,  true);
+    keys->aes      = find_key(p11, s, CKO_SECRET_KEY,  CKK_AES, true);
+    /* the HMAC key type depends on the digest, anything but AES will do */
+    keys->hmac     = find_key(p11, s, CKO_SECRET_KEY,  CKK_AES, false);
+
+    return CKR_OK;
+}
+
+/*
+ * Grows or shrinks the number of FIND_LABEL token objects to size.
+ */
+static CK_RV set_store_size(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE s,
+        CK_OBJECT_HANDLE *handles, CK_ULONG *have, CK_ULONG size) {
+
+    CK_OBJECT_CLASS clazz = CKO_DATA;
+    CK_BBOOL ck_true = CK_TRUE;
+    CK_BBOOL ck_false = CK_FALSE;
+    CK_BYTE value[64] = { 0 };
+
+    CK_ATTRIBUTE tmpl[] = {
+        { CKA_CLASS,   &clazz,     sizeof(clazz)          },
+        { CKA_TOKEN,   &ck_true,   sizeof(ck_true)        },
+        { CKA_PRIVATE, &ck_false,  sizeof(ck_false)       },
+        { CKA_LABEL,   FIND_LABEL, sizeof(FIND_LABEL) - 1 },
+        { CKA_VALUE,   value,      sizeof(value)          },
+    };
+
+    while (*have < size) {
+        CK_RV rv = p11->C_CreateObject(s, tmpl, ARRAY_LEN(tmpl), &handles[*have]);
+        if (rv != CKR_OK) {
+            fprintf(stderr, "C_CreateObject: 0x%lx\n", rv);
+            return rv;
+        }
+        *have += 1;
+    }
+
+    while (*have > size) {
+        CK_RV rv = p11->C_DestroyObject(s, handles[*have - 1]);
+        if (rv != CKR_OK) {
+            fprintf(stderr, "C_DestroyObject: 0x%lx\n", rv);
+            return rv;
+        }
+        *have -= 1;
+    }
+
+    return CKR_OK;
+}
+
+static int run_all(CK_FUNCTION_LIST_PTR p11) {
+
+    int ret = 1;
+    CK_OBJECT_HANDLE *store = NULL;
+    CK_ULONG have = 0;
+    bool is_init = false;
+    CK_SESSION_HANDLE s = CK_INVALID_HANDLE;
+
+    bench_ctx ctx = { .p11 = p11 };
+
+    CK_RV rv = init_library(p11);
+    if (rv != CKR_OK) {
+        fprintf(stderr, "C_Initialize: 0x%lx\n", rv);
+        return 1;
+    }
+    is_init = true;
+
+    rv = find_slot(p11, &ctx.slot);
+    if (rv != CKR_OK) {
+        goto out;
+    }
+
+    /* login state is shared by every session of the application */
+    rv = p11->C_OpenSession(ctx.slot, CKF_SERIAL_SESSION | CKF_RW_SESSION,
+            NULL, NULL, &s);
+    if (rv != CKR_OK) {
+        fprintf(stderr, "C_OpenSession: 0x%lx\n", rv);
+        goto out;
+    }
+
+    rv = p11->C_Login(s, CKU_USER, (CK_UTF8CHAR_PTR)opts.pin, strlen(opts.pin));
+    if (rv != CKR_OK) {
+        fprintf(stderr, "C_Login: 0x%lx\n", rv);
+        goto out;
+    }
+
+    find_keys(p11, s, &ctx.keys);
+
+    unsigned long max_store = 0;
+    size_t i;
+    for (i=0; i < opts.nstore_sizes; i++) {
+        if (opts.store_sizes[i] > max_store) {
+            max_store = opts.store_sizes[i];
+        }
+    }
+
+    store = calloc(max_store ? max_store : 1, sizeof(*store));
+    if (!store) {
+        fprintf(stderr, "oom\n");
+        goto out;
+    }
+
+    for (i=0; i < ARRAY_LEN(_ops); i++) {
+        const bench_op *op = &_ops[i];
+
+        if (!op_selected(op->name)) {
+            continue;
+        }
+
+        if (op->key_offset != NO_KEY &&
+                *(CK_OBJECT_HANDLE *)((char *)&ctx.keys + op->key_offset) == CK_INVALID_HANDLE) {
+            fprintf(stderr, "Skipping %s %s, no suitable key\n", op->name, op->variant);
+            continue;
+        }
+
+        /* these are measured at every store size */
+        bool is_sized = op->fn == op_find_objects || op->fn == op_create_object;
+        size_t nstores = is_sized ? opts.nstore_sizes : 1;
+
+        size_t k;
+        for (k=0; k < nstores; k++) {
+
+            CK_ULONG store_size = is_sized ? opts.store_sizes[k] : 0;
+            if (is_sized) {
+                rv = set_store_size(p11, s, store, &have, store_size);
+                if (rv != CKR_OK) {
+                    goto out;
+                }
+            }
+
+            size_t j = 0;
+            do {
+                ctx.size = op->sizes[j];
+
+                size_t t;
+                for (t=0; t < opts.nthreads; t++) {
+                    if (run_op(&ctx, op, opts.threads[t], store_size)) {
+                        goto out;
+                    }
+                }
+            } while (++j < ARRAY_LEN(op->sizes) && op->sizes[j]);
+        }
+    }
+
+    ret = 0;
+
+out:
+    if (store) {
+        set_store_size(p11, s, store, &have, 0);
+        free(store);
+    }
+
+    if (is_init) {
+        p11->C_Finalize(NULL);
+    }
+
+    /* runs last, it needs the library finalized */
+    if (!ret && op_selected("C_Initialize")) {
+        bench_initialize(p11);
+    }
+
+    return ret;
+}
+
+static size_t parse_list(const char *arg, unsigned long *out, size_t max) {
+
+    size_t n = 0;
+    const char *p = arg;
+    while (*p && n < max) {
+        char *end = NULL;
+        errno = 0;
+        unsigned long v = strtoul(p, &end, 0);
+        if (errno || end == p || (*end && *end != ',')) {
+            return 0;
+        }
+        out[n++] = v;
+        p = *end ? end + 1 : end;
+    }
+
+    return n;
+}
+
+static void usage(const char *prog) {
+
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --module=PATH       PKCS11 module, defaults to $TPM2_PKCS11_MODULE\n"
+        "  --token=LABEL       token to use, defaults to \"" DEFAULT_TOKEN "\"\n"
+        "  --pin=PIN           user pin, defaults to \"" DEFAULT_PIN "\"\n"
+        "  --threads=N,...     thread counts to run, defaults to " DEFAULT_THREADS "\n"
+        "  --store-sizes=N,... object counts for C_FindObjects and C_CreateObject,\n"
+        "                      defaults to " DEFAULT_SIZES "\n"
+        "  --duration=SEC      seconds per measurement, defaults to %u\n"
+        "  --ops=NAME,...      only run the named entry points\n"
+        "  --output=FILE       write results to FILE, defaults to stdout\n",
+        prog, DEFAULT_DURATION);
+}
+
+static bool parse_args(int argc, char *argv[]) {
+
+    unsigned long list[MAX_LIST];
+
+    opts.module = getenv("TPM2_PKCS11_MODULE");
+    opts.token = DEFAULT_TOKEN;
+    opts.pin = DEFAULT_PIN;
+    opts.duration = DEFAULT_DURATION;
+    opts.out = stdout;
+
+    const char *threads = DEFAULT_THREADS;
+    const char *sizes = DEFAULT_SIZES;
+
+    int i;
+    for (i=1; i < argc; i++) {
+        const char *a = argv[i];
+        const char *v = strchr(a, '=');
+        v = v ? v + 1 : "";
+
+        if (!strncmp(a, "--module=", 9)) {
+            opts.module = v;
+        } else if (!strncmp(a, "--token=", 8)) {
+            opts.token = v;
+        } else if (!strncmp(a, "--pin=", 6)) {
+            opts.pin = v;
+        } else if (!strncmp(a, "--threads=", 10)) {
+            threads = v;
+        } else if (!strncmp(a, "--store-sizes=", 14)) {
+            sizes = v;
+        } else if (!strncmp(a, "--duration=", 11)) {
+            opts.duration = strtoul(v, NULL, 0);
+        } else if (!strncmp(a, "--ops=", 6)) {
+            opts.ops = v;
+        } else if (!strncmp(a, "--output=", 9)) {
+            opts.out = fopen(v, "w");
+            if (!opts.out) {
+                fprintf(stderr, "Could not open \"%s\": %s\n", v, strerror(errno));
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+
+    opts.nthreads = parse_list(threads, list, MAX_LIST);
+    size_t j;
+    for (j=0; j < opts.nthreads; j++) {
+        if (!list[j] || list[j] > MAX_THREADS) {
+            fprintf(stderr, "Thread counts must be 1 to %u\n", MAX_THREADS);
+            return false;
+        }
+        opts.threads[j] = list[j];
+    }
+
+    opts.nstore_sizes = parse_list(sizes, opts.store_sizes, MAX_LIST);
+
+    return opts.module && opts.nthreads && opts.nstore_sizes && opts.duration;
+}
+
+int main(int argc, char *argv[]) {
+
+    if (!parse_args(argc, argv)) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    void *dl = dlopen(opts.module, RTLD_NOW | RTLD_LOCAL);
+    if (!dl) {
+        fprintf(stderr, "dlopen: %s\n", dlerror());
+        return 1;
+    }
+
+    CK_C_GetFunctionList get_list =
+            (CK_C_GetFunctionList)dlsym(dl, "C_GetFunctionList");
+    if (!get_list) {
+        fprintf(stderr, "dlsym: %s\n", dlerror());
+        dlclose(dl);
+        return 1;
+    }
+
+    CK_FUNCTION_LIST_PTR p11 = NULL;
+    CK_RV rv = get_list(&p11);
+    if (rv != CKR_OK) {
+        fprintf(stderr, "C_GetFunctionList: 0x%lx\n", rv);
+        dlclose(dl);
+        return 1;
+    }
+
+    memset(_data, 0xA5, sizeof(_data));
+
+    int ret = run_all(p11);
+
+    if (opts.out != stdout) {
+        fclose(opts.out);
+    }
+
+    dlclose(dl);
+
+    return ret;
+}
@@ -0,0 +1,98 @@
+#!/usr/bin/env bash
+# SPDX-License-Identifier: BSD-2-Clause
+#
+# Times the tpm2_ptool commands that provision a store, once with each
+# backend of its Tpm2 class: "tools" runs a tpm2-tools process per TPM
+# command, "esapi" keeps one tpm2-pytss ESAPI context for the command.
+# Every result is one line of JSON, like the results of pkcs11-bench.
+#
+set -e
+
+usage_error ()
+{
+    echo "$0: $*" >&2
+    print_usage >&2
+    exit 2
+}
+print_usage ()
+{
+    cat <<END
+Usage:
+    ptool-bench.sh [--runs=N] [--backends=esapi,tools] [--output=FILE]
+END
+}
+
+RUNS=5
+BACKENDS="esapi,tools"
+OUTPUT=/dev/stdout
+while test $# -gt 0; do
+    case $1 in
+    --help) print_usage; exit $?;;
+    --runs=*) RUNS="${1#*=}";;
+    --backends=*) BACKENDS="${1#*=}";;
+    --output=*) OUTPUT="${1#*=}";;
+    *) usage_error "invalid option: '$1'";;
+    esac
+    shift
+done
+
+if [ "$OUTPUT" != /dev/stdout ]; then
+    : > "$OUTPUT"
+fi
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+openssl genrsa -out "$tmp/rsa.pem" 2048 2>/dev/null
+openssl ecparam -genkey -name prime256v1 -noout -out "$tmp/ecc.pem" 2>/dev/null
+
+now_ns ()
+{
+    date +%s%N
+}
+
+# result <op> <variant> <backend> <start_ns>
+result ()
+{
+    local ns=$(( $(now_ns) - $4 ))
+    printf '{"op":"%s","variant":"%s","backend":"%s","runs":%u,"seconds":%u.%03u,"mean_ms":%u.%03u}\n' \
+        "$1" "$2" "$3" "$RUNS" \
+        $((ns / 1000000000)) $((ns / 1000000 % 1000)) \
+        $((ns / RUNS / 1000000)) $((ns / RUNS / 1000 % 1000)) >> "$OUTPUT"
+}
+
+for backend in ${BACKENDS//,/ }; do
+    export TPM2_PKCS11_PTOOL_BACKEND=$backend
+
+    store="$tmp/$backend"
+    mkdir "$store"
+
+    start=$(now_ns)
+    tpm2_ptool init --transient-parent=tpm2-tools-default --path="$store" > /dev/null
+    RUNS=1 result init transient "$backend" "$start"
+
+    start=$(now_ns)
+    for i in $(seq "$RUNS"); do
+        tpm2_ptool addtoken --pid=1 --sopin=mysopin --userpin=myuserpin \
+            --label="token$i" --path="$store" > /dev/null
+    done
+    result addtoken seal "$backend" "$start"
+
+    for alg in rsa2048 ecc256 aes128 hmac:sha256; do
+        start=$(now_ns)
+        for i in $(seq "$RUNS"); do
+            tpm2_ptool addkey --label=token1 --userpin=myuserpin --algorithm="$alg" \
+                --path="$store" > /dev/null
+        done
+        result addkey "$alg" "$backend" "$start"
+    done
+
+    for alg in rsa ecc; do
+        start=$(now_ns)
+        for i in $(seq "$RUNS"); do
+            tpm2_ptool import --label=token1 --userpin=myuserpin --algorithm="$alg" \
+                --privkey="$tmp/$alg.pem" --path="$store" > /dev/null
+        done
+        result import "$alg" "$backend" "$start"
+    done
+done
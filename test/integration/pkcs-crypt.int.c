@@ -1786,6 +1786,131 @@ static void test_aes_ctr_bad_counter_size(void **state) {
     assert_int_equal(rv, CKR_MECHANISM_PARAM_INVALID);
 }
 
+static void test_aes_message_encrypt_decrypt(void **state) {
+
+    test_info *ti = test_info_from_state(state);
+
+    CK_SESSION_HANDLE session = ti->handle;
+
+    CK_INTERFACE_PTR iface = NULL;
+    CK_RV rv = C_GetInterface(NULL, NULL, &iface, 0);
+    assert_int_equal(rv, CKR_OK);
+    CK_FUNCTION_LIST_3_0_PTR f = (CK_FUNCTION_LIST_3_0_PTR)iface->pFunctionList;
+    assert_int_equal(f->version.major, 3);
+
+    CK_BYTE iv[16] = {
+        0xDE, 0xAD, 0xBE, 0xEF,
+        0xDE, 0xAD, 0xBE, 0xEF,
+        0xDE, 0xAD, 0xBE, 0xEF,
+        0xDE, 0xAD, 0xBE, 0xEF,
+    };
+
+    CK_BYTE iv2[16] = {
+        0xCA, 0xFE, 0xBA, 0xBE,
+        0xCA, 0xFE, 0xBA, 0xBE,
+        0xCA, 0xFE, 0xBA, 0xBE,
+        0xCA, 0xFE, 0xBA, 0xBE,
+    };
+
+    CK_MECHANISM mechanism = {
+        CKM_AES_CBC, iv, sizeof(iv)
+    };
+
+    CK_BYTE plaintext[] = {
+        'm', 'y', ' ', 's', 'e', 'c', 'r', 'e', 't', ' ', 'i', 's', 'c', 'o', 'o', 'l',
+        'm', 'y', ' ', 's', 'e', 'c', 'r', 'e', 't', ' ', 'i', 's', 'c', 'o', 'o', 'l',
+    };
+
+    /* the 2.40 way gives the expected ciphertext */
+    CK_BYTE expected[sizeof(plaintext)] = { 0 };
+    CK_ULONG expected_len = sizeof(expected);
+
+    rv = C_EncryptInit(session, &mechanism, ti->objects.aes);
+    assert_int_equal(rv, CKR_OK);
+    rv = C_Encrypt(session, plaintext, sizeof(plaintext), expected, &expected_len);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = f->C_MessageEncryptInit(session, &mechanism, ti->objects.aes);
+    assert_int_equal(rv, CKR_OK);
+
+    /* each message takes its IV, so the chain doesn't carry over */
+    CK_BYTE ciphertext[sizeof(plaintext)];
+    CK_ULONG ciphertext_len;
+    unsigned i;
+    for (i=0; i < 2; i++) {
+        ciphertext_len = sizeof(ciphertext);
+        rv = f->C_EncryptMessage(session, iv, sizeof(iv), NULL, 0,
+                plaintext, sizeof(plaintext), ciphertext, &ciphertext_len);
+        assert_int_equal(rv, CKR_OK);
+        assert_int_equal(ciphertext_len, expected_len);
+        assert_memory_equal(ciphertext, expected, expected_len);
+    }
+
+    /* an IV is required */
+    ciphertext_len = sizeof(ciphertext);
+    rv = f->C_EncryptMessage(session, NULL, 0, NULL, 0,
+            plaintext, sizeof(plaintext), ciphertext, &ciphertext_len);
+    assert_int_equal(rv, CKR_MECHANISM_PARAM_INVALID);
+
+    /* no AEAD, so no associated data */
+    rv = f->C_EncryptMessage(session, iv, sizeof(iv), plaintext, 1,
+            plaintext, sizeof(plaintext), ciphertext, &ciphertext_len);
+    assert_int_equal(rv, CKR_ARGUMENTS_BAD);
+
+    CK_BYTE other[sizeof(plaintext)];
+    CK_ULONG other_len = sizeof(other);
+    rv = f->C_EncryptMessage(session, iv2, sizeof(iv2), NULL, 0,
+            plaintext, sizeof(plaintext), other, &other_len);
+    assert_int_equal(rv, CKR_OK);
+    assert_memory_not_equal(other, expected, sizeof(other));
+
+    /* in parts, with a size query on the last one */
+    rv = f->C_EncryptMessageBegin(session, iv, sizeof(iv), NULL, 0);
+    assert_int_equal(rv, CKR_OK);
+
+    CK_ULONG part_len = sizeof(ciphertext);
+    rv = f->C_EncryptMessageNext(session, iv, sizeof(iv), plaintext, 20,
+            ciphertext, &part_len, 0);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(part_len, 16);
+
+    CK_ULONG last_len = 0;
+    rv = f->C_EncryptMessageNext(session, iv, sizeof(iv), &plaintext[20],
+            sizeof(plaintext) - 20, NULL, &last_len, CKF_END_OF_MESSAGE);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(last_len, 16);
+
+    rv = f->C_EncryptMessageNext(session, iv, sizeof(iv), &plaintext[20],
+            sizeof(plaintext) - 20, &ciphertext[part_len], &last_len,
+            CKF_END_OF_MESSAGE);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(part_len + last_len, expected_len);
+    assert_memory_equal(ciphertext, expected, expected_len);
+
+    rv = f->C_MessageEncryptFinal(session);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = f->C_MessageDecryptInit(session, &mechanism, ti->objects.aes);
+    assert_int_equal(rv, CKR_OK);
+
+    CK_BYTE plaintext2[sizeof(plaintext)];
+    CK_ULONG plaintext2_len = sizeof(plaintext2);
+    rv = f->C_DecryptMessage(session, iv2, sizeof(iv2), NULL, 0,
+            other, other_len, plaintext2, &plaintext2_len);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(plaintext2_len, sizeof(plaintext));
+    assert_memory_equal(plaintext2, plaintext, sizeof(plaintext));
+
+    plaintext2_len = sizeof(plaintext2);
+    rv = f->C_DecryptMessage(session, iv, sizeof(iv), NULL, 0,
+            expected, expected_len, plaintext2, &plaintext2_len);
+    assert_int_equal(rv, CKR_OK);
+    assert_memory_equal(plaintext2, plaintext, sizeof(plaintext));
+
+    rv = f->C_MessageDecryptFinal(session);
+    assert_int_equal(rv, CKR_OK);
+}
+
 int main() {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test_setup_teardown(test_aes_always_authenticate,
@@ -1830,6 +1955,8 @@ int main() {
                 test_setup, test_teardown),
         cmocka_unit_test_setup_teardown(test_aes_ctr_bad_counter_size,
                 test_setup, test_teardown),
+        cmocka_unit_test_setup_teardown(test_aes_message_encrypt_decrypt,
+                test_setup, test_teardown),
     };
 
     return cmocka_run_group_tests(tests, group_setup, group_teardown);
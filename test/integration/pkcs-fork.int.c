@@ -0,0 +1,362 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Forks workers from a process that initialized the library and logged in,
+ * the way pre-forking servers do, and checks every worker can sign with
+ * the state it inherited. Reports how long workers take from the fork to
+ * their first signature, against workers that finalize and initialize the
+ * library again.
+ *
+ * TEST_FORK_WORKERS    workers forked at once, default 16
+ */
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "test.h"
+
+#define DEFAULT_WORKERS 16
+#define MAX_WORKERS     256
+
+#define WORK_TOKEN "label"
+
+typedef struct fork_ctx fork_ctx;
+struct fork_ctx {
+    CK_SLOT_ID slot;
+    CK_SESSION_HANDLE session;
+    CK_OBJECT_HANDLE key;
+};
+
+/* what a worker writes back to the parent */
+typedef struct fork_result fork_result;
+struct fork_result {
+    CK_RV rv;
+    uint64_t ready_ns;
+};
+
+typedef CK_RV (*fork_worker)(fork_ctx *ctx);
+
+static unsigned _workers = DEFAULT_WORKERS;
+
+static const CK_BYTE _data[32] = { 'F', 'O', 'R', 'K' };
+
+static uint64_t now_ns(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static CK_SLOT_ID find_slot(const char *label) {
+
+    CK_SLOT_ID slots[TOKEN_COUNT + 1];
+    CK_ULONG count = ARRAY_LEN(slots);
+    CK_RV rv = C_GetSlotList(true, slots, &count);
+    if (rv != CKR_OK) {
+        return (CK_SLOT_ID)-1;
+    }
+
+    size_t len = strlen(label);
+
+    CK_ULONG i;
+    for (i=0; i < count; i++) {
+        CK_TOKEN_INFO info;
+        rv = C_GetTokenInfo(slots[i], &info);
+        if (rv != CKR_OK) {
+            return (CK_SLOT_ID)-1;
+        }
+
+        /* labels are blank padded */
+        if (!memcmp(info.label, label, len) && info.label[len] == ' ') {
+            return slots[i];
+        }
+    }
+
+    return (CK_SLOT_ID)-1;
+}
+
+static CK_RV find_key(CK_SESSION_HANDLE session, const char *label,
+        CK_OBJECT_HANDLE *key) {
+
+    CK_OBJECT_CLASS key_class = CKO_PRIVATE_KEY;
+    CK_ATTRIBUTE tmpl[] = {
+        { CKA_CLASS, &key_class, sizeof(key_class) },
+        { CKA_LABEL, (void *)label, strlen(label) },
+    };
+
+    CK_RV rv = C_FindObjectsInit(session, tmpl, ARRAY_LEN(tmpl));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_ULONG count = 0;
+    rv = C_FindObjects(session, key, 1, &count);
+    CK_RV rv2 = C_FindObjectsFinal(session);
+    if (rv == CKR_OK) {
+        rv = count == 1 ? rv2 : CKR_KEY_HANDLE_INVALID;
+    }
+
+    return rv;
+}
+
+static CK_RV sign(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE key) {
+
+    CK_MECHANISM mech = { CKM_SHA256_RSA_PKCS, NULL, 0 };
+
+    CK_RV rv = C_SignInit(session, &mech, key);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_BYTE sig[512];
+    CK_ULONG siglen = sizeof(sig);
+
+    return C_Sign(session, (CK_BYTE_PTR)_data, sizeof(_data), sig, &siglen);
+}
+
+/* uses what the parent left: its login and object handles */
+static CK_RV worker_inherit(fork_ctx *ctx) {
+
+    CK_SESSION_HANDLE session;
+    CK_RV rv = C_OpenSession(ctx->slot, CKF_SERIAL_SESSION, NULL, NULL,
+            &session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    return sign(session, ctx->key);
+}
+
+/* what workers had to do without fork support */
+static CK_RV worker_reinit(fork_ctx *ctx) {
+
+    CK_RV rv = C_Finalize(NULL);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_C_INITIALIZE_ARGS args = {
+        .flags = CKF_OS_LOCKING_OK,
+    };
+
+    rv = C_Initialize(&args);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_SLOT_ID slot = find_slot(WORK_TOKEN);
+    if (slot == (CK_SLOT_ID)-1) {
+        return CKR_SLOT_ID_INVALID;
+    }
+
+    CK_SESSION_HANDLE session;
+    rv = C_OpenSession(slot, CKF_SERIAL_SESSION, NULL, NULL, &session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    rv = C_Login(session, CKU_USER, (CK_UTF8CHAR_PTR)GOOD_USERPIN,
+            sizeof(GOOD_USERPIN) - 1);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_OBJECT_HANDLE key;
+    rv = find_key(session, "rsa0", &key);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    return sign(session, key);
+}
+
+/* forks a grandchild before touching the library, which signs */
+static CK_RV worker_nested(fork_ctx *ctx) {
+
+    int fds[2];
+    if (pipe(fds)) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    if (pid == 0) {
+        CK_RV rv = worker_inherit(ctx);
+        ssize_t n = write(fds[1], &rv, sizeof(rv));
+        _exit(n == sizeof(rv) ? 0 : 1);
+    }
+
+    close(fds[1]);
+
+    CK_RV rv = CKR_GENERAL_ERROR;
+    if (read(fds[0], &rv, sizeof(rv)) != sizeof(rv)) {
+        rv = CKR_GENERAL_ERROR;
+    }
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+
+    /* and the middle child still works after forking */
+    return rv == CKR_OK ? worker_inherit(ctx) : rv;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void run_workers(fork_ctx *ctx, const char *name, fork_worker fn) {
+
+    pid_t pids[MAX_WORKERS];
+    int fds[MAX_WORKERS];
+
+    unsigned i;
+    for (i=0; i < _workers; i++) {
+        int p[2];
+        int rc = pipe(p);
+        assert_int_equal(rc, 0);
+
+        uint64_t start = now_ns();
+        pid_t pid = fork();
+        assert_true(pid >= 0);
+
+        if (pid == 0) {
+            close(p[0]);
+            fork_result r = { .rv = fn(ctx) };
+            r.ready_ns = now_ns() - start;
+            ssize_t n = write(p[1], &r, sizeof(r));
+            _exit(n == sizeof(r) ? 0 : 1);
+        }
+
+        close(p[1]);
+        pids[i] = pid;
+        fds[i] = p[0];
+    }
+
+    uint64_t ready[MAX_WORKERS];
+    unsigned failed = 0;
+    for (i=0; i < _workers; i++) {
+        fork_result r = { .rv = CKR_GENERAL_ERROR };
+        if (read(fds[i], &r, sizeof(r)) != sizeof(r)) {
+            r.rv = CKR_GENERAL_ERROR;
+        }
+        close(fds[i]);
+
+        int status = 0;
+        waitpid(pids[i], &status, 0);
+
+        if (r.rv != CKR_OK || !WIFEXITED(status) || WEXITSTATUS(status)) {
+            fprintf(stderr, "worker %u (%s) failed: 0x%lx\n", i, name, r.rv);
+            failed++;
+        }
+
+        ready[i] = r.ready_ns;
+    }
+
+    qsort(ready, _workers, sizeof(ready[0]), cmp_u64);
+
+    printf("fork mode=%s workers=%u ready_ms min=%.2f median=%.2f max=%.2f\n",
+            name, _workers, ready[0] / 1e6, ready[_workers / 2] / 1e6,
+            ready[_workers - 1] / 1e6);
+
+    assert_int_equal(failed, 0);
+
+    /* the parent's connections must have survived its children */
+    CK_RV rv = sign(ctx->session, ctx->key);
+    assert_int_equal(rv, CKR_OK);
+}
+
+static int test_setup(void **state) {
+
+    CK_C_INITIALIZE_ARGS args = {
+        .flags = CKF_OS_LOCKING_OK,
+    };
+
+    CK_RV rv = C_Initialize(&args);
+    assert_int_equal(rv, CKR_OK);
+
+    fork_ctx *ctx = calloc(1, sizeof(*ctx));
+    assert_non_null(ctx);
+
+    ctx->slot = find_slot(WORK_TOKEN);
+    assert_int_not_equal(ctx->slot, (CK_SLOT_ID)-1);
+
+    rv = C_OpenSession(ctx->slot, CKF_SERIAL_SESSION, NULL, NULL,
+            &ctx->session);
+    assert_int_equal(rv, CKR_OK);
+
+    user_login(ctx->session);
+
+    rv = find_key(ctx->session, "rsa0", &ctx->key);
+    assert_int_equal(rv, CKR_OK);
+
+    /* the key is loaded in the parent, workers inherit it loaded */
+    rv = sign(ctx->session, ctx->key);
+    assert_int_equal(rv, CKR_OK);
+
+    *state = ctx;
+
+    return 0;
+}
+
+static int test_teardown(void **state) {
+
+    fork_ctx *ctx = (fork_ctx *)*state;
+
+    logout(ctx->session);
+
+    CK_RV rv = C_CloseAllSessions(ctx->slot);
+    assert_int_equal(rv, CKR_OK);
+
+    free(ctx);
+
+    rv = C_Finalize(NULL);
+    assert_int_equal(rv, CKR_OK);
+
+    return 0;
+}
+
+static void test_fork_inherit(void **state) {
+    run_workers((fork_ctx *)*state, "inherit", worker_inherit);
+}
+
+static void test_fork_reinit(void **state) {
+    run_workers((fork_ctx *)*state, "reinit", worker_reinit);
+}
+
+static void test_fork_nested(void **state) {
+    run_workers((fork_ctx *)*state, "nested", worker_nested);
+}
+
+int main() {
+
+    const char *workers = getenv("TEST_FORK_WORKERS");
+    if (workers && workers[0]) {
+        char *end = NULL;
+        unsigned long n = strtoul(workers, &end, 10);
+        if (*end || !n || n > MAX_WORKERS) {
+            fprintf(stderr, "TEST_FORK_WORKERS must be from 1 to %u, got \"%s\"\n",
+                    MAX_WORKERS, workers);
+            return 1;
+        }
+        _workers = n;
+    }
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_fork_inherit,
+                test_setup, test_teardown),
+        cmocka_unit_test_setup_teardown(test_fork_reinit,
+                test_setup, test_teardown),
+        cmocka_unit_test_setup_teardown(test_fork_nested,
+                test_setup, test_teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -1264,6 +1264,91 @@ static void test_create_data_object_private (void **state) {
     assert_int_equal(data_template3[0].ulValueLen, 0);
 }
 
+static void check_data_value(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE obj,
+        CK_BYTE_PTR expected, CK_ULONG len) {
+
+    CK_BYTE buf[64] = { 0 };
+    CK_ATTRIBUTE tmpl[] = {
+      { CKA_VALUE, buf, sizeof(buf) },
+    };
+
+    CK_RV rv = C_GetAttributeValue(session, obj, tmpl, ARRAY_LEN(tmpl));
+    assert_int_equal(rv, CKR_OK);
+
+    assert_int_equal(tmpl[0].ulValueLen, len);
+    assert_memory_equal(buf, expected, len);
+}
+
+/*
+ * The plaintext of a private value is kept while logged in, reads must see
+ * what was last set and logout must drop it.
+ */
+static void test_data_object_private_cached_value (void **state) {
+
+    test_info *ti = test_info_from_state(state);
+    CK_SESSION_HANDLE session = ti->handle;
+
+    user_login(session);
+
+    CK_BBOOL _true = CK_TRUE;
+
+    char label[] = "cached data object";
+    CK_OBJECT_CLASS object_class = CKO_DATA;
+    CK_BYTE value[] = "first private value";
+
+    CK_ATTRIBUTE data_template[] = {
+      { CKA_CLASS,       &object_class, sizeof(object_class) },
+      { CKA_TOKEN,       &_true,        sizeof(_true)        },
+      { CKA_PRIVATE,     &_true,        sizeof(_true)        },
+      { CKA_MODIFIABLE,  &_true,        sizeof(_true)        },
+      { CKA_LABEL,       label,         sizeof(label) - 1    },
+      { CKA_VALUE,       value,         sizeof(value)        }
+    };
+
+    CK_OBJECT_HANDLE obj = 0;
+    CK_RV rv = C_CreateObject(session, data_template, ARRAY_LEN(data_template), &obj);
+    assert_int_equal(rv, CKR_OK);
+
+    /* the second read comes from the cached plaintext */
+    check_data_value(session, obj, value, sizeof(value));
+    check_data_value(session, obj, value, sizeof(value));
+
+    /* a new value of another size replaces the cached one */
+    CK_BYTE new_value[] = "the second, longer private value";
+    CK_ATTRIBUTE set_template[] = {
+      { CKA_VALUE, new_value, sizeof(new_value) },
+    };
+
+    rv = C_SetAttributeValue(session, obj, set_template, ARRAY_LEN(set_template));
+    assert_int_equal(rv, CKR_OK);
+
+    check_data_value(session, obj, new_value, sizeof(new_value));
+
+    /* logged out the value can't be read */
+    logout(session);
+
+    CK_BYTE buf[64] = { 0 };
+    CK_ATTRIBUTE get_template[] = {
+      { CKA_VALUE, buf, sizeof(buf) },
+    };
+
+    rv = C_GetAttributeValue(session, obj, get_template, ARRAY_LEN(get_template));
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(get_template[0].ulValueLen, 0);
+
+    CK_BYTE zeros[sizeof(buf)] = { 0 };
+    assert_memory_equal(buf, zeros, sizeof(buf));
+
+    /* after login it's unwrapped again, from what C_SetAttributeValue wrapped */
+    user_login(session);
+
+    check_data_value(session, obj, new_value, sizeof(new_value));
+    check_data_value(session, obj, new_value, sizeof(new_value));
+
+    rv = C_DestroyObject(session, obj);
+    assert_int_equal(rv, CKR_OK);
+}
+
 static void test_create_data_object_public (void **state) {
 
     test_info *ti = test_info_from_state(state);
@@ -1308,6 +1393,8 @@ int main() {
             test_setup, test_teardown),
         cmocka_unit_test_setup_teardown(test_create_data_object_private,
             test_setup, test_teardown),
+        cmocka_unit_test_setup_teardown(test_data_object_private_cached_value,
+            test_setup, test_teardown),
         cmocka_unit_test_setup_teardown(test_create_obj_rsa_public_key,
             test_setup, test_teardown),
         cmocka_unit_test_setup_teardown(test_rsa_keygen_missing_attributes,
@@ -0,0 +1,262 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Reports how much heap a loaded token object costs. Measures the heap
+ * C_Initialize leaves in use with and without a batch of extra token
+ * objects in the store, data objects and EC key pairs, and prints the
+ * difference per object. Loaded objects keep their attribute values in a
+ * single block, so the figure should stay close to the size of the values.
+ *
+ * TEST_FOOTPRINT_OBJECTS  data objects to add, default 200
+ */
+#include "config.h"
+#include <inttypes.h>
+#ifdef HAVE_MALLINFO2
+#include <malloc.h>
+#endif
+
+#include "test.h"
+
+#define DEFAULT_OBJECTS 200
+#define MAX_OBJECTS     100000
+#define KEY_PAIRS       8
+#define VALUE_LEN       64
+
+#define WORK_TOKEN "label"
+#define APPLICATION "pkcs11-footprint"
+
+static unsigned _objects = DEFAULT_OBJECTS;
+
+static CK_SLOT_ID find_slot(const char *label) {
+
+    CK_SLOT_ID slots[TOKEN_COUNT + 1];
+    CK_ULONG count = ARRAY_LEN(slots);
+    CK_RV rv = C_GetSlotList(true, slots, &count);
+    if (rv != CKR_OK) {
+        return (CK_SLOT_ID)-1;
+    }
+
+    size_t len = strlen(label);
+
+    CK_ULONG i;
+    for (i=0; i < count; i++) {
+        CK_TOKEN_INFO info;
+        rv = C_GetTokenInfo(slots[i], &info);
+        if (rv != CKR_OK) {
+            return (CK_SLOT_ID)-1;
+        }
+
+        /* labels are blank padded */
+        if (!memcmp(info.label, label, len) && info.label[len] == ' ') {
+            return slots[i];
+        }
+    }
+
+    return (CK_SLOT_ID)-1;
+}
+
+static CK_SESSION_HANDLE open_session(void) {
+
+    CK_SLOT_ID slot = find_slot(WORK_TOKEN);
+    assert_int_not_equal(slot, (CK_SLOT_ID)-1);
+
+    CK_SESSION_HANDLE session;
+    CK_RV rv = C_OpenSession(slot, CKF_SERIAL_SESSION | CKF_RW_SESSION, NULL,
+            NULL, &session);
+    assert_int_equal(rv, CKR_OK);
+
+    user_login(session);
+
+    return session;
+}
+
+#ifdef HAVE_MALLINFO2
+static size_t heap_in_use(void) {
+
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks;
+}
+
+/* the heap C_Initialize leaves in use, which is mostly the loaded objects */
+static size_t init_heap(void) {
+
+    CK_C_INITIALIZE_ARGS args = {
+        .flags = CKF_OS_LOCKING_OK,
+    };
+
+    size_t before = heap_in_use();
+
+    CK_RV rv = C_Initialize(&args);
+    assert_int_equal(rv, CKR_OK);
+
+    size_t after = heap_in_use();
+
+    rv = C_Finalize(NULL);
+    assert_int_equal(rv, CKR_OK);
+
+    return after > before ? after - before : 0;
+}
+#endif
+
+static void create_objects(CK_SESSION_HANDLE session) {
+
+    CK_BYTE value[VALUE_LEN];
+    memset(value, 0xA5, sizeof(value));
+
+    CK_OBJECT_CLASS clazz = CKO_DATA;
+    CK_BBOOL ck_true = CK_TRUE;
+    CK_BBOOL ck_false = CK_FALSE;
+
+    unsigned i;
+    for (i=0; i < _objects; i++) {
+        char label[64];
+        snprintf(label, sizeof(label), "footprint-%u", i);
+
+        CK_ATTRIBUTE tmpl[] = {
+            { CKA_CLASS, &clazz, sizeof(clazz) },
+            { CKA_TOKEN, &ck_true, sizeof(ck_true) },
+            { CKA_PRIVATE, &ck_false, sizeof(ck_false) },
+            { CKA_APPLICATION, APPLICATION, sizeof(APPLICATION) - 1 },
+            { CKA_LABEL, label, strlen(label) },
+            { CKA_VALUE, value, sizeof(value) },
+        };
+
+        CK_OBJECT_HANDLE obj;
+        CK_RV rv = C_CreateObject(session, tmpl, ARRAY_LEN(tmpl), &obj);
+        assert_int_equal(rv, CKR_OK);
+    }
+
+    /* DER-encoding of the prime256v1 OID */
+    CK_BYTE ec_params[] = {
+        0x06, 0x08, 0x2a, 0x86, 0x48,
+        0xce, 0x3d, 0x03, 0x01, 0x07
+    };
+
+    CK_ATTRIBUTE pub[] = {
+        ADD_ATTR_BASE(CKA_TOKEN, ck_true),
+        ADD_ATTR_BASE(CKA_VERIFY, ck_true),
+        ADD_ATTR_ARRAY(CKA_EC_PARAMS, ec_params),
+        { CKA_ID, APPLICATION, sizeof(APPLICATION) - 1 },
+    };
+
+    CK_ATTRIBUTE priv[] = {
+        ADD_ATTR_BASE(CKA_TOKEN, ck_true),
+        ADD_ATTR_BASE(CKA_PRIVATE, ck_true),
+        ADD_ATTR_BASE(CKA_SIGN, ck_true),
+        { CKA_ID, APPLICATION, sizeof(APPLICATION) - 1 },
+    };
+
+    CK_MECHANISM mech = { CKM_EC_KEY_PAIR_GEN, NULL, 0 };
+
+    for (i=0; i < KEY_PAIRS; i++) {
+        CK_OBJECT_HANDLE pubkey;
+        CK_OBJECT_HANDLE privkey;
+        CK_RV rv = C_GenerateKeyPair(session, &mech,
+                pub, ARRAY_LEN(pub),
+                priv, ARRAY_LEN(priv),
+                &pubkey, &privkey);
+        assert_int_equal(rv, CKR_OK);
+    }
+}
+
+static unsigned destroy_matching(CK_SESSION_HANDLE session, CK_ATTRIBUTE_PTR tmpl) {
+
+    unsigned destroyed = 0;
+
+    while (true) {
+        CK_RV rv = C_FindObjectsInit(session, tmpl, 1);
+        assert_int_equal(rv, CKR_OK);
+
+        CK_OBJECT_HANDLE objs[64];
+        CK_ULONG count = 0;
+        rv = C_FindObjects(session, objs, ARRAY_LEN(objs), &count);
+        assert_int_equal(rv, CKR_OK);
+
+        rv = C_FindObjectsFinal(session);
+        assert_int_equal(rv, CKR_OK);
+
+        if (!count) {
+            return destroyed;
+        }
+
+        CK_ULONG i;
+        for (i=0; i < count; i++) {
+            rv = C_DestroyObject(session, objs[i]);
+            assert_int_equal(rv, CKR_OK);
+            destroyed++;
+        }
+    }
+}
+
+static void destroy_objects(CK_SESSION_HANDLE session) {
+
+    CK_ATTRIBUTE app = { CKA_APPLICATION, APPLICATION, sizeof(APPLICATION) - 1 };
+    unsigned n = destroy_matching(session, &app);
+    assert_int_equal(n, _objects);
+
+    CK_ATTRIBUTE id = { CKA_ID, APPLICATION, sizeof(APPLICATION) - 1 };
+    n = destroy_matching(session, &id);
+    assert_int_equal(n, 2 * KEY_PAIRS);
+}
+
+static void with_session(void (*fn)(CK_SESSION_HANDLE session)) {
+
+    CK_C_INITIALIZE_ARGS args = {
+        .flags = CKF_OS_LOCKING_OK,
+    };
+
+    CK_RV rv = C_Initialize(&args);
+    assert_int_equal(rv, CKR_OK);
+
+    fn(open_session());
+
+    rv = C_Finalize(NULL);
+    assert_int_equal(rv, CKR_OK);
+}
+
+static void test_object_footprint(void **state) {
+    UNUSED(state);
+
+#ifndef HAVE_MALLINFO2
+    skip();
+#else
+    /* the first initialize also pays for one time setup */
+    init_heap();
+
+    size_t base = init_heap();
+
+    with_session(create_objects);
+
+    size_t loaded = init_heap();
+
+    unsigned objects = _objects + 2 * KEY_PAIRS;
+    assert_true(loaded > base);
+
+    printf("object-footprint objects=%u value_len=%u key_pairs=%u "
+            "base_bytes=%zu bytes_per_object=%.1f\n",
+            objects, VALUE_LEN, KEY_PAIRS,
+            base, (double)(loaded - base) / objects);
+
+    with_session(destroy_objects);
+#endif
+}
+
+int main() {
+
+    const char *env = getenv("TEST_FOOTPRINT_OBJECTS");
+    if (env && env[0]) {
+        char *end = NULL;
+        unsigned long n = strtoul(env, &end, 10);
+        if (*end || !n || n > MAX_OBJECTS) {
+            fprintf(stderr, "TEST_FOOTPRINT_OBJECTS must be from 1 to %u,"
+                    " got \"%s\"\n", MAX_OBJECTS, env);
+            return 1;
+        }
+        _objects = n;
+    }
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_object_footprint),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,334 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Opens the store with TPM2_PKCS11_STORE_READONLY set, the way immutable
+ * deployments do, and checks tokens still log in and sign while every call
+ * that would change the store fails with CKR_TOKEN_WRITE_PROTECTED. Also
+ * checks the open is refused while the store's WAL holds commits.
+ */
+#include <limits.h>
+#include <stdlib.h>
+
+#include <sqlite3.h>
+
+#include "test.h"
+
+#define WORK_TOKEN "label"
+
+typedef struct readonly_ctx readonly_ctx;
+struct readonly_ctx {
+    CK_SLOT_ID slot;
+    CK_SESSION_HANDLE session;
+    CK_OBJECT_HANDLE key;
+};
+
+static const CK_BYTE _data[32] = { 'R', 'O' };
+
+static CK_SLOT_ID find_slot(const char *label) {
+
+    CK_SLOT_ID slots[TOKEN_COUNT + 1];
+    CK_ULONG count = ARRAY_LEN(slots);
+    CK_RV rv = C_GetSlotList(true, slots, &count);
+    if (rv != CKR_OK) {
+        return (CK_SLOT_ID)-1;
+    }
+
+    size_t len = strlen(label);
+
+    CK_ULONG i;
+    for (i=0; i < count; i++) {
+        CK_TOKEN_INFO info;
+        rv = C_GetTokenInfo(slots[i], &info);
+        if (rv != CKR_OK) {
+            return (CK_SLOT_ID)-1;
+        }
+
+        /* labels are blank padded */
+        if (!memcmp(info.label, label, len) && info.label[len] == ' ') {
+            return slots[i];
+        }
+    }
+
+    return (CK_SLOT_ID)-1;
+}
+
+static CK_RV find_key(CK_SESSION_HANDLE session, const char *label,
+        CK_OBJECT_HANDLE *key) {
+
+    CK_OBJECT_CLASS key_class = CKO_PRIVATE_KEY;
+    CK_ATTRIBUTE tmpl[] = {
+        { CKA_CLASS, &key_class, sizeof(key_class) },
+        { CKA_LABEL, (void *)label, strlen(label) },
+    };
+
+    CK_RV rv = C_FindObjectsInit(session, tmpl, ARRAY_LEN(tmpl));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_ULONG count = 0;
+    rv = C_FindObjects(session, key, 1, &count);
+    CK_RV rv2 = C_FindObjectsFinal(session);
+    if (rv == CKR_OK) {
+        rv = count == 1 ? rv2 : CKR_KEY_HANDLE_INVALID;
+    }
+
+    return rv;
+}
+
+static int test_setup(void **state) {
+
+    int rc = setenv("TPM2_PKCS11_STORE_READONLY", "1", 1);
+    assert_int_equal(rc, 0);
+
+    CK_C_INITIALIZE_ARGS args = {
+        .flags = CKF_OS_LOCKING_OK,
+    };
+
+    CK_RV rv = C_Initialize(&args);
+    assert_int_equal(rv, CKR_OK);
+
+    readonly_ctx *ctx = calloc(1, sizeof(*ctx));
+    assert_non_null(ctx);
+
+    ctx->slot = find_slot(WORK_TOKEN);
+    assert_int_not_equal(ctx->slot, (CK_SLOT_ID)-1);
+
+    /* read write sessions still open, the calls that write are refused */
+    rv = C_OpenSession(ctx->slot, CKF_SERIAL_SESSION | CKF_RW_SESSION,
+            NULL, NULL, &ctx->session);
+    assert_int_equal(rv, CKR_OK);
+
+    *state = ctx;
+
+    return 0;
+}
+
+static int test_teardown(void **state) {
+
+    readonly_ctx *ctx = (readonly_ctx *)*state;
+
+    CK_RV rv = C_CloseAllSessions(ctx->slot);
+    assert_int_equal(rv, CKR_OK);
+
+    free(ctx);
+
+    rv = C_Finalize(NULL);
+    assert_int_equal(rv, CKR_OK);
+
+    int rc = unsetenv("TPM2_PKCS11_STORE_READONLY");
+    assert_int_equal(rc, 0);
+
+    return 0;
+}
+
+static void test_readonly_token_info(void **state) {
+    UNUSED(state);
+
+    CK_SLOT_ID slots[TOKEN_COUNT + 1];
+    CK_ULONG count = ARRAY_LEN(slots);
+    CK_RV rv = C_GetSlotList(true, slots, &count);
+    assert_int_equal(rv, CKR_OK);
+    assert_true(count > 0);
+
+    CK_ULONG i;
+    for (i=0; i < count; i++) {
+        CK_TOKEN_INFO info;
+        rv = C_GetTokenInfo(slots[i], &info);
+        assert_int_equal(rv, CKR_OK);
+
+        /* no empty token to initialize, and every token says so */
+        assert_true(info.flags & CKF_TOKEN_INITIALIZED);
+        assert_true(info.flags & CKF_WRITE_PROTECTED);
+    }
+}
+
+static void test_readonly_sign(void **state) {
+
+    readonly_ctx *ctx = (readonly_ctx *)*state;
+
+    user_login(ctx->session);
+
+    CK_RV rv = find_key(ctx->session, "rsa0", &ctx->key);
+    assert_int_equal(rv, CKR_OK);
+
+    CK_MECHANISM mech = { CKM_SHA256_RSA_PKCS, NULL, 0 };
+    rv = C_SignInit(ctx->session, &mech, ctx->key);
+    assert_int_equal(rv, CKR_OK);
+
+    CK_BYTE sig[512];
+    CK_ULONG siglen = sizeof(sig);
+    rv = C_Sign(ctx->session, (CK_BYTE_PTR)_data, sizeof(_data), sig, &siglen);
+    assert_int_equal(rv, CKR_OK);
+
+    logout(ctx->session);
+}
+
+static void test_readonly_objects(void **state) {
+
+    readonly_ctx *ctx = (readonly_ctx *)*state;
+
+    user_login(ctx->session);
+
+    CK_RV rv = find_key(ctx->session, "rsa0", &ctx->key);
+    assert_int_equal(rv, CKR_OK);
+
+    CK_OBJECT_CLASS clazz = CKO_DATA;
+    CK_BBOOL ck_true = CK_TRUE;
+    CK_UTF8CHAR label[] = "readonly";
+    CK_BYTE value[] = "value";
+    CK_ATTRIBUTE data_tmpl[] = {
+        ADD_ATTR_BASE(CKA_CLASS, clazz),
+        ADD_ATTR_BASE(CKA_TOKEN, ck_true),
+        ADD_ATTR_STR(CKA_LABEL, label),
+        ADD_ATTR_STR(CKA_VALUE, value),
+    };
+
+    CK_OBJECT_HANDLE obj;
+    rv = C_CreateObject(ctx->session, data_tmpl, ARRAY_LEN(data_tmpl), &obj);
+    assert_int_equal(rv, CKR_TOKEN_WRITE_PROTECTED);
+
+    CK_ATTRIBUTE label_tmpl[] = {
+        ADD_ATTR_STR(CKA_LABEL, label),
+    };
+    rv = C_SetAttributeValue(ctx->session, ctx->key, label_tmpl,
+            ARRAY_LEN(label_tmpl));
+    assert_int_equal(rv, CKR_TOKEN_WRITE_PROTECTED);
+
+    rv = C_DestroyObject(ctx->session, ctx->key);
+    assert_int_equal(rv, CKR_TOKEN_WRITE_PROTECTED);
+
+    CK_ULONG bits = 2048;
+    CK_BYTE exp[] = { 0x00, 0x01, 0x00, 0x01 };
+    CK_ATTRIBUTE pub_tmpl[] = {
+        ADD_ATTR_BASE(CKA_MODULUS_BITS, bits),
+        ADD_ATTR_ARRAY(CKA_PUBLIC_EXPONENT, exp),
+    };
+    CK_ATTRIBUTE priv_tmpl[] = {
+        ADD_ATTR_BASE(CKA_TOKEN, ck_true),
+    };
+    CK_MECHANISM mech = { CKM_RSA_PKCS_KEY_PAIR_GEN, NULL, 0 };
+    CK_OBJECT_HANDLE pub, priv;
+    rv = C_GenerateKeyPair(ctx->session, &mech,
+            pub_tmpl, ARRAY_LEN(pub_tmpl),
+            priv_tmpl, ARRAY_LEN(priv_tmpl),
+            &pub, &priv);
+    assert_int_equal(rv, CKR_TOKEN_WRITE_PROTECTED);
+
+    /* the key is where it was */
+    rv = find_key(ctx->session, "rsa0", &obj);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(obj, ctx->key);
+
+    logout(ctx->session);
+}
+
+static void test_readonly_pins(void **state) {
+
+    readonly_ctx *ctx = (readonly_ctx *)*state;
+
+    user_login(ctx->session);
+
+    CK_RV rv = C_SetPIN(ctx->session,
+            (CK_UTF8CHAR_PTR)GOOD_USERPIN, sizeof(GOOD_USERPIN) - 1,
+            (CK_UTF8CHAR_PTR)BAD_USERPIN, sizeof(BAD_USERPIN) - 1);
+    assert_int_equal(rv, CKR_TOKEN_WRITE_PROTECTED);
+
+    logout(ctx->session);
+
+    so_login(ctx->session);
+
+    rv = C_InitPIN(ctx->session, (CK_UTF8CHAR_PTR)BAD_USERPIN,
+            sizeof(BAD_USERPIN) - 1);
+    assert_int_equal(rv, CKR_TOKEN_WRITE_PROTECTED);
+
+    logout(ctx->session);
+
+    /* the PIN that was there still works */
+    user_login(ctx->session);
+    logout(ctx->session);
+}
+
+/*
+ * A writer holding the store open in WAL mode, with its commit left in the
+ * log. Closing it checkpoints the log and removes it.
+ */
+static sqlite3 *open_writer(void) {
+
+    const char *dir = getenv("TPM2_PKCS11_STORE");
+    assert_non_null(dir);
+
+    char path[PATH_MAX];
+    int n = snprintf(path, sizeof(path), "%s/tpm2_pkcs11.sqlite3", dir);
+    assert_true(n > 0 && (size_t)n < sizeof(path));
+
+    sqlite3 *db = NULL;
+    int rc = sqlite3_open(path, &db);
+    assert_int_equal(rc, SQLITE_OK);
+
+    rc = sqlite3_exec(db,
+            "PRAGMA journal_mode=WAL;"
+            "PRAGMA wal_autocheckpoint=0;"
+            "CREATE TABLE readonly_wal_test(x);"
+            "DROP TABLE readonly_wal_test;",
+            NULL, NULL, NULL);
+    assert_int_equal(rc, SQLITE_OK);
+
+    return db;
+}
+
+static void test_readonly_wal_pending(void **state) {
+    (void) state;
+
+    sqlite3 *writer = open_writer();
+
+    int rc = setenv("TPM2_PKCS11_STORE_READONLY", "1", 1);
+    assert_int_equal(rc, 0);
+
+    CK_C_INITIALIZE_ARGS args = {
+        .flags = CKF_OS_LOCKING_OK,
+    };
+
+    /*
+     * The commit is only in the WAL, which an immutable open can't see. With
+     * FAPI the library still initializes, but without the store's tokens.
+     */
+    CK_RV rv = C_Initialize(&args);
+    if (rv == CKR_OK) {
+        assert_int_equal(find_slot(WORK_TOKEN), (CK_SLOT_ID)-1);
+
+        rv = C_Finalize(NULL);
+        assert_int_equal(rv, CKR_OK);
+    }
+
+    rc = sqlite3_close(writer);
+    assert_int_equal(rc, SQLITE_OK);
+
+    /* once checkpointed the store opens */
+    rv = C_Initialize(&args);
+    assert_int_equal(rv, CKR_OK);
+
+    assert_int_not_equal(find_slot(WORK_TOKEN), (CK_SLOT_ID)-1);
+
+    rv = C_Finalize(NULL);
+    assert_int_equal(rv, CKR_OK);
+
+    rc = unsetenv("TPM2_PKCS11_STORE_READONLY");
+    assert_int_equal(rc, 0);
+}
+
+int main() {
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_readonly_token_info,
+                test_setup, test_teardown),
+        cmocka_unit_test_setup_teardown(test_readonly_sign,
+                test_setup, test_teardown),
+        cmocka_unit_test_setup_teardown(test_readonly_objects,
+                test_setup, test_teardown),
+        cmocka_unit_test_setup_teardown(test_readonly_pins,
+                test_setup, test_teardown),
+        cmocka_unit_test(test_readonly_wal_pending),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
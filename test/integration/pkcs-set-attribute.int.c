@@ -0,0 +1,237 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Relabels token objects holding values of different sizes over and over
+ * with C_SetAttributeValue and reports the update rate for each size. Only
+ * the changed attributes are written, so the rate shouldn't drop much with
+ * the size of the object. Checks the last label and a changed value are
+ * what a fresh load of the store returns.
+ *
+ * TEST_SET_ATTRIBUTE_OPS  updates per object, default 100
+ */
+#include <inttypes.h>
+#include <time.h>
+
+#include "test.h"
+
+#define DEFAULT_OPS 100
+#define MAX_OPS     100000
+
+#define WORK_TOKEN "label"
+
+static const CK_ULONG _sizes[] = { 64, 1024, 8192, 65536 };
+
+static unsigned _ops = DEFAULT_OPS;
+
+static uint64_t now_ns(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static CK_SLOT_ID find_slot(const char *label) {
+
+    CK_SLOT_ID slots[TOKEN_COUNT + 1];
+    CK_ULONG count = ARRAY_LEN(slots);
+    CK_RV rv = C_GetSlotList(true, slots, &count);
+    if (rv != CKR_OK) {
+        return (CK_SLOT_ID)-1;
+    }
+
+    size_t len = strlen(label);
+
+    CK_ULONG i;
+    for (i=0; i < count; i++) {
+        CK_TOKEN_INFO info;
+        rv = C_GetTokenInfo(slots[i], &info);
+        if (rv != CKR_OK) {
+            return (CK_SLOT_ID)-1;
+        }
+
+        /* labels are blank padded */
+        if (!memcmp(info.label, label, len) && info.label[len] == ' ') {
+            return slots[i];
+        }
+    }
+
+    return (CK_SLOT_ID)-1;
+}
+
+static CK_SESSION_HANDLE open_session(void) {
+
+    CK_C_INITIALIZE_ARGS args = {
+        .flags = CKF_OS_LOCKING_OK,
+    };
+
+    CK_RV rv = C_Initialize(&args);
+    assert_int_equal(rv, CKR_OK);
+
+    CK_SLOT_ID slot = find_slot(WORK_TOKEN);
+    assert_int_not_equal(slot, (CK_SLOT_ID)-1);
+
+    CK_SESSION_HANDLE session;
+    rv = C_OpenSession(slot, CKF_SERIAL_SESSION | CKF_RW_SESSION, NULL,
+            NULL, &session);
+    assert_int_equal(rv, CKR_OK);
+
+    user_login(session);
+
+    return session;
+}
+
+static void close_session(void) {
+
+    CK_RV rv = C_Finalize(NULL);
+    assert_int_equal(rv, CKR_OK);
+}
+
+static CK_OBJECT_HANDLE find_data(CK_SESSION_HANDLE session, const char *label) {
+
+    CK_OBJECT_CLASS clazz = CKO_DATA;
+    CK_ATTRIBUTE tmpl[] = {
+        { CKA_CLASS, &clazz, sizeof(clazz) },
+        { CKA_LABEL, (void *)label, strlen(label) },
+    };
+
+    CK_RV rv = C_FindObjectsInit(session, tmpl, ARRAY_LEN(tmpl));
+    assert_int_equal(rv, CKR_OK);
+
+    CK_OBJECT_HANDLE obj;
+    CK_ULONG count = 0;
+    rv = C_FindObjects(session, &obj, 1, &count);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(count, 1);
+
+    rv = C_FindObjectsFinal(session);
+    assert_int_equal(rv, CKR_OK);
+
+    return obj;
+}
+
+static void check_value(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE obj,
+        CK_BYTE_PTR expected, CK_ULONG len) {
+
+    CK_BYTE_PTR got = malloc(len);
+    assert_non_null(got);
+
+    CK_ATTRIBUTE tmpl[] = {
+        { CKA_VALUE, got, len },
+    };
+
+    CK_RV rv = C_GetAttributeValue(session, obj, tmpl, ARRAY_LEN(tmpl));
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(tmpl[0].ulValueLen, len);
+    assert_memory_equal(got, expected, len);
+
+    free(got);
+}
+
+static void test_set_attribute_size(CK_ULONG size) {
+
+    CK_BYTE_PTR value = malloc(size);
+    assert_non_null(value);
+
+    CK_ULONG i;
+    for (i=0; i < size; i++) {
+        value[i] = (CK_BYTE)(i * 7);
+    }
+
+    char label[64];
+    snprintf(label, sizeof(label), "set-attribute-%lu", size);
+
+    CK_SESSION_HANDLE session = open_session();
+
+    CK_OBJECT_CLASS clazz = CKO_DATA;
+    CK_BBOOL ck_true = CK_TRUE;
+    CK_ATTRIBUTE create[] = {
+        { CKA_CLASS, &clazz, sizeof(clazz) },
+        { CKA_TOKEN, &ck_true, sizeof(ck_true) },
+        { CKA_LABEL, label, strlen(label) },
+        { CKA_VALUE, value, size },
+    };
+
+    CK_OBJECT_HANDLE obj;
+    CK_RV rv = C_CreateObject(session, create, ARRAY_LEN(create), &obj);
+    assert_int_equal(rv, CKR_OK);
+
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+
+    unsigned n;
+    for (n=0; n < _ops; n++) {
+        snprintf(label, sizeof(label), "set-attribute-%lu-%u", size, n);
+
+        CK_ATTRIBUTE tmpl[] = {
+            { CKA_LABEL, label, strlen(label) },
+        };
+
+        uint64_t start = now_ns();
+        rv = C_SetAttributeValue(session, obj, tmpl, ARRAY_LEN(tmpl));
+        uint64_t took = now_ns() - start;
+        assert_int_equal(rv, CKR_OK);
+
+        total_ns += took;
+        if (took > max_ns) {
+            max_ns = took;
+        }
+    }
+
+    printf("set-attribute value_len=%lu ops=%u ops_per_s=%.1f "
+            "mean_ms=%.3f max_ms=%.3f\n",
+            size, _ops, _ops / (total_ns / 1e9),
+            total_ns / 1e6 / _ops, max_ns / 1e6);
+
+    /* change the value too, the label updates must not undo it */
+    value[0] ^= 0xFF;
+    CK_ATTRIBUTE tmpl[] = {
+        { CKA_VALUE, value, size },
+    };
+    rv = C_SetAttributeValue(session, obj, tmpl, ARRAY_LEN(tmpl));
+    assert_int_equal(rv, CKR_OK);
+
+    close_session();
+
+    /* a fresh load sees the last label and the new value */
+    session = open_session();
+
+    obj = find_data(session, label);
+    check_value(session, obj, value, size);
+
+    rv = C_DestroyObject(session, obj);
+    assert_int_equal(rv, CKR_OK);
+
+    close_session();
+
+    free(value);
+}
+
+static void test_set_attribute(void **state) {
+    UNUSED(state);
+
+    size_t i;
+    for (i=0; i < ARRAY_LEN(_sizes); i++) {
+        test_set_attribute_size(_sizes[i]);
+    }
+}
+
+int main() {
+
+    const char *env = getenv("TEST_SET_ATTRIBUTE_OPS");
+    if (env && env[0]) {
+        char *end = NULL;
+        unsigned long n = strtoul(env, &end, 10);
+        if (*end || !n || n > MAX_OPS) {
+            fprintf(stderr, "TEST_SET_ATTRIBUTE_OPS must be from 1 to %u,"
+                    " got \"%s\"\n", MAX_OPS, env);
+            return 1;
+        }
+        _ops = n;
+    }
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_set_attribute),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
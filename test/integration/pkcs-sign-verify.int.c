@@ -1675,6 +1675,124 @@ static void test_sign_verify_CKM_SHA512_HMAC(void **state) {
     assert_int_equal(rv, CKR_OK);
 }
 
+static void test_message_sign_verify_CKM_SHA256_RSA_PKCS(void **state) {
+
+    test_info *ti = test_info_from_state(state);
+    CK_SESSION_HANDLE session = ti->handle;
+
+    CK_INTERFACE_PTR iface = NULL;
+    CK_VERSION v3 = { .major = 3, .minor = 0 };
+    CK_RV rv = C_GetInterface((CK_UTF8CHAR_PTR)"PKCS 11", &v3, &iface, 0);
+    assert_int_equal(rv, CKR_OK);
+    CK_FUNCTION_LIST_3_0_PTR f = (CK_FUNCTION_LIST_3_0_PTR)iface->pFunctionList;
+    assert_int_equal(f->version.major, 3);
+
+    CK_OBJECT_CLASS key_class = CKO_PRIVATE_KEY;
+    CK_KEY_TYPE key_type = CKK_RSA;
+    CK_ATTRIBUTE tmpl[] = {
+        { CKA_CLASS, &key_class, sizeof(key_class) },
+        { CKA_KEY_TYPE, &key_type, sizeof(key_type) },
+    };
+
+    user_login(session);
+
+    CK_OBJECT_HANDLE key = CK_INVALID_HANDLE;
+    CK_ULONG count = 0;
+    rv = C_FindObjectsInit(session, tmpl, ARRAY_LEN(tmpl));
+    assert_int_equal(rv, CKR_OK);
+    rv = C_FindObjects(session, &key, 1, &count);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(count, 1);
+    rv = C_FindObjectsFinal(session);
+    assert_int_equal(rv, CKR_OK);
+
+    /* PKCS#1 v1.5 is deterministic, so C_Sign gives the expected signature */
+    CK_MECHANISM mech = { .mechanism = CKM_SHA256_RSA_PKCS };
+    rv = C_SignInit(session, &mech, key);
+    assert_int_equal(rv, CKR_OK);
+
+    CK_BYTE expected[4096];
+    CK_ULONG expected_len = sizeof(expected);
+    rv = C_Sign(session, (CK_BYTE_PTR)_data, sizeof(_data), expected, &expected_len);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = f->C_MessageSignInit(session, &mech, key);
+    assert_int_equal(rv, CKR_OK);
+
+    /* a 2.40 operation can't start while the key is bound */
+    rv = C_SignInit(session, &mech, key);
+    assert_int_equal(rv, CKR_OPERATION_ACTIVE);
+
+    CK_BYTE sig[4096];
+    CK_ULONG sig_len = 0;
+    rv = f->C_SignMessage(session, NULL, 0, (CK_BYTE_PTR)_data, sizeof(_data),
+            NULL, &sig_len);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(sig_len, expected_len);
+
+    /* several messages on the one init */
+    unsigned i;
+    for (i=0; i < 3; i++) {
+        sig_len = sizeof(sig);
+        rv = f->C_SignMessage(session, NULL, 0, (CK_BYTE_PTR)_data, sizeof(_data),
+                sig, &sig_len);
+        assert_int_equal(rv, CKR_OK);
+        assert_int_equal(sig_len, expected_len);
+        assert_memory_equal(sig, expected, expected_len);
+    }
+
+    /* and one in parts */
+    rv = f->C_SignMessageBegin(session, NULL, 0);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = f->C_SignMessage(session, NULL, 0, (CK_BYTE_PTR)_data, sizeof(_data),
+            sig, &sig_len);
+    assert_int_equal(rv, CKR_OPERATION_ACTIVE);
+
+    rv = f->C_SignMessageNext(session, NULL, 0, (CK_BYTE_PTR)_data, 3, NULL, NULL);
+    assert_int_equal(rv, CKR_OK);
+
+    sig_len = sizeof(sig);
+    rv = f->C_SignMessageNext(session, NULL, 0, (CK_BYTE_PTR)&_data[3],
+            sizeof(_data) - 3, sig, &sig_len);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(sig_len, expected_len);
+    assert_memory_equal(sig, expected, expected_len);
+
+    rv = f->C_MessageSignFinal(session);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = f->C_SignMessage(session, NULL, 0, (CK_BYTE_PTR)_data, sizeof(_data),
+            sig, &sig_len);
+    assert_int_equal(rv, CKR_OPERATION_NOT_INITIALIZED);
+
+    rv = f->C_MessageVerifyInit(session, &mech, key);
+    assert_int_equal(rv, CKR_OK);
+
+    for (i=0; i < 2; i++) {
+        rv = f->C_VerifyMessage(session, NULL, 0, (CK_BYTE_PTR)_data, sizeof(_data),
+                expected, expected_len);
+        assert_int_equal(rv, CKR_OK);
+    }
+
+    expected[0] ^= 1;
+    rv = f->C_VerifyMessage(session, NULL, 0, (CK_BYTE_PTR)_data, sizeof(_data),
+            expected, expected_len);
+    assert_int_equal(rv, CKR_SIGNATURE_INVALID);
+    expected[0] ^= 1;
+
+    /* the operation survives a bad signature */
+    rv = f->C_VerifyMessage(session, NULL, 0, (CK_BYTE_PTR)_data, sizeof(_data),
+            expected, expected_len);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = f->C_SessionCancel(session, CKF_MESSAGE_VERIFY);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = f->C_MessageVerifyFinal(session);
+    assert_int_equal(rv, CKR_OPERATION_NOT_INITIALIZED);
+}
+
 int main() {
 
     const struct CMUnitTest tests[] = {
@@ -1724,6 +1842,8 @@ int main() {
             test_setup, test_teardown),
         cmocka_unit_test_setup_teardown(test_sign_verify_CKM_SHA512_HMAC,
             test_setup, test_teardown),
+        cmocka_unit_test_setup_teardown(test_message_sign_verify_CKM_SHA256_RSA_PKCS,
+            test_setup, test_teardown),
     };
 
     return cmocka_run_group_tests(tests, group_setup, group_teardown);
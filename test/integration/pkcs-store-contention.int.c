@@ -0,0 +1,411 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Runs processes that write the store, creating, relabeling and destroying
+ * token objects, next to processes that read a large attribute left in the
+ * store, all on the same store at once. Every call must succeed, a writer
+ * waiting on another process must not surface as an error. Reports the
+ * operation rate and the slowest operation of each kind.
+ *
+ * TEST_CONTENTION_WORKERS  processes of each kind, default 4
+ * TEST_CONTENTION_OPS      operations per process, default 50
+ */
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "test.h"
+
+#define DEFAULT_WORKERS 4
+#define MAX_WORKERS     64
+#define DEFAULT_OPS     50
+
+#define WORK_TOKEN "label"
+
+/* large enough to be left in the store when loaded, see ATTR_LAZY_MIN */
+#define SHARED_LABEL "contention-shared"
+#define SHARED_LEN   1024
+
+typedef struct contention_result contention_result;
+struct contention_result {
+    CK_RV rv;
+    unsigned ops;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+typedef CK_RV (*contention_op)(CK_SESSION_HANDLE session, unsigned i);
+
+static unsigned _workers = DEFAULT_WORKERS;
+static unsigned _ops = DEFAULT_OPS;
+
+static CK_BYTE _shared_value[SHARED_LEN];
+
+static uint64_t now_ns(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static CK_SLOT_ID find_slot(const char *label) {
+
+    CK_SLOT_ID slots[TOKEN_COUNT + 1];
+    CK_ULONG count = ARRAY_LEN(slots);
+    CK_RV rv = C_GetSlotList(true, slots, &count);
+    if (rv != CKR_OK) {
+        return (CK_SLOT_ID)-1;
+    }
+
+    size_t len = strlen(label);
+
+    CK_ULONG i;
+    for (i=0; i < count; i++) {
+        CK_TOKEN_INFO info;
+        rv = C_GetTokenInfo(slots[i], &info);
+        if (rv != CKR_OK) {
+            return (CK_SLOT_ID)-1;
+        }
+
+        /* labels are blank padded */
+        if (!memcmp(info.label, label, len) && info.label[len] == ' ') {
+            return slots[i];
+        }
+    }
+
+    return (CK_SLOT_ID)-1;
+}
+
+static CK_RV find_data(CK_SESSION_HANDLE session, const char *label,
+        CK_OBJECT_HANDLE *obj) {
+
+    CK_OBJECT_CLASS clazz = CKO_DATA;
+    CK_ATTRIBUTE tmpl[] = {
+        { CKA_CLASS, &clazz, sizeof(clazz) },
+        { CKA_LABEL, (void *)label, strlen(label) },
+    };
+
+    CK_RV rv = C_FindObjectsInit(session, tmpl, ARRAY_LEN(tmpl));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_ULONG count = 0;
+    rv = C_FindObjects(session, obj, 1, &count);
+    CK_RV rv2 = C_FindObjectsFinal(session);
+    if (rv == CKR_OK) {
+        rv = count == 1 ? rv2 : CKR_OBJECT_HANDLE_INVALID;
+    }
+
+    return rv;
+}
+
+static CK_RV create_data(CK_SESSION_HANDLE session, const char *label,
+        CK_BYTE_PTR value, CK_ULONG len, CK_OBJECT_HANDLE *obj) {
+
+    CK_OBJECT_CLASS clazz = CKO_DATA;
+    CK_BBOOL ck_true = CK_TRUE;
+    CK_ATTRIBUTE tmpl[] = {
+        { CKA_CLASS, &clazz, sizeof(clazz) },
+        { CKA_TOKEN, &ck_true, sizeof(ck_true) },
+        { CKA_LABEL, (void *)label, strlen(label) },
+        { CKA_VALUE, value, len },
+    };
+
+    return C_CreateObject(session, tmpl, ARRAY_LEN(tmpl), obj);
+}
+
+/* a row in, a row rewritten and a row out, each its own transaction */
+static CK_RV op_write(CK_SESSION_HANDLE session, unsigned i) {
+
+    char label[64];
+    snprintf(label, sizeof(label), "contention-%d-%u", (int)getpid(), i);
+
+    CK_BYTE value[64] = { 0 };
+    memcpy(value, &i, sizeof(i));
+
+    CK_OBJECT_HANDLE obj;
+    CK_RV rv = create_data(session, label, value, sizeof(value), &obj);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_BYTE relabel[] = "contention-relabeled";
+    CK_ATTRIBUTE tmpl[] = {
+        { CKA_LABEL, relabel, sizeof(relabel) - 1 },
+    };
+
+    rv = C_SetAttributeValue(session, obj, tmpl, ARRAY_LEN(tmpl));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    return C_DestroyObject(session, obj);
+}
+
+static CK_RV op_read(CK_SESSION_HANDLE session, unsigned i) {
+    UNUSED(i);
+
+    CK_OBJECT_HANDLE obj;
+    CK_RV rv = find_data(session, SHARED_LABEL, &obj);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_BYTE value[SHARED_LEN];
+    CK_ATTRIBUTE tmpl[] = {
+        { CKA_VALUE, value, sizeof(value) },
+    };
+
+    rv = C_GetAttributeValue(session, obj, tmpl, ARRAY_LEN(tmpl));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    if (tmpl[0].ulValueLen != sizeof(_shared_value)
+            || memcmp(value, _shared_value, sizeof(_shared_value))) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    return CKR_OK;
+}
+
+/* each worker is a process of its own, with its own connections */
+static void worker(contention_op op, contention_result *r) {
+
+    CK_C_INITIALIZE_ARGS args = {
+        .flags = CKF_OS_LOCKING_OK,
+    };
+
+    r->rv = C_Initialize(&args);
+    if (r->rv != CKR_OK) {
+        return;
+    }
+
+    CK_SLOT_ID slot = find_slot(WORK_TOKEN);
+    if (slot == (CK_SLOT_ID)-1) {
+        r->rv = CKR_SLOT_ID_INVALID;
+        return;
+    }
+
+    CK_SESSION_HANDLE session;
+    r->rv = C_OpenSession(slot, CKF_SERIAL_SESSION | CKF_RW_SESSION, NULL,
+            NULL, &session);
+    if (r->rv != CKR_OK) {
+        return;
+    }
+
+    r->rv = C_Login(session, CKU_USER, (CK_UTF8CHAR_PTR)GOOD_USERPIN,
+            sizeof(GOOD_USERPIN) - 1);
+    if (r->rv != CKR_OK) {
+        return;
+    }
+
+    unsigned i;
+    for (i=0; i < _ops; i++) {
+        uint64_t start = now_ns();
+        r->rv = op(session, i);
+        uint64_t took = now_ns() - start;
+        if (r->rv != CKR_OK) {
+            return;
+        }
+
+        r->ops++;
+        r->total_ns += took;
+        if (took > r->max_ns) {
+            r->max_ns = took;
+        }
+    }
+
+    r->rv = C_Finalize(NULL);
+}
+
+static pid_t spawn(contention_op op, int *fd) {
+
+    int p[2];
+    int rc = pipe(p);
+    assert_int_equal(rc, 0);
+
+    pid_t pid = fork();
+    assert_true(pid >= 0);
+
+    if (pid == 0) {
+        close(p[0]);
+        contention_result r = { .rv = CKR_GENERAL_ERROR };
+        worker(op, &r);
+        ssize_t n = write(p[1], &r, sizeof(r));
+        _exit(n == sizeof(r) ? 0 : 1);
+    }
+
+    close(p[1]);
+    *fd = p[0];
+
+    return pid;
+}
+
+static unsigned collect(const char *name, pid_t *pids, int *fds,
+        uint64_t elapsed_ns) {
+
+    unsigned failed = 0;
+    unsigned ops = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+
+    unsigned i;
+    for (i=0; i < _workers; i++) {
+        contention_result r = { .rv = CKR_GENERAL_ERROR };
+        if (read(fds[i], &r, sizeof(r)) != sizeof(r)) {
+            r.rv = CKR_GENERAL_ERROR;
+        }
+        close(fds[i]);
+
+        int status = 0;
+        waitpid(pids[i], &status, 0);
+
+        if (r.rv != CKR_OK || !WIFEXITED(status) || WEXITSTATUS(status)) {
+            fprintf(stderr, "%s worker %u failed after %u ops: 0x%lx\n",
+                    name, i, r.ops, r.rv);
+            failed++;
+        }
+
+        ops += r.ops;
+        total_ns += r.total_ns;
+        if (r.max_ns > max_ns) {
+            max_ns = r.max_ns;
+        }
+    }
+
+    printf("contention kind=%s workers=%u ops=%u ops_per_s=%.1f "
+            "mean_ms=%.2f max_ms=%.2f\n",
+            name, _workers, ops, ops / (elapsed_ns / 1e9),
+            ops ? total_ns / 1e6 / ops : 0.0, max_ns / 1e6);
+
+    return failed;
+}
+
+static CK_RV with_session(bool create) {
+
+    CK_C_INITIALIZE_ARGS args = {
+        .flags = CKF_OS_LOCKING_OK,
+    };
+
+    CK_RV rv = C_Initialize(&args);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_SLOT_ID slot = find_slot(WORK_TOKEN);
+    if (slot == (CK_SLOT_ID)-1) {
+        C_Finalize(NULL);
+        return CKR_SLOT_ID_INVALID;
+    }
+
+    CK_SESSION_HANDLE session;
+    rv = C_OpenSession(slot, CKF_SERIAL_SESSION | CKF_RW_SESSION, NULL, NULL,
+            &session);
+    if (rv != CKR_OK) {
+        goto out;
+    }
+
+    rv = C_Login(session, CKU_USER, (CK_UTF8CHAR_PTR)GOOD_USERPIN,
+            sizeof(GOOD_USERPIN) - 1);
+    if (rv != CKR_OK) {
+        goto out;
+    }
+
+    CK_OBJECT_HANDLE obj;
+    rv = create ?
+            create_data(session, SHARED_LABEL, _shared_value,
+                    sizeof(_shared_value), &obj) :
+            find_data(session, SHARED_LABEL, &obj);
+    if (rv == CKR_OK && !create) {
+        rv = C_DestroyObject(session, obj);
+    }
+
+out:
+    C_Finalize(NULL);
+    return rv;
+}
+
+static int test_setup(void **state) {
+    UNUSED(state);
+
+    unsigned i;
+    for (i=0; i < sizeof(_shared_value); i++) {
+        _shared_value[i] = (CK_BYTE)(i * 7);
+    }
+
+    /* made and finalized before forking, workers load it from the store */
+    CK_RV rv = with_session(true);
+    assert_int_equal(rv, CKR_OK);
+
+    return 0;
+}
+
+static int test_teardown(void **state) {
+    UNUSED(state);
+
+    CK_RV rv = with_session(false);
+    assert_int_equal(rv, CKR_OK);
+
+    return 0;
+}
+
+static void test_store_contention(void **state) {
+    UNUSED(state);
+
+    pid_t writers[MAX_WORKERS];
+    pid_t readers[MAX_WORKERS];
+    int writer_fds[MAX_WORKERS];
+    int reader_fds[MAX_WORKERS];
+
+    uint64_t start = now_ns();
+
+    unsigned i;
+    for (i=0; i < _workers; i++) {
+        writers[i] = spawn(op_write, &writer_fds[i]);
+        readers[i] = spawn(op_read, &reader_fds[i]);
+    }
+
+    unsigned failed = collect("read", readers, reader_fds, now_ns() - start);
+    failed += collect("write", writers, writer_fds, now_ns() - start);
+
+    assert_int_equal(failed, 0);
+}
+
+static bool env_uint(const char *name, unsigned max, unsigned *value) {
+
+    const char *env = getenv(name);
+    if (!env || !env[0]) {
+        return true;
+    }
+
+    char *end = NULL;
+    unsigned long n = strtoul(env, &end, 10);
+    if (*end || !n || n > max) {
+        fprintf(stderr, "%s must be from 1 to %u, got \"%s\"\n",
+                name, max, env);
+        return false;
+    }
+
+    *value = n;
+
+    return true;
+}
+
+int main() {
+
+    if (!env_uint("TEST_CONTENTION_WORKERS", MAX_WORKERS, &_workers)
+            || !env_uint("TEST_CONTENTION_OPS", 100000, &_ops)) {
+        return 1;
+    }
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_store_contention,
+                test_setup, test_teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
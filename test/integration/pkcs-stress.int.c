@@ -0,0 +1,634 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Runs a mixed workload of signing, encryption, object search, attribute
+ * reads, login/logout and session churn from many threads at once, with
+ * the library doing its own locking and with application supplied mutex
+ * callbacks, and reports how throughput scales with the thread count.
+ *
+ * TEST_STRESS_THREADS     comma separated thread counts, default 1,2,4,8
+ * TEST_STRESS_DURATION    seconds per thread count, default 2
+ * TEST_STRESS_TIMEOUT     seconds past the duration before a run is
+ *                         declared deadlocked, default 60
+ *
+ * Build with --enable-tsan to have ThreadSanitizer check every run for
+ * data races and lock order inversions.
+ */
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "test.h"
+
+#define MAX_THREADS 64
+#define MAX_COUNTS  16
+
+#define DEFAULT_THREADS  "1,2,4,8"
+#define DEFAULT_DURATION 2
+#define DEFAULT_TIMEOUT  60
+
+/* login/logout churns on its own token so the keys stay usable */
+#define WORK_TOKEN  "label"
+#define LOGIN_TOKEN "import-keys"
+
+typedef struct stress_keys stress_keys;
+struct stress_keys {
+    CK_OBJECT_HANDLE rsa_priv;
+    CK_OBJECT_HANDLE rsa_pub;
+    CK_OBJECT_HANDLE ec_priv;
+    CK_OBJECT_HANDLE aes;
+};
+
+typedef struct stress_ctx stress_ctx;
+struct stress_ctx {
+    CK_SLOT_ID work_slot;
+    CK_SLOT_ID login_slot;
+    stress_keys keys;
+    /* keeps the work token logged in for the whole run */
+    CK_SESSION_HANDLE login_session;
+};
+
+typedef struct stress_run stress_run;
+struct stress_run {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned done;
+};
+
+typedef struct stress_thread stress_thread;
+
+typedef CK_RV (*stress_fn)(stress_thread *t);
+
+typedef struct stress_op stress_op;
+struct stress_op {
+    const char *name;
+    stress_fn fn;
+    /* a second result that is not an error, CKR_OK if none */
+    CK_RV also_ok;
+};
+
+struct stress_thread {
+    pthread_t thread;
+    unsigned index;
+    stress_ctx *ctx;
+    stress_run *run;
+    CK_SESSION_HANDLE session;
+    CK_SESSION_HANDLE login_session;
+    uint64_t deadline;
+    uint64_t ops;
+    uint64_t errors;
+    const char *last_error_op;
+    CK_RV last_error;
+    /* for the deadlock report, read by the watchdog */
+    const char *current_op;
+};
+
+static struct {
+    unsigned threads[MAX_COUNTS];
+    size_t nthreads;
+    unsigned duration;
+    unsigned timeout;
+} _opts;
+
+static const CK_BYTE _data[32] = { 'S', 'T', 'R', 'E', 'S', 'S' };
+
+static uint64_t now_ns(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static CK_RV op_sign_rsa(stress_thread *t) {
+
+    CK_MECHANISM mech = { CKM_SHA256_RSA_PKCS, NULL, 0 };
+
+    CK_RV rv = C_SignInit(t->session, &mech, t->ctx->keys.rsa_priv);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_BYTE sig[512];
+    CK_ULONG siglen = sizeof(sig);
+
+    return C_Sign(t->session, (CK_BYTE_PTR)_data, sizeof(_data), sig, &siglen);
+}
+
+static CK_RV op_sign_ecdsa(stress_thread *t) {
+
+    CK_MECHANISM mech = { CKM_ECDSA_SHA256, NULL, 0 };
+
+    CK_RV rv = C_SignInit(t->session, &mech, t->ctx->keys.ec_priv);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_BYTE sig[256];
+    CK_ULONG siglen = sizeof(sig);
+
+    return C_Sign(t->session, (CK_BYTE_PTR)_data, sizeof(_data), sig, &siglen);
+}
+
+static CK_RV op_encrypt_aes(stress_thread *t) {
+
+    CK_BYTE iv[16] = { 0 };
+    CK_MECHANISM mech = { CKM_AES_CBC, iv, sizeof(iv) };
+
+    CK_RV rv = C_EncryptInit(t->session, &mech, t->ctx->keys.aes);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_BYTE ciphertext[sizeof(_data)];
+    CK_ULONG len = sizeof(ciphertext);
+
+    return C_Encrypt(t->session, (CK_BYTE_PTR)_data, sizeof(_data),
+            ciphertext, &len);
+}
+
+static CK_RV op_find_objects(stress_thread *t) {
+
+    CK_OBJECT_CLASS key_class = CKO_PRIVATE_KEY;
+    CK_ATTRIBUTE tmpl[] = {
+        { CKA_CLASS, &key_class, sizeof(key_class) },
+    };
+
+    CK_RV rv = C_FindObjectsInit(t->session, tmpl, ARRAY_LEN(tmpl));
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_OBJECT_HANDLE handles[16];
+    CK_ULONG count;
+    do {
+        rv = C_FindObjects(t->session, handles, ARRAY_LEN(handles), &count);
+    } while (rv == CKR_OK && count == ARRAY_LEN(handles));
+
+    CK_RV rv2 = C_FindObjectsFinal(t->session);
+
+    return rv != CKR_OK ? rv : rv2;
+}
+
+static CK_RV op_get_attribute_value(stress_thread *t) {
+
+    CK_BYTE modulus[512];
+    CK_BYTE label[64];
+
+    CK_ATTRIBUTE tmpl[] = {
+        { CKA_MODULUS, modulus, sizeof(modulus) },
+        { CKA_LABEL,   label,   sizeof(label)   },
+    };
+
+    return C_GetAttributeValue(t->session, t->ctx->keys.rsa_pub,
+            tmpl, ARRAY_LEN(tmpl));
+}
+
+/* another thread may hold the login, that is not an error */
+static CK_RV op_login(stress_thread *t) {
+
+    unsigned char upin[] = IMPORT_LABEL_USERPIN;
+
+    return C_Login(t->login_session, CKU_USER, upin, sizeof(upin) - 1);
+}
+
+static CK_RV op_logout(stress_thread *t) {
+
+    return C_Logout(t->login_session);
+}
+
+static CK_RV op_session_churn(stress_thread *t) {
+
+    CK_SESSION_HANDLE session;
+    CK_RV rv = C_OpenSession(t->ctx->work_slot,
+            CKF_SERIAL_SESSION | CKF_RW_SESSION, NULL, NULL, &session);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    CK_SESSION_INFO info;
+    rv = C_GetSessionInfo(session, &info);
+
+    CK_RV rv2 = C_CloseSession(session);
+
+    return rv != CKR_OK ? rv : rv2;
+}
+
+static const stress_op _ops[] = {
+    { "C_Sign RSA",          op_sign_rsa,            CKR_OK                     },
+    { "C_FindObjects",       op_find_objects,        CKR_OK                     },
+    { "C_Login",             op_login,               CKR_USER_ALREADY_LOGGED_IN },
+    { "C_Encrypt AES",       op_encrypt_aes,         CKR_OK                     },
+    { "C_GetAttributeValue", op_get_attribute_value, CKR_OK                     },
+    { "C_OpenSession",       op_session_churn,       CKR_OK                     },
+    { "C_Sign ECDSA",        op_sign_ecdsa,          CKR_OK                     },
+    { "C_Logout",            op_logout,              CKR_USER_NOT_LOGGED_IN     },
+};
+
+static void *thread_main(void *arg) {
+
+    stress_thread *t = (stress_thread *)arg;
+
+    /* threads start at different ops so every op runs concurrently */
+    size_t i = t->index;
+    while (now_ns() < t->deadline) {
+        const stress_op *op = &_ops[i++ % ARRAY_LEN(_ops)];
+
+        __atomic_store_n(&t->current_op, op->name, __ATOMIC_RELAXED);
+        CK_RV rv = op->fn(t);
+        __atomic_store_n(&t->current_op, NULL, __ATOMIC_RELAXED);
+
+        t->ops++;
+        if (rv != CKR_OK && rv != op->also_ok) {
+            t->errors++;
+            t->last_error = rv;
+            t->last_error_op = op->name;
+        }
+    }
+
+    pthread_mutex_lock(&t->run->lock);
+    t->run->done++;
+    pthread_cond_signal(&t->run->cond);
+    pthread_mutex_unlock(&t->run->lock);
+
+    return NULL;
+}
+
+/*
+ * Waits for every thread to finish, a run that overstays its deadline by
+ * the timeout is taken to be deadlocked. The stuck threads can't be
+ * recovered, so report what each is doing and abort.
+ */
+static void wait_for_threads(stress_run *run, stress_thread *threads,
+        unsigned nthreads, uint64_t deadline) {
+
+    struct timespec limit;
+    clock_gettime(CLOCK_REALTIME, &limit);
+    uint64_t now = now_ns();
+    uint64_t remaining = (deadline > now ? deadline - now : 0)
+            + _opts.timeout * 1000000000ULL;
+    limit.tv_sec += remaining / 1000000000ULL;
+    limit.tv_nsec += remaining % 1000000000ULL;
+    if (limit.tv_nsec >= 1000000000L) {
+        limit.tv_sec++;
+        limit.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&run->lock);
+    while (run->done < nthreads) {
+        int rc = pthread_cond_timedwait(&run->cond, &run->lock, &limit);
+        if (rc == ETIMEDOUT) {
+            break;
+        }
+    }
+    unsigned done = run->done;
+    pthread_mutex_unlock(&run->lock);
+
+    if (done == nthreads) {
+        return;
+    }
+
+    fprintf(stderr, "Deadlock suspected, %u of %u threads still running "
+            "%us past the deadline\n", nthreads - done, nthreads, _opts.timeout);
+
+    unsigned i;
+    for (i=0; i < nthreads; i++) {
+        const char *op = __atomic_load_n(&threads[i].current_op,
+                __ATOMIC_RELAXED);
+        if (op) {
+            fprintf(stderr, "  thread %u is in %s\n", i, op);
+        }
+    }
+
+    abort();
+}
+
+static uint64_t run_threads(stress_ctx *ctx, unsigned nthreads,
+        const char *locking, double *ops_per_sec) {
+
+    stress_thread threads[MAX_THREADS] = { 0 };
+    stress_run run = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+    };
+
+    unsigned i;
+    for (i=0; i < nthreads; i++) {
+        stress_thread *t = &threads[i];
+        t->index = i;
+        t->ctx = ctx;
+        t->run = &run;
+
+        CK_RV rv = C_OpenSession(ctx->work_slot,
+                CKF_SERIAL_SESSION | CKF_RW_SESSION, NULL, NULL, &t->session);
+        assert_int_equal(rv, CKR_OK);
+
+        rv = C_OpenSession(ctx->login_slot, CKF_SERIAL_SESSION, NULL, NULL,
+                &t->login_session);
+        assert_int_equal(rv, CKR_OK);
+    }
+
+    uint64_t start = now_ns();
+    uint64_t deadline = start + _opts.duration * 1000000000ULL;
+
+    for (i=0; i < nthreads; i++) {
+        threads[i].deadline = deadline;
+        int rc = pthread_create(&threads[i].thread, NULL, thread_main,
+                &threads[i]);
+        assert_int_equal(rc, 0);
+    }
+
+    wait_for_threads(&run, threads, nthreads, deadline);
+
+    uint64_t ops = 0;
+    uint64_t errors = 0;
+    for (i=0; i < nthreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+
+        stress_thread *t = &threads[i];
+        ops += t->ops;
+        errors += t->errors;
+        if (t->errors) {
+            fprintf(stderr, "thread %u: %"PRIu64" errors, last %s: 0x%lx\n",
+                    i, t->errors, t->last_error_op, t->last_error);
+        }
+
+        C_CloseSession(t->session);
+        C_CloseSession(t->login_session);
+    }
+
+    double seconds = (now_ns() - start) / 1e9;
+    *ops_per_sec = seconds > 0 ? ops / seconds : 0;
+
+    printf("stress locking=%s threads=%u ops=%"PRIu64" errors=%"PRIu64
+            " seconds=%.3f ops_per_sec=%.1f\n",
+            locking, nthreads, ops, errors, seconds, *ops_per_sec);
+
+    pthread_mutex_destroy(&run.lock);
+    pthread_cond_destroy(&run.cond);
+
+    return errors;
+}
+
+static CK_SLOT_ID find_slot(const char *label) {
+
+    CK_SLOT_ID slots[TOKEN_COUNT + 1];
+    CK_ULONG count = ARRAY_LEN(slots);
+    CK_RV rv = C_GetSlotList(true, slots, &count);
+    assert_int_equal(rv, CKR_OK);
+
+    size_t len = strlen(label);
+
+    CK_ULONG i;
+    for (i=0; i < count; i++) {
+        CK_TOKEN_INFO info;
+        rv = C_GetTokenInfo(slots[i], &info);
+        assert_int_equal(rv, CKR_OK);
+
+        /* labels are blank padded */
+        if (!memcmp(info.label, label, len) && info.label[len] == ' ') {
+            return slots[i];
+        }
+    }
+
+    fail_msg("Token \"%s\" not found", label);
+    return 0;
+}
+
+static CK_OBJECT_HANDLE find_key(CK_SESSION_HANDLE session,
+        CK_OBJECT_CLASS key_class, const char *label) {
+
+    CK_ATTRIBUTE tmpl[] = {
+        { CKA_CLASS, &key_class, sizeof(key_class) },
+        { CKA_LABEL, (void *)label, strlen(label) },
+    };
+
+    CK_RV rv = C_FindObjectsInit(session, tmpl, ARRAY_LEN(tmpl));
+    assert_int_equal(rv, CKR_OK);
+
+    CK_OBJECT_HANDLE handle;
+    CK_ULONG count;
+    rv = C_FindObjects(session, &handle, 1, &count);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(count, 1);
+
+    rv = C_FindObjectsFinal(session);
+    assert_int_equal(rv, CKR_OK);
+
+    return handle;
+}
+
+static void stress_ctx_init(stress_ctx *ctx) {
+
+    memset(ctx, 0, sizeof(*ctx));
+
+    ctx->work_slot = find_slot(WORK_TOKEN);
+    ctx->login_slot = find_slot(LOGIN_TOKEN);
+
+    CK_RV rv = C_OpenSession(ctx->work_slot, CKF_SERIAL_SESSION, NULL, NULL,
+            &ctx->login_session);
+    assert_int_equal(rv, CKR_OK);
+
+    user_login(ctx->login_session);
+
+    ctx->keys.rsa_priv = find_key(ctx->login_session, CKO_PRIVATE_KEY, "rsa0");
+    ctx->keys.rsa_pub = find_key(ctx->login_session, CKO_PUBLIC_KEY, "rsa0");
+    ctx->keys.ec_priv = find_key(ctx->login_session, CKO_PRIVATE_KEY, "ec0");
+    ctx->keys.aes = find_key(ctx->login_session, CKO_SECRET_KEY, "mykeylabel");
+}
+
+static void stress_ctx_free(stress_ctx *ctx) {
+
+    logout(ctx->login_session);
+
+    CK_RV rv = C_CloseAllSessions(ctx->work_slot);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = C_CloseAllSessions(ctx->login_slot);
+    assert_int_equal(rv, CKR_OK);
+}
+
+static void run_scaling(const char *locking) {
+
+    stress_ctx ctx;
+    stress_ctx_init(&ctx);
+
+    uint64_t errors = 0;
+    double base = 0;
+
+    size_t i;
+    for (i=0; i < _opts.nthreads; i++) {
+        double ops_per_sec = 0;
+        errors += run_threads(&ctx, _opts.threads[i], locking, &ops_per_sec);
+
+        if (!base) {
+            base = ops_per_sec;
+        }
+
+        printf("stress locking=%s threads=%u scaling=%.2f\n", locking,
+                _opts.threads[i], base > 0 ? ops_per_sec / base : 0);
+    }
+
+    stress_ctx_free(&ctx);
+
+    assert_int_equal(errors, 0);
+}
+
+static void test_stress_os_locking(void **state) {
+    UNUSED(state);
+
+    CK_C_INITIALIZE_ARGS args = {
+        .flags = CKF_OS_LOCKING_OK,
+    };
+
+    CK_RV rv = C_Initialize(&args);
+    assert_int_equal(rv, CKR_OK);
+
+    run_scaling("os");
+
+    rv = C_Finalize(NULL);
+    assert_int_equal(rv, CKR_OK);
+}
+
+/* application mutex callbacks, counted to prove the library uses them */
+static struct {
+    unsigned long created;
+    unsigned long destroyed;
+    unsigned long locked;
+    unsigned long unlocked;
+} _app_mutex;
+
+#define COUNT(x) __atomic_fetch_add(&_app_mutex.x, 1, __ATOMIC_RELAXED)
+
+static CK_RV app_create_mutex(void **mutex) {
+
+    pthread_mutex_t *m = malloc(sizeof(*m));
+    if (!m) {
+        return CKR_HOST_MEMORY;
+    }
+
+    if (pthread_mutex_init(m, NULL)) {
+        free(m);
+        return CKR_GENERAL_ERROR;
+    }
+
+    COUNT(created);
+    *mutex = m;
+
+    return CKR_OK;
+}
+
+static CK_RV app_destroy_mutex(void *mutex) {
+
+    COUNT(destroyed);
+    pthread_mutex_destroy(mutex);
+    free(mutex);
+
+    return CKR_OK;
+}
+
+static CK_RV app_lock_mutex(void *mutex) {
+
+    COUNT(locked);
+
+    return pthread_mutex_lock(mutex) ? CKR_MUTEX_BAD : CKR_OK;
+}
+
+static CK_RV app_unlock_mutex(void *mutex) {
+
+    COUNT(unlocked);
+
+    return pthread_mutex_unlock(mutex) ? CKR_MUTEX_NOT_LOCKED : CKR_OK;
+}
+
+static void test_stress_app_mutex(void **state) {
+    UNUSED(state);
+
+    memset(&_app_mutex, 0, sizeof(_app_mutex));
+
+    /* no CKF_OS_LOCKING_OK, so the library must use these */
+    CK_C_INITIALIZE_ARGS args = {
+        .CreateMutex = app_create_mutex,
+        .DestroyMutex = app_destroy_mutex,
+        .LockMutex = app_lock_mutex,
+        .UnlockMutex = app_unlock_mutex,
+    };
+
+    CK_RV rv = C_Initialize(&args);
+    assert_int_equal(rv, CKR_OK);
+
+    run_scaling("app");
+
+    rv = C_Finalize(NULL);
+    assert_int_equal(rv, CKR_OK);
+
+    printf("stress locking=app mutexes=%lu locks=%lu\n",
+            _app_mutex.created, _app_mutex.locked);
+
+    assert_true(_app_mutex.created > 0);
+    assert_true(_app_mutex.locked > 0);
+    assert_int_equal(_app_mutex.locked, _app_mutex.unlocked);
+    assert_int_equal(_app_mutex.created, _app_mutex.destroyed);
+}
+
+static bool env_uint(const char *name, unsigned def, unsigned *out) {
+
+    const char *value = getenv(name);
+    if (!value || !value[0]) {
+        *out = def;
+        return true;
+    }
+
+    char *end = NULL;
+    unsigned long v = strtoul(value, &end, 10);
+    if (*end || !v || v > UINT32_MAX) {
+        fprintf(stderr, "%s must be a positive number, got \"%s\"\n",
+                name, value);
+        return false;
+    }
+
+    *out = v;
+    return true;
+}
+
+static int parse_opts(void) {
+
+    const char *threads = getenv("TEST_STRESS_THREADS");
+    if (!threads || !threads[0]) {
+        threads = DEFAULT_THREADS;
+    }
+
+    const char *p = threads;
+    while (*p) {
+        char *end = NULL;
+        unsigned long n = strtoul(p, &end, 10);
+        if (end == p || !n || n > MAX_THREADS || _opts.nthreads == MAX_COUNTS
+                || (*end && *end != ',')) {
+            fprintf(stderr, "TEST_STRESS_THREADS must list thread counts "
+                    "from 1 to %u, got \"%s\"\n", MAX_THREADS, threads);
+            return 1;
+        }
+        _opts.threads[_opts.nthreads++] = n;
+        p = *end ? end + 1 : end;
+    }
+
+    if (!env_uint("TEST_STRESS_DURATION", DEFAULT_DURATION, &_opts.duration)
+            || !env_uint("TEST_STRESS_TIMEOUT", DEFAULT_TIMEOUT, &_opts.timeout)) {
+        return 1;
+    }
+
+    return 0;
+}
+
+int main() {
+
+    if (parse_opts()) {
+        return 1;
+    }
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_stress_os_locking),
+        cmocka_unit_test(test_stress_app_mutex),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
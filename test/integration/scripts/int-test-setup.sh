@@ -176,6 +176,17 @@ export TPM2TOOLS_TCTI="tabrmd:${TABRMD_TEST_TCTI_CONF}"
 echo ${TPM2TOOLS_TCTI}
 
 export TPM2_PKCS11_TCTI="tabrmd:${TABRMD_TEST_TCTI_CONF}"
+# model the command latency of a real TPM, see test/tcti/tcti-latency.h
+if [ -n "${TEST_TCTI_LATENCY}" ]; then
+    TPM2_PKCS11_TCTI="${TEST_TCTI_LATENCY_MODULE}:${TEST_TCTI_LATENCY};${TPM2_PKCS11_TCTI}"
+fi
+# replay the timings of, or record, TPM traffic, see src/tcti/tcti-recording.h
+if [ -n "${TEST_TCTI_REPLAY}" ]; then
+    TPM2_PKCS11_TCTI="${TEST_TCTI_REPLAY_MODULE}:${TEST_TCTI_REPLAY};${TPM2_PKCS11_TCTI}"
+fi
+if [ -n "${TEST_TCTI_RECORD}" ]; then
+    TPM2_PKCS11_TCTI="${TEST_TCTI_RECORD_MODULE}:${TEST_TCTI_RECORD};${TPM2_PKCS11_TCTI}"
+fi
 echo ${TPM2_PKCS11_TCTI}
 
 
@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef TEST_TCTI_FAKE_H_
+#define TEST_TCTI_FAKE_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <tss2/tss2_tcti.h>
+
+/*
+ * A child TCTI for the unit tests of the wrapping TCTIs. It answers every
+ * command with a bare success response, optionally after sleeping to stand
+ * in for a slow simulator, and remembers the last command code.
+ */
+typedef struct fake_tcti fake_tcti;
+struct fake_tcti {
+    TSS2_TCTI_CONTEXT_COMMON_V2 common;
+    uint32_t cc;
+    long delay_us;
+};
+
+static const uint8_t _fake_rsp[] = {
+    0x80, 0x01, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x00
+};
+
+static inline void fake_sleep_us(long us) {
+    struct timespec ts = { .tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000 };
+    nanosleep(&ts, NULL);
+}
+
+static inline TSS2_RC fake_transmit(TSS2_TCTI_CONTEXT *ctx, size_t size,
+        const uint8_t *command) {
+
+    fake_tcti *f = (fake_tcti *)ctx;
+    if (size < 10) {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+
+    f->cc = (uint32_t)command[6] << 24 | (uint32_t)command[7] << 16
+            | (uint32_t)command[8] << 8 | command[9];
+
+    return TSS2_RC_SUCCESS;
+}
+
+static inline TSS2_RC fake_receive(TSS2_TCTI_CONTEXT *ctx, size_t *size,
+        uint8_t *response, int32_t timeout) {
+    (void) timeout;
+
+    fake_tcti *f = (fake_tcti *)ctx;
+    if (response) {
+        if (*size < sizeof(_fake_rsp)) {
+            return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+        }
+        memcpy(response, _fake_rsp, sizeof(_fake_rsp));
+        fake_sleep_us(f->delay_us);
+    }
+    *size = sizeof(_fake_rsp);
+
+    return TSS2_RC_SUCCESS;
+}
+
+static inline void fake_init(fake_tcti *f, long delay_us) {
+
+    memset(f, 0, sizeof(*f));
+    f->delay_us = delay_us;
+    TSS2_TCTI_TRANSMIT(f) = fake_transmit;
+    TSS2_TCTI_RECEIVE(f) = fake_receive;
+}
+
+static inline uint64_t fake_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#endif /* TEST_TCTI_FAKE_H_ */
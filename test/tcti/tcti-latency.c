@@ -0,0 +1,494 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <tss2/tss2_tctildr.h>
+#include <tss2/tss2_tpm2_types.h>
+
+#include "tcti-latency.h"
+
+#define TCTI_LATENCY_MAGIC 0x4c6174656e637921ULL
+#define TCTI_LATENCY_VERSION 2
+
+#define ARRAY_LEN(x) (sizeof(x)/sizeof(x[0]))
+
+/*
+ * Command times in microseconds of a discrete TPM on SPI, taken as the
+ * middle of the range published for current parts with 2048 bit RSA and
+ * NIST P256 keys. Key creation varies by orders of magnitude on real parts
+ * so treat those as a typical ECC value, and override them when a test
+ * cares. Transfer time is modeled separately by the per byte cost.
+ */
+static const tcti_latency_cmd _discrete[] = {
+    { "Startup",           TPM2_CC_Startup,            20000 },
+    { "SelfTest",          TPM2_CC_SelfTest,           50000 },
+    { "GetCapability",     TPM2_CC_GetCapability,       2000 },
+    { "GetRandom",         TPM2_CC_GetRandom,           3000 },
+    { "StirRandom",        TPM2_CC_StirRandom,          2000 },
+    { "TestParms",         TPM2_CC_TestParms,           1500 },
+    { "StartAuthSession",  TPM2_CC_StartAuthSession,   25000 },
+    { "PolicyPassword",    TPM2_CC_PolicyPassword,      1500 },
+    { "PolicyAuthValue",   TPM2_CC_PolicyAuthValue,     1500 },
+    { "CreatePrimary",     TPM2_CC_CreatePrimary,     250000 },
+    { "Create",            TPM2_CC_Create,            300000 },
+    { "CreateLoaded",      TPM2_CC_CreateLoaded,      300000 },
+    { "Load",              TPM2_CC_Load,               25000 },
+    { "LoadExternal",      TPM2_CC_LoadExternal,       15000 },
+    { "Import",            TPM2_CC_Import,             30000 },
+    { "ReadPublic",        TPM2_CC_ReadPublic,          2000 },
+    { "FlushContext",      TPM2_CC_FlushContext,        1500 },
+    { "ContextSave",       TPM2_CC_ContextSave,         6000 },
+    { "ContextLoad",       TPM2_CC_ContextLoad,         8000 },
+    { "EvictControl",      TPM2_CC_EvictControl,       30000 },
+    { "ObjectChangeAuth",  TPM2_CC_ObjectChangeAuth,   25000 },
+    { "Unseal",            TPM2_CC_Unseal,             15000 },
+    { "Sign",              TPM2_CC_Sign,               80000 },
+    { "VerifySignature",   TPM2_CC_VerifySignature,    40000 },
+    { "RSA_Encrypt",       TPM2_CC_RSA_Encrypt,        15000 },
+    { "RSA_Decrypt",       TPM2_CC_RSA_Decrypt,       120000 },
+    { "ECDH_KeyGen",       TPM2_CC_ECDH_KeyGen,        70000 },
+    { "ECDH_ZGen",         TPM2_CC_ECDH_ZGen,          60000 },
+    { "EncryptDecrypt",    TPM2_CC_EncryptDecrypt,      8000 },
+    { "EncryptDecrypt2",   TPM2_CC_EncryptDecrypt2,     8000 },
+    { "HMAC",              TPM2_CC_HMAC,                6000 },
+    { "Hash",              TPM2_CC_Hash,                5000 },
+    { "HashSequenceStart", TPM2_CC_HashSequenceStart,   3000 },
+    { "SequenceUpdate",    TPM2_CC_SequenceUpdate,      4000 },
+    { "SequenceComplete",  TPM2_CC_SequenceComplete,    5000 },
+    { "PCR_Read",          TPM2_CC_PCR_Read,            2000 },
+    { "NV_Read",           TPM2_CC_NV_Read,             5000 },
+};
+
+static const struct {
+    const char *name;
+    const tcti_latency_cmd *table;
+    size_t table_len;
+    double scale;
+    uint32_t byte_ns;
+    uint32_t default_us;
+} _profiles[] = {
+    /* roughly 500KB/s effective over SPI with TIS flow control */
+    { "discrete", _discrete, ARRAY_LEN(_discrete), 1.0,  2000, 3000 },
+    /* firmware TPMs run on the host CPU with a memory mapped interface */
+    { "firmware", _discrete, ARRAY_LEN(_discrete), 0.25,   50,  750 },
+    { "none",     NULL,      0,                    1.0,     0,    0 },
+};
+
+typedef struct tcti_latency tcti_latency;
+struct tcti_latency {
+    TSS2_TCTI_CONTEXT_COMMON_V2 common;
+    TSS2_TCTI_CONTEXT *child;
+    bool owns_child;
+    tcti_latency_model model;
+    bool pending;
+    uint32_t cc;
+    size_t cmd_size;
+    struct timespec sent;
+};
+
+static void set_profile(tcti_latency_model *model, size_t i) {
+    model->table = _profiles[i].table;
+    model->table_len = _profiles[i].table_len;
+    model->scale = _profiles[i].scale;
+    model->byte_ns = _profiles[i].byte_ns;
+    model->default_us = _profiles[i].default_us;
+}
+
+static bool parse_u32(const char *s, uint32_t *val) {
+
+    errno = 0;
+    char *end = NULL;
+    unsigned long v = strtoul(s, &end, 0);
+    if (errno || !*s || *end || v > UINT32_MAX) {
+        return false;
+    }
+
+    *val = v;
+    return true;
+}
+
+static bool parse_cc(const char *s, tcti_latency_cmd *cmd) {
+
+    size_t i;
+    for (i=0; i < ARRAY_LEN(_discrete); i++) {
+        if (!strcasecmp(s, _discrete[i].name)) {
+            *cmd = _discrete[i];
+            return true;
+        }
+    }
+
+    cmd->name = NULL;
+    return !strncasecmp(s, "0x", 2) && parse_u32(s, &cmd->cc);
+}
+
+static TSS2_RC parse_opt(tcti_latency_model *model, char *opt, bool profile_pass) {
+
+    char *val = strchr(opt, '=');
+    if (!val) {
+        goto bad;
+    }
+    *val++ = '\0';
+
+    bool is_profile = !strcmp(opt, "profile");
+    if (is_profile != profile_pass) {
+        /* handled in the other pass */
+        return TSS2_RC_SUCCESS;
+    }
+
+    if (is_profile) {
+        size_t i;
+        for (i=0; i < ARRAY_LEN(_profiles); i++) {
+            if (!strcmp(val, _profiles[i].name)) {
+                set_profile(model, i);
+                return TSS2_RC_SUCCESS;
+            }
+        }
+        goto bad;
+    }
+
+    if (!strcmp(opt, "scale")) {
+        char *end = NULL;
+        model->scale = strtod(val, &end);
+        if (!*val || *end || model->scale < 0) {
+            goto bad;
+        }
+    } else if (!strcmp(opt, "byte")) {
+        if (!parse_u32(val, &model->byte_ns)) {
+            goto bad;
+        }
+    } else if (!strcmp(opt, "default")) {
+        if (!parse_u32(val, &model->default_us)) {
+            goto bad;
+        }
+    } else if (!strcmp(opt, "mode")) {
+        if (!strcmp(val, "pad")) {
+            model->mode = tcti_latency_mode_pad;
+        } else if (!strcmp(val, "add")) {
+            model->mode = tcti_latency_mode_add;
+        } else {
+            goto bad;
+        }
+    } else {
+        if (model->overrides_len >= ARRAY_LEN(model->overrides)) {
+            fprintf(stderr, "tcti-latency: more than %u overrides\n",
+                    (unsigned)ARRAY_LEN(model->overrides));
+            return TSS2_TCTI_RC_BAD_VALUE;
+        }
+
+        tcti_latency_cmd *cmd = &model->overrides[model->overrides_len];
+        if (!parse_cc(opt, cmd) || !parse_u32(val, &cmd->us)) {
+            goto bad;
+        }
+        model->overrides_len++;
+    }
+
+    return TSS2_RC_SUCCESS;
+
+bad:
+    fprintf(stderr, "tcti-latency: bad option \"%s\"\n", opt);
+    return TSS2_TCTI_RC_BAD_VALUE;
+}
+
+TSS2_RC tcti_latency_model_parse(tcti_latency_model *model, const char *opts) {
+
+    memset(model, 0, sizeof(*model));
+    set_profile(model, 0);
+    model->mode = tcti_latency_mode_pad;
+
+    if (!opts) {
+        return TSS2_RC_SUCCESS;
+    }
+
+    const char *end = strchr(opts, ';');
+    char *copy = end ? strndup(opts, end - opts) : strdup(opts);
+    if (!copy) {
+        return TSS2_TCTI_RC_MEMORY;
+    }
+
+    /*
+     * The profile sets the baseline, so apply it first wherever it
+     * appears and let the other options adjust it.
+     */
+    TSS2_RC rc = TSS2_RC_SUCCESS;
+    unsigned pass;
+    for (pass=0; pass < 2 && rc == TSS2_RC_SUCCESS; pass++) {
+        char *buf = strdup(copy);
+        if (!buf) {
+            rc = TSS2_TCTI_RC_MEMORY;
+            break;
+        }
+
+        char *saveptr = NULL;
+        char *tok = strtok_r(buf, ",", &saveptr);
+        for (; tok && rc == TSS2_RC_SUCCESS; tok = strtok_r(NULL, ",", &saveptr)) {
+            rc = parse_opt(model, tok, pass == 0);
+        }
+
+        free(buf);
+    }
+
+    free(copy);
+    return rc;
+}
+
+uint64_t tcti_latency_model_ns(const tcti_latency_model *model, uint32_t cc,
+        size_t cmd_size, size_t rsp_size) {
+
+    uint32_t us = model->default_us;
+    bool found = false;
+
+    /* the last override wins */
+    size_t i = model->overrides_len;
+    while (i-- > 0) {
+        if (model->overrides[i].cc == cc) {
+            us = model->overrides[i].us;
+            found = true;
+            break;
+        }
+    }
+
+    for (i=0; !found && i < model->table_len; i++) {
+        if (model->table[i].cc == cc) {
+            us = model->table[i].us;
+            found = true;
+        }
+    }
+
+    uint64_t ns = (uint64_t)(us * 1000.0 * model->scale);
+    return ns + (uint64_t)model->byte_ns * (cmd_size + rsp_size);
+}
+
+static tcti_latency *to_latency(TSS2_TCTI_CONTEXT *ctx) {
+
+    if (!ctx) {
+        return NULL;
+    }
+
+    tcti_latency *t = (tcti_latency *)ctx;
+    return TSS2_TCTI_MAGIC(ctx) == TCTI_LATENCY_MAGIC ? t : NULL;
+}
+
+static void timespec_add_ns(struct timespec *ts, uint64_t ns) {
+
+    ns += ts->tv_nsec;
+    ts->tv_sec += ns / 1000000000ULL;
+    ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static void sleep_until(const struct timespec *deadline) {
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL)
+            == EINTR) {
+        /* keep waiting */
+    }
+}
+
+static TSS2_RC tcti_latency_transmit(TSS2_TCTI_CONTEXT *ctx, size_t size,
+        const uint8_t *command) {
+
+    tcti_latency *t = to_latency(ctx);
+    if (!t) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+
+    /* tag, size and command code make up the command header */
+    if (!command || size < 10) {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+
+    t->cc = (uint32_t)command[6] << 24 | (uint32_t)command[7] << 16
+            | (uint32_t)command[8] << 8 | command[9];
+    t->cmd_size = size;
+    clock_gettime(CLOCK_MONOTONIC, &t->sent);
+
+    TSS2_RC rc = Tss2_Tcti_Transmit(t->child, size, command);
+    t->pending = rc == TSS2_RC_SUCCESS;
+
+    return rc;
+}
+
+static TSS2_RC tcti_latency_receive(TSS2_TCTI_CONTEXT *ctx, size_t *size,
+        uint8_t *response, int32_t timeout) {
+
+    tcti_latency *t = to_latency(ctx);
+    if (!t) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+
+    TSS2_RC rc = Tss2_Tcti_Receive(t->child, size, response, timeout);
+    /* size queries and timeouts leave the command outstanding */
+    if (rc != TSS2_RC_SUCCESS || !response || !t->pending) {
+        return rc;
+    }
+
+    t->pending = false;
+
+    uint64_t ns = tcti_latency_model_ns(&t->model, t->cc, t->cmd_size, *size);
+
+    struct timespec deadline = t->sent;
+    if (t->model.mode == tcti_latency_mode_add) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+    }
+    timespec_add_ns(&deadline, ns);
+    sleep_until(&deadline);
+
+    return rc;
+}
+
+static void tcti_latency_finalize(TSS2_TCTI_CONTEXT *ctx) {
+
+    tcti_latency *t = to_latency(ctx);
+    if (!t) {
+        return;
+    }
+
+    if (t->owns_child) {
+        Tss2_TctiLdr_Finalize(&t->child);
+    }
+
+    TSS2_TCTI_MAGIC(ctx) = 0;
+}
+
+static TSS2_RC tcti_latency_cancel(TSS2_TCTI_CONTEXT *ctx) {
+
+    tcti_latency *t = to_latency(ctx);
+    if (!t) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+
+    t->pending = false;
+    return Tss2_Tcti_Cancel(t->child);
+}
+
+static TSS2_RC tcti_latency_get_poll_handles(TSS2_TCTI_CONTEXT *ctx,
+        TSS2_TCTI_POLL_HANDLE *handles, size_t *num_handles) {
+
+    tcti_latency *t = to_latency(ctx);
+    if (!t) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+
+    return Tss2_Tcti_GetPollHandles(t->child, handles, num_handles);
+}
+
+static TSS2_RC tcti_latency_set_locality(TSS2_TCTI_CONTEXT *ctx,
+        uint8_t locality) {
+
+    tcti_latency *t = to_latency(ctx);
+    if (!t) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+
+    return Tss2_Tcti_SetLocality(t->child, locality);
+}
+
+static TSS2_RC tcti_latency_make_sticky(TSS2_TCTI_CONTEXT *ctx,
+        TPM2_HANDLE *handle, uint8_t sticky) {
+
+    tcti_latency *t = to_latency(ctx);
+    if (!t) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+
+    return Tss2_Tcti_MakeSticky(t->child, handle, sticky);
+}
+
+TSS2_RC tcti_latency_init_child(TSS2_TCTI_CONTEXT *ctx, size_t *size,
+        const char *opts, TSS2_TCTI_CONTEXT *child) {
+
+    if (!size) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+
+    if (!ctx) {
+        *size = sizeof(tcti_latency);
+        return TSS2_RC_SUCCESS;
+    }
+
+    if (*size < sizeof(tcti_latency)) {
+        return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+    }
+
+    if (!child) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+
+    tcti_latency *t = (tcti_latency *)ctx;
+    memset(t, 0, sizeof(*t));
+
+    TSS2_RC rc = tcti_latency_model_parse(&t->model, opts);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+
+    t->child = child;
+
+    TSS2_TCTI_MAGIC(ctx) = TCTI_LATENCY_MAGIC;
+    TSS2_TCTI_VERSION(ctx) = TCTI_LATENCY_VERSION;
+    TSS2_TCTI_TRANSMIT(ctx) = tcti_latency_transmit;
+    TSS2_TCTI_RECEIVE(ctx) = tcti_latency_receive;
+    TSS2_TCTI_FINALIZE(ctx) = tcti_latency_finalize;
+    TSS2_TCTI_CANCEL(ctx) = tcti_latency_cancel;
+    TSS2_TCTI_GET_POLL_HANDLES(ctx) = tcti_latency_get_poll_handles;
+    TSS2_TCTI_SET_LOCALITY(ctx) = tcti_latency_set_locality;
+    TSS2_TCTI_MAKE_STICKY(ctx) = tcti_latency_make_sticky;
+
+    return TSS2_RC_SUCCESS;
+}
+
+TSS2_RC Tss2_Tcti_Latency_Init(TSS2_TCTI_CONTEXT *ctx, size_t *size,
+        const char *conf) {
+
+    if (!ctx) {
+        return tcti_latency_init_child(ctx, size, conf, NULL);
+    }
+
+    /* catch bad options before starting the child */
+    tcti_latency_model model;
+    TSS2_RC rc = tcti_latency_model_parse(&model, conf);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+
+    const char *child_conf = conf ? strchr(conf, ';') : NULL;
+    if (child_conf) {
+        child_conf++;
+    }
+
+    TSS2_TCTI_CONTEXT *child = NULL;
+    rc = Tss2_TctiLdr_Initialize(child_conf && *child_conf ? child_conf : NULL,
+            &child);
+    if (rc != TSS2_RC_SUCCESS) {
+        fprintf(stderr, "tcti-latency: could not load child TCTI \"%s\"\n",
+                child_conf ? child_conf : "(default)");
+        return rc;
+    }
+
+    rc = tcti_latency_init_child(ctx, size, conf, child);
+    if (rc != TSS2_RC_SUCCESS) {
+        Tss2_TctiLdr_Finalize(&child);
+        return rc;
+    }
+
+    ((tcti_latency *)ctx)->owns_child = true;
+
+    return TSS2_RC_SUCCESS;
+}
+
+static const TSS2_TCTI_INFO _info = {
+    .version = TCTI_LATENCY_VERSION,
+    .name = "tcti-latency",
+    .description = "Forwards to a child TCTI and models the command latency "
+                   "of a real TPM.",
+    .config_help = "[profile=discrete|firmware|none][,scale=F][,byte=NS]"
+                   "[,default=US][,mode=pad|add][,<Command>=US...][;CHILD-TCTI]",
+    .init = Tss2_Tcti_Latency_Init,
+};
+
+const TSS2_TCTI_INFO *Tss2_Tcti_Info(void) {
+    return &_info;
+}
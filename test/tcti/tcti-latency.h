@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#ifndef TEST_TCTI_LATENCY_H_
+#define TEST_TCTI_LATENCY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <tss2/tss2_tcti.h>
+
+/*
+ * A TCTI that forwards every command to a child TCTI and holds the
+ * response back until a modeled TPM would have answered. Load it through
+ * the TCTI loader with a config string of options and the child config
+ * separated by a semicolon, for example:
+ *
+ *   TPM2_PKCS11_TCTI="/path/libtss2-tcti-latency.so:profile=discrete,Sign=50000;tabrmd:bus_type=session"
+ *
+ * Options are comma separated:
+ *   profile=discrete|firmware|none  the per command timing table, default discrete.
+ *   scale=<float>                   multiplies every command time, default 1.
+ *   byte=<ns>                       transfer cost per command and response byte.
+ *   default=<us>                    time for commands not in the table.
+ *   mode=pad|add                    pad (default) waits until the modeled time has
+ *                                   passed since transmit, so a fast simulator is
+ *                                   hidden entirely. add sleeps the modeled time
+ *                                   on top of the child's own time.
+ *   <Command>=<us>, <0xCC>=<us>     overrides one command, by TPM2_CC name without
+ *                                   the prefix, eg Sign, or by command code.
+ *
+ * With no child config the TCTI loader default is used.
+ */
+#define TCTI_LATENCY_OVERRIDES_MAX 32
+
+typedef struct tcti_latency_cmd tcti_latency_cmd;
+struct tcti_latency_cmd {
+    const char *name;
+    uint32_t cc;
+    uint32_t us;
+};
+
+typedef enum tcti_latency_mode tcti_latency_mode;
+enum tcti_latency_mode {
+    tcti_latency_mode_pad,
+    tcti_latency_mode_add,
+};
+
+typedef struct tcti_latency_model tcti_latency_model;
+struct tcti_latency_model {
+    const tcti_latency_cmd *table;
+    size_t table_len;
+    double scale;
+    uint32_t byte_ns;
+    uint32_t default_us;
+    tcti_latency_mode mode;
+    size_t overrides_len;
+    tcti_latency_cmd overrides[TCTI_LATENCY_OVERRIDES_MAX];
+};
+
+/**
+ * Parses the option part of a config string into a model.
+ * @param model
+ *  The model to fill in.
+ * @param opts
+ *  The options, up to the end of the string or the first ';'. May be NULL
+ *  for the defaults.
+ * @return
+ *  TSS2_RC_SUCCESS or TSS2_TCTI_RC_BAD_VALUE on a malformed option.
+ */
+TSS2_RC tcti_latency_model_parse(tcti_latency_model *model, const char *opts);
+
+/**
+ * The modeled time for one command, in nanoseconds.
+ * @param model
+ *  The model.
+ * @param cc
+ *  The command code.
+ * @param cmd_size
+ *  The command size in bytes.
+ * @param rsp_size
+ *  The response size in bytes.
+ * @return
+ *  The modeled command time.
+ */
+uint64_t tcti_latency_model_ns(const tcti_latency_model *model, uint32_t cc,
+        size_t cmd_size, size_t rsp_size);
+
+/**
+ * Initializes a latency TCTI around an already initialized child. This is
+ * what the loader entry point uses after loading the child, and lets tests
+ * supply their own. The child is not finalized with the latency TCTI.
+ * @param ctx
+ *  The context to initialize, or NULL to query the size.
+ * @param size
+ *  The context size.
+ * @param opts
+ *  The options, see tcti_latency_model_parse().
+ * @param child
+ *  The TCTI to forward to.
+ * @return
+ *  TSS2_RC_SUCCESS on success.
+ */
+TSS2_RC tcti_latency_init_child(TSS2_TCTI_CONTEXT *ctx, size_t *size,
+        const char *opts, TSS2_TCTI_CONTEXT *child);
+
+/**
+ * The TCTI init function, see TSS2_TCTI_INIT_FUNC.
+ */
+TSS2_RC Tss2_Tcti_Latency_Init(TSS2_TCTI_CONTEXT *ctx, size_t *size,
+        const char *conf);
+
+#endif /* TEST_TCTI_LATENCY_H_ */
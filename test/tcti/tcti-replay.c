@@ -0,0 +1,398 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <tss2/tss2_tctildr.h>
+
+#include "tcti-recording.h"
+
+#define TCTI_REPLAY_MAGIC 0x5265706c61797321ULL
+#define TCTI_REPLAY_VERSION 2
+
+#define CURSORS_MAX 64
+
+typedef struct cc_cursor cc_cursor;
+struct cc_cursor {
+    uint32_t cc;
+    size_t pos;
+};
+
+typedef struct tcti_replay tcti_replay;
+struct tcti_replay {
+    TSS2_TCTI_CONTEXT_COMMON_V2 common;
+    TSS2_TCTI_CONTEXT *child;
+    bool owns_child;
+    recording rec;
+    double scale;
+    bool pending;
+    struct timespec sent;
+    uint64_t duration_ns;
+    /* serving: the next entry and the one in flight */
+    size_t next;
+    const recording_entry *current;
+    /* timing a child: where each command code is up to */
+    size_t cursors_len;
+    cc_cursor cursors[CURSORS_MAX];
+};
+
+static tcti_replay *to_replay(TSS2_TCTI_CONTEXT *ctx) {
+
+    if (!ctx) {
+        return NULL;
+    }
+
+    tcti_replay *t = (tcti_replay *)ctx;
+    return TSS2_TCTI_MAGIC(ctx) == TCTI_REPLAY_MAGIC ? t : NULL;
+}
+
+static void timespec_add_ns(struct timespec *ts, uint64_t ns) {
+
+    ns += ts->tv_nsec;
+    ts->tv_sec += ns / 1000000000ULL;
+    ts->tv_nsec = ns % 1000000000ULL;
+}
+
+static int64_t remaining_ns(const struct timespec *deadline) {
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (int64_t)(deadline->tv_sec - now.tv_sec) * 1000000000LL
+            + deadline->tv_nsec - now.tv_nsec;
+}
+
+static void sleep_until(const struct timespec *deadline) {
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL)
+            == EINTR) {
+        /* keep waiting */
+    }
+}
+
+/*
+ * The recorded TPM time of the next command with this code, cycling
+ * through the recording so a long run keeps the recorded distribution.
+ */
+static uint64_t recorded_ns(tcti_replay *t, uint32_t cc) {
+
+    cc_cursor *c = NULL;
+
+    size_t i;
+    for (i=0; i < t->cursors_len; i++) {
+        if (t->cursors[i].cc == cc) {
+            c = &t->cursors[i];
+            break;
+        }
+    }
+
+    if (!c) {
+        if (t->cursors_len == CURSORS_MAX) {
+            return 0;
+        }
+        c = &t->cursors[t->cursors_len++];
+        c->cc = cc;
+        c->pos = 0;
+    }
+
+    for (i=0; i < t->rec.len; i++) {
+        const recording_entry *e = &t->rec.entries[(c->pos + i) % t->rec.len];
+        if (e->cc == cc) {
+            c->pos = (c->pos + i + 1) % t->rec.len;
+            return e->received_ns - e->sent_ns;
+        }
+    }
+
+    return 0;
+}
+
+static TSS2_RC tcti_replay_transmit(TSS2_TCTI_CONTEXT *ctx, size_t size,
+        const uint8_t *command) {
+
+    tcti_replay *t = to_replay(ctx);
+    if (!t) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+
+    if (!command || size < 10) {
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+
+    if (t->pending) {
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    }
+
+    uint32_t cc = recording_cc(command);
+    uint64_t ns;
+
+    if (t->child) {
+        TSS2_RC rc = Tss2_Tcti_Transmit(t->child, size, command);
+        if (rc != TSS2_RC_SUCCESS) {
+            return rc;
+        }
+        ns = recorded_ns(t, cc);
+    } else {
+        if (t->next >= t->rec.len) {
+            fprintf(stderr, "tcti-replay: recording exhausted after %zu "
+                    "commands\n", t->rec.len);
+            return TSS2_TCTI_RC_BAD_SEQUENCE;
+        }
+
+        const recording_entry *e = &t->rec.entries[t->next];
+        if (e->cc != cc) {
+            fprintf(stderr, "tcti-replay: command %zu is 0x%x, recorded "
+                    "0x%x\n", t->next, cc, e->cc);
+            return TSS2_TCTI_RC_BAD_SEQUENCE;
+        }
+
+        t->next++;
+        t->current = e;
+        ns = e->received_ns - e->sent_ns;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t->sent);
+    t->duration_ns = (uint64_t)(ns * t->scale);
+    t->pending = true;
+
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC tcti_replay_receive(TSS2_TCTI_CONTEXT *ctx, size_t *size,
+        uint8_t *response, int32_t timeout) {
+
+    tcti_replay *t = to_replay(ctx);
+    if (!t) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+
+    if (!size) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+
+    if (!t->pending) {
+        return TSS2_TCTI_RC_BAD_SEQUENCE;
+    }
+
+    if (t->child) {
+        TSS2_RC rc = Tss2_Tcti_Receive(t->child, size, response, timeout);
+        if (rc != TSS2_RC_SUCCESS || !response) {
+            return rc;
+        }
+    } else {
+        const recording_entry *e = t->current;
+        if (!response) {
+            *size = e->rsp_len;
+            return TSS2_RC_SUCCESS;
+        }
+
+        if (*size < e->rsp_len) {
+            *size = e->rsp_len;
+            return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+        }
+
+        struct timespec deadline = t->sent;
+        timespec_add_ns(&deadline, t->duration_ns);
+
+        /* a TPM that is not done yet tells a polling caller to come back */
+        if (timeout != TSS2_TCTI_TIMEOUT_BLOCK
+                && remaining_ns(&deadline) > (int64_t)timeout * 1000000) {
+            struct timespec wait = { 0 };
+            clock_gettime(CLOCK_MONOTONIC, &wait);
+            timespec_add_ns(&wait, (uint64_t)timeout * 1000000);
+            sleep_until(&wait);
+            return TSS2_TCTI_RC_TRY_AGAIN;
+        }
+
+        memcpy(response, e->rsp, e->rsp_len);
+        *size = e->rsp_len;
+    }
+
+    t->pending = false;
+
+    struct timespec deadline = t->sent;
+    timespec_add_ns(&deadline, t->duration_ns);
+    sleep_until(&deadline);
+
+    return TSS2_RC_SUCCESS;
+}
+
+static void tcti_replay_finalize(TSS2_TCTI_CONTEXT *ctx) {
+
+    tcti_replay *t = to_replay(ctx);
+    if (!t) {
+        return;
+    }
+
+    if (t->owns_child) {
+        Tss2_TctiLdr_Finalize(&t->child);
+    }
+
+    recording_free(&t->rec);
+
+    TSS2_TCTI_MAGIC(ctx) = 0;
+}
+
+static TSS2_RC tcti_replay_cancel(TSS2_TCTI_CONTEXT *ctx) {
+
+    tcti_replay *t = to_replay(ctx);
+    if (!t) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+
+    t->pending = false;
+    return t->child ? Tss2_Tcti_Cancel(t->child) : TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC tcti_replay_get_poll_handles(TSS2_TCTI_CONTEXT *ctx,
+        TSS2_TCTI_POLL_HANDLE *handles, size_t *num_handles) {
+
+    tcti_replay *t = to_replay(ctx);
+    if (!t) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+
+    if (t->child) {
+        return Tss2_Tcti_GetPollHandles(t->child, handles, num_handles);
+    }
+
+    if (!num_handles) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+
+    *num_handles = 0;
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC tcti_replay_set_locality(TSS2_TCTI_CONTEXT *ctx,
+        uint8_t locality) {
+
+    tcti_replay *t = to_replay(ctx);
+    if (!t) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+
+    return t->child ? Tss2_Tcti_SetLocality(t->child, locality) :
+            TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC tcti_replay_make_sticky(TSS2_TCTI_CONTEXT *ctx,
+        TPM2_HANDLE *handle, uint8_t sticky) {
+
+    tcti_replay *t = to_replay(ctx);
+    if (!t) {
+        return TSS2_TCTI_RC_BAD_CONTEXT;
+    }
+
+    return t->child ? Tss2_Tcti_MakeSticky(t->child, handle, sticky) :
+            TSS2_TCTI_RC_NOT_IMPLEMENTED;
+}
+
+static TSS2_RC parse_opts(tcti_replay *t, const char *opts) {
+
+    t->scale = 1.0;
+
+    char *scale = recording_opt(opts, "scale");
+    if (scale) {
+        char *end = NULL;
+        t->scale = strtod(scale, &end);
+        bool bad = !*scale || *end || t->scale < 0;
+        free(scale);
+        if (bad) {
+            fprintf(stderr, "tcti-replay: bad scale\n");
+            return TSS2_TCTI_RC_BAD_VALUE;
+        }
+    }
+
+    char *file = recording_opt(opts, "file");
+    if (!file) {
+        fprintf(stderr, "tcti-replay: file=<path> is required\n");
+        return TSS2_TCTI_RC_BAD_VALUE;
+    }
+
+    TSS2_RC rc = recording_load(file, &t->rec);
+    free(file);
+
+    return rc;
+}
+
+TSS2_RC tcti_replay_init_child(TSS2_TCTI_CONTEXT *ctx, size_t *size,
+        const char *opts, TSS2_TCTI_CONTEXT *child) {
+
+    if (!size) {
+        return TSS2_TCTI_RC_BAD_REFERENCE;
+    }
+
+    if (!ctx) {
+        *size = sizeof(tcti_replay);
+        return TSS2_RC_SUCCESS;
+    }
+
+    if (*size < sizeof(tcti_replay)) {
+        return TSS2_TCTI_RC_INSUFFICIENT_BUFFER;
+    }
+
+    tcti_replay *t = (tcti_replay *)ctx;
+    memset(t, 0, sizeof(*t));
+
+    TSS2_RC rc = parse_opts(t, opts);
+    if (rc != TSS2_RC_SUCCESS) {
+        return rc;
+    }
+
+    t->child = child;
+
+    TSS2_TCTI_MAGIC(ctx) = TCTI_REPLAY_MAGIC;
+    TSS2_TCTI_VERSION(ctx) = TCTI_REPLAY_VERSION;
+    TSS2_TCTI_TRANSMIT(ctx) = tcti_replay_transmit;
+    TSS2_TCTI_RECEIVE(ctx) = tcti_replay_receive;
+    TSS2_TCTI_FINALIZE(ctx) = tcti_replay_finalize;
+    TSS2_TCTI_CANCEL(ctx) = tcti_replay_cancel;
+    TSS2_TCTI_GET_POLL_HANDLES(ctx) = tcti_replay_get_poll_handles;
+    TSS2_TCTI_SET_LOCALITY(ctx) = tcti_replay_set_locality;
+    TSS2_TCTI_MAKE_STICKY(ctx) = tcti_replay_make_sticky;
+
+    return TSS2_RC_SUCCESS;
+}
+
+static TSS2_RC Tss2_Tcti_Replay_Init(TSS2_TCTI_CONTEXT *ctx, size_t *size,
+        const char *conf) {
+
+    const char *child_conf = conf ? strchr(conf, ';') : NULL;
+    if (!ctx || !child_conf) {
+        return tcti_replay_init_child(ctx, size, conf, NULL);
+    }
+
+    TSS2_TCTI_CONTEXT *child = NULL;
+    TSS2_RC rc = Tss2_TctiLdr_Initialize(child_conf[1] ? &child_conf[1] : NULL,
+            &child);
+    if (rc != TSS2_RC_SUCCESS) {
+        fprintf(stderr, "tcti-replay: could not load child TCTI \"%s\"\n",
+                child_conf[1] ? &child_conf[1] : "(default)");
+        return rc;
+    }
+
+    rc = tcti_replay_init_child(ctx, size, conf, child);
+    if (rc != TSS2_RC_SUCCESS) {
+        Tss2_TctiLdr_Finalize(&child);
+        return rc;
+    }
+
+    ((tcti_replay *)ctx)->owns_child = true;
+
+    return TSS2_RC_SUCCESS;
+}
+
+static const TSS2_TCTI_INFO _info = {
+    .version = TCTI_REPLAY_VERSION,
+    .name = "tcti-replay",
+    .description = "Serves the responses of a tcti-record recording, or "
+                   "replays its timings on a child TCTI.",
+    .config_help = "file=PATH[,scale=F][;CHILD-TCTI]",
+    .init = Tss2_Tcti_Replay_Init,
+};
+
+const TSS2_TCTI_INFO *Tss2_Tcti_Info(void) {
+    return &_info;
+}
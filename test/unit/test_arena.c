@@ -0,0 +1,428 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <cmocka.h>
+
+#include "arena.h"
+#include "attrs.h"
+#include "encrypt.h"
+#include "mech.h"
+#include "object.h"
+#include "session_ctx.h"
+#include "sign.h"
+#include "token.h"
+#include "tpm.h"
+
+#define SIG_LEN 64
+#define LOOPS 1000
+
+/*
+ * Only calls made from the library are seen, allocations OpenSSL makes
+ * internally, like the EVP_MD_CTX of a fresh digest, are not counted.
+ */
+static bool _count_allocs;
+static unsigned _alloc_cnt;
+static unsigned _free_cnt;
+
+void *__real_calloc(size_t nmemb, size_t size);
+void *__wrap_calloc(size_t nmemb, size_t size) {
+
+    if (_count_allocs) {
+        _alloc_cnt++;
+    }
+
+    return __real_calloc(nmemb, size);
+}
+
+void *__real_malloc(size_t size);
+void *__wrap_malloc(size_t size) {
+
+    if (_count_allocs) {
+        _alloc_cnt++;
+    }
+
+    return __real_malloc(size);
+}
+
+void *__real_realloc(void *ptr, size_t size);
+void *__wrap_realloc(void *ptr, size_t size) {
+
+    if (_count_allocs) {
+        _alloc_cnt++;
+    }
+
+    return __real_realloc(ptr, size);
+}
+
+void __real_free(void *ptr);
+void __wrap_free(void *ptr) {
+
+    if (_count_allocs && ptr) {
+        _free_cnt++;
+    }
+
+    __real_free(ptr);
+}
+
+static void start_counting(void) {
+    _alloc_cnt = _free_cnt = 0;
+    _count_allocs = true;
+}
+
+static void stop_counting(void) {
+    _count_allocs = false;
+}
+
+/*
+ * A TPM that does ECDSA with SHA256 and hands out fixed signatures, and a
+ * key that is always loaded.
+ */
+static tobject _tobj;
+
+CK_RV __wrap_tpm2_getmechanisms(tpm_ctx *ctx, CK_MECHANISM_TYPE *mechanism_list, CK_ULONG_PTR count) {
+    (void) ctx;
+
+    assert_true(*count >= 1);
+    mechanism_list[0] = CKM_ECDSA_SHA256;
+    *count = 1;
+
+    return CKR_OK;
+}
+
+CK_RV __wrap_tpm_is_rsa_keysize_supported(tpm_ctx *tctx, CK_ULONG test_size) {
+    (void) tctx;
+    (void) test_size;
+
+    return CKR_MECHANISM_INVALID;
+}
+
+CK_RV __wrap_tpm_is_ecc_curve_supported(tpm_ctx *tctx, int nid) {
+    (void) tctx;
+    (void) nid;
+
+    return CKR_MECHANISM_INVALID;
+}
+
+CK_RV __wrap_token_load_object(token *tok, CK_OBJECT_HANDLE key, tobject **loaded_tobj) {
+    (void) tok;
+    (void) key;
+
+    _tobj.active++;
+    *loaded_tobj = &_tobj;
+
+    return CKR_OK;
+}
+
+CK_RV __wrap_ssl_util_attrs_to_evp(attr_list *attrs, EVP_PKEY **outpkey) {
+    (void) attrs;
+
+    *outpkey = NULL;
+
+    return CKR_OK;
+}
+
+CK_RV __wrap_tobject_get_min_buf_size(tobject *tobj, CK_MECHANISM_PTR mech, size_t *maxsize) {
+    (void) tobj;
+    (void) mech;
+
+    *maxsize = SIG_LEN;
+
+    return CKR_OK;
+}
+
+CK_RV __wrap_tpm_sign(tpm_op_data *opdata, CK_BYTE_PTR data, CK_ULONG datalen, CK_BYTE_PTR sig, CK_ULONG_PTR siglen) {
+    (void) opdata;
+    (void) data;
+    (void) datalen;
+
+    assert_true(*siglen >= SIG_LEN);
+    memset(sig, 0x5A, SIG_LEN);
+    *siglen = SIG_LEN;
+
+    return CKR_OK;
+}
+
+typedef struct test_state test_state;
+struct test_state {
+    token tok;
+    session_ctx *ctx;
+};
+
+static int sign_setup(void **state) {
+
+    test_state *s = calloc(1, sizeof(*s));
+    assert_non_null(s);
+
+    /* never used, the TPM calls are wrapped */
+    s->tok.tctx = (tpm_ctx *)s;
+
+    CK_RV rv = mdetail_new(s->tok.tctx, &s->tok.mdtl, pss_config_state_unk);
+    assert_int_equal(rv, CKR_OK);
+
+    rv = session_ctx_new(&s->ctx, &s->tok, CKF_SERIAL_SESSION);
+    assert_int_equal(rv, CKR_OK);
+
+    memset(&_tobj, 0, sizeof(_tobj));
+    _tobj.attrs = attr_list_new();
+    assert_non_null(_tobj.attrs);
+
+    CK_MECHANISM_TYPE allowed[] = { CKM_ECDSA_SHA256 };
+    bool r = attr_list_add_int(_tobj.attrs, CKA_CLASS, CKO_PRIVATE_KEY);
+    assert_true(r);
+    r = attr_list_add_int(_tobj.attrs, CKA_KEY_TYPE, CKK_EC);
+    assert_true(r);
+    r = attr_list_add_int_seq(_tobj.attrs, CKA_ALLOWED_MECHANISMS,
+            (CK_BYTE_PTR)allowed, sizeof(allowed));
+    assert_true(r);
+
+    *state = s;
+    return 0;
+}
+
+static int sign_teardown(void **state) {
+
+    test_state *s = (test_state *)*state;
+
+    session_ctx_free(s->ctx);
+    mdetail_free(&s->tok.mdtl);
+    attr_list_free(_tobj.attrs);
+    free(s);
+
+    return 0;
+}
+
+static void sign_once(session_ctx *ctx) {
+
+    CK_MECHANISM mech = { CKM_ECDSA_SHA256, NULL, 0 };
+    CK_RV rv = sign_init(ctx, &mech, 1);
+    assert_int_equal(rv, CKR_OK);
+
+    CK_BYTE data[32] = { 0 };
+    CK_BYTE sig[SIG_LEN];
+    CK_ULONG siglen = sizeof(sig);
+    rv = sign(ctx, data, sizeof(data), sig, &siglen);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(siglen, SIG_LEN);
+}
+
+/*
+ * Once warm, a sign makes no heap calls of its own. Only the library's
+ * malloc, calloc, realloc and free are counted, what OpenSSL allocates
+ * per operation, like the EVP_MD_CTX of each digest, is not.
+ */
+static void test_sign_steady_state_no_library_heap(void **state) {
+
+    test_state *s = (test_state *)*state;
+    arena *a = session_ctx_get_arena(s->ctx);
+
+    sign_once(s->ctx);
+
+    start_counting();
+
+    unsigned i;
+    for (i=0; i < LOOPS; i++) {
+        sign_once(s->ctx);
+    }
+
+    stop_counting();
+
+    assert_int_equal(_alloc_cnt, 0);
+    assert_int_equal(_free_cnt, 0);
+    assert_int_equal(arena_used(a), 0);
+    assert_int_equal(_tobj.active, 0);
+}
+
+/* As above, for a message sign, whose state lives in the session arena */
+static void test_message_sign_steady_state_no_library_heap(void **state) {
+
+    test_state *s = (test_state *)*state;
+    arena *a = session_ctx_get_arena(s->ctx);
+
+    CK_MECHANISM mech = { CKM_ECDSA_SHA256, NULL, 0 };
+    CK_RV rv = message_sign_init(s->ctx, &mech, 1);
+    assert_int_equal(rv, CKR_OK);
+
+    size_t used = arena_used(a);
+    assert_true(used > 0);
+
+    CK_BYTE data[32] = { 0 };
+    CK_BYTE sig[SIG_LEN];
+
+    start_counting();
+
+    unsigned i;
+    for (i=0; i < LOOPS; i++) {
+        CK_ULONG siglen = sizeof(sig);
+        rv = sign_message(s->ctx, NULL, 0, data, sizeof(data), sig, &siglen);
+        assert_int_equal(rv, CKR_OK);
+
+        rv = sign_message_begin(s->ctx, NULL, 0);
+        assert_int_equal(rv, CKR_OK);
+        rv = sign_message_next(s->ctx, NULL, 0, data, sizeof(data), NULL, NULL);
+        assert_int_equal(rv, CKR_OK);
+        siglen = sizeof(sig);
+        rv = sign_message_next(s->ctx, NULL, 0, NULL, 0, sig, &siglen);
+        assert_int_equal(rv, CKR_OK);
+    }
+
+    stop_counting();
+
+    assert_int_equal(_alloc_cnt, 0);
+    assert_int_equal(_free_cnt, 0);
+
+    /* messages don't grow the arena, only the operation holds space */
+    assert_int_equal(arena_used(a), used);
+
+    rv = message_sign_final(s->ctx);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(arena_used(a), 0);
+    assert_int_equal(_tobj.active, 0);
+}
+
+static int arena_setup(void **state) {
+
+    arena *a = arena_new(ARENA_DEFAULT_SIZE);
+    assert_non_null(a);
+    *state = a;
+    return 0;
+}
+
+static int arena_teardown(void **state) {
+
+    arena_free((arena *)*state);
+    return 0;
+}
+
+static void test_arena_cleansed_on_reuse(void **state) {
+
+    arena *a = (arena *)*state;
+
+    unsigned char *first = arena_calloc(a, 1, 64);
+    assert_non_null(first);
+    memset(first, 0xAA, 64);
+    arena_release(first);
+
+    unsigned char *second = arena_calloc(a, 1, 64);
+    assert_ptr_equal(first, second);
+
+    unsigned char zeros[64] = { 0 };
+    assert_memory_equal(second, zeros, sizeof(zeros));
+
+    arena_release(second);
+}
+
+static void test_arena_rewinds_on_last_release(void **state) {
+
+    arena *a = (arena *)*state;
+
+    void *x = arena_calloc(a, 1, 16);
+    void *y = arena_calloc(a, 1, 16);
+    assert_non_null(x);
+    assert_non_null(y);
+
+    size_t used = arena_used(a);
+    assert_true(used >= 32);
+
+    /* x is below y, so it waits for y */
+    arena_release(x);
+    assert_int_equal(arena_used(a), used);
+
+    arena_release(y);
+    assert_int_equal(arena_used(a), 0);
+}
+
+static void test_arena_reclaims_last_allocation(void **state) {
+
+    arena *a = (arena *)*state;
+
+    void *x = arena_calloc(a, 1, 16);
+    assert_non_null(x);
+    size_t used = arena_used(a);
+
+    /* freeing and allocating in turn keeps reusing the same space */
+    unsigned i;
+    for (i=0; i < LOOPS; i++) {
+        unsigned char *y = arena_calloc(a, 1, 64);
+        assert_non_null(y);
+        assert_true(arena_used(a) > used);
+        memset(y, 0xAA, 64);
+        arena_release(y);
+        assert_int_equal(arena_used(a), used);
+    }
+
+    unsigned char *y = arena_calloc(a, 1, 64);
+    unsigned char zeros[64] = { 0 };
+    assert_memory_equal(y, zeros, sizeof(zeros));
+    arena_release(y);
+
+    arena_release(x);
+    assert_int_equal(arena_used(a), 0);
+}
+
+static void test_arena_exhausted_uses_heap(void **state) {
+    (void) state;
+
+    arena *a = arena_new(64);
+    assert_non_null(a);
+
+    start_counting();
+
+    void *big = arena_calloc(a, 1, 256);
+    assert_non_null(big);
+    assert_int_equal(arena_used(a), 0);
+
+    arena_release(big);
+
+    stop_counting();
+
+    assert_int_equal(_alloc_cnt, 1);
+    assert_int_equal(_free_cnt, 1);
+
+    arena_free(a);
+}
+
+static void test_arena_null_uses_heap(void **state) {
+    (void) state;
+
+    start_counting();
+
+    encrypt_op_data *opdata = encrypt_op_data_new(NULL);
+    assert_non_null(opdata);
+    arena_release(opdata);
+
+    stop_counting();
+
+    assert_int_equal(_alloc_cnt, 1);
+    assert_int_equal(_free_cnt, 1);
+
+    /* releasing NULL is a no-op */
+    arena_release(NULL);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_sign_steady_state_no_library_heap,
+                sign_setup, sign_teardown),
+        cmocka_unit_test_setup_teardown(test_message_sign_steady_state_no_library_heap,
+                sign_setup, sign_teardown),
+        cmocka_unit_test_setup_teardown(test_arena_cleansed_on_reuse,
+                arena_setup, arena_teardown),
+        cmocka_unit_test_setup_teardown(test_arena_rewinds_on_last_release,
+                arena_setup, arena_teardown),
+        cmocka_unit_test_setup_teardown(test_arena_reclaims_last_allocation,
+                arena_setup, arena_teardown),
+        cmocka_unit_test(test_arena_exhausted_uses_heap),
+        cmocka_unit_test(test_arena_null_uses_heap),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
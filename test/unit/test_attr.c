@@ -12,6 +12,19 @@
 #include <cmocka.h>
 
 #include "attrs.h"
+#include "typed_memory.h"
+
+static bool _fail_calloc;
+
+void *__real_calloc(size_t nmemb, size_t size);
+void *__wrap_calloc(size_t nmemb, size_t size) {
+
+    if (_fail_calloc) {
+        return NULL;
+    }
+
+    return __real_calloc(nmemb, size);
+}
 
 static void test_config_parser_empty_seq(void **state) {
     (void) state;
@@ -57,12 +70,395 @@ static void test_config_parser_empty_seq(void **state) {
     attr_list_free(attrs);
 }
 
+static void test_attr_list_compact(void **state) {
+    (void) state;
+
+    attr_list *attrs = attr_list_new();
+    assert_non_null(attrs);
+
+    bool r = attr_list_add_int(attrs, CKA_CLASS, CKO_PRIVATE_KEY);
+    assert_true(r);
+
+    r = attr_list_add_buf(attrs, CKA_LABEL, (CK_BYTE_PTR)"odd", 3);
+    assert_true(r);
+
+    r = attr_list_add_buf(attrs, CKA_ID, NULL, 0);
+    assert_true(r);
+
+    r = attr_list_add_bool(attrs, CKA_SIGN, CK_TRUE);
+    assert_true(r);
+
+    r = attr_list_compact(attrs);
+    assert_true(r);
+    assert_int_equal(attr_list_get_count(attrs), 4);
+
+    /* values survive the move */
+    CK_OBJECT_CLASS got_class = CKO_DATA;
+    CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(attrs, CKA_CLASS);
+    assert_non_null(a);
+    CK_RV rv = attr_CK_OBJECT_CLASS(a, &got_class);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(got_class, CKO_PRIVATE_KEY);
+
+    a = attr_get_attribute_by_type(attrs, CKA_LABEL);
+    assert_non_null(a);
+    assert_int_equal(a->ulValueLen, 3);
+    assert_memory_equal(a->pValue, "odd", 3);
+
+    a = attr_get_attribute_by_type(attrs, CKA_ID);
+    assert_non_null(a);
+    assert_null(a->pValue);
+    assert_int_equal(a->ulValueLen, 0);
+
+    CK_BBOOL got_bool = CK_FALSE;
+    a = attr_get_attribute_by_type(attrs, CKA_SIGN);
+    assert_non_null(a);
+    rv = attr_CK_BBOOL(a, &got_bool);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(got_bool, CK_TRUE);
+
+    /* duplicates of packed lists are independent */
+    attr_list *dup = NULL;
+    rv = attr_list_dup(attrs, &dup);
+    assert_int_equal(rv, CKR_OK);
+
+    /* modifications work on a packed list, and don't move its entries */
+    CK_ATTRIBUTE_PTR held = attr_get_attribute_by_type(attrs, CKA_LABEL);
+    assert_non_null(held);
+
+    CK_ATTRIBUTE label = {
+        .type = CKA_LABEL,
+        .pValue = "longer label",
+        .ulValueLen = 12
+    };
+    rv = attr_list_update_entry(attrs, &label);
+    assert_int_equal(rv, CKR_OK);
+
+    assert_ptr_equal(held, attr_get_attribute_by_type(attrs, CKA_LABEL));
+    assert_int_equal(held->ulValueLen, 12);
+    assert_memory_equal(held->pValue, "longer label", 12);
+
+    r = attr_list_add_bool(attrs, CKA_VERIFY, CK_FALSE);
+    assert_true(r);
+    assert_int_equal(attr_list_get_count(attrs), 5);
+
+    a = attr_get_attribute_by_type(attrs, CKA_LABEL);
+    assert_non_null(a);
+    assert_int_equal(a->ulValueLen, 12);
+    assert_memory_equal(a->pValue, "longer label", 12);
+
+    a = attr_get_attribute_by_type(dup, CKA_LABEL);
+    assert_non_null(a);
+    assert_int_equal(a->ulValueLen, 3);
+    assert_memory_equal(a->pValue, "odd", 3);
+
+    /* cleansing an entry of a packed list leaves the rest intact */
+    r = attr_list_compact(dup);
+    assert_true(r);
+
+    a = attr_get_attribute_by_type(dup, CKA_LABEL);
+    attr_list_cleanse_entry(dup, a);
+    assert_null(a->pValue);
+    assert_int_equal(a->ulValueLen, 0);
+
+    a = attr_get_attribute_by_type(dup, CKA_CLASS);
+    rv = attr_CK_OBJECT_CLASS(a, &got_class);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(got_class, CKO_PRIVATE_KEY);
+
+    attr_list_free(dup);
+    attr_list_free(attrs);
+}
+
+static void test_attr_list_update_entry_oom(void **state) {
+    (void) state;
+
+    attr_list *attrs = attr_list_new();
+    assert_non_null(attrs);
+
+    bool r = attr_list_add_buf(attrs, CKA_LABEL, (CK_BYTE_PTR)"odd", 3);
+    assert_true(r);
+
+    r = attr_list_compact(attrs);
+    assert_true(r);
+
+    CK_ATTRIBUTE label = {
+        .type = CKA_LABEL,
+        .pValue = "longer label",
+        .ulValueLen = 12
+    };
+
+    /* a value in the block that can't be replaced is kept */
+    _fail_calloc = true;
+    CK_RV rv = attr_list_update_entry(attrs, &label);
+    _fail_calloc = false;
+    assert_int_equal(rv, CKR_HOST_MEMORY);
+
+    CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(attrs, CKA_LABEL);
+    assert_non_null(a);
+    assert_int_equal(a->ulValueLen, 3);
+    assert_memory_equal(a->pValue, "odd", 3);
+
+    rv = attr_list_update_entry(attrs, &label);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(a->ulValueLen, 12);
+    assert_memory_equal(a->pValue, "longer label", 12);
+
+    attr_list_free(attrs);
+}
+
+static void test_attr_list_twist_views(void **state) {
+    (void) state;
+
+    attr_list *attrs = attr_list_new();
+    assert_non_null(attrs);
+
+    bool r = attr_list_add_buf(attrs, CKA_TPM2_PUB_BLOB, (CK_BYTE_PTR)"pub", 3);
+    assert_true(r);
+
+    r = attr_list_add_buf(attrs, CKA_LABEL, (CK_BYTE_PTR)"odd", 3);
+    assert_true(r);
+
+    /* only compacted lists have views */
+    assert_null(attr_list_get_twist(attrs, CKA_TPM2_PUB_BLOB));
+
+    r = attr_list_compact(attrs);
+    assert_true(r);
+
+    twist pub = attr_list_get_twist(attrs, CKA_TPM2_PUB_BLOB);
+    assert_non_null(pub);
+    assert_int_equal(twist_len(pub), 3);
+    assert_memory_equal(pub, "pub", 3);
+
+    /* and only for the TPM blobs and the wrapped auth */
+    assert_null(attr_list_get_twist(attrs, CKA_LABEL));
+    assert_null(attr_list_get_twist(attrs, CKA_TPM2_PRIV_BLOB));
+
+    /* changing and adding others leaves the view and the entry alone */
+    CK_ATTRIBUTE_PTR held = attr_get_attribute_by_type(attrs, CKA_TPM2_PUB_BLOB);
+    CK_ATTRIBUTE label = {
+        .type = CKA_LABEL,
+        .pValue = "longer label",
+        .ulValueLen = 12
+    };
+    CK_RV rv = attr_list_update_entry(attrs, &label);
+    assert_int_equal(rv, CKR_OK);
+    assert_ptr_equal(held, attr_get_attribute_by_type(attrs, CKA_TPM2_PUB_BLOB));
+
+    unsigned i;
+    for (i=0; i < 20; i++) {
+        r = attr_list_add_int(attrs, CKA_VENDOR_DEFINED + i, i);
+        assert_true(r);
+    }
+
+    assert_ptr_equal(pub, attr_list_get_twist(attrs, CKA_TPM2_PUB_BLOB));
+    assert_int_equal(twist_len(pub), 3);
+    assert_memory_equal(pub, "pub", 3);
+
+    twist copy = twist_dup(pub);
+    assert_non_null(copy);
+    assert_int_equal(twist_len(copy), 3);
+    assert_string_equal(copy, "pub");
+    twist_free(copy);
+
+    /* compacting again repacks the moved values */
+    r = attr_list_compact(attrs);
+    assert_true(r);
+
+    CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(attrs, CKA_LABEL);
+    assert_non_null(a);
+    assert_int_equal(a->ulValueLen, 12);
+    assert_memory_equal(a->pValue, "longer label", 12);
+
+    pub = attr_list_get_twist(attrs, CKA_TPM2_PUB_BLOB);
+    assert_non_null(pub);
+    assert_memory_equal(pub, "pub", 3);
+
+    attr_list_free(attrs);
+}
+
+static void test_attr_list_new_mapped(void **state) {
+    (void) state;
+
+    /* values laid out the way a snapshot maps them, each with its type byte */
+    union {
+        CK_ULONG align;
+        CK_BYTE b[3 * sizeof(CK_ULONG)];
+    } mapping = { 0 };
+
+    CK_OBJECT_CLASS clazz = CKO_PRIVATE_KEY;
+    memcpy(mapping.b, &clazz, sizeof(clazz));
+    mapping.b[sizeof(clazz)] = TYPE_BYTE_INT;
+    memcpy(&mapping.b[2 * sizeof(CK_ULONG)], "odd", 3);
+    mapping.b[2 * sizeof(CK_ULONG) + 3] = TYPE_BYTE_HEX_STR;
+
+    CK_BYTE before[sizeof(mapping.b)];
+    memcpy(before, mapping.b, sizeof(before));
+
+    CK_ATTRIBUTE_PTR a = calloc(3, sizeof(*a));
+    assert_non_null(a);
+    a[0].type = CKA_CLASS;
+    a[0].pValue = mapping.b;
+    a[0].ulValueLen = sizeof(clazz);
+    a[1].type = CKA_LABEL;
+    a[1].pValue = &mapping.b[2 * sizeof(CK_ULONG)];
+    a[1].ulValueLen = 3;
+    a[2].type = CKA_ID;
+
+    attr_list *attrs = attr_list_new_mapped(a, 3);
+    assert_non_null(attrs);
+    assert_int_equal(attr_list_get_count(attrs), 3);
+
+    /* reads come straight from the mapping */
+    CK_ATTRIBUTE_PTR got = attr_get_attribute_by_type(attrs, CKA_CLASS);
+    assert_non_null(got);
+    assert_true(got->pValue == mapping.b);
+    CK_OBJECT_CLASS got_class = CKO_DATA;
+    CK_RV rv = attr_CK_OBJECT_CLASS(got, &got_class);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(got_class, CKO_PRIVATE_KEY);
+
+    /* duplicates own their values */
+    attr_list *dup = NULL;
+    rv = attr_list_dup(attrs, &dup);
+    assert_int_equal(rv, CKR_OK);
+    got = attr_get_attribute_by_type(dup, CKA_LABEL);
+    assert_non_null(got);
+    assert_true(got->pValue != &mapping.b[2 * sizeof(CK_ULONG)]);
+    assert_memory_equal(got->pValue, "odd", 3);
+
+    /* a changed value gets storage of its own, the mapping is never written */
+    CK_ATTRIBUTE label = {
+        .type = CKA_LABEL,
+        .pValue = "longer label",
+        .ulValueLen = 12
+    };
+    rv = attr_list_update_entry(attrs, &label);
+    assert_int_equal(rv, CKR_OK);
+
+    got = attr_get_attribute_by_type(attrs, CKA_LABEL);
+    assert_non_null(got);
+    assert_int_equal(got->ulValueLen, 12);
+    assert_memory_equal(got->pValue, "longer label", 12);
+
+    /* the others stay on the mapping */
+    got = attr_get_attribute_by_type(attrs, CKA_CLASS);
+    assert_non_null(got);
+    assert_true(got->pValue == mapping.b);
+
+    /* cleansing an entry on the mapping only drops it */
+    attr_list_cleanse_entry(attrs, got);
+    assert_null(got->pValue);
+    assert_int_equal(got->ulValueLen, 0);
+    assert_memory_equal(mapping.b, before, sizeof(before));
+
+    attr_list_free(dup);
+    attr_list_free(attrs);
+
+    /* freeing a list still on the mapping leaves the values */
+    a = calloc(1, sizeof(*a));
+    assert_non_null(a);
+    a[0].type = CKA_CLASS;
+    a[0].pValue = mapping.b;
+    a[0].ulValueLen = sizeof(clazz);
+
+    attrs = attr_list_new_mapped(a, 1);
+    assert_non_null(attrs);
+    attr_list_free(attrs);
+    assert_memory_equal(mapping.b, before, sizeof(before));
+}
+
+static void test_attr_list_diff(void **state) {
+    (void) state;
+
+    attr_list *old = attr_list_new();
+    assert_non_null(old);
+
+    bool r = attr_list_add_int(old, CKA_CLASS, CKO_DATA);
+    assert_true(r);
+    r = attr_list_add_buf(old, CKA_LABEL, (CK_BYTE_PTR)"odd", 3);
+    assert_true(r);
+    r = attr_list_add_lazy(old, CKA_VALUE, 1024);
+    assert_true(r);
+
+    attr_list *new = NULL;
+    CK_RV rv = attr_list_dup(old, &new);
+    assert_int_equal(rv, CKR_OK);
+
+    /* nothing changed, values left in the store included */
+    attr_list *changed = NULL;
+    rv = attr_list_diff(old, new, &changed);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(attr_list_get_count(changed), 0);
+    attr_list_free(changed);
+
+    CK_ATTRIBUTE label = {
+        .type = CKA_LABEL,
+        .pValue = "longer label",
+        .ulValueLen = 12
+    };
+    rv = attr_list_update_entry(new, &label);
+    assert_int_equal(rv, CKR_OK);
+
+    CK_ATTRIBUTE id = {
+        .type = CKA_ID,
+        .pValue = "id",
+        .ulValueLen = 2
+    };
+    rv = attr_list_append_entry(&new, &id);
+    assert_int_equal(rv, CKR_OK);
+
+    /* only the updated and the new attribute */
+    rv = attr_list_diff(old, new, &changed);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(attr_list_get_count(changed), 2);
+
+    CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(changed, CKA_LABEL);
+    assert_non_null(a);
+    assert_int_equal(a->ulValueLen, 12);
+    assert_memory_equal(a->pValue, "longer label", 12);
+    assert_int_equal(type_from_ptr(a->pValue, a->ulValueLen), TYPE_BYTE_HEX_STR);
+
+    a = attr_get_attribute_by_type(changed, CKA_ID);
+    assert_non_null(a);
+    assert_memory_equal(a->pValue, "id", 2);
+
+    assert_null(attr_get_attribute_by_type(changed, CKA_VALUE));
+
+    /* applying the changes to the old list gives the new one */
+    rv = attr_list_merge(&old, changed);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(attr_list_get_count(old), 4);
+
+    attr_list *none = NULL;
+    rv = attr_list_diff(new, old, &none);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(attr_list_get_count(none), 0);
+    attr_list_free(none);
+
+    /* a changed value has to be resident to be written */
+    CK_ATTRIBUTE_PTR value = attr_get_attribute_by_type(new, CKA_VALUE);
+    assert_non_null(value);
+    value->ulValueLen = 2048;
+    rv = attr_list_diff(old, new, &none);
+    assert_int_equal(rv, CKR_GENERAL_ERROR);
+
+    attr_list_free(changed);
+    attr_list_free(new);
+    attr_list_free(old);
+}
+
 int main(int argc, char* argv[]) {
     (void) argc;
     (void) argv;
 
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_config_parser_empty_seq),
+        cmocka_unit_test(test_attr_list_compact),
+        cmocka_unit_test(test_attr_list_update_entry_oom),
+        cmocka_unit_test(test_attr_list_twist_views),
+        cmocka_unit_test(test_attr_list_new_mapped),
+        cmocka_unit_test(test_attr_list_diff),
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);
@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <cmocka.h>
+
+#include "attr_cache.h"
+
+static twist value_new(const char *s) {
+    twist t = twist_new(s);
+    assert_non_null(t);
+    return t;
+}
+
+static void test_attr_cache_get_put(void **state) {
+    (void) state;
+
+    attr_cache *c = attr_cache_new(4);
+    assert_non_null(c);
+
+    assert_null(attr_cache_get(c, 1, CKA_VALUE));
+
+    attr_cache_put(c, 1, CKA_VALUE, value_new("one"));
+    attr_cache_put(c, 1, CKA_ISSUER, value_new("issuer"));
+
+    twist got = attr_cache_get(c, 1, CKA_VALUE);
+    assert_non_null(got);
+    assert_string_equal(got, "one");
+
+    got = attr_cache_get(c, 1, CKA_ISSUER);
+    assert_non_null(got);
+    assert_string_equal(got, "issuer");
+
+    assert_null(attr_cache_get(c, 2, CKA_VALUE));
+
+    /* replacing a value keeps a single entry */
+    attr_cache_put(c, 1, CKA_VALUE, value_new("uno"));
+    got = attr_cache_get(c, 1, CKA_VALUE);
+    assert_non_null(got);
+    assert_string_equal(got, "uno");
+
+    attr_cache_free(c);
+}
+
+static void test_attr_cache_evicts_lru(void **state) {
+    (void) state;
+
+    attr_cache *c = attr_cache_new(2);
+    assert_non_null(c);
+
+    attr_cache_put(c, 1, CKA_VALUE, value_new("one"));
+    attr_cache_put(c, 2, CKA_VALUE, value_new("two"));
+
+    /* touch 1 so 2 is the least recently used */
+    assert_non_null(attr_cache_get(c, 1, CKA_VALUE));
+
+    attr_cache_put(c, 3, CKA_VALUE, value_new("three"));
+
+    assert_non_null(attr_cache_get(c, 1, CKA_VALUE));
+    assert_null(attr_cache_get(c, 2, CKA_VALUE));
+    assert_non_null(attr_cache_get(c, 3, CKA_VALUE));
+
+    attr_cache_free(c);
+}
+
+static void test_attr_cache_invalidate(void **state) {
+    (void) state;
+
+    attr_cache *c = attr_cache_new(4);
+    assert_non_null(c);
+
+    attr_cache_put(c, 1, CKA_VALUE, value_new("one"));
+    attr_cache_put(c, 1, CKA_SUBJECT, value_new("subject"));
+    attr_cache_put(c, 2, CKA_VALUE, value_new("two"));
+
+    attr_cache_invalidate(c, 1);
+
+    assert_null(attr_cache_get(c, 1, CKA_VALUE));
+    assert_null(attr_cache_get(c, 1, CKA_SUBJECT));
+    assert_non_null(attr_cache_get(c, 2, CKA_VALUE));
+
+    /* NULL is allowed, the cache is created on first use */
+    attr_cache_invalidate(NULL, 1);
+
+    attr_cache_free(c);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_attr_cache_get_put),
+        cmocka_unit_test(test_attr_cache_evicts_lru),
+        cmocka_unit_test(test_attr_cache_invalidate),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
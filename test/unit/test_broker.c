@@ -0,0 +1,427 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cmocka.h>
+
+#include "broker.h"
+
+/*
+ * The library behind the broker is faked, it hands out sessions on slot 1
+ * and signs everything with a four byte signature.
+ */
+static const CK_BYTE _signature[] = { 's', 'i', 'g', '!' };
+
+static unsigned _next_session;
+static unsigned _open_sessions;
+static CK_MECHANISM_TYPE _sign_mech;
+
+static CK_RV fake_open_session(CK_SLOT_ID slot, CK_FLAGS flags, CK_VOID_PTR application,
+        CK_NOTIFY notify, CK_SESSION_HANDLE_PTR session) {
+    (void) flags;
+    (void) application;
+    (void) notify;
+
+    if (slot != 1) {
+        return CKR_SLOT_ID_INVALID;
+    }
+
+    *session = __atomic_add_fetch(&_next_session, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_open_sessions, 1, __ATOMIC_RELAXED);
+    return CKR_OK;
+}
+
+static CK_RV fake_close_session(CK_SESSION_HANDLE session) {
+    (void) session;
+
+    __atomic_sub_fetch(&_open_sessions, 1, __ATOMIC_RELAXED);
+    return CKR_OK;
+}
+
+static CK_RV fake_get_session_info(CK_SESSION_HANDLE session, CK_SESSION_INFO_PTR info) {
+    (void) session;
+
+    memset(info, 0, sizeof(*info));
+    info->slotID = 1;
+    info->state = CKS_RO_PUBLIC_SESSION;
+    return CKR_OK;
+}
+
+static CK_RV fake_sign_init(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mech, CK_OBJECT_HANDLE key) {
+    (void) session;
+
+    if (key != 42) {
+        return CKR_KEY_HANDLE_INVALID;
+    }
+
+    _sign_mech = mech->mechanism;
+    return CKR_OK;
+}
+
+static CK_RV fake_sign(CK_SESSION_HANDLE session, CK_BYTE_PTR data, CK_ULONG data_len,
+        CK_BYTE_PTR sig, CK_ULONG_PTR sig_len) {
+    (void) session;
+    (void) data;
+    (void) data_len;
+
+    if (!sig) {
+        *sig_len = sizeof(_signature);
+        return CKR_OK;
+    }
+
+    if (*sig_len < sizeof(_signature)) {
+        *sig_len = sizeof(_signature);
+        return CKR_BUFFER_TOO_SMALL;
+    }
+
+    memcpy(sig, _signature, sizeof(_signature));
+    *sig_len = sizeof(_signature);
+    return CKR_OK;
+}
+
+static CK_FUNCTION_LIST _fake = {
+    .C_OpenSession = fake_open_session,
+    .C_CloseSession = fake_close_session,
+    .C_GetSessionInfo = fake_get_session_info,
+    .C_SignInit = fake_sign_init,
+    .C_Sign = fake_sign,
+};
+
+typedef struct test_server test_server;
+struct test_server {
+    char path[64];
+    int fd;
+    broker_server *server;
+    pthread_t thread;
+};
+
+static unsigned _serving;
+
+static void *serve_one(void *arg) {
+
+    void **args = (void **)arg;
+    broker_server_serve(args[0], (int)(intptr_t)args[1]);
+    free(args);
+    __atomic_sub_fetch(&_serving, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* accepts until the listening socket is shut down */
+static void *accept_thread(void *arg) {
+
+    test_server *t = (test_server *)arg;
+    for (;;) {
+        int fd = accept(t->fd, NULL, NULL);
+        if (fd < 0) {
+            return NULL;
+        }
+
+        void **args = calloc(2, sizeof(void *));
+        assert_non_null(args);
+        args[0] = t->server;
+        args[1] = (void *)(intptr_t)fd;
+
+        __atomic_add_fetch(&_serving, 1, __ATOMIC_RELAXED);
+
+        pthread_t thread;
+        assert_int_equal(pthread_create(&thread, NULL, serve_one, args), 0);
+        pthread_detach(thread);
+    }
+}
+
+static int server_setup(void **state) {
+
+    test_server *t = calloc(1, sizeof(*t));
+    assert_non_null(t);
+
+    snprintf(t->path, sizeof(t->path), "/tmp/test_broker_%d.sock", (int)getpid());
+    unlink(t->path);
+
+    t->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert_true(t->fd >= 0);
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strcpy(addr.sun_path, t->path);
+    assert_int_equal(bind(t->fd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+    assert_int_equal(listen(t->fd, 8), 0);
+
+    t->server = broker_server_new(&_fake);
+    assert_non_null(t->server);
+
+    assert_int_equal(pthread_create(&t->thread, NULL, accept_thread, t), 0);
+
+    setenv(BROKER_ENV_VAR, t->path, 1);
+    setenv(BROKER_DAEMON_ENV_VAR, "", 1);
+
+    _next_session = 0;
+    _open_sessions = 0;
+
+    *state = t;
+    return 0;
+}
+
+static int server_teardown(void **state) {
+
+    test_server *t = (test_server *)*state;
+
+    shutdown(t->fd, SHUT_RDWR);
+    pthread_join(t->thread, NULL);
+    close(t->fd);
+    unlink(t->path);
+
+    /* the clients hung up, wait for their threads to be done */
+    while (__atomic_load_n(&_serving, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+
+    broker_server_free(t->server);
+    free(t);
+
+    unsetenv(BROKER_ENV_VAR);
+    unsetenv(BROKER_DAEMON_ENV_VAR);
+
+    return 0;
+}
+
+static void test_broker_msg_roundtrip(void **state) {
+    (void) state;
+
+    broker_msg m = { 0 };
+
+    CK_BYTE empty[1];
+    CK_BYTE label[] = "label";
+    CK_BBOOL yes = CK_TRUE;
+    CK_ATTRIBUTE templ[] = {
+        { CKA_LABEL, label, sizeof(label) - 1 },
+        { CKA_SIGN, &yes, sizeof(yes) },
+        { CKA_ID, NULL, 0 },
+    };
+
+    CK_BYTE source[] = { 1, 2, 3 };
+    CK_RSA_PKCS_OAEP_PARAMS oaep = {
+        .hash_alg = CKM_SHA256,
+        .mgf = CKG_MGF1_SHA256,
+        .source = CKZ_DATA_SPECIFIED,
+        .source_data = source,
+        .source_data_len = sizeof(source),
+    };
+    CK_MECHANISM mech = { CKM_RSA_PKCS_OAEP, &oaep, sizeof(oaep) };
+
+    broker_put_ulong(&m, 0x1234);
+    broker_put_bytes(&m, NULL, 0);
+    broker_put_bytes(&m, empty, 0);
+    broker_put_out(&m, empty, 17);
+    assert_true(broker_put_attrs(&m, templ, 3));
+    assert_true(broker_put_mech(&m, &mech));
+    assert_false(m.bad);
+
+    assert_int_equal(broker_get_ulong(&m), 0x1234);
+
+    CK_ULONG len = 99;
+    assert_null(broker_get_bytes(&m, &len));
+    assert_int_equal(len, 0);
+    assert_non_null(broker_get_bytes(&m, &len));
+    assert_int_equal(len, 0);
+
+    assert_true(broker_get_out(&m, &len));
+    assert_int_equal(len, 17);
+
+    CK_ATTRIBUTE_PTR got = NULL;
+    CK_ULONG count = 0;
+    assert_int_equal(broker_get_attrs(&m, &got, &count), CKR_OK);
+    assert_int_equal(count, 3);
+    assert_int_equal(got[0].type, CKA_LABEL);
+    assert_int_equal(got[0].ulValueLen, sizeof(label) - 1);
+    assert_memory_equal(got[0].pValue, label, sizeof(label) - 1);
+    assert_int_equal(*(CK_BBOOL *)got[1].pValue, CK_TRUE);
+    assert_null(got[2].pValue);
+    free(got);
+
+    broker_mech bm;
+    assert_int_equal(broker_get_mech(&m, &bm), CKR_OK);
+    assert_int_equal(bm.mech.mechanism, CKM_RSA_PKCS_OAEP);
+    assert_int_equal(bm.mech.ulParameterLen, sizeof(oaep));
+    CK_RSA_PKCS_OAEP_PARAMS *p = bm.mech.pParameter;
+    assert_ptr_equal(p, &bm.params.oaep);
+    assert_int_equal(p->hash_alg, CKM_SHA256);
+    assert_int_equal(p->mgf, CKG_MGF1_SHA256);
+    assert_int_equal(p->source_data_len, sizeof(source));
+    assert_memory_equal(p->source_data, source, sizeof(source));
+
+    /* reading past the end flags the message rather than failing */
+    assert_false(m.bad);
+    assert_int_equal(broker_get_ulong(&m), 0);
+    assert_true(m.bad);
+
+    /* templates of templates hold pointers */
+    CK_ATTRIBUTE nested = { CKA_WRAP_TEMPLATE, templ, sizeof(templ) };
+    broker_msg_reset(&m);
+    assert_false(broker_put_attrs(&m, &nested, 1));
+    assert_false(broker_put_mech(&m, NULL));
+
+    broker_msg_free(&m);
+}
+
+static void test_broker_frames(void **state) {
+    (void) state;
+
+    int sv[2];
+    assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+
+    broker_msg out = { 0 };
+    broker_msg in = { 0 };
+    broker_put_ulong(&out, 7);
+    broker_put_bytes(&out, "data", 4);
+
+    assert_int_equal(broker_send(sv[0], &out), CKR_OK);
+    assert_int_equal(broker_recv(sv[1], &in), CKR_OK);
+    assert_int_equal(in.len, out.len);
+    assert_int_equal(broker_get_ulong(&in), 7);
+
+    /* frames over the limit are refused before any allocation */
+    uint32_t huge = BROKER_MAX_FRAME + 1;
+    assert_int_equal(write(sv[0], &huge, sizeof(huge)), sizeof(huge));
+    assert_int_equal(broker_recv(sv[1], &in), CKR_DEVICE_MEMORY);
+
+    close(sv[0]);
+    assert_int_equal(broker_recv(sv[1], &in), CKR_DEVICE_ERROR);
+    close(sv[1]);
+
+    broker_msg_free(&out);
+    broker_msg_free(&in);
+}
+
+static void test_broker_hello_mismatch(void **state) {
+
+    test_server *t = (test_server *)*state;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strcpy(addr.sun_path, t->path);
+    assert_int_equal(connect(fd, (struct sockaddr *)&addr, sizeof(addr)), 0);
+
+    broker_msg m = { 0 };
+    broker_put_ulong(&m, broker_call_hello);
+    broker_put_ulong(&m, BROKER_PROTOCOL_VERSION + 1);
+    broker_put_ulong(&m, sizeof(CK_ULONG));
+    broker_put_ulong(&m, 0);
+    broker_put_ulong(&m, 1);
+    assert_int_equal(broker_send(fd, &m), CKR_OK);
+    assert_int_equal(broker_recv(fd, &m), CKR_OK);
+    assert_int_equal(broker_get_ulong(&m), broker_call_hello);
+    assert_int_equal(broker_get_ulong(&m), CKR_FUNCTION_FAILED);
+
+    /* and the broker hangs up */
+    assert_int_equal(broker_recv(fd, &m), CKR_DEVICE_ERROR);
+
+    close(fd);
+    broker_msg_free(&m);
+}
+
+static void test_broker_client(void **state) {
+    (void) state;
+
+    CK_FUNCTION_LIST_PTR p11 = NULL;
+    assert_true(broker_client_enabled());
+    assert_int_equal(broker_client_get_func_list(&p11), CKR_OK);
+
+    CK_RV rv = p11->C_OpenSession(1, CKF_SERIAL_SESSION, NULL, NULL, &(CK_SESSION_HANDLE){0});
+    assert_int_equal(rv, CKR_CRYPTOKI_NOT_INITIALIZED);
+
+    rv = p11->C_Initialize(NULL);
+    assert_int_equal(rv, CKR_OK);
+    rv = p11->C_Initialize(NULL);
+    assert_int_equal(rv, CKR_CRYPTOKI_ALREADY_INITIALIZED);
+
+    CK_SESSION_HANDLE session = 0;
+    rv = p11->C_OpenSession(1, CKF_SERIAL_SESSION, NULL, NULL, &session);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(_open_sessions, 1);
+
+    rv = p11->C_OpenSession(2, CKF_SERIAL_SESSION, NULL, NULL, &(CK_SESSION_HANDLE){0});
+    assert_int_equal(rv, CKR_SLOT_ID_INVALID);
+
+    /* sessions the client did not open are not its own */
+    rv = p11->C_CloseSession(session + 100);
+    assert_int_equal(rv, CKR_SESSION_HANDLE_INVALID);
+
+    CK_MECHANISM mech = { CKM_ECDSA, NULL, 0 };
+    rv = p11->C_SignInit(session, &mech, 42);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(_sign_mech, CKM_ECDSA);
+
+    CK_BYTE data[] = "data";
+    CK_BYTE sig[16] = { 0 };
+    CK_ULONG sig_len = 0;
+    rv = p11->C_Sign(session, data, sizeof(data), NULL, &sig_len);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(sig_len, sizeof(_signature));
+
+    sig_len = 2;
+    rv = p11->C_Sign(session, data, sizeof(data), sig, &sig_len);
+    assert_int_equal(rv, CKR_BUFFER_TOO_SMALL);
+    assert_int_equal(sig_len, sizeof(_signature));
+
+    sig_len = sizeof(sig);
+    rv = p11->C_Sign(session, data, sizeof(data), sig, &sig_len);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(sig_len, sizeof(_signature));
+    assert_memory_equal(sig, _signature, sizeof(_signature));
+
+    /* finalize closes what the client left open */
+    rv = p11->C_OpenSession(1, CKF_SERIAL_SESSION, NULL, NULL, &session);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(_open_sessions, 2);
+
+    rv = p11->C_Finalize(NULL);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(_open_sessions, 0);
+
+    rv = p11->C_Finalize(NULL);
+    assert_int_equal(rv, CKR_CRYPTOKI_NOT_INITIALIZED);
+}
+
+static void test_broker_no_daemon(void **state) {
+    (void) state;
+
+    setenv(BROKER_ENV_VAR, "/tmp/test_broker_nobody.sock", 1);
+    setenv(BROKER_DAEMON_ENV_VAR, "", 1);
+    unlink("/tmp/test_broker_nobody.sock");
+
+    CK_FUNCTION_LIST_PTR p11 = NULL;
+    assert_int_equal(broker_client_get_func_list(&p11), CKR_OK);
+
+    CK_RV rv = p11->C_Initialize(NULL);
+    assert_int_equal(rv, CKR_FUNCTION_FAILED);
+
+    unsetenv(BROKER_ENV_VAR);
+    unsetenv(BROKER_DAEMON_ENV_VAR);
+    assert_false(broker_client_enabled());
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_broker_msg_roundtrip),
+        cmocka_unit_test(test_broker_frames),
+        cmocka_unit_test_setup_teardown(test_broker_hello_mismatch,
+                server_setup, server_teardown),
+        cmocka_unit_test_setup_teardown(test_broker_client,
+                server_setup, server_teardown),
+        cmocka_unit_test(test_broker_no_daemon),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
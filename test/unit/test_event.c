@@ -0,0 +1,362 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <cmocka.h>
+
+#include "db.h"
+#include "event.h"
+#include "slot.h"
+
+/*
+ * The store is faked by a plain file, every write to it reports a change
+ * to token _changed_tokid.
+ */
+static char _store_path[] = "/tmp/test_event_XXXXXX";
+static bool _have_store;
+static unsigned _changed_tokid;
+static unsigned _change_checks;
+
+struct db_watch {
+    int unused;
+};
+
+static db_watch _watch;
+
+CK_RV __wrap_db_watch_new(db_watch **watch) {
+
+    if (!_have_store) {
+        return CKR_TOKEN_NOT_PRESENT;
+    }
+
+    *watch = &_watch;
+    return CKR_OK;
+}
+
+const char *__wrap_db_watch_path(db_watch *watch) {
+    (void) watch;
+    return _store_path;
+}
+
+CK_RV __wrap_db_watch_changes(db_watch *watch, db_watch_cb cb, void *userdata) {
+    (void) watch;
+
+    __atomic_add_fetch(&_change_checks, 1, __ATOMIC_RELAXED);
+
+    unsigned tokid = __atomic_exchange_n(&_changed_tokid, 0, __ATOMIC_RELAXED);
+    if (tokid) {
+        cb(tokid, userdata);
+    }
+
+    return CKR_OK;
+}
+
+void __wrap_db_watch_free(db_watch *watch) {
+    (void) watch;
+}
+
+/* slots 1 to 9 exist */
+static token _token;
+token *__wrap_slot_get_token(CK_SLOT_ID slot_id) {
+    return slot_id && slot_id < 10 ? &_token : NULL;
+}
+
+static int event_setup(void **state) {
+    (void) state;
+
+    _have_store = false;
+    event_init(true);
+
+    return 0;
+}
+
+static int event_teardown(void **state) {
+    (void) state;
+
+    event_destroy();
+
+    return 0;
+}
+
+static void test_event_args(void **state) {
+    (void) state;
+
+    CK_SLOT_ID slot;
+    CK_RV rv = event_wait(CKF_DONT_BLOCK, NULL, NULL);
+    assert_int_equal(rv, CKR_ARGUMENTS_BAD);
+
+    rv = event_wait(CKF_DONT_BLOCK, &slot, &slot);
+    assert_int_equal(rv, CKR_ARGUMENTS_BAD);
+}
+
+static void test_event_dont_block(void **state) {
+    (void) state;
+
+    CK_SLOT_ID slot = 0;
+    CK_RV rv = event_wait(CKF_DONT_BLOCK, &slot, NULL);
+    assert_int_equal(rv, CKR_NO_EVENT);
+
+    event_post(3);
+    event_post(1);
+    /* already pending, no second event */
+    event_post(3);
+    /* can't be a slot */
+    event_post(256);
+
+    rv = event_wait(CKF_DONT_BLOCK, &slot, NULL);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(slot, 3);
+
+    rv = event_wait(CKF_DONT_BLOCK, &slot, NULL);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(slot, 1);
+
+    rv = event_wait(CKF_DONT_BLOCK, &slot, NULL);
+    assert_int_equal(rv, CKR_NO_EVENT);
+
+    /* consumed, so it can be posted again */
+    event_post(3);
+    rv = event_wait(CKF_DONT_BLOCK, &slot, NULL);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(slot, 3);
+}
+
+typedef struct waiter waiter;
+struct waiter {
+    pthread_t thread;
+    CK_SLOT_ID slot;
+    CK_RV rv;
+};
+
+static void *waiter_main(void *arg) {
+
+    waiter *w = (waiter *)arg;
+    w->rv = event_wait(0, &w->slot, NULL);
+
+    return NULL;
+}
+
+static void test_event_blocking(void **state) {
+    (void) state;
+
+    waiter w = { .rv = CKR_GENERAL_ERROR };
+    assert_int_equal(pthread_create(&w.thread, NULL, waiter_main, &w), 0);
+
+    event_post(5);
+
+    pthread_join(w.thread, NULL);
+    assert_int_equal(w.rv, CKR_OK);
+    assert_int_equal(w.slot, 5);
+}
+
+static void test_event_finalize_wakes(void **state) {
+    (void) state;
+
+    waiter w[3];
+
+    size_t i;
+    for (i=0; i < 3; i++) {
+        w[i].rv = CKR_GENERAL_ERROR;
+        assert_int_equal(pthread_create(&w[i].thread, NULL, waiter_main, &w[i]), 0);
+    }
+
+    /* give them time to block, C_Finalize must wake them either way */
+    usleep(10000);
+
+    event_destroy();
+
+    for (i=0; i < 3; i++) {
+        pthread_join(w[i].thread, NULL);
+        assert_int_equal(w[i].rv, CKR_CRYPTOKI_NOT_INITIALIZED);
+    }
+
+    CK_SLOT_ID slot;
+    CK_RV rv = event_wait(CKF_DONT_BLOCK, &slot, NULL);
+    assert_int_equal(rv, CKR_CRYPTOKI_NOT_INITIALIZED);
+
+    /* for the teardown */
+    event_init(true);
+}
+
+static void test_event_store_change(void **state) {
+    (void) state;
+
+    int fd = mkstemp(_store_path);
+    assert_true(fd >= 0);
+    _have_store = true;
+
+    /* starts the watcher */
+    CK_SLOT_ID slot;
+    CK_RV rv = event_wait(CKF_DONT_BLOCK, &slot, NULL);
+    assert_int_equal(rv, CKR_NO_EVENT);
+
+    /* a change to a token that's not a slot here */
+    __atomic_store_n(&_changed_tokid, 42, __ATOMIC_RELAXED);
+    assert_int_equal(write(fd, "x", 1), 1);
+
+    unsigned i;
+    for (i=0; i < 500 && __atomic_load_n(&_changed_tokid, __ATOMIC_RELAXED); i++) {
+        usleep(10000);
+    }
+
+    rv = event_wait(CKF_DONT_BLOCK, &slot, NULL);
+    assert_int_equal(rv, CKR_NO_EVENT);
+
+    __atomic_store_n(&_changed_tokid, 4, __ATOMIC_RELAXED);
+    assert_int_equal(write(fd, "x", 1), 1);
+
+    rv = event_wait(0, &slot, NULL);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(slot, 4);
+
+    assert_true(__atomic_load_n(&_change_checks, __ATOMIC_RELAXED) >= 2);
+
+    close(fd);
+    unlink(_store_path);
+}
+
+/* the child's checks, it can't use cmocka's */
+static int event_fork_child(int fd) {
+
+    event_after_fork();
+
+    /* pending events survive, and the wait starts a watcher of the child's own */
+    CK_SLOT_ID slot = 0;
+    CK_RV rv = event_wait(CKF_DONT_BLOCK, &slot, NULL);
+    if (rv != CKR_OK || slot != 2) {
+        return 1;
+    }
+
+    __atomic_store_n(&_changed_tokid, 6, __ATOMIC_RELAXED);
+    if (write(fd, "x", 1) != 1) {
+        return 2;
+    }
+
+    rv = event_wait(0, &slot, NULL);
+    if (rv != CKR_OK || slot != 6) {
+        return 3;
+    }
+
+    /* would hang on the parent's waiters or watcher */
+    event_destroy();
+
+    return 0;
+}
+
+static void test_event_after_fork(void **state) {
+    (void) state;
+
+    strcpy(_store_path, "/tmp/test_event_XXXXXX");
+    int fd = mkstemp(_store_path);
+    assert_true(fd >= 0);
+    _have_store = true;
+
+    /* the parent has a watcher and a blocked waiter when it forks */
+    CK_SLOT_ID slot;
+    CK_RV rv = event_wait(CKF_DONT_BLOCK, &slot, NULL);
+    assert_int_equal(rv, CKR_NO_EVENT);
+
+    waiter w = { .rv = CKR_GENERAL_ERROR };
+    assert_int_equal(pthread_create(&w.thread, NULL, waiter_main, &w), 0);
+    usleep(10000);
+
+    pid_t pid = fork();
+    assert_true(pid >= 0);
+    if (pid == 0) {
+        event_post(2);
+        _exit(event_fork_child(fd));
+    }
+
+    int status = 0;
+    assert_int_equal(waitpid(pid, &status, 0), pid);
+    assert_true(WIFEXITED(status));
+    assert_int_equal(WEXITSTATUS(status), 0);
+
+    /* the parent's waiter is untouched */
+    event_post(7);
+    pthread_join(w.thread, NULL);
+    assert_int_equal(w.rv, CKR_OK);
+    assert_int_equal(w.slot, 7);
+
+    close(fd);
+    unlink(_store_path);
+}
+
+static int event_no_threads_setup(void **state) {
+    (void) state;
+
+    _have_store = false;
+    event_init(false);
+
+    return 0;
+}
+
+static void test_event_no_threads(void **state) {
+    (void) state;
+
+    strcpy(_store_path, "/tmp/test_event_XXXXXX");
+    int fd = mkstemp(_store_path);
+    assert_true(fd >= 0);
+    _have_store = true;
+
+    unsigned checks = __atomic_load_n(&_change_checks, __ATOMIC_RELAXED);
+
+    /* nothing could wake a blocked waiter */
+    CK_SLOT_ID slot = 0;
+    CK_RV rv = event_wait(0, &slot, NULL);
+    assert_int_equal(rv, CKR_FUNCTION_NOT_SUPPORTED);
+
+    /* the store is checked on the calling thread */
+    __atomic_store_n(&_changed_tokid, 4, __ATOMIC_RELAXED);
+    rv = event_wait(CKF_DONT_BLOCK, &slot, NULL);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(slot, 4);
+
+    rv = event_wait(CKF_DONT_BLOCK, &slot, NULL);
+    assert_int_equal(rv, CKR_NO_EVENT);
+
+    assert_int_equal(__atomic_load_n(&_change_checks, __ATOMIC_RELAXED),
+            checks + 3);
+
+    /* a pending event doesn't need to wait */
+    event_post(3);
+    rv = event_wait(0, &slot, NULL);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(slot, 3);
+
+    close(fd);
+    unlink(_store_path);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_event_args,
+                event_setup, event_teardown),
+        cmocka_unit_test_setup_teardown(test_event_dont_block,
+                event_setup, event_teardown),
+        cmocka_unit_test_setup_teardown(test_event_blocking,
+                event_setup, event_teardown),
+        cmocka_unit_test_setup_teardown(test_event_finalize_wakes,
+                event_setup, event_teardown),
+        cmocka_unit_test_setup_teardown(test_event_store_change,
+                event_setup, event_teardown),
+        cmocka_unit_test_setup_teardown(test_event_after_fork,
+                event_setup, event_teardown),
+        cmocka_unit_test_setup_teardown(test_event_no_threads,
+                event_no_threads_setup, event_teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,228 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cmocka.h>
+
+#include "fapi_index.h"
+
+#define TOKEN_PATH "/P_RSA2048SHA256/HS/SRK/tpm2-pkcs11-token-so-00000001"
+
+/*
+ * A fake keystore: a FAPI config naming a user keystore with one token
+ * seal, the system keystore is left missing.
+ */
+typedef struct test_ks test_ks;
+struct test_ks {
+    char root[64];
+    char path[256];
+};
+
+static void write_file(const char *path, const char *data) {
+
+    FILE *f = fopen(path, "w");
+    assert_non_null(f);
+    assert_int_equal(fputs(data, f) >= 0, 1);
+    assert_int_equal(fclose(f), 0);
+}
+
+static const char *ks_path(test_ks *ks, const char *rel) {
+    snprintf(ks->path, sizeof(ks->path), "%s%s", ks->root, rel);
+    return ks->path;
+}
+
+static int ks_setup(void **state) {
+
+    test_ks *ks = calloc(1, sizeof(*ks));
+    assert_non_null(ks);
+
+    snprintf(ks->root, sizeof(ks->root), "/tmp/test_fapi_index_XXXXXX");
+    assert_non_null(mkdtemp(ks->root));
+
+    static const char *dirs[] = {
+        "/user",
+        "/user/P_RSA2048SHA256",
+        "/user/P_RSA2048SHA256/HS",
+        "/user/P_RSA2048SHA256/HS/SRK",
+        "/user/P_RSA2048SHA256/HS/SRK/tpm2-pkcs11-token-so-00000001",
+    };
+
+    size_t i;
+    for (i=0; i < sizeof(dirs)/sizeof(dirs[0]); i++) {
+        assert_int_equal(mkdir(ks_path(ks, dirs[i]), 0700), 0);
+    }
+
+    write_file(ks_path(ks, "/user" TOKEN_PATH "/object.json"), "{}");
+
+    /* the user keystore is given relative to HOME */
+    setenv("HOME", ks->root, 1);
+    write_file(ks_path(ks, "/fapi-config.json"),
+            "{\n"
+            "    \"profile_name\": \"P_RSA2048SHA256\",\n"
+            "    \"user_dir\": \"~/user\",\n"
+            "    \"system_pcrs\" : [],\n"
+            "    \"system_dir\": \"/nonexistent/system\"\n"
+            "}\n");
+    setenv("TSS2_FAPICONF", ks_path(ks, "/fapi-config.json"), 1);
+    setenv(FAPI_INDEX_ENV_VAR, ks_path(ks, "/fapi-index"), 1);
+
+    *state = ks;
+
+    return 0;
+}
+
+static int ks_teardown(void **state) {
+
+    test_ks *ks = (test_ks *)*state;
+
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", ks->root);
+    assert_int_equal(system(cmd), 0);
+
+    unsetenv("TSS2_FAPICONF");
+    unsetenv(FAPI_INDEX_ENV_VAR);
+    free(ks);
+
+    return 0;
+}
+
+static void assert_hit(fapi_index *idx, const char *kind, const char *path,
+        const char *expected, size_t len) {
+
+    twist got = fapi_index_get(idx, kind, path);
+    assert_non_null(got);
+    assert_int_equal(twist_len(got), len);
+    assert_memory_equal(got, expected, len);
+    twist_free(got);
+}
+
+/* expected values may hold '\0' */
+#define ASSERT_HIT(idx, kind, path, expected) \
+    assert_hit(idx, kind, path, expected, sizeof(expected) - 1)
+
+static void test_fapi_index_disabled(void **state) {
+
+    test_ks *ks = (test_ks *)*state;
+
+    setenv(FAPI_INDEX_ENV_VAR, "", 1);
+    assert_null(fapi_index_open());
+
+    /* a NULL index is a permanent miss */
+    assert_null(fapi_index_get(NULL, "appdata", TOKEN_PATH));
+    fapi_index_put(NULL, "appdata", TOKEN_PATH, "x", 1);
+    fapi_index_close(NULL);
+
+    setenv(FAPI_INDEX_ENV_VAR, ks_path(ks, "/fapi-index"), 1);
+    setenv("TSS2_FAPICONF", ks_path(ks, "/missing.json"), 1);
+    assert_null(fapi_index_open());
+}
+
+static void test_fapi_index_roundtrip(void **state) {
+    (void) state;
+
+    fapi_index *idx = fapi_index_open();
+    assert_non_null(idx);
+
+    assert_null(fapi_index_get(idx, "appdata", TOKEN_PATH));
+    fapi_index_put(idx, "appdata", TOKEN_PATH, "salt\0rec", 8);
+    assert_null(fapi_index_get(idx, "list", "/HS/SRK"));
+    fapi_index_put(idx, "list", "/HS/SRK", TOKEN_PATH, strlen(TOKEN_PATH));
+
+    /* not in a keystore, so nothing to validate it against */
+    const char *gone = "/P_RSA2048SHA256/HS/SRK/gone";
+    assert_null(fapi_index_get(idx, "appdata", gone));
+    fapi_index_put(idx, "appdata", gone, "x", 1);
+
+    fapi_index_close(idx);
+
+    idx = fapi_index_open();
+    assert_non_null(idx);
+
+    ASSERT_HIT(idx, "appdata", TOKEN_PATH, "salt\0rec");
+    ASSERT_HIT(idx, "list", "/HS/SRK", TOKEN_PATH);
+    assert_null(fapi_index_get(idx, "appdata", gone));
+    /* same path, other kind */
+    assert_null(fapi_index_get(idx, "description", TOKEN_PATH));
+
+    fapi_index_close(idx);
+}
+
+static void test_fapi_index_stale(void **state) {
+
+    test_ks *ks = (test_ks *)*state;
+
+    fapi_index *idx = fapi_index_open();
+    assert_non_null(idx);
+
+    assert_null(fapi_index_get(idx, "appdata", TOKEN_PATH));
+    fapi_index_put(idx, "appdata", TOKEN_PATH, "old", 3);
+    assert_null(fapi_index_get(idx, "list", "/HS/SRK"));
+    fapi_index_put(idx, "list", "/HS/SRK", TOKEN_PATH, strlen(TOKEN_PATH));
+
+    fapi_index_close(idx);
+
+    /* rewrite the entry, the size alone tells it apart */
+    write_file(ks_path(ks, "/user" TOKEN_PATH "/object.json"), "{ \"changed\": 1 }");
+
+    idx = fapi_index_open();
+    assert_non_null(idx);
+
+    assert_null(fapi_index_get(idx, "appdata", TOKEN_PATH));
+    fapi_index_put(idx, "appdata", TOKEN_PATH, "new", 3);
+    ASSERT_HIT(idx, "appdata", TOKEN_PATH, "new");
+
+    /* the listing is unchanged until an entry is added under the SRK */
+    ASSERT_HIT(idx, "list", "/HS/SRK", TOKEN_PATH);
+    assert_int_equal(mkdir(ks_path(ks,
+            "/user/P_RSA2048SHA256/HS/SRK/tpm2-pkcs11-token-so-00000002"), 0700), 0);
+    assert_null(fapi_index_get(idx, "list", "/HS/SRK"));
+
+    fapi_index_close(idx);
+}
+
+static void test_fapi_index_damaged(void **state) {
+
+    test_ks *ks = (test_ks *)*state;
+
+    write_file(ks_path(ks, "/fapi-index"), "tpm2fapi, but not an index");
+
+    fapi_index *idx = fapi_index_open();
+    assert_non_null(idx);
+
+    assert_null(fapi_index_get(idx, "appdata", TOKEN_PATH));
+    fapi_index_put(idx, "appdata", TOKEN_PATH, "salt", 4);
+
+    fapi_index_close(idx);
+
+    /* rewritten whole on close */
+    idx = fapi_index_open();
+    assert_non_null(idx);
+    ASSERT_HIT(idx, "appdata", TOKEN_PATH, "salt");
+    fapi_index_close(idx);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_fapi_index_disabled,
+                ks_setup, ks_teardown),
+        cmocka_unit_test_setup_teardown(test_fapi_index_roundtrip,
+                ks_setup, ks_teardown),
+        cmocka_unit_test_setup_teardown(test_fapi_index_stale,
+                ks_setup, ks_teardown),
+        cmocka_unit_test_setup_teardown(test_fapi_index_damaged,
+                ks_setup, ks_teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
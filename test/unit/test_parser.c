@@ -98,6 +98,63 @@ static void test_attr_parser_good(void **state) {
     attr_list_free(attrs);
 }
 
+static void test_attr_parser_lazy(void **state) {
+    (void) state;
+
+    /* CKA_CLASS is CKO_CERTIFICATE and CKA_VALUE is 300 bytes of 0xAB */
+    char yaml[1024];
+    char hex[601];
+    unsigned i;
+    for (i=0; i < 300; i++) {
+        memcpy(&hex[i * 2], "ab", 2);
+    }
+    hex[600] = '\0';
+
+    int len = snprintf(yaml, sizeof(yaml),
+            "--- !!map {\n"
+            "  ? !!int \"0\"\n"
+            "  : !!int \"1\",\n"
+            "  ? !!int \"3\"\n"
+            "  : !!str \"6c6162656c\",\n"
+            "  ? !!int \"17\"\n"
+            "  : !!str \"%s\",\n"
+            "}\n", hex);
+    assert_true(len > 0 && (size_t)len < sizeof(yaml));
+
+    /* the large value is left out, the small label is not */
+    attr_list *attrs = NULL;
+    bool res = parse_attributes_from_string_lazy((unsigned char *)yaml, len,
+            &attrs);
+    assert_true(res);
+    assert_int_equal(attr_list_get_count(attrs), 3);
+
+    CK_ATTRIBUTE_PTR a = attr_get_attribute_by_type(attrs, CKA_VALUE);
+    assert_non_null(a);
+    assert_true(attr_is_lazy(a));
+    assert_int_equal(a->ulValueLen, 300);
+
+    a = attr_get_attribute_by_type(attrs, CKA_LABEL);
+    assert_non_null(a);
+    assert_false(attr_is_lazy(a));
+    assert_int_equal(a->ulValueLen, 5);
+    assert_memory_equal(a->pValue, "label", 5);
+
+    attr_list_free(attrs);
+
+    /* the regular parser keeps everything resident */
+    res = parse_attributes_from_string((unsigned char *)yaml, len,
+            &attrs);
+    assert_true(res);
+
+    a = attr_get_attribute_by_type(attrs, CKA_VALUE);
+    assert_non_null(a);
+    assert_false(attr_is_lazy(a));
+    assert_int_equal(a->ulValueLen, 300);
+    assert_int_equal(((CK_BYTE_PTR)a->pValue)[299], 0xAB);
+
+    attr_list_free(attrs);
+}
+
 static const unsigned char _config_yaml[] = {
   0x21, 0x21, 0x6d, 0x61, 0x70, 0x20, 0x7b, 0x0a, 0x20, 0x20, 0x3f, 0x20,
   0x21, 0x21, 0x73, 0x74, 0x72, 0x20, 0x22, 0x74, 0x6f, 0x6b, 0x65, 0x6e,
@@ -277,6 +334,7 @@ int main(int argc, char* argv[]) {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_config_parser_empty_seq),
         cmocka_unit_test(test_attr_parser_good),
+        cmocka_unit_test(test_attr_parser_lazy),
         cmocka_unit_test(test_config_parser_good),
         cmocka_unit_test(test_token_config_parser_no_tags),
         cmocka_unit_test(test_token_config_parser_missing_tags),
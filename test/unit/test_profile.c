@@ -0,0 +1,206 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <cmocka.h>
+
+#include "profile.h"
+
+static int profile_setup(void **state) {
+    (void) state;
+
+    setenv(PROFILE_ENV_VAR, "/dev/null", 1);
+    profile_init();
+
+    return profile_enabled() ? 0 : -1;
+}
+
+static int profile_teardown(void **state) {
+    (void) state;
+
+    profile_finalize(0);
+    unsetenv(PROFILE_ENV_VAR);
+
+    return 0;
+}
+
+static char *report(void) {
+
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&buf, &len);
+    assert_non_null(f);
+
+    profile_report(f);
+    fclose(f);
+
+    return buf;
+}
+
+/* returns the report line for a phase, the indent included */
+static char *find_line(char *text, const char *indent_phase) {
+
+    char *line = text;
+    while (line && *line) {
+        size_t n = strlen(indent_phase);
+        if (!strncmp(line, indent_phase, n) && line[n] == ' ') {
+            return line;
+        }
+        line = strchr(line, '\n');
+        if (line) {
+            line++;
+        }
+    }
+
+    return NULL;
+}
+
+/* reads the token, runs, tpm cmds and rows columns of a line */
+static void parse_line(const char *line, char token[16], unsigned *runs,
+        unsigned *tpm_cmds, unsigned *rows) {
+
+    char phase[64];
+    double ms, tpm_ms;
+    int n = sscanf(line, "%63s %15s %u %lf %u %lf %u", phase, token, runs,
+            &ms, tpm_cmds, &tpm_ms, rows);
+    assert_int_equal(n, 7);
+}
+
+static void test_profile_disabled(void **state) {
+    (void) state;
+
+    assert_false(profile_enabled());
+
+    profile_span span = profile_begin(profile_phase_backend_init,
+            PROFILE_TOKEN_INHERIT);
+    assert_false(span.active);
+    profile_tpm_begin();
+    profile_tpm_end();
+    profile_db_row();
+    profile_end(&span);
+
+    char *text = report();
+    assert_null(find_line(text, "backend_init"));
+    free(text);
+}
+
+static void test_profile_nesting(void **state) {
+    (void) state;
+
+    profile_span outer = profile_begin(profile_phase_slot_init,
+            PROFILE_TOKEN_INHERIT);
+    profile_db_row();
+
+    unsigned id;
+    for (id=1; id <= 2; id++) {
+        profile_span tok = profile_begin(profile_phase_token_min_init, id);
+
+        /* runs twice per token, both runs are added up */
+        unsigned i;
+        for (i=0; i < 2; i++) {
+            profile_span inner = profile_begin(profile_phase_mdetail_new,
+                    PROFILE_TOKEN_INHERIT);
+            profile_tpm_begin();
+            profile_tpm_end();
+            profile_db_row();
+            profile_end(&inner);
+        }
+
+        profile_end(&tok);
+    }
+
+    profile_end(&outer);
+
+    /* a TPM command outside of any phase only counts in the total */
+    profile_tpm_begin();
+    profile_tpm_end();
+
+    char *text = report();
+
+    char token[16];
+    unsigned runs, tpm_cmds, rows;
+
+    char *line = find_line(text, "slot_init");
+    assert_non_null(line);
+    parse_line(line, token, &runs, &tpm_cmds, &rows);
+    assert_string_equal(token, "-");
+    assert_int_equal(runs, 1);
+    assert_int_equal(tpm_cmds, 4);
+    assert_int_equal(rows, 5);
+
+    line = find_line(text, "  token_min_init");
+    assert_non_null(line);
+    parse_line(line, token, &runs, &tpm_cmds, &rows);
+    assert_string_equal(token, "1");
+    assert_int_equal(runs, 1);
+    assert_int_equal(tpm_cmds, 2);
+    assert_int_equal(rows, 2);
+
+    line = find_line(text, "    mdetail_new");
+    assert_non_null(line);
+    parse_line(line, token, &runs, &tpm_cmds, &rows);
+    assert_string_equal(token, "1");
+    assert_int_equal(runs, 2);
+    assert_int_equal(tpm_cmds, 2);
+    assert_int_equal(rows, 2);
+
+    /* token 2 follows token 1 */
+    line = find_line(line + 1, "  token_min_init");
+    assert_non_null(line);
+    parse_line(line, token, &runs, &tpm_cmds, &rows);
+    assert_string_equal(token, "2");
+
+    line = find_line(text, "total");
+    assert_non_null(line);
+    double ms, tpm_ms;
+    int n = sscanf(line, "total - - %lf %u %lf %u", &ms, &tpm_cmds,
+            &tpm_ms, &rows);
+    assert_int_equal(n, 4);
+    assert_int_equal(tpm_cmds, 5);
+    assert_int_equal(rows, 5);
+
+    free(text);
+}
+
+static void test_profile_token_restored(void **state) {
+    (void) state;
+
+    profile_span tok = profile_begin(profile_phase_init_tobjects, 7);
+    profile_span inner = profile_begin(profile_phase_yaml_parse,
+            PROFILE_TOKEN_INHERIT);
+    assert_int_equal(inner.token, 7);
+    profile_end(&inner);
+    profile_end(&tok);
+
+    /* back at the top level there is no token to inherit */
+    profile_span after = profile_begin(profile_phase_db_new,
+            PROFILE_TOKEN_INHERIT);
+    assert_int_equal(after.token, 0);
+    profile_end(&after);
+
+    char *text = report();
+    char *line = find_line(text, "db_new");
+    assert_non_null(line);
+    free(text);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_profile_disabled),
+        cmocka_unit_test_setup_teardown(test_profile_nesting,
+                profile_setup, profile_teardown),
+        cmocka_unit_test_setup_teardown(test_profile_token_restored,
+                profile_setup, profile_teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,190 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <cmocka.h>
+
+#include "backend.h"
+#include "slot.h"
+#include "token.h"
+#include "utils.h"
+
+/* the ids the fake backend hands out */
+static const unsigned _ids[] = { 1, 2, 7, 300 };
+
+CK_RV __wrap_backend_get_tokens(token **tok, size_t *len) {
+
+    token *t = calloc(MAX_TOKEN_CNT, sizeof(*t));
+    assert_non_null(t);
+
+    size_t i;
+    for (i=0; i < ARRAY_LEN(_ids); i++) {
+        t[i].id = _ids[i];
+        t[i].config.is_initialized = true;
+    }
+
+    *tok = t;
+    *len = ARRAY_LEN(_ids);
+
+    return CKR_OK;
+}
+
+void __wrap_token_free_list(token **tok, size_t *len) {
+
+    free(*tok);
+    *tok = NULL;
+    *len = 0;
+}
+
+CK_RV token_min_init(token *t) {
+    (void) t;
+    return CKR_OK;
+}
+
+static int slot_setup(void **state) {
+    (void) state;
+
+    return slot_init() != CKR_OK;
+}
+
+static int slot_teardown(void **state) {
+    (void) state;
+
+    slot_destroy();
+
+    return 0;
+}
+
+static void test_slot_get_token(void **state) {
+    (void) state;
+
+    size_t i;
+    for (i=0; i < ARRAY_LEN(_ids); i++) {
+        token *t = slot_get_token(_ids[i]);
+        assert_non_null(t);
+        assert_int_equal(t->id, _ids[i]);
+    }
+
+    assert_null(slot_get_token(0));
+    assert_null(slot_get_token(3));
+    assert_null(slot_get_token(255));
+    assert_null(slot_get_token(256));
+    assert_null(slot_get_token(~0UL));
+}
+
+static void test_slot_get_list(void **state) {
+    (void) state;
+
+    CK_ULONG count = 0;
+    CK_RV rv = slot_get_list(true, NULL, &count);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(count, ARRAY_LEN(_ids));
+
+    CK_SLOT_ID slots[8];
+    count = 2;
+    rv = slot_get_list(true, slots, &count);
+    assert_int_equal(rv, CKR_BUFFER_TOO_SMALL);
+    assert_int_equal(count, ARRAY_LEN(_ids));
+
+    count = ARRAY_LEN(slots);
+    rv = slot_get_list(true, slots, &count);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(count, ARRAY_LEN(_ids));
+
+    size_t i;
+    for (i=0; i < count; i++) {
+        assert_int_equal(slots[i], _ids[i]);
+    }
+}
+
+static void test_slot_add_uninit_token(void **state) {
+    (void) state;
+
+    token *before = slot_get_token(7);
+
+    CK_RV rv = slot_add_uninit_token();
+    assert_int_equal(rv, CKR_OK);
+
+    /* existing tokens don't move when the table is republished */
+    assert_ptr_equal(slot_get_token(7), before);
+
+    token *t = slot_get_token(ARRAY_LEN(_ids) + 1);
+    assert_non_null(t);
+    assert_false(t->config.is_initialized);
+
+    CK_ULONG count = 0;
+    rv = slot_get_list(true, NULL, &count);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(count, ARRAY_LEN(_ids) + 1);
+
+    /* there's an uninitialized token now, so nothing is added */
+    rv = slot_add_uninit_token();
+    assert_int_equal(rv, CKR_OK);
+
+    rv = slot_get_list(true, NULL, &count);
+    assert_int_equal(rv, CKR_OK);
+    assert_int_equal(count, ARRAY_LEN(_ids) + 1);
+}
+
+static void *reader_main(void *arg) {
+
+    bool *stop = (bool *)arg;
+
+    while (!__atomic_load_n(stop, __ATOMIC_RELAXED)) {
+        token *t = slot_get_token(2);
+        if (!t || t->id != 2) {
+            return (void *)1;
+        }
+    }
+
+    return NULL;
+}
+
+static void test_slot_lookup_during_add(void **state) {
+    (void) state;
+
+    bool stop = false;
+    pthread_t readers[4];
+
+    size_t i;
+    for (i=0; i < ARRAY_LEN(readers); i++) {
+        assert_int_equal(pthread_create(&readers[i], NULL, reader_main, &stop), 0);
+    }
+
+    CK_RV rv = slot_add_uninit_token();
+    assert_int_equal(rv, CKR_OK);
+
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+
+    for (i=0; i < ARRAY_LEN(readers); i++) {
+        void *result = NULL;
+        pthread_join(readers[i], &result);
+        assert_null(result);
+    }
+
+    assert_non_null(slot_get_token(ARRAY_LEN(_ids) + 1));
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_slot_get_token,
+                slot_setup, slot_teardown),
+        cmocka_unit_test_setup_teardown(test_slot_get_list,
+                slot_setup, slot_teardown),
+        cmocka_unit_test_setup_teardown(test_slot_add_uninit_token,
+                slot_setup, slot_teardown),
+        cmocka_unit_test_setup_teardown(test_slot_lookup_during_add,
+                slot_setup, slot_teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,131 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <time.h>
+
+#include <cmocka.h>
+
+#include "stats.h"
+
+static void sleep_us(long us) {
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = us * 1000 };
+    nanosleep(&ts, NULL);
+}
+
+static int stats_setup(void **state) {
+    (void) state;
+
+    setenv(STATS_ENV_VAR, "/dev/null", 1);
+    stats_init();
+
+    return stats_enabled() ? 0 : -1;
+}
+
+static int stats_teardown(void **state) {
+    (void) state;
+
+    stats_finalize();
+    unsetenv(STATS_ENV_VAR);
+
+    return 0;
+}
+
+static void test_stats_disabled(void **state) {
+    (void) state;
+
+    static stats_site site = STATS_SITE_INIT("disabled");
+
+    assert_false(stats_enabled());
+
+    uint64_t start = stats_call_begin();
+    assert_int_equal(start, 0);
+    stats_call_end(&site, start, CKR_OK);
+
+    stats_snapshot snap;
+    stats_site_snapshot(&site, &snap);
+    assert_int_equal(snap.calls, 0);
+}
+
+static void test_stats_call_counts(void **state) {
+    (void) state;
+
+    static stats_site site = STATS_SITE_INIT("C_Test");
+
+    unsigned i;
+    for (i=0; i < 3; i++) {
+        uint64_t start = stats_call_begin();
+        assert_int_not_equal(start, 0);
+        stats_call_end(&site, start, i ? CKR_OK : CKR_ARGUMENTS_BAD);
+    }
+
+    stats_snapshot snap;
+    stats_site_snapshot(&site, &snap);
+    assert_int_equal(snap.calls, 3);
+    assert_int_equal(snap.errors, 1);
+
+    uint64_t samples = 0;
+    for (i=0; i < STATS_BUCKETS; i++) {
+        samples += snap.buckets[STATS_TIME_HOST][i];
+    }
+    assert_int_equal(samples, 3);
+}
+
+static void test_stats_time_split(void **state) {
+    (void) state;
+
+    static stats_site call = STATS_SITE_INIT("C_Split");
+    static stats_site cmd = STATS_SITE_INIT("Esys_Split");
+
+    unsigned i;
+    uint64_t start = stats_call_begin();
+
+    uint64_t lock_start = stats_now();
+    sleep_us(2000);
+    stats_lock_wait(lock_start);
+
+    stats_tpm_begin();
+    sleep_us(5000);
+    assert_int_equal(stats_tpm_end(&cmd, 0x101), 0x101);
+
+    stats_call_end(&call, start, CKR_OK);
+
+    stats_snapshot snap;
+    stats_site_snapshot(&cmd, &snap);
+    assert_int_equal(snap.calls, 1);
+    assert_int_equal(snap.errors, 1);
+    assert_true(snap.sum_ns[STATS_TIME_TPM] >= 5000000);
+    assert_int_equal(snap.sum_ns[STATS_TIME_HOST], 0);
+
+    stats_site_snapshot(&call, &snap);
+    assert_int_equal(snap.calls, 1);
+    assert_int_equal(snap.errors, 0);
+    assert_true(snap.sum_ns[STATS_TIME_TPM] >= 5000000);
+    assert_true(snap.sum_ns[STATS_TIME_LOCK] >= 2000000);
+    /* the waits are not counted as host time */
+    assert_true(snap.sum_ns[STATS_TIME_HOST] < snap.sum_ns[STATS_TIME_TPM]);
+
+    /* 5ms lands in the [4096, 8192) microsecond bucket or above */
+    for (i=0; i < 12; i++) {
+        assert_int_equal(snap.buckets[STATS_TIME_TPM][i], 0);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_stats_disabled),
+        cmocka_unit_test_setup_teardown(test_stats_call_counts,
+                stats_setup, stats_teardown),
+        cmocka_unit_test_setup_teardown(test_stats_time_split,
+                stats_setup, stats_teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,176 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <cmocka.h>
+
+#include <tss2/tss2_tpm2_types.h>
+
+#include "tcti-fake.h"
+#include "tcti-latency.h"
+
+static TSS2_TCTI_CONTEXT *latency_new(const char *opts, fake_tcti *child) {
+
+    size_t size = 0;
+    TSS2_RC rc = tcti_latency_init_child(NULL, &size, opts, NULL);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+
+    TSS2_TCTI_CONTEXT *ctx = calloc(1, size);
+    assert_non_null(ctx);
+
+    rc = tcti_latency_init_child(ctx, &size, opts, (TSS2_TCTI_CONTEXT *)child);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+
+    return ctx;
+}
+
+/* runs one command through the TCTI and returns how long it took */
+static uint64_t run_cmd(TSS2_TCTI_CONTEXT *ctx, uint32_t cc) {
+
+    uint8_t cmd[10] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0a,
+        cc >> 24, cc >> 16, cc >> 8, cc };
+    uint8_t rsp[4096];
+    size_t size = sizeof(rsp);
+
+    uint64_t start = fake_now_us();
+
+    TSS2_RC rc = Tss2_Tcti_Transmit(ctx, sizeof(cmd), cmd);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+
+    rc = Tss2_Tcti_Receive(ctx, &size, rsp, TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+    assert_int_equal(size, sizeof(_fake_rsp));
+    assert_memory_equal(rsp, _fake_rsp, sizeof(_fake_rsp));
+
+    return fake_now_us() - start;
+}
+
+static void test_model_parse(void **state) {
+    (void) state;
+
+    tcti_latency_model model;
+
+    /* the default profile knows Sign */
+    TSS2_RC rc = tcti_latency_model_parse(&model, NULL);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+    assert_int_equal(model.mode, tcti_latency_mode_pad);
+    assert_true(tcti_latency_model_ns(&model, TPM2_CC_Sign, 0, 0) > 0);
+
+    rc = tcti_latency_model_parse(&model,
+            "profile=none,Sign=20000,0x17b=7,sign=30000;tabrmd:bus_type=session");
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+    /* the last override wins and names are case insensitive */
+    assert_int_equal(tcti_latency_model_ns(&model, TPM2_CC_Sign, 0, 0), 30000000);
+    assert_int_equal(tcti_latency_model_ns(&model, TPM2_CC_GetRandom, 0, 0), 7000);
+    assert_int_equal(tcti_latency_model_ns(&model, TPM2_CC_Load, 0, 0), 0);
+
+    rc = tcti_latency_model_parse(&model, "byte=10,default=5,profile=none");
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+    assert_int_equal(tcti_latency_model_ns(&model, TPM2_CC_Load, 100, 20), 5000 + 1200);
+
+    /* the profile is the baseline whatever its position */
+    rc = tcti_latency_model_parse(&model, "scale=2,profile=firmware,mode=add");
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+    assert_true(model.scale == 2.0);
+    assert_int_equal(model.mode, tcti_latency_mode_add);
+}
+
+static void test_model_parse_bad(void **state) {
+    (void) state;
+
+    static const char *bad[] = {
+        "bogus",
+        "bogus=1",
+        "profile=nope",
+        "scale=fast",
+        "mode=sometimes",
+        "Sign=soon",
+        "0x=1",
+    };
+
+    tcti_latency_model model;
+
+    size_t i;
+    for (i=0; i < sizeof(bad)/sizeof(bad[0]); i++) {
+        TSS2_RC rc = tcti_latency_model_parse(&model, bad[i]);
+        assert_int_equal(rc, TSS2_TCTI_RC_BAD_VALUE);
+    }
+}
+
+static void test_pad(void **state) {
+    (void) state;
+
+    fake_tcti child;
+    fake_init(&child, 0);
+
+    TSS2_TCTI_CONTEXT *ctx = latency_new("profile=none,Sign=20000", &child);
+
+    assert_true(run_cmd(ctx, TPM2_CC_Sign) >= 20000);
+    assert_int_equal(child.cc, TPM2_CC_Sign);
+
+    /* the child's own time counts towards the modeled time */
+    child.delay_us = 10000;
+    assert_true(run_cmd(ctx, TPM2_CC_Sign) >= 20000);
+
+    Tss2_Tcti_Finalize(ctx);
+    free(ctx);
+}
+
+static void test_add(void **state) {
+    (void) state;
+
+    fake_tcti child;
+    fake_init(&child, 10000);
+
+    TSS2_TCTI_CONTEXT *ctx = latency_new("mode=add,profile=none,Sign=10000", &child);
+
+    assert_true(run_cmd(ctx, TPM2_CC_Sign) >= 20000);
+
+    Tss2_Tcti_Finalize(ctx);
+    free(ctx);
+}
+
+static void test_bad_context(void **state) {
+    (void) state;
+
+    size_t size = 0;
+    TSS2_RC rc = tcti_latency_init_child(NULL, NULL, NULL, NULL);
+    assert_int_equal(rc, TSS2_TCTI_RC_BAD_REFERENCE);
+
+    rc = tcti_latency_init_child(NULL, &size, NULL, NULL);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+
+    TSS2_TCTI_CONTEXT *ctx = calloc(1, size);
+    assert_non_null(ctx);
+
+    size_t small = size - 1;
+    fake_tcti child;
+    fake_init(&child, 0);
+    rc = tcti_latency_init_child(ctx, &small, NULL, (TSS2_TCTI_CONTEXT *)&child);
+    assert_int_equal(rc, TSS2_TCTI_RC_INSUFFICIENT_BUFFER);
+
+    rc = tcti_latency_init_child(ctx, &size, "scale=fast", (TSS2_TCTI_CONTEXT *)&child);
+    assert_int_equal(rc, TSS2_TCTI_RC_BAD_VALUE);
+
+    free(ctx);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_model_parse),
+        cmocka_unit_test(test_model_parse_bad),
+        cmocka_unit_test(test_pad),
+        cmocka_unit_test(test_add),
+        cmocka_unit_test(test_bad_context),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
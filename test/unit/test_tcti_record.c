@@ -0,0 +1,150 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <unistd.h>
+
+#include <cmocka.h>
+
+#include <tss2/tss2_tpm2_types.h>
+
+#include "tcti-fake.h"
+#include "tcti-recording.h"
+
+static char _dir[] = "/tmp/test_tcti_record_XXXXXX";
+
+static int dir_setup(void **state) {
+    (void) state;
+    return mkdtemp(_dir) ? 0 : -1;
+}
+
+static int dir_teardown(void **state) {
+    (void) state;
+    return rmdir(_dir);
+}
+
+static void test_record(void **state) {
+    (void) state;
+
+    fake_tcti child;
+    fake_init(&child, 2000);
+
+    char opts[128];
+    snprintf(opts, sizeof(opts), "file=%s/rec-%%p;ignored:child", _dir);
+
+    size_t size = 0;
+    TSS2_RC rc = tcti_record_init_child(NULL, &size, opts, NULL);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+
+    TSS2_TCTI_CONTEXT *ctx = calloc(1, size);
+    assert_non_null(ctx);
+
+    rc = tcti_record_init_child(ctx, &size, opts, (TSS2_TCTI_CONTEXT *)&child);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+
+    static const uint32_t ccs[] = { TPM2_CC_GetRandom, TPM2_CC_Sign };
+
+    unsigned i;
+    for (i=0; i < 2; i++) {
+        uint32_t cc = ccs[i];
+        uint8_t cmd[12] = { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0c,
+            cc >> 24, cc >> 16, cc >> 8, cc, 0x00, i };
+        uint8_t rsp[64];
+
+        rc = Tss2_Tcti_Transmit(ctx, sizeof(cmd), cmd);
+        assert_int_equal(rc, TSS2_RC_SUCCESS);
+        assert_int_equal(child.cc, cc);
+
+        /* a size query records nothing */
+        size_t rsp_size = 0;
+        rc = Tss2_Tcti_Receive(ctx, &rsp_size, NULL, TSS2_TCTI_TIMEOUT_BLOCK);
+        assert_int_equal(rc, TSS2_RC_SUCCESS);
+        assert_int_equal(rsp_size, sizeof(_fake_rsp));
+
+        rsp_size = sizeof(rsp);
+        rc = Tss2_Tcti_Receive(ctx, &rsp_size, rsp, TSS2_TCTI_TIMEOUT_BLOCK);
+        assert_int_equal(rc, TSS2_RC_SUCCESS);
+        assert_memory_equal(rsp, _fake_rsp, sizeof(_fake_rsp));
+    }
+
+    Tss2_Tcti_Finalize(ctx);
+    free(ctx);
+
+    char path[128];
+    snprintf(path, sizeof(path), "%s/rec-%ld", _dir, (long)getpid());
+
+    recording r;
+    rc = recording_load(path, &r);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+    assert_int_equal(r.len, 2);
+
+    for (i=0; i < 2; i++) {
+        recording_entry *e = &r.entries[i];
+        assert_int_equal(e->cc, ccs[i]);
+        assert_int_equal(e->cmd_len, 12);
+        assert_int_equal(e->cmd[11], i);
+        assert_int_equal(e->rsp_len, sizeof(_fake_rsp));
+        assert_memory_equal(e->rsp, _fake_rsp, sizeof(_fake_rsp));
+        assert_true(e->received_ns - e->sent_ns >= 2000000);
+    }
+    assert_true(r.entries[1].sent_ns >= r.entries[0].received_ns);
+
+    recording_free(&r);
+    unlink(path);
+}
+
+static void test_record_no_file(void **state) {
+    (void) state;
+
+    fake_tcti child;
+    fake_init(&child, 0);
+
+    size_t size = 0;
+    TSS2_RC rc = tcti_record_init_child(NULL, &size, NULL, NULL);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+
+    TSS2_TCTI_CONTEXT *ctx = calloc(1, size);
+    assert_non_null(ctx);
+
+    rc = tcti_record_init_child(ctx, &size, "scale=1", (TSS2_TCTI_CONTEXT *)&child);
+    assert_int_equal(rc, TSS2_TCTI_RC_BAD_VALUE);
+
+    rc = tcti_record_init_child(ctx, &size, "file=/nonexistent/dir/rec",
+            (TSS2_TCTI_CONTEXT *)&child);
+    assert_int_equal(rc, TSS2_TCTI_RC_BAD_VALUE);
+
+    free(ctx);
+}
+
+static void test_recording_opt(void **state) {
+    (void) state;
+
+    char *v = recording_opt("a=1,file=/x/y,scale=0.5;dev:file=no", "file");
+    assert_string_equal(v, "/x/y");
+    free(v);
+
+    v = recording_opt("a=1,file=/x/y,scale=0.5;dev:file=no", "scale");
+    assert_string_equal(v, "0.5");
+    free(v);
+
+    assert_null(recording_opt("files=1;file=2", "file"));
+    assert_null(recording_opt(NULL, "file"));
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_record),
+        cmocka_unit_test(test_record_no_file),
+        cmocka_unit_test(test_recording_opt),
+    };
+
+    return cmocka_run_group_tests(tests, dir_setup, dir_teardown);
+}
@@ -0,0 +1,271 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <unistd.h>
+
+#include <cmocka.h>
+
+#include <tss2/tss2_tpm2_types.h>
+
+#include "tcti-fake.h"
+#include "tcti-recording.h"
+
+static char _path[] = "/tmp/test_tcti_replay_XXXXXX";
+
+#define CMD(cc) { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0a, \
+    ((cc) >> 24) & 0xff, ((cc) >> 16) & 0xff, ((cc) >> 8) & 0xff, (cc) & 0xff }
+
+/*
+ * GetRandom answered in 1ms with 0x11 and Sign in 20ms with 0x22 then
+ * 30ms with 0x33 after it.
+ */
+static int recording_setup(void **state) {
+    (void) state;
+
+    int fd = mkstemp(_path);
+    if (fd < 0) {
+        return -1;
+    }
+
+    FILE *f = fdopen(fd, "w");
+    if (!f) {
+        close(fd);
+        return -1;
+    }
+
+    fprintf(f, RECORDING_MAGIC "\n# a comment\n");
+
+    uint8_t cmds[3][10] = {
+        CMD(TPM2_CC_GetRandom), CMD(TPM2_CC_Sign), CMD(TPM2_CC_Sign)
+    };
+    uint8_t rsps[3][1] = { { 0x11 }, { 0x22 }, { 0x33 } };
+    uint64_t times[3][2] = {
+        { 1000, 1001000 }, { 2000000, 22000000 }, { 23000000, 53000000 }
+    };
+
+    bool ok = true;
+    unsigned i;
+    for (i=0; i < 3; i++) {
+        recording_entry e = {
+            .sent_ns = times[i][0],
+            .received_ns = times[i][1],
+            .cmd = cmds[i],
+            .cmd_len = sizeof(cmds[i]),
+            .rsp = rsps[i],
+            .rsp_len = sizeof(rsps[i]),
+        };
+        ok &= recording_write(f, &e);
+    }
+
+    fclose(f);
+    return ok ? 0 : -1;
+}
+
+static int recording_teardown(void **state) {
+    (void) state;
+    return unlink(_path);
+}
+
+static TSS2_TCTI_CONTEXT *replay_new(const char *extra, fake_tcti *child) {
+
+    char opts[128];
+    snprintf(opts, sizeof(opts), "file=%s%s", _path, extra);
+
+    size_t size = 0;
+    TSS2_RC rc = tcti_replay_init_child(NULL, &size, opts, NULL);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+
+    TSS2_TCTI_CONTEXT *ctx = calloc(1, size);
+    assert_non_null(ctx);
+
+    rc = tcti_replay_init_child(ctx, &size, opts, (TSS2_TCTI_CONTEXT *)child);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+
+    return ctx;
+}
+
+static TSS2_RC run_cmd(TSS2_TCTI_CONTEXT *ctx, uint32_t cc, uint8_t *rsp,
+        size_t *rsp_size, uint64_t *us) {
+
+    uint8_t cmd[10] = CMD(cc);
+
+    uint64_t start = fake_now_us();
+
+    TSS2_RC rc = Tss2_Tcti_Transmit(ctx, sizeof(cmd), cmd);
+    if (rc == TSS2_RC_SUCCESS) {
+        rc = Tss2_Tcti_Receive(ctx, rsp_size, rsp, TSS2_TCTI_TIMEOUT_BLOCK);
+    }
+
+    *us = fake_now_us() - start;
+
+    return rc;
+}
+
+static void test_replay_serve(void **state) {
+    (void) state;
+
+    TSS2_TCTI_CONTEXT *ctx = replay_new("", NULL);
+
+    uint8_t rsp[16];
+    size_t size = sizeof(rsp);
+    uint64_t us;
+
+    TSS2_RC rc = run_cmd(ctx, TPM2_CC_GetRandom, rsp, &size, &us);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+    assert_int_equal(size, 1);
+    assert_int_equal(rsp[0], 0x11);
+    assert_true(us >= 1000);
+
+    size = sizeof(rsp);
+    rc = run_cmd(ctx, TPM2_CC_Sign, rsp, &size, &us);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+    assert_int_equal(rsp[0], 0x22);
+    assert_true(us >= 20000);
+
+    /* out of order commands are refused */
+    size = sizeof(rsp);
+    rc = run_cmd(ctx, TPM2_CC_Load, rsp, &size, &us);
+    assert_int_equal(rc, TSS2_TCTI_RC_BAD_SEQUENCE);
+
+    size = sizeof(rsp);
+    rc = run_cmd(ctx, TPM2_CC_Sign, rsp, &size, &us);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+    assert_int_equal(rsp[0], 0x33);
+
+    /* and so is running past the end */
+    size = sizeof(rsp);
+    rc = run_cmd(ctx, TPM2_CC_Sign, rsp, &size, &us);
+    assert_int_equal(rc, TSS2_TCTI_RC_BAD_SEQUENCE);
+
+    Tss2_Tcti_Finalize(ctx);
+    free(ctx);
+}
+
+static void test_replay_scale(void **state) {
+    (void) state;
+
+    TSS2_TCTI_CONTEXT *ctx = replay_new(",scale=0", NULL);
+
+    uint8_t rsp[16];
+    size_t size = sizeof(rsp);
+    uint64_t us;
+
+    TSS2_RC rc = run_cmd(ctx, TPM2_CC_GetRandom, rsp, &size, &us);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+
+    Tss2_Tcti_Finalize(ctx);
+    free(ctx);
+
+    ctx = replay_new(",scale=2", NULL);
+
+    size = sizeof(rsp);
+    rc = run_cmd(ctx, TPM2_CC_GetRandom, rsp, &size, &us);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+    assert_true(us >= 2000);
+
+    /* a polling caller is told to retry until the scaled time is up */
+    uint8_t cmd[10] = CMD(TPM2_CC_Sign);
+    rc = Tss2_Tcti_Transmit(ctx, sizeof(cmd), cmd);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+
+    size = sizeof(rsp);
+    rc = Tss2_Tcti_Receive(ctx, &size, rsp, 1);
+    assert_int_equal(rc, TSS2_TCTI_RC_TRY_AGAIN);
+
+    size = 0;
+    rc = Tss2_Tcti_Receive(ctx, &size, rsp, TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal(rc, TSS2_TCTI_RC_INSUFFICIENT_BUFFER);
+    assert_int_equal(size, 1);
+
+    rc = Tss2_Tcti_Receive(ctx, &size, rsp, TSS2_TCTI_TIMEOUT_BLOCK);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+    assert_int_equal(rsp[0], 0x22);
+
+    Tss2_Tcti_Finalize(ctx);
+    free(ctx);
+}
+
+static void test_replay_child(void **state) {
+    (void) state;
+
+    fake_tcti child;
+    fake_init(&child, 0);
+
+    TSS2_TCTI_CONTEXT *ctx = replay_new("", &child);
+
+    uint8_t rsp[16];
+    uint64_t us;
+
+    /* the child answers, the recording sets the pace, cycling per code */
+    uint64_t expect_us[] = { 20000, 30000, 20000 };
+    unsigned i;
+    for (i=0; i < 3; i++) {
+        size_t size = sizeof(rsp);
+        TSS2_RC rc = run_cmd(ctx, TPM2_CC_Sign, rsp, &size, &us);
+        assert_int_equal(rc, TSS2_RC_SUCCESS);
+        assert_int_equal(child.cc, TPM2_CC_Sign);
+        assert_memory_equal(rsp, _fake_rsp, sizeof(_fake_rsp));
+        assert_true(us >= expect_us[i]);
+    }
+
+    /* commands that were never recorded go at the child's pace */
+    size_t size = sizeof(rsp);
+    TSS2_RC rc = run_cmd(ctx, TPM2_CC_Load, rsp, &size, &us);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+
+    Tss2_Tcti_Finalize(ctx);
+    free(ctx);
+}
+
+static void test_replay_bad_file(void **state) {
+    (void) state;
+
+    size_t size = 0;
+    TSS2_RC rc = tcti_replay_init_child(NULL, &size, NULL, NULL);
+    assert_int_equal(rc, TSS2_RC_SUCCESS);
+
+    TSS2_TCTI_CONTEXT *ctx = calloc(1, size);
+    assert_non_null(ctx);
+
+    rc = tcti_replay_init_child(ctx, &size, "scale=1", NULL);
+    assert_int_equal(rc, TSS2_TCTI_RC_BAD_VALUE);
+
+    rc = tcti_replay_init_child(ctx, &size, "file=/nonexistent", NULL);
+    assert_int_equal(rc, TSS2_TCTI_RC_IO_ERROR);
+
+    char path[] = "/tmp/test_tcti_replay_bad_XXXXXX";
+    int fd = mkstemp(path);
+    assert_true(fd >= 0);
+    FILE *f = fdopen(fd, "w");
+    assert_non_null(f);
+    fprintf(f, RECORDING_MAGIC "\n0 10 80010000000a0000015d zz\n");
+    fclose(f);
+
+    char opts[64];
+    snprintf(opts, sizeof(opts), "file=%s", path);
+    rc = tcti_replay_init_child(ctx, &size, opts, NULL);
+    assert_int_equal(rc, TSS2_TCTI_RC_BAD_VALUE);
+
+    unlink(path);
+    free(ctx);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_replay_serve),
+        cmocka_unit_test(test_replay_scale),
+        cmocka_unit_test(test_replay_child),
+        cmocka_unit_test(test_replay_bad_file),
+    };
+
+    return cmocka_run_group_tests(tests, recording_setup, recording_teardown);
+}
@@ -0,0 +1,129 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include "config.h"
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <cmocka.h>
+
+#include "trace.h"
+
+static char *dump(void) {
+
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&buf, &len);
+    assert_non_null(f);
+
+    trace_ring_dump(f);
+    fclose(f);
+
+    assert_non_null(buf);
+    return buf;
+}
+
+static unsigned count(const char *haystack, const char *needle) {
+
+    unsigned n = 0;
+    const char *p = haystack;
+    while ((p = strstr(p, needle))) {
+        n++;
+        p += strlen(needle);
+    }
+
+    return n;
+}
+
+static int trace_setup(void **state) {
+    (void) state;
+
+    setenv(TRACE_ENV_VAR, "/dev/null", 1);
+    trace_init();
+
+    return trace_ring_enabled() ? 0 : -1;
+}
+
+static int trace_teardown(void **state) {
+    (void) state;
+
+    trace_finalize();
+    unsetenv(TRACE_ENV_VAR);
+
+    return 0;
+}
+
+static void test_trace_ring_dump(void **state) {
+    (void) state;
+
+    TRACE(esys_begin, "Esys_\"Sign\"", 0);
+    TRACE(esys_end, "Esys_\"Sign\"", 0x101);
+
+    char *json = dump();
+
+    assert_true(!strncmp(json, "{\"traceEvents\":[", 16));
+    assert_non_null(strstr(json, "\"name\":\"Esys_\\\"Sign\\\"\""));
+    assert_non_null(strstr(json, "\"cat\":\"esys_begin\",\"ph\":\"B\""));
+    assert_non_null(strstr(json, "\"cat\":\"esys_end\",\"ph\":\"E\""));
+    assert_non_null(strstr(json, "\"args\":{\"arg\":257}"));
+
+    free(json);
+}
+
+static void test_trace_ring_wraps(void **state) {
+    (void) state;
+
+    unsigned i;
+    for (i=0; i < TRACE_RING_SIZE + 10; i++) {
+        TRACE(db_stmt_begin, NULL, i);
+    }
+
+    char *json = dump();
+
+    /* only the newest TRACE_RING_SIZE events survive, the first 10 are gone */
+    assert_null(strstr(json, "{\"arg\":9}"));
+    assert_non_null(strstr(json, "{\"arg\":10}"));
+    assert_int_equal(count(json, "\"cat\":\"db_stmt_begin\""), TRACE_RING_SIZE);
+
+    free(json);
+}
+
+static void test_trace_disabled(void **state) {
+    (void) state;
+
+    assert_false(trace_ring_enabled());
+
+    char *before = dump();
+
+    TRACE(object_load_begin, NULL, 42);
+
+    char *after = dump();
+    assert_string_equal(before, after);
+
+    free(before);
+    free(after);
+}
+
+int main(int argc, char* argv[]) {
+    (void) argc;
+    (void) argv;
+
+#ifndef ENABLE_TRACING
+    /* trace points are compiled out, tell automake to skip */
+    return 77;
+#endif
+
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_trace_ring_dump,
+                trace_setup, trace_teardown),
+        cmocka_unit_test_setup_teardown(test_trace_ring_wraps,
+                trace_setup, trace_teardown),
+        cmocka_unit_test(test_trace_disabled),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
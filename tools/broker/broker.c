@@ -0,0 +1,288 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * tpm2-pkcs11-broker: serves the PKCS11 library to modules in broker
+ * client mode, see src/lib/broker.h. Clients start it on demand and it
+ * exits once it served no connection for the idle timeout.
+ */
+#define _GNU_SOURCE
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "broker.h"
+#include "pkcs11.h"
+
+#define DEFAULT_IDLE_TIMEOUT 60
+
+static volatile sig_atomic_t _stop;
+
+static pthread_mutex_t _lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned _connections;
+
+typedef struct connection connection;
+struct connection {
+    broker_server *server;
+    int fd;
+};
+
+static void on_signal(int sig) {
+    (void)sig;
+    _stop = 1;
+}
+
+static void *serve_thread(void *arg) {
+
+    connection *c = (connection *)arg;
+    broker_server_serve(c->server, c->fd);
+    free(c);
+
+    pthread_mutex_lock(&_lock);
+    _connections--;
+    pthread_mutex_unlock(&_lock);
+
+    return NULL;
+}
+
+static bool serve(broker_server *server, int fd) {
+
+    connection *c = calloc(1, sizeof(*c));
+    if (!c) {
+        close(fd);
+        return false;
+    }
+
+    c->server = server;
+    c->fd = fd;
+
+    pthread_mutex_lock(&_lock);
+    _connections++;
+    pthread_mutex_unlock(&_lock);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t thread;
+    int rc = pthread_create(&thread, &attr, serve_thread, c);
+    pthread_attr_destroy(&attr);
+    if (rc) {
+        fprintf(stderr, "Could not start a thread: %s\n", strerror(rc));
+        pthread_mutex_lock(&_lock);
+        _connections--;
+        pthread_mutex_unlock(&_lock);
+        close(fd);
+        free(c);
+        return false;
+    }
+
+    return true;
+}
+
+static int listen_on(const char *path) {
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Could not create the socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+
+    /* the lock is held, whatever is there was left by a dead broker */
+    unlink(path);
+
+    mode_t old = umask(0077);
+    int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old);
+    if (rc || chmod(path, 0600) || listen(fd, SOMAXCONN)) {
+        fprintf(stderr, "Could not listen on \"%s\": %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void show_help(const char *name) {
+
+    printf("Usage: %s [options]\n"
+           "Serves the tpm2-pkcs11 library to modules in broker client mode.\n"
+           "\n"
+           "Options:\n"
+           "    -s, --socket=PATH         The socket to listen on, the default socket\n"
+           "                              of the clients otherwise.\n"
+           "    -t, --idle-timeout=SEC    Exit after SEC seconds without connections,\n"
+           "                              0 never exits, %u by default.\n"
+           "    -h, --help                Show this help.\n",
+           name, DEFAULT_IDLE_TIMEOUT);
+}
+
+int main(int argc, char *argv[]) {
+
+    const char *socket_path = NULL;
+    unsigned long idle_timeout = DEFAULT_IDLE_TIMEOUT;
+
+    static struct option long_opts[] = {
+        { "help", no_argument, NULL, 'h' },
+        { "idle-timeout", required_argument, NULL, 't' },
+        { "socket", required_argument, NULL, 's' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hs:t:", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            show_help(argv[0]);
+            return 0;
+
+        case 's':
+            socket_path = optarg;
+            break;
+
+        case 't': {
+            char *end = NULL;
+            errno = 0;
+            idle_timeout = strtoul(optarg, &end, 0);
+            if (errno || !end || *end || optarg[0] == '-') {
+                fprintf(stderr, "Invalid idle timeout \"%s\"\n", optarg);
+                return 1;
+            }
+        } break;
+
+        default:
+            show_help(argv[0]);
+            return 1;
+        }
+    }
+
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    if (socket_path) {
+        if (strlen(socket_path) >= sizeof(path)) {
+            fprintf(stderr, "The socket path \"%s\" is too long\n", socket_path);
+            return 1;
+        }
+        strcpy(path, socket_path);
+    } else if (!broker_socket_path(path, sizeof(path))) {
+        fprintf(stderr, "The socket path is too long\n");
+        return 1;
+    }
+
+    /* the library in here serves in process */
+    unsetenv(BROKER_ENV_VAR);
+
+    /* one broker per socket, a second one started by a racing client exits */
+    char lock_path[sizeof(path) + 8];
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (lock_fd < 0) {
+        fprintf(stderr, "Could not open \"%s\": %s\n", lock_path, strerror(errno));
+        return 1;
+    }
+
+    if (flock(lock_fd, LOCK_EX | LOCK_NB)) {
+        close(lock_fd);
+        return 0;
+    }
+
+    CK_FUNCTION_LIST_PTR p11 = NULL;
+    CK_RV rv = C_GetFunctionList(&p11);
+    if (rv != CKR_OK) {
+        fprintf(stderr, "C_GetFunctionList failed: 0x%lx\n", rv);
+        return 1;
+    }
+
+    CK_C_INITIALIZE_ARGS args = { .flags = CKF_OS_LOCKING_OK };
+    rv = p11->C_Initialize(&args);
+    if (rv != CKR_OK) {
+        fprintf(stderr, "C_Initialize failed: 0x%lx\n", rv);
+        return 1;
+    }
+
+    int rc = 1;
+    broker_server *server = NULL;
+    int fd = listen_on(path);
+    if (fd < 0) {
+        goto out;
+    }
+
+    server = broker_server_new(p11);
+    if (!server) {
+        fprintf(stderr, "oom\n");
+        goto out;
+    }
+
+    struct sigaction sa = { .sa_handler = on_signal };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    unsigned long idle = 0;
+    while (!_stop) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int n = poll(&pfd, 1, 1000);
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            goto out;
+        }
+
+        if (n > 0) {
+            int client = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+            if (client >= 0) {
+                serve(server, client);
+            }
+            idle = 0;
+            continue;
+        }
+
+        pthread_mutex_lock(&_lock);
+        bool busy = _connections > 0;
+        pthread_mutex_unlock(&_lock);
+
+        idle = busy ? 0 : idle + 1;
+        if (idle_timeout && idle >= idle_timeout) {
+            break;
+        }
+    }
+
+    rc = 0;
+
+out:
+    /* stop taking connections before the library goes */
+    if (fd >= 0) {
+        close(fd);
+        unlink(path);
+    }
+
+    /*
+     * Threads still serving hold the server, the process exits with them.
+     * C_Finalize is only safe without them.
+     */
+    pthread_mutex_lock(&_lock);
+    bool busy = _connections > 0;
+    pthread_mutex_unlock(&_lock);
+
+    if (!busy) {
+        p11->C_Finalize(NULL);
+        broker_server_free(server);
+    }
+
+    close(lock_fd);
+
+    return rc;
+}
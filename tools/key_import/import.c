@@ -22,10 +22,16 @@
  */
 
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <openssl/objects.h>
 
@@ -374,6 +380,609 @@ c_generate_keypair(CK_SESSION_HANDLE session,
     return 0;
 }
 
+static int
+key_mech_from_public(const TPMT_PUBLIC *pub, CK_MECHANISM *mech, uint8_t **ec_params) {
+
+    switch (pub->type) {
+    case TPM2_ALG_RSA:
+        mech->mechanism = CKM_RSA_PKCS_KEY_PAIR_GEN;
+        return 0;
+    case TPM2_ALG_ECC:
+        mech->mechanism = CKM_EC_KEY_PAIR_GEN;
+        return tpm2_ec_alg_to_asn1(pub->parameters.eccDetail.curveID, ec_params);
+    default:
+        PRINT_E("The given TPM key type is not supported.");
+        return -1;
+    }
+}
+
+static CK_BBOOL ck_true = CK_TRUE;
+
+/* The key pair templates handed to C_GenerateKeyPair */
+typedef struct key_templates key_templates;
+struct key_templates {
+    unsigned long tpm2_handle;
+    uint8_t      *ec_params;
+    CK_MECHANISM  mech;
+    CK_ATTRIBUTE  pub_attrs[4];
+    CK_ULONG      pub_count;
+    CK_ATTRIBUTE  priv_attrs[5];
+    CK_ULONG      priv_count;
+};
+
+/*
+ * Builds the templates of a key that is either a persistent handle or a
+ * pair of blobs. The attributes point at the given label, auth and blobs,
+ * which must outlive the templates. ec_params is owned by t and is freed by
+ * the caller.
+ */
+static int
+key_templates_build(key_templates     *t,
+                    char              *label,
+                    char              *auth,
+                    TPM2_HANDLE        persistent_handle,
+                    uint8_t           *pub_blob,
+                    size_t             pub_sz,
+                    uint8_t           *priv_blob,
+                    size_t             priv_sz,
+                    const TPMT_PUBLIC *pub) {
+
+    int      pub_ind = 0;
+    int      priv_ind = 0;
+    CK_ULONG label_len = strlen(label);
+
+    t->mech.pParameter = NULL;
+    t->mech.ulParameterLen = 0;
+    int ec_params_len = key_mech_from_public(pub, &t->mech, &t->ec_params);
+    if (ec_params_len < 0 || (pub->type == TPM2_ALG_ECC && (!ec_params_len || !t->ec_params))) {
+        return 1;
+    }
+
+    ADD_ATTR(&t->pub_attrs[pub_ind++], CKA_ID, label_len, label);
+    ADD_ATTR(&t->pub_attrs[pub_ind++], CKA_LABEL, label_len, label);
+
+    ADD_ATTR(&t->priv_attrs[priv_ind++], CKA_ID, label_len, label);
+    ADD_ATTR(&t->priv_attrs[priv_ind++], CKA_LABEL, label_len, label);
+    ADD_ATTR(&t->priv_attrs[priv_ind++], CKA_SENSITIVE, sizeof(ck_true), &ck_true);
+    if (auth && auth[0]) {
+        ADD_ATTR(&t->priv_attrs[priv_ind++], CKA_TPM2_OBJAUTH, strlen(auth), auth);
+    }
+
+    if (persistent_handle) {
+        t->tpm2_handle = persistent_handle;
+        ADD_ATTR(&t->pub_attrs[pub_ind++], CKA_TPM2_PERSISTENT_HANDLE, sizeof(t->tpm2_handle),
+                 &t->tpm2_handle);
+        ADD_ATTR(&t->priv_attrs[priv_ind++], CKA_TPM2_PERSISTENT_HANDLE,
+                 sizeof(t->tpm2_handle), &t->tpm2_handle);
+    } else {
+        ADD_ATTR(&t->pub_attrs[pub_ind++], CKA_TPM2_PUB_BLOB, pub_sz, pub_blob);
+        ADD_ATTR(&t->priv_attrs[priv_ind++], CKA_TPM2_PRIV_BLOB, priv_sz, priv_blob);
+    }
+
+    if (t->ec_params) {
+        ADD_ATTR(&t->pub_attrs[pub_ind++], CKA_EC_PARAMS, ec_params_len, t->ec_params);
+    }
+
+    assert(pub_ind <= ARRAY_LEN(t->pub_attrs));
+    assert(priv_ind <= ARRAY_LEN(t->priv_attrs));
+
+    t->pub_count = pub_ind;
+    t->priv_count = priv_ind;
+
+    return 0;
+}
+
+/*
+ * Batch mode: imports every key of a directory or a manifest with one
+ * library session. The host side work of each key, reading and unmarshaling
+ * the blobs and building the templates, runs on a pool of worker threads
+ * while the main thread hands the prepared keys to the library in order.
+ * A key that fails is reported and the batch goes on.
+ */
+#define BATCH_MAX_JOBS 64
+
+typedef struct key_job key_job;
+struct key_job {
+    /* From the manifest */
+    char       *label;
+    char       *pub_path;
+    char       *priv_path;
+    char       *auth;
+    TPM2_HANDLE persistent_handle;
+
+    /* Prepared by the workers */
+    uint8_t      *pub_blob;
+    size_t        pub_sz;
+    uint8_t      *priv_blob;
+    size_t        priv_sz;
+    TPM2B_PUBLIC  pub;
+    key_templates tmpl;
+    char          error[256];
+    bool          ready;
+};
+
+typedef struct batch batch;
+struct batch {
+    key_job        *jobs;
+    size_t          count;
+    size_t          next;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+};
+
+#define JOB_ERROR(j, ...) snprintf((j)->error, sizeof((j)->error), __VA_ARGS__)
+
+static void
+key_job_free(key_job *j) {
+    free(j->label);
+    free(j->pub_path);
+    free(j->priv_path);
+    free(j->auth);
+    free(j->pub_blob);
+    free(j->priv_blob);
+    free(j->tmpl.ec_params);
+}
+
+static int
+batch_add(batch *b, size_t *cap, const char *label, const char *pub_path,
+          const char *priv_path, const char *auth, TPM2_HANDLE handle) {
+
+    if (b->count == *cap) {
+        size_t   newcap = *cap ? *cap * 2 : 64;
+        key_job *jobs = realloc(b->jobs, newcap * sizeof(*jobs));
+        if (!jobs) {
+            PRINT_E("realloc has failed");
+            return 1;
+        }
+        b->jobs = jobs;
+        *cap = newcap;
+    }
+
+    key_job *j = &b->jobs[b->count];
+    memset(j, 0, sizeof(*j));
+    j->persistent_handle = handle;
+    j->label = strdup(label);
+    j->pub_path = pub_path ? strdup(pub_path) : NULL;
+    j->priv_path = priv_path ? strdup(priv_path) : NULL;
+    j->auth = auth ? strdup(auth) : NULL;
+    if (!j->label || (pub_path && !j->pub_path) || (priv_path && !j->priv_path)
+        || (auth && !j->auth)) {
+        PRINT_E("strdup has failed");
+        key_job_free(j);
+        return 1;
+    }
+
+    b->count++;
+    return 0;
+}
+
+static char *
+read_line_file(const char *path) {
+
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return NULL;
+    }
+
+    char   *line = NULL;
+    size_t  n = 0;
+    ssize_t len = getline(&line, &n, f);
+    fclose(f);
+    if (len < 0) {
+        free(line);
+        return strdup("");
+    }
+
+    line[strcspn(line, "\r\n")] = '\0';
+    return line;
+}
+
+static int
+path_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * A directory holds a <label>.pub and <label>.priv pair per key, with the
+ * key auth in an optional <label>.auth file.
+ */
+static int
+batch_from_dir(batch *b, const char *dir) {
+
+    int    ret = 1;
+    size_t cap = 0;
+    char **stems = NULL;
+    size_t nstems = 0;
+    size_t stemcap = 0;
+
+    DIR *d = opendir(dir);
+    if (!d) {
+        PRINT_E("Could not open the directory \"%s\": %s", dir, strerror(errno));
+        return 1;
+    }
+
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        size_t len = strlen(e->d_name);
+        if (len <= 4 || strcmp(&e->d_name[len - 4], ".pub")) {
+            continue;
+        }
+
+        if (nstems == stemcap) {
+            stemcap = stemcap ? stemcap * 2 : 64;
+            char **tmp = realloc(stems, stemcap * sizeof(*stems));
+            if (!tmp) {
+                PRINT_E("realloc has failed");
+                goto out;
+            }
+            stems = tmp;
+        }
+
+        stems[nstems] = strndup(e->d_name, len - 4);
+        if (!stems[nstems]) {
+            PRINT_E("strndup has failed");
+            goto out;
+        }
+        nstems++;
+    }
+
+    /* import in a stable order */
+    qsort(stems, nstems, sizeof(*stems), path_cmp);
+
+    for (size_t i = 0; i < nstems; i++) {
+        size_t len = strlen(dir) + strlen(stems[i]) + sizeof("/.priv");
+        char   pub_path[len], priv_path[len], auth_path[len];
+        snprintf(pub_path, len, "%s/%s.pub", dir, stems[i]);
+        snprintf(priv_path, len, "%s/%s.priv", dir, stems[i]);
+        snprintf(auth_path, len, "%s/%s.auth", dir, stems[i]);
+
+        if (access(priv_path, F_OK)) {
+            /* a public key without a private part is not a key to import */
+            continue;
+        }
+
+        char *auth = read_line_file(auth_path);
+        int   rc = batch_add(b, &cap, stems[i], pub_path, priv_path, auth, 0);
+        free(auth);
+        if (rc) {
+            goto out;
+        }
+    }
+
+    ret = 0;
+
+out:
+    closedir(d);
+    for (size_t i = 0; i < nstems; i++) {
+        free(stems[i]);
+    }
+    free(stems);
+    return ret;
+}
+
+static int
+parse_persistent_handle(const char *s, TPM2_HANDLE *handle) {
+
+    if (strlen(s) != 10 || strncmp(s, "0x", 2)) {
+        return 1;
+    }
+
+    char         *end = NULL;
+    unsigned long h = strtoul(s, &end, 16);
+    if (*end || h < TPM2_PERSISTENT_FIRST || h > TPM2_PERSISTENT_LAST) {
+        return 1;
+    }
+
+    *handle = (TPM2_HANDLE)h;
+    return 0;
+}
+
+/*
+ * A manifest has a line per key, blank lines and lines starting with '#'
+ * are skipped:
+ *   <label> <public file> <private file> [<key auth>]
+ *   <label> <persistent handle> [<key auth>]
+ */
+static int
+batch_from_manifest(batch *b, const char *path) {
+
+    int     ret = 1;
+    size_t  cap = 0;
+    char   *line = NULL;
+    size_t  n = 0;
+    unsigned lineno = 0;
+
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        PRINT_E("Could not open the file \"%s\": %s", path, strerror(errno));
+        return 1;
+    }
+
+    while (getline(&line, &n, f) >= 0) {
+        lineno++;
+
+        char *save = NULL;
+        char *tok[5] = { 0 };
+        size_t ntok = 0;
+        char *t = strtok_r(line, " \t\r\n", &save);
+        while (t && ntok < ARRAY_LEN(tok)) {
+            tok[ntok++] = t;
+            t = strtok_r(NULL, " \t\r\n", &save);
+        }
+
+        if (!ntok || tok[0][0] == '#') {
+            continue;
+        }
+
+        TPM2_HANDLE handle = 0;
+        int         rc;
+        if (ntok >= 2 && !strncmp(tok[1], "0x", 2)) {
+            if (ntok > 3 || parse_persistent_handle(tok[1], &handle)) {
+                PRINT_E("%s:%u: expecting: <label> <persistent handle> [<key auth>]", path,
+                        lineno);
+                goto out;
+            }
+            rc = batch_add(b, &cap, tok[0], NULL, NULL, tok[2], handle);
+        } else {
+            if (ntok < 3 || ntok > 4) {
+                PRINT_E("%s:%u: expecting: <label> <public> <private> [<key auth>]", path,
+                        lineno);
+                goto out;
+            }
+            rc = batch_add(b, &cap, tok[0], tok[1], tok[2], tok[3], 0);
+        }
+
+        if (rc) {
+            goto out;
+        }
+    }
+
+    ret = 0;
+
+out:
+    free(line);
+    fclose(f);
+    return ret;
+}
+
+static int
+key_job_read_blob(key_job *j, const char *path, size_t max, uint8_t **blob, size_t *sz) {
+
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        JOB_ERROR(j, "Could not open the file \"%s\": %s", path, strerror(errno));
+        return 1;
+    }
+
+    int ret = 1;
+    *blob = calloc(1, max);
+    if (!*blob) {
+        JOB_ERROR(j, "calloc has failed");
+        goto out;
+    }
+
+    *sz = fread(*blob, 1, max, f);
+    if (!feof(f)) {
+        JOB_ERROR(j, "Failed to read from \"%s\"", path);
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    fclose(f);
+    return ret;
+}
+
+/* Everything that needs no TPM, safe to run on any thread */
+static void
+key_job_prepare(key_job *j) {
+
+    TSS2_RC rc;
+    size_t  offset = 0;
+
+    if (j->persistent_handle) {
+        /* The key type is read from the TPM on import */
+        return;
+    }
+
+    if (key_job_read_blob(j, j->pub_path, sizeof(TPM2B_PUBLIC), &j->pub_blob, &j->pub_sz)
+        || key_job_read_blob(j, j->priv_path, sizeof(TPM2B_PRIVATE), &j->priv_blob,
+                             &j->priv_sz)) {
+        return;
+    }
+
+    rc = Tss2_MU_TPM2B_PUBLIC_Unmarshal(j->pub_blob, j->pub_sz, &offset, &j->pub);
+    if (rc != TSS2_RC_SUCCESS) {
+        JOB_ERROR(j, "Tss2_MU_PUBLIC_Unmarshal has failed with: %s", Tss2_RC_Decode(rc));
+        return;
+    }
+
+    TPM2B_PRIVATE priv = { 0 };
+    offset = 0;
+    rc = Tss2_MU_TPM2B_PRIVATE_Unmarshal(j->priv_blob, j->priv_sz, &offset, &priv);
+    if (rc != TSS2_RC_SUCCESS) {
+        JOB_ERROR(j, "Tss2_MU_PRIVATE_Unmarshal has failed with: %s", Tss2_RC_Decode(rc));
+        return;
+    }
+}
+
+/* Builds the templates once the key type is known */
+static void
+key_job_templates(key_job *j) {
+
+    if (key_templates_build(&j->tmpl, j->label, j->auth, j->persistent_handle, j->pub_blob,
+                            j->pub_sz, j->priv_blob, j->priv_sz, &j->pub.publicArea)) {
+        JOB_ERROR(j, "Unsupported key type or curve");
+    }
+}
+
+static void *
+batch_worker(void *arg) {
+
+    batch *b = (batch *)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+        size_t i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+        if (i >= b->count) {
+            break;
+        }
+
+        key_job *j = &b->jobs[i];
+        key_job_prepare(j);
+        if (!j->error[0] && !j->persistent_handle) {
+            key_job_templates(j);
+        }
+
+        pthread_mutex_lock(&b->lock);
+        j->ready = true;
+        pthread_cond_broadcast(&b->cond);
+        pthread_mutex_unlock(&b->lock);
+    }
+
+    return NULL;
+}
+
+static void
+key_job_read_public(key_job *j, ESYS_CONTEXT *esys_ctx) {
+
+    ESYS_TR       esys_tr = ESYS_TR_NONE;
+    TPM2B_PUBLIC *key_public = NULL;
+
+    if (!esys_ctx) {
+        JOB_ERROR(j, "Importing a persistent handle needs --tcti");
+        return;
+    }
+
+    TSS2_RC rc = Esys_TR_FromTPMPublic(esys_ctx, j->persistent_handle, ESYS_TR_NONE,
+                                       ESYS_TR_NONE, ESYS_TR_NONE, &esys_tr);
+    if (rc != TSS2_RC_SUCCESS) {
+        JOB_ERROR(j, "Esys_TR_FromTPMPublic has failed with: %s", Tss2_RC_Decode(rc));
+        return;
+    }
+
+    rc = Esys_ReadPublic(esys_ctx, esys_tr, ESYS_TR_NONE, ESYS_TR_NONE, ESYS_TR_NONE,
+                         &key_public, NULL, NULL);
+    Esys_TR_Close(esys_ctx, &esys_tr);
+    if (rc != TSS2_RC_SUCCESS) {
+        JOB_ERROR(j, "Esys_ReadPublic has failed with: %s", Tss2_RC_Decode(rc));
+        return;
+    }
+
+    j->pub = *key_public;
+    free(key_public);
+
+    key_job_templates(j);
+}
+
+static int
+batch_import(const char *path, unsigned jobs, CK_SLOT_ID slot_id, CK_UTF8CHAR_PTR user_pin,
+             ESYS_CONTEXT *esys_ctx) {
+
+    int               ret = 1;
+    batch             b = { 0 };
+    pthread_t         threads[BATCH_MAX_JOBS];
+    unsigned          nthreads = 0;
+    size_t            imported = 0;
+    CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
+    struct stat       st;
+
+    if (stat(path, &st)) {
+        PRINT_E("Could not open \"%s\": %s", path, strerror(errno));
+        return 1;
+    }
+
+    if (S_ISDIR(st.st_mode) ? batch_from_dir(&b, path) : batch_from_manifest(&b, path)) {
+        goto out;
+    }
+
+    if (!b.count) {
+        PRINT_E("No keys to import found in \"%s\"", path);
+        goto out;
+    }
+
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.cond, NULL);
+
+    /* One library session and login for the whole batch */
+    if (c_initialize() || c_get_info() || c_get_slot(slot_id)
+        || c_open_session(slot_id, &session) || c_login(session, user_pin)) {
+        goto out_c;
+    }
+
+    if (jobs > b.count) {
+        jobs = b.count;
+    }
+
+    for (nthreads = 0; nthreads < jobs; nthreads++) {
+        if (pthread_create(&threads[nthreads], NULL, batch_worker, &b)) {
+            PRINT_E("pthread_create has failed");
+            break;
+        }
+    }
+
+    if (!nthreads) {
+        /* no workers, prepare each key here */
+        batch_worker(&b);
+    }
+
+    for (size_t i = 0; i < b.count; i++) {
+        key_job *j = &b.jobs[i];
+
+        pthread_mutex_lock(&b.lock);
+        while (!j->ready) {
+            pthread_cond_wait(&b.cond, &b.lock);
+        }
+        pthread_mutex_unlock(&b.lock);
+
+        if (!j->error[0] && j->persistent_handle) {
+            key_job_read_public(j, esys_ctx);
+        }
+
+        if (!j->error[0]) {
+            CK_OBJECT_HANDLE pubkey, privkey;
+            CK_RV rv = C_GenerateKeyPair(session, &j->tmpl.mech, j->tmpl.pub_attrs,
+                                         j->tmpl.pub_count, j->tmpl.priv_attrs,
+                                         j->tmpl.priv_count, &pubkey, &privkey);
+            if (rv != CKR_OK) {
+                JOB_ERROR(j, "C_GenerateKeyPair has failed: %s", ckr_to_string(rv));
+            }
+        }
+
+        if (j->error[0]) {
+            printf("%s: failed: %s\n", j->label, j->error);
+        } else {
+            printf("%s: imported\n", j->label);
+            imported++;
+        }
+        fflush(stdout);
+    }
+
+    printf("Imported %zu of %zu keys\n", imported, b.count);
+    ret = imported == b.count ? 0 : 1;
+
+out_c:
+    /* let the workers drain if the batch did not start */
+    pthread_mutex_lock(&b.lock);
+    b.next = b.count;
+    pthread_mutex_unlock(&b.lock);
+    for (unsigned t = 0; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    pthread_cond_destroy(&b.cond);
+    pthread_mutex_destroy(&b.lock);
+    c_close_session(session);
+    c_finalize();
+out:
+    for (size_t i = 0; i < b.count; i++) {
+        key_job_free(&b.jobs[i]);
+    }
+    free(b.jobs);
+    return ret;
+}
+
 int
 main(int argc, char **argv) {
 
@@ -392,40 +1001,33 @@ main(int argc, char **argv) {
     ESYS_TR            parent_esys_tr = 0;
     ESYS_TR            esys_tr = 0;
     TPM2B_DIGEST       parent_auth = { 0 };
-    unsigned long      tpm2_handle = 0;
     char              *pub_path = NULL;
     char              *priv_path = NULL;
     size_t             offset = 0;
+    const char        *batch_path = NULL;
+    long               jobs = sysconf(_SC_NPROCESSORS_ONLN);
 
     /* PKCS #11 variables */
 
     CK_UTF8CHAR_PTR key_label = NULL;
     CK_UTF8CHAR_PTR parent_auth_value = NULL;
     CK_UTF8CHAR_PTR auth_value = NULL;
-    CK_ULONG        pubkey_attrs_count = 0;
-    CK_ULONG        privkey_attrs_count = 0;
-    CK_MECHANISM    mech
-        = { .mechanism = CKR_MECHANISM_INVALID, .pParameter = NULL, .ulParameterLen = 0 };
-    CK_BBOOL          ck_true = CK_TRUE;
-    CK_ATTRIBUTE      pubkey_attrs[4] = { 0 };
-    CK_ATTRIBUTE      privkey_attrs[5] = { 0 };
-    int               pub_attrs_ind = 0;
-    int               priv_attrs_ind = 0;
+    key_templates     tmpl = { .mech = { .mechanism = CKR_MECHANISM_INVALID } };
     CK_SESSION_HANDLE session = CK_INVALID_HANDLE;
     CK_SLOT_ID        slot_id = 0;
     CK_UTF8CHAR_PTR   user_pin = NULL;
-    uint8_t          *cka_ec_params = NULL;
-    int               cka_ec_params_len = 0;
 
     /* getopt variables */
 
     int                  opt;
     int                  opt_index = 0;
-    const char          *short_opts = "A:a:C:c:hk:l:r:s:u:t:";
+    const char          *short_opts = "A:a:b:C:c:hj:k:l:r:s:u:t:";
     static struct option long_opts[]
         = { { "key-auth", required_argument, NULL, 'a' },
+            { "batch", required_argument, NULL, 'b' },
             { "persistent-handle", required_argument, NULL, 'c' },
             { "help", no_argument, NULL, 'h' },
+            { "jobs", required_argument, NULL, 'j' },
             { "user-pin", required_argument, NULL, 'k' },
             { "key-label", required_argument, NULL, 'l' },
             { "parent-persistent-handle", required_argument, NULL, 'C' },
@@ -454,6 +1056,10 @@ main(int argc, char **argv) {
             auth_value = (unsigned char *)optarg;
             break;
 
+        case 'b':
+            batch_path = optarg;
+            break;
+
         case 'C':
             if (strlen(optarg) != 10 || strncmp(optarg, "0x", 2)) {
                 PRINT_E("Invalid input format. Expecting an 8-character long"
@@ -500,6 +1106,10 @@ main(int argc, char **argv) {
             printf("  -A, --parent-auth               The authorization value of the\n");
             printf("                                  parent key.\n");
             printf("  -a, --key-auth                  The TPM key's authorization value.\n");
+            printf("  -b, --batch                     A directory or a manifest file listing\n");
+            printf("                                  the keys to import in one run.\n");
+            printf("                                  If this option is selected, do not\n");
+            printf("                                  specify -l, -c, -r, or -u.\n");
             printf("  -C, --parent-persistent-handle  The persistent handle of the parent key\n");
             printf("                                  to which the key objects are associated.\n");
             printf("  -c, --persistent-handle         The persistent handle of the TPM key\n");
@@ -507,6 +1117,9 @@ main(int argc, char **argv) {
             printf("                                  If this option is selected, do not\n");
             printf("                                  specify -r, -u, -C, or -A.\n");
             printf("  -h, --help                      Show this help message.\n");
+            printf("  -j, --jobs                      The number of threads preparing keys\n");
+            printf("                                  in batch mode (default is the number\n");
+            printf("                                  of online CPUs).\n");
             printf("  -k, --user-pin                  The PKCS#11 token user PIN.\n");
             printf("  -l, --key-label                 The PKCS#11 key label to assign to the\n");
             printf("                                  TPM key.\n");
@@ -527,6 +1140,14 @@ main(int argc, char **argv) {
             ret = 0;
             goto exit;
 
+        case 'j':
+            jobs = strtol(optarg, NULL, 10);
+            if (jobs < 1 || jobs > BATCH_MAX_JOBS) {
+                PRINT_E("The number of jobs must be in the range of 1 to %d", BATCH_MAX_JOBS);
+                goto exit;
+            }
+            break;
+
         case 'k':
             user_pin = (unsigned char *)optarg;
             break;
@@ -577,6 +1198,29 @@ main(int argc, char **argv) {
         }
     }
 
+    if (batch_path) {
+        if (!user_pin) {
+            PRINT_E("Missing inputs. Check the command usage by running: %s --help", argv[0]);
+            goto exit;
+        }
+
+        if (key_label || persistent_handle || pub_path || priv_path) {
+            PRINT_E("Ambiguous options detected. A batch cannot be used together with a single"
+                    " key. Check the command usage by running: %s --help",
+                    argv[0]);
+            goto exit;
+        }
+
+        if (jobs < 1) {
+            jobs = 1;
+        } else if (jobs > BATCH_MAX_JOBS) {
+            jobs = BATCH_MAX_JOBS;
+        }
+
+        ret = batch_import(batch_path, (unsigned)jobs, slot_id, user_pin, esys_ctx);
+        goto exit;
+    }
+
     if (!user_pin || !esys_ctx || !key_label) {
         PRINT_E("Missing inputs. Check the command usage by running: %s --help", argv[0]);
         goto exit;
@@ -589,25 +1233,8 @@ main(int argc, char **argv) {
         goto exit;
     }
 
-    ADD_ATTR(&pubkey_attrs[pub_attrs_ind++], CKA_ID, strlen((char *)key_label), key_label);
-    ADD_ATTR(&pubkey_attrs[pub_attrs_ind++], CKA_LABEL, strlen((char *)key_label), key_label);
-
-    ADD_ATTR(&privkey_attrs[priv_attrs_ind++], CKA_ID, strlen((char *)key_label), key_label);
-    ADD_ATTR(&privkey_attrs[priv_attrs_ind++], CKA_LABEL, strlen((char *)key_label), key_label);
-    ADD_ATTR(&privkey_attrs[priv_attrs_ind++], CKA_SENSITIVE, sizeof(ck_true), &ck_true);
-    if (auth_value) {
-        ADD_ATTR(&privkey_attrs[priv_attrs_ind++], CKA_TPM2_OBJAUTH, strlen((char *)auth_value),
-                 auth_value);
-    }
-
     if (persistent_handle) {
 
-        tpm2_handle = persistent_handle;
-        ADD_ATTR(&pubkey_attrs[pub_attrs_ind++], CKA_TPM2_PERSISTENT_HANDLE, sizeof(tpm2_handle),
-                 &tpm2_handle);
-        ADD_ATTR(&privkey_attrs[priv_attrs_ind++], CKA_TPM2_PERSISTENT_HANDLE, sizeof(tpm2_handle),
-                 &tpm2_handle);
-
         /* Create the ESYS_TR object from the persistent handle */
 
         tss2_rc = Esys_TR_FromTPMPublic(esys_ctx, persistent_handle, ESYS_TR_NONE, ESYS_TR_NONE,
@@ -696,9 +1323,6 @@ main(int argc, char **argv) {
             goto exit;
         }
 
-        ADD_ATTR(&pubkey_attrs[pub_attrs_ind++], CKA_TPM2_PUB_BLOB, pub_sz, pub_blob);
-        ADD_ATTR(&privkey_attrs[priv_attrs_ind++], CKA_TPM2_PRIV_BLOB, priv_sz, priv_blob);
-
     } else {
         PRINT_E("Missing inputs. Check the command usage by running: %s --help", argv[0]);
         goto exit;
@@ -713,39 +1337,18 @@ main(int argc, char **argv) {
         goto exit;
     }
 
-    switch (key_public->publicArea.type) {
-    case TPM2_ALG_RSA:
-        mech.mechanism = CKM_RSA_PKCS_KEY_PAIR_GEN;
-        break;
-    case TPM2_ALG_ECC:
-        mech.mechanism = CKM_EC_KEY_PAIR_GEN;
-        cka_ec_params_len = tpm2_ec_alg_to_asn1(key_public->publicArea.parameters.eccDetail.curveID,
-                                                &cka_ec_params);
-        if (!cka_ec_params_len || !cka_ec_params) {
-            goto exit;
-        }
-
-        ADD_ATTR(&pubkey_attrs[pub_attrs_ind++], CKA_EC_PARAMS, cka_ec_params_len, cka_ec_params);
-        break;
-    default:
-        PRINT_E("The given TPM key type is not supported.");
+    if (key_templates_build(&tmpl, (char *)key_label, (char *)auth_value, persistent_handle,
+                            pub_blob, pub_sz, priv_blob, priv_sz, &key_public->publicArea)) {
+        PRINT_E("Unsupported key type or curve");
         goto exit;
     }
 
-    /* Finalize the public and private key templates */
-
-    assert(pub_attrs_ind <= ARRAY_LEN(pubkey_attrs));
-    assert(priv_attrs_ind <= ARRAY_LEN(privkey_attrs));
-
-    pubkey_attrs_count = pub_attrs_ind;
-    privkey_attrs_count = priv_attrs_ind;
-
     /* Start the key import process */
 
     if (c_initialize() || c_get_info() || c_get_slot(slot_id) || c_open_session(slot_id, &session)
         || c_login(session, user_pin)
-        || c_generate_keypair(session, &mech, pubkey_attrs, pubkey_attrs_count, privkey_attrs,
-                              privkey_attrs_count)) {
+        || c_generate_keypair(session, &tmpl.mech, tmpl.pub_attrs, tmpl.pub_count,
+                              tmpl.priv_attrs, tmpl.priv_count)) {
         goto exit_c;
     }
 
@@ -757,7 +1360,7 @@ exit_c:
 exit:
     pub_f ? fclose(pub_f) : 0;
     priv_f ? fclose(priv_f) : 0;
-    free(cka_ec_params);
+    free(tmpl.ec_params);
     free(pub_blob);
     free(priv_blob);
     esys_ctx ? Esys_Finalize(&esys_ctx) : 0;
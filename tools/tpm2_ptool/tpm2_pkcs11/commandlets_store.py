@@ -1,6 +1,7 @@
 # SPDX-License-Identifier: BSD-2-Clause
 import argparse
 import os
+import stat
 import sys
 import traceback
 import yaml
@@ -10,6 +11,11 @@ from .command import Command
 from .command import commandlet
 
 from .db import Db
+from .snapshot import SNAPSHOT_NAME
+from .snapshot import compile_snapshot
+from .snapshot import store_stamp
+from .snapshot import wal_pending
+from .snapshot import write_snapshot
 from .utils import bytes_to_file
 from .utils import TemporaryDirectory
 from .utils import query_yes_no
@@ -229,3 +235,66 @@ class DbUp(Command):
             }
 
             print(yaml.safe_dump(y, default_flow_style=False))
+
+@commandlet("snapshot")
+class SnapshotCommand(Command):
+    '''
+    Compiles the objects of a store's tokens into a snapshot the library maps
+    '''
+
+    # adhere to an interface
+    # pylint: disable=no-self-use
+    def generate_options(self, group_parser):
+        group_parser.add_argument(
+            '--label',
+            action='append',
+            help='The label of a token to compile, may be given more than once. '
+            'Defaults to every token.\n')
+        group_parser.add_argument(
+            '--output',
+            type=os.path.expanduser,
+            help='The snapshot file, defaults to {} in the store directory.\n'.format(
+                SNAPSHOT_NAME))
+
+    def __call__(self, args):
+
+        path = args['path']
+        output = args['output'] or os.path.join(path, SNAPSHOT_NAME)
+
+        with Db(path) as db:
+            dbpath = db._path
+
+            # the stamp is of the store file, so it has to hold every commit
+            busy = db._conn.execute('PRAGMA wal_checkpoint(TRUNCATE)').fetchone()[0]
+            if busy:
+                sys.exit('The store is in use, try again')
+
+            stamp = store_stamp(dbpath)
+
+            if args['label']:
+                rows = [db.gettoken(label) for label in args['label']]
+            else:
+                rows = [t for p in db.getprimaries() for t in db.gettokens(p['id'])]
+
+            tokens = []
+            for t in rows:
+                objects = [(o['id'], o['attrs']) for o in db.getobjects(t['id'])]
+                tokens.append((t['id'], objects))
+
+            version = db.VERSION
+
+        # a snapshot must only ever match the objects it holds
+        if store_stamp(dbpath) != stamp or wal_pending(dbpath):
+            sys.exit('The store changed while compiling the snapshot, try again')
+
+        data = compile_snapshot(tokens, version, stamp)
+        mode = stat.S_IMODE(os.stat(dbpath).st_mode)
+        write_snapshot(output, data, mode)
+
+        y = {
+            'path': output,
+            'tokens': len(tokens),
+            'objects': sum(len(t[1]) for t in tokens),
+            'bytes': len(data),
+        }
+        print(yaml.safe_dump(y, default_flow_style=False))
@@ -22,7 +22,7 @@ from .pkcs11t import (
     CKM_ECDSA_SHA512
 )
 
-VERSION = 8
+VERSION = 9
 
 #
 # With Db() as db:
@@ -79,7 +79,7 @@ class Db(object):
         c = self._conn.cursor()
         c.execute("SELECT * from tobjects WHERE tokid=?", (tokid, ))
         x = c.fetchall()
-        return x
+        return self._withpatches(x)
 
     def rmtoken(self, label):
         # This works on the premise of a cascading delete tied by foreign
@@ -101,13 +101,32 @@ class Db(object):
         c = self._conn.cursor()
         c.execute("SELECT * from tobjects WHERE tokid=?", (tokid, ))
         x = c.fetchall()
-        return x
+        return self._withpatches(x)
 
     def getobject(self, tid):
         c = self._conn.cursor()
         c.execute("SELECT * from tobjects WHERE id=?", (tid, ))
         x = c.fetchone()
-        return x
+        return self._withpatches([x])[0] if x is not None else None
+
+    def _withpatches(self, tobjs):
+        # The library writes the attributes C_SetAttributeValue changes as
+        # patches until it folds them into the object, so apply them here.
+        # Rewriting the object with updatetertiary() drops them.
+        c = self._conn.cursor()
+        merged = []
+        for t in tobjs:
+            t = dict(t)
+            c.execute("SELECT attrs from tobject_patches WHERE tobjid=? ORDER BY id",
+                      (t['id'], ))
+            patches = c.fetchall()
+            if patches:
+                attrs = yaml.safe_load(t['attrs'])
+                for p in patches:
+                    attrs.update(yaml.safe_load(p['attrs']))
+                t['attrs'] = yaml.safe_dump(attrs, canonical=True)
+            merged.append(t)
+        return merged
 
     def getpid_by_tokid(self, tokid):
         c = self._conn.cursor()
@@ -561,6 +580,46 @@ class Db(object):
 
             Db._updatetertiary(dbbakcon, t['id'], attrs)
 
+    def _update_on_9(self, dbbakcon):
+        '''
+        Between version 8 and 9 of the DB the following changes need to be made:
+
+        Table tobject_patches:
+
+        New, holds the attributes C_SetAttributeValue changed until they are
+        folded into the tobjects row.
+        '''
+        sql = [
+            textwrap.dedent('''
+            CREATE TABLE tobject_patches(
+                id INTEGER PRIMARY KEY,
+                tobjid INTEGER NOT NULL,
+                attrs TEXT NOT NULL,
+                FOREIGN KEY (tobjid) REFERENCES tobjects(id) ON DELETE CASCADE
+            );
+            '''),
+            textwrap.dedent('''
+            CREATE INDEX tobject_patches_tobjid ON tobject_patches(tobjid);
+            '''),
+            textwrap.dedent('''
+                CREATE TRIGGER tobject_patches_fold
+                AFTER UPDATE OF attrs ON tobjects
+                BEGIN
+                    DELETE FROM tobject_patches WHERE tobjid=NEW.id;
+                END;
+            '''),
+            textwrap.dedent('''
+                CREATE TRIGGER tobject_patches_drop
+                AFTER DELETE ON tobjects
+                BEGIN
+                    DELETE FROM tobject_patches WHERE tobjid=OLD.id;
+                END;
+            '''),
+        ]
+
+        for s in sql:
+            dbbakcon.execute(s)
+
     def update_db(self, old_version, new_version=VERSION):
 
         # were doing the update, so make a backup to manipulate
@@ -657,6 +716,31 @@ class Db(object):
             );
             '''),
             textwrap.dedent('''
+            CREATE TABLE tobject_patches(
+                id INTEGER PRIMARY KEY,
+                tobjid INTEGER NOT NULL,
+                attrs TEXT NOT NULL,
+                FOREIGN KEY (tobjid) REFERENCES tobjects(id) ON DELETE CASCADE
+            );
+            '''),
+            textwrap.dedent('''
+            CREATE INDEX tobject_patches_tobjid ON tobject_patches(tobjid);
+            '''),
+            textwrap.dedent('''
+                CREATE TRIGGER tobject_patches_fold
+                AFTER UPDATE OF attrs ON tobjects
+                BEGIN
+                    DELETE FROM tobject_patches WHERE tobjid=NEW.id;
+                END;
+            '''),
+            textwrap.dedent('''
+                CREATE TRIGGER tobject_patches_drop
+                AFTER DELETE ON tobjects
+                BEGIN
+                    DELETE FROM tobject_patches WHERE tobjid=OLD.id;
+                END;
+            '''),
+            textwrap.dedent('''
             CREATE TABLE schema(
                 id INTEGER PRIMARY KEY,
                 schema_version INTEGER NOT NULL
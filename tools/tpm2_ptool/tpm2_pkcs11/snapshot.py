@@ -0,0 +1,161 @@
+# SPDX-License-Identifier: BSD-2-Clause
+import binascii
+import hashlib
+import os
+import struct
+import tempfile
+import yaml
+
+#
+# Writes the snapshot files the library maps in place of reading the
+# objects of a token from the store, see src/lib/snapshot.h for the format.
+# Keep this in sync with src/lib/snapshot.c.
+#
+MAGIC = b'TPM2SNAP'
+VERSION = 1
+ENDIAN = 0x01020304
+ULONG_SIZE = 8
+
+SNAPSHOT_NAME = 'tpm2_pkcs11.snapshot'
+
+HEADER = struct.Struct('<8s8I3Q3Q2I32s')
+TOKEN = struct.Struct('<4I')
+OBJECT = struct.Struct('<4IQ')
+ATTR = struct.Struct('<3Q')
+
+# where the digest sits in the header, it isn't hashed
+DIGEST_OFF = HEADER.size - 32
+
+# the typed memory type byte following each value
+TYPE_BYTE_INT = 1
+TYPE_BYTE_BOOL = 2
+TYPE_BYTE_INT_SEQ = 3
+TYPE_BYTE_HEX_STR = 4
+
+# the sqlite file header keeps a big endian change counter here
+SQLITE_CHANGE_COUNTER_OFF = 24
+
+
+def _align(n):
+    return (n + 7) & ~7
+
+
+def _encode_value(attr, value):
+    '''Returns the bytes and type byte the library keeps an attribute in.'''
+
+    # bool first, it is an int too
+    if isinstance(value, bool):
+        return (struct.pack('<B', 1 if value else 0), TYPE_BYTE_BOOL)
+    if isinstance(value, int):
+        return (struct.pack('<Q', value), TYPE_BYTE_INT)
+    if isinstance(value, str):
+        return (binascii.unhexlify(value), TYPE_BYTE_HEX_STR)
+    if isinstance(value, list):
+        return (struct.pack('<%dQ' % len(value), *value), TYPE_BYTE_INT_SEQ)
+
+    raise RuntimeError('Attribute 0x{:x} has a value of unknown type {}'.format(
+        attr, type(value).__name__))
+
+
+def store_stamp(dbpath):
+    '''Returns what ties a snapshot to the state of a store file.'''
+
+    st = os.stat(dbpath)
+    with open(dbpath, 'rb') as f:
+        f.seek(SQLITE_CHANGE_COUNTER_OFF)
+        counter = struct.unpack('>I', f.read(4))[0]
+
+    return (st.st_size, st.st_mtime_ns // 1000000000,
+            st.st_mtime_ns % 1000000000, counter)
+
+
+def wal_pending(dbpath):
+    '''Tells if a store in WAL mode has commits its file doesn't hold yet.'''
+
+    try:
+        return os.stat(dbpath + '-wal').st_size > 0
+    except FileNotFoundError:
+        return False
+
+
+def compile_snapshot(tokens, db_version, stamp):
+    '''Builds a snapshot.
+
+    Args:
+        tokens ([(int, [(int, str)])]): The token ids with the id and the
+            attribute YAML of each of their objects.
+        db_version (int): The schema version of the store.
+        stamp ((int, int, int, int)): The store_stamp() the objects were
+            read at.
+
+    Returns:
+        The snapshot as bytes.
+    '''
+
+    tokens = sorted(tokens, key=lambda t: t[0])
+    objects = [(tokid, oid, attrs)
+               for tokid, objs in tokens
+               for oid, attrs in sorted(objs, key=lambda o: o[0])]
+
+    tokens_off = HEADER.size
+    objects_off = tokens_off + TOKEN.size * len(tokens)
+    data_off = objects_off + OBJECT.size * len(objects)
+
+    buf = bytearray(data_off)
+
+    first = 0
+    for i, (tokid, objs) in enumerate(tokens):
+        TOKEN.pack_into(buf, tokens_off + i * TOKEN.size,
+                        tokid, len(objs), first, 0)
+        first += len(objs)
+
+    for i, (tokid, oid, yattrs) in enumerate(objects):
+        attrs = list(yaml.safe_load(yattrs).items())
+
+        attrs_off = len(buf)
+        buf.extend(bytes(ATTR.size * len(attrs)))
+
+        for j, (attr, value) in enumerate(attrs):
+            data, type_byte = _encode_value(attr, value)
+
+            value_off = 0
+            if data:
+                value_off = len(buf)
+                buf.extend(data)
+                buf.append(type_byte)
+                buf.extend(bytes(_align(len(buf)) - len(buf)))
+
+            ATTR.pack_into(buf, attrs_off + j * ATTR.size,
+                           attr, len(data), value_off)
+
+        OBJECT.pack_into(buf, objects_off + i * OBJECT.size,
+                         oid, tokid, len(attrs), 0, attrs_off)
+
+    size, mtime_s, mtime_ns, counter = stamp
+
+    HEADER.pack_into(buf, 0, MAGIC, VERSION, HEADER.size, ENDIAN, ULONG_SIZE,
+                     db_version, len(tokens), len(objects), 0,
+                     tokens_off, objects_off, len(buf),
+                     size, mtime_s, mtime_ns, counter, 0, bytes(32))
+
+    digest = hashlib.sha256(bytes(buf[:DIGEST_OFF]) + bytes(buf[HEADER.size:]))
+    buf[DIGEST_OFF:HEADER.size] = digest.digest()
+
+    return bytes(buf)
+
+
+def write_snapshot(path, data, mode):
+    '''Replaces a snapshot, processes that mapped the old one keep it.'''
+
+    d = os.path.dirname(os.path.abspath(path))
+    fd, tmp = tempfile.mkstemp(prefix='.snapshot-', dir=d)
+    try:
+        with os.fdopen(fd, 'wb') as f:
+            f.write(data)
+            f.flush()
+            os.fsync(f.fileno())
+        os.chmod(tmp, mode)
+        os.replace(tmp, path)
+    except Exception:
+        os.unlink(tmp)
+        raise
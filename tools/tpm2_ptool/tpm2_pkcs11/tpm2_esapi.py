@@ -0,0 +1,676 @@
+# SPDX-License-Identifier: BSD-2-Clause
+import atexit
+import contextlib
+import hashlib
+import os
+import struct
+import uuid
+from collections import OrderedDict
+from tempfile import mkstemp
+
+import yaml
+
+from cryptography.hazmat.primitives import serialization
+from cryptography.hazmat.primitives.asymmetric.ec import EllipticCurvePrivateKey
+from cryptography.hazmat.primitives.asymmetric.rsa import RSAPrivateKey
+from cryptography.hazmat.primitives.asymmetric.utils import encode_dss_signature
+
+try:
+    from tpm2_pytss import ESAPI
+    from tpm2_pytss.constants import (
+        ESYS_TR,
+        TPM2_ALG,
+        TPM2_CAP,
+        TPM2_RH,
+        TPM2_ST,
+        TPMA_OBJECT,
+    )
+    from tpm2_pytss.types import (
+        TPM2B_AUTH,
+        TPM2B_DIGEST,
+        TPM2B_IV,
+        TPM2B_MAX_BUFFER,
+        TPM2B_PRIVATE,
+        TPM2B_PUBLIC,
+        TPM2B_SENSITIVE,
+        TPM2B_SENSITIVE_CREATE,
+        TPM2B_SENSITIVE_DATA,
+        TPMS_SENSITIVE_CREATE,
+        TPMT_KEYEDHASH_SCHEME,
+        TPMT_PUBLIC,
+        TPMT_SIG_SCHEME,
+        TPMT_SYM_DEF_OBJECT,
+        TPMT_TK_HASHCHECK,
+    )
+    from tpm2_pytss.utils import wrap
+    _HAVE_PYTSS = True
+except ImportError:
+    _HAVE_PYTSS = False
+
+from .tpm2 import Tpm2
+from .utils import str2bytes
+
+#
+# The names tpm2-tools uses for TPM values, so the YAML handed to the callers
+# reads the same as the output of the tools.
+#
+_ATTRS = OrderedDict([
+    ('fixedtpm', 0x2),
+    ('stclear', 0x4),
+    ('fixedparent', 0x10),
+    ('sensitivedataorigin', 0x20),
+    ('userwithauth', 0x40),
+    ('adminwithpolicy', 0x80),
+    ('noda', 0x400),
+    ('encryptedduplication', 0x800),
+    ('restricted', 0x10000),
+    ('decrypt', 0x20000),
+    ('sign', 0x40000),
+])
+
+_ALGS = {
+    0x1: 'rsa', 0x3: 'tdes', 0x4: 'sha1', 0x5: 'hmac', 0x6: 'aes', 0x7: 'mgf1',
+    0x8: 'keyedhash', 0xa: 'xor', 0xb: 'sha256', 0xc: 'sha384', 0xd: 'sha512',
+    0x10: 'null', 0x12: 'sm3_256', 0x13: 'sm4', 0x14: 'rsassa', 0x15: 'rsaes',
+    0x16: 'rsapss', 0x17: 'oaep', 0x18: 'ecdsa', 0x19: 'ecdh', 0x1a: 'ecdaa',
+    0x1b: 'sm2', 0x1c: 'ecschnorr', 0x1d: 'ecmqv', 0x20: 'kdf1_sp800_56a',
+    0x21: 'kdf2', 0x22: 'kdf1_sp800_108', 0x23: 'ecc', 0x25: 'symcipher',
+    0x26: 'camellia', 0x27: 'sha3_256', 0x28: 'sha3_384', 0x29: 'sha3_512',
+    0x3f: 'cmac', 0x40: 'ctr', 0x41: 'ofb', 0x42: 'cbc', 0x43: 'cfb',
+    0x44: 'ecb',
+}
+
+_ALG_IDS = {v: k for k, v in _ALGS.items()}
+
+_CURVES = {
+    0x1: 'NIST p192', 0x2: 'NIST p224', 0x3: 'NIST p256', 0x4: 'NIST p384',
+    0x5: 'NIST p521', 0x10: 'BN P256', 0x11: 'BN P638', 0x20: 'SM2 P256',
+}
+
+# tpm2_createprimary and tpm2_create defaults
+_PRIMARY_ATTRS = 'restricted|decrypt|fixedtpm|fixedparent|sensitivedataorigin|userwithauth'
+_CREATE_ATTRS = 'fixedtpm|fixedparent|sensitivedataorigin|userwithauth|decrypt|sign'
+_IMPORT_ATTRS = 'userwithauth|decrypt|sign'
+
+_TPM2_HT_PERSISTENT = 0x81
+
+
+def _attrs(attrs):
+    value = 0
+    for a in attrs.split('|'):
+        a = a.strip().lower()
+        if a not in _ATTRS:
+            raise RuntimeError('Unknown object attribute: "{}"'.format(a))
+        value |= _ATTRS[a]
+    return value
+
+
+def _alg_id(name):
+    if name not in _ALG_IDS:
+        raise RuntimeError('Unknown algorithm: "{}"'.format(name))
+    return _ALG_IDS[name]
+
+
+def _auth(auth):
+    # tpm2-tools auth values are strings unless prefixed with hex:
+    if auth is None:
+        return b''
+    if isinstance(auth, bytes):
+        return auth
+    if auth.startswith('hex:'):
+        return bytes.fromhex(auth[4:])
+    if auth.startswith('str:'):
+        return auth[4:].encode()
+    return auth.encode()
+
+
+def _read(blob):
+    if isinstance(blob, str):
+        with open(blob, 'rb') as f:
+            return f.read()
+    return blob
+
+
+def _value(v, names):
+    v = int(v)
+    return {
+        'value' : names.get(v, '0x{:x}'.format(v)),
+        'raw'   : v
+    }
+
+
+def _public_yaml(public):
+    """The public area as printed by tpm2_create, tpm2_import and
+    tpm2_readpublic, reduced to the fields the tool reads."""
+
+    p = public.publicArea
+    attrs = int(p.objectAttributes)
+    y = OrderedDict()
+    y['name-alg'] = _value(p.nameAlg, _ALGS)
+    y['attributes'] = {
+        'value' : '|'.join(n for n, bit in _ATTRS.items() if attrs & bit),
+        'raw'   : attrs
+    }
+    y['type'] = _value(p.type, _ALGS)
+
+    if p.type == TPM2_ALG.RSA:
+        d = p.parameters.rsaDetail
+        y['exponent'] = int(d.exponent)
+        y['bits'] = int(d.keyBits)
+        if d.scheme.scheme != TPM2_ALG.NULL:
+            y['scheme'] = _value(d.scheme.scheme, _ALGS)
+        y['rsa'] = bytes(p.unique.rsa).hex()
+    elif p.type == TPM2_ALG.ECC:
+        d = p.parameters.eccDetail
+        y['curve-id'] = _value(d.curveID, _CURVES)
+        if d.scheme.scheme != TPM2_ALG.NULL:
+            y['scheme'] = _value(d.scheme.scheme, _ALGS)
+        y['x'] = bytes(p.unique.ecc.x).hex()
+        y['y'] = bytes(p.unique.ecc.y).hex()
+    elif p.type == TPM2_ALG.SYMCIPHER:
+        d = p.parameters.symDetail.sym
+        y['sym-alg'] = _value(d.algorithm, _ALGS)
+        y['sym-mode'] = _value(d.mode.sym, _ALGS)
+        y['sym-keybits'] = int(d.keyBits.sym)
+    elif p.type == TPM2_ALG.KEYEDHASH:
+        s = p.parameters.keyedHashDetail.scheme
+        y['algorithm'] = _value(s.scheme, _ALGS)
+        if s.scheme == TPM2_ALG.HMAC:
+            y['hash-alg'] = _value(s.details.hmac.hashAlg, _ALGS)
+
+    # plain dicts, so safe_dump takes them
+    return yaml.safe_dump(dict(y), default_flow_style=False,
+                          sort_keys=False).encode()
+
+
+def _keyedhash_scheme(alg):
+    # "hmac" and "hmac:<hash>" are HMAC keys, "keyedhash" has no scheme
+    scheme = TPMT_KEYEDHASH_SCHEME(scheme=TPM2_ALG.NULL)
+    if alg.startswith('hmac'):
+        halg = alg.split(':')[1] if ':' in alg else 'sha256'
+        scheme.scheme = TPM2_ALG.HMAC
+        scheme.details.hmac.hashAlg = _alg_id(halg)
+    return scheme
+
+
+def _template(alg, attrs, primary=False):
+
+    if alg.startswith('hmac') or alg == 'keyedhash':
+        pub = TPMT_PUBLIC(type=TPM2_ALG.KEYEDHASH, nameAlg=TPM2_ALG.SHA256,
+                          objectAttributes=TPMA_OBJECT(attrs))
+        pub.parameters.keyedHashDetail.scheme = _keyedhash_scheme(alg)
+        return TPM2B_PUBLIC(publicArea=pub)
+
+    if primary and ':' not in alg:
+        # restricted decryption keys need a symmetric algorithm
+        alg = {'rsa': 'rsa2048', 'ecc': 'ecc256'}.get(alg, alg) + ':null:aes128cfb'
+
+    return TPM2B_PUBLIC.parse(alg, objectAttributes=TPMA_OBJECT(attrs),
+                              nameAlg='sha256')
+
+
+class _Esys(object):
+    '''
+    The ESAPI context of the command, shared by every Tpm2Esapi so the
+    connection and the loaded objects outlive the TemporaryDirectory scopes
+    the commandlets create them in.
+
+    Transient objects are kept as recipes to load or create them again.
+    When more than MAX_LOADED are in the TPM the least recently used one is
+    flushed and it is loaded again the next time it is used, which keeps a
+    resource manager with three object slots per connection happy.
+    '''
+
+    MAX_LOADED = 3
+
+    _instance = None
+    _error = None
+
+    def __init__(self, ectx):
+        self.ectx = ectx
+        # handle file path -> object id
+        self._paths = {}
+        # object id -> recipe
+        self._recipes = {}
+        # what was created or loaded -> object id
+        self._idents = {}
+        # object id -> ESYS_TR, least recently used first
+        self._loaded = OrderedDict()
+        # serialized ESYS_TR or persistent handle -> ESYS_TR
+        self._trs = {}
+
+    @classmethod
+    def get(cls):
+        if cls._instance is None:
+            if cls._error is not None:
+                raise cls._error
+            try:
+                ectx = ESAPI(os.getenv('TPM2TOOLS_TCTI', None))
+            except Exception as e:
+                cls._error = e
+                raise
+            cls._instance = cls(ectx)
+            atexit.register(cls._instance.close)
+        return cls._instance
+
+    @classmethod
+    def opened(cls):
+        return cls._instance
+
+    def close(self):
+        for tr in self._loaded.values():
+            try:
+                self.ectx.flush_context(tr)
+            except Exception:
+                pass
+        self._loaded.clear()
+        self.ectx.close()
+        _Esys._instance = None
+
+    def _make_room(self, keep):
+        while len(self._loaded) >= self.MAX_LOADED:
+            victim = next((k for k in self._loaded if k not in keep), None)
+            if victim is None:
+                break
+            self.ectx.flush_context(self._loaded.pop(victim))
+
+    def _load(self, oid, keep=()):
+        tr = self._loaded.get(oid)
+        if tr is None:
+            keep = keep + (oid,)
+            tr = self._recipes[oid](keep)
+            self._loaded[oid] = tr
+        self._loaded.move_to_end(oid)
+        return tr
+
+    def transient(self, ident, recipe, path):
+        '''
+        Returns the handle file at path for the object that recipe loads,
+        loading it unless the same ident was loaded before. The file holds
+        the serialized ESYS_TR, like a tpm2-tools context file names the
+        object.
+        '''
+        oid = self._idents.get(ident)
+        if oid is None:
+            oid = uuid.uuid4().hex
+            self._recipes[oid] = recipe
+            try:
+                self._load(oid)
+            except Exception:
+                del self._recipes[oid]
+                raise
+            self._idents[ident] = oid
+
+        tr = self._load(oid)
+        with open(path, 'wb') as f:
+            f.write(self.ectx.tr_serialize(tr))
+        self._paths[path] = oid
+        return path
+
+    def resolve(self, handle, keep=()):
+        '''Returns the ESYS_TR of a handle as taken by the tpm2-tools -c options.'''
+
+        if isinstance(handle, int):
+            return self._persistent(handle)
+
+        handle = str(handle)
+        oid = self._paths.get(handle)
+        if oid is not None:
+            return self._load(oid, keep)
+
+        if handle.startswith('0x'):
+            return self._persistent(int(handle, 16))
+
+        with open(handle, 'rb') as f:
+            data = f.read()
+        tr = self._trs.get(data)
+        if tr is None:
+            tr = self.ectx.tr_deserialize(data)
+            self._trs[data] = tr
+        return tr
+
+    def _ident(self, handle):
+        # the same parent, whatever temporary file names it
+        oid = self._paths.get(str(handle))
+        if oid is not None:
+            return oid
+        if isinstance(handle, str) and os.path.isfile(handle):
+            return _read(handle)
+        return str(handle)
+
+    def forget(self, tr):
+        self._trs = {k: v for k, v in self._trs.items() if v != tr}
+
+    def _persistent(self, handle):
+        tr = self._trs.get(handle)
+        if tr is None:
+            tr = self.ectx.tr_from_tpmpublic(handle)
+            self._trs[handle] = tr
+        return tr
+
+    def load(self, parent, pauth, priv, pub, path):
+
+        def recipe(keep):
+            if priv is None:
+                self._make_room(keep)
+                return self.ectx.load_external(in_public=pub)
+
+            ptr = self.resolve(parent, keep)
+            self._make_room(keep + (self._paths.get(str(parent)),))
+            self.ectx.tr_set_auth(ptr, _auth(pauth))
+            return self.ectx.load(ptr, priv, pub)
+
+        ident = ('load', self._ident(parent), pauth, priv.marshal() if priv is not None else None,
+                 pub.marshal())
+        return self.transient(ident, recipe, path)
+
+    def createprimary(self, hierarchyauth, objauth, public, path):
+
+        sensitive = TPM2B_SENSITIVE_CREATE(
+            sensitive=TPMS_SENSITIVE_CREATE(userAuth=TPM2B_AUTH(_auth(objauth))))
+
+        def recipe(keep):
+            self._make_room(keep)
+            self.ectx.tr_set_auth(ESYS_TR.OWNER, _auth(hierarchyauth))
+            tr, _, _, _, _ = self.ectx.create_primary(
+                in_sensitive=sensitive, in_public=public,
+                primary_handle=ESYS_TR.OWNER)
+            return tr
+
+        ident = ('primary', hierarchyauth, objauth, public.marshal())
+        return self.transient(ident, recipe, path)
+
+    def getcap(self, cap, prop):
+        '''Every value of a capability, starting at prop.'''
+
+        values = []
+        more = True
+        while more:
+            more, data = self.ectx.get_capability(cap, prop, 0xFF)
+            if cap == TPM2_CAP.ALGS:
+                got = [int(a.alg) for a in data.data.algorithms]
+            else:
+                got = [int(h) for h in data.data.handles]
+            if len(got) == 0:
+                break
+            values.extend(got)
+            prop = got[-1] + 1
+        return values
+
+
+@contextlib.contextmanager
+def esapi_context():
+    '''
+    Yields the ESAPI context of the command when the in-process backend
+    opened one, otherwise a new one closed on leaving. Some TCTIs, like the
+    device TCTI without a resource manager, allow only one connection.
+    '''
+    esys = _Esys.opened()
+    if esys is not None:
+        yield esys.ectx
+        return
+
+    with ESAPI(os.getenv('TPM2TOOLS_TCTI', None)) as e:
+        yield e
+
+
+class Tpm2Esapi(Tpm2):
+    '''
+    Runs the TPM commands of Tpm2 in process through tpm2-pytss instead of
+    one tpm2-tools process each. It keeps the contract of Tpm2: handles are
+    files in the temporary directory, private and public portions are
+    written in the tpm2-tools format and the YAML output reads like the
+    tools' output.
+    '''
+
+    @staticmethod
+    def available():
+        if not _HAVE_PYTSS:
+            return False
+        try:
+            _Esys.get()
+        except Exception:
+            return False
+        return True
+
+    def __init__(self, tmp):
+        super(Tpm2Esapi, self).__init__(tmp)
+        self._esys = _Esys.get()
+        self._ectx = self._esys.ectx
+
+    def _handle_path(self, suffix='.out'):
+        return os.path.join(self._tmp, uuid.uuid4().hex + suffix)
+
+    def _save(self, suffix, blob):
+        fd, path = mkstemp(prefix='', suffix=suffix, dir=self._tmp)
+        try:
+            os.write(fd, blob.marshal())
+        finally:
+            os.close(fd)
+        return path
+
+    def createprimary(self, hierarchyauth=None, objauth=None, alg=None, attrs=None,):
+
+        public = _template(alg if alg is not None else 'rsa',
+                           _attrs(attrs if attrs is not None else _PRIMARY_ATTRS),
+                           primary=True)
+
+        return self._esys.createprimary(hierarchyauth, objauth, public,
+                                        self._handle_path())
+
+    def evictcontrol(self, hierarchyauth, ctx, handle=None):
+
+        tr_file = os.path.join(self._tmp, "primary.handle")
+
+        tr = self._esys.resolve(ctx)
+        tpm_handle = struct.unpack('>I', self._ectx.tr_serialize(tr)[0:4])[0]
+
+        self._ectx.tr_set_auth(ESYS_TR.OWNER, _auth(hierarchyauth))
+
+        # Like tpm2_evictcontrol, a persistent object is evicted
+        if tpm_handle >> Tpm2.TPM2_HR_SHIFT == _TPM2_HT_PERSISTENT:
+            self._ectx.evict_control(ESYS_TR.OWNER, tr, tpm_handle)
+            self._esys.forget(tr)
+            return tr_file
+
+        if handle is None:
+            taken = set(self._esys.getcap(TPM2_CAP.HANDLES, 0x81000000))
+            handle = next(h for h in range(0x81000000, 0x82000000)
+                          if h not in taken)
+        elif isinstance(handle, str):
+            handle = int(handle, 0)
+
+        newtr = self._ectx.evict_control(ESYS_TR.OWNER, tr, handle)
+        with open(tr_file, 'wb') as f:
+            f.write(self._ectx.tr_serialize(newtr))
+
+        return tr_file
+
+    def readpublic(self, handle, get_tr_file=True):
+
+        tr_file = os.path.join(self._tmp, "primary.handle")
+
+        tr = self._esys.resolve(handle)
+        public, _, _ = self._ectx.read_public(tr)
+
+        if get_tr_file:
+            with open(tr_file, 'wb') as f:
+                f.write(self._ectx.tr_serialize(tr))
+
+        return (_public_yaml(public), tr_file if get_tr_file else None)
+
+    def load(self, pctx, pauth, priv, pub):
+
+        pub = TPM2B_PUBLIC.unmarshal(_read(pub))[0]
+        if priv is not None:
+            priv = TPM2B_PRIVATE.unmarshal(_read(priv))[0]
+
+        try:
+            return self._esys.load(pctx, pauth, priv, pub, self._handle_path())
+        except Exception as e:
+            raise RuntimeError("Could not load: %s" % e)
+
+    def unseal(self, ctx, auth):
+
+        tr = self._esys.resolve(ctx)
+        self._ectx.tr_set_auth(tr, _auth(auth))
+        return bytes(self._ectx.unseal(tr))
+
+    def _encryptdecrypt(self, ctx, auth, data, decrypt=False):
+
+        tr = self._esys.resolve(ctx)
+        self._ectx.tr_set_auth(tr, _auth(auth))
+
+        # Like tpm2_encryptdecrypt: the key's mode, a zero IV and the data
+        # in chunks of TPM2B_MAX_BUFFER
+        iv = TPM2B_IV(b'\0' * 16)
+        out = b''
+        for i in range(0, len(data), 1024):
+            chunk, iv = self._ectx.encrypt_decrypt_2(
+                tr, TPM2B_MAX_BUFFER(data[i:i + 1024]), decrypt,
+                TPM2_ALG.NULL, iv)
+            out += bytes(chunk)
+        return out
+
+    def create(self,
+               phandle,
+               pauth=None,
+               objauth=None,
+               objattrs=None,
+               seal=None,
+               alg=None):
+
+        if seal is not None:
+            alg = 'keyedhash'
+            # tpm2_create clears these for sealing objects
+            default = 'fixedtpm|fixedparent|userwithauth'
+        elif alg is None:
+            alg = 'rsa2048'
+            default = _CREATE_ATTRS
+        elif alg.startswith('hmac'):
+            default = 'fixedtpm|fixedparent|sensitivedataorigin|userwithauth|sign'
+        else:
+            default = _CREATE_ATTRS
+
+        public = _template(alg, _attrs(objattrs if objattrs is not None else default))
+
+        sensitive = TPMS_SENSITIVE_CREATE(userAuth=TPM2B_AUTH(_auth(objauth)))
+        if seal is not None:
+            sensitive.data = TPM2B_SENSITIVE_DATA(str2bytes(seal))
+
+        parent = self._esys.resolve(phandle)
+        self._ectx.tr_set_auth(parent, _auth(pauth))
+        try:
+            priv, pub, _, _, _ = self._ectx.create(
+                parent, TPM2B_SENSITIVE_CREATE(sensitive=sensitive), public)
+        except Exception as e:
+            raise RuntimeError("Could not create: %s" % e)
+
+        return self._save('.priv', priv), self._save('.pub', pub), _public_yaml(pub)
+
+    def getcap(self, cap):
+
+        if cap == 'algorithms':
+            algs = self._esys.getcap(TPM2_CAP.ALGS, 0)
+            y = {_ALGS.get(a, '0x{:x}'.format(a)): {'value': a} for a in algs}
+        elif cap == 'handles-persistent':
+            y = self._esys.getcap(TPM2_CAP.HANDLES, 0x81000000)
+        else:
+            return super(Tpm2Esapi, self).getcap(cap)
+
+        return yaml.safe_dump(y, default_flow_style=False).encode()
+
+    def importkey(self,
+                  phandle,
+                  pauth,
+                  objauth,
+                  privkey,
+                  objattrs=None,
+                  seal=None,
+                  alg=None,
+                  passin=None):
+
+        if privkey is None or len(privkey) == 0 or not os.path.isfile(privkey):
+            raise RuntimeError("File '%s' path is invalid or is missing" %
+                               privkey)
+
+        if alg is not None and (alg.startswith('hmac') or alg == 'keyedhash'):
+            with open(privkey, 'rb') as f:
+                secret = f.read()
+            default = _IMPORT_ATTRS if alg == 'keyedhash' else 'userwithauth|sign'
+            attrs = TPMA_OBJECT(_attrs(objattrs if objattrs is not None else default))
+            sensitive, public = TPM2B_SENSITIVE.keyedhash_from_secret(
+                secret, nameAlg=TPM2_ALG.SHA256, objectAttributes=attrs,
+                scheme=_keyedhash_scheme(alg))
+        else:
+            data, alg, _ = self._read_privkey(privkey, alg, passin)
+            key = serialization.load_pem_private_key(
+                data, password=self._passin_bytes(passin))
+
+            expected = RSAPrivateKey if alg == 'rsa' else EllipticCurvePrivateKey
+            if not isinstance(key, expected):
+                raise RuntimeError("Key '%s' is not of algorithm %s" %
+                                   (privkey, alg))
+
+            pem = key.private_bytes(
+                encoding=serialization.Encoding.PEM,
+                format=serialization.PrivateFormat.PKCS8,
+                encryption_algorithm=serialization.NoEncryption())
+            attrs = TPMA_OBJECT(_attrs(objattrs if objattrs is not None else _IMPORT_ATTRS))
+            sensitive = TPM2B_SENSITIVE.from_pem(pem)
+            public = TPM2B_PUBLIC.from_pem(pem, nameAlg=TPM2_ALG.SHA256,
+                                           objectAttributes=attrs)
+
+        sensitive.sensitiveArea.authValue = TPM2B_AUTH(_auth(objauth))
+
+        parent = self._esys.resolve(phandle)
+        self._ectx.tr_set_auth(parent, _auth(pauth))
+        try:
+            ppublic, _, _ = self._ectx.read_public(parent)
+            enckey, duplicate, seed = wrap(ppublic.publicArea, public, sensitive)
+            priv = self._ectx.import_(parent, enckey, public, duplicate, seed,
+                                      TPMT_SYM_DEF_OBJECT(algorithm=TPM2_ALG.NULL))
+        except Exception as e:
+            raise RuntimeError("Could not import: %s" % e)
+
+        return self._save('.priv', priv), self._save('.pub', public), _public_yaml(public)
+
+    def changeauth(self, pctx, objctx, oldobjauth, newobjauth):
+
+        parent = self._esys.resolve(pctx)
+        tr = self._esys.resolve(objctx)
+        self._ectx.tr_set_auth(tr, _auth(oldobjauth))
+        try:
+            priv = self._ectx.object_change_auth(tr, parent,
+                                                 TPM2B_AUTH(_auth(newobjauth)))
+        except Exception as e:
+            raise RuntimeError("Could not change auth: %s" % e)
+
+        newpriv = self._handle_path('.priv')
+        with open(newpriv, 'wb') as f:
+            f.write(priv.marshal())
+        return newpriv
+
+    def sign(self, ctx, halg, scheme, message):
+
+        tr = self._esys.resolve(ctx)
+
+        # An unrestricted key signs a digest computed here without a ticket
+        digest = hashlib.new(halg, str2bytes(message)).digest()
+        inscheme = TPMT_SIG_SCHEME(scheme=_alg_id(scheme))
+        inscheme.details.any.hashAlg = _alg_id(halg)
+        validation = TPMT_TK_HASHCHECK(tag=TPM2_ST.HASHCHECK,
+                                       hierarchy=TPM2_RH.NULL)
+
+        sig = self._ectx.sign(tr, TPM2B_DIGEST(digest), inscheme, validation)
+
+        # the "plain" format of tpm2_sign
+        if sig.sigAlg == TPM2_ALG.RSAPSS:
+            return bytes(sig.signature.rsapss.sig)
+        if sig.sigAlg == TPM2_ALG.RSASSA:
+            return bytes(sig.signature.rsassa.sig)
+        if sig.sigAlg == TPM2_ALG.ECDSA:
+            r = int.from_bytes(bytes(sig.signature.ecdsa.signatureR), 'big')
+            s = int.from_bytes(bytes(sig.signature.ecdsa.signatureS), 'big')
+            return encode_dss_signature(r, s)
+        raise RuntimeError("Cannot handle signature scheme: %s" % scheme)
@@ -5,6 +5,7 @@ from .command import commandlet
 # Store level commands
 from .commandlets_store import InitCommand  # pylint: disable=unused-import # noqa
 from .commandlets_store import DestroyCommand  # pylint: disable=unused-import # noqa
+from .commandlets_store import SnapshotCommand  # pylint: disable=unused-import # noqa
 
 # Token Level Commands
 from .commandlets_token import AddTokenCommand  # pylint: disable=unused-import # noqa
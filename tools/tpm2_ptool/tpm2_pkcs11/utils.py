@@ -18,7 +18,6 @@ from cryptography.hazmat.primitives import hashes
 from pyasn1_modules import pem, rfc2459
 from pyasn1.codec.der import decoder as derdecoder, encoder as derencoder
 
-from tpm2_pytss.ESAPI import ESAPI
 from tpm2_pytss.tsskey import TSSPrivKey
 from tpm2_pytss.constants import (
     TPM2_RH,
@@ -533,7 +532,9 @@ def dump_tsspem(db, obj, pin, is_sopin, output_prefix):
     
     objauth, pobj_handle = getauth(db, obj, pin, is_sopin, attrs)    
 
-    with ESAPI(os.getenv('TPM2TOOLS_TCTI', None)) as e:
+    from .tpm2_esapi import esapi_context
+
+    with esapi_context() as e:
         tr_handle = ESYS_TR.deserialize(e, pobj_handle)
         
         tpm_handle = e.tr_get_tpm_handle(tr_handle)